@@ -1,9 +1,11 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <Windows.h>
 #include <tchar.h>
 #include <initguid.h>
 #include "../EVhdParser/Control.h"
 #include <virtdisk.h>
+#include "manifest.h"
 
 UCHAR rgbTest256KeyPart1[32] = {
     0x27, 0x18, 0x28, 0x18, 0x28, 0x45, 0x90, 0x45, 0x23, 0x53, 0x60, 0x28, 0x74, 0x71, 0x35, 0x26,
@@ -136,6 +138,574 @@ static DWORD GetVhdId(LPTSTR lpszVhdPath, GUID *lpDiskId)
 void PrintUsage()
 {
 	printf("Usage: EVhdConfig <path to vhd>\n");
+	printf("       EVhdConfig -import <manifest> [batch size]\n");
+	printf("       EVhdConfig -flight <output file>\n");
+	printf("       EVhdConfig -stats\n");
+	printf("       EVhdConfig -stages\n");
+	printf("       EVhdConfig -control\n");
+	printf("       EVhdConfig -inflight\n");
+	printf("       EVhdConfig -heatmap <disk tag> <output file> [-reset]\n");
+}
+
+static int SubmitCipherBatch(void *pContext, EVHD_SET_CIPHER_BATCH_REQUEST *pBatch, unsigned long Size)
+{
+	DWORD dwError = SyncrhonousDeviceIoControl((HANDLE)pContext, IOCTL_VIRTUAL_DISK_SET_CIPHER_BATCH,
+		pBatch, Size, NULL, 0, NULL);
+	if (ERROR_SUCCESS != dwError)
+		PrintError(dwError, "Failed to set device ciphers");
+	return (int)dwError;
+}
+
+/** Applies the cipher configurations of a manifest without opening the disks */
+static int ImportManifest(const TCHAR *lpszManifest, ULONG32 BatchSize)
+{
+	int Result = 0;
+	ULONG32 Count = 0;
+	FILE *pFile = NULL;
+	DWORD dwStart = 0;
+
+	if (0 != _tfopen_s(&pFile, lpszManifest, _T("r")))
+	{
+		printf("Could not open the manifest\n");
+		return 1;
+	}
+
+	HANDLE hDevice = CreateFile(L"\\\\.\\EVhdParser", GENERIC_WRITE | GENERIC_READ, 0, NULL, OPEN_EXISTING,
+		FILE_FLAG_OVERLAPPED, NULL);
+	if (hDevice == INVALID_HANDLE_VALUE)
+	{
+		PrintError(GetLastError(), "Failed to open shim driver device");
+		fclose(pFile);
+		return 1;
+	}
+
+	dwStart = GetTickCount();
+	Result = Manifest_Import(pFile, BatchSize, SubmitCipherBatch, hDevice, &Count);
+	printf("Imported %u disk configurations in %u ms\n", Count, GetTickCount() - dwStart);
+
+	CloseHandle(hDevice);
+	fclose(pFile);
+
+	return Result ? 1 : 0;
+}
+
+/** Saves a snapshot of the driver flight recorder, evhdtool flight-decode prints it */
+static int SaveFlightRecorder(const TCHAR *lpszOutput)
+{
+	DWORD dwError = ERROR_SUCCESS;
+	DWORD dwReturned = 0;
+	FLIGHT_SNAPSHOT_HEADER Header = { 0 };
+	PVOID pSnapshot = NULL;
+	FILE *pFile = NULL;
+	int Result = 1;
+
+	HANDLE hDevice = CreateFile(L"\\\\.\\EVhdParser", GENERIC_READ, 0, NULL, OPEN_EXISTING,
+		FILE_FLAG_OVERLAPPED, NULL);
+	if (hDevice == INVALID_HANDLE_VALUE)
+	{
+		PrintError(GetLastError(), "Failed to open shim driver device");
+		return 1;
+	}
+
+	// The header alone tells the size of the snapshot
+	dwError = SyncrhonousDeviceIoControl(hDevice, IOCTL_VIRTUAL_DISK_SNAPSHOT_FLIGHT_RECORDER,
+		NULL, 0, &Header, sizeof(Header), &dwReturned);
+	if (ERROR_SUCCESS != dwError && ERROR_MORE_DATA != dwError)
+	{
+		PrintError(dwError, "Failed to query the flight recorder");
+		goto out;
+	}
+
+	pSnapshot = VirtualAlloc(NULL, Header.TotalSize, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	if (!pSnapshot)
+	{
+		PrintError(GetLastError(), "Failed to allocate the snapshot");
+		goto out;
+	}
+
+	dwError = SyncrhonousDeviceIoControl(hDevice, IOCTL_VIRTUAL_DISK_SNAPSHOT_FLIGHT_RECORDER,
+		NULL, 0, pSnapshot, Header.TotalSize, &dwReturned);
+	if (ERROR_SUCCESS != dwError)
+	{
+		PrintError(dwError, "Failed to snapshot the flight recorder");
+		goto out;
+	}
+
+	if (0 != _tfopen_s(&pFile, lpszOutput, _T("wb")) || dwReturned != fwrite(pSnapshot, 1, dwReturned, pFile))
+	{
+		printf("Could not write the snapshot\n");
+		goto out;
+	}
+
+	printf("Saved %u processors, %u bytes\n", Header.RingCount, dwReturned);
+	Result = 0;
+
+out:
+	if (pFile)
+		fclose(pFile);
+	if (pSnapshot)
+		VirtualFree(pSnapshot, 0, MEM_RELEASE);
+	CloseHandle(hDevice);
+
+	return Result;
+}
+
+static void PrintGuidA(const GUID *pGuid)
+{
+	printf("%08lX-%04hX-%04hX-%02X%02X-%02X%02X%02X%02X%02X%02X", pGuid->Data1, pGuid->Data2, pGuid->Data3,
+		pGuid->Data4[0], pGuid->Data4[1], pGuid->Data4[2], pGuid->Data4[3],
+		pGuid->Data4[4], pGuid->Data4[5], pGuid->Data4[6], pGuid->Data4[7]);
+}
+
+/** Upper bound in microseconds of the latency below which Percent of the requests completed */
+static double LatencyPercentile(const ULONG64 *pBuckets, double Percent, ULONG64 TscFrequency)
+{
+	ULONG64 Total = 0, Seen = 0;
+	ULONG32 Bucket = 0;
+
+	for (Bucket = 0; Bucket < DISK_LATENCY_BUCKETS; ++Bucket)
+		Total += pBuckets[Bucket];
+	if (!Total || !TscFrequency)
+		return 0;
+	for (Bucket = 0; Bucket < DISK_LATENCY_BUCKETS - 1; ++Bucket)
+	{
+		Seen += pBuckets[Bucket];
+		if (Seen >= Total * Percent / 100)
+			break;
+	}
+	return DiskCounters_BucketStart(Bucket + 1) * 1e6 / TscFrequency;
+}
+
+static void PrintDiskCounters(const DISK_COUNTERS *pCounters, LONG64 InFlight, ULONG64 TscFrequency)
+{
+	static const char *ClassNames[DISK_CLASS_MAX] = { "read", "write", "other" };
+	double Frequency = TscFrequency ? (double)TscFrequency : 1;
+	ULONG32 Class = 0;
+
+	for (Class = 0; Class < DISK_CLASS_MAX; ++Class)
+	{
+		ULONG64 Measured = pCounters->Completed[Class];
+		if (!pCounters->Requests[Class])
+			continue;
+		printf("    %-5s %12llu requests %10.1f MB  avg %8.1f us  p50 %8.1f us  p99 %8.1f us  p99.9 %8.1f us\n",
+			ClassNames[Class], pCounters->Requests[Class], pCounters->Bytes[Class] / 1048576.0,
+			Measured ? pCounters->LatencyTicks[Class] * 1e6 / Frequency / Measured : 0,
+			LatencyPercentile(pCounters->Latency[Class], 50, TscFrequency),
+			LatencyPercentile(pCounters->Latency[Class], 99, TscFrequency),
+			LatencyPercentile(pCounters->Latency[Class], 99.9, TscFrequency));
+	}
+	printf("    in flight %lld, errors %llu, untracked %llu, crypto %.1f MB in %.1f ms, bounce pages %llu (%llu failed)\n",
+		InFlight, pCounters->Errors, pCounters->Untracked, pCounters->CryptoBytes / 1048576.0,
+		pCounters->CryptoTicks * 1e3 / Frequency, pCounters->BounceAllocations, pCounters->BounceFailures);
+	if (pCounters->ResponseHits + pCounters->ResponseMisses)
+		printf("    control commands %llu answered from the response cache, %llu sent to vhdmp (%.1f%% hits)\n",
+			pCounters->ResponseHits, pCounters->ResponseMisses,
+			100.0 * pCounters->ResponseHits / (pCounters->ResponseHits + pCounters->ResponseMisses));
+	if (pCounters->AlignedIos + pCounters->MisalignedIos)
+		printf("    reads and writes %llu aligned to 4 KiB, %llu misaligned (%.1f%%)\n",
+			pCounters->AlignedIos, pCounters->MisalignedIos,
+			100.0 * pCounters->MisalignedIos / (pCounters->AlignedIos + pCounters->MisalignedIos));
+	if (pCounters->ReadCacheHits + pCounters->ReadCacheFills)
+		printf("    read cache: %llu reads completed from it, %llu blocks put into it\n", pCounters->ReadCacheHits,
+			pCounters->ReadCacheFills);
+	if (pCounters->ParentCacheHits)
+		printf("    %llu of the reads completed from blocks shared with the other clones of the parent\n",
+			pCounters->ParentCacheHits);
+	if (pCounters->ReadAheadHits + pCounters->ReadAheadBytes)
+		printf("    read-ahead: %llu reads completed from it, %llu KiB read ahead, %llu KiB of them never read
+",
+			pCounters->ReadAheadHits, pCounters->ReadAheadBytes / 1024, pCounters->ReadAheadWasted / 1024);
+}
+
+/** Prints the counters of every open disk, grouped by the virtual machine using it */
+static int PrintDiskStats()
+{
+	DWORD dwError = ERROR_SUCCESS;
+	DWORD dwReturned = 0;
+	DWORD dwSize = FIELD_OFFSET(DISK_STATS_LIST, Disks) + 16 * sizeof(DISK_STATS);
+	DISK_STATS_LIST *pList = NULL;
+	BOOL *pPrinted = NULL;
+	ULONG32 i = 0, j = 0, Returned = 0;
+	int Result = 1;
+
+	HANDLE hDevice = CreateFile(L"\\\\.\\EVhdParser", GENERIC_READ, 0, NULL, OPEN_EXISTING,
+		FILE_FLAG_OVERLAPPED, NULL);
+	if (hDevice == INVALID_HANDLE_VALUE)
+	{
+		PrintError(GetLastError(), "Failed to open shim driver device");
+		return 1;
+	}
+
+	// Disks may be opened between the calls, retry until all of them fit
+	for (;;)
+	{
+		free(pList);
+		pList = malloc(dwSize);
+		if (!pList)
+			goto out;
+		dwError = SyncrhonousDeviceIoControl(hDevice, IOCTL_VIRTUAL_DISK_QUERY_DISK_STATS, NULL, 0, pList, dwSize, &dwReturned);
+		if (ERROR_SUCCESS != dwError)
+		{
+			PrintError(dwError, "Failed to query disk counters");
+			goto out;
+		}
+		Returned = (dwReturned - FIELD_OFFSET(DISK_STATS_LIST, Disks)) / sizeof(DISK_STATS);
+		if (Returned >= pList->Count)
+			break;
+		dwSize = FIELD_OFFSET(DISK_STATS_LIST, Disks) + (pList->Count + 16) * sizeof(DISK_STATS);
+	}
+
+	pPrinted = calloc(pList->Count + 1, sizeof(BOOL));
+	if (!pPrinted)
+		goto out;
+	if (!pList->TscFrequency)
+		printf("The driver has just started, latencies are not available yet\n");
+
+	for (i = 0; i < pList->Count; ++i)
+	{
+		DISK_COUNTERS Total = { 0 };
+		LONG64 InFlight = 0;
+		ULONG32 Disks = 0;
+
+		if (pPrinted[i])
+			continue;
+		for (j = i; j < pList->Count; ++j)
+		{
+			if (!pPrinted[j] && IsEqualGUID(&pList->Disks[j].ApplicationId, &pList->Disks[i].ApplicationId))
+			{
+				DiskCounters_Add(&Total, &pList->Disks[j].Counters);
+				InFlight += pList->Disks[j].InFlight;
+				++Disks;
+			}
+		}
+
+		printf("VM ");
+		PrintGuidA(&pList->Disks[i].ApplicationId);
+		printf(", %u disks\n", Disks);
+		PrintDiskCounters(&Total, InFlight, pList->TscFrequency);
+		for (j = i; j < pList->Count; ++j)
+		{
+			if (pPrinted[j] || !IsEqualGUID(&pList->Disks[j].ApplicationId, &pList->Disks[i].ApplicationId))
+				continue;
+			pPrinted[j] = TRUE;
+			printf("  disk ");
+			PrintGuidA(&pList->Disks[j].DiskId);
+			printf(" (tag %u)\n", pList->Disks[j].DiskTag);
+			PrintDiskCounters(&pList->Disks[j].Counters, pList->Disks[j].InFlight, pList->TscFrequency);
+		}
+	}
+	Result = 0;
+
+out:
+	free(pPrinted);
+	free(pList);
+	CloseHandle(hDevice);
+
+	return Result;
+}
+
+/** Upper bound in microseconds of the time below which Percent of the requests passed a stage */
+static double StagePercentile(const ULONG64 *pBuckets, ULONG64 Total, double Percent, ULONG64 TscFrequency)
+{
+	ULONG64 Seen = 0;
+	ULONG32 Bucket = 0;
+
+	if (!Total || !TscFrequency)
+		return 0;
+	for (Bucket = 0; Bucket < SRB_STAGE_BUCKETS - 1; ++Bucket)
+	{
+		Seen += pBuckets[Bucket];
+		if (Seen >= Total * Percent / 100)
+			break;
+	}
+	return SrbTiming_BucketStart(Bucket + 1) * 1e6 / TscFrequency;
+}
+
+static void PrintStageCounters(const SRB_STAGE_COUNTERS *pStages, ULONG64 TscFrequency)
+{
+	static const char *StageNames[SRB_STAGE_MAX] = {
+		"total", "setup", "bounce", "encrypt", "handoff", "vhdmp", "dispatch", "decrypt", "finish" };
+	double Frequency = TscFrequency ? (double)TscFrequency : 1;
+	ULONG32 Stage = 0;
+
+	for (Stage = 0; Stage < SRB_STAGE_MAX; ++Stage)
+	{
+		ULONG64 Count = pStages->Count[Stage];
+		if (!Count)
+			continue;
+		printf("    %-8s %12llu requests  avg %9.2f us  p50 %9.2f us  p99 %9.2f us  p99.9 %9.2f us\n",
+			StageNames[Stage], Count, pStages->Ticks[Stage] * 1e6 / Frequency / Count,
+			StagePercentile(pStages->Histogram[Stage], Count, 50, TscFrequency),
+			StagePercentile(pStages->Histogram[Stage], Count, 99, TscFrequency),
+			StagePercentile(pStages->Histogram[Stage], Count, 99.9, TscFrequency));
+	}
+	if (pStages->Skewed)
+		printf("    %llu requests not counted, their timestamps went backwards\n", pStages->Skewed);
+}
+
+/** Prints where the requests of every stage timed disk spent their time */
+static int PrintStageStats()
+{
+	DWORD dwError = ERROR_SUCCESS;
+	DWORD dwReturned = 0;
+	DWORD dwSize = FIELD_OFFSET(DISK_STAGE_STATS_LIST, Disks) + 16 * sizeof(DISK_STAGE_STATS);
+	DISK_STAGE_STATS_LIST *pList = NULL;
+	ULONG32 i = 0, Returned = 0;
+	int Result = 1;
+
+	HANDLE hDevice = CreateFile(L"\\\\.\\EVhdParser", GENERIC_READ, 0, NULL, OPEN_EXISTING,
+		FILE_FLAG_OVERLAPPED, NULL);
+	if (hDevice == INVALID_HANDLE_VALUE)
+	{
+		PrintError(GetLastError(), "Failed to open shim driver device");
+		return 1;
+	}
+
+	for (;;)
+	{
+		free(pList);
+		pList = malloc(dwSize);
+		if (!pList)
+			goto out;
+		dwError = SyncrhonousDeviceIoControl(hDevice, IOCTL_VIRTUAL_DISK_QUERY_STAGE_STATS, NULL, 0, pList, dwSize, &dwReturned);
+		if (ERROR_SUCCESS != dwError)
+		{
+			PrintError(dwError, "Failed to query stage counters");
+			goto out;
+		}
+		Returned = (dwReturned - FIELD_OFFSET(DISK_STAGE_STATS_LIST, Disks)) / sizeof(DISK_STAGE_STATS);
+		if (Returned >= pList->Count)
+			break;
+		dwSize = FIELD_OFFSET(DISK_STAGE_STATS_LIST, Disks) + (pList->Count + 16) * sizeof(DISK_STAGE_STATS);
+	}
+
+	if (!pList->Enabled)
+		printf("Stage timing is disabled, set the StageTiming parameter of the driver and restart it\n");
+	if (!pList->TscFrequency)
+		printf("The driver has just started, times are not available yet\n");
+	for (i = 0; i < pList->Count; ++i)
+	{
+		printf("disk ");
+		PrintGuidA(&pList->Disks[i].DiskId);
+		printf(" (tag %u) of VM ", pList->Disks[i].DiskTag);
+		PrintGuidA(&pList->Disks[i].ApplicationId);
+		printf("\n");
+		PrintStageCounters(&pList->Disks[i].Stages, pList->TscFrequency);
+	}
+	Result = 0;
+
+out:
+	free(pList);
+	CloseHandle(hDevice);
+
+	return Result;
+}
+
+static const char *ControlPhaseNames[CTL_PHASE_MAX] = {
+	"open", "  shim", "  create", "  parents", "  init", "  qos", "  diskinfo", "  ext",
+	"mount", "  key", "  registerio", "  address",
+	"dismount", "  remove", "  ext",
+	"close", "  qos", "  finalize" };
+
+/** Prints how long disks took to open, mount, dismount and close, phase by phase */
+static int PrintControlStats()
+{
+	DWORD dwError = ERROR_SUCCESS;
+	DWORD dwReturned = 0;
+	DWORD dwSize = FIELD_OFFSET(CONTROL_STATS_LIST, Disks) + 16 * sizeof(DISK_CONTROL_STATS);
+	CONTROL_STATS_LIST *pList = NULL;
+	const CTL_PHASE_COUNTERS *pPhases = NULL;
+	ULONG32 i = 0, Phase = 0, Returned = 0;
+	int Result = 1;
+
+	HANDLE hDevice = CreateFile(L"\\\\.\\EVhdParser", GENERIC_READ, 0, NULL, OPEN_EXISTING,
+		FILE_FLAG_OVERLAPPED, NULL);
+	if (hDevice == INVALID_HANDLE_VALUE)
+	{
+		PrintError(GetLastError(), "Failed to open shim driver device");
+		return 1;
+	}
+
+	for (;;)
+	{
+		free(pList);
+		pList = malloc(dwSize);
+		if (!pList)
+			goto out;
+		dwError = SyncrhonousDeviceIoControl(hDevice, IOCTL_VIRTUAL_DISK_QUERY_CONTROL_STATS, NULL, 0, pList, dwSize, &dwReturned);
+		if (ERROR_SUCCESS != dwError)
+		{
+			PrintError(dwError, "Failed to query control path counters");
+			goto out;
+		}
+		Returned = (dwReturned - FIELD_OFFSET(CONTROL_STATS_LIST, Disks)) / sizeof(DISK_CONTROL_STATS);
+		if (Returned >= pList->Count)
+			break;
+		dwSize = FIELD_OFFSET(CONTROL_STATS_LIST, Disks) + (pList->Count + 16) * sizeof(DISK_CONTROL_STATS);
+	}
+
+	printf("vhdmp control requests %llu, %u in flight, at most %u at once; IRPs allocated %llu, reused %llu\n",
+		pList->Irps.Calls, pList->Irps.InFlight, pList->Irps.MaxInFlight, pList->Irps.Allocated, pList->Irps.Reused);
+	// Times are in 100 ns units, the stage percentile helper converts them with a 10 MHz clock
+	pPhases = &pList->Phases;
+	for (Phase = 0; Phase < CTL_PHASE_MAX; ++Phase)
+	{
+		ULONG64 Count = pPhases->Count[Phase];
+		if (!Count)
+			continue;
+		printf("%-12s %8llu times  avg %11.1f us  p50 %11.1f us  p99 %11.1f us  max %11.1f us\n",
+			ControlPhaseNames[Phase], Count, pPhases->Time[Phase] / 10.0 / Count,
+			StagePercentile(pPhases->Histogram[Phase], Count, 50, 10000000),
+			StagePercentile(pPhases->Histogram[Phase], Count, 99, 10000000),
+			pPhases->MaxTime[Phase] / 10.0);
+	}
+	for (i = 0; i < pList->Count; ++i)
+	{
+		printf("disk ");
+		PrintGuidA(&pList->Disks[i].DiskId);
+		printf(" (tag %u) of VM ", pList->Disks[i].DiskTag);
+		PrintGuidA(&pList->Disks[i].ApplicationId);
+		printf(", last time of each phase\n");
+		for (Phase = 0; Phase < CTL_PHASE_MAX; ++Phase)
+		{
+			if (pList->Disks[i].Last.Time[Phase])
+				printf("    %-12s %11.1f us\n", ControlPhaseNames[Phase], pList->Disks[i].Last.Time[Phase] / 10.0);
+		}
+	}
+	Result = 0;
+
+out:
+	free(pList);
+	CloseHandle(hDevice);
+
+	return Result;
+}
+
+static void PrintInflightRequests(const char *pszTitle, const DISK_INFLIGHT_REQUEST *pRequests, ULONG32 Count,
+	ULONG64 TscFrequency)
+{
+	ULONG32 i = 0;
+
+	if (Count)
+		printf("    %s\n", pszTitle);
+	for (i = 0; i < Count; ++i)
+	{
+		printf("      op 0x%02X lba 0x%llX, %u bytes, %.3f ms%s\n", pRequests[i].Opcode, pRequests[i].Lba,
+			pRequests[i].Length, TscFrequency ? pRequests[i].Ticks * 1e3 / TscFrequency : 0,
+			(pRequests[i].Flags & DISK_INFLIGHT_STUCK) ? " STUCK" : "");
+	}
+}
+
+/** Prints the requests in flight on every disk, the stuck ones, and the slowest completions of the last scan period */
+static int PrintInflight()
+{
+	DWORD dwError = ERROR_SUCCESS;
+	DWORD dwReturned = 0;
+	DWORD dwSize = FIELD_OFFSET(DISK_INFLIGHT_LIST, Disks) + 16 * sizeof(DISK_INFLIGHT_STATS);
+	DISK_INFLIGHT_LIST *pList = NULL;
+	ULONG32 i = 0, Returned = 0;
+	int Result = 1;
+
+	HANDLE hDevice = CreateFile(L"\\\\.\\EVhdParser", GENERIC_READ, 0, NULL, OPEN_EXISTING,
+		FILE_FLAG_OVERLAPPED, NULL);
+	if (hDevice == INVALID_HANDLE_VALUE)
+	{
+		PrintError(GetLastError(), "Failed to open shim driver device");
+		return 1;
+	}
+
+	for (;;)
+	{
+		free(pList);
+		pList = malloc(dwSize);
+		if (!pList)
+			goto out;
+		dwError = SyncrhonousDeviceIoControl(hDevice, IOCTL_VIRTUAL_DISK_QUERY_INFLIGHT, NULL, 0, pList, dwSize, &dwReturned);
+		if (ERROR_SUCCESS != dwError)
+		{
+			PrintError(dwError, "Failed to query requests in flight");
+			goto out;
+		}
+		Returned = (dwReturned - FIELD_OFFSET(DISK_INFLIGHT_LIST, Disks)) / sizeof(DISK_INFLIGHT_STATS);
+		if (Returned >= pList->Count)
+			break;
+		dwSize = FIELD_OFFSET(DISK_INFLIGHT_LIST, Disks) + (pList->Count + 16) * sizeof(DISK_INFLIGHT_STATS);
+	}
+
+	if (pList->ScanPeriod)
+		printf("Requests in flight for %u ms are stuck, scanned every %u ms\n", pList->StuckThreshold, pList->ScanPeriod);
+	else
+		printf("The scanner is disabled, set the InflightScanPeriod parameter of the driver and restart it\n");
+	for (i = 0; i < pList->Count; ++i)
+	{
+		const DISK_INFLIGHT_STATS *pDisk = &pList->Disks[i];
+		printf("disk ");
+		PrintGuidA(&pDisk->DiskId);
+		printf(" (tag %u) of VM ", pDisk->DiskTag);
+		PrintGuidA(&pDisk->ApplicationId);
+		printf("\n    %u in flight, %u stuck now, %llu found stuck since the disk was opened\n",
+			pDisk->Scan.Outstanding, pDisk->Scan.Stuck, pDisk->StuckTotal);
+		PrintInflightRequests("oldest in flight", pDisk->Scan.Oldest, pDisk->Scan.OldestCount, pList->TscFrequency);
+		PrintInflightRequests("slowest completed in the last period", pDisk->Slowest, pDisk->SlowestCount,
+			pList->TscFrequency);
+	}
+	Result = 0;
+
+out:
+	free(pList);
+	CloseHandle(hDevice);
+
+	return Result;
+}
+
+/** Saves the heatmap of a disk, the tag is the one printed by -stats */
+static int SaveHeatmap(ULONG32 DiskTag, const TCHAR *lpszOutput, BOOLEAN Reset)
+{
+	DWORD dwError = ERROR_SUCCESS;
+	DWORD dwReturned = 0;
+	DWORD dwSize = (DWORD)HEAT_SNAPSHOT_SIZE(HEAT_BUCKETS, HEAT_TOP_BLOCKS);
+	HEAT_SNAPSHOT_REQUEST Request = { DiskTag, Reset ? HEAT_SNAPSHOT_RESET : 0 };
+	HEAT_SNAPSHOT_HEADER *pSnapshot = NULL;
+	FILE *pFile = NULL;
+	int Result = 1;
+
+	HANDLE hDevice = CreateFile(L"\\\\.\\EVhdParser", GENERIC_READ, 0, NULL, OPEN_EXISTING,
+		FILE_FLAG_OVERLAPPED, NULL);
+	if (hDevice == INVALID_HANDLE_VALUE)
+	{
+		PrintError(GetLastError(), "Failed to open shim driver device");
+		return 1;
+	}
+
+	// Large enough for the heatmap of any disk
+	pSnapshot = malloc(dwSize);
+	if (!pSnapshot)
+		goto out;
+	dwError = SyncrhonousDeviceIoControl(hDevice, IOCTL_VIRTUAL_DISK_SNAPSHOT_HEATMAP,
+		&Request, sizeof(Request), pSnapshot, dwSize, &dwReturned);
+	if (ERROR_SUCCESS != dwError)
+	{
+		PrintError(dwError, "Failed to snapshot the heatmap, it is enabled by the Heatmap parameter of the driver");
+		goto out;
+	}
+
+	if (0 != _tfopen_s(&pFile, lpszOutput, _T("wb")) || dwReturned != fwrite(pSnapshot, 1, dwReturned, pFile))
+	{
+		printf("Could not write the snapshot\n");
+		goto out;
+	}
+
+	printf("Saved %u buckets of %llu KiB and %u hot blocks, %u bytes\n", pSnapshot->BucketCount,
+		(1ULL << pSnapshot->BucketShift) >> 10, pSnapshot->TopCount, dwReturned);
+	Result = 0;
+
+out:
+	if (pFile)
+		fclose(pFile);
+	free(pSnapshot);
+	CloseHandle(hDevice);
+
+	return Result;
 }
 
 int _tmain(int argc, _TCHAR* argv[])
@@ -143,6 +713,41 @@ int _tmain(int argc, _TCHAR* argv[])
 	DWORD dwError = ERROR_SUCCESS;
 	GUID vhdId = GUID_NULL;
 
+	if ((argc == 3 || argc == 4) && 0 == _tcscmp(argv[1], _T("-import")))
+	{
+		return ImportManifest(argv[2], argc == 4 ? _tcstoul(argv[3], NULL, 10) : MANIFEST_DEFAULT_BATCH);
+	}
+
+	if (argc == 3 && 0 == _tcscmp(argv[1], _T("-flight")))
+	{
+		return SaveFlightRecorder(argv[2]);
+	}
+
+	if (argc == 2 && 0 == _tcscmp(argv[1], _T("-stats")))
+	{
+		return PrintDiskStats();
+	}
+
+	if (argc == 2 && 0 == _tcscmp(argv[1], _T("-stages")))
+	{
+		return PrintStageStats();
+	}
+
+	if (argc == 2 && 0 == _tcscmp(argv[1], _T("-control")))
+	{
+		return PrintControlStats();
+	}
+
+	if (argc == 2 && 0 == _tcscmp(argv[1], _T("-inflight")))
+	{
+		return PrintInflight();
+	}
+
+	if ((argc == 4 || argc == 5) && 0 == _tcscmp(argv[1], _T("-heatmap")))
+	{
+		return SaveHeatmap(_tcstoul(argv[2], NULL, 10), argv[3], argc == 5 && 0 == _tcscmp(argv[4], _T("-reset")));
+	}
+
 	if (argc != 2)
 	{
 		PrintUsage();
@@ -0,0 +1,176 @@
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include "manifest.h"
+
+static const struct {
+    const char *Name;
+    ECipherAlgo Algorithm;
+} ManifestAlgorithms[] = {
+    { "disabled", ECipherAlgo_Disabled },
+    { "aes-xts", ECipherAlgo_AesXts },
+    { "twofish-xts", ECipherAlgo_TwofishXts },
+    { "serpent-xts", ECipherAlgo_SerpentXts },
+};
+
+static const char *SkipSpaces(const char *p)
+{
+    while (*p && isspace((unsigned char)*p))
+        ++p;
+    return p;
+}
+
+static int HexDigit(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+const char *Manifest_ParseHex(const char *p, UCHAR *pBytes, size_t Count)
+{
+    size_t i = 0;
+    for (i = 0; i < Count; ++i)
+    {
+        int High = HexDigit(p[0]), Low = High < 0 ? -1 : HexDigit(p[1]);
+        if (Low < 0)
+            return NULL;
+        pBytes[i] = (UCHAR)(High << 4 | Low);
+        p += 2;
+    }
+    return p;
+}
+
+const char *Manifest_ParseGuid(const char *p, GUID *pGuid)
+{
+    UCHAR Bytes[16];
+    BOOLEAN Braces = *p == '{';
+    static const size_t Groups[] = { 4, 2, 2, 2, 6 };
+    size_t i = 0, Offset = 0;
+
+    if (Braces)
+        ++p;
+    for (i = 0; i < sizeof(Groups) / sizeof(Groups[0]); ++i)
+    {
+        if (i && *p++ != '-')
+            return NULL;
+        if (!(p = Manifest_ParseHex(p, Bytes + Offset, Groups[i])))
+            return NULL;
+        Offset += Groups[i];
+    }
+    if (Braces && *p++ != '}')
+        return NULL;
+
+    pGuid->Data1 = (ULONG)Bytes[0] << 24 | (ULONG)Bytes[1] << 16 | (ULONG)Bytes[2] << 8 | Bytes[3];
+    pGuid->Data2 = (USHORT)(Bytes[4] << 8 | Bytes[5]);
+    pGuid->Data3 = (USHORT)(Bytes[6] << 8 | Bytes[7]);
+    memcpy(pGuid->Data4, Bytes + 8, 8);
+    return p;
+}
+
+static const char *ParseWord(const char *p, char *pWord, size_t WordSize)
+{
+    size_t Length = 0;
+    while (*p && !isspace((unsigned char)*p))
+    {
+        if (Length + 1 >= WordSize)
+            return NULL;
+        pWord[Length++] = *p++;
+    }
+    pWord[Length] = 0;
+    return p;
+}
+
+int Manifest_ParseLine(const char *pLine, EVHD_SET_CIPHER_CONFIG_REQUEST *pConfig)
+{
+    const char *p = SkipSpaces(pLine);
+    char Name[16];
+    size_t i = 0;
+
+    if (!*p || *p == '#')
+        return 0;
+
+    memset(pConfig, 0, sizeof(*pConfig));
+    if (!(p = Manifest_ParseGuid(p, &pConfig->DiskId)) || !isspace((unsigned char)*p))
+        return -1;
+    if (!(p = ParseWord(SkipSpaces(p), Name, sizeof(Name))))
+        return -1;
+
+    for (i = 0; i < sizeof(ManifestAlgorithms) / sizeof(ManifestAlgorithms[0]); ++i)
+    {
+        if (!strcmp(Name, ManifestAlgorithms[i].Name))
+            break;
+    }
+    if (i == sizeof(ManifestAlgorithms) / sizeof(ManifestAlgorithms[0]))
+        return -1;
+    pConfig->Algorithm = ManifestAlgorithms[i].Algorithm;
+
+    if (pConfig->Algorithm != ECipherAlgo_Disabled)
+    {
+        p = Manifest_ParseHex(SkipSpaces(p), pConfig->Opts.Xts256.CryptoKey, sizeof(pConfig->Opts.Xts256.CryptoKey));
+        if (!p || !isspace((unsigned char)*p))
+            return -1;
+        p = Manifest_ParseHex(SkipSpaces(p), pConfig->Opts.Xts256.TweakKey, sizeof(pConfig->Opts.Xts256.TweakKey));
+        if (!p)
+            return -1;
+    }
+
+    p = SkipSpaces(p);
+    return (!*p || *p == '#') ? 1 : -1;
+}
+
+int Manifest_Import(FILE *pFile, ULONG32 BatchSize, ManifestSubmit_t pfnSubmit, void *pContext, ULONG32 *pCount)
+{
+    EVHD_SET_CIPHER_BATCH_REQUEST *pBatch = NULL;
+    char Line[512];
+    unsigned long LineNumber = 0;
+    int Result = 0;
+
+    *pCount = 0;
+    if (!BatchSize || BatchSize > EVHD_SET_CIPHER_BATCH_MAX)
+        BatchSize = MANIFEST_DEFAULT_BATCH;
+
+    pBatch = malloc(EVHD_SET_CIPHER_BATCH_SIZE(BatchSize));
+    if (!pBatch)
+        return ENOMEM;
+    memset(pBatch, 0, FIELD_OFFSET(EVHD_SET_CIPHER_BATCH_REQUEST, Configs));
+
+    while (fgets(Line, sizeof(Line), pFile))
+    {
+        ++LineNumber;
+        Result = Manifest_ParseLine(Line, &pBatch->Configs[pBatch->Count]);
+        if (Result < 0)
+        {
+            fprintf(stderr, "Manifest line %lu: syntax error\n", LineNumber);
+            goto Cleanup;
+        }
+        if (Result == 0)
+            continue;
+
+        if (++pBatch->Count == BatchSize)
+        {
+            if (0 != (Result = pfnSubmit(pContext, pBatch, (unsigned long)EVHD_SET_CIPHER_BATCH_SIZE(pBatch->Count))))
+                goto Cleanup;
+            *pCount += pBatch->Count;
+            pBatch->Count = 0;
+        }
+    }
+
+    Result = 0;
+    if (pBatch->Count)
+    {
+        if (0 == (Result = pfnSubmit(pContext, pBatch, (unsigned long)EVHD_SET_CIPHER_BATCH_SIZE(pBatch->Count))))
+            *pCount += pBatch->Count;
+    }
+
+Cleanup:
+    // The batch holds keys
+    memset(pBatch, 0, EVHD_SET_CIPHER_BATCH_SIZE(BatchSize));
+    free(pBatch);
+    return Result;
+}
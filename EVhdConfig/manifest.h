@@ -0,0 +1,34 @@
+#pragma once
+/*
+ * Cipher manifest import. A manifest is a text file with one disk per line:
+ *
+ *     <DiskId> <algorithm> [<crypto key hex> <tweak key hex>]
+ *
+ * where algorithm is one of disabled, aes-xts, twofish-xts, serpent-xts and the keys are
+ * 32 bytes each. Empty lines and lines starting with '#' are ignored. Parsing and batching
+ * only use the C runtime so they can be exercised off Windows.
+ */
+#include <stdio.h>
+#include "../EVhdParser/Control.h"
+
+/* Number of configurations submitted per IOCTL by default */
+#define MANIFEST_DEFAULT_BATCH 1024
+
+/** Submits a batch, returns 0 on success or an error code that stops the import */
+typedef int (*ManifestSubmit_t)(void *pContext, EVHD_SET_CIPHER_BATCH_REQUEST *pBatch, unsigned long Size);
+
+/** Parses Count bytes of hex digits, returns the position after them or NULL */
+const char *Manifest_ParseHex(const char *p, UCHAR *pBytes, size_t Count);
+
+/** Parses a GUID in the registry format, braces are optional. Returns the position after it or NULL */
+const char *Manifest_ParseGuid(const char *p, GUID *pGuid);
+
+/** Parses a single manifest line. Returns 1 if the line holds an entry, 0 if it is blank, -1 on a syntax error */
+int Manifest_ParseLine(const char *pLine, EVHD_SET_CIPHER_CONFIG_REQUEST *pConfig);
+
+/**
+ * Reads the manifest and submits its entries in batches of up to BatchSize configurations.
+ * Returns 0 on success, -1 on a syntax error (reported with its line number), ENOMEM or the
+ * first error returned by pfnSubmit. pCount receives the number of entries submitted.
+ */
+int Manifest_Import(FILE *pFile, ULONG32 BatchSize, ManifestSubmit_t pfnSubmit, void *pContext, ULONG32 *pCount);
@@ -6,8 +6,12 @@
 #include "utils.h"
 #include "Ioctl.h"
 #include "Vdrvroot.h"
+#include "ReadCache.h"
 #include "Dispatch.h"
 #include "Extension.h"
+#include "Catalog.h"
+#include "DiskStats.h"
+#include "IrpPool.h"
 
 static HANDLE g_shimFileHandle = NULL;
 
@@ -20,8 +24,15 @@ void EVhdDriverUnload(PDRIVER_OBJECT pDriverObject)
 		ZwClose(g_shimFileHandle);
 		g_shimFileHandle = NULL;
     }
+    Ext_Cleanup();
+    Catalog_Cleanup();
+    ReadCache_Cleanup();
+    Vdrvroot_Cleanup();
     Log_Cleanup();
     DPT_Cleanup();
+    DiskStats_Cleanup();
+    Flight_Cleanup();
+    IrpPool_Cleanup();
 }
 
 static NTSTATUS EVhdDriverLoad(ULONG32 *pResult)
@@ -89,14 +100,51 @@ NTSTATUS DriverEntry(PDRIVER_OBJECT pDriverObject, PUNICODE_STRING pRegistryPath
     if (!NT_SUCCESS(status))
     {
         DbgPrint("DPT_Initialize failed with error: 0x%08X\n", status);
-        return status;
+        goto CleanupExtension;
     }
 
+    IrpPool_Initialize();
+
     status = Log_Initialize(pDeviceObject, pRegistryPath);
     if (!NT_SUCCESS(status))
     {
         DbgPrint("Log_Initialize failed with error: 0x%08X\n", status);
-        return status;
+        goto CleanupLog;
+    }
+
+    // Disks not in the catalog are still served through the key service
+    status = Catalog_Initialize(pRegistryPath);
+    if (!NT_SUCCESS(status))
+    {
+        DbgPrint("Catalog_Initialize failed with error: 0x%08X\n", status);
+    }
+
+    // The driver works without the flight recorder, it only records nothing
+    status = Flight_Initialize();
+    if (!NT_SUCCESS(status))
+    {
+        DbgPrint("Flight_Initialize failed with error: 0x%08X\n", status);
+    }
+
+    // Disks are served without counters, their snapshots are only empty
+    status = DiskStats_Initialize(pRegistryPath);
+    if (!NT_SUCCESS(status))
+    {
+        DbgPrint("DiskStats_Initialize failed with error: 0x%08X\n", status);
+    }
+
+    // The shim is looked up once at load, the cache only keeps later lookups off the enumerator
+    status = Vdrvroot_Initialize(pDriverObject);
+    if (!NT_SUCCESS(status))
+    {
+        DbgPrint("Vdrvroot_Initialize failed with error: 0x%08X\n", status);
+    }
+
+    // Reads of encrypted disks are decrypted every time without it
+    status = ReadCache_Initialize(pRegistryPath);
+    if (!NT_SUCCESS(status))
+    {
+        DbgPrint("ReadCache_Initialize failed with error: 0x%08X\n", status);
     }
 
 	ParserInfo.qwVersion = 0;
@@ -119,15 +167,36 @@ NTSTATUS DriverEntry(PDRIVER_OBJECT pDriverObject, PUNICODE_STRING pRegistryPath
 	if (!NT_SUCCESS(status))
 	{
         DbgPrint("EVhdDriverLoad failed with error: 0x%08X\n", status);
-		return status;
+		goto Cleanup;
 	}
 
 	status = RegisterParser(&ParserInfo);
 	if (!NT_SUCCESS(status))
 	{
         DbgPrint("RegisterParser failed with error: 0x%08X\n", status);
-		return status;
+		goto Cleanup;
 	}
 
 	return status;
+
+    // DriverUnload is not called when DriverEntry fails, the steps done so far are undone in reverse order
+Cleanup:
+	if (g_shimFileHandle)
+	{
+		ZwClose(g_shimFileHandle);
+		g_shimFileHandle = NULL;
+	}
+    ReadCache_Cleanup();
+    Vdrvroot_Cleanup();
+    DiskStats_Cleanup();
+    Flight_Cleanup();
+    Catalog_Cleanup();
+CleanupLog:
+    // The flusher thread must be gone before the image is unloaded
+    Log_Cleanup();
+    IrpPool_Cleanup();
+    DPT_Cleanup();
+CleanupExtension:
+    Ext_Cleanup();
+    return status;
 }
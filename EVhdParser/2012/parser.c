@@ -6,6 +6,8 @@
 #include "Vdrvroot.h"	 
 #include "utils.h"
 #include "Extension.h"
+#include "ExtRequest.h"
+#include "DiskStats.h"
 
 #define LOG_PARSER(level, format, ...) LOG_FUNCTION(level, LOG_CTG_PARSER, format, __VA_ARGS__)
 
@@ -14,27 +16,19 @@ static const ULONG EvhdPoolTag = 'VVpp';
 static NTSTATUS EVhd_InitializeExtension(ParserInstance *parser, PGUID applicationId, PCUNICODE_STRING diskPath)
 {
     NTSTATUS status = STATUS_SUCCESS;
-    DISK_INFO_RESPONSE Response = { 0 };
-    DISK_INFO_REQUEST Request = { EDiskInfoType_ParserInfo };
-    EDiskFormat DiskFormat = EDiskFormat_Unknown;
-    status = SynchronouseCall(parser->pVhdmpFileObject, IOCTL_STORAGE_VHD_GET_INFORMATION,
-        &Request, sizeof(DISK_INFO_REQUEST), &Response, sizeof(DISK_INFO_RESPONSE));
+    GUID ParentId;
+    DISK_INFO Info;
+    status = DiskInfo_Fetch(parser->pVhdmpFileObject, &parser->DiskInfo, &Info);
     if (!NT_SUCCESS(status))
     {
-        LOG_PARSER(LL_FATAL, "Failed to retreive parser info. 0x%0X\n", status);
+        LOG_PARSER(LL_FATAL, "Failed to retreive disk information. 0x%0X\n", status);
         return status;
     }
-    DiskFormat = Response.vals[0].dwLow;
-
-    Request.RequestCode = EDiskInfoType_LinkageId;
-    status = SynchronouseCall(parser->pVhdmpFileObject, IOCTL_STORAGE_VHD_GET_INFORMATION,
-        &Request, sizeof(DISK_INFO_REQUEST), &Response, sizeof(DISK_INFO_RESPONSE));
-    if (!NT_SUCCESS(status))
-    {
-        LOG_PARSER(LL_FATAL, "Failed to retreive virtual disk identifier. 0x%0X\n", status);
-        return status;
-    }
-    status = Ext_Create(diskPath, applicationId, DiskFormat, &Response.guid, &parser->pExtension);
+    status = Ext_Create(diskPath, applicationId, Info.DiskFormat, &Info.LinkageId, &parser->pExtension);
+    // Reads of a clone are shared with the other clones of its parent with the parent known
+    if (NT_SUCCESS(status) && parser->pExtension && DISK_INFO_TYPE_DIFFERENCING == Info.DiskType &&
+        NT_SUCCESS(DiskInfo_QueryParent(parser->pVhdmpFileObject, &ParentId)))
+        Ext_SetParent(parser->pExtension, &ParentId);
     return status;
 }
 
@@ -195,16 +189,19 @@ static NTSTATUS EVhd_UnregisterQoS(ParserInstance *parser)
 	return status;
 }
 
-static NTSTATUS EVhd_RegisterIo(ParserInstance *parser, BOOLEAN bFlag)
+static NTSTATUS EVhd_RegisterIo(ParserInstance *parser, BOOLEAN bFlag, CTL_TIMING *pTiming)
 {
     TRACE_FUNCTION_IN();
     REGISTER_IO_REQUEST Request = { 0 };
 	NTSTATUS status = STATUS_SUCCESS;
 	SCSI_ADDRESS scsiAddressResponse = { 0 };
+    LONG64 PhaseStart = 0;
 
     if (parser->pExtension)
     {
+        PhaseStart = DiskStats_PhaseStart();
         status = Ext_Mount(parser->pExtension);
+        DiskStats_PhaseEnd(pTiming, CTL_PHASE_MOUNT_KEY, PhaseStart);
         if (!NT_SUCCESS(status))
         {
             goto Cleanup;
@@ -221,8 +218,10 @@ static NTSTATUS EVhd_RegisterIo(ParserInstance *parser, BOOLEAN bFlag)
     {
         Request.dwVersion = 1;
         Request.dwFlags = bFlag ? 0x9 : 0x8;
+        PhaseStart = DiskStats_PhaseStart();
         status = SynchronouseCall(parser->pVhdmpFileObject, IOCTL_STORAGE_REGISTER_IO,
             &Request, sizeof(REGISTER_IO_REQUEST), NULL, 0);
+        DiskStats_PhaseEnd(pTiming, CTL_PHASE_MOUNT_REGISTER_IO, PhaseStart);
 
         if (!NT_SUCCESS(status))
         {
@@ -232,7 +231,9 @@ static NTSTATUS EVhd_RegisterIo(ParserInstance *parser, BOOLEAN bFlag)
         parser->bIoRegistered = TRUE;
     }
 
+    PhaseStart = DiskStats_PhaseStart();
     status = SynchronouseCall(parser->pVhdmpFileObject, IOCTL_SCSI_GET_ADDRESS, NULL, 0, &scsiAddressResponse, sizeof(SCSI_ADDRESS));
+    DiskStats_PhaseEnd(pTiming, CTL_PHASE_MOUNT_ADDRESS, PhaseStart);
 
     if (!NT_SUCCESS(status))
     {
@@ -249,16 +250,19 @@ Cleanup:
 	return status;
 }
 
-static NTSTATUS EVhd_UnregisterIo(ParserInstance *parser)
+static NTSTATUS EVhd_UnregisterIo(ParserInstance *parser, CTL_TIMING *pTiming)
 {
 	NTSTATUS status = STATUS_SUCCESS;
+    LONG64 PhaseStart = 0;
     TRACE_FUNCTION_IN();
 	if (parser->bIoRegistered)
 	{
         UNREGISTER_IO_REQUEST Request = { 1 };
 
+		PhaseStart = DiskStats_PhaseStart();
 		status = SynchronouseCall(parser->pVhdmpFileObject, IOCTL_STORAGE_REMOVE_VIRTUAL_DISK,
             &Request, sizeof(UNREGISTER_IO_REQUEST), NULL, 0);
+		DiskStats_PhaseEnd(pTiming, CTL_PHASE_DISMOUNT_REMOVE, PhaseStart);
 		if (!NT_SUCCESS(status))
 		{
             LOG_PARSER(LL_FATAL, "IOCTL_STORAGE_REMOVE_VIRTUAL_DISK failed with error 0x%0X\n", status);
@@ -270,7 +274,9 @@ static NTSTATUS EVhd_UnregisterIo(ParserInstance *parser)
 
     if (NT_SUCCESS(status) && parser->pExtension)
     {
+        PhaseStart = DiskStats_PhaseStart();
         status = Ext_Dismount(parser->pExtension);
+        DiskStats_PhaseEnd(pTiming, CTL_PHASE_DISMOUNT_EXTENSION, PhaseStart);
     }
 Cleanup:
     TRACE_FUNCTION_OUT_STATUS(status);
@@ -281,7 +287,12 @@ static VOID EVhd_PostProcessSrbPacket(SCSI_PACKET *pPacket, NTSTATUS status)
 {
 	STORVSP_REQUEST *pVspRequest = pPacket->pVspRequest;
 	STORVSC_REQUEST *pVscRequest = pPacket->pVscRequest;
+    ULONG RequestLength = pVscRequest->DataTransferLength;
+    // Answered from the response cache or failed by the extension, it counted the completion
+    BOOLEAN Answered = STATUS_ALREADY_COMPLETE == status;
 
+    if (Answered)
+        status = STATUS_SUCCESS;
     pVscRequest->SrbStatus = pVspRequest->Srb.SrbStatus;
     pVscRequest->ScsiStatus = pVspRequest->Srb.ScsiStatus;
     pVscRequest->SenseInfoBufferLength = pVspRequest->Srb.SenseInfoBufferLength;
@@ -292,16 +303,11 @@ static VOID EVhd_PostProcessSrbPacket(SCSI_PACKET *pPacket, NTSTATUS status)
 		pPacket->DataTransferLength = 0;
 
     ParserInstance *pParser = pPacket->pContext;
-    if (pParser->pExtension) {
-        EVHD_EXT_SCSI_PACKET ExtPacket;
-        ExtPacket.pMdl = pPacket->pMdl;
-        ExtPacket.pSenseBuffer = &pPacket->pVspRequest->Srb.SenseInfoBuffer;
-        ExtPacket.SenseBufferLength = pPacket->pVspRequest->Srb.SenseInfoBufferLength;
-        ExtPacket.Srb = &pPacket->pVspRequest->Srb;
-        status = Ext_CompleteScsiRequest(pParser->pExtension, &ExtPacket, status);
-        if (NT_SUCCESS(status)) {
-            pPacket->pMdl = ExtPacket.pMdl;
-        }
+    if (pParser->pExtension && !Answered) {
+        Ext_CompleteVstorRequest(pParser->pExtension, pVspRequest, pVscRequest, &pPacket->pMdl, NULL, RequestLength,
+            status);
+        if (NT_SUCCESS(pPacket->Status))
+            pPacket->DataTransferLength = pVspRequest->Srb.DataTransferLength;
     }
 }
 
@@ -378,7 +384,7 @@ NTSTATUS EVhd_Init(SrbCallbackInfo *callbackInfo, PCUNICODE_STRING diskPath, ULO
 	RESILIENCY_INFO_EA *pResiliency = *pInOutParam;
 	ULONG32 dwFlags = OpenFlags ? ((OpenFlags & 0x80000000) ? 0xD0000 : 0x3B0000) : 0x80000;
 
-	status = OpenVhdmpDevice(&FileHandle, OpenFlags, &pFileObject, diskPath, pResiliency);
+	status = OpenVhdmpDevice(&FileHandle, OpenFlags, &pFileObject, diskPath, pResiliency, NULL);
 	if (!NT_SUCCESS(status))
 	{
         LOG_PARSER(LL_FATAL, "Failed to open vhdmp device for virtual disk file %S\n", diskPath->Buffer);
@@ -394,6 +400,7 @@ NTSTATUS EVhd_Init(SrbCallbackInfo *callbackInfo, PCUNICODE_STRING diskPath, ULO
 	}
 
 	memset(parser, 0, sizeof(ParserInstance));
+	DiskInfo_Initialize(&parser->DiskInfo);
 
 	status = EVhd_Initialize(callbackInfo, dwFlags, FileHandle, pFileObject, parser);
 
@@ -469,6 +476,8 @@ NTSTATUS EVhd_Mount(PVOID pContext, BOOLEAN bMountDismount, BOOLEAN registerIoFl
     TRACE_FUNCTION_IN();
     ParserInstance *parser = pContext;
 	NTSTATUS status = STATUS_SUCCESS;
+	CTL_TIMING Timing = { 0 };
+	LONG64 Start = 0;
 
 	if (parser->bMounted == bMountDismount)
 	{
@@ -476,18 +485,23 @@ NTSTATUS EVhd_Mount(PVOID pContext, BOOLEAN bMountDismount, BOOLEAN registerIoFl
 		return STATUS_INVALID_DEVICE_STATE;
 	}
 
+	Start = DiskStats_PhaseStart();
 	if (bMountDismount)
 	{
-		status = EVhd_RegisterIo(parser, registerIoFlag);
+		status = EVhd_RegisterIo(parser, registerIoFlag, &Timing);
+		DiskStats_PhaseEnd(&Timing, CTL_PHASE_MOUNT, Start);
+		Ext_RecordControl(parser->pExtension, &Timing, CTL_PHASE_MOUNT, CTL_PHASE_MOUNT_ADDRESS);
 		if (!NT_SUCCESS(status))
-			EVhd_UnregisterIo(parser);
+			EVhd_UnregisterIo(parser, NULL);
 		else
 			parser->bMounted = TRUE;
 	}
 	else
 	{
-		status = EVhd_UnregisterIo(parser);
+		status = EVhd_UnregisterIo(parser, &Timing);
 		parser->bMounted = FALSE;
+		DiskStats_PhaseEnd(&Timing, CTL_PHASE_DISMOUNT, Start);
+		Ext_RecordControl(parser->pExtension, &Timing, CTL_PHASE_DISMOUNT, CTL_PHASE_DISMOUNT_EXTENSION);
 	}
     TRACE_FUNCTION_OUT_STATUS(status);
 	return status;
@@ -526,10 +540,20 @@ NTSTATUS EVhd_ExecuteSrb(SCSI_PACKET *pPacket)
         ExtPacket.pSenseBuffer = &pPacket->pVspRequest->Srb.SenseInfoBuffer;
         ExtPacket.SenseBufferLength = pPacket->pVspRequest->Srb.SenseInfoBufferLength;
         ExtPacket.Srb = &pVspRequest->Srb;
+        // The inner buffer is sized by vstor here, there is no room for stage timestamps
+        ExtPacket.pTiming = NULL;
+        ExtPacket.RequestLength = pVscRequest->DataTransferLength;
+        ExtPacket.bReadAheadSent = FALSE;
         status = Ext_StartScsiRequest(parser->pExtension, &ExtPacket);
         pPacket->pMdl = ExtPacket.pMdl;
     }
 
+    if (STATUS_ALREADY_COMPLETE == status)
+    {
+        // Answered from the response cache of the disk or failed by the extension, vhdmp never sees it
+        EVhd_PostProcessSrbPacket(pPacket, status);
+        return STATUS_SUCCESS;
+    }
 	if (NT_SUCCESS(status))
         status = parser->QoS.pfnStartIo(parser->QoS.pIoInterface, pPacket, pVspRequest, pPacket->pMdl);
 	else
@@ -1,5 +1,6 @@
 #pragma once 
 #include "Vstor.h"
+#include "DiskInfo.h"
 
 typedef struct _PARSER_STATE {
 	ULONG64		qwUnk1;
@@ -29,6 +30,7 @@ typedef struct _ParserInstance {
 	VstorPrepare_t						pfnVstorSrbPrepare;
 	QoSInfo								QoS;
     PVOID                               pExtension;
+    DISK_INFO_CACHE                     DiskInfo;
 } ParserInstance;
 
 NTSTATUS EVhd_Init(SrbCallbackInfo *openInfo, PCUNICODE_STRING diskPath, ULONG32 OpenFlags, void **pInOutParam);
@@ -8,6 +8,11 @@
 #include "Log.h"
 #include "Dispatch.h"
 #include "Extension.h"
+#include "Catalog.h"
+#include "DiskStats.h"
+#include "IrpPool.h"
+#include "Vdrvroot.h"
+#include "ReadCache.h"
 
 #if 0
 // {860ECCBC-6E7D-4A17-B181-81D64AF02170}
@@ -25,8 +30,14 @@ void EVhdDriverUnload(PDRIVER_OBJECT pDriverObject)
 {
 	UNREFERENCED_PARAMETER(pDriverObject);
     Ext_Cleanup();
+    Catalog_Cleanup();
+    ReadCache_Cleanup();
+    Vdrvroot_Cleanup();
     Log_Cleanup();
     DPT_Cleanup();
+    DiskStats_Cleanup();
+    Flight_Cleanup();
+    IrpPool_Cleanup();
 }
 
 /** Default major function dispatcher */
@@ -80,7 +91,7 @@ NTSTATUS DriverEntry(PDRIVER_OBJECT pDriverObject, PUNICODE_STRING pRegistryPath
     if (!NT_SUCCESS(status))
     {
         DbgPrint("Failed to initialize dispatch subsystem: %X\n", status);
-        return status;
+        goto CleanupExtension;
     }
 
 	ParserInfo.dwSize						= sizeof(VSTOR_PARSER_INFO);
@@ -102,19 +113,72 @@ NTSTATUS DriverEntry(PDRIVER_OBJECT pDriverObject, PUNICODE_STRING pRegistryPath
 	ParserInfo.pfnGetQosInformationDisk		= EVhd_GetQosInformationDisk;
 
 
+    IrpPool_Initialize();
+
     status = Log_Initialize(pDeviceObject, pRegistryPath);
     if (!NT_SUCCESS(status))
     {
         DbgPrint("Log_Initialize failed with error: %X\n", status);
-        return status;
+        goto CleanupLog;
+    }
+
+    // Disks not in the catalog are still served through the key service
+    status = Catalog_Initialize(pRegistryPath);
+    if (!NT_SUCCESS(status))
+    {
+        DbgPrint("Catalog_Initialize failed with error: %X\n", status);
+    }
+
+    // The driver works without the flight recorder, it only records nothing
+    status = Flight_Initialize();
+    if (!NT_SUCCESS(status))
+    {
+        DbgPrint("Flight_Initialize failed with error: %X\n", status);
+    }
+
+    // Disks are served without counters, their snapshots are only empty
+    status = DiskStats_Initialize(pRegistryPath);
+    if (!NT_SUCCESS(status))
+    {
+        DbgPrint("DiskStats_Initialize failed with error: %X\n", status);
+    }
+
+    // Disks are still opened without the cache, they only look up the shim every time
+    status = Vdrvroot_Initialize(pDriverObject);
+    if (!NT_SUCCESS(status))
+    {
+        DbgPrint("Vdrvroot_Initialize failed with error: %X\n", status);
+    }
+
+    // Reads of encrypted disks are decrypted every time without it
+    status = ReadCache_Initialize(pRegistryPath);
+    if (!NT_SUCCESS(status))
+    {
+        DbgPrint("ReadCache_Initialize failed with error: %X\n", status);
     }
 
 	status = VstorRegisterParser(&ParserInfo);
 	if (!NT_SUCCESS(status))
 	{
 		LOG_FUNCTION(LL_FATAL, LOG_CTG_GENERAL, "VstorRegisterParser failed with error: %X\n", status);
-		return status;
+		goto Cleanup;
 	}
 
 	return status;
+
+    // DriverUnload is not called when DriverEntry fails, the steps done so far are undone in reverse order
+Cleanup:
+    ReadCache_Cleanup();
+    Vdrvroot_Cleanup();
+    DiskStats_Cleanup();
+    Flight_Cleanup();
+    Catalog_Cleanup();
+CleanupLog:
+    // The flusher thread must be gone before the image is unloaded
+    Log_Cleanup();
+    IrpPool_Cleanup();
+    DPT_Cleanup();
+CleanupExtension:
+    Ext_Cleanup();
+    return status;
 }
@@ -6,35 +6,35 @@
 #include "Guids.h"
 #include "Log.h"
 #include "Extension.h"
+#include "ExtRequest.h"
+#include "DiskStats.h"
+#include "IrpPool.h"
 
 #define LOG_PARSER(level, format, ...) LOG_FUNCTION(level, LOG_CTG_PARSER, format, __VA_ARGS__)
 
 static const ULONG EvhdPoolTag = 'VVpp';
 
-static NTSTATUS EVhd_InitializeExtension(ParserInstance *parser, PGUID applicationId, PCUNICODE_STRING diskPath)
+static NTSTATUS EVhd_InitializeExtension(ParserInstance *parser, PGUID applicationId, PCUNICODE_STRING diskPath,
+	CTL_TIMING *pTiming)
 {
 	NTSTATUS status = STATUS_SUCCESS;
-	DISK_INFO_RESPONSE Response = { 0 };
-    DISK_INFO_REQUEST Request = { EDiskInfoType_ParserInfo };
-	EDiskFormat DiskFormat = EDiskFormat_Unknown;
-	status = SynchronouseCall(parser->pVhdmpFileObject, IOCTL_STORAGE_VHD_GET_INFORMATION,
-        &Request, sizeof(DISK_INFO_REQUEST), &Response, sizeof(DISK_INFO_RESPONSE));
-	if (!NT_SUCCESS(status))
-	{
-        LOG_PARSER(LL_FATAL, "Failed to retreive parser info. 0x%0X\n", status);
-		return status;
-	}
-	DiskFormat = Response.vals[0].dwLow;
-
-	Request.RequestCode = EDiskInfoType_LinkageId;
-    status = SynchronouseCall(parser->pVhdmpFileObject, IOCTL_STORAGE_VHD_GET_INFORMATION,
-        &Request, sizeof(DISK_INFO_REQUEST), &Response, sizeof(DISK_INFO_RESPONSE));
+	GUID ParentId;
+	DISK_INFO Info;
+	LONG64 PhaseStart = DiskStats_PhaseStart();
+	status = DiskInfo_Fetch(parser->pVhdmpFileObject, &parser->DiskInfo, &Info);
+	DiskStats_PhaseEnd(pTiming, CTL_PHASE_OPEN_DISK_INFO, PhaseStart);
 	if (!NT_SUCCESS(status))
 	{
-        LOG_PARSER(LL_FATAL, "Failed to retreive virtual disk identifier. 0x%0X\n", status);
+        LOG_PARSER(LL_FATAL, "Failed to retreive disk information. 0x%0X\n", status);
 		return status;
 	}
-    status = Ext_Create(diskPath, applicationId, DiskFormat, &Response.guid, &parser->pExtension);
+	PhaseStart = DiskStats_PhaseStart();
+    status = Ext_Create(diskPath, applicationId, Info.DiskFormat, &Info.LinkageId, &parser->pExtension);
+	// Reads of a clone are shared with the other clones of its parent with the parent known
+	if (NT_SUCCESS(status) && parser->pExtension && DISK_INFO_TYPE_DIFFERENCING == Info.DiskType &&
+		NT_SUCCESS(DiskInfo_QueryParent(parser->pVhdmpFileObject, &ParentId)))
+		Ext_SetParent(parser->pExtension, &ParentId);
+	DiskStats_PhaseEnd(pTiming, CTL_PHASE_OPEN_EXTENSION, PhaseStart);
 	return status;
 }
 
@@ -57,18 +57,10 @@ static NTSTATUS EVhd_Initialize(HANDLE hFileHandle, PFILE_OBJECT pFileObject, Pa
 
 	parser->pVhdmpFileObject = pFileObject;
 	parser->FileHandle = hFileHandle;
-	parser->pIrp = IoAllocateIrp(IoGetRelatedDeviceObject(parser->pVhdmpFileObject)->StackSize, FALSE);
-	if (!parser->pIrp)
-	{
-        LOG_PARSER(LL_FATAL, "IoAllocateIrp failed\n");
-		return STATUS_INSUFFICIENT_RESOURCES;
-	}
 
     status = SynchronouseCall(parser->pVhdmpFileObject, IOCTL_STORAGE_VHD_GET_INFORMATION,
         &Request, sizeof(DISK_INFO_REQUEST), &Response, sizeof(DISK_INFO_RESPONSE));
 
-    FltInitializePushLock(&parser->IoLock);
-
 	if (!NT_SUCCESS(status))
 	{
         LOG_PARSER(LL_FATAL, "SynchronouseCall IOCTL_STORAGE_VHD_GET_INFORMATION failed with error 0x%0x\n", status);
@@ -83,9 +75,6 @@ static VOID EVhd_Finalize(ParserInstance *parser)
 {
 	EVhd_FinalizeExtension(parser);
 
-	if (parser->pIrp)
-		IoFreeIrp(parser->pIrp);
-
 	if (parser->pVhdmpFileObject)
 	{
 		ObfDereferenceObject(parser->pVhdmpFileObject);
@@ -126,8 +115,28 @@ static NTSTATUS EVhd_UnregisterQosInterface(ParserInstance *parser)
 	return status;
 }
 
+/** Stage timestamps of a request, they follow the vhdmp extension in the inner buffer */
+static __inline SRB_TIMING *EVhd_GetTiming(ParserInstance *parser, STORVSP_REQUEST *pVspRequest)
+{
+    if (!parser->dwTimingOffset)
+        return NULL;
+    return (SRB_TIMING *)((UCHAR *)(pVspRequest + 1) + parser->dwTimingOffset);
+}
+
+/** Stamps the hand back of a timed request to the VSP and counts its stages, the request is still ours */
+static VOID EVhd_CompleteTiming(ParserInstance *parser, STORVSP_REQUEST *pVspRequest)
+{
+    SRB_TIMING *pTiming = EVhd_GetTiming(parser, pVspRequest);
+    if (pTiming)
+    {
+        Ext_StampRequest(pTiming, SRB_STAMP_VSTOR_COMPLETE);
+        Ext_CompleteTiming(parser->pExtension, pTiming);
+    }
+}
+
 static void EVhd_PostProcessScsiPacket(SCSI_PACKET *pPacket, NTSTATUS status)
 {
+    ULONG RequestLength = pPacket->pVscRequest->DataTransferLength;
     pPacket->pVscRequest->SrbStatus = pPacket->pVspRequest->Srb.SrbStatus;
     pPacket->pVscRequest->ScsiStatus = pPacket->pVspRequest->Srb.ScsiStatus;
     pPacket->pVscRequest->SenseInfoBufferLength = pPacket->pVspRequest->Srb.SenseInfoBufferLength;
@@ -148,24 +157,24 @@ static void EVhd_PostProcessScsiPacket(SCSI_PACKET *pPacket, NTSTATUS status)
 	}
 
     ParserInstance *pParser = pPacket->pVspRequest->pContext;
-    if (pParser->pExtension) {
-        EVHD_EXT_SCSI_PACKET ExtPacket;
-        ExtPacket.pMdl = pPacket->pMdl;
-        ExtPacket.pSenseBuffer = &pPacket->Sense;
-        ExtPacket.SenseBufferLength = pPacket->pVspRequest->Srb.SenseInfoBufferLength;
-        ExtPacket.Srb = &pPacket->pVspRequest->Srb;
-        status = Ext_CompleteScsiRequest(pParser->pExtension, &ExtPacket, status);
-        if (NT_SUCCESS(status)) {
-            pPacket->pMdl = ExtPacket.pMdl;
-        }
-    }
+    // Answered from the response cache or failed by the extension, it counted the completion
+    if (STATUS_ALREADY_COMPLETE == status)
+        return;
+    if (pParser->bPassThrough)
+        Ext_CompletePlainRequest(pParser->pExtension, &pPacket->pVspRequest->Srb, RequestLength, status);
+    else if (pParser->pExtension)
+        Ext_CompleteVstorRequest(pParser->pExtension, pPacket->pVspRequest, pPacket->pVscRequest, &pPacket->pMdl,
+            EVhd_GetTiming(pParser, pPacket->pVspRequest), RequestLength, status);
 }
 
 NTSTATUS EVhd_CompleteScsiRequest(SCSI_PACKET *pPacket, NTSTATUS VspStatus)
 {
     NTSTATUS status;
+    ParserInstance *parser = pPacket->pVspRequest->pContext;
     //TRACE_FUNCTION_IN();
+    Ext_StampRequest(EVhd_GetTiming(parser, pPacket->pVspRequest), SRB_STAMP_VHDMP_COMPLETE);
     EVhd_PostProcessScsiPacket(pPacket, VspStatus);
+    EVhd_CompleteTiming(parser, pPacket->pVspRequest);
     status = VstorCompleteScsiRequest(pPacket);
     //TRACE_FUNCTION_OUT_STATUS(status);
     return status;
@@ -188,18 +197,22 @@ NTSTATUS EVhd_SendMediaNotification(void *param1)
 }
 
 
-static NTSTATUS EVhd_RegisterIo(ParserInstance *parser, BOOLEAN flag1, BOOLEAN flag2)
+static NTSTATUS EVhd_RegisterIo(ParserInstance *parser, BOOLEAN flag1, BOOLEAN flag2, CTL_TIMING *pTiming)
 {
     TRACE_FUNCTION_IN();
 	NTSTATUS status = STATUS_SUCCESS;
+	LONG64 PhaseStart = 0;
 
     if (parser->pExtension)
     {
+        PhaseStart = DiskStats_PhaseStart();
         status = Ext_Mount(parser->pExtension);
+        DiskStats_PhaseEnd(pTiming, CTL_PHASE_MOUNT_KEY, PhaseStart);
         if (!NT_SUCCESS(status))
         {
             return status;
         }
+        parser->bPassThrough = Ext_IsPassThrough(parser->pExtension);
     }
 
 	if (!parser->bIoRegistered)
@@ -217,8 +230,10 @@ static NTSTATUS EVhd_RegisterIo(ParserInstance *parser, BOOLEAN flag1, BOOLEAN f
 		request.pfnSendNotification = &EVhd_SendNotification;
 		request.pVstorInterface = parser->pVstorInterface;
 
+        PhaseStart = DiskStats_PhaseStart();
         status = SynchronouseCall(parser->pVhdmpFileObject, IOCTL_STORAGE_REGISTER_IO, &request, sizeof(REGISTER_IO_REQUEST),
             &response, sizeof(REGISTER_IO_RESPONSE));
+        DiskStats_PhaseEnd(pTiming, CTL_PHASE_MOUNT_REGISTER_IO, PhaseStart);
 
 		if (!NT_SUCCESS(status))
 		{
@@ -229,9 +244,18 @@ static NTSTATUS EVhd_RegisterIo(ParserInstance *parser, BOOLEAN flag1, BOOLEAN f
 		parser->bIoRegistered = TRUE;
 		parser->dwDiskSaveSize = response.dwDiskSaveSize;
 		parser->dwInnerBufferSize = sizeof(PARSER_STATE) + response.dwExtensionBufferSize;
+		parser->dwTimingOffset = 0;
+		if (parser->pExtension && Ext_TimingSize())
+		{
+			// Stage timestamps are kept after everything vhdmp uses, 8 byte aligned
+			parser->dwTimingOffset = (parser->dwInnerBufferSize + 7) & ~7;
+			parser->dwInnerBufferSize = parser->dwTimingOffset + Ext_TimingSize();
+		}
 		parser->Io = response.Io;
 
+		PhaseStart = DiskStats_PhaseStart();
 		status = SynchronouseCall(parser->pVhdmpFileObject, IOCTL_SCSI_GET_ADDRESS, NULL, 0, &scsiAddressResponse, sizeof(SCSI_ADDRESS));
+		DiskStats_PhaseEnd(pTiming, CTL_PHASE_MOUNT_ADDRESS, PhaseStart);
 
 		if (!NT_SUCCESS(status))
 		{
@@ -249,40 +273,17 @@ static NTSTATUS EVhd_RegisterIo(ParserInstance *parser, BOOLEAN flag1, BOOLEAN f
 	return status;
 }
 
+/** Control request the caller's buffer is the system buffer of, several may be in flight at once */
 static NTSTATUS EVhd_DirectIoControl(ParserInstance *parser, ULONG ControlCode, PVOID pInputBuffer, ULONG InputBufferSize)
 {
-	NTSTATUS status = STATUS_SUCCESS;
-	PDEVICE_OBJECT pDeviceObject = NULL;
-	KeEnterCriticalRegion();
-	FltAcquirePushLockExclusive(&parser->IoLock);
-
-	IoReuseIrp(parser->pIrp, STATUS_PENDING);
-	parser->pIrp->Flags |= IRP_NOCACHE;
-	parser->pIrp->Tail.Overlay.Thread = (PETHREAD)__readgsqword(0x188);		// Pointer to calling thread control block
-	parser->pIrp->AssociatedIrp.SystemBuffer = pInputBuffer;				// IO buffer for buffered control code
-	// fill stack frame parameters for synchronous IRP call
-	PIO_STACK_LOCATION pStackFrame = IoGetNextIrpStackLocation(parser->pIrp);
-	pDeviceObject = IoGetRelatedDeviceObject(parser->pVhdmpFileObject);
-	pStackFrame->FileObject = parser->pVhdmpFileObject;
-	pStackFrame->DeviceObject = pDeviceObject;
-	pStackFrame->Parameters.DeviceIoControl.IoControlCode = ControlCode;
-	pStackFrame->Parameters.DeviceIoControl.InputBufferLength = InputBufferSize;
-	pStackFrame->Parameters.DeviceIoControl.OutputBufferLength = 0;
-	pStackFrame->MajorFunction = IRP_MJ_DEVICE_CONTROL;
-	pStackFrame->MinorFunction = 0;
-	pStackFrame->Flags = 0;
-	pStackFrame->Control = 0;
-	IoSynchronousCallDriver(pDeviceObject, parser->pIrp);
-	status = parser->pIrp->IoStatus.Status;
-	FltReleasePushLock(&parser->IoLock);
-	KeLeaveCriticalRegion();
-	return status;
+	return IrpPool_Call(parser->pVhdmpFileObject, ControlCode, pInputBuffer, InputBufferSize, 0, NULL);
 }
 
-static NTSTATUS EVhd_UnregisterIo(ParserInstance *parser)
+static NTSTATUS EVhd_UnregisterIo(ParserInstance *parser, CTL_TIMING *pTiming)
 {
     TRACE_FUNCTION_IN();
 	NTSTATUS status = STATUS_SUCCESS;
+	LONG64 PhaseStart = 0;
 
 	if (parser->bIoRegistered)
 	{
@@ -294,7 +295,9 @@ static NTSTATUS EVhd_UnregisterIo(ParserInstance *parser)
 		} RemoveVhdRequest = { 1 };
 #pragma pack(pop)
 
+		PhaseStart = DiskStats_PhaseStart();
 		EVhd_DirectIoControl(parser, IOCTL_STORAGE_REMOVE_VIRTUAL_DISK, &RemoveVhdRequest, sizeof(RemoveVhdRequest));
+		DiskStats_PhaseEnd(pTiming, CTL_PHASE_DISMOUNT_REMOVE, PhaseStart);
 
 		parser->bIoRegistered = FALSE;
 		parser->Io.pIoInterface = NULL;
@@ -306,7 +309,12 @@ static NTSTATUS EVhd_UnregisterIo(ParserInstance *parser)
 	}
 
     if (parser->pExtension)
+    {
+        parser->bPassThrough = FALSE;
+        PhaseStart = DiskStats_PhaseStart();
         status = Ext_Dismount(parser->pExtension);
+        DiskStats_PhaseEnd(pTiming, CTL_PHASE_DISMOUNT_EXTENSION, PhaseStart);
+    }
 
     TRACE_FUNCTION_OUT_STATUS(status);
 
@@ -322,6 +330,8 @@ NTSTATUS EVhd_OpenDisk(PCUNICODE_STRING diskPath, ULONG32 OpenFlags, GUID *pVmId
 	HANDLE FileHandle = NULL;
 	ParserInstance *parser = NULL;
 	RESILIENCY_INFO_EA vmInfo = { 0 };
+	CTL_TIMING Timing = { 0 };
+	LONG64 OpenStart = DiskStats_PhaseStart(), PhaseStart = 0;
 
 	if (pVmId)
 	{
@@ -331,7 +341,7 @@ NTSTATUS EVhd_OpenDisk(PCUNICODE_STRING diskPath, ULONG32 OpenFlags, GUID *pVmId
 		strncpy(vmInfo.EaName, OPEN_FILE_RESILIENCY_INFO_EA_NAME, sizeof(vmInfo.EaName));
 		vmInfo.EaValue = *pVmId;
 	}
-	status = OpenVhdmpDevice(&FileHandle, OpenFlags, &pFileObject, diskPath, pVmId ? &vmInfo : NULL);
+	status = OpenVhdmpDevice(&FileHandle, OpenFlags, &pFileObject, diskPath, pVmId ? &vmInfo : NULL, &Timing);
 	if (!NT_SUCCESS(status))
 	{
         LOG_PARSER(LL_ERROR, "Failed to open vhdmp device for virtual disk file %S\n", diskPath->Buffer);
@@ -347,13 +357,18 @@ NTSTATUS EVhd_OpenDisk(PCUNICODE_STRING diskPath, ULONG32 OpenFlags, GUID *pVmId
 	}
 
 	memset(parser, 0, sizeof(ParserInstance));
+	DiskInfo_Initialize(&parser->DiskInfo);
 
+	PhaseStart = DiskStats_PhaseStart();
 	status = EVhd_Initialize(FileHandle, pFileObject, parser);
+	DiskStats_PhaseEnd(&Timing, CTL_PHASE_OPEN_INITIALIZE, PhaseStart);
 
 	if (!NT_SUCCESS(status))
 		goto failure_cleanup;
 
+	PhaseStart = DiskStats_PhaseStart();
 	status = EVhd_RegisterQosInterface(parser);
+	DiskStats_PhaseEnd(&Timing, CTL_PHASE_OPEN_QOS, PhaseStart);
 
 	if (!NT_SUCCESS(status))
 		goto failure_cleanup;
@@ -365,7 +380,7 @@ NTSTATUS EVhd_OpenDisk(PCUNICODE_STRING diskPath, ULONG32 OpenFlags, GUID *pVmId
 
 	parser->pVstorInterface = vstorInterface;
 
-	status = EVhd_InitializeExtension(parser, pVmId, diskPath);
+	status = EVhd_InitializeExtension(parser, pVmId, diskPath, &Timing);
 	if (!NT_SUCCESS(status))
 	{
         LOG_PARSER(LL_ERROR, "EVhd_InitializeExtension failed with error 0x%08X\n", status);
@@ -385,9 +400,19 @@ failure_cleanup:
 	if (parser)
 	{
 		EVhd_CloseDisk(parser);
+		parser = NULL;
 	}
 
 cleanup:
+	// A failed open is counted without a disk, its extension is gone
+	DiskStats_PhaseEnd(&Timing, CTL_PHASE_OPEN, OpenStart);
+	Ext_RecordControl(parser ? parser->pExtension : NULL, &Timing, CTL_PHASE_OPEN, CTL_PHASE_OPEN_EXTENSION);
+	LOG_PARSER(LL_INFO, "Open of %S took %I64u us (0x%08X): shim %I64u, create %I64u, differencing %I64u, "
+		"initialize %I64u, qos %I64u, disk info %I64u, extension %I64u us", diskPath->Buffer,
+		Timing.Time[CTL_PHASE_OPEN] / 10, status, Timing.Time[CTL_PHASE_OPEN_FIND_SHIM] / 10,
+		Timing.Time[CTL_PHASE_OPEN_CREATE] / 10, Timing.Time[CTL_PHASE_OPEN_DIFFERENCING] / 10,
+		Timing.Time[CTL_PHASE_OPEN_INITIALIZE] / 10, Timing.Time[CTL_PHASE_OPEN_QOS] / 10,
+		Timing.Time[CTL_PHASE_OPEN_DISK_INFO] / 10, Timing.Time[CTL_PHASE_OPEN_EXTENSION] / 10);
     TRACE_FUNCTION_OUT_STATUS(status);
 
 	return status;
@@ -398,13 +423,24 @@ VOID EVhd_CloseDisk(PVOID pContext)
 {
     TRACE_FUNCTION_IN();
     ParserInstance *parser = pContext;
+	CTL_TIMING Timing = { 0 };
+	LONG64 CloseStart = DiskStats_PhaseStart(), PhaseStart = 0;
+
 	if (parser->pVhdmpFileObject && parser->bQosRegistered && parser->Qos.pQosInterface)
+	{
+		PhaseStart = DiskStats_PhaseStart();
 		EVhd_UnregisterQosInterface(parser);
+		DiskStats_PhaseEnd(&Timing, CTL_PHASE_CLOSE_QOS, PhaseStart);
+	}
 	if (parser->bMounted)
-		EVhd_UnregisterIo(parser);
+		EVhd_UnregisterIo(parser, NULL);
 
+	PhaseStart = DiskStats_PhaseStart();
 	EVhd_Finalize(parser);
+	DiskStats_PhaseEnd(&Timing, CTL_PHASE_CLOSE_FINALIZE, PhaseStart);
 	ExFreePoolWithTag(parser, EvhdPoolTag);
+	DiskStats_PhaseEnd(&Timing, CTL_PHASE_CLOSE, CloseStart);
+	Ext_RecordControl(NULL, &Timing, CTL_PHASE_CLOSE, CTL_PHASE_CLOSE_FINALIZE);
     TRACE_FUNCTION_OUT();
 }
 
@@ -414,12 +450,16 @@ NTSTATUS EVhd_MountDisk(PVOID pContext, UCHAR flags, PARSER_MOUNT_INFO *mountInf
     TRACE_FUNCTION_IN();
 	NTSTATUS status = STATUS_SUCCESS;
     ParserInstance *parser = pContext;
+	CTL_TIMING Timing = { 0 };
+	LONG64 MountStart = DiskStats_PhaseStart();
 
-	status = EVhd_RegisterIo(parser, flags & 1, (flags >> 1) & 1);
+	status = EVhd_RegisterIo(parser, flags & 1, (flags >> 1) & 1, &Timing);
+	DiskStats_PhaseEnd(&Timing, CTL_PHASE_MOUNT, MountStart);
+	Ext_RecordControl(parser->pExtension, &Timing, CTL_PHASE_MOUNT, CTL_PHASE_MOUNT_ADDRESS);
 	if (!NT_SUCCESS(status))
 	{
         LOG_PARSER(LL_ERROR, "VHD: EvhdRegisterIo failed with error 0x%0x\n", status);
-		EVhd_UnregisterIo(parser);
+		EVhd_UnregisterIo(parser, NULL);
 		return status;
 	}
 	parser->bMounted = TRUE;
@@ -436,8 +476,12 @@ NTSTATUS EVhd_DismountDisk(PVOID pContext)
     TRACE_FUNCTION_IN();
 	NTSTATUS status = STATUS_SUCCESS;
     ParserInstance *parser = pContext;
-	status = EVhd_UnregisterIo(parser);
+	CTL_TIMING Timing = { 0 };
+	LONG64 DismountStart = DiskStats_PhaseStart();
+	status = EVhd_UnregisterIo(parser, &Timing);
 	parser->bMounted = FALSE;
+	DiskStats_PhaseEnd(&Timing, CTL_PHASE_DISMOUNT, DismountStart);
+	Ext_RecordControl(parser->pExtension, &Timing, CTL_PHASE_DISMOUNT, CTL_PHASE_DISMOUNT_EXTENSION);
     TRACE_FUNCTION_OUT_STATUS(status);
 	return status;
 }
@@ -476,6 +520,9 @@ NTSTATUS EVhd_ExecuteScsiRequestDisk(PVOID pContext, SCSI_PACKET *pPacket)
     STORVSP_REQUEST *pVspRequest = pPacket->pVspRequest;
     STORVSC_REQUEST *pVscRequest = pPacket->pVscRequest;
     PMDL pMdl = pPacket->pMdl;
+    SRB_TIMING *pTiming = EVhd_GetTiming(parser, pVspRequest);
+    if (pTiming)
+        SrbTiming_Start(pTiming, ReadTimeStampCounter());
 	memset(&pVspRequest->Srb, 0, SCSI_REQUEST_BLOCK_SIZE);
 	pVspRequest->pContext = pContext;
 	pVspRequest->Srb.Length = SCSI_REQUEST_BLOCK_SIZE;
@@ -522,25 +569,36 @@ NTSTATUS EVhd_ExecuteScsiRequestDisk(PVOID pContext, SCSI_PACKET *pPacket)
         break;
     }
 
-    if (NT_SUCCESS(status) && parser->pExtension) {
+    if (NT_SUCCESS(status) && parser->bPassThrough)
+        status = Ext_StartPlainRequest(parser->pExtension, &pVspRequest->Srb, pTiming);
+    else if (NT_SUCCESS(status) && parser->pExtension) {
         EVHD_EXT_SCSI_PACKET ExtPacket;
         ExtPacket.pMdl = pPacket->pMdl;
         ExtPacket.pSenseBuffer = &pPacket->Sense;
         ExtPacket.SenseBufferLength = pPacket->pVspRequest->Srb.SenseInfoBufferLength;
         ExtPacket.Srb = &pVspRequest->Srb;
+        ExtPacket.pTiming = pTiming;
+        ExtPacket.RequestLength = pVscRequest->DataTransferLength;
+        ExtPacket.bReadAheadSent = FALSE;
         status = Ext_StartScsiRequest(parser->pExtension, &ExtPacket);
         pPacket->pMdl = ExtPacket.pMdl;
     }
 
-    if (NT_SUCCESS(status)) {
+    // STATUS_ALREADY_COMPLETE: answered from the response cache of the disk or failed by the extension, vhdmp never sees it
+    if (NT_SUCCESS(status) && STATUS_ALREADY_COMPLETE != status) {
+        Ext_StampRequest(pTiming, SRB_STAMP_START_IO);
         status = parser->Io.pfnStartIo(parser->Io.pIoInterface, pPacket, pVspRequest, pPacket->pMdl, pPacket->bUnkFlag,
             pPacket->bUseInternalSenseBuffer ? &pPacket->Sense : NULL);
+        // Completed by vhdmp on this thread
+        if (STATUS_PENDING != status)
+            Ext_StampRequest(pTiming, SRB_STAMP_VHDMP_COMPLETE);
     }
-	else
+	else if (!NT_SUCCESS(status))
         pVscRequest->SrbStatus = SRB_STATUS_INTERNAL_ERROR;
 
 	if (STATUS_PENDING != status) {
         EVhd_PostProcessScsiPacket(pPacket, status);
+        EVhd_CompleteTiming(parser, pVspRequest);
         status = VstorCompleteScsiRequest(pPacket);
 	}
     //TRACE_FUNCTION_OUT_STATUS(status);
@@ -566,90 +624,10 @@ NTSTATUS EVhd_QueryInformationDisk(PVOID pContext, EDiskInfoType type, INT unuse
 		ASSERT(0x38 == sizeof(DISK_INFO_FORMAT));
 		if (*pBufferSize < sizeof(DISK_INFO_FORMAT))
 			return status = STATUS_BUFFER_TOO_SMALL;
-		DISK_INFO_FORMAT *pRes = pBuffer;
-		memset(pBuffer, 0, sizeof(DISK_INFO_FORMAT));
-
-		Request.RequestCode = EDiskInfoType_Type;
-		status = SynchronouseCall(parser->pVhdmpFileObject, IOCTL_STORAGE_VHD_GET_INFORMATION,
-            &Request, sizeof(DISK_INFO_REQUEST), &Response, sizeof(DISK_INFO_RESPONSE));
-		if (!NT_SUCCESS(status))
-		{
-            LOG_PARSER(LL_ERROR, "Failed to retreive disk type. 0x%0X\n", status);
-			return status;
-		}
-		pRes->DiskType = Response.vals[0].dwLow;
-
-		Request.RequestCode = EDiskInfoType_ParserInfo;
-        status = SynchronouseCall(parser->pVhdmpFileObject, IOCTL_STORAGE_VHD_GET_INFORMATION,
-            &Request, sizeof(DISK_INFO_REQUEST), &Response, sizeof(DISK_INFO_RESPONSE));
+		// Only the flags that change with the data are read from vhdmp, the rest is cached
+		status = DiskInfo_QueryFormat(parser->pVhdmpFileObject, &parser->DiskInfo, pBuffer);
 		if (!NT_SUCCESS(status))
-		{
-            LOG_PARSER(LL_ERROR, "Failed to retreive parser info. 0x%0X\n", status);
 			return status;
-		}
-		pRes->DiskFormat = Response.vals[0].dwLow;
-
-		Request.RequestCode = EDiskInfoType_Geometry;
-        status = SynchronouseCall(parser->pVhdmpFileObject, IOCTL_STORAGE_VHD_GET_INFORMATION,
-            &Request, sizeof(DISK_INFO_REQUEST), &Response, sizeof(DISK_INFO_RESPONSE));
-		if (!NT_SUCCESS(status))
-		{
-            LOG_PARSER(LL_ERROR, "Failed to retreive size info. 0x%0X\n", status);
-			return status;
-		}
-		pRes->dwBlockSize = Response.vals[2].dwLow;
-		pRes->qwDiskSize = Response.vals[1].qword;
-
-		Request.RequestCode = EDiskInfoType_LinkageId;
-        status = SynchronouseCall(parser->pVhdmpFileObject, IOCTL_STORAGE_VHD_GET_INFORMATION,
-            &Request, sizeof(DISK_INFO_REQUEST), &Response, sizeof(DISK_INFO_RESPONSE));
-		if (!NT_SUCCESS(status))
-		{
-            LOG_PARSER(LL_ERROR, "Failed to retreive linkage identifier. 0x%0X\n", status);
-			return status;
-		}
-		pRes->LinkageId = Response.guid;
-
-		Request.RequestCode = EDiskInfoType_InUseFlag;
-        status = SynchronouseCall(parser->pVhdmpFileObject, IOCTL_STORAGE_VHD_GET_INFORMATION,
-            &Request, sizeof(DISK_INFO_REQUEST), &Response, sizeof(DISK_INFO_RESPONSE));
-		if (!NT_SUCCESS(status))
-		{
-            LOG_PARSER(LL_ERROR, "Failed to retreive in use flag. 0x%0X\n", status);
-			return status;
-		}
-		pRes->bIsInUse = (BOOLEAN)Response.vals[0].dwLow;
-
-		Request.RequestCode = EDiskInfoType_IsFullyAllocated;
-        status = SynchronouseCall(parser->pVhdmpFileObject, IOCTL_STORAGE_VHD_GET_INFORMATION,
-            &Request, sizeof(DISK_INFO_REQUEST), &Response, sizeof(DISK_INFO_RESPONSE));
-		if (!NT_SUCCESS(status))
-		{
-            LOG_PARSER(LL_ERROR, "Failed to retreive fully allocated flag. 0x%0X\n", status);
-			return status;
-		}
-		pRes->bIsFullyAllocated = (BOOLEAN)Response.vals[0].dwLow;
-
-        Request.RequestCode = EDiskInfoType_PhysicalDisk;
-        status = SynchronouseCall(parser->pVhdmpFileObject, IOCTL_STORAGE_VHD_GET_INFORMATION,
-            &Request, sizeof(DISK_INFO_REQUEST), &Response, sizeof(DISK_INFO_RESPONSE));
-		if (!NT_SUCCESS(status))
-		{
-            LOG_PARSER(LL_ERROR, "Failed to retreive unk9 flag. 0x%0X\n", status);
-			return status;
-		}
-		pRes->IsRemote = (BOOLEAN)Response.vals[0].dwLow;
-
-        Request.RequestCode = EDiskInfoType_Page83Data;
-        status = SynchronouseCall(parser->pVhdmpFileObject, IOCTL_STORAGE_VHD_GET_INFORMATION,
-            &Request, sizeof(DISK_INFO_REQUEST), &Response, sizeof(DISK_INFO_RESPONSE));
-		if (!NT_SUCCESS(status))
-		{
-            LOG_PARSER(LL_ERROR, "Failed to retreive disk identifier. 0x%0X\n", status);
-			return status;
-		}
-		pRes->DiskIdentifier = Response.guid;
-
 		*pBufferSize = sizeof(DISK_INFO_FORMAT);
 	}
 	else if (EDiskInfo_Fragmentation == type)
@@ -739,16 +717,12 @@ NTSTATUS EVhd_QueryInformationDisk(PVOID pContext, EDiskInfoType type, INT unuse
 		if (*pBufferSize < sizeof(DISK_INFO_GEOMETRY))
 			return status = STATUS_BUFFER_TOO_SMALL;
 		DISK_INFO_GEOMETRY *pRes = pBuffer;
-        Request.RequestCode = EDiskInfoType_Geometry;
-        status = SynchronouseCall(parser->pVhdmpFileObject, IOCTL_STORAGE_VHD_GET_INFORMATION,
-            &Request, sizeof(DISK_INFO_REQUEST), &Response, sizeof(DISK_INFO_RESPONSE));
+		status = DiskInfo_QueryGeometry(parser->pVhdmpFileObject, &parser->DiskInfo, pRes);
 		if (!NT_SUCCESS(status))
 		{
             LOG_PARSER(LL_ERROR, "Failed to retreive size info. 0x%0X\n", status);
 			return status;
 		}
-		pRes->dwSectorSize = Response.vals[2].dwHigh;
-		pRes->qwDiskSize = Response.vals[0].qword;
 		pRes->dwNumSectors = parser->dwNumSectors;
 		*pBufferSize = sizeof(DISK_INFO_GEOMETRY);
 	}
@@ -826,6 +800,9 @@ NTSTATUS EVhd_SetBehaviourDisk(PVOID pContext, INT behaviour)
 	else
 		return STATUS_INVALID_DEVICE_REQUEST;
 
+    // The medium changes, responses kept for it are stale
+    if (parser->pExtension)
+        Ext_InvalidateResponses(parser->pExtension);
 	status = SynchronouseCall(parser->pVhdmpFileObject, IoControl, NULL, 0, NULL, 0);
     TRACE_FUNCTION_OUT_STATUS(status);
     return status;
@@ -3,6 +3,7 @@
 #include <ntifs.h>
 #include "Vstor.h"
 #include "cipher.h"
+#include "DiskInfo.h"
 
 typedef struct _PARSER_STATE {
 	ULONG64		qwUnk1;
@@ -28,9 +29,10 @@ typedef struct _ParserInstance {
 	PARSER_QOS_INFO	Qos;
 	ULONG32			dwDiskSaveSize;
 	INT				dwInnerBufferSize;
-	PIRP			pIrp;
-	ULONG_PTR		IoLock;
+	INT				dwTimingOffset;		// Offset of the SRB_TIMING in the inner buffer, 0 if requests are not timed
     PVOID           pExtension;
+    BOOLEAN         bPassThrough;		// Mounted without a cipher, requests are only counted by the extension
+    DISK_INFO_CACHE DiskInfo;
 } ParserInstance;
 
 /** Forward declaration of parser handler */
@@ -0,0 +1,188 @@
+#include "stdafx.h"
+#include "driver.h"
+#include "Ioctl.h"
+#include "Vstor.h"
+#include <initguid.h>
+#include "parser.h"
+#include "Control.h"
+#include "Log.h"
+#include "Dispatch.h"
+#include "Extension.h"
+#include "Catalog.h"
+#include "DiskStats.h"
+#include "IrpPool.h"
+#include "Vdrvroot.h"
+#include "Params.h"
+#include "ReadCache.h"
+
+// pretend to replace original vhdparser
+// {f916c826-f0f5-4cd9-be68-4fd638cf9a53}
+DEFINE_GUID(GUID_EVHD_PARSER_ID,
+	0xf916c826, 0xf0f5, 0x4cd9, 0xbe, 0x68, 0x4f, 0xd6, 0x38, 0xcf, 0x9a, 0x53);
+
+/** Driver unload routine */
+void EVhdDriverUnload(PDRIVER_OBJECT pDriverObject)
+{
+	UNREFERENCED_PARAMETER(pDriverObject);
+    Ext_Cleanup();
+    Catalog_Cleanup();
+    ReadCache_Cleanup();
+    Params_Cleanup();
+    Vdrvroot_Cleanup();
+    Log_Cleanup();
+    DPT_Cleanup();
+    DiskStats_Cleanup();
+    Flight_Cleanup();
+    IrpPool_Cleanup();
+}
+
+NTSTATUS DriverEntry(PDRIVER_OBJECT pDriverObject, PUNICODE_STRING pRegistryPath)
+{
+	NTSTATUS status = STATUS_SUCCESS;
+	VSTOR_PARSER_INFO ParserInfo = { 0 };
+	RTL_OSVERSIONINFOW VersionInfo = { 0 };
+    PDEVICE_OBJECT pDeviceObject = NULL;
+    EVHD_EXT_CAPABILITIES Caps;
+
+	VersionInfo.dwOSVersionInfoSize = sizeof(RTL_OSVERSIONINFOW);
+
+	status = RtlGetVersion(&VersionInfo);
+	if (!NT_SUCCESS(status))
+	{
+		DbgPrint("Failed to get windows version information: %X\n", status);
+		return status;
+	}
+
+	// This version of driver only supports Windows Server 2016
+	if (VersionInfo.dwMajorVersion != 10)
+	{
+		DbgPrint("Running on an unsupported platform: %d.%d.%d\n", VersionInfo.dwMajorVersion,
+			VersionInfo.dwMinorVersion, VersionInfo.dwBuildNumber);
+		return status = STATUS_NOT_SUPPORTED;
+	}
+
+    pDriverObject->DriverUnload = EVhdDriverUnload;
+    status = Ext_Initialize(&Caps);
+    if (!NT_SUCCESS(status))
+    {
+        DbgPrint("Failed to initialize extension: %X\n", status);
+        return status;
+    }
+
+    status = DPT_Initialize(pDriverObject, pRegistryPath, &pDeviceObject);
+    if (!NT_SUCCESS(status))
+    {
+        DbgPrint("Failed to initialize dispatch subsystem: %X\n", status);
+        goto CleanupExtension;
+    }
+
+	ParserInfo.dwSize								= sizeof(VSTOR_PARSER_INFO);
+	ParserInfo.dwVersion							= 1;
+	ParserInfo.ParserId								= GUID_EVHD_PARSER_ID;
+	ParserInfo.pDriverObject						= pDriverObject;
+	ParserInfo.pfnOpenDisk							= EVhdOpenDisk;
+	ParserInfo.pfnCloseDisk							= EVhdCloseDisk;
+	ParserInfo.pfnMountDisk							= EVhdMountDisk;
+	ParserInfo.pfnDismountDisk						= EVhdDismountDisk;
+	// Casts where a callback of the parser differs from the prototype in the parser table
+	ParserInfo.pfnQueryMountStatusDisk				= (ParserQueryMountStatusDisk_t)EVhdQueryMountStatusDisk;
+	ParserInfo.pfnExecuteScsiRequestDisk			= (ParserExecuteScsiRequestDisk_t)EVhdExecuteScsiRequestDisk;
+	ParserInfo.pfnQueryInformationDisk				= EVhdQueryInformationDisk;
+	ParserInfo.pfnQuerySaveVersionDisk				= EVhdQuerySaveVersionDisk;
+	ParserInfo.pfnSaveDisk							= EVhdSaveDisk;
+	ParserInfo.pfnRestoreDisk						= EVhdRestoreDisk;
+	ParserInfo.pfnSetBehaviourDisk					= (ParserSetBehaviourDisk_t)EVhdSetBehaviourDisk;
+	ParserInfo.pfnSetQoSPolicyDisk					= EVhdSetQosPolicyDisk;
+	ParserInfo.pfnGetQoSStatusDisk					= (ParserGetQosStatusDisk_t)EVhdGetQosStatusDisk;
+	ParserInfo.pfnChangeTrackingSetParameters		= EVhdChangeTrackingSetParameters;
+	ParserInfo.pfnChangeTrackingGetParameters		= EVhdChangeTrackingGetParameters;
+	ParserInfo.pfnChangeTrackingStart				= EVhdChangeTrackingStart;
+	ParserInfo.pfnChangeTrackingStop				= EVhdChangeTrackingStop;
+	ParserInfo.pfnChangeTrackingSwitchLogs			= (ParserChangeTrackingSwitchLogs_t)EVhdChangeTrackingSwitchLogs;
+	ParserInfo.pfnEnableResiliency					= EVhdEnableResiliency;
+	ParserInfo.pfnNotifyRecoveryStatus				= EVhdNotifyRecoveryStatus;
+	ParserInfo.pfnGetRecoveryStatus					= EVhdGetRecoveryStatus;
+	ParserInfo.pfnPrepareMetaOperation				= EVhdPrepareMetaOperation;
+	ParserInfo.pfnStartMetaOperation				= EVhdStartMetaOperation;
+	ParserInfo.pfnCancelMetaOperation				= EVhdCancelMetaOperation;
+	ParserInfo.pfnQueryMetaOperationProgress		= (MetaOperationCallback_t)EVhdQueryMetaOperationProgress;
+	ParserInfo.pfnCleanupMetaOperation				= EVhdCleanupMetaOperation;
+	ParserInfo.pfnDeleteSnapshot					= EVhdParserDeleteSnapshot;
+	ParserInfo.pfnQueryChanges						= (ParserQueryChanges_t)EVhdParserQueryChanges;
+
+    IrpPool_Initialize();
+
+    status = Log_Initialize(pDeviceObject, pRegistryPath);
+    if (!NT_SUCCESS(status))
+    {
+        DbgPrint("Log_Initialize failed with error: %X\n", status);
+        goto CleanupLog;
+    }
+
+    // Disks not in the catalog are still served through the key service
+    status = Catalog_Initialize(pRegistryPath);
+    if (!NT_SUCCESS(status))
+    {
+        DbgPrint("Catalog_Initialize failed with error: %X\n", status);
+    }
+
+    // The driver works without the flight recorder, it only records nothing
+    status = Flight_Initialize();
+    if (!NT_SUCCESS(status))
+    {
+        DbgPrint("Flight_Initialize failed with error: %X\n", status);
+    }
+
+    // Disks are served without counters, their snapshots are only empty
+    status = DiskStats_Initialize(pRegistryPath);
+    if (!NT_SUCCESS(status))
+    {
+        DbgPrint("DiskStats_Initialize failed with error: %X\n", status);
+    }
+
+    // Disks are still opened without the caches, they only read the shim and the parameters every time
+    status = Vdrvroot_Initialize(pDriverObject);
+    if (!NT_SUCCESS(status))
+    {
+        DbgPrint("Vdrvroot_Initialize failed with error: %X\n", status);
+    }
+
+    status = Params_Initialize(pDeviceObject, pRegistryPath);
+    if (!NT_SUCCESS(status))
+    {
+        DbgPrint("Params_Initialize failed with error: %X\n", status);
+    }
+
+    // Reads of encrypted disks are decrypted every time without it
+    status = ReadCache_Initialize(pRegistryPath);
+    if (!NT_SUCCESS(status))
+    {
+        DbgPrint("ReadCache_Initialize failed with error: %X\n", status);
+    }
+
+	status = VstorRegisterParser(&ParserInfo);
+	if (!NT_SUCCESS(status))
+	{
+		LOG_FUNCTION(LL_FATAL, LOG_CTG_GENERAL, "VstorRegisterParser failed with error: %X\n", status);
+		goto Cleanup;
+	}
+
+	return status;
+
+    // DriverUnload is not called when DriverEntry fails, the steps done so far are undone in reverse order
+Cleanup:
+    ReadCache_Cleanup();
+    Params_Cleanup();
+    Vdrvroot_Cleanup();
+    DiskStats_Cleanup();
+    Flight_Cleanup();
+    Catalog_Cleanup();
+CleanupLog:
+    // The flusher thread must be gone before the image is unloaded
+    Log_Cleanup();
+    IrpPool_Cleanup();
+    DPT_Cleanup();
+CleanupExtension:
+    Ext_Cleanup();
+    return status;
+}
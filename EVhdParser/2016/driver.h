@@ -0,0 +1,2 @@
+//#include <wdm.h>
+#include <ntifs.h>
@@ -3,6 +3,11 @@
 #include "parser.h"	  
 #include "Ioctl.h"
 #include "utils.h"	   
+#include "Extension.h"
+#include "ExtRequest.h"
+#include "IrpPool.h"
+#include "Params.h"
+#include "DiskStats.h"
 #include <fltKernel.h>
 
 #define LOG_PARSER(level, format, ...) LOG_FUNCTION(level, LOG_CTG_PARSER, format, __VA_ARGS__)
@@ -13,81 +18,45 @@ static const ULONG EvhdMetaOperationPoolTag = 'VVpm';
 
 static const SIZE_T QoSBufferSize = 0x470;
 
-extern PUNICODE_STRING g_pRegistryPath;
+/** Control request the caller's buffer is the system buffer of, several may be in flight at once */
+static NTSTATUS EvhdDirectIoControl(ParserInstance *parser, ULONG ControlCode, PVOID pSystemBuffer, ULONG InputBufferSize,
+	ULONG OutputBufferSize)
+{
+	return IrpPool_Call(parser->pVhdmpFileObject, ControlCode, pSystemBuffer, InputBufferSize, OutputBufferSize, NULL);
+}
 
-static NTSTATUS EvhdQueryBoolParameter(LPCWSTR lpszParameterName, BOOLEAN bDefaultValue, BOOLEAN *pResult)
+static NTSTATUS EvhdInitializeExtension(ParserInstance *parser, PGUID applicationId, PCUNICODE_STRING diskPath,
+	CTL_TIMING *pTiming)
 {
 	NTSTATUS status = STATUS_SUCCESS;
-	HANDLE KeyHandle = NULL, SubKeyHandle = NULL;
-	OBJECT_ATTRIBUTES ObjectAttributes = { 0 };
-	UNICODE_STRING SubKeyName, ValueName;
-	BOOLEAN Result = bDefaultValue;
-	KEY_VALUE_PARTIAL_INFORMATION KeyValueInformation;
-	ULONG ResultLength;
-
-	ObjectAttributes.Length = sizeof(OBJECT_ATTRIBUTES);
-	ObjectAttributes.ObjectName = g_pRegistryPath;
-	ObjectAttributes.Attributes = OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE;
-
-	status = ZwOpenKey(&KeyHandle, FILE_GENERIC_READ, &ObjectAttributes);
-	if (NT_SUCCESS(status))
+	GUID ParentId;
+	DISK_INFO Info;
+	LONG64 PhaseStart = DiskStats_PhaseStart();
+	status = DiskInfo_Fetch(parser->pVhdmpFileObject, &parser->DiskInfo, &Info);
+	DiskStats_PhaseEnd(pTiming, CTL_PHASE_OPEN_DISK_INFO, PhaseStart);
+	if (!NT_SUCCESS(status))
 	{
-		RtlInitUnicodeString(&SubKeyName, L"Parameters");
-		ObjectAttributes.RootDirectory = KeyHandle;
-		ObjectAttributes.ObjectName = &SubKeyName;
-		status = ZwOpenKey(&SubKeyHandle, FILE_GENERIC_READ, &ObjectAttributes);
-		if (NT_SUCCESS(status))
-		{
-			RtlInitUnicodeString(&ValueName, lpszParameterName);
-			if (NT_SUCCESS(ZwQueryValueKey(SubKeyHandle, &ValueName, KeyValuePartialInformation, &KeyValueInformation,
-				sizeof(KeyValueInformation), &ResultLength)))
-			{
-				if (ResultLength == sizeof(KeyValueInformation) &&
-					REG_DWORD == KeyValueInformation.Type &&
-					sizeof(ULONG32) == KeyValueInformation.DataLength)
-				{
-					Result = 0 != *(ULONG32 *)KeyValueInformation.Data;
-				}
-			}
-
-			ZwClose(SubKeyHandle);
-		}
-
-		ZwClose(KeyHandle);
+		LOG_PARSER(LL_FATAL, "Failed to retrieve disk information. 0x%0X\n", status);
+		return status;
 	}
-
-	*pResult = Result;
+	PhaseStart = DiskStats_PhaseStart();
+	status = Ext_Create(diskPath, applicationId, Info.DiskFormat, &Info.LinkageId, &parser->pExtension);
+	// Reads of a clone are shared with the other clones of its parent with the parent known
+	if (NT_SUCCESS(status) && parser->pExtension && DISK_INFO_TYPE_DIFFERENCING == Info.DiskType &&
+		NT_SUCCESS(DiskInfo_QueryParent(parser->pVhdmpFileObject, &ParentId)))
+		Ext_SetParent(parser->pExtension, &ParentId);
+	DiskStats_PhaseEnd(pTiming, CTL_PHASE_OPEN_EXTENSION, PhaseStart);
 	return status;
 }
 
-static NTSTATUS EvhdDirectIoControl(ParserInstance *parser, ULONG ControlCode, PVOID pSystemBuffer, ULONG InputBufferSize,
-	ULONG OutputBufferSize)
+static NTSTATUS EvhdFinalizeExtension(ParserInstance *parser)
 {
 	NTSTATUS status = STATUS_SUCCESS;
-	PDEVICE_OBJECT pDeviceObject = NULL;
-	KeEnterCriticalRegion();
-	FltAcquirePushLockExclusive(&parser->DirectIoPushLock);
-
-	IoReuseIrp(parser->pDirectIoIrp, STATUS_PENDING);
-	parser->pDirectIoIrp->Flags |= IRP_NOCACHE;
-	parser->pDirectIoIrp->Tail.Overlay.Thread = (PETHREAD)__readgsqword(0x188);		// Pointer to calling thread control block
-	parser->pDirectIoIrp->AssociatedIrp.SystemBuffer = pSystemBuffer;				// IO buffer for buffered control code
-	// fill stack frame parameters for synchronous IRP call
-	PIO_STACK_LOCATION pStackFrame = IoGetNextIrpStackLocation(parser->pDirectIoIrp);
-	pDeviceObject = IoGetRelatedDeviceObject(parser->pVhdmpFileObject);
-	pStackFrame->FileObject = parser->pVhdmpFileObject;
-	pStackFrame->DeviceObject = pDeviceObject;
-	pStackFrame->Parameters.DeviceIoControl.IoControlCode = ControlCode;
-	pStackFrame->Parameters.DeviceIoControl.InputBufferLength = InputBufferSize;
-	pStackFrame->Parameters.DeviceIoControl.OutputBufferLength = OutputBufferSize;
-	pStackFrame->MajorFunction = IRP_MJ_DEVICE_CONTROL;
-	pStackFrame->MinorFunction = 0;
-	pStackFrame->Flags = 0;
-	pStackFrame->Control = 0;
-	IoSynchronousCallDriver(pDeviceObject, parser->pDirectIoIrp);
-	status = parser->pDirectIoIrp->IoStatus.Status;
-	FltReleasePushLock(&parser->DirectIoPushLock);
-	KeLeaveCriticalRegion();
+	if (parser->pExtension)
+	{
+		status = Ext_Delete(parser->pExtension);
+		parser->pExtension = NULL;
+	}
 	return status;
 }
 
@@ -98,14 +67,6 @@ static NTSTATUS EvhdInitialize(HANDLE hFileHandle, PFILE_OBJECT pFileObject, Par
 	parser->pVhdmpFileObject = pFileObject;
 	parser->FileHandle = hFileHandle;
 	
-	/* Initialize Direct IO */
-	parser->pDirectIoIrp = IoAllocateIrp(IoGetRelatedDeviceObject(parser->pVhdmpFileObject)->StackSize, FALSE);
-	if (!parser->pDirectIoIrp)
-	{
-        LOG_PARSER(LL_FATAL, "IoAllocateIrp failed\n");
-		return STATUS_INSUFFICIENT_RESOURCES;
-	}
-	
 	/* Initialize QoS */
 	parser->pQoSStatusIrp = IoAllocateIrp(IoGetRelatedDeviceObject(parser->pVhdmpFileObject)->StackSize, FALSE);
 	if (!parser->pQoSStatusIrp)
@@ -138,6 +99,8 @@ static NTSTATUS EvhdInitialize(HANDLE hFileHandle, PFILE_OBJECT pFileObject, Par
 
 static VOID EvhdFinalize(ParserInstance *parser)
 {
+	EvhdFinalizeExtension(parser);
+
 	if (parser->pRecoveryStatusIrp)
 	{
 		IoCancelIrp(parser->pRecoveryStatusIrp);
@@ -146,12 +109,6 @@ static VOID EvhdFinalize(ParserInstance *parser)
 		parser->pRecoveryStatusIrp = NULL;
 	}
 
-	if (parser->pDirectIoIrp)
-	{
-		IoFreeIrp(parser->pDirectIoIrp);
-		parser->pDirectIoIrp = NULL;
-	}
-
 	if (parser->pQoSStatusIrp)
 	{
 		IoFreeIrp(parser->pQoSStatusIrp);
@@ -177,8 +134,28 @@ static VOID EvhdFinalize(ParserInstance *parser)
 	}
 }
 
+/** Stage timestamps of a request, they follow the vhdmp extension in the inner buffer */
+static __inline SRB_TIMING *EvhdGetTiming(ParserInstance *parser, STORVSP_REQUEST *pVspRequest)
+{
+	if (!parser->dwTimingOffset)
+		return NULL;
+	return (SRB_TIMING *)((UCHAR *)(pVspRequest + 1) + parser->dwTimingOffset);
+}
+
+/** Stamps the hand back of a timed request to the VSP and counts its stages, the request is still ours */
+static VOID EvhdCompleteTiming(ParserInstance *parser, STORVSP_REQUEST *pVspRequest)
+{
+	SRB_TIMING *pTiming = EvhdGetTiming(parser, pVspRequest);
+	if (pTiming)
+	{
+		Ext_StampRequest(pTiming, SRB_STAMP_VSTOR_COMPLETE);
+		Ext_CompleteTiming(parser->pExtension, pTiming);
+	}
+}
+
 static void EvhdPostProcessScsiPacket(SCSI_PACKET *pPacket, NTSTATUS status)
 {
+	ULONG RequestLength = pPacket->pVscRequest->DataTransferLength;
 	pPacket->pVscRequest->SrbStatus = pPacket->pVspRequest->Srb.SrbStatus;
     pPacket->pVscRequest->ScsiStatus = pPacket->pVspRequest->Srb.ScsiStatus;
     pPacket->pVscRequest->SenseInfoBufferLength = pPacket->pVspRequest->Srb.SenseInfoBufferLength;
@@ -197,11 +174,24 @@ static void EvhdPostProcessScsiPacket(SCSI_PACKET *pPacket, NTSTATUS status)
 			break;
 		}
 	}
+
+	ParserInstance *parser = pPacket->pVspRequest->pContext;
+	// Answered from the response cache or failed by the extension, it counted the completion
+	if (STATUS_ALREADY_COMPLETE == status)
+		return;
+	if (parser->bPassThrough)
+		Ext_CompletePlainRequest(parser->pExtension, &pPacket->pVspRequest->Srb, RequestLength, status);
+	else if (parser->pExtension)
+		Ext_CompleteVstorRequest(parser->pExtension, pPacket->pVspRequest, pPacket->pVscRequest, &pPacket->pMdl,
+			EvhdGetTiming(parser, pPacket->pVspRequest), RequestLength, status);
 }
 
 NTSTATUS EvhdCompleteScsiRequest(SCSI_PACKET *pPacket, NTSTATUS status)
 {
+	ParserInstance *parser = pPacket->pVspRequest->pContext;
+	Ext_StampRequest(EvhdGetTiming(parser, pPacket->pVspRequest), SRB_STAMP_VHDMP_COMPLETE);
 	EvhdPostProcessScsiPacket(pPacket, status);
+	EvhdCompleteTiming(parser, pPacket->pVspRequest);
 	return VstorCompleteScsiRequest(pPacket);
 }
 
@@ -215,9 +205,21 @@ NTSTATUS EvhdSendMediaNotification(void *param1)
 	return VstorSendMediaNotification(param1);
 }
 
-static NTSTATUS EvhdRegisterIo(ParserInstance *parser, BOOLEAN flag1, BOOLEAN flag2, PGUID pSnapshotId)
+static NTSTATUS EvhdRegisterIo(ParserInstance *parser, BOOLEAN flag1, BOOLEAN flag2, PGUID pSnapshotId,
+	CTL_TIMING *pTiming)
 {
 	NTSTATUS status = STATUS_SUCCESS;
+	LONG64 PhaseStart = 0;
+
+	if (parser->pExtension)
+	{
+		PhaseStart = DiskStats_PhaseStart();
+		status = Ext_Mount(parser->pExtension);
+		DiskStats_PhaseEnd(pTiming, CTL_PHASE_MOUNT_KEY, PhaseStart);
+		if (!NT_SUCCESS(status))
+			return status;
+		parser->bPassThrough = Ext_IsPassThrough(parser->pExtension);
+	}
 
 	if (!parser->bIoRegistered)
 	{
@@ -228,15 +230,18 @@ static NTSTATUS EvhdRegisterIo(ParserInstance *parser, BOOLEAN flag1, BOOLEAN fl
 		request.dwVersion = 1;
 		request.dwFlags = flag1 ? 9 : 8;
 		if (flag2) request.wFlags |= 0x1;
-        request.SnapshotId = *pSnapshotId;
+		if (pSnapshotId)
+			request.SnapshotId = *pSnapshotId;
 		request.pfnCompleteScsiRequest = &EvhdCompleteScsiRequest;
 		request.pfnSendMediaNotification = &EvhdSendMediaNotification;
 		request.pfnSendNotification = &EvhdSendNotification;
 		request.pVstorInterface = parser->pVstorInterface;
 		request.wMountFlags = parser->wMountFlags;
 
+        PhaseStart = DiskStats_PhaseStart();
         status = SynchronouseCall(parser->pVhdmpFileObject, IOCTL_STORAGE_REGISTER_IO, &request, sizeof(REGISTER_IO_REQUEST),
             &response, sizeof(REGISTER_IO_RESPONSE));
+        DiskStats_PhaseEnd(pTiming, CTL_PHASE_MOUNT_REGISTER_IO, PhaseStart);
 
 		if (!NT_SUCCESS(status))
 		{
@@ -247,9 +252,18 @@ static NTSTATUS EvhdRegisterIo(ParserInstance *parser, BOOLEAN flag1, BOOLEAN fl
 		parser->bIoRegistered = TRUE;
 		parser->dwDiskSaveSize = response.dwDiskSaveSize;
         parser->dwInnerBufferSize = sizeof(PARSER_STATE) + response.dwExtensionBufferSize;
+		parser->dwTimingOffset = 0;
+		if (parser->pExtension && Ext_TimingSize())
+		{
+			// Stage timestamps are kept after everything vhdmp uses, 8 byte aligned
+			parser->dwTimingOffset = (parser->dwInnerBufferSize + 7) & ~7;
+			parser->dwInnerBufferSize = parser->dwTimingOffset + Ext_TimingSize();
+		}
 		parser->Io = response.Io;
 
+		PhaseStart = DiskStats_PhaseStart();
 		status = SynchronouseCall(parser->pVhdmpFileObject, IOCTL_SCSI_GET_ADDRESS, NULL, 0, &scsiAddressResponse, sizeof(SCSI_ADDRESS));
+		DiskStats_PhaseEnd(pTiming, CTL_PHASE_MOUNT_ADDRESS, PhaseStart);
 
 		if (!NT_SUCCESS(status))
 		{
@@ -265,9 +279,10 @@ static NTSTATUS EvhdRegisterIo(ParserInstance *parser, BOOLEAN flag1, BOOLEAN fl
 	return status;
 }
 
-static NTSTATUS EvhdUnregisterIo(ParserInstance *parser)
+static NTSTATUS EvhdUnregisterIo(ParserInstance *parser, CTL_TIMING *pTiming)
 {
 	NTSTATUS status = STATUS_SUCCESS;
+	LONG64 PhaseStart = 0;
 
 	if (parser->bIoRegistered)
 	{
@@ -279,7 +294,9 @@ static NTSTATUS EvhdUnregisterIo(ParserInstance *parser)
 		} RemoveVhdRequest = { 1 };
 #pragma pack(pop)
 
+		PhaseStart = DiskStats_PhaseStart();
 		EvhdDirectIoControl(parser, IOCTL_STORAGE_REMOVE_VIRTUAL_DISK, &RemoveVhdRequest, sizeof(RemoveVhdRequest), 0);
+		DiskStats_PhaseEnd(pTiming, CTL_PHASE_DISMOUNT_REMOVE, PhaseStart);
 
 		parser->bIoRegistered = FALSE;
 		parser->Io.pIoInterface = NULL;
@@ -290,6 +307,14 @@ static NTSTATUS EvhdUnregisterIo(ParserInstance *parser)
 		parser->dwInnerBufferSize = 0;
 	}
 
+	if (parser->pExtension)
+	{
+		parser->bPassThrough = FALSE;
+		PhaseStart = DiskStats_PhaseStart();
+		status = Ext_Dismount(parser->pExtension);
+		DiskStats_PhaseEnd(pTiming, CTL_PHASE_DISMOUNT_EXTENSION, PhaseStart);
+	}
+
 	return status;
 }
 
@@ -300,6 +325,9 @@ NTSTATUS EVhdOpenDisk(PCUNICODE_STRING diskPath, ULONG32 OpenFlags, GUID *pVmId,
 	HANDLE FileHandle = NULL;
 	ParserInstance *parser = NULL;
 	RESILIENCY_INFO_EA vmInfo = { 0 };
+	EVHD_PARAMETERS Parameters;
+	CTL_TIMING Timing = { 0 };
+	LONG64 OpenStart = DiskStats_PhaseStart(), PhaseStart = 0;
 
 	if (pVmId)
 	{
@@ -309,7 +337,7 @@ NTSTATUS EVhdOpenDisk(PCUNICODE_STRING diskPath, ULONG32 OpenFlags, GUID *pVmId,
 		strncpy(vmInfo.EaName, OPEN_FILE_RESILIENCY_INFO_EA_NAME, sizeof(vmInfo.EaName));
 		vmInfo.EaValue = *pVmId;
 	}
-	status = OpenVhdmpDevice(&FileHandle, OpenFlags, &pFileObject, diskPath, pVmId ? &vmInfo : NULL);
+	status = OpenVhdmpDevice(&FileHandle, OpenFlags, &pFileObject, diskPath, pVmId ? &vmInfo : NULL, &Timing);
 	if (!NT_SUCCESS(status))
 	{
         LOG_PARSER(LL_FATAL, "Failed to open vhdmp device for virtual disk file %S\n", diskPath->Buffer);
@@ -325,16 +353,30 @@ NTSTATUS EVhdOpenDisk(PCUNICODE_STRING diskPath, ULONG32 OpenFlags, GUID *pVmId,
 	}
 
 	memset(parser, 0, sizeof(ParserInstance));
+	DiskInfo_Initialize(&parser->DiskInfo);
 
+	PhaseStart = DiskStats_PhaseStart();
 	status = EvhdInitialize(FileHandle, pFileObject, parser);
 
 	if (!NT_SUCCESS(status))
+	{
+		DiskStats_PhaseEnd(&Timing, CTL_PHASE_OPEN_INITIALIZE, PhaseStart);
 		goto failure_cleanup;
+	}
 
 	parser->wMountFlags = OpenFlags & 0x40 ? 4 : OpenFlags & 1;	// 4 - ignore SCSI_SYNCHRONIZE_CACHE opcodes, 1 - read only mount
-	EvhdQueryBoolParameter(L"FastPause", TRUE, &parser->bFastPause);
-	EvhdQueryBoolParameter(L"FastClose", TRUE, &parser->bFastClose);
+	Params_Query(&Parameters);
+	parser->bFastPause = Parameters.bFastPause;
+	parser->bFastClose = Parameters.bFastClose;
 	parser->pVstorInterface = vstorInterface;
+	DiskStats_PhaseEnd(&Timing, CTL_PHASE_OPEN_INITIALIZE, PhaseStart);
+
+	status = EvhdInitializeExtension(parser, pVmId, diskPath, &Timing);
+	if (!NT_SUCCESS(status))
+	{
+		LOG_PARSER(LL_FATAL, "EvhdInitializeExtension failed with error 0x%08X\n", status);
+		goto failure_cleanup;
+	}
 
 	*ppOutParser = parser;
 
@@ -349,9 +391,19 @@ failure_cleanup:
 	if (parser)
 	{
 		EVhdCloseDisk(parser);
+		parser = NULL;
 	}
 
 cleanup:
+	// A failed open is counted without a disk, its extension is gone
+	DiskStats_PhaseEnd(&Timing, CTL_PHASE_OPEN, OpenStart);
+	Ext_RecordControl(parser ? parser->pExtension : NULL, &Timing, CTL_PHASE_OPEN, CTL_PHASE_OPEN_EXTENSION);
+	LOG_PARSER(LL_INFO, "Open of %S took %I64u us (0x%08X): shim %I64u, create %I64u, differencing %I64u, "
+		"initialize %I64u, disk info %I64u, extension %I64u us", diskPath->Buffer,
+		Timing.Time[CTL_PHASE_OPEN] / 10, status, Timing.Time[CTL_PHASE_OPEN_FIND_SHIM] / 10,
+		Timing.Time[CTL_PHASE_OPEN_CREATE] / 10, Timing.Time[CTL_PHASE_OPEN_DIFFERENCING] / 10,
+		Timing.Time[CTL_PHASE_OPEN_INITIALIZE] / 10, Timing.Time[CTL_PHASE_OPEN_DISK_INFO] / 10,
+		Timing.Time[CTL_PHASE_OPEN_EXTENSION] / 10);
 	return status;
 }
 
@@ -359,7 +411,7 @@ VOID EVhdCloseDisk(ParserInstance *parser)
 {
 	if (parser->bMounted)
 	{
-		EvhdUnregisterIo(parser);
+		EvhdUnregisterIo(parser, NULL);
 		parser->bMounted = FALSE;
 	}
 	EvhdFinalize(parser);
@@ -368,12 +420,16 @@ VOID EVhdCloseDisk(ParserInstance *parser)
 NTSTATUS EVhdMountDisk(ParserInstance *parser, UCHAR flags, PGUID pUnkGuid, __out PARSER_MOUNT_INFO *mountInfo)
 {
 	NTSTATUS status = STATUS_SUCCESS;
+	CTL_TIMING Timing = { 0 };
+	LONG64 MountStart = DiskStats_PhaseStart();
 
-	status = EvhdRegisterIo(parser, flags & 1, (flags >> 1) & 1, pUnkGuid);
+	status = EvhdRegisterIo(parser, flags & 1, (flags >> 1) & 1, pUnkGuid, &Timing);
+	DiskStats_PhaseEnd(&Timing, CTL_PHASE_MOUNT, MountStart);
+	Ext_RecordControl(parser->pExtension, &Timing, CTL_PHASE_MOUNT, CTL_PHASE_MOUNT_ADDRESS);
 	if (!NT_SUCCESS(status))
 	{
         LOG_PARSER(LL_FATAL, "EvhdRegisterIo failed with error 0x%0x\n", status);
-		EvhdUnregisterIo(parser);
+		EvhdUnregisterIo(parser, NULL);
 		return status;
 	}
 	parser->bMounted = TRUE;
@@ -388,9 +444,13 @@ NTSTATUS EVhdMountDisk(ParserInstance *parser, UCHAR flags, PGUID pUnkGuid, __ou
 NTSTATUS EVhdDismountDisk(ParserInstance *parser)
 {
 	NTSTATUS status = STATUS_SUCCESS;
+	CTL_TIMING Timing = { 0 };
+	LONG64 DismountStart = DiskStats_PhaseStart();
 
-	status = EvhdUnregisterIo(parser);
+	status = EvhdUnregisterIo(parser, &Timing);
 	parser->bMounted = FALSE;
+	DiskStats_PhaseEnd(&Timing, CTL_PHASE_DISMOUNT, DismountStart);
+	Ext_RecordControl(parser->pExtension, &Timing, CTL_PHASE_DISMOUNT, CTL_PHASE_DISMOUNT_EXTENSION);
 	return status;
 }
 
@@ -416,6 +476,9 @@ NTSTATUS EVhdExecuteScsiRequestDisk(ParserInstance *parser, SCSI_PACKET *pPacket
     STORVSC_REQUEST *pVscRequest = pPacket->pVscRequest;
 	PMDL pMdl = pPacket->pMdl;
     SCSI_OP_CODE opCode = (UCHAR)pVscRequest->Sense.Cdb6.OpCode;
+	SRB_TIMING *pTiming = EvhdGetTiming(parser, pVspRequest);
+	if (pTiming)
+		SrbTiming_Start(pTiming, ReadTimeStampCounter());
     memset(&pVspRequest->Srb, 0, SCSI_REQUEST_BLOCK_SIZE);
 	pVspRequest->pContext = parser;
 	pVspRequest->Srb.Length = SCSI_REQUEST_BLOCK_SIZE;
@@ -458,15 +521,40 @@ NTSTATUS EVhdExecuteScsiRequestDisk(ParserInstance *parser, SCSI_PACKET *pPacket
 		break;
 	}
 
-	if (NT_SUCCESS(status))
-        status = parser->Io.pfnStartIo(parser->Io.pIoInterface, pPacket, pVspRequest, pMdl, pPacket->bUnkFlag,
-		pPacket->bUseInternalSenseBuffer ? &pPacket->Sense : NULL);
-	else
+	// Plaintext disks skip the extension packet, they only need the request counted
+	if (NT_SUCCESS(status) && parser->bPassThrough)
+		status = Ext_StartPlainRequest(parser->pExtension, &pVspRequest->Srb, pTiming);
+	else if (NT_SUCCESS(status) && parser->pExtension)
+	{
+		EVHD_EXT_SCSI_PACKET ExtPacket;
+		ExtPacket.pMdl = pMdl;
+		ExtPacket.pSenseBuffer = &pPacket->Sense;
+		ExtPacket.SenseBufferLength = pVspRequest->Srb.SenseInfoBufferLength;
+		ExtPacket.Srb = &pVspRequest->Srb;
+		ExtPacket.pTiming = pTiming;
+		ExtPacket.RequestLength = pVscRequest->DataTransferLength;
+		ExtPacket.bReadAheadSent = FALSE;
+		status = Ext_StartScsiRequest(parser->pExtension, &ExtPacket);
+		pPacket->pMdl = ExtPacket.pMdl;
+	}
+
+	// STATUS_ALREADY_COMPLETE: answered from the response cache of the disk or failed by the extension, vhdmp never sees it
+	if (NT_SUCCESS(status) && STATUS_ALREADY_COMPLETE != status)
+	{
+		Ext_StampRequest(pTiming, SRB_STAMP_START_IO);
+		status = parser->Io.pfnStartIo(parser->Io.pIoInterface, pPacket, pVspRequest, pPacket->pMdl, pPacket->bUnkFlag,
+			pPacket->bUseInternalSenseBuffer ? &pPacket->Sense : NULL);
+		// Completed by vhdmp on this thread
+		if (STATUS_PENDING != status)
+			Ext_StampRequest(pTiming, SRB_STAMP_VHDMP_COMPLETE);
+	}
+	else if (!NT_SUCCESS(status))
         pVscRequest->SrbStatus = SRB_STATUS_INTERNAL_ERROR;
 
 	if (STATUS_PENDING != status)
 	{
 		EvhdPostProcessScsiPacket(pPacket, status);
+		EvhdCompleteTiming(parser, pVspRequest);
 		status = VstorCompleteScsiRequest(pPacket);
 	}
 
@@ -487,90 +575,10 @@ NTSTATUS EVhdQueryInformationDisk(ParserInstance *parser, EDiskInfoType type, IN
 		ASSERT(0x38 == sizeof(DISK_INFO_FORMAT));
         if (*pBufferSize < sizeof(DISK_INFO_FORMAT))
 			return status = STATUS_BUFFER_TOO_SMALL;
-        DISK_INFO_FORMAT *pRes = pBuffer;
-        memset(pBuffer, 0, sizeof(DISK_INFO_FORMAT));
-
-		Request.RequestCode = EDiskInfoType_Type;
-		status = SynchronouseCall(parser->pVhdmpFileObject, IOCTL_STORAGE_VHD_GET_INFORMATION,
-            &Request, sizeof(DISK_INFO_REQUEST), &Response, sizeof(DISK_INFO_RESPONSE));
-		if (!NT_SUCCESS(status))
-		{
-            LOG_PARSER(LL_FATAL, "Failed to retrieve disk type. 0x%0X\n", status);
-			return status;
-		}
-		pRes->DiskType = Response.vals[0].dwLow;
-
-        Request.RequestCode = EDiskInfoType_ParserInfo;
-        status = SynchronouseCall(parser->pVhdmpFileObject, IOCTL_STORAGE_VHD_GET_INFORMATION,
-            &Request, sizeof(DISK_INFO_REQUEST), &Response, sizeof(DISK_INFO_RESPONSE));
-		if (!NT_SUCCESS(status))
-		{
-            LOG_PARSER(LL_FATAL, "Failed to retrieve parser info. 0x%0X\n", status);
-			return status;
-		}
-		pRes->DiskFormat = Response.vals[0].dwLow;
-
-        Request.RequestCode = EDiskInfoType_Geometry;
-        status = SynchronouseCall(parser->pVhdmpFileObject, IOCTL_STORAGE_VHD_GET_INFORMATION,
-            &Request, sizeof(DISK_INFO_REQUEST), &Response, sizeof(DISK_INFO_RESPONSE));
-		if (!NT_SUCCESS(status))
-		{
-            LOG_PARSER(LL_FATAL, "Failed to retrieve size info. 0x%0X\n", status);
-			return status;
-		}
-		pRes->dwBlockSize = Response.vals[2].dwLow;
-		pRes->qwDiskSize = Response.vals[1].qword;
-
-        Request.RequestCode = EDiskInfoType_LinkageId;
-        status = SynchronouseCall(parser->pVhdmpFileObject, IOCTL_STORAGE_VHD_GET_INFORMATION,
-            &Request, sizeof(DISK_INFO_REQUEST), &Response, sizeof(DISK_INFO_RESPONSE));
+		// Only the flags that change with the data are read from vhdmp, the rest is cached
+		status = DiskInfo_QueryFormat(parser->pVhdmpFileObject, &parser->DiskInfo, pBuffer);
 		if (!NT_SUCCESS(status))
-		{
-            LOG_PARSER(LL_FATAL, "Failed to retrieve linkage identifier. 0x%0X\n", status);
 			return status;
-		}
-		pRes->LinkageId = Response.guid;
-
-        Request.RequestCode = EDiskInfoType_InUseFlag;
-        status = SynchronouseCall(parser->pVhdmpFileObject, IOCTL_STORAGE_VHD_GET_INFORMATION,
-            &Request, sizeof(DISK_INFO_REQUEST), &Response, sizeof(DISK_INFO_RESPONSE));
-		if (!NT_SUCCESS(status))
-		{
-            LOG_PARSER(LL_FATAL, "Failed to retrieve in use flag. 0x%0X\n", status);
-			return status;
-		}
-		pRes->bIsInUse = (BOOLEAN)Response.vals[0].dwLow;
-
-        Request.RequestCode = EDiskInfoType_IsFullyAllocated;
-        status = SynchronouseCall(parser->pVhdmpFileObject, IOCTL_STORAGE_VHD_GET_INFORMATION,
-            &Request, sizeof(DISK_INFO_REQUEST), &Response, sizeof(DISK_INFO_RESPONSE));
-		if (!NT_SUCCESS(status))
-		{
-            LOG_PARSER(LL_FATAL, "Failed to retrieve fully allocated flag. 0x%0X\n", status);
-			return status;
-		}
-		pRes->bIsFullyAllocated = (BOOLEAN)Response.vals[0].dwLow;
-
-        Request.RequestCode = EDiskInfoType_PhysicalDisk;
-        status = SynchronouseCall(parser->pVhdmpFileObject, IOCTL_STORAGE_VHD_GET_INFORMATION,
-            &Request, sizeof(DISK_INFO_REQUEST), &Response, sizeof(DISK_INFO_RESPONSE));
-		if (!NT_SUCCESS(status))
-		{
-            LOG_PARSER(LL_FATAL, "Failed to retrieve unk9 flag. 0x%0X\n", status);
-			return status;
-		}
-		pRes->IsRemote = (BOOLEAN)Response.vals[0].dwLow;
-
-        Request.RequestCode = EDiskInfoType_Page83Data;
-        status = SynchronouseCall(parser->pVhdmpFileObject, IOCTL_STORAGE_VHD_GET_INFORMATION,
-            &Request, sizeof(DISK_INFO_REQUEST), &Response, sizeof(DISK_INFO_RESPONSE));
-		if (!NT_SUCCESS(status))
-		{
-            LOG_PARSER(LL_FATAL, "Failed to retrieve disk identifier. 0x%0X\n", status);
-			return status;
-		}
-		pRes->DiskIdentifier = Response.guid;
-
         *pBufferSize = sizeof(DISK_INFO_FORMAT);
 	}
 	else if (EDiskInfo_Fragmentation == type)
@@ -648,16 +656,12 @@ NTSTATUS EVhdQueryInformationDisk(ParserInstance *parser, EDiskInfoType type, IN
         if (*pBufferSize < sizeof(DISK_INFO_GEOMETRY))
 			return status = STATUS_BUFFER_TOO_SMALL;
         DISK_INFO_GEOMETRY *pRes = pBuffer;
-        Request.RequestCode = EDiskInfoType_Geometry;
-        status = SynchronouseCall(parser->pVhdmpFileObject, IOCTL_STORAGE_VHD_GET_INFORMATION,
-            &Request, sizeof(DISK_INFO_REQUEST), &Response, sizeof(DISK_INFO_RESPONSE));
+		status = DiskInfo_QueryGeometry(parser->pVhdmpFileObject, &parser->DiskInfo, pRes);
 		if (!NT_SUCCESS(status))
 		{
             LOG_PARSER(LL_FATAL, "Failed to retrieve size info. 0x%0X\n", status);
 			return status;
 		}
-		pRes->dwSectorSize = Response.vals[2].dwHigh;
-		pRes->qwDiskSize = Response.vals[0].qword;
         Request.RequestCode = EDiskInfoType_NumSectors;
         status = SynchronouseCall(parser->pVhdmpFileObject, IOCTL_STORAGE_VHD_GET_INFORMATION,
             &Request, sizeof(DISK_INFO_REQUEST), &Response, sizeof(DISK_INFO_RESPONSE));
@@ -728,6 +732,9 @@ static NTSTATUS EvhdSetCachePolicy(ParserInstance *parser, BOOLEAN bEnable)
 
 NTSTATUS EVhdSetBehaviourDisk(ParserInstance *parser, INT behaviour, BOOLEAN *enableCache, INT param)
 {
+	// The medium changes, responses kept for it are stale
+	if ((0x40000001 == behaviour || 0x40000002 == behaviour) && parser->pExtension)
+		Ext_InvalidateResponses(parser->pExtension);
 	switch (behaviour)
 	{
 	case 0x40000001:
@@ -964,7 +971,7 @@ NTSTATUS EVhdPrepareMetaOperation(ParserInstance *parser, MetaOperationBuffer *p
 	pOperation->pfnCompletionRoutine = pfnCompletionCb;
 	pOperation->pParser = parser;
 	pOperation->pInterface = pInterface;
-	pOperation->pIrp = IoAllocateIrp(IoGetRelatedDeviceObject(parser->pVhdmpFileObject)->StackSize, FALSE);
+	pOperation->pIrp = IrpPool_Allocate(IoGetRelatedDeviceObject(parser->pVhdmpFileObject));
 	pOperation->pBuffer = pBuffer;
 	if (!pOperation->pIrp)
 	{
@@ -979,6 +986,10 @@ static NTSTATUS EvhdMetaOperationCompletionRoutine(PDEVICE_OBJECT DeviceObject,
 {
 	UNREFERENCED_PARAMETER(DeviceObject);
 	MetaOperation *pOperation = (MetaOperation *)pContext;
+	// Queries made while the operation ran may have cached the disk as it was before
+	DiskInfo_Invalidate(&pOperation->pParser->DiskInfo);
+	if (pOperation->pParser->pExtension)
+		Ext_InvalidateResponses(pOperation->pParser->pExtension);
 	pOperation->pBuffer->Status = pIrp->IoStatus;
 	pOperation->pfnCompletionRoutine(pOperation->pInterface);
 	return STATUS_MORE_PROCESSING_REQUIRED;
@@ -1050,6 +1061,9 @@ static NTSTATUS EvhdSetSnapshot(MetaOperation *pOperation, META_OPERATION_CREATE
 NTSTATUS EVhdStartMetaOperation(MetaOperation *pOperation)
 {
 	PVOID pRequest = (PUCHAR)pOperation->pBuffer + sizeof(MetaOperationBuffer);
+	DiskInfo_Invalidate(&pOperation->pParser->DiskInfo);
+	if (pOperation->pParser->pExtension)
+		Ext_InvalidateResponses(pOperation->pParser->pExtension);
 	switch (pOperation->pBuffer->Type)
 	{
 	case EMetaOperation_Snapshot:
@@ -1098,7 +1112,10 @@ NTSTATUS EVhdCleanupMetaOperation(MetaOperation *pOperation)
 		// O RLY?
 		if (pOperation->pBuffer)
 			ExFreePoolWithTag(pOperation->pBuffer, EvhdPoolTag);
-		IoFreeIrp(pOperation->pIrp);
+		// The pool reuses the IRP, the system buffer of the operation has to go first
+		if (pOperation->pIrp->Flags & IRP_BUFFERED_IO)
+			ExFreePoolWithTag(pOperation->pIrp->AssociatedIrp.SystemBuffer, EvhdPoolTag);
+		IrpPool_Free(pOperation->pIrp);
 	}
 	ExFreePoolWithTag(pOperation, EvhdPoolTag);
     return STATUS_SUCCESS;
@@ -3,6 +3,7 @@
 #include <ntifs.h>
 #include "Vstor.h"
 #include "cipher.h"
+#include "DiskInfo.h"
 
 typedef struct _PARSER_STATE {
     ULONG64		qwUnk1;
@@ -27,9 +28,6 @@ typedef struct _ParserInstance {
 	ULONG32			dwDiskSaveSize;
 	ULONG32			dwInnerBufferSize;
 	
-	PIRP			pDirectIoIrp;
-	EX_PUSH_LOCK	DirectIoPushLock;
-
 	PIRP			pQoSStatusIrp;
 	PVOID			pQoSStatusBuffer;
 	QoSStatusCompletionRoutine pfnQoSStatusCallback;
@@ -43,6 +41,11 @@ typedef struct _ParserInstance {
 
 	USHORT			wMountFlags;
 
+	INT				dwTimingOffset;		// Offset of the SRB_TIMING in the inner buffer, 0 if requests are not timed
+	PVOID			pExtension;
+	BOOLEAN			bPassThrough;		// Mounted without a cipher, requests are only counted by the extension
+	DISK_INFO_CACHE	DiskInfo;
+
 } ParserInstance;
 
 /** Forward declaration of parser handler functions */
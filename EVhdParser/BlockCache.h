@@ -0,0 +1,323 @@
+#pragma once
+/*
+ * Scan resistant cache of fixed size blocks with the 2Q policy. A block read
+ * for the first time enters a FIFO holding a quarter of the cache, and only
+ * its key stays in a ghost list once it leaves it. A block filled again while
+ * its key is remembered enters an LRU list of the blocks read more than once,
+ * so a scan passes through the FIFO and does not push the hot blocks out.
+ *
+ * Blocks are keyed by a disk and a block number. The owner provides the
+ * buffers through pfnAllocate and takes them back through pfnRelease, a
+ * buffer dropped to make room for a fill is reused for it. Invalidations
+ * stamp a small table indexed by the hash of the block: a read that started
+ * before the last invalidation of its slot does not fill the block, it may
+ * have read the data a write is replacing.
+ * The caller serializes all calls. Plain C, evhdtool replays traces with it.
+ */
+#include "PortableTypes.h"
+
+#define BLOCK_CACHE_NIL             0xFFFFFFFF
+
+/* Lists of the nodes */
+#define BLOCK_CACHE_FREE            0
+#define BLOCK_CACHE_IN              1   /* Read once, FIFO */
+#define BLOCK_CACHE_HOT             2   /* Read again, LRU */
+#define BLOCK_CACHE_GHOST           3   /* Keys of the blocks that left the FIFO, FIFO */
+#define BLOCK_CACHE_LISTS           4
+
+typedef struct _BLOCK_CACHE_NODE {
+    ULONG64 Disk;
+    ULONG64 Block;
+    /* NULL for ghosts and free nodes */
+    VOID *pData;
+    ULONG32 Prev;
+    ULONG32 Next;
+    ULONG32 HashNext;
+    ULONG32 List;
+} BLOCK_CACHE_NODE;
+
+typedef VOID *(*BLOCK_CACHE_ALLOCATE)(VOID *pContext);
+typedef VOID (*BLOCK_CACHE_RELEASE)(VOID *pContext, VOID *pData);
+
+typedef struct _BLOCK_CACHE {
+    BLOCK_CACHE_NODE *pNodes;
+    ULONG32 NodeCount;
+    /* Blocks the nodes are sized for, and blocks kept at most */
+    ULONG32 Capacity;
+    ULONG32 Limit;
+    /* Power of two sized */
+    ULONG32 *pBuckets;
+    ULONG32 BucketMask;
+    ULONG64 *pStamps;
+    ULONG32 StampMask;
+    ULONG32 Head[BLOCK_CACHE_LISTS];
+    ULONG32 Tail[BLOCK_CACHE_LISTS];
+    ULONG32 Count[BLOCK_CACHE_LISTS];
+    BLOCK_CACHE_ALLOCATE pfnAllocate;
+    BLOCK_CACHE_RELEASE pfnRelease;
+    VOID *pContext;
+    ULONG64 Hits;
+    ULONG64 Misses;
+    ULONG64 Fills;
+    /* Fills refused because the read raced an invalidation */
+    ULONG64 Rejected;
+    ULONG64 Evictions;
+} BLOCK_CACHE;
+
+/** Nodes needed for a capacity, the ghosts take half as many as the blocks */
+static __inline ULONG32 BlockCache_NodeCount(ULONG32 Capacity)
+{
+    return Capacity + Capacity / 2 + 1;
+}
+
+static __inline ULONG32 BlockCache_Hash(ULONG64 Disk, ULONG64 Block)
+{
+    ULONG64 Key = (Block ^ (Disk << 40) ^ (Disk >> 24)) * 0x9E3779B97F4A7C15ULL;
+    return (ULONG32)(Key >> 32);
+}
+
+static __inline VOID BlockCache_Unlink(BLOCK_CACHE *pCache, ULONG32 Index)
+{
+    BLOCK_CACHE_NODE *pNode = &pCache->pNodes[Index];
+
+    if (pNode->Prev != BLOCK_CACHE_NIL)
+        pCache->pNodes[pNode->Prev].Next = pNode->Next;
+    else
+        pCache->Head[pNode->List] = pNode->Next;
+    if (pNode->Next != BLOCK_CACHE_NIL)
+        pCache->pNodes[pNode->Next].Prev = pNode->Prev;
+    else
+        pCache->Tail[pNode->List] = pNode->Prev;
+    --pCache->Count[pNode->List];
+}
+
+/** Puts a node at the head of a list, the tail is the oldest */
+static __inline VOID BlockCache_Link(BLOCK_CACHE *pCache, ULONG32 Index, ULONG32 List)
+{
+    BLOCK_CACHE_NODE *pNode = &pCache->pNodes[Index];
+
+    pNode->List = List;
+    pNode->Prev = BLOCK_CACHE_NIL;
+    pNode->Next = pCache->Head[List];
+    if (pNode->Next != BLOCK_CACHE_NIL)
+        pCache->pNodes[pNode->Next].Prev = Index;
+    else
+        pCache->Tail[List] = Index;
+    pCache->Head[List] = Index;
+    ++pCache->Count[List];
+}
+
+static __inline ULONG32 BlockCache_Find(const BLOCK_CACHE *pCache, ULONG64 Disk, ULONG64 Block)
+{
+    ULONG32 Index = pCache->pBuckets[BlockCache_Hash(Disk, Block) & pCache->BucketMask];
+
+    while (Index != BLOCK_CACHE_NIL &&
+        (pCache->pNodes[Index].Disk != Disk || pCache->pNodes[Index].Block != Block))
+        Index = pCache->pNodes[Index].HashNext;
+    return Index;
+}
+
+static __inline VOID BlockCache_Unhash(BLOCK_CACHE *pCache, ULONG32 Index)
+{
+    BLOCK_CACHE_NODE *pNode = &pCache->pNodes[Index];
+    ULONG32 *pLink = &pCache->pBuckets[BlockCache_Hash(pNode->Disk, pNode->Block) & pCache->BucketMask];
+
+    while (*pLink != Index)
+        pLink = &pCache->pNodes[*pLink].HashNext;
+    *pLink = pNode->HashNext;
+}
+
+/** Frees a node, its buffer is given back to the owner */
+static __inline VOID BlockCache_Drop(BLOCK_CACHE *pCache, ULONG32 Index)
+{
+    BLOCK_CACHE_NODE *pNode = &pCache->pNodes[Index];
+
+    if (pNode->pData)
+        pCache->pfnRelease(pCache->pContext, pNode->pData);
+    pNode->pData = NULL;
+    BlockCache_Unhash(pCache, Index);
+    BlockCache_Unlink(pCache, Index);
+    BlockCache_Link(pCache, Index, BLOCK_CACHE_FREE);
+}
+
+static __inline VOID BlockCache_TrimGhosts(BLOCK_CACHE *pCache)
+{
+    while (pCache->Count[BLOCK_CACHE_GHOST] > pCache->Limit / 2)
+        BlockCache_Drop(pCache, pCache->Tail[BLOCK_CACHE_GHOST]);
+}
+
+/** Takes the buffer of the block the policy evicts, a block leaving the FIFO leaves its key behind */
+static __inline VOID *BlockCache_Evict(BLOCK_CACHE *pCache)
+{
+    ULONG32 Index = BLOCK_CACHE_NIL;
+    VOID *pData = NULL;
+
+    if (pCache->Count[BLOCK_CACHE_IN] > pCache->Limit / 4 || !pCache->Count[BLOCK_CACHE_HOT])
+        Index = pCache->Tail[BLOCK_CACHE_IN];
+    else
+        Index = pCache->Tail[BLOCK_CACHE_HOT];
+    pData = pCache->pNodes[Index].pData;
+    pCache->pNodes[Index].pData = NULL;
+    ++pCache->Evictions;
+    if (pCache->pNodes[Index].List == BLOCK_CACHE_IN)
+    {
+        BlockCache_Unlink(pCache, Index);
+        BlockCache_Link(pCache, Index, BLOCK_CACHE_GHOST);
+        BlockCache_TrimGhosts(pCache);
+    }
+    else
+        BlockCache_Drop(pCache, Index);
+    return pData;
+}
+
+static __inline ULONG32 BlockCache_Resident(const BLOCK_CACHE *pCache)
+{
+    return pCache->Count[BLOCK_CACHE_IN] + pCache->Count[BLOCK_CACHE_HOT];
+}
+
+/**
+ * Sets up a cache of Capacity blocks over arrays owned by the caller: BlockCache_NodeCount(Capacity) nodes,
+ * and a power of two of buckets and of stamps.
+ */
+static __inline VOID BlockCache_Initialize(BLOCK_CACHE *pCache, ULONG32 Capacity, BLOCK_CACHE_NODE *pNodes,
+    ULONG32 *pBuckets, ULONG32 BucketCount, ULONG64 *pStamps, ULONG32 StampCount, BLOCK_CACHE_ALLOCATE pfnAllocate,
+    BLOCK_CACHE_RELEASE pfnRelease, VOID *pContext)
+{
+    ULONG32 i = 0;
+
+    memset(pCache, 0, sizeof(BLOCK_CACHE));
+    pCache->pNodes = pNodes;
+    pCache->NodeCount = BlockCache_NodeCount(Capacity);
+    pCache->Capacity = Capacity;
+    pCache->Limit = Capacity;
+    pCache->pBuckets = pBuckets;
+    pCache->BucketMask = BucketCount - 1;
+    pCache->pStamps = pStamps;
+    pCache->StampMask = StampCount - 1;
+    pCache->pfnAllocate = pfnAllocate;
+    pCache->pfnRelease = pfnRelease;
+    pCache->pContext = pContext;
+    for (i = 0; i < BLOCK_CACHE_LISTS; ++i)
+        pCache->Head[i] = pCache->Tail[i] = BLOCK_CACHE_NIL;
+    for (i = 0; i < BucketCount; ++i)
+        pBuckets[i] = BLOCK_CACHE_NIL;
+    memset(pStamps, 0, StampCount * sizeof(ULONG64));
+    for (i = 0; i < pCache->NodeCount; ++i)
+    {
+        pNodes[i].pData = NULL;
+        BlockCache_Link(pCache, i, BLOCK_CACHE_FREE);
+    }
+}
+
+/** Buffer of a block kept in the cache, NULL if it is not */
+static __inline const VOID *BlockCache_Lookup(BLOCK_CACHE *pCache, ULONG64 Disk, ULONG64 Block)
+{
+    ULONG32 Index = BlockCache_Find(pCache, Disk, Block);
+
+    if (Index == BLOCK_CACHE_NIL || pCache->pNodes[Index].List == BLOCK_CACHE_GHOST)
+    {
+        ++pCache->Misses;
+        return NULL;
+    }
+    if (pCache->pNodes[Index].List == BLOCK_CACHE_HOT)
+    {
+        BlockCache_Unlink(pCache, Index);
+        BlockCache_Link(pCache, Index, BLOCK_CACHE_HOT);
+    }
+    ++pCache->Hits;
+    return pCache->pNodes[Index].pData;
+}
+
+/**
+ * Buffer to copy a block read from the disk into, NULL if it is not kept: the block is in the cache already,
+ * the read started at or before the last invalidation stamped for it, or no buffer could be allocated.
+ */
+static __inline VOID *BlockCache_Fill(BLOCK_CACHE *pCache, ULONG64 Disk, ULONG64 Block, ULONG64 StartStamp)
+{
+    ULONG32 Hash = BlockCache_Hash(Disk, Block), Index = BLOCK_CACHE_NIL, List = BLOCK_CACHE_IN;
+    VOID *pData = NULL;
+
+    if (StartStamp <= pCache->pStamps[Hash & pCache->StampMask])
+    {
+        ++pCache->Rejected;
+        return NULL;
+    }
+    if (!pCache->Limit)
+        return NULL;
+    Index = BlockCache_Find(pCache, Disk, Block);
+    if (Index != BLOCK_CACHE_NIL)
+    {
+        if (pCache->pNodes[Index].List != BLOCK_CACHE_GHOST)
+            return NULL;
+        // Read again while its key was remembered
+        BlockCache_Drop(pCache, Index);
+        List = BLOCK_CACHE_HOT;
+    }
+    while (BlockCache_Resident(pCache) >= pCache->Limit)
+    {
+        VOID *pEvicted = BlockCache_Evict(pCache);
+        if (pData)
+            pCache->pfnRelease(pCache->pContext, pEvicted);
+        else
+            pData = pEvicted;
+    }
+    if (!pData)
+        pData = pCache->pfnAllocate(pCache->pContext);
+    if (!pData)
+        return NULL;
+    if (pCache->Tail[BLOCK_CACHE_FREE] == BLOCK_CACHE_NIL)
+    {
+        // Not reached while the ghosts are trimmed to half of the limit
+        pCache->pfnRelease(pCache->pContext, pData);
+        return NULL;
+    }
+
+    Index = pCache->Tail[BLOCK_CACHE_FREE];
+    BlockCache_Unlink(pCache, Index);
+    pCache->pNodes[Index].Disk = Disk;
+    pCache->pNodes[Index].Block = Block;
+    pCache->pNodes[Index].pData = pData;
+    pCache->pNodes[Index].HashNext = pCache->pBuckets[Hash & pCache->BucketMask];
+    pCache->pBuckets[Hash & pCache->BucketMask] = Index;
+    BlockCache_Link(pCache, Index, List);
+    ++pCache->Fills;
+    return pData;
+}
+
+/** Drops a block and stamps its slot, reads that started at or before Stamp do not fill it */
+static __inline VOID BlockCache_Invalidate(BLOCK_CACHE *pCache, ULONG64 Disk, ULONG64 Block, ULONG64 Stamp)
+{
+    ULONG64 *pStamp = &pCache->pStamps[BlockCache_Hash(Disk, Block) & pCache->StampMask];
+    ULONG32 Index = BlockCache_Find(pCache, Disk, Block);
+
+    if (*pStamp < Stamp)
+        *pStamp = Stamp;
+    if (Index != BLOCK_CACHE_NIL && pCache->pNodes[Index].List != BLOCK_CACHE_GHOST)
+        BlockCache_Drop(pCache, Index);
+}
+
+/** Drops every block and key of a disk and stamps every slot, reads of any disk in flight do not fill */
+static __inline VOID BlockCache_DropDisk(BLOCK_CACHE *pCache, ULONG64 Disk, ULONG64 Stamp)
+{
+    ULONG32 i = 0;
+
+    for (i = 0; i <= pCache->StampMask; ++i)
+    {
+        if (pCache->pStamps[i] < Stamp)
+            pCache->pStamps[i] = Stamp;
+    }
+    for (i = 0; i < pCache->NodeCount; ++i)
+    {
+        if (pCache->pNodes[i].List != BLOCK_CACHE_FREE && pCache->pNodes[i].Disk == Disk)
+            BlockCache_Drop(pCache, i);
+    }
+}
+
+/** Keeps at most Limit blocks, up to the capacity, evicting the blocks above it */
+static __inline VOID BlockCache_SetLimit(BLOCK_CACHE *pCache, ULONG32 Limit)
+{
+    pCache->Limit = Limit < pCache->Capacity ? Limit : pCache->Capacity;
+    while (BlockCache_Resident(pCache) > pCache->Limit)
+        pCache->pfnRelease(pCache->pContext, BlockCache_Evict(pCache));
+    BlockCache_TrimGhosts(pCache);
+}
@@ -0,0 +1,191 @@
+#include "stdafx.h"
+#include "Catalog.h"
+#include "RegUtils.h"
+#include "Log.h"
+
+#define CATLOG(level, format, ...) LOG_FUNCTION(level, LOG_CTG_CIPHER, format, __VA_ARGS__)
+
+const ULONG32 CatalogAllocationTag = 'CtlP';
+
+static PWSTR CatalogFileName = NULL;
+/* Loaded image, replaced as a whole by Catalog_Reload */
+static CATALOG_HEADER *CatalogImage = NULL;
+static FAST_MUTEX CatalogMutex;
+static BOOLEAN CatalogInitialized = FALSE;
+
+/** Reads and validates the catalog file, the returned image is owned by the caller */
+static NTSTATUS Catalog_ReadFile(LPCWSTR pszFileName, CATALOG_HEADER **ppImage)
+{
+	NTSTATUS Status = STATUS_SUCCESS;
+	OBJECT_ATTRIBUTES fAttrs;
+	UNICODE_STRING FileName;
+	IO_STATUS_BLOCK StatusBlock = { 0 };
+	FILE_STANDARD_INFORMATION Info = { 0 };
+	HANDLE hFile = NULL;
+	PVOID pImage = NULL;
+	ULONG Size = 0;
+
+	RtlInitUnicodeString(&FileName, pszFileName);
+	InitializeObjectAttributes(&fAttrs, &FileName, OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, NULL, NULL);
+	Status = ZwCreateFile(&hFile, GENERIC_READ | SYNCHRONIZE, &fAttrs, &StatusBlock, NULL, FILE_ATTRIBUTE_NORMAL,
+		FILE_SHARE_READ | FILE_SHARE_DELETE, FILE_OPEN, FILE_SYNCHRONOUS_IO_NONALERT | FILE_SEQUENTIAL_ONLY, NULL, 0);
+	if (!NT_SUCCESS(Status))
+	{
+		hFile = NULL;
+		goto Cleanup;
+	}
+
+	Status = ZwQueryInformationFile(hFile, &StatusBlock, &Info, sizeof(Info), FileStandardInformation);
+	if (!NT_SUCCESS(Status))
+		goto Cleanup;
+	if (Info.EndOfFile.QuadPart < sizeof(CATALOG_HEADER) || Info.EndOfFile.QuadPart > CATALOG_MAX_SIZE)
+	{
+		Status = STATUS_FILE_CORRUPT_ERROR;
+		goto Cleanup;
+	}
+	Size = Info.EndOfFile.LowPart;
+
+	pImage = ExAllocatePoolWithTag(NonPagedPoolNx, Size, CatalogAllocationTag);
+	if (!pImage)
+	{
+		Status = STATUS_INSUFFICIENT_RESOURCES;
+		goto Cleanup;
+	}
+
+	// The whole file is read with a single request
+	Status = ZwReadFile(hFile, NULL, NULL, NULL, &StatusBlock, pImage, Size, NULL, NULL);
+	if (NT_SUCCESS(Status) && StatusBlock.Information != Size)
+		Status = STATUS_END_OF_FILE;
+	if (!NT_SUCCESS(Status))
+		goto Cleanup;
+
+	if (!Catalog_Validate(pImage, Size))
+	{
+		Status = STATUS_FILE_CORRUPT_ERROR;
+		goto Cleanup;
+	}
+
+	*ppImage = pImage;
+	pImage = NULL;
+
+Cleanup:
+	if (pImage)
+	{
+		RtlSecureZeroMemory(pImage, Size);
+		ExFreePoolWithTag(pImage, CatalogAllocationTag);
+	}
+	if (hFile)
+		ZwClose(hFile);
+
+	return Status;
+}
+
+static VOID Catalog_FreeImage(CATALOG_HEADER *pImage)
+{
+	// Entries may hold keys
+	RtlSecureZeroMemory(pImage, pImage->FileSize);
+	ExFreePoolWithTag(pImage, CatalogAllocationTag);
+}
+
+NTSTATUS Catalog_Initialize(_In_ PCUNICODE_STRING pRegistryPath)
+{
+	NTSTATUS Status = STATUS_SUCCESS;
+	HANDLE hKey = NULL, hParametersKey = NULL;
+	OBJECT_ATTRIBUTES fAttrs;
+	UNICODE_STRING SubkeyName;
+
+	ExInitializeFastMutex(&CatalogMutex);
+	CatalogInitialized = TRUE;
+
+	InitializeObjectAttributes(&fAttrs, (PUNICODE_STRING)pRegistryPath, OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, NULL, NULL);
+	Status = ZwOpenKey(&hKey, KEY_READ, &fAttrs);
+	if (!NT_SUCCESS(Status))
+		return Status;
+
+	RtlInitUnicodeString(&SubkeyName, L"Parameters");
+	InitializeObjectAttributes(&fAttrs, &SubkeyName, OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, hKey, NULL);
+	Status = ZwOpenKey(&hParametersKey, KEY_READ, &fAttrs);
+	if (NT_SUCCESS(Status))
+	{
+		Reg_GetStringValue(hParametersKey, L"CatalogFile", &CatalogFileName);
+		ZwClose(hParametersKey);
+	}
+	ZwClose(hKey);
+
+	if (!CatalogFileName)
+	{
+		CATLOG(LL_INFO, "No disk catalog configured");
+		return STATUS_SUCCESS;
+	}
+
+	// A broken catalog must not prevent the driver from loading, disks fall back to the key service
+	Status = Catalog_Reload();
+	if (!NT_SUCCESS(Status))
+		CATLOG(LL_ERROR, "Failed to load disk catalog %S: 0x%08X", CatalogFileName, Status);
+
+	return STATUS_SUCCESS;
+}
+
+VOID Catalog_Cleanup()
+{
+	if (CatalogImage)
+	{
+		Catalog_FreeImage(CatalogImage);
+		CatalogImage = NULL;
+	}
+	if (CatalogFileName)
+	{
+		ExFreePool(CatalogFileName);
+		CatalogFileName = NULL;
+	}
+}
+
+NTSTATUS Catalog_Reload()
+{
+	NTSTATUS Status = STATUS_SUCCESS;
+	CATALOG_HEADER *pImage = NULL;
+
+	if (!CatalogInitialized || !CatalogFileName)
+		return STATUS_NOT_FOUND;
+
+	Status = Catalog_ReadFile(CatalogFileName, &pImage);
+	if (!NT_SUCCESS(Status))
+		return Status;
+
+	ExAcquireFastMutex(&CatalogMutex);
+	if (CatalogImage && CatalogImage->Generation > pImage->Generation)
+	{
+		CATLOG(LL_WARNING, "Catalog generation %I64u is older than the loaded %I64u", pImage->Generation,
+			CatalogImage->Generation);
+	}
+	// Lookups copy entries under the mutex, so nobody references the old image past this point
+	CATALOG_HEADER *pOldImage = CatalogImage;
+	CatalogImage = pImage;
+	ExReleaseFastMutex(&CatalogMutex);
+
+	CATLOG(LL_INFO, "Loaded disk catalog generation %I64u with %d entries", pImage->Generation, pImage->EntryCount);
+
+	if (pOldImage)
+		Catalog_FreeImage(pOldImage);
+
+	return Status;
+}
+
+NTSTATUS Catalog_Lookup(_In_ PGUID pDiskId, _Out_ CATALOG_ENTRY *pEntry)
+{
+	NTSTATUS Status = STATUS_NOT_FOUND;
+	const CATALOG_ENTRY *pFound = NULL;
+
+	if (!CatalogInitialized)
+		return Status;
+
+	ExAcquireFastMutex(&CatalogMutex);
+	if (CatalogImage && NULL != (pFound = Catalog_Find(CatalogImage, pDiskId)))
+	{
+		*pEntry = *pFound;
+		Status = STATUS_SUCCESS;
+	}
+	ExReleaseFastMutex(&CatalogMutex);
+
+	return Status;
+}
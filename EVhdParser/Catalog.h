@@ -0,0 +1,185 @@
+#pragma once
+/*
+ * Persistent catalog of per-disk configurations. The file is produced offline,
+ * loaded into memory as a whole and searched in place:
+ *
+ *     CATALOG_HEADER | ULONG32 Buckets[BucketCount] | CATALOG_ENTRY Entries[EntryCount]
+ *
+ * Every bucket holds the index of the first entry of its chain, entries are chained
+ * through Next. The checksum is the CRC32 of the whole file with the Checksum field
+ * set to zero. The file is always replaced as a whole (written under a temporary name
+ * and renamed) so readers never see a partial catalog.
+ */
+#include "PortableTypes.h"
+#include "CipherOpts.h"
+
+#define CATALOG_MAGIC               0x54435645  // 'EVCT'
+#define CATALOG_VERSION             1
+#define CATALOG_END                 0xFFFFFFFF
+#define CATALOG_MAX_SIZE            0x10000000
+
+/* Keys are stored in the entry, the catalog file must only be readable by the system */
+#define CATALOG_FLAG_INLINE_KEY     0x1
+/* Do not fall back to keys set through IOCTL_VIRTUAL_DISK_SET_CIPHER */
+#define CATALOG_FLAG_REQUIRE_KEY    0x2
+/* Report 4 KiB physical sectors and 4 KiB aligned optimal transfers to the guest, implied by 4096 byte data units */
+#define CATALOG_FLAG_ADVERTISE_4K   0x4
+/*
+ * Differencing disk created empty over its parent, with the key of the parent. The blocks it reads from the
+ * parent are shared with the other clones of the parent, a key reference or an inline key is required. The
+ * blocks the clone holds itself are read from its allocation table at mount
+ */
+#define CATALOG_FLAG_SHARE_PARENT   0x8
+
+typedef struct _CATALOG_HEADER {
+    ULONG32 Magic;
+    USHORT Version;
+    USHORT HeaderSize;
+    ULONG32 FileSize;
+    ULONG32 Checksum;
+    /* Incremented by the writer on every rebuild */
+    ULONG64 Generation;
+    ULONG32 EntryCount;
+    /* Power of two */
+    ULONG32 BucketCount;
+    ULONG32 BucketsOffset;
+    ULONG32 EntriesOffset;
+} CATALOG_HEADER;
+
+C_ASSERT(sizeof(CATALOG_HEADER) == 40);
+
+typedef struct _CATALOG_ENTRY {
+    GUID DiskId;
+    /* ECipherAlgo */
+    ULONG32 Algorithm;
+    /* Bytes encrypted with a single tweak, 512 or 4096. Reads and writes of part of a data unit are failed */
+    ULONG32 DataUnitSize;
+    ULONG32 PolicyFlags;
+    ULONG32 Next;
+    /* Identifier of the wrapped key held by the key service */
+    GUID KeyReference;
+    /* Valid with CATALOG_FLAG_INLINE_KEY only */
+    Xts256CipherOptions Key;
+} CATALOG_ENTRY;
+
+C_ASSERT(sizeof(CATALOG_ENTRY) == 112);
+
+static __inline ULONG32 Catalog_Crc32(ULONG32 Crc, const VOID *pData, ULONG32 Length)
+{
+    // Half-byte table, small enough to live in a header and still fast enough for load time checks
+    static const ULONG32 Table[16] = {
+        0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+        0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+    };
+    const UCHAR *p = (const UCHAR *)pData;
+
+    Crc = ~Crc;
+    while (Length--)
+    {
+        Crc ^= *p++;
+        Crc = (Crc >> 4) ^ Table[Crc & 0xF];
+        Crc = (Crc >> 4) ^ Table[Crc & 0xF];
+    }
+    return ~Crc;
+}
+
+/** Checksum of a catalog image, computed as if the Checksum field was zero */
+static __inline ULONG32 Catalog_Checksum(const VOID *pImage, ULONG32 Size)
+{
+    static const ULONG32 Zero = 0;
+    ULONG32 Crc = Catalog_Crc32(0, pImage, FIELD_OFFSET(CATALOG_HEADER, Checksum));
+    Crc = Catalog_Crc32(Crc, &Zero, sizeof(Zero));
+    return Catalog_Crc32(Crc, (const UCHAR *)pImage + FIELD_OFFSET(CATALOG_HEADER, Generation),
+        Size - FIELD_OFFSET(CATALOG_HEADER, Generation));
+}
+
+/** FNV-1a over the raw identifier bytes, the same on every platform writing GUIDs in their native layout */
+static __inline ULONG32 Catalog_Hash(const GUID *pDiskId)
+{
+    const UCHAR *p = (const UCHAR *)pDiskId;
+    ULONG32 Hash = 2166136261u;
+    ULONG32 i = 0;
+
+    for (i = 0; i < sizeof(GUID); ++i)
+        Hash = (Hash ^ p[i]) * 16777619u;
+    return Hash;
+}
+
+static __inline ULONG32 *Catalog_Buckets(const CATALOG_HEADER *pHeader)
+{
+    return (ULONG32 *)((UCHAR *)pHeader + pHeader->BucketsOffset);
+}
+
+static __inline CATALOG_ENTRY *Catalog_Entries(const CATALOG_HEADER *pHeader)
+{
+    return (CATALOG_ENTRY *)((UCHAR *)pHeader + pHeader->EntriesOffset);
+}
+
+/** Checks the layout and the checksum of an image of Size bytes. Lookups on a valid image stay in bounds */
+static __inline BOOLEAN Catalog_Validate(const VOID *pImage, ULONG32 Size)
+{
+    const CATALOG_HEADER *pHeader = (const CATALOG_HEADER *)pImage;
+    ULONG32 *pBuckets = NULL;
+    CATALOG_ENTRY *pEntries = NULL;
+    ULONG32 i = 0;
+
+    if (Size < sizeof(CATALOG_HEADER) || Size > CATALOG_MAX_SIZE ||
+        pHeader->Magic != CATALOG_MAGIC || pHeader->Version != CATALOG_VERSION ||
+        pHeader->HeaderSize < sizeof(CATALOG_HEADER) || pHeader->FileSize != Size)
+    {
+        return FALSE;
+    }
+    if (!pHeader->BucketCount || (pHeader->BucketCount & (pHeader->BucketCount - 1)) ||
+        pHeader->BucketCount > Size / sizeof(ULONG32) || pHeader->EntryCount > Size / sizeof(CATALOG_ENTRY) ||
+        pHeader->BucketsOffset < pHeader->HeaderSize || (pHeader->BucketsOffset & 3) ||
+        pHeader->BucketsOffset > Size - pHeader->BucketCount * sizeof(ULONG32) ||
+        pHeader->EntriesOffset < pHeader->BucketsOffset + pHeader->BucketCount * sizeof(ULONG32) ||
+        (pHeader->EntriesOffset & 7) ||
+        pHeader->EntriesOffset > Size - pHeader->EntryCount * sizeof(CATALOG_ENTRY))
+    {
+        return FALSE;
+    }
+    if (pHeader->Checksum != Catalog_Checksum(pImage, Size))
+        return FALSE;
+
+    pBuckets = Catalog_Buckets(pHeader);
+    pEntries = Catalog_Entries(pHeader);
+    for (i = 0; i < pHeader->BucketCount; ++i)
+    {
+        if (pBuckets[i] != CATALOG_END && pBuckets[i] >= pHeader->EntryCount)
+            return FALSE;
+    }
+    for (i = 0; i < pHeader->EntryCount; ++i)
+    {
+        if (pEntries[i].Next != CATALOG_END && pEntries[i].Next >= pHeader->EntryCount)
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+/** Finds the entry of the disk in a validated image */
+static __inline const CATALOG_ENTRY *Catalog_Find(const CATALOG_HEADER *pHeader, const GUID *pDiskId)
+{
+    const CATALOG_ENTRY *pEntries = Catalog_Entries(pHeader);
+    ULONG32 Index = Catalog_Buckets(pHeader)[Catalog_Hash(pDiskId) & (pHeader->BucketCount - 1)];
+    ULONG32 Steps = 0;
+
+    // Chains are bounded by the entry count, so a crafted cycle can not hang the lookup
+    for (; Index != CATALOG_END && Steps < pHeader->EntryCount; Index = pEntries[Index].Next, ++Steps)
+    {
+        if (!memcmp(&pEntries[Index].DiskId, pDiskId, sizeof(GUID)))
+            return &pEntries[Index];
+    }
+    return NULL;
+}
+
+#ifdef _WINKRNL
+/** Loads the catalog named by the CatalogFile value of the Parameters key, a missing value is not an error */
+NTSTATUS Catalog_Initialize(_In_ PCUNICODE_STRING pRegistryPath);
+VOID Catalog_Cleanup();
+/** Reads the catalog file again and replaces the loaded one if the new file is valid */
+NTSTATUS Catalog_Reload();
+/** Copies the entry of the disk, returns STATUS_NOT_FOUND if the disk is not in the catalog */
+NTSTATUS Catalog_Lookup(_In_ PGUID pDiskId, _Out_ CATALOG_ENTRY *pEntry);
+#endif
@@ -2,10 +2,19 @@
 #ifdef _WINKRNL
 #include <ntifs.h>
 #include <devioctl.h>
-#else
+#elif defined(_WIN32)
 #include <winioctl.h>
+#else
+#include "PortableTypes.h"
 #endif
 #include "CipherOpts.h"
+#include "MessageRing.h"
+#include "TraceFormat.h"
+#include "FlightFormat.h"
+#include "DiskCounters.h"
+#include "SrbTiming.h"
+#include "ControlTiming.h"
+#include "HeatFormat.h"
 
 typedef struct
 {
@@ -21,28 +30,245 @@ typedef struct
 
 C_ASSERT(sizeof(EVHD_SET_CIPHER_CONFIG_REQUEST) == 0x100);
 
+/* Largest number of configurations accepted by a single batch */
+#define EVHD_SET_CIPHER_BATCH_MAX 4096
+
+typedef struct
+{
+    ULONG32 Count;
+    ULONG32 Reserved[3];
+    EVHD_SET_CIPHER_CONFIG_REQUEST Configs[1];
+} EVHD_SET_CIPHER_BATCH_REQUEST;
+
+#define EVHD_SET_CIPHER_BATCH_SIZE(Count) \
+    (FIELD_OFFSET(EVHD_SET_CIPHER_BATCH_REQUEST, Configs) + (Count) * sizeof(EVHD_SET_CIPHER_CONFIG_REQUEST))
+
 typedef struct
 {
 	GUID DiskId;
 } EVHD_QUERY_CIPHER_CONFIG_REQUEST;
 
+#define LOG_BACKEND_TEXT    0
+#define LOG_BACKEND_BINARY  1
+
 typedef struct _LOG_SETTINGS {
     ULONG32 LogLevel;
     ULONG32 LogCategories;
     ULONG32 MaxFileSize;
     ULONG32 MaxKeptRotatedFiles;
+    /* LOG_BACKEND_TEXT formats lines when they are logged, LOG_BACKEND_BINARY records trace events */
+    ULONG32 Backend;
 
-    UINT8 Reserved[32];
+    UINT8 Reserved[28];
 } LOG_SETTINGS;
 
 C_ASSERT(sizeof(LOG_SETTINGS) == 48);
 
+/** Counters of the per-processor log rings and of the flusher writing them to the file */
+typedef struct _LOG_STATISTICS {
+    ULONG32 Rings;
+    ULONG32 SlotsPerRing;
+    LONG64 LinesWritten;
+    /* Lines lost because the ring of their processor was full */
+    LONG64 Dropped;
+    LONG64 BatchesWritten;
+    LONG64 BytesWritten;
+    /* Lines waiting for the flusher right now, and the most any single ring has held */
+    ULONG32 Pending;
+    ULONG32 HighWater;
+} LOG_STATISTICS;
+
+C_ASSERT(sizeof(LOG_STATISTICS) == 48);
+
+#define TRACEPOINT_ALL_SITES 0xFFFFFFFF
+
+/** Selects log call sites and sets how they log. A site has to match the id, the categories and the function */
+typedef struct _TRACEPOINT_REQUEST {
+    /* Call site id as listed by IOCTL_VIRTUAL_DISK_QUERY_TRACEPOINTS, or TRACEPOINT_ALL_SITES */
+    ULONG32 Id;
+    /* LOG_CTG_* bits, 0 matches every category */
+    ULONG32 CategoryMask;
+    /* TRACEPOINT_MODE */
+    ULONG32 Mode;
+    /* One in Rate events for TracepointSample, events per second for TracepointRateLimit */
+    ULONG32 Rate;
+    ULONG32 Burst;
+    ULONG32 Reserved;
+    /* Function name, empty matches every function */
+    CHAR Function[64];
+} TRACEPOINT_REQUEST;
+
+C_ASSERT(sizeof(TRACEPOINT_REQUEST) == 88);
+
+typedef struct _TRACEPOINT_INFO {
+    ULONG32 Id;
+    ULONG32 Line;
+    UCHAR Level;
+    UCHAR Category;
+    /* TRACE_SITE_* state the call site currently sees */
+    UCHAR Enabled;
+    UCHAR Reserved;
+    ULONG32 Mode;
+    ULONG32 Rate;
+    ULONG32 Burst;
+    LONG64 Evaluated;
+    LONG64 Suppressed;
+    CHAR Function[64];
+} TRACEPOINT_INFO;
+
+C_ASSERT(sizeof(TRACEPOINT_INFO) == 104);
+
+typedef struct _TRACEPOINT_LIST {
+    /* Number of call sites, may exceed the number of entries returned */
+    ULONG32 Count;
+    ULONG32 Reserved;
+    TRACEPOINT_INFO Sites[1];
+} TRACEPOINT_LIST;
+
+/** Counters of an open disk summed over all processors */
+typedef struct _DISK_STATS {
+    GUID DiskId;
+    /* Virtual machine the disk is attached to, the counters of a machine are the sum of its disks */
+    GUID ApplicationId;
+    /* Same tag as in the flight recorder events of the disk */
+    ULONG32 DiskTag;
+    ULONG32 Reserved;
+    /* Requests started and not completed yet */
+    LONG64 InFlight;
+    DISK_COUNTERS Counters;
+} DISK_STATS;
+
+C_ASSERT(sizeof(DISK_STATS) == 48 + sizeof(DISK_COUNTERS));
+
+typedef struct _DISK_STATS_LIST {
+    /* Number of open disks, may exceed the number of entries returned */
+    ULONG32 Count;
+    ULONG32 Reserved;
+    /* Measured TSC ticks per second, 0 right after the driver started */
+    ULONG64 TscFrequency;
+    DISK_STATS Disks[1];
+} DISK_STATS_LIST;
+
+/** Stage histograms of an open disk summed over all processors */
+typedef struct _DISK_STAGE_STATS {
+    GUID DiskId;
+    GUID ApplicationId;
+    ULONG32 DiskTag;
+    ULONG32 Reserved;
+    SRB_STAGE_COUNTERS Stages;
+} DISK_STAGE_STATS;
+
+C_ASSERT(sizeof(DISK_STAGE_STATS) == 40 + sizeof(SRB_STAGE_COUNTERS));
+
+typedef struct _DISK_STAGE_STATS_LIST {
+    /* Number of disks with stage timing, may exceed the number of entries returned */
+    ULONG32 Count;
+    /* Set if stage timing is enabled, disks opened while it was disabled are not listed */
+    ULONG32 Enabled;
+    ULONG64 TscFrequency;
+    DISK_STAGE_STATS Disks[1];
+} DISK_STAGE_STATS_LIST;
+
+/** Control path times of an open disk */
+typedef struct _DISK_CONTROL_STATS {
+    GUID DiskId;
+    GUID ApplicationId;
+    ULONG32 DiskTag;
+    ULONG32 Reserved;
+    /* Phases of the open of the disk and of its last mount and dismount */
+    CTL_TIMING Last;
+} DISK_CONTROL_STATS;
+
+/** Control requests the driver sent to vhdmp and the IRPs they took */
+typedef struct _CONTROL_IRP_STATS {
+    ULONG64 Calls;
+    /* IRPs allocated because the pool of their stack size was empty */
+    ULONG64 Allocated;
+    /* IRPs taken from a pool */
+    ULONG64 Reused;
+    /* Control requests in flight right now, and the most there were at once */
+    ULONG32 InFlight;
+    ULONG32 MaxInFlight;
+} CONTROL_IRP_STATS;
+
+C_ASSERT(sizeof(CONTROL_IRP_STATS) == 32);
+
+typedef struct _CONTROL_STATS_LIST {
+    /* Number of open disks, may exceed the number of entries returned */
+    ULONG32 Count;
+    ULONG32 Reserved;
+    /* Every open, mount, dismount and close since the driver started, failed ones included */
+    CTL_PHASE_COUNTERS Phases;
+    CONTROL_IRP_STATS Irps;
+    DISK_CONTROL_STATS Disks[1];
+} CONTROL_STATS_LIST;
+
+/** Requests in flight on an open disk and its slowest recent completions */
+typedef struct _DISK_INFLIGHT_STATS {
+    GUID DiskId;
+    GUID ApplicationId;
+    ULONG32 DiskTag;
+    ULONG32 Reserved;
+    DISK_INFLIGHT_SCAN Scan;
+    /* Requests the scanner found stuck since the disk was opened */
+    ULONG64 StuckTotal;
+    ULONG32 SlowestCount;
+    ULONG32 Reserved2;
+    /* Slowest completions of the last full scan period, slowest first */
+    DISK_INFLIGHT_REQUEST Slowest[DISK_INFLIGHT_REPORT];
+} DISK_INFLIGHT_STATS;
+
+typedef struct _DISK_INFLIGHT_LIST {
+    /* Number of open disks, may exceed the number of entries returned */
+    ULONG32 Count;
+    /* Parameters\InflightScanPeriod and Parameters\StuckIoThreshold in milliseconds, a 0 period disables the scanner */
+    ULONG32 ScanPeriod;
+    ULONG32 StuckThreshold;
+    ULONG32 Reserved;
+    ULONG64 TscFrequency;
+    DISK_INFLIGHT_STATS Disks[1];
+} DISK_INFLIGHT_LIST;
+
+/* Clears the heatmap and the sketch once the snapshot is taken */
+#define HEAT_SNAPSHOT_RESET     1
+
+typedef struct _HEAT_SNAPSHOT_REQUEST {
+    /* Flight recorder tag of the disk */
+    ULONG32 DiskTag;
+    ULONG32 Flags;
+} HEAT_SNAPSHOT_REQUEST;
+
 typedef struct _CREATE_SUBSCRIPTION_REQUEST
 {
     BOOLEAN Servicing;
     UCHAR Reserved[3];
 } CREATE_SUBSCRIPTION_REQUEST;
 
+typedef struct _CREATE_RING_SUBSCRIPTION_REQUEST
+{
+    BOOLEAN Servicing;
+    UCHAR Reserved[3];
+    /* Size of the data area of each ring, power of two */
+    ULONG32 RingSize;
+    /* Event handle the driver signals when it writes to an idle request ring */
+    ULONG64 RequestEvent;
+    /* Event handle the service signals when it writes to an idle response ring */
+    ULONG64 ResponseEvent;
+} CREATE_RING_SUBSCRIPTION_REQUEST;
+
+C_ASSERT(sizeof(CREATE_RING_SUBSCRIPTION_REQUEST) == 24);
+
+typedef struct _CREATE_RING_SUBSCRIPTION_RESPONSE
+{
+    /* PARSER_RING_HEADER addresses in the caller's address space */
+    ULONG64 RequestRing;
+    ULONG64 ResponseRing;
+    ULONG32 RingSize;
+    ULONG32 Reserved;
+} CREATE_RING_SUBSCRIPTION_RESPONSE;
+
+C_ASSERT(sizeof(CREATE_RING_SUBSCRIPTION_RESPONSE) == 24);
+
 typedef struct _PARSER_RESPONSE_MESSAGE
 {
     LONG RequestId;
@@ -73,14 +299,122 @@ typedef struct _PARSER_MESSAGE {
         struct {
             GUID DiskId;
             GUID ApplicationId;
+            /* Wrapped key named by the disk catalog, zero if the disk is not in the catalog */
+            GUID KeyReference;
         } QueryCipherConfig;
     } Message;
 } PARSER_MESSAGE;
 
 C_ASSERT(sizeof(PARSER_MESSAGE) == 1024);
 
+typedef enum _PARSER_MESSAGE_FRAMING
+{
+    /* Every read returns a single PARSER_MESSAGE */
+    MessageFramingFixed,
+    /* Every read returns as many PARSER_MESSAGE_FRAMEs as fit in the buffer */
+    MessageFramingPacked
+} PARSER_MESSAGE_FRAMING;
+
+typedef struct _SET_MESSAGE_FRAMING_REQUEST
+{
+    ULONG32 Framing;
+    ULONG32 Reserved;
+} SET_MESSAGE_FRAMING_REQUEST;
+
+/** Packed framing header, laid out like PARSER_RING_RECORD. Length bytes of the message follow it */
+typedef struct _PARSER_MESSAGE_FRAME
+{
+    ULONG32 Length;
+    ULONG32 Reserved;
+} PARSER_MESSAGE_FRAME;
+
+#define PARSER_MESSAGE_FRAME_SIZE(Length) PARSER_RING_ALIGN(sizeof(PARSER_MESSAGE_FRAME) + (Length))
+
+#define WORKER_FLAG_RING 0x1
+
+/** Load and latency counters of a servicing subscription */
+typedef struct _WORKER_STATISTICS
+{
+    ULONG32 WorkerId;
+    ULONG32 ProcessId;
+    ULONG32 Outstanding;
+    ULONG32 Flags;
+    LONG64 Completed;
+    /* Requests moved to other workers when this one closed */
+    LONG64 FailedOver;
+    LONG64 TotalLatencyUs;
+    LONG64 MaxLatencyUs;
+} WORKER_STATISTICS;
+
+C_ASSERT(sizeof(WORKER_STATISTICS) == 48);
+
+typedef struct _WORKER_STATISTICS_RESPONSE
+{
+    /* Number of servicing subscriptions, may exceed the number of entries returned */
+    ULONG32 Count;
+    ULONG32 Reserved;
+    WORKER_STATISTICS Workers[1];
+} WORKER_STATISTICS_RESPONSE;
+
+typedef enum _SUBSCRIPTION_OVERFLOW_POLICY
+{
+    /* The oldest queued event is dropped to make room for the new one */
+    OverflowPolicyDropOldest,
+    /* A queued event of the same type and disk is replaced by the new one, otherwise the oldest is dropped */
+    OverflowPolicyCoalesce
+} SUBSCRIPTION_OVERFLOW_POLICY;
+
+/** Filters and read queue limits of a subscription. Requests are never dropped, they are rejected when the queue is full */
+typedef struct _SUBSCRIPTION_OPTIONS
+{
+    /* Bit (1 << Type) enables messages of that type */
+    ULONG32 MessageTypeMask;
+    /* Maximum number of queued messages, 1 to 4096 */
+    ULONG32 MaxQueuedMessages;
+    ULONG32 OverflowPolicy;
+    ULONG32 Reserved;
+    /* Only messages about this disk are delivered, zero GUID accepts all disks */
+    GUID DiskId;
+} SUBSCRIPTION_OPTIONS;
+
+C_ASSERT(sizeof(SUBSCRIPTION_OPTIONS) == 32);
+
+typedef struct _SUBSCRIPTION_STATISTICS
+{
+    LONG64 Delivered;
+    /* Events dropped because the queue or the ring was full */
+    LONG64 Dropped;
+    LONG64 Coalesced;
+    /* Messages rejected by the filters */
+    LONG64 Filtered;
+    /* Requests failed because the queue was full */
+    LONG64 Rejected;
+    ULONG32 Queued;
+    ULONG32 MaxQueued;
+    ULONG32 HighWater;
+    ULONG32 Reserved;
+} SUBSCRIPTION_STATISTICS;
+
+C_ASSERT(sizeof(SUBSCRIPTION_STATISTICS) == 56);
+
 #define IOCTL_VIRTUAL_DISK_SET_CIPHER		    CTL_CODE(FILE_DEVICE_VIRTUAL_DISK, 0x2001, METHOD_IN_DIRECT, FILE_WRITE_ACCESS)	
 #define IOCTL_VIRTUAL_DISK_SET_LOGGER           CTL_CODE(FILE_DEVICE_VIRTUAL_DISK, 0x2002, METHOD_IN_DIRECT, FILE_WRITE_ACCESS)
 #define IOCTL_VIRTUAL_DISK_GET_LOGGER           CTL_CODE(FILE_DEVICE_VIRTUAL_DISK, 0x2003, METHOD_OUT_DIRECT, FILE_READ_ACCESS)
 #define IOCTL_VIRTUAL_DISK_CREATE_SUBSCRIPTION  CTL_CODE(FILE_DEVICE_VIRTUAL_DISK, 0x2004, METHOD_IN_DIRECT, FILE_READ_ACCESS)
 #define IOCTL_VIRTUAL_DISK_FINISH_REQUEST       CTL_CODE(FILE_DEVICE_VIRTUAL_DISK, 0x2005, METHOD_IN_DIRECT, FILE_WRITE_ACCESS)
+#define IOCTL_VIRTUAL_DISK_CREATE_RING_SUBSCRIPTION CTL_CODE(FILE_DEVICE_VIRTUAL_DISK, 0x2006, METHOD_BUFFERED, FILE_READ_ACCESS)
+#define IOCTL_VIRTUAL_DISK_SET_MESSAGE_FRAMING  CTL_CODE(FILE_DEVICE_VIRTUAL_DISK, 0x2007, METHOD_BUFFERED, FILE_READ_ACCESS)
+#define IOCTL_VIRTUAL_DISK_QUERY_WORKERS        CTL_CODE(FILE_DEVICE_VIRTUAL_DISK, 0x2008, METHOD_BUFFERED, FILE_READ_ACCESS)
+#define IOCTL_VIRTUAL_DISK_SET_SUBSCRIPTION_OPTIONS CTL_CODE(FILE_DEVICE_VIRTUAL_DISK, 0x2009, METHOD_BUFFERED, FILE_READ_ACCESS)
+#define IOCTL_VIRTUAL_DISK_QUERY_SUBSCRIPTION   CTL_CODE(FILE_DEVICE_VIRTUAL_DISK, 0x200A, METHOD_BUFFERED, FILE_READ_ACCESS)
+#define IOCTL_VIRTUAL_DISK_SET_CIPHER_BATCH     CTL_CODE(FILE_DEVICE_VIRTUAL_DISK, 0x200B, METHOD_BUFFERED, FILE_WRITE_ACCESS)
+#define IOCTL_VIRTUAL_DISK_RELOAD_CATALOG       CTL_CODE(FILE_DEVICE_VIRTUAL_DISK, 0x200C, METHOD_BUFFERED, FILE_WRITE_ACCESS)
+#define IOCTL_VIRTUAL_DISK_QUERY_LOGGER_STATS   CTL_CODE(FILE_DEVICE_VIRTUAL_DISK, 0x200D, METHOD_BUFFERED, FILE_READ_ACCESS)
+#define IOCTL_VIRTUAL_DISK_SET_TRACEPOINT       CTL_CODE(FILE_DEVICE_VIRTUAL_DISK, 0x200E, METHOD_BUFFERED, FILE_WRITE_ACCESS)
+#define IOCTL_VIRTUAL_DISK_QUERY_TRACEPOINTS    CTL_CODE(FILE_DEVICE_VIRTUAL_DISK, 0x200F, METHOD_BUFFERED, FILE_READ_ACCESS)
+#define IOCTL_VIRTUAL_DISK_SNAPSHOT_FLIGHT_RECORDER CTL_CODE(FILE_DEVICE_VIRTUAL_DISK, 0x2010, METHOD_BUFFERED, FILE_READ_ACCESS)
+#define IOCTL_VIRTUAL_DISK_QUERY_DISK_STATS     CTL_CODE(FILE_DEVICE_VIRTUAL_DISK, 0x2011, METHOD_BUFFERED, FILE_READ_ACCESS)
+#define IOCTL_VIRTUAL_DISK_QUERY_STAGE_STATS    CTL_CODE(FILE_DEVICE_VIRTUAL_DISK, 0x2012, METHOD_BUFFERED, FILE_READ_ACCESS)
+#define IOCTL_VIRTUAL_DISK_QUERY_CONTROL_STATS  CTL_CODE(FILE_DEVICE_VIRTUAL_DISK, 0x2013, METHOD_BUFFERED, FILE_READ_ACCESS)
+#define IOCTL_VIRTUAL_DISK_QUERY_INFLIGHT       CTL_CODE(FILE_DEVICE_VIRTUAL_DISK, 0x2014, METHOD_BUFFERED, FILE_READ_ACCESS)
+#define IOCTL_VIRTUAL_DISK_SNAPSHOT_HEATMAP     CTL_CODE(FILE_DEVICE_VIRTUAL_DISK, 0x2015, METHOD_BUFFERED, FILE_READ_ACCESS)
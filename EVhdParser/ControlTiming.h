@@ -0,0 +1,61 @@
+#pragma once
+/*
+ * Phases of the control path of a disk: open, mount, dismount and close. The
+ * parser times every phase of an operation in 100 ns units, the times are
+ * kept for the disk and counted in driver wide histograms, one per phase.
+ * The histograms use the buckets of the stage timing histograms.
+ * Plain C, read back with IOCTL_VIRTUAL_DISK_QUERY_CONTROL_STATS.
+ */
+#include "SrbTiming.h"
+
+#define CTL_PHASE_OPEN              0   /* Whole EVhd_OpenDisk */
+#define CTL_PHASE_OPEN_FIND_SHIM    1   /* Looking up the vhdmp shim device */
+#define CTL_PHASE_OPEN_CREATE       2   /* Opening the disk through the shim */
+#define CTL_PHASE_OPEN_DIFFERENCING 3   /* Reopening a differencing disk until its parent is found */
+#define CTL_PHASE_OPEN_INITIALIZE   4   /* Parser instance set up, disk size query, service parameters */
+#define CTL_PHASE_OPEN_QOS          5   /* QoS interface registration */
+#define CTL_PHASE_OPEN_DISK_INFO    6   /* Disk information read into the cache */
+#define CTL_PHASE_OPEN_EXTENSION    7   /* Ext_Create */
+#define CTL_PHASE_MOUNT             8
+#define CTL_PHASE_MOUNT_KEY         9   /* Ext_Mount, catalog lookup and key request */
+#define CTL_PHASE_MOUNT_REGISTER_IO 10
+#define CTL_PHASE_MOUNT_ADDRESS     11  /* SCSI address query */
+#define CTL_PHASE_DISMOUNT          12
+#define CTL_PHASE_DISMOUNT_REMOVE   13  /* Removal of the disk from vhdmp */
+#define CTL_PHASE_DISMOUNT_EXTENSION 14 /* Ext_Dismount */
+#define CTL_PHASE_CLOSE             15
+#define CTL_PHASE_CLOSE_QOS         16
+#define CTL_PHASE_CLOSE_FINALIZE    17  /* Ext_Delete, the handle and file object released */
+#define CTL_PHASE_MAX               18
+
+/** Times of the phases of one operation, 0 for the phases not run */
+typedef struct _CTL_TIMING {
+    ULONG64 Time[CTL_PHASE_MAX];
+} CTL_TIMING;
+
+typedef struct _CTL_PHASE_COUNTERS {
+    ULONG64 Count[CTL_PHASE_MAX];
+    ULONG64 Time[CTL_PHASE_MAX];
+    ULONG64 MaxTime[CTL_PHASE_MAX];
+    /* Buckets of SrbTiming_Bucket over the time in 100 ns units */
+    ULONG64 Histogram[CTL_PHASE_MAX][SRB_STAGE_BUCKETS];
+} CTL_PHASE_COUNTERS;
+
+/** Counts the phases First to Last of an operation that were run */
+static __inline VOID CtlTiming_Aggregate(CTL_PHASE_COUNTERS *pCounters, const CTL_TIMING *pTiming, ULONG32 First,
+    ULONG32 Last)
+{
+    ULONG32 Phase = 0;
+
+    for (Phase = First; Phase <= Last; ++Phase)
+    {
+        ULONG64 Time = pTiming->Time[Phase];
+        if (!Time)
+            continue;
+        ++pCounters->Count[Phase];
+        pCounters->Time[Phase] += Time;
+        if (Time > pCounters->MaxTime[Phase])
+            pCounters->MaxTime[Phase] = Time;
+        ++pCounters->Histogram[Phase][SrbTiming_Bucket(Time)];
+    }
+}
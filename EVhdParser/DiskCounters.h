@@ -0,0 +1,332 @@
+#pragma once
+/*
+ * Per-disk performance counters. Every disk has one counter block per
+ * processor, updated with plain stores by the processor that owns it and
+ * summed only when a snapshot is taken, so counting a request does not
+ * bounce cache lines between processors. A thread preempted between picking
+ * its block and updating it may lose an update, the counters are statistics.
+ *
+ * Latencies are measured in TSC ticks from the start of a request to its
+ * completion. The start stamp is kept in a small open addressed table keyed
+ * by the request block because the parser has no room for it in the packet.
+ * The table also holds the opcode, first block and length of every request,
+ * so a scanner can report requests that have been in flight for too long
+ * without taking a lock the IO path has to take as well.
+ * Plain C, evhdtool measures the update cost outside of the kernel.
+ */
+#include "MessageRing.h"
+
+#define DISK_CLASS_READ             0
+#define DISK_CLASS_WRITE            1
+#define DISK_CLASS_OTHER            2
+#define DISK_CLASS_MAX              3
+
+/*
+ * Log-linear latency histogram: two buckets per power of two of 256 ticks, bucket 0 holds everything
+ * below 256 ticks and the last one also everything longer than its range.
+ */
+#define DISK_LATENCY_SHIFT          8
+#define DISK_LATENCY_BUCKETS        64
+
+#define DISK_INFLIGHT_SLOTS         512
+#define DISK_INFLIGHT_PROBES        32
+/* Oldest requests in flight and slowest completions reported per disk */
+#define DISK_INFLIGHT_REPORT        8
+
+#define DISK_INFLIGHT_STUCK         1   /* In flight for longer than the stuck IO threshold */
+#define DISK_INFLIGHT_NEW           2   /* Found stuck by the scan that reported it */
+
+typedef struct _DISK_COUNTERS {
+    ULONG64 Requests[DISK_CLASS_MAX];
+    ULONG64 Completed[DISK_CLASS_MAX];
+    ULONG64 Bytes[DISK_CLASS_MAX];
+    /* Sum of the measured latencies */
+    ULONG64 LatencyTicks[DISK_CLASS_MAX];
+    ULONG64 Errors;
+    /* Ticks and bytes spent encrypting and decrypting */
+    ULONG64 CryptoTicks;
+    ULONG64 CryptoBytes;
+    /* Pages allocated for encrypted copies of written data, and failures to get them */
+    ULONG64 BounceAllocations;
+    ULONG64 BounceFailures;
+    /* Requests whose latency was not measured, the in-flight table was full */
+    ULONG64 Untracked;
+    /* Cacheable SCSI commands answered from the response cache and sent to vhdmp */
+    ULONG64 ResponseHits;
+    ULONG64 ResponseMisses;
+    /* Reads and writes that start and end on a 4 KiB boundary, and the others */
+    ULONG64 AlignedIos;
+    ULONG64 MisalignedIos;
+    /* Reads completed from the read cache, and blocks of completed reads put into it */
+    ULONG64 ReadCacheHits;
+    ULONG64 ReadCacheFills;
+    /* Hits on the blocks shared with the other clones of the parent, counted in ReadCacheHits as well */
+    ULONG64 ParentCacheHits;
+    /* Reads copied from the read-ahead buffer, bytes read ahead and bytes of them never read */
+    ULONG64 ReadAheadHits;
+    ULONG64 ReadAheadBytes;
+    ULONG64 ReadAheadWasted;
+    ULONG64 Reserved[4];
+    ULONG64 Latency[DISK_CLASS_MAX][DISK_LATENCY_BUCKETS];
+} DISK_COUNTERS;
+
+C_ASSERT(sizeof(DISK_COUNTERS) % 64 == 0);
+
+typedef struct _DISK_INFLIGHT_SLOT {
+    /* Request block of the request, 0 for a free slot */
+    volatile LONG64 Key;
+    /* Written after the other fields of a claimed slot and cleared before it is freed, 0 while they are not valid */
+    volatile LONG64 StartTsc;
+    ULONG64 Lba;
+    /* StartTsc of the request the scanner last reported as stuck, compared so a reused slot is reported again */
+    volatile LONG64 StuckTsc;
+    ULONG32 Length;
+    UCHAR Opcode;
+    UCHAR Reserved[3];
+} DISK_INFLIGHT_SLOT;
+
+C_ASSERT(sizeof(DISK_INFLIGHT_SLOT) == 40);
+
+typedef struct _DISK_INFLIGHT_TABLE {
+    DISK_INFLIGHT_SLOT Slots[DISK_INFLIGHT_SLOTS];
+} DISK_INFLIGHT_TABLE;
+
+/** Request in flight or completed, as reported by IOCTL_VIRTUAL_DISK_QUERY_INFLIGHT */
+typedef struct _DISK_INFLIGHT_REQUEST {
+    ULONG64 Lba;
+    /* Time in flight so far, or latency of a completed request, in TSC ticks */
+    ULONG64 Ticks;
+    ULONG32 Length;
+    UCHAR Opcode;
+    /* DISK_INFLIGHT_STUCK and DISK_INFLIGHT_NEW */
+    UCHAR Flags;
+    USHORT Reserved;
+} DISK_INFLIGHT_REQUEST;
+
+C_ASSERT(sizeof(DISK_INFLIGHT_REQUEST) == 24);
+
+/** Result of a scan of the in-flight table */
+typedef struct _DISK_INFLIGHT_SCAN {
+    ULONG32 Outstanding;
+    ULONG32 Stuck;
+    /* Requests found stuck by this scan, they were not reported before */
+    ULONG32 NewlyStuck;
+    ULONG32 OldestCount;
+    /* Longest in flight first */
+    DISK_INFLIGHT_REQUEST Oldest[DISK_INFLIGHT_REPORT];
+} DISK_INFLIGHT_SCAN;
+
+static __inline ULONG32 DiskCounters_Class(UCHAR Opcode)
+{
+    switch (Opcode)
+    {
+    case 0x08: case 0x28: case 0xA8: case 0x88:
+        return DISK_CLASS_READ;
+    case 0x0A: case 0x2A: case 0xAA: case 0x8A:
+        return DISK_CLASS_WRITE;
+    }
+    return DISK_CLASS_OTHER;
+}
+
+static __inline ULONG32 DiskCounters_Bucket(ULONG64 Ticks)
+{
+    ULONG64 Units = Ticks >> DISK_LATENCY_SHIFT;
+    ULONG32 Msb = 0;
+
+    if (Units < 2)
+        return (ULONG32)Units;
+#if defined(_MSC_VER)
+    {
+        unsigned long Index = 0;
+        _BitScanReverse64(&Index, Units);
+        Msb = Index;
+    }
+#else
+    Msb = 63 - __builtin_clzll(Units);
+#endif
+    if (Msb >= DISK_LATENCY_BUCKETS / 2)
+        return DISK_LATENCY_BUCKETS - 1;
+    return 2 * Msb + (ULONG32)((Units >> (Msb - 1)) & 1);
+}
+
+/** Smallest latency in ticks counted by a bucket */
+static __inline ULONG64 DiskCounters_BucketStart(ULONG32 Bucket)
+{
+    if (Bucket < 2)
+        return (ULONG64)Bucket << DISK_LATENCY_SHIFT;
+    return ((ULONG64)(2 | (Bucket & 1)) << (Bucket / 2 - 1)) << DISK_LATENCY_SHIFT;
+}
+
+static __inline ULONG32 DiskInflight_Hash(ULONG64 Key)
+{
+    Key ^= Key >> 17;
+    Key *= 0x9E3779B97F4A7C15ULL;
+    return (ULONG32)(Key >> 40);
+}
+
+/** Remembers when and what a request started, returns FALSE if no slot was found near its hash */
+static __inline BOOLEAN DiskInflight_Insert(DISK_INFLIGHT_TABLE *pTable, ULONG64 Key, ULONG64 StartTsc, UCHAR Opcode,
+    ULONG64 Lba, ULONG32 Length)
+{
+    ULONG32 Index = DiskInflight_Hash(Key), Probe = 0;
+
+    for (Probe = 0; Probe < DISK_INFLIGHT_PROBES; ++Probe, ++Index)
+    {
+        DISK_INFLIGHT_SLOT *pSlot = &pTable->Slots[Index & (DISK_INFLIGHT_SLOTS - 1)];
+        if (pSlot->Key == 0 && RING_COMPARE_EXCHANGE64(&pSlot->Key, (LONG64)Key, 0) == 0)
+        {
+            pSlot->Lba = Lba;
+            pSlot->Length = Length;
+            pSlot->Opcode = Opcode;
+            RING_COMPILER_BARRIER();
+            pSlot->StartTsc = (LONG64)StartTsc;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/** Frees the slot of a request, returns FALSE if it was not found */
+static __inline BOOLEAN DiskInflight_Remove(DISK_INFLIGHT_TABLE *pTable, ULONG64 Key, ULONG64 *pStartTsc)
+{
+    ULONG32 Index = DiskInflight_Hash(Key), Probe = 0;
+
+    for (Probe = 0; Probe < DISK_INFLIGHT_PROBES; ++Probe, ++Index)
+    {
+        DISK_INFLIGHT_SLOT *pSlot = &pTable->Slots[Index & (DISK_INFLIGHT_SLOTS - 1)];
+        if ((ULONG64)pSlot->Key == Key)
+        {
+            *pStartTsc = (ULONG64)pSlot->StartTsc;
+            pSlot->StartTsc = 0;
+            RING_COMPILER_BARRIER();
+            pSlot->Key = 0;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/**
+ * Copies a slot without stopping the requests that use it. Returns FALSE for a free slot and for a slot that
+ * was claimed, freed or reused while it was read, the start of the request copied is returned in pStartTsc.
+ */
+static __inline BOOLEAN DiskInflight_Read(DISK_INFLIGHT_SLOT *pSlot, ULONG64 NowTsc, DISK_INFLIGHT_REQUEST *pRequest,
+    ULONG64 *pStartTsc)
+{
+    LONG64 Key = pSlot->Key, StartTsc = 0;
+
+    if (!Key)
+        return FALSE;
+    StartTsc = pSlot->StartTsc;
+    RING_COMPILER_BARRIER();
+    pRequest->Lba = pSlot->Lba;
+    pRequest->Length = pSlot->Length;
+    pRequest->Opcode = pSlot->Opcode;
+    pRequest->Flags = 0;
+    pRequest->Reserved = 0;
+    RING_COMPILER_BARRIER();
+    if (!StartTsc || pSlot->Key != Key || pSlot->StartTsc != StartTsc)
+        return FALSE;
+    pRequest->Ticks = NowTsc > (ULONG64)StartTsc ? NowTsc - StartTsc : 0;
+    *pStartTsc = (ULONG64)StartTsc;
+    return TRUE;
+}
+
+/** Keeps the DISK_INFLIGHT_REPORT longest requests of a list sorted longest first */
+static __inline VOID DiskInflight_KeepLongest(DISK_INFLIGHT_REQUEST *pList, ULONG32 *pCount,
+    const DISK_INFLIGHT_REQUEST *pRequest)
+{
+    ULONG32 Index = *pCount;
+
+    if (Index == DISK_INFLIGHT_REPORT)
+    {
+        if (pList[Index - 1].Ticks >= pRequest->Ticks)
+            return;
+        --Index;
+    }
+    else
+        ++*pCount;
+    for (; Index > 0 && pList[Index - 1].Ticks < pRequest->Ticks; --Index)
+        pList[Index] = pList[Index - 1];
+    pList[Index] = *pRequest;
+}
+
+/** Shortest time a request needs to enter a full list, 0 while the list is not full */
+static __inline ULONG64 DiskInflight_Floor(const DISK_INFLIGHT_REQUEST *pList, ULONG32 Count)
+{
+    return Count == DISK_INFLIGHT_REPORT ? pList[DISK_INFLIGHT_REPORT - 1].Ticks : 0;
+}
+
+/**
+ * Counts the requests in flight and those in flight for ThresholdTicks or longer, and picks the oldest ones.
+ * A marking scan remembers the stuck requests it found, so the next one does not count them as new again.
+ */
+static __inline VOID DiskInflight_Scan(DISK_INFLIGHT_TABLE *pTable, ULONG64 NowTsc, ULONG64 ThresholdTicks,
+    BOOLEAN Mark, DISK_INFLIGHT_SCAN *pScan)
+{
+    ULONG32 i = 0;
+
+    memset(pScan, 0, sizeof(DISK_INFLIGHT_SCAN));
+    for (i = 0; i < DISK_INFLIGHT_SLOTS; ++i)
+    {
+        DISK_INFLIGHT_SLOT *pSlot = &pTable->Slots[i];
+        DISK_INFLIGHT_REQUEST Request;
+        ULONG64 StartTsc = 0;
+
+        if (!DiskInflight_Read(pSlot, NowTsc, &Request, &StartTsc))
+            continue;
+        ++pScan->Outstanding;
+        if (Request.Ticks >= ThresholdTicks)
+        {
+            ++pScan->Stuck;
+            Request.Flags = DISK_INFLIGHT_STUCK;
+            if ((ULONG64)pSlot->StuckTsc != StartTsc)
+            {
+                ++pScan->NewlyStuck;
+                Request.Flags |= DISK_INFLIGHT_NEW;
+                // A slot reused in the meantime keeps a start that is not its own and is found again
+                if (Mark)
+                    pSlot->StuckTsc = (LONG64)StartTsc;
+            }
+        }
+        DiskInflight_KeepLongest(pScan->Oldest, &pScan->OldestCount, &Request);
+    }
+}
+
+static __inline VOID DiskCounters_Start(DISK_COUNTERS *pCounters, ULONG32 Class)
+{
+    ++pCounters->Requests[Class];
+}
+
+/** Counts a completed request, Ticks is 0 if its start was not recorded */
+static __inline VOID DiskCounters_Complete(DISK_COUNTERS *pCounters, ULONG32 Class, ULONG32 Bytes, ULONG64 Ticks,
+    BOOLEAN Failed)
+{
+    ++pCounters->Completed[Class];
+    pCounters->Bytes[Class] += Bytes;
+    pCounters->Errors += Failed;
+    if (Ticks)
+    {
+        pCounters->LatencyTicks[Class] += Ticks;
+        ++pCounters->Latency[Class][DiskCounters_Bucket(Ticks)];
+    }
+    else
+        ++pCounters->Untracked;
+}
+
+static __inline VOID DiskCounters_Crypto(DISK_COUNTERS *pCounters, ULONG64 Ticks, ULONG32 Bytes)
+{
+    pCounters->CryptoTicks += Ticks;
+    pCounters->CryptoBytes += Bytes;
+}
+
+/** Adds the counters of one processor to a total */
+static __inline VOID DiskCounters_Add(DISK_COUNTERS *pTotal, const DISK_COUNTERS *pCounters)
+{
+    ULONG64 *pTo = (ULONG64 *)pTotal;
+    const ULONG64 *pFrom = (const ULONG64 *)pCounters;
+    ULONG32 i = 0;
+
+    for (i = 0; i < sizeof(DISK_COUNTERS) / sizeof(ULONG64); ++i)
+        pTo[i] += pFrom[i];
+}
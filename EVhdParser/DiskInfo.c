@@ -0,0 +1,159 @@
+#include "stdafx.h"
+#include "DiskInfo.h"
+#include <2012R2/Vstor.h>
+#include "Ioctl.h"
+#include "utils.h"
+#include "Log.h"
+
+#define LOG_DISKINFO(level, format, ...) LOG_FUNCTION(level, LOG_CTG_PARSER, format, __VA_ARGS__)
+
+/* Most requests sent at once */
+#define DISK_INFO_MAX_CALLS 6
+
+/** Sends a IOCTL_STORAGE_VHD_GET_INFORMATION request for every type at once and waits for all of them */
+static NTSTATUS DiskInfo_Query(PFILE_OBJECT pVhdmpFileObject, const EDiskInfoType *pTypes, ULONG Count,
+	DISK_INFO_RESPONSE *pResponses)
+{
+	NTSTATUS status = STATUS_SUCCESS;
+	CONCURRENT_CALL Calls[DISK_INFO_MAX_CALLS];
+	ULONG i = 0;
+
+	ASSERT(Count <= DISK_INFO_MAX_CALLS);
+	for (i = 0; i < Count; ++i)
+	{
+		// The response starts with the request code, its buffer carries the request
+		memset(&pResponses[i], 0, sizeof(DISK_INFO_RESPONSE));
+		pResponses[i].dwRequestCode = pTypes[i];
+		Calls[i].ControlCode = IOCTL_STORAGE_VHD_GET_INFORMATION;
+		Calls[i].SystemBuffer = &pResponses[i];
+		Calls[i].InputBufferLength = sizeof(DISK_INFO_REQUEST);
+		Calls[i].OutputBufferLength = sizeof(DISK_INFO_RESPONSE);
+	}
+	status = ConcurrentCalls(pVhdmpFileObject, Calls, Count);
+	if (!NT_SUCCESS(status))
+	{
+		for (i = 0; i < Count && NT_SUCCESS(Calls[i].Status); ++i);
+		LOG_DISKINFO(LL_ERROR, "Failed to retrieve disk info type %d. 0x%0X\n", i < Count ? pTypes[i] : -1, status);
+	}
+	return status;
+}
+
+VOID DiskInfo_Initialize(DISK_INFO_CACHE *pCache)
+{
+	memset(pCache, 0, sizeof(DISK_INFO_CACHE));
+	KeInitializeSpinLock(&pCache->Lock);
+}
+
+NTSTATUS DiskInfo_Fetch(PFILE_OBJECT pVhdmpFileObject, DISK_INFO_CACHE *pCache, DISK_INFO *pInfo)
+{
+	static const EDiskInfoType Types[] = { EDiskInfoType_Type, EDiskInfoType_ParserInfo, EDiskInfoType_Geometry,
+		EDiskInfoType_LinkageId, EDiskInfoType_PhysicalDisk, EDiskInfoType_Page83Data };
+	NTSTATUS status = STATUS_SUCCESS;
+	DISK_INFO_RESPONSE Responses[ARRAYSIZE(Types)];
+	LONG Generation = 0;
+	KIRQL OldIrql;
+
+	KeAcquireSpinLock(&pCache->Lock, &OldIrql);
+	Generation = pCache->Generation;
+	KeReleaseSpinLock(&pCache->Lock, OldIrql);
+	status = DiskInfo_Query(pVhdmpFileObject, Types, ARRAYSIZE(Types), Responses);
+	if (!NT_SUCCESS(status))
+		return status;
+
+	pInfo->DiskType = Responses[0].vals[0].dwLow;
+	pInfo->DiskFormat = Responses[1].vals[0].dwLow;
+	pInfo->dwBlockSize = Responses[2].vals[2].dwLow;
+	pInfo->qwDiskSize = Responses[2].vals[1].qword;
+	pInfo->qwGeometrySize = Responses[2].vals[0].qword;
+	pInfo->dwSectorSize = Responses[2].vals[2].dwHigh;
+	pInfo->LinkageId = Responses[3].guid;
+	pInfo->IsRemote = (BOOLEAN)Responses[4].vals[0].dwLow;
+	pInfo->DiskIdentifier = Responses[5].guid;
+	KeAcquireSpinLock(&pCache->Lock, &OldIrql);
+	// The disk may have changed while the requests were in flight, the next query reads it again
+	if (Generation == pCache->Generation)
+	{
+		pCache->Info = *pInfo;
+		pCache->bValid = TRUE;
+	}
+	KeReleaseSpinLock(&pCache->Lock, OldIrql);
+	return status;
+}
+
+/** Copies the cached information, or reads it from vhdmp if it was invalidated */
+static NTSTATUS DiskInfo_Get(PFILE_OBJECT pVhdmpFileObject, DISK_INFO_CACHE *pCache, DISK_INFO *pInfo)
+{
+	BOOLEAN bValid = FALSE;
+	KIRQL OldIrql;
+
+	KeAcquireSpinLock(&pCache->Lock, &OldIrql);
+	bValid = pCache->bValid;
+	if (bValid)
+		*pInfo = pCache->Info;
+	KeReleaseSpinLock(&pCache->Lock, OldIrql);
+	return bValid ? STATUS_SUCCESS : DiskInfo_Fetch(pVhdmpFileObject, pCache, pInfo);
+}
+
+NTSTATUS DiskInfo_QueryParent(PFILE_OBJECT pVhdmpFileObject, GUID *pParentId)
+{
+	static const EDiskInfoType Types[] = { EDiskInfoType_ParentLinkageId };
+	NTSTATUS status = STATUS_SUCCESS;
+	DISK_INFO_RESPONSE Responses[ARRAYSIZE(Types)];
+
+	status = DiskInfo_Query(pVhdmpFileObject, Types, ARRAYSIZE(Types), Responses);
+	if (NT_SUCCESS(status))
+		*pParentId = Responses[0].guid;
+	return status;
+}
+
+VOID DiskInfo_Invalidate(DISK_INFO_CACHE *pCache)
+{
+	KIRQL OldIrql;
+
+	KeAcquireSpinLock(&pCache->Lock, &OldIrql);
+	++pCache->Generation;
+	pCache->bValid = FALSE;
+	KeReleaseSpinLock(&pCache->Lock, OldIrql);
+}
+
+NTSTATUS DiskInfo_QueryFormat(PFILE_OBJECT pVhdmpFileObject, DISK_INFO_CACHE *pCache, DISK_INFO_FORMAT *pFormat)
+{
+	// The disk is in use and allocated by writes that do not pass the parser
+	static const EDiskInfoType Types[] = { EDiskInfoType_InUseFlag, EDiskInfoType_IsFullyAllocated };
+	NTSTATUS status = STATUS_SUCCESS;
+	DISK_INFO_RESPONSE Responses[ARRAYSIZE(Types)];
+	DISK_INFO Info;
+
+	status = DiskInfo_Get(pVhdmpFileObject, pCache, &Info);
+	if (!NT_SUCCESS(status))
+		return status;
+	status = DiskInfo_Query(pVhdmpFileObject, Types, ARRAYSIZE(Types), Responses);
+	if (!NT_SUCCESS(status))
+		return status;
+
+	memset(pFormat, 0, sizeof(DISK_INFO_FORMAT));
+	pFormat->DiskType = Info.DiskType;
+	pFormat->DiskFormat = Info.DiskFormat;
+	pFormat->dwBlockSize = Info.dwBlockSize;
+	pFormat->LinkageId = Info.LinkageId;
+	pFormat->IsRemote = Info.IsRemote;
+	pFormat->DiskIdentifier = Info.DiskIdentifier;
+	pFormat->qwDiskSize = Info.qwDiskSize;
+	pFormat->bIsInUse = (BOOLEAN)Responses[0].vals[0].dwLow;
+	pFormat->bIsFullyAllocated = (BOOLEAN)Responses[1].vals[0].dwLow;
+	return status;
+}
+
+NTSTATUS DiskInfo_QueryGeometry(PFILE_OBJECT pVhdmpFileObject, DISK_INFO_CACHE *pCache, DISK_INFO_GEOMETRY *pGeometry)
+{
+	NTSTATUS status = STATUS_SUCCESS;
+	DISK_INFO Info;
+
+	status = DiskInfo_Get(pVhdmpFileObject, pCache, &Info);
+	if (NT_SUCCESS(status))
+	{
+		pGeometry->qwDiskSize = Info.qwGeometrySize;
+		pGeometry->dwSectorSize = Info.dwSectorSize;
+	}
+	return status;
+}
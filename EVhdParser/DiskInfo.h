@@ -0,0 +1,50 @@
+#pragma once
+#include <ntifs.h>
+#include "Vdrvroot.h"
+
+/* Layouts of the 2012 R2 parser interface, the 2012 parser only reads the disk information */
+struct _DISK_INFO_FORMAT;
+struct _DISK_INFO_GEOMETRY;
+
+/* DiskType of a differencing disk */
+#define DISK_INFO_TYPE_DIFFERENCING 4
+
+/** Disk information that only meta-operations such as a resize change */
+typedef struct _DISK_INFO {
+	INT DiskType;
+	EDiskFormat DiskFormat;
+	INT dwBlockSize;
+	BOOLEAN IsRemote;
+	GUID LinkageId;
+	GUID DiskIdentifier;	// Page 83 data
+	/* From the geometry, the size of the format query and the size and sector size of the geometry query */
+	LONG64 qwDiskSize;
+	ULONG64 qwGeometrySize;
+	INT dwSectorSize;
+} DISK_INFO;
+
+/**
+ * DISK_INFO of an open disk. It is read at open with concurrent IOCTL_STORAGE_VHD_GET_INFORMATION requests and
+ * read again by the next query after it was invalidated.
+ */
+typedef struct _DISK_INFO_CACHE {
+	/* Guards the rest, invalidations come from completion routines */
+	KSPIN_LOCK Lock;
+	/* Bumped by every invalidation, a fetch started before one does not fill the cache */
+	LONG Generation;
+	BOOLEAN bValid;
+	DISK_INFO Info;
+} DISK_INFO_CACHE;
+
+VOID DiskInfo_Initialize(DISK_INFO_CACHE *pCache);
+/** Reads the information of a disk into the cache, and into pInfo even if the cache was invalidated meanwhile */
+NTSTATUS DiskInfo_Fetch(PFILE_OBJECT pVhdmpFileObject, DISK_INFO_CACHE *pCache, DISK_INFO *pInfo);
+/** Makes the next query read the disk information again, callable at any IRQL */
+VOID DiskInfo_Invalidate(DISK_INFO_CACHE *pCache);
+/** Linkage identifier of the parent of a differencing disk */
+NTSTATUS DiskInfo_QueryParent(PFILE_OBJECT pVhdmpFileObject, GUID *pParentId);
+/** EDiskInfo_Format query, only the flags that change with the data are read from vhdmp */
+NTSTATUS DiskInfo_QueryFormat(PFILE_OBJECT pVhdmpFileObject, DISK_INFO_CACHE *pCache, struct _DISK_INFO_FORMAT *pFormat);
+/** Size and sector size of an EDiskInfo_Geometry query, the caller sets the number of sectors */
+NTSTATUS DiskInfo_QueryGeometry(PFILE_OBJECT pVhdmpFileObject, DISK_INFO_CACHE *pCache,
+	struct _DISK_INFO_GEOMETRY *pGeometry);
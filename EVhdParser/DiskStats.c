@@ -0,0 +1,461 @@
+#include "stdafx.h"
+#include "DiskStats.h"
+#include "RegUtils.h"
+#include "Log.h"
+#include "FlightRecorder.h"
+#include "IrpPool.h"
+
+static const ULONG DiskStatsAllocationTag = 'SDVE';
+static LIST_ENTRY DiskStatsList;
+static KSPIN_LOCK DiskStatsLock;
+/* TSC and performance counter read together at start, the TSC frequency is measured against them */
+static ULONG64 DiskStatsStartTsc = 0;
+static LARGE_INTEGER DiskStatsStartCounter = { 0 };
+/* Parameters\StageTiming, read once when the driver starts */
+static ULONG32 DiskStatsStageTiming = 0;
+/* Control path phases of every disk, updated under the list lock */
+static CTL_PHASE_COUNTERS DiskStatsControl;
+/* Parameters\InflightScanPeriod and Parameters\StuckIoThreshold in milliseconds */
+static ULONG32 DiskStatsScanPeriod = 1000;
+static ULONG32 DiskStatsStuckThreshold = 10000;
+/* Parameters\Heatmap, disks opened while it is set get a heatmap */
+static ULONG32 DiskStatsHeatmap = 0;
+static KTIMER DiskStatsScanTimer;
+static KDPC DiskStatsScanDpc;
+static KDEFERRED_ROUTINE DiskStats_ScanDpc;
+
+static ULONG64 DiskStats_TscFrequency();
+
+NTSTATUS DiskStats_Initialize(_In_ PCUNICODE_STRING pRegistryPath)
+{
+	HANDLE hKey = NULL, hParametersKey = NULL;
+	OBJECT_ATTRIBUTES fAttrs;
+	UNICODE_STRING SubkeyName;
+
+	InitializeListHead(&DiskStatsList);
+	KeInitializeSpinLock(&DiskStatsLock);
+	DiskStatsStartTsc = ReadTimeStampCounter();
+	DiskStatsStartCounter = KeQueryPerformanceCounter(NULL);
+
+	// Stage timing stays off if the parameter can not be read
+	InitializeObjectAttributes(&fAttrs, (PUNICODE_STRING)pRegistryPath, OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, NULL, NULL);
+	if (NT_SUCCESS(ZwOpenKey(&hKey, KEY_READ, &fAttrs)))
+	{
+		RtlInitUnicodeString(&SubkeyName, L"Parameters");
+		InitializeObjectAttributes(&fAttrs, &SubkeyName, OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, hKey, NULL);
+		if (NT_SUCCESS(ZwOpenKey(&hParametersKey, KEY_READ, &fAttrs)))
+		{
+			Reg_GetDwordValue(hParametersKey, L"StageTiming", &DiskStatsStageTiming);
+			Reg_GetDwordValue(hParametersKey, L"InflightScanPeriod", &DiskStatsScanPeriod);
+			Reg_GetDwordValue(hParametersKey, L"StuckIoThreshold", &DiskStatsStuckThreshold);
+			Reg_GetDwordValue(hParametersKey, L"Heatmap", &DiskStatsHeatmap);
+			ZwClose(hParametersKey);
+		}
+		ZwClose(hKey);
+	}
+
+	KeInitializeTimer(&DiskStatsScanTimer);
+	KeInitializeDpc(&DiskStatsScanDpc, DiskStats_ScanDpc, NULL);
+	if (DiskStatsScanPeriod)
+	{
+		LARGE_INTEGER DueTime;
+		DueTime.QuadPart = -(LONGLONG)DiskStatsScanPeriod * 10000;
+		KeSetTimerEx(&DiskStatsScanTimer, DueTime, DiskStatsScanPeriod, &DiskStatsScanDpc);
+	}
+	return STATUS_SUCCESS;
+}
+
+BOOLEAN DiskStats_StageTimingEnabled()
+{
+	return DiskStatsStageTiming != 0;
+}
+
+VOID DiskStats_Cleanup()
+{
+	KeCancelTimer(&DiskStatsScanTimer);
+	KeFlushQueuedDpcs();
+	// Every disk is closed by now
+	NT_ASSERT(IsListEmpty(&DiskStatsList));
+}
+
+NTSTATUS DiskStats_Create(_In_ const GUID *pDiskId, _In_ const GUID *pApplicationId, USHORT DiskTag,
+	_Out_ DISK_STATS_CONTEXT **ppStats)
+{
+	ULONG Processors = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+	DISK_STATS_CONTEXT *pStats = NULL;
+	KIRQL OldIrql;
+
+	*ppStats = NULL;
+	pStats = ExAllocatePoolWithTag(NonPagedPoolNx, sizeof(DISK_STATS_CONTEXT), DiskStatsAllocationTag);
+	if (!pStats)
+		return STATUS_INSUFFICIENT_RESOURCES;
+	RtlZeroMemory(pStats, sizeof(DISK_STATS_CONTEXT));
+
+	pStats->pCounters = ExAllocatePoolWithTag(NonPagedPoolNxCacheAligned, Processors * sizeof(DISK_COUNTERS),
+		DiskStatsAllocationTag);
+	if (!pStats->pCounters)
+	{
+		ExFreePoolWithTag(pStats, DiskStatsAllocationTag);
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+	RtlZeroMemory(pStats->pCounters, Processors * sizeof(DISK_COUNTERS));
+	if (DiskStatsStageTiming)
+	{
+		// The disk is still counted without them
+		pStats->pStages = ExAllocatePoolWithTag(NonPagedPoolNxCacheAligned, Processors * sizeof(SRB_STAGE_COUNTERS),
+			DiskStatsAllocationTag);
+		if (pStats->pStages)
+			RtlZeroMemory(pStats->pStages, Processors * sizeof(SRB_STAGE_COUNTERS));
+	}
+	if (DiskStatsHeatmap)
+	{
+		// Same, without a heatmap
+		pStats->pHeat = ExAllocatePoolWithTag(NonPagedPoolNx, sizeof(HEAT_MAP), DiskStatsAllocationTag);
+		if (pStats->pHeat)
+			HeatMap_Initialize(pStats->pHeat);
+	}
+	KeInitializeSpinLock(&pStats->HeatLock);
+	pStats->DiskId = *pDiskId;
+	pStats->ApplicationId = *pApplicationId;
+	pStats->DiskTag = DiskTag;
+	pStats->Processors = Processors;
+	KeInitializeSpinLock(&pStats->OutlierLock);
+
+	KeAcquireSpinLock(&DiskStatsLock, &OldIrql);
+	InsertTailList(&DiskStatsList, &pStats->Link);
+	KeReleaseSpinLock(&DiskStatsLock, OldIrql);
+
+	*ppStats = pStats;
+	return STATUS_SUCCESS;
+}
+
+VOID DiskStats_Delete(_In_ DISK_STATS_CONTEXT *pStats)
+{
+	KIRQL OldIrql;
+
+	KeAcquireSpinLock(&DiskStatsLock, &OldIrql);
+	RemoveEntryList(&pStats->Link);
+	KeReleaseSpinLock(&DiskStatsLock, OldIrql);
+
+	if (pStats->pStages)
+		ExFreePoolWithTag(pStats->pStages, DiskStatsAllocationTag);
+	if (pStats->pHeat)
+		ExFreePoolWithTag(pStats->pHeat, DiskStatsAllocationTag);
+	ExFreePoolWithTag(pStats->pCounters, DiskStatsAllocationTag);
+	ExFreePoolWithTag(pStats, DiskStatsAllocationTag);
+}
+
+/** TSC ticks per second measured since the driver started, 0 if too little time has passed */
+static ULONG64 DiskStats_TscFrequency()
+{
+	LARGE_INTEGER Frequency, Counter = KeQueryPerformanceCounter(&Frequency);
+	ULONG64 Ticks = ReadTimeStampCounter() - DiskStatsStartTsc;
+	ULONG64 Elapsed = Counter.QuadPart - DiskStatsStartCounter.QuadPart;
+
+	if (Elapsed < (ULONG64)Frequency.QuadPart / 100)
+		return 0;
+	// Both spans are halved until the product fits in 64 bits
+	while (Ticks > MAXULONG64 / Frequency.QuadPart)
+	{
+		Ticks >>= 1;
+		Elapsed >>= 1;
+	}
+	return Elapsed ? Ticks * Frequency.QuadPart / Elapsed : 0;
+}
+
+NTSTATUS DiskStats_Query(_Out_writes_bytes_(Length) DISK_STATS_LIST *pList, ULONG Length, _Out_ ULONG_PTR *pInformation)
+{
+	PLIST_ENTRY pEntry = NULL;
+	ULONG Capacity = 0, Count = 0, Processor = 0, Class = 0;
+	KIRQL OldIrql;
+
+	*pInformation = 0;
+	if (Length < FIELD_OFFSET(DISK_STATS_LIST, Disks))
+		return STATUS_BUFFER_TOO_SMALL;
+	Capacity = (Length - FIELD_OFFSET(DISK_STATS_LIST, Disks)) / sizeof(DISK_STATS);
+	pList->TscFrequency = DiskStats_TscFrequency();
+
+	KeAcquireSpinLock(&DiskStatsLock, &OldIrql);
+	for (pEntry = DiskStatsList.Flink; pEntry != &DiskStatsList; pEntry = pEntry->Flink)
+	{
+		DISK_STATS_CONTEXT *pStats = CONTAINING_RECORD(pEntry, DISK_STATS_CONTEXT, Link);
+		DISK_STATS *pDisk = NULL;
+		if (Count++ >= Capacity)
+			continue;
+
+		pDisk = &pList->Disks[Count - 1];
+		RtlZeroMemory(pDisk, sizeof(DISK_STATS));
+		pDisk->DiskId = pStats->DiskId;
+		pDisk->ApplicationId = pStats->ApplicationId;
+		pDisk->DiskTag = pStats->DiskTag;
+		for (Processor = 0; Processor < pStats->Processors; ++Processor)
+			DiskCounters_Add(&pDisk->Counters, &pStats->pCounters[Processor]);
+		for (Class = 0; Class < DISK_CLASS_MAX; ++Class)
+			pDisk->InFlight += pDisk->Counters.Requests[Class] - pDisk->Counters.Completed[Class];
+	}
+	KeReleaseSpinLock(&DiskStatsLock, OldIrql);
+
+	pList->Count = Count;
+	pList->Reserved = 0;
+	*pInformation = FIELD_OFFSET(DISK_STATS_LIST, Disks) + min(Count, Capacity) * sizeof(DISK_STATS);
+	return STATUS_SUCCESS;
+}
+
+VOID DiskStats_RecordOutlier(_In_ DISK_STATS_CONTEXT *pStats, _In_ const DISK_INFLIGHT_REQUEST *pRequest)
+{
+	KIRQL OldIrql;
+
+	KeAcquireSpinLock(&pStats->OutlierLock, &OldIrql);
+	DiskInflight_KeepLongest(pStats->Slowest[0], &pStats->SlowestCount[0], pRequest);
+	pStats->OutlierFloor = DiskInflight_Floor(pStats->Slowest[0], pStats->SlowestCount[0]);
+	KeReleaseSpinLock(&pStats->OutlierLock, OldIrql);
+}
+
+VOID DiskStats_AccessLocked(_In_ DISK_STATS_CONTEXT *pStats, ULONG64 Offset, BOOLEAN Write, BOOLEAN Fold,
+	_In_reads_(Candidates) const HEAT_HOT_BLOCK *pCandidates, ULONG32 Candidates)
+{
+	ULONG32 i = 0;
+	KIRQL OldIrql;
+
+	KeAcquireSpinLock(&pStats->HeatLock, &OldIrql);
+	if (Fold)
+	{
+		HeatMap_Fold(pStats->pHeat, Offset);
+		HeatMap_CountBucket(pStats->pHeat, Offset, Write);
+	}
+	for (i = 0; i < Candidates; ++i)
+		HeatMap_Promote(pStats->pHeat, &pCandidates[i]);
+	KeReleaseSpinLock(&pStats->HeatLock, OldIrql);
+}
+
+NTSTATUS DiskStats_SnapshotHeat(_In_ const HEAT_SNAPSHOT_REQUEST *pRequest,
+	_Out_writes_bytes_(Length) HEAT_SNAPSHOT_HEADER *pHeader, ULONG Length, _Out_ ULONG_PTR *pInformation)
+{
+	NTSTATUS Status = STATUS_NOT_FOUND;
+	PLIST_ENTRY pEntry = NULL;
+	LARGE_INTEGER SystemTime, LocalTime;
+	KIRQL OldIrql;
+
+	*pInformation = 0;
+	if (Length < sizeof(HEAT_SNAPSHOT_HEADER))
+		return STATUS_BUFFER_TOO_SMALL;
+	KeQuerySystemTime(&SystemTime);
+	ExSystemTimeToLocalTime(&SystemTime, &LocalTime);
+
+	KeAcquireSpinLock(&DiskStatsLock, &OldIrql);
+	for (pEntry = DiskStatsList.Flink; pEntry != &DiskStatsList; pEntry = pEntry->Flink)
+	{
+		DISK_STATS_CONTEXT *pStats = CONTAINING_RECORD(pEntry, DISK_STATS_CONTEXT, Link);
+		if (pStats->DiskTag != pRequest->DiskTag)
+			continue;
+		if (!pStats->pHeat)
+		{
+			Status = STATUS_NOT_SUPPORTED;
+			break;
+		}
+
+		RtlZeroMemory(pHeader, sizeof(HEAT_SNAPSHOT_HEADER));
+		pHeader->DiskTag = pStats->DiskTag;
+		pHeader->DiskId = pStats->DiskId;
+		pHeader->ApplicationId = pStats->ApplicationId;
+		pHeader->LocalTime = LocalTime.QuadPart;
+		KeAcquireSpinLockAtDpcLevel(&pStats->HeatLock);
+		if (HeatMap_Snapshot(pStats->pHeat, pHeader, Length))
+		{
+			*pInformation = pHeader->TotalSize;
+			Status = STATUS_SUCCESS;
+			if (pRequest->Flags & HEAT_SNAPSHOT_RESET)
+				HeatMap_Initialize(pStats->pHeat);
+		}
+		else
+		{
+			// The header alone tells the size needed
+			*pInformation = sizeof(HEAT_SNAPSHOT_HEADER);
+			Status = STATUS_BUFFER_OVERFLOW;
+		}
+		KeReleaseSpinLockFromDpcLevel(&pStats->HeatLock);
+		break;
+	}
+	KeReleaseSpinLock(&DiskStatsLock, OldIrql);
+	return Status;
+}
+
+/** TSC ticks of the stuck IO threshold, all ones while the TSC frequency is not known yet */
+static ULONG64 DiskStats_StuckTicks(ULONG64 TscFrequency)
+{
+	return TscFrequency ? TscFrequency / 1000 * DiskStatsStuckThreshold : MAXULONG64;
+}
+
+/** Reports the requests that got stuck since the last period and starts a new outlier period on every disk */
+static VOID DiskStats_ScanDpc(PKDPC pDpc, PVOID pDeferredContext, PVOID pSystemArgument1, PVOID pSystemArgument2)
+{
+	UNREFERENCED_PARAMETER(pDpc);
+	UNREFERENCED_PARAMETER(pDeferredContext);
+	UNREFERENCED_PARAMETER(pSystemArgument1);
+	UNREFERENCED_PARAMETER(pSystemArgument2);
+	ULONG64 TscFrequency = DiskStats_TscFrequency();
+	ULONG64 StuckTicks = DiskStats_StuckTicks(TscFrequency);
+	PLIST_ENTRY pEntry = NULL;
+	DISK_INFLIGHT_SCAN Scan;
+	ULONG i = 0;
+
+	KeAcquireSpinLockAtDpcLevel(&DiskStatsLock);
+	for (pEntry = DiskStatsList.Flink; pEntry != &DiskStatsList; pEntry = pEntry->Flink)
+	{
+		DISK_STATS_CONTEXT *pStats = CONTAINING_RECORD(pEntry, DISK_STATS_CONTEXT, Link);
+
+		KeAcquireSpinLockAtDpcLevel(&pStats->OutlierLock);
+		pStats->SlowestCount[1] = pStats->SlowestCount[0];
+		RtlCopyMemory(pStats->Slowest[1], pStats->Slowest[0], sizeof(pStats->Slowest[0]));
+		pStats->SlowestCount[0] = 0;
+		pStats->OutlierFloor = 0;
+		KeReleaseSpinLockFromDpcLevel(&pStats->OutlierLock);
+
+		DiskInflight_Scan(&pStats->Inflight, ReadTimeStampCounter(), StuckTicks, TRUE, &Scan);
+		if (!Scan.NewlyStuck)
+			continue;
+		pStats->StuckTotal += Scan.NewlyStuck;
+		GNRLLOG(LL_WARNING, "Disk %u: %u of %u requests in flight for more than %u ms, %u of them new",
+			pStats->DiskTag, Scan.Stuck, Scan.Outstanding, DiskStatsStuckThreshold, Scan.NewlyStuck);
+		// Only the oldest are recorded, the query returns the rest of the picture
+		for (i = 0; i < Scan.OldestCount; ++i)
+		{
+			if (Scan.Oldest[i].Flags & DISK_INFLIGHT_NEW)
+				Flight_Record(FlightEventSrbStuck, Scan.Oldest[i].Opcode, pStats->DiskTag, Scan.Oldest[i].Lba,
+					Scan.Oldest[i].Length, (ULONG32)min(Scan.Oldest[i].Ticks / (TscFrequency / 1000), MAXULONG32));
+		}
+	}
+	KeReleaseSpinLockFromDpcLevel(&DiskStatsLock);
+}
+
+NTSTATUS DiskStats_QueryInflight(_Out_writes_bytes_(Length) DISK_INFLIGHT_LIST *pList, ULONG Length,
+	_Out_ ULONG_PTR *pInformation)
+{
+	PLIST_ENTRY pEntry = NULL;
+	ULONG Capacity = 0, Count = 0;
+	ULONG64 StuckTicks = 0;
+	KIRQL OldIrql;
+
+	*pInformation = 0;
+	if (Length < FIELD_OFFSET(DISK_INFLIGHT_LIST, Disks))
+		return STATUS_BUFFER_TOO_SMALL;
+	Capacity = (Length - FIELD_OFFSET(DISK_INFLIGHT_LIST, Disks)) / sizeof(DISK_INFLIGHT_STATS);
+	pList->TscFrequency = DiskStats_TscFrequency();
+	StuckTicks = DiskStats_StuckTicks(pList->TscFrequency);
+
+	KeAcquireSpinLock(&DiskStatsLock, &OldIrql);
+	for (pEntry = DiskStatsList.Flink; pEntry != &DiskStatsList; pEntry = pEntry->Flink)
+	{
+		DISK_STATS_CONTEXT *pStats = CONTAINING_RECORD(pEntry, DISK_STATS_CONTEXT, Link);
+		DISK_INFLIGHT_STATS *pDisk = NULL;
+		if (Count++ >= Capacity)
+			continue;
+
+		pDisk = &pList->Disks[Count - 1];
+		RtlZeroMemory(pDisk, sizeof(DISK_INFLIGHT_STATS));
+		pDisk->DiskId = pStats->DiskId;
+		pDisk->ApplicationId = pStats->ApplicationId;
+		pDisk->DiskTag = pStats->DiskTag;
+		pDisk->StuckTotal = pStats->StuckTotal;
+		// Leaves the reporting of new stuck requests to the scanner
+		DiskInflight_Scan(&pStats->Inflight, ReadTimeStampCounter(), StuckTicks, FALSE, &pDisk->Scan);
+
+		KeAcquireSpinLockAtDpcLevel(&pStats->OutlierLock);
+		pDisk->SlowestCount = pStats->SlowestCount[1];
+		RtlCopyMemory(pDisk->Slowest, pStats->Slowest[1], sizeof(pDisk->Slowest));
+		KeReleaseSpinLockFromDpcLevel(&pStats->OutlierLock);
+	}
+	KeReleaseSpinLock(&DiskStatsLock, OldIrql);
+
+	pList->Count = Count;
+	pList->ScanPeriod = DiskStatsScanPeriod;
+	pList->StuckThreshold = DiskStatsStuckThreshold;
+	pList->Reserved = 0;
+	*pInformation = FIELD_OFFSET(DISK_INFLIGHT_LIST, Disks) + min(Count, Capacity) * sizeof(DISK_INFLIGHT_STATS);
+	return STATUS_SUCCESS;
+}
+
+VOID DiskStats_RecordControl(_In_opt_ DISK_STATS_CONTEXT *pStats, _In_ const CTL_TIMING *pTiming, ULONG First, ULONG Last)
+{
+	KIRQL OldIrql;
+
+	KeAcquireSpinLock(&DiskStatsLock, &OldIrql);
+	CtlTiming_Aggregate(&DiskStatsControl, pTiming, First, Last);
+	if (pStats)
+		RtlCopyMemory(&pStats->Control.Time[First], &pTiming->Time[First], (Last - First + 1) * sizeof(ULONG64));
+	KeReleaseSpinLock(&DiskStatsLock, OldIrql);
+}
+
+NTSTATUS DiskStats_QueryControl(_Out_writes_bytes_(Length) CONTROL_STATS_LIST *pList, ULONG Length,
+	_Out_ ULONG_PTR *pInformation)
+{
+	PLIST_ENTRY pEntry = NULL;
+	ULONG Capacity = 0, Count = 0;
+	KIRQL OldIrql;
+
+	*pInformation = 0;
+	if (Length < FIELD_OFFSET(CONTROL_STATS_LIST, Disks))
+		return STATUS_BUFFER_TOO_SMALL;
+	Capacity = (Length - FIELD_OFFSET(CONTROL_STATS_LIST, Disks)) / sizeof(DISK_CONTROL_STATS);
+
+	IrpPool_QueryStats(&pList->Irps);
+	KeAcquireSpinLock(&DiskStatsLock, &OldIrql);
+	pList->Phases = DiskStatsControl;
+	for (pEntry = DiskStatsList.Flink; pEntry != &DiskStatsList; pEntry = pEntry->Flink)
+	{
+		DISK_STATS_CONTEXT *pStats = CONTAINING_RECORD(pEntry, DISK_STATS_CONTEXT, Link);
+		DISK_CONTROL_STATS *pDisk = NULL;
+		if (Count++ >= Capacity)
+			continue;
+
+		pDisk = &pList->Disks[Count - 1];
+		pDisk->DiskId = pStats->DiskId;
+		pDisk->ApplicationId = pStats->ApplicationId;
+		pDisk->DiskTag = pStats->DiskTag;
+		pDisk->Reserved = 0;
+		pDisk->Last = pStats->Control;
+	}
+	KeReleaseSpinLock(&DiskStatsLock, OldIrql);
+
+	pList->Count = Count;
+	pList->Reserved = 0;
+	*pInformation = FIELD_OFFSET(CONTROL_STATS_LIST, Disks) + min(Count, Capacity) * sizeof(DISK_CONTROL_STATS);
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS DiskStats_QueryStages(_Out_writes_bytes_(Length) DISK_STAGE_STATS_LIST *pList, ULONG Length,
+	_Out_ ULONG_PTR *pInformation)
+{
+	PLIST_ENTRY pEntry = NULL;
+	ULONG Capacity = 0, Count = 0, Processor = 0;
+	KIRQL OldIrql;
+
+	*pInformation = 0;
+	if (Length < FIELD_OFFSET(DISK_STAGE_STATS_LIST, Disks))
+		return STATUS_BUFFER_TOO_SMALL;
+	Capacity = (Length - FIELD_OFFSET(DISK_STAGE_STATS_LIST, Disks)) / sizeof(DISK_STAGE_STATS);
+	pList->TscFrequency = DiskStats_TscFrequency();
+
+	KeAcquireSpinLock(&DiskStatsLock, &OldIrql);
+	for (pEntry = DiskStatsList.Flink; pEntry != &DiskStatsList; pEntry = pEntry->Flink)
+	{
+		DISK_STATS_CONTEXT *pStats = CONTAINING_RECORD(pEntry, DISK_STATS_CONTEXT, Link);
+		DISK_STAGE_STATS *pDisk = NULL;
+		if (!pStats->pStages || Count++ >= Capacity)
+			continue;
+
+		pDisk = &pList->Disks[Count - 1];
+		RtlZeroMemory(pDisk, sizeof(DISK_STAGE_STATS));
+		pDisk->DiskId = pStats->DiskId;
+		pDisk->ApplicationId = pStats->ApplicationId;
+		pDisk->DiskTag = pStats->DiskTag;
+		for (Processor = 0; Processor < pStats->Processors; ++Processor)
+			SrbTiming_Add(&pDisk->Stages, &pStats->pStages[Processor]);
+	}
+	KeReleaseSpinLock(&DiskStatsLock, OldIrql);
+
+	pList->Count = Count;
+	pList->Enabled = DiskStatsStageTiming != 0;
+	*pInformation = FIELD_OFFSET(DISK_STAGE_STATS_LIST, Disks) + min(Count, Capacity) * sizeof(DISK_STAGE_STATS);
+	return STATUS_SUCCESS;
+}
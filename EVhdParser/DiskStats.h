@@ -0,0 +1,112 @@
+#pragma once
+#include "Control.h"
+
+/** Counters of an open disk */
+typedef struct _DISK_STATS_CONTEXT {
+	LIST_ENTRY Link;
+	GUID DiskId;
+	GUID ApplicationId;
+	USHORT DiskTag;
+	ULONG Processors;
+	/* One cache aligned block per processor */
+	DISK_COUNTERS *pCounters;
+	/* One cache aligned block per processor, NULL if stage timing was off when the disk was opened */
+	SRB_STAGE_COUNTERS *pStages;
+	/* Control path phases, written under the list lock */
+	CTL_TIMING Control;
+	/* Requests found stuck by the scanner, written under the list lock */
+	ULONG64 StuckTotal;
+	/* Slowest completions of the current and of the last scan period, under the outlier lock */
+	KSPIN_LOCK OutlierLock;
+	ULONG32 SlowestCount[2];
+	DISK_INFLIGHT_REQUEST Slowest[2][DISK_INFLIGHT_REPORT];
+	/* Shortest latency that enters the current list, read without the lock */
+	volatile ULONG64 OutlierFloor;
+	/* NULL if the heatmap was off when the disk was opened, folded and promoted into under the heat lock */
+	HEAT_MAP *pHeat;
+	KSPIN_LOCK HeatLock;
+	DISK_INFLIGHT_TABLE Inflight;
+} DISK_STATS_CONTEXT;
+
+/** Reads the StageTiming, InflightScanPeriod, StuckIoThreshold and Heatmap parameters and starts the in-flight scanner */
+NTSTATUS DiskStats_Initialize(_In_ PCUNICODE_STRING pRegistryPath);
+/** Stops the scanner */
+VOID DiskStats_Cleanup();
+NTSTATUS DiskStats_Create(_In_ const GUID *pDiskId, _In_ const GUID *pApplicationId, USHORT DiskTag,
+	_Out_ DISK_STATS_CONTEXT **ppStats);
+VOID DiskStats_Delete(_In_ DISK_STATS_CONTEXT *pStats);
+NTSTATUS DiskStats_Query(_Out_writes_bytes_(Length) DISK_STATS_LIST *pList, ULONG Length, _Out_ ULONG_PTR *pInformation);
+NTSTATUS DiskStats_QueryStages(_Out_writes_bytes_(Length) DISK_STAGE_STATS_LIST *pList, ULONG Length,
+	_Out_ ULONG_PTR *pInformation);
+/** TRUE if requests of newly mounted disks are stage timed */
+BOOLEAN DiskStats_StageTimingEnabled();
+/** Counts the phases First to Last of a control operation, and keeps them for the disk if there is one */
+VOID DiskStats_RecordControl(_In_opt_ DISK_STATS_CONTEXT *pStats, _In_ const CTL_TIMING *pTiming, ULONG First, ULONG Last);
+NTSTATUS DiskStats_QueryControl(_Out_writes_bytes_(Length) CONTROL_STATS_LIST *pList, ULONG Length,
+	_Out_ ULONG_PTR *pInformation);
+NTSTATUS DiskStats_QueryInflight(_Out_writes_bytes_(Length) DISK_INFLIGHT_LIST *pList, ULONG Length,
+	_Out_ ULONG_PTR *pInformation);
+VOID DiskStats_RecordOutlier(_In_ DISK_STATS_CONTEXT *pStats, _In_ const DISK_INFLIGHT_REQUEST *pRequest);
+/** Slow path of DiskStats_Access: folds the heatmap or promotes hot blocks */
+VOID DiskStats_AccessLocked(_In_ DISK_STATS_CONTEXT *pStats, ULONG64 Offset, BOOLEAN Write, BOOLEAN Fold,
+	_In_reads_(Candidates) const HEAT_HOT_BLOCK *pCandidates, ULONG32 Candidates);
+NTSTATUS DiskStats_SnapshotHeat(_In_ const HEAT_SNAPSHOT_REQUEST *pRequest,
+	_Out_writes_bytes_(Length) HEAT_SNAPSHOT_HEADER *pHeader, ULONG Length, _Out_ ULONG_PTR *pInformation);
+
+/** Counter block of the current processor */
+static __inline DISK_COUNTERS *DiskStats_Counters(_In_ DISK_STATS_CONTEXT *pStats)
+{
+	return &pStats->pCounters[KeGetCurrentProcessorNumberEx(NULL) % pStats->Processors];
+}
+
+/** Stage counter block of the current processor, the disk must have them */
+static __inline SRB_STAGE_COUNTERS *DiskStats_Stages(_In_ DISK_STATS_CONTEXT *pStats)
+{
+	return &pStats->pStages[KeGetCurrentProcessorNumberEx(NULL) % pStats->Processors];
+}
+
+/** Keeps a completed request if it is one of the slowest of the current scan period */
+static __inline VOID DiskStats_Completed(_In_ DISK_STATS_CONTEXT *pStats, UCHAR Opcode, ULONG64 Lba, ULONG32 Length,
+	ULONG64 Ticks)
+{
+	DISK_INFLIGHT_REQUEST Request;
+	if (Ticks <= pStats->OutlierFloor)
+		return;
+	Request.Lba = Lba;
+	Request.Ticks = Ticks;
+	Request.Length = Length;
+	Request.Opcode = Opcode;
+	Request.Flags = 0;
+	Request.Reserved = 0;
+	DiskStats_RecordOutlier(pStats, &Request);
+}
+
+/** Counts a read or a write in the heatmap of the disk, if it has one */
+static __inline VOID DiskStats_Access(_In_ DISK_STATS_CONTEXT *pStats, ULONG64 Offset, ULONG32 Length, BOOLEAN Write)
+{
+	HEAT_HOT_BLOCK Candidates[HEAT_MAX_REQUEST_BLOCKS];
+	BOOLEAN Fold = FALSE;
+	ULONG32 Count = 0;
+	if (!pStats->pHeat)
+		return;
+	Fold = !HeatMap_CountBucket(pStats->pHeat, Offset, Write);
+	Count = HeatMap_CountBlocks(pStats->pHeat, Offset, Length, Candidates);
+	if (Fold || Count)
+		DiskStats_AccessLocked(pStats, Offset, Write, Fold, Candidates, Count);
+}
+
+/** Start of a timed control path phase */
+static __inline LONG64 DiskStats_PhaseStart()
+{
+	return KeQueryPerformanceCounter(NULL).QuadPart;
+}
+
+/** Adds the time since Start to a phase in 100 ns units, at least 1 so the phase shows as run */
+static __inline VOID DiskStats_PhaseEnd(_Inout_opt_ CTL_TIMING *pTiming, ULONG Phase, LONG64 Start)
+{
+	LARGE_INTEGER Frequency, Now;
+	if (!pTiming)
+		return;
+	Now = KeQueryPerformanceCounter(&Frequency);
+	pTiming->Time[Phase] += max((ULONG64)(Now.QuadPart - Start) * 10000000 / Frequency.QuadPart, 1);
+}
@@ -2,6 +2,10 @@
 #include "Dispatch.h"
 #include "Log.h"
 #include "cipher.h"
+#include "Catalog.h"
+#include "DiskStats.h"
+#include "RequestTable.h"
+#include "MessageQueue.h"
 
 #define DPTLOG(level, format, ...) LOG_FUNCTION(level, LOG_CTG_DISPATCH, format, __VA_ARGS__)
 
@@ -10,34 +14,82 @@
 
 const ULONG32 DptAllocationTag = 'Dpt ';
 
-typedef struct {
-	LIST_ENTRY Link;
+/* Message body shared by every subscriber queue holding the message */
+typedef struct _PARSER_MESSAGE_BODY {
+    volatile LONG RefCount;
+    /* Only the meaningful bytes of the message are allocated */
+    ULONG Length;
+    PARSER_MESSAGE Message;
+} PARSER_MESSAGE_BODY;
 
-	PARSER_MESSAGE Message;
-} PARSER_MESSAGE_ENTRY, *PPARSER_MESSAGE_ENTRY;
+/* Entry of a read queue, pData is the PARSER_MESSAGE_BODY */
+typedef MESSAGE_QUEUE_ENTRY PARSER_MESSAGE_ENTRY, *PPARSER_MESSAGE_ENTRY;
+
+#define DPT_ENTRY_BODY(pMessageEntry) ((PARSER_MESSAGE_BODY *)(pMessageEntry)->pData)
+
+#define DPT_DEFAULT_MAX_QUEUED_MESSAGES 256
+#define DPT_MAX_QUEUED_MESSAGES_LIMIT 4096
 
 typedef struct _REQUEST_ENTRY {
-    LIST_ENTRY Link;
+    /* Links in the request table and the timer wheel, and the id */
+    REQUEST_TABLE_ENTRY Table;
 
-    LONG RequestId;
     KEVENT Event;
     LARGE_INTEGER StartTime;
+    /* Set under the bucket lock when the response was copied */
+    BOOLEAN Completed;
     PARSER_RESPONSE_MESSAGE *pResponse;
+    PARSER_MESSAGE *pMessage;
+    /* Worker serving the request, referenced. Protected by the bucket lock */
+    struct _SUBSCRIPTION_CONTEXT *pWorker;
+    /* Signalled when the request is moved to another worker */
+    KEVENT WorkerChanged;
 } REQUEST_ENTRY;
 
+typedef struct _REQUEST_BUCKET {
+    KSPIN_LOCK Lock;
+    REQUEST_LINK Requests;
+} REQUEST_BUCKET;
+
+/* Request timeouts are kept in a timer wheel, the timer only runs while requests are pending */
+#define DPT_TIMER_TICK_MS 100
+
 typedef struct _SUBSCRIPTION_CONTEXT {
     LIST_ENTRY Link;
 
 	PFILE_OBJECT pFileObject;
 	LIST_ENTRY PendedReads;
 	ULONG PendedReadsCount;
-	LIST_ENTRY PendedMessages;
-	ULONG PendedMessagesCount;
+	MESSAGE_QUEUE PendedMessages;
 
     /* Whether this context services requests or not */
     BOOLEAN ServicingContext;
+    /* Layout of the messages returned by reads, PARSER_MESSAGE_FRAMING */
+    ULONG Framing;
 
 	KSPIN_LOCK Lock;
+    LONG RefCount;
+
+    /* Shared memory rings, used instead of the read queue when pRingMdl is set */
+    PMDL pRingMdl;
+    PVOID pUserRingAddress;
+    PEPROCESS pOwnerProcess;
+    PARSER_RING RequestRing;
+    PARSER_RING ResponseRing;
+    PKEVENT pRequestEvent;
+    PKEVENT pResponseEvent;
+    /* Serializes the driver side consumers of the response ring */
+    KSPIN_LOCK ResponseLock;
+
+    /* Filters and queue limits, written under Lock */
+    SUBSCRIPTION_OPTIONS Options;
+    /* Queue counters, protected by Lock */
+    SUBSCRIPTION_STATISTICS Statistics;
+
+    /* Load balancing state of servicing contexts */
+    volatile LONG Outstanding;
+    ULONG64 LastSelected;
+    WORKER_STATISTICS WorkerStatistics;
 } SUBSCRIPTION_CONTEXT;
 
 // Forward declarations
@@ -48,16 +100,38 @@ static NTSTATUS DPT_Open(PDEVICE_OBJECT pDeviceObject, PIRP pIrp);
 static NTSTATUS DPT_ReadCancel(PDEVICE_OBJECT pDeviceObject, PIRP pIrp);
 static NTSTATUS DPT_Read(PDEVICE_OBJECT pDeviceObject, PIRP pIrp);
 static NTSTATUS DPT_Write(PDEVICE_OBJECT pDeviceObject, PIRP pIrp);
+static NTSTATUS DPT_CleanupHandle(PDEVICE_OBJECT pDeviceObject, PIRP pIrp);
 static NTSTATUS DPT_Close(PDEVICE_OBJECT pDeviceObject, PIRP pIrp);
 static NTSTATUS DPT_Control(PDEVICE_OBJECT pDeviceObject, PIRP pIrp);
 static BOOLEAN DPT_SendMessage(SUBSCRIPTION_CONTEXT *pContext, PARSER_MESSAGE *pMessage);
+static BOOLEAN DPT_DeliverMessage(SUBSCRIPTION_CONTEXT *pContext, PARSER_MESSAGE *pMessage, PARSER_MESSAGE_BODY **ppBody, BOOLEAN Request);
+static BOOLEAN DPT_MessageMatchesFilter(SUBSCRIPTION_CONTEXT *pContext, PARSER_MESSAGE *pMessage);
+static VOID DPT_ReleaseMessageBody(PARSER_MESSAGE_BODY *pBody);
+static NTSTATUS DPT_CompleteRequest(PARSER_RESPONSE_MESSAGE *pResponse);
+static VOID DPT_ReleaseContext(SUBSCRIPTION_CONTEXT *pContext);
+static KDEFERRED_ROUTINE DPT_TimerDpc;
+static VOID DPT_DrainResponseRing(SUBSCRIPTION_CONTEXT *pContext);
+static ULONG DPT_GetMinimalReadLength(SUBSCRIPTION_CONTEXT *pContext);
+static ULONG DPT_FrameMessage(SUBSCRIPTION_CONTEXT *pContext, PARSER_MESSAGE *pMessage, ULONG MessageLength, PUCHAR pBuffer, ULONG BufferLength);
 
 // Dispatch globals
 static PDEVICE_OBJECT DptDeviceObject = NULL;
 static LIST_ENTRY DptSubscriptions = { &DptSubscriptions, &DptSubscriptions };
-static LIST_ENTRY DptRequests = { &DptRequests, &DptRequests };
+static REQUEST_BUCKET DptRequestTable[REQUEST_TABLE_BUCKETS];
 static LONG DptRequestCounter = 0;
+static ULONG64 DptWorkerSelections = 0;
+static LONG DptWorkerCounter = 0;
 static KSPIN_LOCK DptLock;	// synchronizes access to DptSubscriptions
+static REQUEST_TIMER_WHEEL DptTimerWheel;
+static BOOLEAN DptTimerArmed = FALSE;
+static KTIMER DptTimer;
+static KDPC DptTimerDpc;
+static KSPIN_LOCK DptTimerLock;	// synchronizes access to the timer wheel
+
+static ULONG64 DPT_CurrentTick()
+{
+    return KeQueryInterruptTime() / (DPT_TIMER_TICK_MS * 10000);
+}
 
 NTSTATUS DPT_Initialize(_In_ PDRIVER_OBJECT pDriverObject, _In_ PCUNICODE_STRING pRegistryPath, _Out_ PDEVICE_OBJECT *ppDeviceObject)
 {
@@ -71,6 +145,15 @@ NTSTATUS DPT_Initialize(_In_ PDRIVER_OBJECT pDriverObject, _In_ PCUNICODE_STRING
 	TRACE_FUNCTION_IN();
 
     KeInitializeSpinLock(&DptLock);
+    KeInitializeSpinLock(&DptTimerLock);
+    for (ulIndex = 0; ulIndex < REQUEST_TABLE_BUCKETS; ++ulIndex)
+    {
+        KeInitializeSpinLock(&DptRequestTable[ulIndex].Lock);
+        RequestLink_Initialize(&DptRequestTable[ulIndex].Requests);
+    }
+    TimerWheel_Initialize(&DptTimerWheel, DPT_CurrentTick());
+    KeInitializeTimer(&DptTimer);
+    KeInitializeDpc(&DptTimerDpc, DPT_TimerDpc, NULL);
 
     RtlInitUnicodeString(&DeviceName, DEVICE_NAME);
     RtlInitUnicodeString(&DosDeviceName, DOSDEVICE_NAME);
@@ -100,6 +183,9 @@ NTSTATUS DPT_Initialize(_In_ PDRIVER_OBJECT pDriverObject, _In_ PCUNICODE_STRING
 		case IRP_MJ_CREATE:
 			majorFunctions[ulIndex] = DPT_Open;
 			break;
+		case IRP_MJ_CLEANUP:
+			majorFunctions[ulIndex] = DPT_CleanupHandle;
+			break;
 		case IRP_MJ_CLOSE:
 			majorFunctions[ulIndex] = DPT_Close;
 			break;
@@ -140,10 +226,13 @@ VOID DPT_Cleanup()
 
 		SUBSCRIPTION_CONTEXT *pContext = CONTAINING_RECORD(pEntry, SUBSCRIPTION_CONTEXT, Link);
 		DPT_CancelPendingReads(pContext);
-        ExFreePoolWithTag(pContext, DptAllocationTag);
         RemoveEntryList(pEntry);
+        DPT_ReleaseContext(pContext);
 	}
 
+    KeCancelTimer(&DptTimer);
+    KeFlushQueuedDpcs();
+
     UNICODE_STRING DosDeviceName;
     RtlInitUnicodeString(&DosDeviceName, DOSDEVICE_NAME);
     IoDeleteSymbolicLink(&DosDeviceName);
@@ -160,7 +249,7 @@ VOID DPT_Cleanup()
 VOID DPT_QueueMessage(_In_ PARSER_MESSAGE *pMessage)
 {
 	PLIST_ENTRY pEntry = NULL;
-	PPARSER_MESSAGE_ENTRY pMessageEntry = NULL;
+    PARSER_MESSAGE_BODY *pBody = NULL;
     KIRQL OldIrql;
 
 	TRACE_FUNCTION_IN();
@@ -169,91 +258,671 @@ VOID DPT_QueueMessage(_In_ PARSER_MESSAGE *pMessage)
 	for (pEntry = DptSubscriptions.Flink; pEntry != &DptSubscriptions; pEntry = pEntry->Flink)
 	{
         SUBSCRIPTION_CONTEXT *pContext = CONTAINING_RECORD(pEntry, SUBSCRIPTION_CONTEXT, Link);
-		// if was not able to send message immediatelly, put it in the queue
-		if (!DPT_SendMessage(pContext, pMessage))
-		{
-			DPTLOG(LL_VERBOSE, "Queueing message to subscription context %p", pContext);
-			pMessageEntry = ExAllocatePoolWithTag(NonPagedPool, sizeof(PARSER_MESSAGE_ENTRY), DptAllocationTag);
-			pMessageEntry->Message = *pMessage;
-
-			KeAcquireSpinLockAtDpcLevel(&pContext->Lock);
-			InsertTailList(&pContext->PendedMessages, &pMessageEntry->Link);
-			++pContext->PendedMessagesCount;
-			KeReleaseSpinLockFromDpcLevel(&pContext->Lock);
-		}
+        // The body is allocated by the first subscriber that has to queue the message and shared by the rest
+        DPT_DeliverMessage(pContext, pMessage, &pBody, FALSE);
 	}
     KeReleaseSpinLock(&DptLock, OldIrql);
 
+    if (pBody)
+        DPT_ReleaseMessageBody(pBody);
+
 	TRACE_FUNCTION_OUT();
 }
 
-BOOLEAN DPT_SynchronouseRequest(_Inout_ PARSER_MESSAGE *pRequest, _Out_opt_ PARSER_RESPONSE_MESSAGE *pResponse, _In_ ULONG TimeoutMs)
+/** Bucket of the pending request table */
+static REQUEST_BUCKET *DPT_GetRequestBucket(LONG RequestId)
+{
+    return &DptRequestTable[RequestTable_Bucket(RequestId)];
+}
+
+/**
+ * Picks the servicing subscription accepting the message with the fewest outstanding requests, the least
+ * recently chosen one among equally loaded workers. Returns it referenced or NULL if there is none.
+ */
+static SUBSCRIPTION_CONTEXT *DPT_SelectWorker(PARSER_MESSAGE *pMessage)
 {
     PLIST_ENTRY pEntry = NULL;
-    PPARSER_MESSAGE_ENTRY pMessageEntry = NULL;
+    SUBSCRIPTION_CONTEXT *pWorker = NULL;
     KIRQL OldIrql;
-    BOOLEAN Result = FALSE;
-
-    TRACE_FUNCTION_IN();
 
     KeAcquireSpinLock(&DptLock, &OldIrql);
     for (pEntry = DptSubscriptions.Flink; pEntry != &DptSubscriptions; pEntry = pEntry->Flink)
     {
-        SUBSCRIPTION_CONTEXT *pContext = CONTAINING_RECORD(pEntry, SUBSCRIPTION_CONTEXT, Link);
-        if (pContext->ServicingContext)
-        {
-            pRequest->RequestId = InterlockedIncrement(&DptRequestCounter);
-            REQUEST_ENTRY RequestEntry = { 0 };
-            KeInitializeEvent(&RequestEntry.Event, NotificationEvent, FALSE);
-            RequestEntry.pResponse = pResponse;
-            RequestEntry.RequestId = pRequest->RequestId;
-            KeQuerySystemTime(&RequestEntry.StartTime);
-            InsertTailList(&DptRequests, &RequestEntry.Link);
-
-            // if was not able to send message immediatelly, put it in the queue
-            if (!DPT_SendMessage(pContext, pRequest))
+        SUBSCRIPTION_CONTEXT *pCurrent = CONTAINING_RECORD(pEntry, SUBSCRIPTION_CONTEXT, Link);
+        if (!pCurrent->ServicingContext || !DPT_MessageMatchesFilter(pCurrent, pMessage))
+            continue;
+        if (!pWorker || RequestTable_PreferWorker(pCurrent->Outstanding, pCurrent->LastSelected,
+            pWorker->Outstanding, pWorker->LastSelected))
+        {
+            pWorker = pCurrent;
+        }
+    }
+    if (pWorker)
+    {
+        pWorker->LastSelected = ++DptWorkerSelections;
+        InterlockedIncrement(&pWorker->RefCount);
+    }
+    KeReleaseSpinLock(&DptLock, OldIrql);
+
+    return pWorker;
+}
+
+/**
+ * Hands the request to the referenced worker, the reference is owned by the request afterwards.
+ * Must be called with the bucket lock held. Returns FALSE if the message could not be delivered.
+ */
+static BOOLEAN DPT_AssignRequestNoLock(REQUEST_ENTRY *pRequestEntry, SUBSCRIPTION_CONTEXT *pWorker)
+{
+    PARSER_MESSAGE_BODY *pBody = NULL;
+    BOOLEAN Delivered = FALSE;
+
+    pRequestEntry->pWorker = pWorker;
+    InterlockedIncrement(&pWorker->Outstanding);
+    Delivered = DPT_DeliverMessage(pWorker, pRequestEntry->pMessage, &pBody, TRUE);
+    if (pBody)
+        DPT_ReleaseMessageBody(pBody);
+
+    return Delivered;
+}
+
+/** Detaches the request from its worker. Must be called with the bucket lock held, returns the worker to release */
+static SUBSCRIPTION_CONTEXT *DPT_UnassignRequestNoLock(REQUEST_ENTRY *pRequestEntry)
+{
+    SUBSCRIPTION_CONTEXT *pWorker = pRequestEntry->pWorker;
+    if (pWorker)
+        InterlockedDecrement(&pWorker->Outstanding);
+    pRequestEntry->pWorker = NULL;
+    return pWorker;
+}
+
+/** Makes the request visible to responses, arms its timeout and sends it to the worker */
+static BOOLEAN DPT_InsertRequest(REQUEST_ENTRY *pRequestEntry, SUBSCRIPTION_CONTEXT *pWorker, ULONG TimeoutMs)
+{
+    REQUEST_BUCKET *pBucket = DPT_GetRequestBucket(pRequestEntry->Table.RequestId);
+    ULONG64 Ticks = ((ULONG64)TimeoutMs + DPT_TIMER_TICK_MS - 1) / DPT_TIMER_TICK_MS;
+    BOOLEAN Delivered = FALSE;
+    KIRQL OldIrql;
+
+    KeAcquireSpinLock(&DptTimerLock, &OldIrql);
+    if (TimerWheel_Insert(&DptTimerWheel, &pRequestEntry->Table, DPT_CurrentTick(), Ticks) && !DptTimerArmed)
+    {
+        LARGE_INTEGER DueTime;
+        DueTime.QuadPart = -(LONGLONG)DPT_TIMER_TICK_MS * 10000;
+        KeSetTimerEx(&DptTimer, DueTime, DPT_TIMER_TICK_MS, &DptTimerDpc);
+        DptTimerArmed = TRUE;
+    }
+    KeReleaseSpinLock(&DptTimerLock, OldIrql);
+
+    // Delivered under the bucket lock, so a failover never sees a request its worker has not got yet
+    KeAcquireSpinLock(&pBucket->Lock, &OldIrql);
+    RequestLink_InsertTail(&pBucket->Requests, &pRequestEntry->Table.Link);
+    Delivered = DPT_AssignRequestNoLock(pRequestEntry, pWorker);
+    KeReleaseSpinLock(&pBucket->Lock, OldIrql);
+
+    return Delivered;
+}
+
+/** Removes the request from the table and the timer wheel. Returns TRUE if a response was delivered */
+static BOOLEAN DPT_RemoveRequest(REQUEST_ENTRY *pRequestEntry)
+{
+    REQUEST_BUCKET *pBucket = DPT_GetRequestBucket(pRequestEntry->Table.RequestId);
+    SUBSCRIPTION_CONTEXT *pWorker = NULL;
+    BOOLEAN Completed = FALSE;
+    KIRQL OldIrql;
+
+    KeAcquireSpinLock(&DptTimerLock, &OldIrql);
+    TimerWheel_Remove(&DptTimerWheel, &pRequestEntry->Table);
+    KeReleaseSpinLock(&DptTimerLock, OldIrql);
+
+    KeAcquireSpinLock(&pBucket->Lock, &OldIrql);
+    RequestLink_Remove(&pRequestEntry->Table.Link);
+    Completed = pRequestEntry->Completed;
+    pWorker = DPT_UnassignRequestNoLock(pRequestEntry);
+    KeReleaseSpinLock(&pBucket->Lock, OldIrql);
+
+    if (pWorker)
+        DPT_ReleaseContext(pWorker);
+
+    return Completed;
+}
+
+/** Returns the current worker of the request referenced, NULL if it has none */
+static SUBSCRIPTION_CONTEXT *DPT_ReferenceRequestWorker(REQUEST_ENTRY *pRequestEntry)
+{
+    REQUEST_BUCKET *pBucket = DPT_GetRequestBucket(pRequestEntry->Table.RequestId);
+    SUBSCRIPTION_CONTEXT *pWorker = NULL;
+    KIRQL OldIrql;
+
+    KeAcquireSpinLock(&pBucket->Lock, &OldIrql);
+    pWorker = pRequestEntry->pWorker;
+    if (pWorker)
+        InterlockedIncrement(&pWorker->RefCount);
+    KeReleaseSpinLock(&pBucket->Lock, OldIrql);
+
+    return pWorker;
+}
+
+/** Moves the unanswered requests of a closing worker to the remaining ones, fails them if there are none */
+static VOID DPT_FailOverRequests(SUBSCRIPTION_CONTEXT *pContext)
+{
+    ULONG ulIndex = 0;
+    KIRQL OldIrql;
+
+    for (ulIndex = 0; ulIndex < REQUEST_TABLE_BUCKETS; ++ulIndex)
+    {
+        REQUEST_BUCKET *pBucket = &DptRequestTable[ulIndex];
+        REQUEST_LINK *pLink = NULL;
+
+        KeAcquireSpinLock(&pBucket->Lock, &OldIrql);
+        for (pLink = pBucket->Requests.pNext; pLink != &pBucket->Requests; pLink = pLink->pNext)
+        {
+            REQUEST_ENTRY *pRequestEntry = CONTAINING_RECORD(REQUEST_TABLE_ENTRY_OF(pLink, Link), REQUEST_ENTRY, Table);
+            if (pRequestEntry->pWorker != pContext || pRequestEntry->Completed)
+                continue;
+
+            // The closing context still holds its own reference, this one can not be the last
+            DPT_UnassignRequestNoLock(pRequestEntry);
+            InterlockedDecrement(&pContext->RefCount);
+
+            SUBSCRIPTION_CONTEXT *pWorker = DPT_SelectWorker(pRequestEntry->pMessage);
+            if (pWorker && DPT_AssignRequestNoLock(pRequestEntry, pWorker))
             {
-                DPTLOG(LL_VERBOSE, "Queueing request %d to subscription context %p", pRequest->RequestId, pContext);
-                pMessageEntry = ExAllocatePoolWithTag(NonPagedPool, sizeof(PARSER_MESSAGE_ENTRY), DptAllocationTag);
-                pMessageEntry->Message = *pRequest;
-
-                KeAcquireSpinLockAtDpcLevel(&pContext->Lock);
-                InsertTailList(&pContext->PendedMessages, &pMessageEntry->Link);
-                ++pContext->PendedMessagesCount;
-                KeReleaseSpinLockFromDpcLevel(&pContext->Lock);
+                DPTLOG(LL_INFO, "Request %d failed over from %p to %p", pRequestEntry->Table.RequestId, pContext, pWorker);
+                InterlockedIncrement64(&pContext->WorkerStatistics.FailedOver);
             }
+            else
+            {
+                DPTLOG(LL_WARNING, "No worker left for request %d", pRequestEntry->Table.RequestId);
+                KeSetEvent(&pRequestEntry->Event, IO_NO_INCREMENT, FALSE);
+            }
+            KeSetEvent(&pRequestEntry->WorkerChanged, IO_NO_INCREMENT, FALSE);
+        }
+        KeReleaseSpinLock(&pBucket->Lock, OldIrql);
+    }
+}
 
-            DPTLOG(LL_INFO, "Request issued %d, waiting %d ms", pRequest->RequestId, TimeoutMs);
-            LARGE_INTEGER Timeout;
-            Timeout.QuadPart = -10 * TimeoutMs;
-            KeReleaseSpinLock(&DptLock, OldIrql);
-            NTSTATUS Status = KeWaitForSingleObject(&RequestEntry.Event, DelayExecution, KernelMode, FALSE, &Timeout);
-            KeAcquireSpinLock(&DptLock, &OldIrql);
-            DPTLOG(LL_INFO, "Wait request result 0x%08X", Status);
-            Result = NT_SUCCESS(Status);
+/** Expires the requests of the timer wheel slots passed since the last tick */
+static VOID DPT_TimerDpc(PKDPC pDpc, PVOID pDeferredContext, PVOID pSystemArgument1, PVOID pSystemArgument2)
+{
+    UNREFERENCED_PARAMETER(pDpc);
+    UNREFERENCED_PARAMETER(pDeferredContext);
+    UNREFERENCED_PARAMETER(pSystemArgument1);
+    UNREFERENCED_PARAMETER(pSystemArgument2);
+    ULONG64 CurrentTick = DPT_CurrentTick();
+    REQUEST_LINK Expired;
+
+    RequestLink_Initialize(&Expired);
+    KeAcquireSpinLockAtDpcLevel(&DptTimerLock);
+
+    TimerWheel_Expire(&DptTimerWheel, CurrentTick, &Expired);
+    // The waiters remove their requests under the timer lock, they are signalled before it is released
+    while (!RequestLink_IsEmpty(&Expired))
+    {
+        REQUEST_TABLE_ENTRY *pEntry = REQUEST_TABLE_ENTRY_OF(Expired.pNext, TimerLink);
+        RequestLink_Remove(&pEntry->TimerLink);
+        KeSetEvent(&CONTAINING_RECORD(pEntry, REQUEST_ENTRY, Table)->Event, IO_NO_INCREMENT, FALSE);
+    }
 
-            RemoveEntryList(&RequestEntry.Link);
+    if (DptTimerWheel.Count == 0 && DptTimerArmed)
+    {
+        KeCancelTimer(&DptTimer);
+        DptTimerArmed = FALSE;
+    }
 
-            break;
+    KeReleaseSpinLockFromDpcLevel(&DptTimerLock);
+}
+
+/**
+ * Waits for the response to the request. The response ring of the current worker is drained
+ * while waiting, the wait restarts when the request fails over to another worker.
+ */
+static NTSTATUS DPT_WaitForResponse(REQUEST_ENTRY *pRequestEntry)
+{
+    NTSTATUS Status = STATUS_SUCCESS;
+
+    // No wait timeout, the timer wheel signals the event of expired requests
+    for (;;)
+    {
+        SUBSCRIPTION_CONTEXT *pWorker = DPT_ReferenceRequestWorker(pRequestEntry);
+        PVOID WaitObjects[3] = { &pRequestEntry->Event, &pRequestEntry->WorkerChanged, NULL };
+        ULONG WaitCount = 2;
+
+        if (pWorker && pWorker->pRingMdl)
+        {
+            Ring_PrepareWait(&pWorker->ResponseRing);
+            DPT_DrainResponseRing(pWorker);
+            WaitObjects[WaitCount++] = pWorker->pResponseEvent;
         }
+
+        if (KeReadStateEvent(&pRequestEntry->Event))
+            Status = STATUS_SUCCESS;
+        else
+            Status = KeWaitForMultipleObjects(WaitCount, WaitObjects, WaitAny, Executive, KernelMode, FALSE, NULL, NULL);
+
+        if (pWorker)
+            DPT_ReleaseContext(pWorker);
+
+        if (Status == STATUS_WAIT_0 || !NT_SUCCESS(Status))
+            return Status;
     }
+}
 
-    KeReleaseSpinLock(&DptLock, OldIrql);
+BOOLEAN DPT_SynchronouseRequest(_Inout_ PARSER_MESSAGE *pRequest, _Out_opt_ PARSER_RESPONSE_MESSAGE *pResponse, _In_ ULONG TimeoutMs)
+{
+    SUBSCRIPTION_CONTEXT *pWorker = NULL;
+    REQUEST_ENTRY RequestEntry = { 0 };
+    BOOLEAN Result = FALSE;
+
+    TRACE_FUNCTION_IN();
+
+    KeInitializeEvent(&RequestEntry.Event, NotificationEvent, FALSE);
+    KeInitializeEvent(&RequestEntry.WorkerChanged, SynchronizationEvent, FALSE);
+    RequestEntry.pResponse = pResponse;
+    RequestEntry.pMessage = pRequest;
+
+    pWorker = DPT_SelectWorker(pRequest);
+    if (pWorker)
+    {
+        pRequest->RequestId = InterlockedIncrement(&DptRequestCounter);
+        RequestTable_InitializeEntry(&RequestEntry.Table, pRequest->RequestId);
+        RequestEntry.StartTime.QuadPart = KeQueryInterruptTime();
+
+        if (DPT_InsertRequest(&RequestEntry, pWorker, TimeoutMs))
+        {
+            DPTLOG(LL_INFO, "Request issued %d to %p, waiting %d ms", pRequest->RequestId, pWorker, TimeoutMs);
+            NTSTATUS Status = DPT_WaitForResponse(&RequestEntry);
+            DPTLOG(LL_INFO, "Wait request result 0x%08X", Status);
+        }
+
+        Result = DPT_RemoveRequest(&RequestEntry);
+        if (!Result)
+            DPTLOG(LL_WARNING, "Request %d was not answered", RequestEntry.Table.RequestId);
+    }
 
     TRACE_FUNCTION_OUT();
     return Result;
 }
 
-static REQUEST_ENTRY *DPT_FindRequestNoLock(LONG RequestId)
+static REQUEST_ENTRY *DPT_FindRequestNoLock(REQUEST_BUCKET *pBucket, LONG RequestId)
+{
+    REQUEST_TABLE_ENTRY *pEntry = RequestTable_Find(&pBucket->Requests, RequestId);
+    return pEntry ? CONTAINING_RECORD(pEntry, REQUEST_ENTRY, Table) : NULL;
+}
+
+/** Hands the response over to the waiting request */
+static NTSTATUS DPT_CompleteRequest(PARSER_RESPONSE_MESSAGE *pResponse)
+{
+    NTSTATUS Status = STATUS_SUCCESS;
+    REQUEST_BUCKET *pBucket = DPT_GetRequestBucket(pResponse->RequestId);
+    KIRQL OldIrql;
+
+    KeAcquireSpinLock(&pBucket->Lock, &OldIrql);
+    REQUEST_ENTRY *pRequest = DPT_FindRequestNoLock(pBucket, pResponse->RequestId);
+    if (pRequest && !pRequest->Completed)
+    {
+        if (pRequest->pResponse)
+            memmove(pRequest->pResponse, pResponse, sizeof(PARSER_RESPONSE_MESSAGE));
+        pRequest->Completed = TRUE;
+        if (pRequest->pWorker)
+        {
+            WORKER_STATISTICS *pStatistics = &pRequest->pWorker->WorkerStatistics;
+            LONG64 LatencyUs = (LONG64)(KeQueryInterruptTime() - pRequest->StartTime.QuadPart) / 10;
+            LONG64 MaxLatencyUs = pStatistics->MaxLatencyUs;
+
+            InterlockedIncrement64(&pStatistics->Completed);
+            InterlockedAdd64(&pStatistics->TotalLatencyUs, LatencyUs);
+            while (LatencyUs > MaxLatencyUs)
+            {
+                LONG64 Previous = InterlockedCompareExchange64(&pStatistics->MaxLatencyUs, LatencyUs, MaxLatencyUs);
+                if (Previous == MaxLatencyUs)
+                    break;
+                MaxLatencyUs = Previous;
+            }
+        }
+        KeSetEvent(&pRequest->Event, LOW_PRIORITY, FALSE);
+    }
+    else
+    {
+        Status = STATUS_INVALID_DEVICE_REQUEST;
+    }
+    KeReleaseSpinLock(&pBucket->Lock, OldIrql);
+
+    return Status;
+}
+
+/** Fills the statistics of the servicing subscriptions, as many as fit into the buffer */
+static NTSTATUS DPT_QueryWorkers(WORKER_STATISTICS_RESPONSE *pResponse, ULONG BufferLength, PULONG_PTR pBytesWritten)
+{
+    NTSTATUS Status = STATUS_SUCCESS;
+    PLIST_ENTRY pEntry = NULL;
+    ULONG Capacity = (BufferLength - FIELD_OFFSET(WORKER_STATISTICS_RESPONSE, Workers)) / sizeof(WORKER_STATISTICS);
+    ULONG Count = 0;
+    KIRQL OldIrql;
+
+    KeAcquireSpinLock(&DptLock, &OldIrql);
+    for (pEntry = DptSubscriptions.Flink; pEntry != &DptSubscriptions; pEntry = pEntry->Flink)
+    {
+        SUBSCRIPTION_CONTEXT *pContext = CONTAINING_RECORD(pEntry, SUBSCRIPTION_CONTEXT, Link);
+        if (!pContext->ServicingContext)
+            continue;
+        if (Count < Capacity)
+        {
+            WORKER_STATISTICS *pStatistics = &pResponse->Workers[Count];
+            *pStatistics = pContext->WorkerStatistics;
+            pStatistics->Outstanding = pContext->Outstanding;
+            pStatistics->Flags = pContext->pRingMdl ? WORKER_FLAG_RING : 0;
+        }
+        ++Count;
+    }
+    KeReleaseSpinLock(&DptLock, OldIrql);
+
+    pResponse->Count = Count;
+    pResponse->Reserved = 0;
+    if (Count > Capacity)
+    {
+        Status = STATUS_BUFFER_OVERFLOW;
+        Count = Capacity;
+    }
+    *pBytesWritten = FIELD_OFFSET(WORKER_STATISTICS_RESPONSE, Workers) + Count * sizeof(WORKER_STATISTICS);
+
+    return Status;
+}
+
+/** Completes the requests whose responses were written to the response ring */
+static VOID DPT_DrainResponseRing(SUBSCRIPTION_CONTEXT *pContext)
+{
+    PARSER_RESPONSE_MESSAGE Response;
+    ULONG32 Length = 0;
+    KIRQL OldIrql;
+
+    KeAcquireSpinLock(&pContext->ResponseLock, &OldIrql);
+    while (Ring_Read(&pContext->ResponseRing, &Response, sizeof(Response), &Length))
+    {
+        if (Length != sizeof(PARSER_RESPONSE_MESSAGE))
+        {
+            DPTLOG(LL_WARNING, "Dropping malformed response record of %d bytes", Length);
+            continue;
+        }
+        if (!NT_SUCCESS(DPT_CompleteRequest(&Response)))
+            DPTLOG(LL_WARNING, "No pending request %d for the response", Response.RequestId);
+    }
+    KeReleaseSpinLock(&pContext->ResponseLock, OldIrql);
+}
+
+/** Returns the number of meaningful bytes in the message, so variable-length transports do not copy the unused tail */
+static ULONG DPT_GetMessageLength(PARSER_MESSAGE *pMessage)
+{
+    switch (pMessage->Type)
+    {
+    case MessageTypeQueryCipherConfig:
+        return FIELD_OFFSET(PARSER_MESSAGE, Message) + RTL_FIELD_SIZE(PARSER_MESSAGE, Message.QueryCipherConfig);
+    default:
+        return sizeof(PARSER_MESSAGE);
+    }
+}
+
+/** Smallest read buffer that can hold any message in the framing of the context */
+static ULONG DPT_GetMinimalReadLength(SUBSCRIPTION_CONTEXT *pContext)
+{
+    if (pContext->Framing == MessageFramingPacked)
+        return PARSER_MESSAGE_FRAME_SIZE(sizeof(PARSER_MESSAGE));
+    return sizeof(PARSER_MESSAGE);
+}
+
+/**
+ * Copies MessageLength bytes of the message to the read buffer in the framing of the context.
+ * Returns the number of bytes used, 0 if a packed frame does not fit into the buffer.
+ */
+static ULONG DPT_FrameMessage(SUBSCRIPTION_CONTEXT *pContext, PARSER_MESSAGE *pMessage, ULONG MessageLength, PUCHAR pBuffer, ULONG BufferLength)
+{
+    ULONG Length = 0;
+
+    if (pContext->Framing != MessageFramingPacked)
+    {
+        // Shared bodies are truncated to the meaningful bytes, fixed framing still returns the full structure
+        Length = min(BufferLength, sizeof(PARSER_MESSAGE));
+        memmove(pBuffer, pMessage, min(Length, MessageLength));
+        if (Length > MessageLength)
+            memset(pBuffer + MessageLength, 0, Length - MessageLength);
+        return Length;
+    }
+
+    Length = MessageLength;
+    if (PARSER_MESSAGE_FRAME_SIZE(Length) > BufferLength)
+        return 0;
+
+    PARSER_MESSAGE_FRAME *pFrame = (PARSER_MESSAGE_FRAME *)pBuffer;
+    pFrame->Length = Length;
+    pFrame->Reserved = 0;
+    memmove(pFrame + 1, pMessage, Length);
+    // Keep the padding deterministic, the buffer belongs to user mode
+    memset((PUCHAR)(pFrame + 1) + Length, 0, PARSER_MESSAGE_FRAME_SIZE(Length) - sizeof(PARSER_MESSAGE_FRAME) - Length);
+
+    return PARSER_MESSAGE_FRAME_SIZE(Length);
+}
+
+/** Writes the message to the request ring of the context and wakes the consumer up if it sleeps */
+static BOOLEAN DPT_PostRingMessage(SUBSCRIPTION_CONTEXT *pContext, PARSER_MESSAGE *pMessage)
+{
+    BOOLEAN Written = FALSE;
+    KIRQL OldIrql;
+
+    // Many threads may produce messages, the ring itself allows only one producer at a time
+    KeAcquireSpinLock(&pContext->Lock, &OldIrql);
+    Written = Ring_Write(&pContext->RequestRing, pMessage, DPT_GetMessageLength(pMessage));
+    if (Written && Ring_ConsumerNeedsWake(&pContext->RequestRing))
+        KeSetEvent(pContext->pRequestEvent, IO_NO_INCREMENT, FALSE);
+    if (Written)
+        ++pContext->Statistics.Delivered;
+    else
+        ++pContext->Statistics.Dropped;
+    KeReleaseSpinLock(&pContext->Lock, OldIrql);
+
+    if (!Written)
+        DPTLOG(LL_WARNING, "Request ring of subscription context %p is full, message %d dropped", pContext, pMessage->RequestId);
+
+    return Written;
+}
+
+/** Returns the disk the message is about or NULL if it is not disk specific */
+static GUID *DPT_GetMessageDiskId(PARSER_MESSAGE *pMessage)
+{
+    switch (pMessage->Type)
+    {
+    case MessageTypeQueryCipherConfig:
+        return &pMessage->Message.QueryCipherConfig.DiskId;
+    default:
+        return NULL;
+    }
+}
+
+/** Checks the message against the filters of the context */
+static BOOLEAN DPT_MessageMatchesFilter(SUBSCRIPTION_CONTEXT *pContext, PARSER_MESSAGE *pMessage)
+{
+    static const GUID ZeroGuid = { 0 };
+    GUID *pDiskId = NULL;
+
+    if ((ULONG)pMessage->Type >= 32 || !(pContext->Options.MessageTypeMask & (1UL << pMessage->Type)))
+        return FALSE;
+
+    pDiskId = DPT_GetMessageDiskId(pMessage);
+    if (pDiskId && memcmp(&pContext->Options.DiskId, &ZeroGuid, sizeof(GUID)) &&
+        memcmp(&pContext->Options.DiskId, pDiskId, sizeof(GUID)))
+    {
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/** Copies the meaningful part of the message into a body shared by the subscriber queues */
+static PARSER_MESSAGE_BODY *DPT_CreateMessageBody(PARSER_MESSAGE *pMessage)
+{
+    ULONG Length = DPT_GetMessageLength(pMessage);
+    PARSER_MESSAGE_BODY *pBody = ExAllocatePoolWithTag(NonPagedPool,
+        FIELD_OFFSET(PARSER_MESSAGE_BODY, Message) + Length, DptAllocationTag);
+    if (!pBody)
+        return NULL;
+
+    pBody->RefCount = 1;
+    pBody->Length = Length;
+    memmove(&pBody->Message, pMessage, Length);
+
+    return pBody;
+}
+
+static VOID DPT_ReleaseMessageBody(PARSER_MESSAGE_BODY *pBody)
+{
+    if (InterlockedDecrement(&pBody->RefCount) == 0)
+        ExFreePoolWithTag(pBody, DptAllocationTag);
+}
+
+static VOID DPT_FreeMessageEntry(PPARSER_MESSAGE_ENTRY pMessageEntry)
+{
+    DPT_ReleaseMessageBody(DPT_ENTRY_BODY(pMessageEntry));
+    ExFreePoolWithTag(pMessageEntry, DptAllocationTag);
+}
+
+/**
+ * Puts the message into the read queue of the context, applying its bound and overflow policy.
+ * Requests are rejected when the queue is full so their senders fail fast instead of timing out.
+ * Returns FALSE if the message was not queued.
+ */
+static BOOLEAN DPT_EnqueueMessage(SUBSCRIPTION_CONTEXT *pContext, PARSER_MESSAGE *pMessage, PARSER_MESSAGE_BODY **ppBody, BOOLEAN Request)
+{
+    PPARSER_MESSAGE_ENTRY pMessageEntry = NULL;
+    PPARSER_MESSAGE_ENTRY pFree = NULL;
+    GUID *pDiskId = DPT_GetMessageDiskId(pMessage);
+    BOOLEAN Queued = FALSE;
+    KIRQL OldIrql;
+
+    if (!*ppBody)
+        *ppBody = DPT_CreateMessageBody(pMessage);
+    pMessageEntry = ExAllocatePoolWithTag(NonPagedPool, sizeof(PARSER_MESSAGE_ENTRY), DptAllocationTag);
+    if (!*ppBody || !pMessageEntry)
+    {
+        DPTLOG(LL_ERROR, "Failed to allocate message entry, message %d dropped", pMessage->RequestId);
+        if (pMessageEntry)
+            ExFreePoolWithTag(pMessageEntry, DptAllocationTag);
+        return FALSE;
+    }
+    RtlZeroMemory(pMessageEntry, sizeof(PARSER_MESSAGE_ENTRY));
+    pMessageEntry->pData = *ppBody;
+    pMessageEntry->Type = pMessage->Type;
+    if (pDiskId)
+        pMessageEntry->DiskId = *pDiskId;
+    pMessageEntry->Request = Request;
+    InterlockedIncrement(&(*ppBody)->RefCount);
+
+    KeAcquireSpinLock(&pContext->Lock, &OldIrql);
+    Queued = MessageQueue_Push(&pContext->PendedMessages, pMessageEntry, pContext->Options.MaxQueuedMessages,
+        pContext->Options.OverflowPolicy, &pContext->Statistics, &pFree);
+    KeReleaseSpinLock(&pContext->Lock, OldIrql);
+
+    if (pFree)
+        DPT_FreeMessageEntry(pFree);
+    if (!Queued)
+        DPTLOG(LL_WARNING, "Message queue of subscription context %p is full, message %d not queued", pContext, pMessage->RequestId);
+
+    return Queued;
+}
+
+/**
+ * Delivers the message through the transport of the context. Requests are never dropped from the queue,
+ * events may be dropped or coalesced per the overflow policy. *ppBody is the body shared by the queues
+ * the message is delivered to, allocated on first use and released by the caller.
+ * Returns FALSE if the message was filtered out or lost.
+ */
+static BOOLEAN DPT_DeliverMessage(SUBSCRIPTION_CONTEXT *pContext, PARSER_MESSAGE *pMessage, PARSER_MESSAGE_BODY **ppBody, BOOLEAN Request)
+{
+    KIRQL OldIrql;
+
+    if (!DPT_MessageMatchesFilter(pContext, pMessage))
+    {
+        KeAcquireSpinLock(&pContext->Lock, &OldIrql);
+        ++pContext->Statistics.Filtered;
+        KeReleaseSpinLock(&pContext->Lock, OldIrql);
+        return FALSE;
+    }
+
+    if (pContext->pRingMdl)
+        return DPT_PostRingMessage(pContext, pMessage);
+
+    // if was not able to send message immediatelly, put it in the queue
+    if (DPT_SendMessage(pContext, pMessage))
+        return TRUE;
+
+    DPTLOG(LL_VERBOSE, "Queueing message %d to subscription context %p", pMessage->RequestId, pContext);
+    return DPT_EnqueueMessage(pContext, pMessage, ppBody, Request);
+}
+
+/** Applies new filters and queue limits, queued events that no longer match or fit are dropped */
+static NTSTATUS DPT_SetSubscriptionOptions(SUBSCRIPTION_CONTEXT *pContext, SUBSCRIPTION_OPTIONS *pOptions)
+{
+    MESSAGE_QUEUE Dropped;
+    PPARSER_MESSAGE_ENTRY pMessageEntry = NULL, pNext = NULL;
+    KIRQL OldIrql;
+
+    if (pOptions->MaxQueuedMessages < 1 || pOptions->MaxQueuedMessages > DPT_MAX_QUEUED_MESSAGES_LIMIT ||
+        pOptions->OverflowPolicy > OverflowPolicyCoalesce)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    MessageQueue_Initialize(&Dropped);
+
+    KeAcquireSpinLock(&pContext->Lock, &OldIrql);
+    pContext->Options = *pOptions;
+    pContext->Options.Reserved = 0;
+    for (pMessageEntry = MessageQueue_First(&pContext->PendedMessages); pMessageEntry; pMessageEntry = pNext)
+    {
+        pNext = MessageQueue_Next(&pContext->PendedMessages, pMessageEntry);
+        if (!pMessageEntry->Request && !DPT_MessageMatchesFilter(pContext, &DPT_ENTRY_BODY(pMessageEntry)->Message))
+        {
+            MessageQueue_Remove(&pContext->PendedMessages, pMessageEntry);
+            MessageQueue_InsertTail(&Dropped, pMessageEntry);
+            ++pContext->Statistics.Filtered;
+        }
+    }
+    while (NULL != (pMessageEntry = MessageQueue_Trim(&pContext->PendedMessages, pContext->Options.MaxQueuedMessages,
+        &pContext->Statistics)))
+    {
+        MessageQueue_InsertTail(&Dropped, pMessageEntry);
+    }
+    KeReleaseSpinLock(&pContext->Lock, OldIrql);
+
+    while (NULL != (pMessageEntry = MessageQueue_First(&Dropped)))
+    {
+        MessageQueue_Remove(&Dropped, pMessageEntry);
+        DPT_FreeMessageEntry(pMessageEntry);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+/** Drops a reference to the subscription context, the last one frees it and its rings */
+static VOID DPT_ReleaseContext(SUBSCRIPTION_CONTEXT *pContext)
 {
-    LIST_ENTRY *pLink;
-    for (pLink = DptRequests.Flink; pLink != &DptRequests; pLink = pLink->Flink)
+    if (InterlockedDecrement(&pContext->RefCount) != 0)
+        return;
+
+    if (pContext->pRingMdl)
     {
-        REQUEST_ENTRY *pRequestEntry = CONTAINING_RECORD(pLink, REQUEST_ENTRY, Link);
-        if (pRequestEntry->RequestId == RequestId)
-            return pRequestEntry;
+        PMDL pMdl = pContext->pRingMdl;
+        LOG_ASSERT(pContext->pUserRingAddress == NULL);
+        if (pMdl->MdlFlags & MDL_MAPPED_TO_SYSTEM_VA)
+            MmUnmapLockedPages(pMdl->MappedSystemVa, pMdl);
+        MmFreePagesFromMdl(pMdl);
+        ExFreePool(pMdl);
     }
-    return NULL;
+    if (pContext->pRequestEvent)
+        ObDereferenceObject(pContext->pRequestEvent);
+    if (pContext->pResponseEvent)
+        ObDereferenceObject(pContext->pResponseEvent);
+    if (pContext->pOwnerProcess)
+        ObDereferenceObject(pContext->pOwnerProcess);
+
+    ExFreePoolWithTag(pContext, DptAllocationTag);
 }
 
 /** Default major function dispatcher */
@@ -313,7 +982,6 @@ static VOID DPT_CancelPendingReads(SUBSCRIPTION_CONTEXT *pContext)
 	PLIST_ENTRY pIrpEntry = NULL;
 	PIRP pIrp = NULL;
 	PPARSER_MESSAGE_ENTRY pMessage = NULL;
-	PLIST_ENTRY pMessageEntry = NULL;
     KIRQL OldIrql;
 
 	TRACE_FUNCTION_IN();
@@ -321,13 +989,10 @@ static VOID DPT_CancelPendingReads(SUBSCRIPTION_CONTEXT *pContext)
 	KeAcquireSpinLock(&pContext->Lock, &OldIrql);
 
 	// Clean message queue
-	while (!IsListEmpty(&pContext->PendedMessages))
+	while (NULL != (pMessage = MessageQueue_First(&pContext->PendedMessages)))
 	{
-		pMessageEntry = pContext->PendedMessages.Flink;
-		pMessage = CONTAINING_RECORD(pMessageEntry, PARSER_MESSAGE_ENTRY, Link);
-		RemoveEntryList(pMessageEntry);
-		--pContext->PendedMessagesCount;
-		ExFreePoolWithTag(pMessage, DptAllocationTag);
+		MessageQueue_Remove(&pContext->PendedMessages, pMessage);
+		DPT_FreeMessageEntry(pMessage);
 	}
 
 	// Cancel pending IRP's
@@ -376,10 +1041,9 @@ static NTSTATUS DPT_Read(PDEVICE_OBJECT pDeviceObject, PIRP pIrp)
 	NTSTATUS Status = STATUS_SUCCESS;
 	PIO_STACK_LOCATION pIrpSp = NULL;
 	SUBSCRIPTION_CONTEXT *pContext = NULL;
-	PLIST_ENTRY pMessageEntry = NULL;
 	PPARSER_MESSAGE_ENTRY pMessage = NULL;
-	PUCHAR pSource = NULL, pBuffer = NULL;
-	ULONG BytesRemaining = 0, BytesToCopy = 0;
+	PUCHAR pBuffer = NULL;
+	ULONG BytesRemaining = 0, BytesToCopy = 0, BytesCopied = 0;
     KIRQL OldIrql;
 
 	TRACE_FUNCTION_IN();
@@ -394,6 +1058,13 @@ static NTSTATUS DPT_Read(PDEVICE_OBJECT pDeviceObject, PIRP pIrp)
 		goto Cleanup;
 	}
 
+	if (pContext->pRingMdl)
+	{
+		DPTLOG(LL_ERROR, "Messages of ring subscriptions are delivered through the request ring");
+		Status = STATUS_INVALID_DEVICE_REQUEST;
+		goto Cleanup;
+	}
+
 	if (pIrp->MdlAddress == NULL)
 	{
 		DPTLOG(LL_ERROR, "NULL MdlAddress on IRP %p", pIrp);
@@ -401,7 +1072,7 @@ static NTSTATUS DPT_Read(PDEVICE_OBJECT pDeviceObject, PIRP pIrp)
 		goto Cleanup;
 	}
 
-	if (MmGetMdlByteCount(pIrp->MdlAddress) < sizeof(PARSER_MESSAGE))
+	if (MmGetMdlByteCount(pIrp->MdlAddress) < DPT_GetMinimalReadLength(pContext))
 	{
 		DPTLOG(LL_ERROR, "User buffer too small");
 		Status = STATUS_INVALID_BUFFER_SIZE;
@@ -417,41 +1088,46 @@ static NTSTATUS DPT_Read(PDEVICE_OBJECT pDeviceObject, PIRP pIrp)
 
 	KeAcquireSpinLock(&pContext->Lock, &OldIrql);
 
-	IoSetCancelRoutine(pIrp, DPT_ReadCancel);
-
-	if (pIrp->Cancel && IoSetCancelRoutine(pIrp, NULL))
+	if (MessageQueue_First(&pContext->PendedMessages))
 	{
-		//
-		// IRP has been canceled but the I/O manager did not manage to call our cancel routine. This
-		// code is safe referencing the Irp->Cancel field without locks because of the memory barriers
-		// in the interlocked exchange sequences used by IoSetCancelRoutine.
-		//
+		pBuffer = (PUCHAR)MmGetSystemAddressForMdlSafe(pIrp->MdlAddress, NormalPagePriority);
+		BytesRemaining = MmGetMdlByteCount(pIrp->MdlAddress);
+		LOG_ASSERT(pBuffer);
 
-		Status = STATUS_CANCELLED;
-	}
-	else
-	{
-		if (!IsListEmpty(&pContext->PendedMessages))
+		// Packed framing drains as many messages as fit, fixed framing one message per read
+		do
 		{
-			pMessageEntry = pContext->PendedMessages.Flink;
-			RemoveEntryList(pMessageEntry);
-			--pContext->PendedMessagesCount;
-			pMessage = CONTAINING_RECORD(pMessageEntry, PARSER_MESSAGE_ENTRY, Link);
-			pSource = (PUCHAR)&pMessage->Message;
+			pMessage = MessageQueue_First(&pContext->PendedMessages);
+
+			BytesToCopy = DPT_FrameMessage(pContext, &DPT_ENTRY_BODY(pMessage)->Message, DPT_ENTRY_BODY(pMessage)->Length,
+				pBuffer + BytesCopied, BytesRemaining - BytesCopied);
+			if (!BytesToCopy)
+				break;
+			BytesCopied += BytesToCopy;
 
-            pBuffer = (PUCHAR)MmGetSystemAddressForMdlSafe(pIrp->MdlAddress, NormalPagePriority) + pIrp->MdlAddress->ByteOffset;
-            BytesRemaining = pIrp->MdlAddress->ByteCount;
-            LOG_ASSERT(pBuffer);
+			MessageQueue_Remove(&pContext->PendedMessages, pMessage);
+			++pContext->Statistics.Delivered;
+			DPT_FreeMessageEntry(pMessage);
+		} while (pContext->Framing == MessageFramingPacked && MessageQueue_First(&pContext->PendedMessages));
 
-			BytesToCopy = min(BytesRemaining, sizeof(PARSER_MESSAGE));
-			memmove(pBuffer, pSource, BytesToCopy);
+		Status = STATUS_SUCCESS;
+		pIrp->IoStatus.Information = BytesCopied;
 
-			ExFreePoolWithTag(pMessage, DptAllocationTag);
+		DPTLOG(LL_INFO, "IRP %p completed with %d bytes", pIrp, BytesCopied);
+	}
+	else
+	{
+		IoSetCancelRoutine(pIrp, DPT_ReadCancel);
 
-			Status = STATUS_SUCCESS;
-			pIrp->IoStatus.Information = BytesToCopy;
+		if (pIrp->Cancel && IoSetCancelRoutine(pIrp, NULL))
+		{
+			//
+			// IRP has been canceled but the I/O manager did not manage to call our cancel routine. This
+			// code is safe referencing the Irp->Cancel field without locks because of the memory barriers
+			// in the interlocked exchange sequences used by IoSetCancelRoutine.
+			//
 
-			DPTLOG(LL_INFO, "IRP %p completed with %d bytes", pIrp, BytesToCopy);
+			Status = STATUS_CANCELLED;
 		}
 		else
 		{
@@ -493,6 +1169,43 @@ static NTSTATUS DPT_Write(PDEVICE_OBJECT pDeviceObject, PIRP pIrp)
 	return Status;
 }
 
+/** Unmaps the shared rings from the owner process, the mapping can not outlive the handle */
+static NTSTATUS DPT_CleanupHandle(PDEVICE_OBJECT pDeviceObject, PIRP pIrp)
+{
+	UNREFERENCED_PARAMETER(pDeviceObject);
+	NTSTATUS Status = STATUS_SUCCESS;
+	PIO_STACK_LOCATION pIrpSp = NULL;
+	SUBSCRIPTION_CONTEXT *pContext = NULL;
+	TRACE_FUNCTION_IN();
+
+	pIrpSp = IoGetCurrentIrpStackLocation(pIrp);
+	pContext = pIrpSp->FileObject->FsContext;
+
+	if (pContext && pContext->pUserRingAddress)
+	{
+		KAPC_STATE ApcState;
+		BOOLEAN Attached = FALSE;
+
+		// The last handle may have been closed from a process the handle was duplicated to
+		if (PsGetCurrentProcess() != pContext->pOwnerProcess)
+		{
+			KeStackAttachProcess(pContext->pOwnerProcess, &ApcState);
+			Attached = TRUE;
+		}
+		MmUnmapLockedPages(pContext->pUserRingAddress, pContext->pRingMdl);
+		pContext->pUserRingAddress = NULL;
+		if (Attached)
+			KeUnstackDetachProcess(&ApcState);
+	}
+
+	TRACE_FUNCTION_OUT_STATUS(Status);
+
+	pIrp->IoStatus.Status = Status;
+	pIrp->IoStatus.Information = 0;
+	IoCompleteRequest(pIrp, IO_NO_INCREMENT);
+	return Status;
+}
+
 static NTSTATUS DPT_Close(PDEVICE_OBJECT pDeviceObject, PIRP pIrp)
 {
 	UNREFERENCED_PARAMETER(pDeviceObject);
@@ -508,13 +1221,19 @@ static NTSTATUS DPT_Close(PDEVICE_OBJECT pDeviceObject, PIRP pIrp)
 	pContext = pIrpSp->FileObject->FsContext;
 
 	if (pContext)
-	{
-		DPT_CancelPendingReads(pContext);
         RemoveEntryList(&pContext->Link);
-	}
 	pIrpSp->FileObject->FsContext = NULL;
 
 	KeReleaseSpinLock(&DptLock, OldIrql);
+
+	if (pContext)
+	{
+		DPT_CancelPendingReads(pContext);
+		if (pContext->ServicingContext)
+			DPT_FailOverRequests(pContext);
+		DPT_ReleaseContext(pContext);
+	}
+
 	TRACE_FUNCTION_OUT_STATUS(Status);
 
 	pIrp->IoStatus.Status = Status;
@@ -523,6 +1242,137 @@ static NTSTATUS DPT_Close(PDEVICE_OBJECT pDeviceObject, PIRP pIrp)
 	return Status;
 }
 
+/** Allocates the shared rings of the context and maps them into the calling process */
+static NTSTATUS DPT_CreateRings(SUBSCRIPTION_CONTEXT *pContext, CREATE_RING_SUBSCRIPTION_REQUEST *pRequest,
+    CREATE_RING_SUBSCRIPTION_RESPONSE *pResponse)
+{
+    NTSTATUS Status = STATUS_SUCCESS;
+    PHYSICAL_ADDRESS LowAddress, HighAddress, SkipBytes;
+    SIZE_T RingRegionSize = 0;
+    PUCHAR pSystemAddress = NULL;
+
+    if (pRequest->RingSize < PARSER_RING_MIN_SIZE || pRequest->RingSize > PARSER_RING_MAX_SIZE ||
+        (pRequest->RingSize & (pRequest->RingSize - 1)) != 0)
+    {
+        DPTLOG(LL_ERROR, "Invalid ring size %d", pRequest->RingSize);
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    Status = ObReferenceObjectByHandle((HANDLE)(ULONG_PTR)pRequest->RequestEvent, EVENT_MODIFY_STATE, *ExEventObjectType,
+        UserMode, (PVOID *)&pContext->pRequestEvent, NULL);
+    if (!NT_SUCCESS(Status))
+    {
+        DPTLOG(LL_ERROR, "Invalid request event handle. 0x%0X", Status);
+        return Status;
+    }
+    Status = ObReferenceObjectByHandle((HANDLE)(ULONG_PTR)pRequest->ResponseEvent, SYNCHRONIZE, *ExEventObjectType,
+        UserMode, (PVOID *)&pContext->pResponseEvent, NULL);
+    if (!NT_SUCCESS(Status))
+    {
+        DPTLOG(LL_ERROR, "Invalid response event handle. 0x%0X", Status);
+        return Status;
+    }
+
+    // Each ring gets its own pages so the header always starts on a page boundary
+    RingRegionSize = ROUND_TO_PAGES(sizeof(PARSER_RING_HEADER) + pRequest->RingSize);
+    LowAddress.QuadPart = 0;
+    HighAddress.QuadPart = 0xFFFFFFFFFFFFFFFF;
+    SkipBytes.QuadPart = 0;
+    pContext->pRingMdl = MmAllocatePagesForMdlEx(LowAddress, HighAddress, SkipBytes, 2 * RingRegionSize, MmCached, 0);
+    if (!pContext->pRingMdl)
+        return STATUS_INSUFFICIENT_RESOURCES;
+    if (MmGetMdlByteCount(pContext->pRingMdl) != 2 * RingRegionSize)
+    {
+        DPTLOG(LL_ERROR, "Failed to allocate %d bytes for the rings", 2 * RingRegionSize);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    pSystemAddress = MmGetSystemAddressForMdlSafe(pContext->pRingMdl, NormalPagePriority);
+    if (!pSystemAddress)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    Ring_Format(&pContext->RequestRing, (PARSER_RING_HEADER *)pSystemAddress, pRequest->RingSize);
+    Ring_Format(&pContext->ResponseRing, (PARSER_RING_HEADER *)(pSystemAddress + RingRegionSize), pRequest->RingSize);
+
+    __try
+    {
+        pContext->pUserRingAddress = MmMapLockedPagesSpecifyCache(pContext->pRingMdl, UserMode, MmCached, NULL, FALSE,
+            NormalPagePriority);
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER)
+    {
+        pContext->pUserRingAddress = NULL;
+    }
+    if (!pContext->pUserRingAddress)
+    {
+        DPTLOG(LL_ERROR, "Failed to map the rings into the process");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    pContext->pOwnerProcess = PsGetCurrentProcess();
+    ObReferenceObject(pContext->pOwnerProcess);
+
+    pResponse->RequestRing = (ULONG64)(ULONG_PTR)pContext->pUserRingAddress;
+    pResponse->ResponseRing = pResponse->RequestRing + RingRegionSize;
+    pResponse->RingSize = pRequest->RingSize;
+    pResponse->Reserved = 0;
+
+    return Status;
+}
+
+/** Creates the subscription context of the file object. Rings are set up when pRingRequest is given */
+static NTSTATUS DPT_CreateSubscription(PFILE_OBJECT pFileObject, BOOLEAN Servicing,
+    CREATE_RING_SUBSCRIPTION_REQUEST *pRingRequest, CREATE_RING_SUBSCRIPTION_RESPONSE *pRingResponse)
+{
+    NTSTATUS Status = STATUS_SUCCESS;
+    KIRQL OldIrql;
+
+    if (pFileObject->FsContext != NULL)
+    {
+        DPTLOG(LL_ERROR, "Given file object is already recieving events");
+        return STATUS_PIPE_LISTENING;
+    }
+    SUBSCRIPTION_CONTEXT *pContext = ExAllocatePoolWithTag(NonPagedPool, sizeof(SUBSCRIPTION_CONTEXT), DptAllocationTag);
+    if (!pContext)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    memset(pContext, 0, sizeof(SUBSCRIPTION_CONTEXT));
+    pContext->pFileObject = pFileObject;
+    pContext->RefCount = 1;
+    KeInitializeSpinLock(&pContext->Lock);
+    KeInitializeSpinLock(&pContext->ResponseLock);
+    InitializeListHead(&pContext->PendedReads);
+    MessageQueue_Initialize(&pContext->PendedMessages);
+    pContext->ServicingContext = Servicing;
+    pContext->Options.MessageTypeMask = MAXULONG32;
+    pContext->Options.MaxQueuedMessages = DPT_DEFAULT_MAX_QUEUED_MESSAGES;
+    pContext->Options.OverflowPolicy = OverflowPolicyDropOldest;
+    pContext->WorkerStatistics.WorkerId = InterlockedIncrement(&DptWorkerCounter);
+    pContext->WorkerStatistics.ProcessId = HandleToULong(PsGetCurrentProcessId());
+
+    if (pRingRequest)
+    {
+        Status = DPT_CreateRings(pContext, pRingRequest, pRingResponse);
+        if (!NT_SUCCESS(Status))
+        {
+            if (pContext->pUserRingAddress)
+            {
+                MmUnmapLockedPages(pContext->pUserRingAddress, pContext->pRingMdl);
+                pContext->pUserRingAddress = NULL;
+            }
+            DPT_ReleaseContext(pContext);
+            return Status;
+        }
+    }
+
+    pFileObject->FsContext = pContext;
+    KeAcquireSpinLock(&DptLock, &OldIrql);
+    InsertTailList(&DptSubscriptions, &pContext->Link);
+    KeReleaseSpinLock(&DptLock, OldIrql);
+
+    return Status;
+}
+
 static NTSTATUS DPT_Control(PDEVICE_OBJECT pDeviceObject, PIRP pIrp)
 {
     UNREFERENCED_PARAMETER(pDeviceObject);
@@ -544,6 +1394,32 @@ static NTSTATUS DPT_Control(PDEVICE_OBJECT pDeviceObject, PIRP pIrp)
         EVHD_SET_CIPHER_CONFIG_REQUEST *request = pIrp->AssociatedIrp.SystemBuffer;
         Status = SetCipherOpts(&request->DiskId, request->Algorithm, &request->Opts);
         break;
+    case IOCTL_VIRTUAL_DISK_SET_CIPHER_BATCH: {
+        DPTLOG(LL_INFO, "IOCTL_VIRTUAL_DISK_SET_CIPHER_BATCH");
+        EVHD_SET_CIPHER_BATCH_REQUEST *pBatch = pIrp->AssociatedIrp.SystemBuffer;
+        ULONG InputLength = IrpSp->Parameters.DeviceIoControl.InputBufferLength;
+        if (InputLength < FIELD_OFFSET(EVHD_SET_CIPHER_BATCH_REQUEST, Configs) ||
+            0 != IrpSp->Parameters.DeviceIoControl.OutputBufferLength ||
+            pBatch->Count == 0 || pBatch->Count > EVHD_SET_CIPHER_BATCH_MAX ||
+            EVHD_SET_CIPHER_BATCH_SIZE(pBatch->Count) != InputLength)
+        {
+            Status = STATUS_INVALID_BUFFER_SIZE;
+            break;
+        }
+        Status = SetCipherOptsBatch(pBatch->Configs, pBatch->Count);
+        DPTLOG(LL_INFO, "Applied %d cipher configurations, status %X", pBatch->Count, Status);
+        break;
+    }
+    case IOCTL_VIRTUAL_DISK_RELOAD_CATALOG:
+        DPTLOG(LL_INFO, "IOCTL_VIRTUAL_DISK_RELOAD_CATALOG");
+        if (0 != IrpSp->Parameters.DeviceIoControl.InputBufferLength ||
+            0 != IrpSp->Parameters.DeviceIoControl.OutputBufferLength)
+        {
+            Status = STATUS_INVALID_BUFFER_SIZE;
+            break;
+        }
+        Status = Catalog_Reload();
+        break;
     case IOCTL_VIRTUAL_DISK_SET_LOGGER:
         DPTLOG(LL_INFO, "IOCTL_VIRTUAL_DISK_SET_LOGGER");
         if (sizeof(LOG_SETTINGS) != IrpSp->Parameters.DeviceIoControl.InputBufferLength ||
@@ -567,6 +1443,103 @@ static NTSTATUS DPT_Control(PDEVICE_OBJECT pDeviceObject, PIRP pIrp)
         if (NT_SUCCESS(Status))
             pIrp->IoStatus.Information = sizeof(LOG_SETTINGS);
         break;
+    case IOCTL_VIRTUAL_DISK_QUERY_LOGGER_STATS:
+        DPTLOG(LL_VERBOSE, "IOCTL_VIRTUAL_DISK_QUERY_LOGGER_STATS");
+        if (0 != IrpSp->Parameters.DeviceIoControl.InputBufferLength ||
+            sizeof(LOG_STATISTICS) != IrpSp->Parameters.DeviceIoControl.OutputBufferLength)
+        {
+            Status = STATUS_INVALID_BUFFER_SIZE;
+            break;
+        }
+        Status = Log_QueryStatistics((LOG_STATISTICS *)pIrp->AssociatedIrp.SystemBuffer);
+        if (NT_SUCCESS(Status))
+            pIrp->IoStatus.Information = sizeof(LOG_STATISTICS);
+        break;
+    case IOCTL_VIRTUAL_DISK_SET_TRACEPOINT:
+        DPTLOG(LL_INFO, "IOCTL_VIRTUAL_DISK_SET_TRACEPOINT");
+        if (sizeof(TRACEPOINT_REQUEST) != IrpSp->Parameters.DeviceIoControl.InputBufferLength ||
+            0 != IrpSp->Parameters.DeviceIoControl.OutputBufferLength)
+        {
+            Status = STATUS_INVALID_BUFFER_SIZE;
+            break;
+        }
+        Status = Trace_SetTracepoint((TRACEPOINT_REQUEST *)pIrp->AssociatedIrp.SystemBuffer);
+        pIrp->IoStatus.Information = 0;
+        break;
+    case IOCTL_VIRTUAL_DISK_QUERY_TRACEPOINTS:
+        DPTLOG(LL_VERBOSE, "IOCTL_VIRTUAL_DISK_QUERY_TRACEPOINTS");
+        if (0 != IrpSp->Parameters.DeviceIoControl.InputBufferLength)
+        {
+            Status = STATUS_INVALID_BUFFER_SIZE;
+            break;
+        }
+        Status = Trace_QueryTracepoints((TRACEPOINT_LIST *)pIrp->AssociatedIrp.SystemBuffer,
+            IrpSp->Parameters.DeviceIoControl.OutputBufferLength, &pIrp->IoStatus.Information);
+        break;
+    case IOCTL_VIRTUAL_DISK_SNAPSHOT_FLIGHT_RECORDER:
+        DPTLOG(LL_VERBOSE, "IOCTL_VIRTUAL_DISK_SNAPSHOT_FLIGHT_RECORDER");
+        if (0 != IrpSp->Parameters.DeviceIoControl.InputBufferLength)
+        {
+            Status = STATUS_INVALID_BUFFER_SIZE;
+            break;
+        }
+        // A buffer too small for the events still receives the header with the size needed
+        Status = Flight_Snapshot((FLIGHT_SNAPSHOT_HEADER *)pIrp->AssociatedIrp.SystemBuffer,
+            IrpSp->Parameters.DeviceIoControl.OutputBufferLength, &pIrp->IoStatus.Information);
+        break;
+    case IOCTL_VIRTUAL_DISK_QUERY_DISK_STATS:
+        DPTLOG(LL_VERBOSE, "IOCTL_VIRTUAL_DISK_QUERY_DISK_STATS");
+        if (0 != IrpSp->Parameters.DeviceIoControl.InputBufferLength)
+        {
+            Status = STATUS_INVALID_BUFFER_SIZE;
+            break;
+        }
+        Status = DiskStats_Query((DISK_STATS_LIST *)pIrp->AssociatedIrp.SystemBuffer,
+            IrpSp->Parameters.DeviceIoControl.OutputBufferLength, &pIrp->IoStatus.Information);
+        break;
+    case IOCTL_VIRTUAL_DISK_QUERY_STAGE_STATS:
+        DPTLOG(LL_VERBOSE, "IOCTL_VIRTUAL_DISK_QUERY_STAGE_STATS");
+        if (0 != IrpSp->Parameters.DeviceIoControl.InputBufferLength)
+        {
+            Status = STATUS_INVALID_BUFFER_SIZE;
+            break;
+        }
+        Status = DiskStats_QueryStages((DISK_STAGE_STATS_LIST *)pIrp->AssociatedIrp.SystemBuffer,
+            IrpSp->Parameters.DeviceIoControl.OutputBufferLength, &pIrp->IoStatus.Information);
+        break;
+    case IOCTL_VIRTUAL_DISK_QUERY_CONTROL_STATS:
+        DPTLOG(LL_VERBOSE, "IOCTL_VIRTUAL_DISK_QUERY_CONTROL_STATS");
+        if (0 != IrpSp->Parameters.DeviceIoControl.InputBufferLength)
+        {
+            Status = STATUS_INVALID_BUFFER_SIZE;
+            break;
+        }
+        Status = DiskStats_QueryControl((CONTROL_STATS_LIST *)pIrp->AssociatedIrp.SystemBuffer,
+            IrpSp->Parameters.DeviceIoControl.OutputBufferLength, &pIrp->IoStatus.Information);
+        break;
+    case IOCTL_VIRTUAL_DISK_QUERY_INFLIGHT:
+        DPTLOG(LL_VERBOSE, "IOCTL_VIRTUAL_DISK_QUERY_INFLIGHT");
+        if (0 != IrpSp->Parameters.DeviceIoControl.InputBufferLength)
+        {
+            Status = STATUS_INVALID_BUFFER_SIZE;
+            break;
+        }
+        Status = DiskStats_QueryInflight((DISK_INFLIGHT_LIST *)pIrp->AssociatedIrp.SystemBuffer,
+            IrpSp->Parameters.DeviceIoControl.OutputBufferLength, &pIrp->IoStatus.Information);
+        break;
+    case IOCTL_VIRTUAL_DISK_SNAPSHOT_HEATMAP: {
+        DPTLOG(LL_VERBOSE, "IOCTL_VIRTUAL_DISK_SNAPSHOT_HEATMAP");
+        if (sizeof(HEAT_SNAPSHOT_REQUEST) != IrpSp->Parameters.DeviceIoControl.InputBufferLength)
+        {
+            Status = STATUS_INVALID_BUFFER_SIZE;
+            break;
+        }
+        // The snapshot overwrites the request in the system buffer
+        HEAT_SNAPSHOT_REQUEST Request = *(HEAT_SNAPSHOT_REQUEST *)pIrp->AssociatedIrp.SystemBuffer;
+        Status = DiskStats_SnapshotHeat(&Request, (HEAT_SNAPSHOT_HEADER *)pIrp->AssociatedIrp.SystemBuffer,
+            IrpSp->Parameters.DeviceIoControl.OutputBufferLength, &pIrp->IoStatus.Information);
+        break;
+    }
     case IOCTL_VIRTUAL_DISK_CREATE_SUBSCRIPTION: {
         DPTLOG(LL_INFO, "IOCTL_VIRTUAL_DISK_CREATE_SUBSCRIPTION");
         if (sizeof(CREATE_SUBSCRIPTION_REQUEST) != IrpSp->Parameters.DeviceIoControl.InputBufferLength ||
@@ -575,31 +1548,56 @@ static NTSTATUS DPT_Control(PDEVICE_OBJECT pDeviceObject, PIRP pIrp)
             Status = STATUS_INVALID_BUFFER_SIZE;
             break;
         }
-        PVOID pCurrentContext = IrpSp->FileObject->FsContext;
-        if (pCurrentContext != NULL)
+        Status = DPT_CreateSubscription(IrpSp->FileObject,
+            ((CREATE_SUBSCRIPTION_REQUEST *)pIrp->AssociatedIrp.SystemBuffer)->Servicing, NULL, NULL);
+        pIrp->IoStatus.Information = 0;
+        break;
+    }
+    case IOCTL_VIRTUAL_DISK_CREATE_RING_SUBSCRIPTION: {
+        DPTLOG(LL_INFO, "IOCTL_VIRTUAL_DISK_CREATE_RING_SUBSCRIPTION");
+        if (sizeof(CREATE_RING_SUBSCRIPTION_REQUEST) != IrpSp->Parameters.DeviceIoControl.InputBufferLength ||
+            sizeof(CREATE_RING_SUBSCRIPTION_RESPONSE) != IrpSp->Parameters.DeviceIoControl.OutputBufferLength)
         {
-            DPTLOG(LL_ERROR, "Given file object is already recieving events");
-            Status = STATUS_PIPE_LISTENING;
+            Status = STATUS_INVALID_BUFFER_SIZE;
             break;
         }
-        SUBSCRIPTION_CONTEXT *pContext = ExAllocatePoolWithTag(NonPagedPool, sizeof(SUBSCRIPTION_CONTEXT), DptAllocationTag);
+        CREATE_RING_SUBSCRIPTION_REQUEST Request = *(CREATE_RING_SUBSCRIPTION_REQUEST *)pIrp->AssociatedIrp.SystemBuffer;
+        CREATE_RING_SUBSCRIPTION_RESPONSE *pRingResponse = pIrp->AssociatedIrp.SystemBuffer;
+        Status = DPT_CreateSubscription(IrpSp->FileObject, Request.Servicing, &Request, pRingResponse);
+        if (NT_SUCCESS(Status))
+            pIrp->IoStatus.Information = sizeof(CREATE_RING_SUBSCRIPTION_RESPONSE);
+        break;
+    }
+    case IOCTL_VIRTUAL_DISK_SET_MESSAGE_FRAMING: {
+        DPTLOG(LL_INFO, "IOCTL_VIRTUAL_DISK_SET_MESSAGE_FRAMING");
+        if (sizeof(SET_MESSAGE_FRAMING_REQUEST) != IrpSp->Parameters.DeviceIoControl.InputBufferLength ||
+            sizeof(SET_MESSAGE_FRAMING_REQUEST) != IrpSp->Parameters.DeviceIoControl.OutputBufferLength)
+        {
+            Status = STATUS_INVALID_BUFFER_SIZE;
+            break;
+        }
+        SUBSCRIPTION_CONTEXT *pContext = IrpSp->FileObject->FsContext;
+        SET_MESSAGE_FRAMING_REQUEST *pFraming = pIrp->AssociatedIrp.SystemBuffer;
         if (!pContext)
         {
-            Status = STATUS_INSUFFICIENT_RESOURCES;
+            Status = STATUS_INVALID_HANDLE;
             break;
-
         }
-        memset(pContext, 0, sizeof(SUBSCRIPTION_CONTEXT));
-        pContext->pFileObject = IrpSp->FileObject;
-        KeInitializeSpinLock(&pContext->Lock);
-        InitializeListHead(&pContext->PendedReads);
-        InitializeListHead(&pContext->PendedMessages);
-        pContext->ServicingContext = ((CREATE_SUBSCRIPTION_REQUEST *)pIrp->AssociatedIrp.SystemBuffer)->Servicing;
-        IrpSp->FileObject->FsContext = pContext;
-        pIrp->IoStatus.Information = 0;
-        ExAcquireSpinLockAtDpcLevel(&DptLock);
-        InsertTailList(&DptSubscriptions, &pContext->Link);
-        ExReleaseSpinLockFromDpcLevel(&DptLock);
+        if (pFraming->Framing != MessageFramingFixed && pFraming->Framing != MessageFramingPacked)
+        {
+            Status = STATUS_INVALID_PARAMETER;
+            break;
+        }
+        KIRQL OldIrql;
+        KeAcquireSpinLock(&pContext->Lock, &OldIrql);
+        // Reads already pended were validated against the old framing
+        if (pContext->PendedReadsCount)
+            Status = STATUS_DEVICE_BUSY;
+        else
+            pContext->Framing = pFraming->Framing;
+        pFraming->Framing = pContext->Framing;
+        KeReleaseSpinLock(&pContext->Lock, OldIrql);
+        pIrp->IoStatus.Information = sizeof(SET_MESSAGE_FRAMING_REQUEST);
         break;
     }
     case IOCTL_VIRTUAL_DISK_FINISH_REQUEST: {
@@ -611,21 +1609,60 @@ static NTSTATUS DPT_Control(PDEVICE_OBJECT pDeviceObject, PIRP pIrp)
             break;
         }
 
-        ExAcquireSpinLockAtDpcLevel(&DptLock);
-        PARSER_RESPONSE_MESSAGE *pResponse = pIrp->AssociatedIrp.SystemBuffer;
-        REQUEST_ENTRY *pRequest = DPT_FindRequestNoLock(pResponse->RequestId);
-        if (pRequest)
+        Status = DPT_CompleteRequest(pIrp->AssociatedIrp.SystemBuffer);
+        break;
+    }
+    case IOCTL_VIRTUAL_DISK_SET_SUBSCRIPTION_OPTIONS: {
+        DPTLOG(LL_INFO, "IOCTL_VIRTUAL_DISK_SET_SUBSCRIPTION_OPTIONS");
+        if (sizeof(SUBSCRIPTION_OPTIONS) != IrpSp->Parameters.DeviceIoControl.InputBufferLength ||
+            0 != IrpSp->Parameters.DeviceIoControl.OutputBufferLength)
         {
-            memmove(pRequest->pResponse, pResponse, sizeof(PARSER_RESPONSE_MESSAGE));
-            KeSetEvent(&pRequest->Event, LOW_PRIORITY, FALSE);
+            Status = STATUS_INVALID_BUFFER_SIZE;
+            break;
         }
-        else
+        SUBSCRIPTION_CONTEXT *pContext = IrpSp->FileObject->FsContext;
+        if (!pContext)
         {
-            Status = STATUS_INVALID_DEVICE_REQUEST;
+            Status = STATUS_INVALID_HANDLE;
+            break;
         }
-        ExReleaseSpinLockFromDpcLevel(&DptLock);
+        Status = DPT_SetSubscriptionOptions(pContext, pIrp->AssociatedIrp.SystemBuffer);
         break;
     }
+    case IOCTL_VIRTUAL_DISK_QUERY_SUBSCRIPTION: {
+        DPTLOG(LL_INFO, "IOCTL_VIRTUAL_DISK_QUERY_SUBSCRIPTION");
+        if (0 != IrpSp->Parameters.DeviceIoControl.InputBufferLength ||
+            sizeof(SUBSCRIPTION_STATISTICS) != IrpSp->Parameters.DeviceIoControl.OutputBufferLength)
+        {
+            Status = STATUS_INVALID_BUFFER_SIZE;
+            break;
+        }
+        SUBSCRIPTION_CONTEXT *pContext = IrpSp->FileObject->FsContext;
+        if (!pContext)
+        {
+            Status = STATUS_INVALID_HANDLE;
+            break;
+        }
+        KIRQL OldIrql;
+        KeAcquireSpinLock(&pContext->Lock, &OldIrql);
+        pContext->Statistics.Queued = pContext->PendedMessages.Count;
+        pContext->Statistics.MaxQueued = pContext->Options.MaxQueuedMessages;
+        *(SUBSCRIPTION_STATISTICS *)pIrp->AssociatedIrp.SystemBuffer = pContext->Statistics;
+        KeReleaseSpinLock(&pContext->Lock, OldIrql);
+        pIrp->IoStatus.Information = sizeof(SUBSCRIPTION_STATISTICS);
+        break;
+    }
+    case IOCTL_VIRTUAL_DISK_QUERY_WORKERS:
+        DPTLOG(LL_INFO, "IOCTL_VIRTUAL_DISK_QUERY_WORKERS");
+        if (0 != IrpSp->Parameters.DeviceIoControl.InputBufferLength ||
+            sizeof(WORKER_STATISTICS_RESPONSE) > IrpSp->Parameters.DeviceIoControl.OutputBufferLength)
+        {
+            Status = STATUS_INVALID_BUFFER_SIZE;
+            break;
+        }
+        Status = DPT_QueryWorkers(pIrp->AssociatedIrp.SystemBuffer, IrpSp->Parameters.DeviceIoControl.OutputBufferLength,
+            &pIrp->IoStatus.Information);
+        break;
     default:
         Status = STATUS_INVALID_DEVICE_REQUEST;
         break;
@@ -642,8 +1679,9 @@ static BOOLEAN DPT_SendMessage(SUBSCRIPTION_CONTEXT *pContext, PARSER_MESSAGE *p
 {
 	PLIST_ENTRY pIrpEntry = NULL;
 	PIRP pIrp = NULL;
-	PUCHAR pBuffer = NULL, pSource = (PUCHAR)pMessage;
-	ULONG BytesRemaining = 0, BytesToCopy = 0;
+	PPARSER_MESSAGE_ENTRY pQueued = NULL;
+	PUCHAR pBuffer = NULL;
+	ULONG BytesRemaining = 0, BytesToCopy = 0, BytesCopied = 0;
 	BOOLEAN Sent = FALSE;
     KIRQL OldIrql;
 
@@ -678,28 +1716,53 @@ static BOOLEAN DPT_SendMessage(SUBSCRIPTION_CONTEXT *pContext, PARSER_MESSAGE *p
 		}
 
 		if (!FoundPendingIrp)
+		{
+			pIrp = NULL;
 			goto Cleanup;
+		}
 
-		KeReleaseSpinLockFromDpcLevel(&pContext->Lock);
-
-        pBuffer = (PUCHAR)MmGetSystemAddressForMdlSafe(pIrp->MdlAddress, NormalPagePriority) + pIrp->MdlAddress->ByteOffset;
-        BytesRemaining = pIrp->MdlAddress->ByteCount;
+        pBuffer = (PUCHAR)MmGetSystemAddressForMdlSafe(pIrp->MdlAddress, NormalPagePriority);
+        BytesRemaining = MmGetMdlByteCount(pIrp->MdlAddress);
         LOG_ASSERT(pBuffer);
 
-		BytesToCopy = min(BytesRemaining, sizeof(PARSER_MESSAGE));
-		memmove(pBuffer, pSource, BytesToCopy);
+        // Packed framing drains the queue into the read like DPT_Read, the queued messages are older and go first
+        while (pContext->Framing == MessageFramingPacked && NULL != (pQueued = MessageQueue_First(&pContext->PendedMessages)))
+        {
+            BytesToCopy = DPT_FrameMessage(pContext, &DPT_ENTRY_BODY(pQueued)->Message, DPT_ENTRY_BODY(pQueued)->Length,
+                pBuffer + BytesCopied, BytesRemaining - BytesCopied);
+            if (!BytesToCopy)
+                break;
+            BytesCopied += BytesToCopy;
+
+            MessageQueue_Remove(&pContext->PendedMessages, pQueued);
+            ++pContext->Statistics.Delivered;
+            DPT_FreeMessageEntry(pQueued);
+        }
+
+        // The message is queued behind the ones that did not fit
+        if (!MessageQueue_First(&pContext->PendedMessages) || pContext->Framing != MessageFramingPacked)
+        {
+            BytesToCopy = DPT_FrameMessage(pContext, pMessage, DPT_GetMessageLength(pMessage),
+                pBuffer + BytesCopied, BytesRemaining - BytesCopied);
+            if (BytesToCopy)
+            {
+                BytesCopied += BytesToCopy;
+                ++pContext->Statistics.Delivered;
+                Sent = TRUE;
+            }
+        }
+	}
+Cleanup:
+	KeReleaseSpinLock(&pContext->Lock, OldIrql);
 
+	if (pIrp)
+	{
 		pIrp->IoStatus.Status = STATUS_SUCCESS;
-		pIrp->IoStatus.Information = BytesToCopy;
+		pIrp->IoStatus.Information = BytesCopied;
 
-		DPTLOG(LL_INFO, "IRP %p completed with %d bytes", pIrp, BytesToCopy);
+		DPTLOG(LL_INFO, "IRP %p completed with %d bytes", pIrp, BytesCopied);
 
 		IoCompleteRequest(pIrp, IO_NO_INCREMENT);
-
-		KeAcquireSpinLockAtDpcLevel(&pContext->Lock);
-		Sent = TRUE;
 	}
-Cleanup:
-	KeReleaseSpinLock(&pContext->Lock, OldIrql);
 	return Sent;
 }
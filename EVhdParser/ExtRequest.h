@@ -0,0 +1,42 @@
+#pragma once
+/*
+ * Completion of a request of the storage VSP through the extension, shared by the parsers. The layouts of
+ * STORVSP_REQUEST and STORVSC_REQUEST differ between the parsers, so this header is included after the
+ * Vstor.h of the parser and compiled with it.
+ */
+#include "Extension.h"
+
+/**
+ Ext_CompleteVstorRequest
+
+ Routine Description:
+	Calls Ext_CompleteScsiRequest for a request that vhdmp completed with Status. The MDL and the transfer
+	length of the guest are restored whatever the status, a read the extension could not decrypt is failed
+	with the sense data of pVspRequest. Returns the status of the extension
+*/
+static __inline NTSTATUS Ext_CompleteVstorRequest(_In_ PVOID ExtContext, _Inout_ STORVSP_REQUEST *pVspRequest,
+    _Inout_ STORVSC_REQUEST *pVscRequest, _Inout_ PMDL *ppMdl, _In_opt_ SRB_TIMING *pTiming, ULONG RequestLength,
+    NTSTATUS Status)
+{
+    EVHD_EXT_SCSI_PACKET ExtPacket;
+    NTSTATUS ExtStatus = STATUS_SUCCESS;
+
+    ExtPacket.Srb = &pVspRequest->Srb;
+    ExtPacket.pMdl = *ppMdl;
+    ExtPacket.pSenseBuffer = pVspRequest->Srb.SenseInfoBuffer;
+    ExtPacket.SenseBufferLength = pVspRequest->Srb.SenseInfoBufferLength;
+    ExtPacket.pTiming = pTiming;
+    ExtPacket.RequestLength = RequestLength;
+    ExtPacket.bReadAheadSent = FALSE;
+    ExtStatus = Ext_CompleteScsiRequest(ExtContext, &ExtPacket, Status);
+    // A read-ahead is trimmed off whatever the status
+    *ppMdl = ExtPacket.pMdl;
+    pVscRequest->DataTransferLength = pVspRequest->Srb.DataTransferLength;
+    if (NT_SUCCESS(Status) && !NT_SUCCESS(ExtStatus))
+    {
+        pVscRequest->SrbStatus = pVspRequest->Srb.SrbStatus;
+        pVscRequest->ScsiStatus = pVspRequest->Srb.ScsiStatus;
+        pVscRequest->SenseInfoBufferLength = pVspRequest->Srb.SenseInfoBufferLength;
+    }
+    return ExtStatus;
+}
@@ -5,6 +5,12 @@
 #include "cipher.h"
 #include "ScsiOp.h"
 #include "Dispatch.h"
+#include "Catalog.h"
+#include "DiskStats.h"
+#include "ScsiCache.h"
+#include "ReadCache.h"
+#include "ParentOverlay.h"
+#include "ReadAhead.h"
 
 #define EXTLOG(level, format, ...) LOG_FUNCTION(level, LOG_CTG_EXTENSION, format, __VA_ARGS__)
 
@@ -12,11 +18,56 @@ const ULONG32 ExtAllocationTag = 'SExt';
 
 static ULONG ExtWaitCipherConfigTimeoutInMs = 5000;
 
+/* Logical sector size the SCSI requests are addressed in */
+#define EXT_SECTOR_SIZE 512
+/* Physical sector size and smallest optimal transfer advertised with CATALOG_FLAG_ADVERTISE_4K */
+#define EXT_PHYSICAL_SECTOR_SIZE 4096
+#define EXT_OPTIMAL_TRANSFER_SIZE 0x40000
+/* Fixed format sense data of the requests the extension fails itself */
+#define EXT_SENSE_LENGTH 18
+#define EXT_SENSE_MEDIUM_ERROR 0x03
+#define EXT_SENSE_ILLEGAL_REQUEST 0x05
+#define EXT_ASC_UNRECOVERED_READ_ERROR 0x11
+#define EXT_ASC_INVALID_FIELD_IN_CDB 0x24
+
 typedef struct {
     CipherEngine *pCipherEngine;
     PVOID pCipherContext;
     GUID DiskId;
     GUID ApplicationId;
+    /* File of the disk, its allocation table tells the blocks a clone holds itself */
+    UNICODE_STRING DiskPath;
+    BOOLEAN bVhdx;
+    /* Bytes encrypted with a single tweak, from the disk catalog */
+    ULONG DataUnitSize;
+    /* Block limits and READ CAPACITY 16 responses are rewritten to advertise 4 KiB physical sectors */
+    BOOLEAN bAdvertise4K;
+    /* Identifies the disk in the flight recorder */
+    USHORT DiskTag;
+    /* Performance counters, NULL if they could not be allocated */
+    DISK_STATS_CONTEXT *pStats;
+    /* Responses to idempotent commands, under ResponseLock */
+    KSPIN_LOCK ResponseLock;
+    SCSI_CACHE Responses;
+    /* Key of the disk in the read cache */
+    ULONG64 CacheDisk;
+    /* Linkage identifier of the parent of a differencing disk */
+    GUID ParentId;
+    BOOLEAN bHasParent;
+    /* Key in the read cache of the blocks read from the parent, shared with its other clones, 0 if not shared */
+    ULONG64 SharedDisk;
+    /* Regions the disk holds itself, NULL while it never shared the blocks of its parent. Kept until it is closed */
+    PARENT_OVERLAY *pOverlay;
+    /* A disk mounted before without the overlay does not share, its writes may not be in its allocation table yet */
+    BOOLEAN bMountedBefore;
+    /* Sequential stream of reads and its decrypted read-ahead, under ReadAheadLock. No buffer while read-ahead is off */
+    KSPIN_LOCK ReadAheadLock;
+    READ_AHEAD ReadAhead;
+    PUCHAR pReadAheadBuffer;
+    /* Request of the read-ahead in flight, NULL if none */
+    PSCSI_REQUEST_BLOCK pReadAheadSrb;
+    /* Size of the disk from the last READ CAPACITY, 0 while it is not known */
+    volatile LONG64 CapacityBytes;
 } EXTENSION_CONTEXT, *PEXTENSION_CONTEXT;
 
 PMDL Ext_AllocateInnerMdl(PMDL pSourceMdl)
@@ -27,7 +78,8 @@ PMDL Ext_AllocateInnerMdl(PMDL pSourceMdl)
     SkipBytes.QuadPart = 0;
 
     PMDL pNewMdl = MmAllocatePagesForMdlEx(LowAddress, HighAddress, SkipBytes, pSourceMdl->ByteCount, MmCached, MM_DONT_ZERO_ALLOCATION);
-    pNewMdl->Next = pSourceMdl;
+    if (pNewMdl)
+        pNewMdl->Next = pSourceMdl;
 
     return pNewMdl;
 }
@@ -37,6 +89,7 @@ PMDL Ext_FreeInnerMdl(PMDL pMdl)
     PMDL pSourceMdl = pMdl->Next;
     pMdl->Next = NULL;
     MmFreePagesFromMdl(pMdl);
+    ExFreePool(pMdl);
     return pSourceMdl;
 }
 
@@ -44,7 +97,7 @@ NTSTATUS Ext_CryptBlocks(PEXTENSION_CONTEXT ExtContext, PMDL pSourceMdl, PMDL pT
 {
     NTSTATUS status = STATUS_SUCCESS;
     PVOID pSource = NULL, pTarget = NULL;
-    CONST SIZE_T SectorSize = 512;
+    SIZE_T SectorSize = 0;
     SIZE_T SectorOffset = 0;
 
     if (!ExtContext || !pSourceMdl || !pTargetMdl)
@@ -52,6 +105,12 @@ NTSTATUS Ext_CryptBlocks(PEXTENSION_CONTEXT ExtContext, PMDL pSourceMdl, PMDL pT
     if (!ExtContext->pCipherContext)
         return STATUS_SUCCESS;
 
+    // The tweak is the data unit number, requests must cover whole data units
+    SectorSize = ExtContext->DataUnitSize;
+    if (0 != (sector * EXT_SECTOR_SIZE) % SectorSize || 0 != size % SectorSize)
+        return STATUS_INVALID_PARAMETER;
+    sector = sector * EXT_SECTOR_SIZE / SectorSize;
+
     pSource = MmGetSystemAddressForMdlSafe(pSourceMdl, NormalPagePriority);
     pTarget = MmGetSystemAddressForMdlSafe(pTargetMdl, NormalPagePriority);
 
@@ -79,6 +138,24 @@ NTSTATUS Ext_CryptBlocks(PEXTENSION_CONTEXT ExtContext, PMDL pSourceMdl, PMDL pT
     return status;
 }
 
+/** Ext_CryptBlocks, the time spent is added to the counters of the disk and stamped into the request */
+static NTSTATUS Ext_CryptCounted(PEXTENSION_CONTEXT ExtContext, SRB_TIMING *pTiming, PMDL pSourceMdl, PMDL pTargetMdl,
+    SIZE_T size, SIZE_T sector, BOOLEAN Encrypt)
+{
+    ULONG Stamp = Encrypt ? SRB_STAMP_CRYPT_START : SRB_STAMP_DECRYPT_START;
+    ULONG64 StartTsc = ReadTimeStampCounter(), EndTsc = 0;
+    NTSTATUS Status = Ext_CryptBlocks(ExtContext, pSourceMdl, pTargetMdl, size, sector, Encrypt);
+    EndTsc = ReadTimeStampCounter();
+    if (ExtContext->pStats)
+        DiskCounters_Crypto(DiskStats_Counters(ExtContext->pStats), EndTsc - StartTsc, (ULONG32)size);
+    if (pTiming)
+    {
+        pTiming->Tsc[Stamp] = StartTsc;
+        pTiming->Tsc[Stamp + 1] = EndTsc;
+    }
+    return Status;
+}
+
 NTSTATUS Ext_Initialize(_Out_ PEVHD_EXT_CAPABILITIES pCaps)
 {
     NTSTATUS Status = STATUS_SUCCESS;
@@ -104,7 +181,6 @@ NTSTATUS Ext_Create(_In_ PCUNICODE_STRING DiskPath,
     _In_ PGUID DiskId,
     _Outptr_opt_result_maybenull_ PVOID *DiskContext)
 {
-    UNREFERENCED_PARAMETER(DiskFormat);
     NTSTATUS Status = STATUS_SUCCESS;
     TRACE_FUNCTION_IN();
     EXTLOG(LL_INFO, "Disk opened %S, " GUID_FORMAT, DiskPath->Buffer, GUID_PARAMETERS(*DiskId));
@@ -121,8 +197,25 @@ NTSTATUS Ext_Create(_In_ PCUNICODE_STRING DiskPath,
     {
         memset(Context, 0, sizeof(EXTENSION_CONTEXT));
         Context->DiskId = *DiskId;
+        Context->bVhdx = DiskFormat == EDiskFormat_Vhdx;
+        // Without it the blocks of the parent are not shared
+        Context->DiskPath.Buffer = ExAllocatePoolWithTag(PagedPool, DiskPath->Length + sizeof(WCHAR), ExtAllocationTag);
+        if (Context->DiskPath.Buffer)
+        {
+            Context->DiskPath.MaximumLength = DiskPath->Length + sizeof(WCHAR);
+            RtlCopyUnicodeString(&Context->DiskPath, DiskPath);
+        }
+        Context->DataUnitSize = EXT_SECTOR_SIZE;
+        Context->DiskTag = Flight_AllocateDiskTag();
+        Context->CacheDisk = ReadCache_NewDisk();
+        KeInitializeSpinLock(&Context->ResponseLock);
+        KeInitializeSpinLock(&Context->ReadAheadLock);
+        ScsiCache_Initialize(&Context->Responses);
         if (ApplicationId)
             Context->ApplicationId = *ApplicationId;
+        // The disk works without counters
+        if (!NT_SUCCESS(DiskStats_Create(&Context->DiskId, &Context->ApplicationId, Context->DiskTag, &Context->pStats)))
+            EXTLOG(LL_WARNING, "Could not allocate performance counters");
         *DiskContext = Context;
     }
     
@@ -130,16 +223,135 @@ NTSTATUS Ext_Create(_In_ PCUNICODE_STRING DiskPath,
     return Status;
 }
 
+VOID Ext_SetParent(_In_ PVOID ExtContext, _In_ PGUID ParentId)
+{
+    static const GUID NoParent = { 0 };
+    PEXTENSION_CONTEXT Context = ExtContext;
+
+    if (RtlEqualMemory(ParentId, &NoParent, sizeof(GUID)))
+        return;
+    Context->ParentId = *ParentId;
+    Context->bHasParent = TRUE;
+    EXTLOG(LL_INFO, "Disk " GUID_FORMAT " has the parent " GUID_FORMAT, GUID_PARAMETERS(Context->DiskId),
+        GUID_PARAMETERS(*ParentId));
+}
+
 NTSTATUS Ext_Delete(_In_ PVOID ExtContext)
 {
     NTSTATUS Status = STATUS_SUCCESS;
     TRACE_FUNCTION_IN();
     Ext_Dismount(ExtContext);
+    if (((PEXTENSION_CONTEXT)ExtContext)->pStats)
+        DiskStats_Delete(((PEXTENSION_CONTEXT)ExtContext)->pStats);
+    if (((PEXTENSION_CONTEXT)ExtContext)->pOverlay)
+        ExFreePoolWithTag(((PEXTENSION_CONTEXT)ExtContext)->pOverlay, ExtAllocationTag);
+    if (((PEXTENSION_CONTEXT)ExtContext)->DiskPath.Buffer)
+        ExFreePoolWithTag(((PEXTENSION_CONTEXT)ExtContext)->DiskPath.Buffer, ExtAllocationTag);
     ExFreePoolWithTag(ExtContext, ExtAllocationTag);
     TRACE_FUNCTION_OUT_STATUS(Status);
     return Status;
 }
 
+/** Asks the key service for the cipher configuration, the exchange is kept by the flight recorder */
+static BOOLEAN Ext_KeyRequest(PEXTENSION_CONTEXT Context, PARSER_MESSAGE *pRequest, PARSER_RESPONSE_MESSAGE *pResponse)
+{
+    ULONG64 StartTime = KeQueryInterruptTime();
+    BOOLEAN Answered = FALSE;
+
+    Flight_Record(FlightEventKeyRequest, (UCHAR)pRequest->Type, Context->DiskTag, 0, 0, 0);
+    Answered = DPT_SynchronouseRequest(pRequest, pResponse, ExtWaitCipherConfigTimeoutInMs);
+    Flight_Record(FlightEventKeyResponse, (UCHAR)pRequest->Type, Context->DiskTag, (ULONG64)pRequest->RequestId,
+        (ULONG32)((KeQueryInterruptTime() - StartTime) / 10), Answered ? STATUS_SUCCESS : STATUS_TIMEOUT);
+    return Answered;
+}
+
+/** First block addressed by a read or write CDB, 0 for other commands */
+static ULONG64 Ext_GetCdbLba(const UCHAR *Cdb)
+{
+    switch (Cdb[0])
+    {
+    case SCSI_OP_CODE_READ_6:
+    case SCSI_OP_CODE_WRITE_6:
+        return ((ULONG64)(Cdb[1] & 0x1F) << 16) | ((ULONG64)Cdb[2] << 8) | Cdb[3];
+    case SCSI_OP_CODE_READ_10:
+    case SCSI_OP_CODE_WRITE_10:
+    case SCSI_OP_CODE_READ_12:
+    case SCSI_OP_CODE_WRITE_12:
+        return RtlUlongByteSwap(*(ULONG UNALIGNED *)&Cdb[2]);
+    case SCSI_OP_CODE_READ_16:
+    case SCSI_OP_CODE_WRITE_16:
+        return RtlUlonglongByteSwap(*(ULONG64 UNALIGNED *)&Cdb[2]);
+    }
+    return 0;
+}
+
+static ULONG64 Ext_HashBytes(ULONG64 Hash, const VOID *pData, SIZE_T Length)
+{
+    const UCHAR *p = pData;
+    while (Length--)
+        Hash = (Hash ^ *p++) * 0x100000001B3ULL;
+    return Hash;
+}
+
+/** Shares the blocks the disk reads from its parent with the other clones that decrypt them with the same key */
+static VOID Ext_ShareParent(PEXTENSION_CONTEXT Context, const CATALOG_ENTRY *pEntry)
+{
+    static const GUID NoKey = { 0 };
+    ULONG64 KeyHash = 0xCBF29CE484222325ULL;
+    NTSTATUS Status = STATUS_SUCCESS;
+
+    if (!Context->bHasParent || !ReadCache_Enabled() || !Context->DiskPath.Buffer)
+        return;
+    // The key service may give clones without a key reference different keys
+    if (!(pEntry->PolicyFlags & CATALOG_FLAG_INLINE_KEY) && RtlEqualMemory(&pEntry->KeyReference, &NoKey, sizeof(GUID)))
+    {
+        EXTLOG(LL_WARNING, "Disk " GUID_FORMAT " has no key reference, the blocks of its parent are not shared",
+            GUID_PARAMETERS(Context->DiskId));
+        return;
+    }
+    KeyHash = Ext_HashBytes(KeyHash, &pEntry->Algorithm, sizeof(pEntry->Algorithm));
+    KeyHash = Ext_HashBytes(KeyHash, &pEntry->DataUnitSize, sizeof(pEntry->DataUnitSize));
+    KeyHash = Ext_HashBytes(KeyHash, &pEntry->KeyReference, sizeof(GUID));
+    if (pEntry->PolicyFlags & CATALOG_FLAG_INLINE_KEY)
+        KeyHash = Ext_HashBytes(KeyHash, &pEntry->Key, sizeof(pEntry->Key));
+
+    if (!Context->pOverlay)
+    {
+        if (Context->bMountedBefore)
+        {
+            EXTLOG(LL_INFO, "Disk " GUID_FORMAT " was mounted before without an overlay, the blocks of its parent "
+                "are not shared", GUID_PARAMETERS(Context->DiskId));
+            return;
+        }
+        Context->pOverlay = ExAllocatePoolWithTag(NonPagedPool, sizeof(PARENT_OVERLAY), ExtAllocationTag);
+        if (!Context->pOverlay)
+        {
+            EXTLOG(LL_WARNING, "Could not allocate the overlay, the blocks of the parent are not shared");
+            return;
+        }
+        ParentOverlay_Initialize(Context->pOverlay);
+        // Blocks written by earlier opens, before any read of the parent is shared
+        Status = ParentOverlay_Load(Context->pOverlay, &Context->DiskPath, Context->bVhdx);
+        if (!NT_SUCCESS(Status))
+        {
+            EXTLOG(LL_WARNING, "Could not read the allocation table of " GUID_FORMAT " (0x%08X), the blocks of its parent "
+                "are not shared", GUID_PARAMETERS(Context->DiskId), Status);
+            ExFreePoolWithTag(Context->pOverlay, ExtAllocationTag);
+            Context->pOverlay = NULL;
+            return;
+        }
+    }
+    // The overlay keeps recording writes while nothing is shared
+    Context->SharedDisk = ReadCache_OpenShared(&Context->ParentId, KeyHash);
+    if (!Context->SharedDisk)
+    {
+        EXTLOG(LL_WARNING, "Too many parents are shared, the blocks of " GUID_FORMAT " are not",
+            GUID_PARAMETERS(Context->ParentId));
+        return;
+    }
+    EXTLOG(LL_INFO, "Disk " GUID_FORMAT " shares the blocks of its parent", GUID_PARAMETERS(Context->DiskId));
+}
+
 NTSTATUS Ext_Mount(_In_ PVOID ExtContext)
 {
     PEXTENSION_CONTEXT Context = ExtContext;
@@ -148,12 +360,43 @@ NTSTATUS Ext_Mount(_In_ PVOID ExtContext)
 
     PARSER_MESSAGE Request;
     PARSER_RESPONSE_MESSAGE Response;
+    CATALOG_ENTRY CatalogEntry;
+    BOOLEAN InCatalog = FALSE;
 
     Request.Type = MessageTypeQueryCipherConfig;
     Request.Message.QueryCipherConfig.DiskId = Context->DiskId;
     Request.Message.QueryCipherConfig.ApplicationId = Context->ApplicationId;
+    memset(&Request.Message.QueryCipherConfig.KeyReference, 0, sizeof(GUID));
+    Flight_Record(FlightEventMount, 0, Context->DiskTag, *(ULONG64 *)&Context->DiskId,
+        *(ULONG32 *)&Context->DiskId.Data4[0], *(ULONG32 *)&Context->DiskId.Data4[4]);
+
+    Context->bAdvertise4K = FALSE;
+    InCatalog = NT_SUCCESS(Catalog_Lookup(&Context->DiskId, &CatalogEntry));
+    if (InCatalog)
+    {
+        EXTLOG(LL_INFO, "Disk " GUID_FORMAT " found in the catalog", GUID_PARAMETERS(Context->DiskId));
+        Request.Message.QueryCipherConfig.KeyReference = CatalogEntry.KeyReference;
+        if (CatalogEntry.DataUnitSize == 4096)
+            Context->DataUnitSize = CatalogEntry.DataUnitSize;
+        else if (CatalogEntry.DataUnitSize != EXT_SECTOR_SIZE)
+            Status = STATUS_INVALID_PARAMETER;
+        // The guest is asked for transfers of whole data units, the others are failed with a check condition
+        Context->bAdvertise4K = (CatalogEntry.PolicyFlags & CATALOG_FLAG_ADVERTISE_4K) || CatalogEntry.DataUnitSize == 4096;
+    }
 
-    if (DPT_SynchronouseRequest(&Request, &Response, ExtWaitCipherConfigTimeoutInMs))
+    if (!NT_SUCCESS(Status))
+    {
+        EXTLOG(LL_ERROR, "Unsupported data unit size %d in the catalog", CatalogEntry.DataUnitSize);
+    }
+    else if (InCatalog && CatalogEntry.Algorithm == ECipherAlgo_Disabled)
+    {
+        // The catalog states the disk is not encrypted, there is nothing to ask for
+    }
+    else if (InCatalog && (CatalogEntry.PolicyFlags & CATALOG_FLAG_INLINE_KEY))
+    {
+        Status = CipherCreate((ECipherAlgo)CatalogEntry.Algorithm, &CatalogEntry.Key, &Context->pCipherEngine, &Context->pCipherContext);
+    }
+    else if (Ext_KeyRequest(Context, &Request, &Response))
     {
         if (Response.Type == MessageTypeResponseCipherConfig)
         {
@@ -163,13 +406,34 @@ NTSTATUS Ext_Mount(_In_ PVOID ExtContext)
         else
             Status = STATUS_INVALID_PARAMETER;
     }
+    else if (InCatalog && (CatalogEntry.PolicyFlags & CATALOG_FLAG_REQUIRE_KEY))
+    {
+        EXTLOG(LL_ERROR, "Key service did not provide the key required by the catalog");
+        Status = STATUS_ACCESS_DENIED;
+    }
     else
     {
         Status = CipherEngineGet(&Context->DiskId, &Context->pCipherEngine, &Context->pCipherContext);
     }
+    if (NT_SUCCESS(Status) && InCatalog && Context->pCipherEngine && (CatalogEntry.PolicyFlags & CATALOG_FLAG_SHARE_PARENT))
+        Ext_ShareParent(Context, &CatalogEntry);
+    if (NT_SUCCESS(Status) && Context->pCipherEngine && ReadCache_ReadAheadWindow())
+    {
+        // The disk works without read-ahead
+        Context->pReadAheadBuffer = ExAllocatePoolWithTag(NonPagedPool, ReadCache_ReadAheadWindow(), ExtAllocationTag);
+        Context->pReadAheadSrb = NULL;
+        if (Context->pReadAheadBuffer)
+            ReadAhead_Initialize(&Context->ReadAhead, ReadCache_ReadAheadWindow());
+        else
+            EXTLOG(LL_WARNING, "Could not allocate the read-ahead buffer");
+    }
+    if (InCatalog)
+        RtlSecureZeroMemory(&CatalogEntry, sizeof(CatalogEntry));
     if (!NT_SUCCESS(Status)) {
         EXTLOG(LL_FATAL, "Could not create encryption context");
     }
+    Context->bMountedBefore = TRUE;
+    Flight_Record(FlightEventMountDone, 0, Context->DiskTag, 0, 0, Status);
     TRACE_FUNCTION_OUT_STATUS(Status);
     return Status;
 }
@@ -179,6 +443,19 @@ NTSTATUS Ext_Dismount(_In_ PVOID ExtContext)
     TRACE_FUNCTION_IN();
     NTSTATUS Status = STATUS_SUCCESS;
     PEXTENSION_CONTEXT Context = ExtContext;
+    Flight_Record(FlightEventDismount, 0, Context->DiskTag, 0, 0, 0);
+    Ext_InvalidateResponses(Context);
+    ReadCache_DropDisk(Context->CacheDisk);
+    if (Context->SharedDisk)
+    {
+        ReadCache_CloseShared(Context->SharedDisk);
+        Context->SharedDisk = 0;
+    }
+    if (Context->pReadAheadBuffer)
+    {
+        ExFreePoolWithTag(Context->pReadAheadBuffer, ExtAllocationTag);
+        Context->pReadAheadBuffer = NULL;
+    }
     if (Context->pCipherEngine) {
         Context->pCipherEngine->pfnDestroy(Context->pCipherContext);
         Context->pCipherContext = NULL;
@@ -210,10 +487,567 @@ NTSTATUS Ext_Restore(_In_ PVOID ExtContext, PVOID RestoreBuffer, SIZE_T RestoreB
     return Status;
 }
 
+/** Records the start of a request in the flight recorder and the counters of its disk */
+static __inline VOID Ext_CountStart(PEXTENSION_CONTEXT Context, PSCSI_REQUEST_BLOCK Srb, SRB_TIMING *pTiming)
+{
+    UCHAR opCode = Srb->Cdb[0];
+    ULONG64 Lba = Ext_GetCdbLba(Srb->Cdb);
+    // Read once, the TSC costs as much as the rest of the accounting on some hypervisors
+    ULONG64 Tsc = ReadTimeStampCounter();
+
+    if (pTiming)
+        pTiming->Tsc[SRB_STAMP_EXT_START] = Tsc;
+    Flight_RecordAt(Tsc, FlightEventSrbStart, opCode, Context->DiskTag, Lba, Srb->DataTransferLength, 0);
+    if (Context->pStats)
+    {
+        ULONG32 Class = DiskCounters_Class(opCode);
+        DISK_COUNTERS *pCounters = DiskStats_Counters(Context->pStats);
+        DiskCounters_Start(pCounters, Class);
+        if (Class != DISK_CLASS_OTHER)
+        {
+            DiskStats_Access(Context->pStats, Lba * EXT_SECTOR_SIZE, Srb->DataTransferLength, Class == DISK_CLASS_WRITE);
+            if ((Lba * EXT_SECTOR_SIZE | Srb->DataTransferLength) & (EXT_PHYSICAL_SECTOR_SIZE - 1))
+                ++pCounters->MisalignedIos;
+            else
+                ++pCounters->AlignedIos;
+        }
+        // A request not found at completion is counted as untracked
+        DiskInflight_Insert(&Context->pStats->Inflight, (ULONG64)Srb, Tsc, opCode, Lba, Srb->DataTransferLength);
+    }
+}
+
+/**
+ * Records the completion of a request in the flight recorder and the counters of its disk. Returns the TSC the
+ * request started at, 0 if it was not tracked.
+ */
+static __inline ULONG64 Ext_CountComplete(PEXTENSION_CONTEXT Context, PSCSI_REQUEST_BLOCK Srb, NTSTATUS Status)
+{
+    UCHAR opCode = Srb->Cdb[0];
+    ULONG64 Lba = Ext_GetCdbLba(Srb->Cdb);
+    ULONG64 Tsc = ReadTimeStampCounter(), StartTsc = 0;
+
+    Flight_RecordAt(Tsc, FlightEventSrbComplete, opCode, Context->DiskTag, Lba, Srb->DataTransferLength, Status);
+    if (Context->pStats)
+    {
+        ULONG64 Ticks = 0;
+        if (DiskInflight_Remove(&Context->pStats->Inflight, (ULONG64)Srb, &StartTsc))
+            Ticks = max(Tsc - StartTsc, 1);
+        DiskCounters_Complete(DiskStats_Counters(Context->pStats), DiskCounters_Class(opCode), Srb->DataTransferLength,
+            Ticks, !NT_SUCCESS(Status) || SRB_STATUS(Srb->SrbStatus) != SRB_STATUS_SUCCESS);
+        DiskStats_Completed(Context->pStats, opCode, Lba, Srb->DataTransferLength, Ticks);
+    }
+    return StartTsc;
+}
+
+/** System address of the buffer of an MDL, *pUnmap is set if the mapping was made for the caller */
+static PVOID Ext_MapMdl(PMDL pMdl, BOOLEAN *pUnmap)
+{
+    *pUnmap = 0 == (pMdl->MdlFlags & (MDL_MAPPED_TO_SYSTEM_VA | MDL_SOURCE_IS_NONPAGED_POOL));
+    return MmGetSystemAddressForMdlSafe(pMdl, NormalPagePriority);
+}
+
+/** Completes the request with CHECK CONDITION and sense data of SenseKey and Asc, nothing is transferred */
+static VOID Ext_FailRequest(PSCSI_REQUEST_BLOCK Srb, UCHAR SenseKey, UCHAR Asc)
+{
+    UCHAR *pSense = Srb->SenseInfoBuffer;
+
+    Srb->SrbStatus = SRB_STATUS_ERROR;
+    Srb->ScsiStatus = SCSISTAT_CHECK_CONDITION;
+    Srb->DataTransferLength = 0;
+    if (!pSense || Srb->SenseInfoBufferLength < EXT_SENSE_LENGTH)
+    {
+        Srb->SenseInfoBufferLength = 0;
+        return;
+    }
+    RtlZeroMemory(pSense, EXT_SENSE_LENGTH);
+    pSense[0] = 0x70;
+    pSense[2] = SenseKey;
+    pSense[7] = EXT_SENSE_LENGTH - 8;
+    pSense[12] = Asc;
+    Srb->SenseInfoBufferLength = EXT_SENSE_LENGTH;
+    Srb->SrbStatus |= SRB_STATUS_AUTOSENSE_VALID;
+}
+
+/** FALSE for a read or write covering part of a data unit, it can not be encrypted without the rest of it */
+static BOOLEAN Ext_IsDataUnitAligned(PEXTENSION_CONTEXT Context, PSCSI_REQUEST_BLOCK Srb)
+{
+    ULONG32 Class = DiskCounters_Class(Srb->Cdb[0]);
+    ULONG64 Offset = Ext_GetCdbLba(Srb->Cdb) * EXT_SECTOR_SIZE;
+
+    if (Context->DataUnitSize == EXT_SECTOR_SIZE || (Class != DISK_CLASS_READ && Class != DISK_CLASS_WRITE))
+        return TRUE;
+    return !((Offset | Srb->DataTransferLength) & (Context->DataUnitSize - 1));
+}
+
+/** TRUE for a read or write of whole read cache blocks */
+static BOOLEAN Ext_IsCacheAligned(PSCSI_REQUEST_BLOCK Srb)
+{
+    ULONG64 Offset = Ext_GetCdbLba(Srb->Cdb) * EXT_SECTOR_SIZE;
+    return Srb->DataTransferLength && !((Offset | Srb->DataTransferLength) & (READ_CACHE_BLOCK_SIZE - 1));
+}
+
+/** Key of a range in the read cache, the key shared with the other clones of the parent while the disk did not write it */
+static ULONG64 Ext_CacheDiskFor(PEXTENSION_CONTEXT Context, ULONG64 Offset, ULONG Length)
+{
+    if (Context->SharedDisk && !ParentOverlay_Covers(Context->pOverlay, Offset, Length))
+        return Context->SharedDisk;
+    return Context->CacheDisk;
+}
+
+/** Completes a read of an encrypted disk from the read cache, TRUE if every block was found */
+static BOOLEAN Ext_ReadFromCache(PEXTENSION_CONTEXT Context, PEVHD_EXT_SCSI_PACKET pExtPacket)
+{
+    PSCSI_REQUEST_BLOCK Srb = pExtPacket->Srb;
+    BOOLEAN Unmap = FALSE, Found = FALSE;
+    PUCHAR pBuffer = NULL;
+    ULONG64 Offset = 0, Disk = 0;
+
+    if (DiskCounters_Class(Srb->Cdb[0]) != DISK_CLASS_READ || !Ext_IsCacheAligned(Srb) || !pExtPacket->pMdl)
+        return FALSE;
+    pBuffer = Ext_MapMdl(pExtPacket->pMdl, &Unmap);
+    if (!pBuffer)
+        return FALSE;
+    Offset = Ext_GetCdbLba(Srb->Cdb) * EXT_SECTOR_SIZE;
+    Disk = Ext_CacheDiskFor(Context, Offset, Srb->DataTransferLength);
+    Found = ReadCache_Read(Disk, Offset, Srb->DataTransferLength, pBuffer);
+    if (Unmap)
+        MmUnmapLockedPages(pBuffer, pExtPacket->pMdl);
+    if (!Found)
+        return FALSE;
+    Srb->SrbStatus = SRB_STATUS_SUCCESS;
+    Srb->ScsiStatus = SCSISTAT_GOOD;
+    if (Context->pStats)
+    {
+        ++DiskStats_Counters(Context->pStats)->ReadCacheHits;
+        if (Disk == Context->SharedDisk)
+            ++DiskStats_Counters(Context->pStats)->ParentCacheHits;
+    }
+    return TRUE;
+}
+
+/** Keeps the decrypted blocks of a read that started at StartTsc, 0 if its start is not known */
+static VOID Ext_FillReadCache(PEXTENSION_CONTEXT Context, PSCSI_REQUEST_BLOCK Srb, PMDL pMdl, ULONG64 StartTsc)
+{
+    BOOLEAN Unmap = FALSE;
+    PUCHAR pBuffer = NULL;
+    ULONG Filled = 0, Length = Srb->DataTransferLength & ~(READ_CACHE_BLOCK_SIZE - 1);
+    ULONG64 Offset = Ext_GetCdbLba(Srb->Cdb) * EXT_SECTOR_SIZE;
+
+    // A short transfer keeps its whole blocks
+    if (!StartTsc || SRB_STATUS(Srb->SrbStatus) != SRB_STATUS_SUCCESS || (Offset & (READ_CACHE_BLOCK_SIZE - 1)) || !Length)
+        return;
+    pBuffer = Ext_MapMdl(pMdl, &Unmap);
+    if (!pBuffer)
+        return;
+    // Picked now, a write the read returned the data of has added its regions to the overlay by the time it completes
+    Filled = ReadCache_Fill(Ext_CacheDiskFor(Context, Offset, Length), Offset, Length, pBuffer, StartTsc);
+    if (Unmap)
+        MmUnmapLockedPages(pBuffer, pMdl);
+    if (Context->pStats)
+        DiskStats_Counters(Context->pStats)->ReadCacheFills += Filled;
+}
+
+/** Adds to the read-ahead counters of the disk */
+static VOID Ext_CountReadAhead(PEXTENSION_CONTEXT Context, ULONG Hits, ULONG64 Bytes, ULONG64 Wasted)
+{
+    DISK_COUNTERS *pCounters = NULL;
+
+    if (!Context->pStats)
+        return;
+    pCounters = DiskStats_Counters(Context->pStats);
+    pCounters->ReadAheadHits += Hits;
+    pCounters->ReadAheadBytes += Bytes;
+    pCounters->ReadAheadWasted += Wasted;
+}
+
+/**
+ * Tracks the stream of a READ 10 of an encrypted disk and completes it from the read-ahead buffer. Returns TRUE if
+ * it was copied from there, otherwise *pAhead receives the bytes to read ahead with it, 0 for none
+ */
+static BOOLEAN Ext_ReadFromReadAhead(PEXTENSION_CONTEXT Context, PEVHD_EXT_SCSI_PACKET pExtPacket, ULONG *pAhead)
+{
+    PSCSI_REQUEST_BLOCK Srb = pExtPacket->Srb;
+    ULONG64 Offset = Ext_GetCdbLba(Srb->Cdb) * EXT_SECTOR_SIZE, Capacity = Context->CapacityBytes, Wasted = 0;
+    ULONG Ahead = 0;
+    BOOLEAN Unmap = FALSE, Copied = FALSE;
+    PUCHAR pBuffer = NULL, pSource = NULL;
+    KIRQL OldIrql;
+
+    *pAhead = 0;
+    // The tweak of the other reads is not in the same CDB bytes, and they are rare
+    if (SCSI_OP_CODE_READ_10 != Srb->Cdb[0] || !Ext_IsCacheAligned(Srb) || !pExtPacket->pMdl || !Capacity)
+        return FALSE;
+    KeAcquireSpinLock(&Context->ReadAheadLock, &OldIrql);
+    Wasted = Context->ReadAhead.WastedBytes;
+    Ahead = ReadAhead_Start(&Context->ReadAhead, Offset, Srb->DataTransferLength, Capacity);
+    if (READ_AHEAD_HIT == Ahead)
+    {
+        pSource = Context->pReadAheadBuffer + (Offset - Context->ReadAhead.BaseOffset);
+        Ahead = 0;
+    }
+    Wasted = Context->ReadAhead.WastedBytes - Wasted;
+    KeReleaseSpinLock(&Context->ReadAheadLock, OldIrql);
+
+    if (pSource)
+    {
+        // No read-ahead fills the buffer until the copy ended
+        pBuffer = Ext_MapMdl(pExtPacket->pMdl, &Unmap);
+        if (pBuffer)
+        {
+            RtlCopyMemory(pBuffer, pSource, Srb->DataTransferLength);
+            Copied = TRUE;
+        }
+        KeAcquireSpinLock(&Context->ReadAheadLock, &OldIrql);
+        ReadAhead_EndRead(&Context->ReadAhead);
+        KeReleaseSpinLock(&Context->ReadAheadLock, OldIrql);
+    }
+    if (Unmap)
+        MmUnmapLockedPages(pBuffer, pExtPacket->pMdl);
+    Ext_CountReadAhead(Context, Copied, 0, Wasted);
+    // READ 10 transfers at most 0xFFFF blocks
+    if (Ahead && Srb->DataTransferLength + (ULONG64)Ahead <= 0xFFFF * EXT_SECTOR_SIZE)
+        *pAhead = Ahead;
+    if (!Copied)
+        return FALSE;
+    Srb->SrbStatus = SRB_STATUS_SUCCESS;
+    Srb->ScsiStatus = SCSISTAT_GOOD;
+    return TRUE;
+}
+
+/**
+ * Sends a read with Ahead more bytes after it. The transfer goes to an inner MDL and the CDB asks for the longer
+ * transfer, Ext_TrimReadAhead gives the guest its own back on completion. The read is sent as it is if the inner
+ * MDL could not be allocated or another read-ahead went out meanwhile, bReadAheadSent tells which
+ */
+static VOID Ext_SendReadAhead(PEXTENSION_CONTEXT Context, PEVHD_EXT_SCSI_PACKET pExtPacket, ULONG Ahead)
+{
+    PSCSI_REQUEST_BLOCK Srb = pExtPacket->Srb;
+    ULONG Length = Srb->DataTransferLength;
+    PHYSICAL_ADDRESS LowAddress, HighAddress, SkipBytes;
+    BOOLEAN Sent = FALSE;
+    PMDL pInnerMdl = NULL;
+    KIRQL OldIrql;
+
+    LowAddress.QuadPart = 0;
+    HighAddress.QuadPart = 0xFFFFFFFFFFFFFFFF;
+    SkipBytes.QuadPart = 0;
+    pInnerMdl = MmAllocatePagesForMdlEx(LowAddress, HighAddress, SkipBytes, Length + Ahead, MmCached, MM_DONT_ZERO_ALLOCATION);
+    // Fewer pages than asked for may be returned
+    if (pInnerMdl && pInnerMdl->ByteCount < Length + Ahead)
+    {
+        MmFreePagesFromMdl(pInnerMdl);
+        ExFreePool(pInnerMdl);
+        pInnerMdl = NULL;
+    }
+    if (Context->pStats)
+    {
+        DISK_COUNTERS *pCounters = DiskStats_Counters(Context->pStats);
+        if (pInnerMdl)
+            ++pCounters->BounceAllocations;
+        else
+            ++pCounters->BounceFailures;
+    }
+    if (!pInnerMdl)
+        return;
+
+    KeAcquireSpinLock(&Context->ReadAheadLock, &OldIrql);
+    if (!Context->ReadAhead.Pending)
+    {
+        ReadAhead_Issue(&Context->ReadAhead, Ext_GetCdbLba(Srb->Cdb) * EXT_SECTOR_SIZE + Length, Ahead);
+        Context->pReadAheadSrb = Srb;
+        Sent = TRUE;
+    }
+    KeReleaseSpinLock(&Context->ReadAheadLock, OldIrql);
+    if (!Sent)
+    {
+        MmFreePagesFromMdl(pInnerMdl);
+        ExFreePool(pInnerMdl);
+        return;
+    }
+    pInnerMdl->Next = pExtPacket->pMdl;
+    pExtPacket->pMdl = pInnerMdl;
+    pExtPacket->bReadAheadSent = TRUE;
+    *(USHORT UNALIGNED *)&Srb->Cdb[7] = RtlUshortByteSwap((USHORT)((Length + Ahead) / EXT_SECTOR_SIZE));
+    Srb->DataTransferLength = Length + Ahead;
+}
+
+/**
+ * Gives a read sent with a read-ahead the CDB and the transfer length of the guest back, before anything looks at
+ * its completion. Returns TRUE for such a read and sets bReadAheadSent, *pAhead receives the bytes read ahead that
+ * were transferred
+ */
+static BOOLEAN Ext_TrimReadAhead(PEXTENSION_CONTEXT Context, PEVHD_EXT_SCSI_PACKET pExtPacket, ULONG *pAhead)
+{
+    PSCSI_REQUEST_BLOCK Srb = pExtPacket->Srb;
+    ULONG Blocks = pExtPacket->RequestLength / EXT_SECTOR_SIZE;
+    KIRQL OldIrql;
+
+    *pAhead = 0;
+    if (SCSI_OP_CODE_READ_10 != Srb->Cdb[0] || !Context->pReadAheadBuffer)
+        return FALSE;
+    // Only one read-ahead is in flight, this request is the one if it was remembered for it
+    KeAcquireSpinLock(&Context->ReadAheadLock, &OldIrql);
+    if (Context->pReadAheadSrb == Srb)
+    {
+        Context->pReadAheadSrb = NULL;
+        pExtPacket->bReadAheadSent = TRUE;
+    }
+    KeReleaseSpinLock(&Context->ReadAheadLock, OldIrql);
+    if (!pExtPacket->bReadAheadSent || !pExtPacket->pMdl || !pExtPacket->pMdl->Next)
+        return FALSE;
+    *(USHORT UNALIGNED *)&Srb->Cdb[7] = RtlUshortByteSwap((USHORT)Blocks);
+    if (Srb->DataTransferLength > pExtPacket->RequestLength)
+    {
+        *pAhead = Srb->DataTransferLength - pExtPacket->RequestLength;
+        Srb->DataTransferLength = pExtPacket->RequestLength;
+    }
+    return TRUE;
+}
+
+/**
+ * Decrypts a read sent with Ahead bytes of read-ahead, copies the data of the guest to its buffer and keeps the
+ * rest in the read-ahead buffer unless a write or the stream made it stale. Frees the inner MDL, returns TRUE if the
+ * data of the guest was decrypted and copied. Otherwise a read that succeeded at vhdmp is failed by the caller
+ */
+static BOOLEAN Ext_KeepReadAhead(PEXTENSION_CONTEXT Context, PEVHD_EXT_SCSI_PACKET pExtPacket, NTSTATUS Status,
+    ULONG Ahead, ULONG Sector, ULONG64 StartTsc)
+{
+    PSCSI_REQUEST_BLOCK Srb = pExtPacket->Srb;
+    PMDL pInnerMdl = pExtPacket->pMdl, pMdl = pExtPacket->pMdl->Next;
+    ULONG Length = Srb->DataTransferLength;
+    ULONG32 Skip = 0;
+    ULONG64 Wasted = 0, Before = 0;
+    BOOLEAN Decrypted = FALSE, Fill = FALSE, Unmap = FALSE, UnmapInner = FALSE;
+    PUCHAR pBuffer = NULL, pInner = NULL;
+    KIRQL OldIrql;
+
+    // A short transfer keeps its whole data units
+    Ahead &= ~(READ_AHEAD_ALIGNMENT - 1);
+    if (NT_SUCCESS(Status) && NT_SUCCESS(Ext_CryptCounted(Context, pExtPacket->pTiming, pInnerMdl, pInnerMdl, Length + Ahead,
+        Sector, FALSE)))
+    {
+        pInner = Ext_MapMdl(pInnerMdl, &UnmapInner);
+        pBuffer = Ext_MapMdl(pMdl, &Unmap);
+        if (pInner && pBuffer)
+        {
+            RtlCopyMemory(pBuffer, pInner, Length);
+            Decrypted = TRUE;
+        }
+    }
+    if (!Decrypted)
+        Ahead = 0;
+    KeAcquireSpinLock(&Context->ReadAheadLock, &OldIrql);
+    Wasted = Context->ReadAhead.WastedBytes;
+    // Not kept if the start of the read is not known, 0 is never after a write
+    Fill = ReadAhead_Complete(&Context->ReadAhead, Ahead, StartTsc, &Skip);
+    Wasted = Context->ReadAhead.WastedBytes - Wasted;
+    KeReleaseSpinLock(&Context->ReadAheadLock, OldIrql);
+
+    if (Fill)
+    {
+        // Still pending, reads of the stream miss the buffer and no other read-ahead goes out until it is published
+        RtlCopyMemory(Context->pReadAheadBuffer + Skip, pInner + Length + Skip, Ahead - Skip);
+        KeAcquireSpinLock(&Context->ReadAheadLock, &OldIrql);
+        Before = Context->ReadAhead.WastedBytes;
+        ReadAhead_Publish(&Context->ReadAhead, Ahead, StartTsc);
+        Wasted += Context->ReadAhead.WastedBytes - Before;
+        KeReleaseSpinLock(&Context->ReadAheadLock, OldIrql);
+    }
+
+    if (pBuffer && Unmap)
+        MmUnmapLockedPages(pBuffer, pMdl);
+    if (pInner && UnmapInner)
+        MmUnmapLockedPages(pInner, pInnerMdl);
+    pExtPacket->pMdl = Ext_FreeInnerMdl(pInnerMdl);
+    Ext_CountReadAhead(Context, 0, Ahead, Wasted);
+    return Decrypted;
+}
+
+/** Drops the read-ahead a write of Length bytes at Offset overlaps */
+static VOID Ext_InvalidateReadAhead(PEXTENSION_CONTEXT Context, ULONG64 Offset, ULONG64 Length)
+{
+    ULONG64 Wasted = 0;
+    KIRQL OldIrql;
+
+    if (!Context->pReadAheadBuffer)
+        return;
+    KeAcquireSpinLock(&Context->ReadAheadLock, &OldIrql);
+    Wasted = Context->ReadAhead.WastedBytes;
+    ReadAhead_Invalidate(&Context->ReadAhead, Offset, Length, ReadTimeStampCounter());
+    Wasted = Context->ReadAhead.WastedBytes - Wasted;
+    KeReleaseSpinLock(&Context->ReadAheadLock, OldIrql);
+    Ext_CountReadAhead(Context, 0, 0, Wasted);
+}
+
+/** Learns the size of the disk from a READ CAPACITY response, read-ahead stops at its end */
+static VOID Ext_LearnCapacity(PEXTENSION_CONTEXT Context, PSCSI_REQUEST_BLOCK Srb)
+{
+    const UCHAR *pData = Srb->DataBuffer;
+    ULONG64 LastLba = 0;
+    ULONG BlockLength = 0;
+
+    if (!pData || SRB_STATUS(Srb->SrbStatus) != SRB_STATUS_SUCCESS || SCSISTAT_GOOD != Srb->ScsiStatus)
+        return;
+    if (SCSI_OP_CODE_READ_CAPACITY_10 == Srb->Cdb[0] && Srb->DataTransferLength >= 8)
+    {
+        LastLba = RtlUlongByteSwap(*(ULONG UNALIGNED *)&pData[0]);
+        BlockLength = RtlUlongByteSwap(*(ULONG UNALIGNED *)&pData[4]);
+        // Larger disks answer READ CAPACITY 16
+        if (0xFFFFFFFF == LastLba)
+            return;
+    }
+    else if (SCSI_OP_CODE_READ_CAPACITY_16 == Srb->Cdb[0] && 0x10 == (Srb->Cdb[1] & 0x1F) && Srb->DataTransferLength >= 12)
+    {
+        LastLba = RtlUlonglongByteSwap(*(ULONG64 UNALIGNED *)&pData[0]);
+        BlockLength = RtlUlongByteSwap(*(ULONG UNALIGNED *)&pData[8]);
+    }
+    else
+        return;
+    // The offsets of the requests are computed in EXT_SECTOR_SIZE blocks
+    InterlockedExchange64(&Context->CapacityBytes, EXT_SECTOR_SIZE == BlockLength ? (LONG64)((LastLba + 1) * EXT_SECTOR_SIZE) : 0);
+}
+
+/** Drops the cached blocks a request changes, called when it starts and when it completes */
+static VOID Ext_InvalidateReadCache(PEXTENSION_CONTEXT Context, PSCSI_REQUEST_BLOCK Srb)
+{
+    switch (Srb->Cdb[0])
+    {
+    case SCSI_OP_CODE_WRITE_6:
+    case SCSI_OP_CODE_WRITE_10:
+    case SCSI_OP_CODE_WRITE_12:
+    case SCSI_OP_CODE_WRITE_16:
+        // Blocks shared with the other clones stay, the disk reads its own from now on
+        if (Context->pOverlay)
+            ParentOverlay_Add(Context->pOverlay, Ext_GetCdbLba(Srb->Cdb) * EXT_SECTOR_SIZE, Srb->DataTransferLength);
+        ReadCache_Invalidate(Context->CacheDisk, Ext_GetCdbLba(Srb->Cdb) * EXT_SECTOR_SIZE, Srb->DataTransferLength);
+        Ext_InvalidateReadAhead(Context, Ext_GetCdbLba(Srb->Cdb) * EXT_SECTOR_SIZE, Srb->DataTransferLength);
+        break;
+    case SCSI_OP_CODE_FORMAT:
+    case SCSI_OP_CODE_WRITE_AND_VERIFY_10:
+    case SCSI_OP_CODE_WRITE_AND_VERIFY_12:
+    case SCSI_OP_CODE_WRITE_AND_VERIFY_16:
+    case SCSI_OP_CODE_WRITE_LONG_10:
+    case SCSI_OP_CODE_WRITE_LONG_16:
+    case SCSI_OP_CODE_WRITE_SAME_10:
+    case SCSI_OP_CODE_WRITE_SAME_16:
+    case SCSI_OP_CODE_UNMAP:
+    case SCSI_OP_CODE_XDWRITE_10:
+    case SCSI_OP_CODE_XDWRITEREAD_10:
+    case SCSI_OP_CODE_XDWRITE_EXTENDED_16:
+    case SCSI_OP_CODE_COMPARE_AND_WRITE:
+    case SCSI_OP_CODE_ORWRITE:
+        // Rare, and their ranges are not in the CDB alone
+        if (Context->pOverlay)
+            ParentOverlay_SetFull(Context->pOverlay);
+        ReadCache_DropDisk(Context->CacheDisk);
+        Ext_InvalidateReadAhead(Context, 0, MAXLONG64);
+        break;
+    }
+}
+
+/** Answers a cacheable command from the response cache, or counts it as sent to vhdmp. TRUE if it was answered */
+static BOOLEAN Ext_AnswerFromCache(PEXTENSION_CONTEXT Context, PSCSI_REQUEST_BLOCK Srb)
+{
+    const SCSI_CACHE_ENTRY *pEntry = NULL;
+    KIRQL OldIrql;
+
+    KeAcquireSpinLock(&Context->ResponseLock, &OldIrql);
+    // Data of other commands is not mapped by the parser, they are sent and counted like a miss
+    if (!Srb->DataTransferLength || Srb->DataBuffer)
+        pEntry = ScsiCache_Find(&Context->Responses, Srb->Cdb, Srb->CdbLength, Srb->DataTransferLength);
+    if (pEntry)
+    {
+        if (pEntry->DataLength)
+            memmove(Srb->DataBuffer, pEntry->Data, pEntry->DataLength);
+        Srb->DataTransferLength = pEntry->DataLength;
+        Srb->SrbStatus = pEntry->SrbStatus;
+        Srb->ScsiStatus = SCSISTAT_GOOD;
+        Srb->SenseInfoBufferLength = pEntry->SenseLength;
+    }
+    else
+        ScsiCache_Sent(&Context->Responses);
+    KeReleaseSpinLock(&Context->ResponseLock, OldIrql);
+
+    if (Context->pStats)
+    {
+        DISK_COUNTERS *pCounters = DiskStats_Counters(Context->pStats);
+        if (pEntry)
+            ++pCounters->ResponseHits;
+        else
+            ++pCounters->ResponseMisses;
+    }
+    return NULL != pEntry;
+}
+
+/** Rewrites the block limits page and READ CAPACITY 16 data so the guest issues 4 KiB aligned transfers */
+static VOID Ext_AdvertisePhysicalSectors(PSCSI_REQUEST_BLOCK Srb)
+{
+    const ULONG Granularity = EXT_PHYSICAL_SECTOR_SIZE / EXT_SECTOR_SIZE;
+    UCHAR *pData = Srb->DataBuffer;
+    ULONG Length = Srb->DataTransferLength;
+    UCHAR SrbStatus = SRB_STATUS(Srb->SrbStatus);
+
+    if (!pData || (SRB_STATUS_SUCCESS != SrbStatus && SRB_STATUS_DATA_OVERRUN != SrbStatus) ||
+        SCSISTAT_GOOD != Srb->ScsiStatus)
+        return;
+    if (SCSI_OP_CODE_INQUIRY == Srb->Cdb[0] && (Srb->Cdb[1] & 1) && 0xB0 == Srb->Cdb[2] && Length >= 16 &&
+        0xB0 == pData[1])
+    {
+        // Granularity and optimal transfer length are in logical blocks, the maximum 0 means no limit
+        ULONG Current = RtlUshortByteSwap(*(USHORT UNALIGNED *)&pData[6]);
+        ULONG Maximum = RtlUlongByteSwap(*(ULONG UNALIGNED *)&pData[8]);
+        ULONG Optimal = RtlUlongByteSwap(*(ULONG UNALIGNED *)&pData[12]);
+
+        if (Current < Granularity || Current % Granularity)
+            Current = Granularity;
+        Optimal = max(Optimal, EXT_OPTIMAL_TRANSFER_SIZE / EXT_SECTOR_SIZE);
+        Optimal = (Optimal + Current - 1) / Current * Current;
+        if (Maximum && Optimal > Maximum)
+            Optimal = Maximum >= Current ? Maximum / Current * Current : Maximum;
+        *(USHORT UNALIGNED *)&pData[6] = RtlUshortByteSwap((USHORT)Current);
+        *(ULONG UNALIGNED *)&pData[12] = RtlUlongByteSwap(Optimal);
+    }
+    else if (SCSI_OP_CODE_READ_CAPACITY_16 == Srb->Cdb[0] && 0x10 == (Srb->Cdb[1] & 0x1F) && Length >= 14)
+    {
+        ULONG BlockLength = RtlUlongByteSwap(*(ULONG UNALIGNED *)&pData[8]);
+        UCHAR Exponent = 0;
+
+        while (BlockLength && (BlockLength << Exponent) < EXT_PHYSICAL_SECTOR_SIZE)
+            ++Exponent;
+        if (BlockLength && (pData[13] & 0xF) < Exponent)
+        {
+            // Logical blocks per physical block exponent, the first physical block starts at LBA 0
+            pData[13] = (pData[13] & 0xF0) | Exponent;
+            if (Length >= 16)
+            {
+                pData[14] &= 0xC0;
+                pData[15] = 0;
+            }
+        }
+    }
+}
+
+/** Keeps the response of a cacheable command, or drops the kept responses if the command changed the disk */
+static VOID Ext_CompleteForCache(PEXTENSION_CONTEXT Context, PSCSI_REQUEST_BLOCK Srb, ULONG RequestLength, NTSTATUS Status)
+{
+    BOOLEAN Cacheable = ScsiCache_IsCacheable(Srb->Cdb, Srb->CdbLength);
+    UCHAR SrbStatus = SRB_STATUS(Srb->SrbStatus);
+    KIRQL OldIrql;
+
+    if (!Cacheable && !ScsiCache_Invalidates(Srb->Cdb, Srb->ScsiStatus))
+        return;
+    KeAcquireSpinLock(&Context->ResponseLock, &OldIrql);
+    if (ScsiCache_Invalidates(Srb->Cdb, Srb->ScsiStatus))
+        ScsiCache_Invalidate(&Context->Responses);
+    if (Cacheable)
+        // Short transfers complete with SRB_STATUS_DATA_OVERRUN
+        ScsiCache_Complete(&Context->Responses, Srb->Cdb, Srb->CdbLength, RequestLength, SrbStatus, Srb->ScsiStatus, Srb->SenseInfoBufferLength, Srb->DataBuffer, Srb->DataTransferLength,
+            NT_SUCCESS(Status) && (SRB_STATUS_SUCCESS == SrbStatus || SRB_STATUS_DATA_OVERRUN == SrbStatus));
+    KeReleaseSpinLock(&Context->ResponseLock, OldIrql);
+}
+
 NTSTATUS Ext_StartScsiRequest(_In_ PVOID ExtContext, _In_ PEVHD_EXT_SCSI_PACKET pExtPacket)
 {
-    UNREFERENCED_PARAMETER(ExtContext);
-    UNREFERENCED_PARAMETER(pExtPacket);
     NTSTATUS Status = STATUS_SUCCESS;
     UCHAR opCode = pExtPacket->Srb->Cdb[0];
     PMDL pMdl = pExtPacket->pMdl;
@@ -221,6 +1055,35 @@ NTSTATUS Ext_StartScsiRequest(_In_ PVOID ExtContext, _In_ PEVHD_EXT_SCSI_PACKET
     PEXTENSION_CONTEXT Context = ExtContext;
     USHORT wSectors = RtlUshortByteSwap(*(USHORT *)&(pExtPacket->Srb->Cdb[7]));
     ULONG dwSectorOffset = RtlUlongByteSwap(*(ULONG *)&(pExtPacket->Srb->Cdb[2]));
+    Ext_CountStart(Context, pExtPacket->Srb, pExtPacket->pTiming);
+    if (ScsiCache_IsCacheable(pExtPacket->Srb->Cdb, pExtPacket->Srb->CdbLength) &&
+        Ext_AnswerFromCache(Context, pExtPacket->Srb))
+    {
+        Ext_CountComplete(Context, pExtPacket->Srb, STATUS_SUCCESS);
+        return STATUS_ALREADY_COMPLETE;
+    }
+    if (Context->pCipherEngine)
+    {
+        ULONG Ahead = 0;
+        if (!Ext_IsDataUnitAligned(Context, pExtPacket->Srb))
+        {
+            EXTLOG(LL_WARNING, "Request 0x%X of 0x%X bytes is not aligned to the data unit\n", opCode,
+                pExtPacket->Srb->DataTransferLength);
+            Ext_FailRequest(pExtPacket->Srb, EXT_SENSE_ILLEGAL_REQUEST, EXT_ASC_INVALID_FIELD_IN_CDB);
+            Ext_CountComplete(Context, pExtPacket->Srb, STATUS_INVALID_PARAMETER);
+            return STATUS_ALREADY_COMPLETE;
+        }
+        if ((Context->pReadAheadBuffer && Ext_ReadFromReadAhead(Context, pExtPacket, &Ahead)) ||
+            (ReadCache_Enabled() && Ext_ReadFromCache(Context, pExtPacket)))
+        {
+            Ext_CountComplete(Context, pExtPacket->Srb, STATUS_SUCCESS);
+            return STATUS_ALREADY_COMPLETE;
+        }
+        // Extended only once the read cache missed, the read goes to vhdmp
+        if (Ahead)
+            Ext_SendReadAhead(Context, pExtPacket, Ahead);
+        Ext_InvalidateReadCache(Context, pExtPacket->Srb);
+    }
     switch (opCode)
     {
     case SCSI_OP_CODE_WRITE_6:
@@ -232,8 +1095,24 @@ NTSTATUS Ext_StartScsiRequest(_In_ PVOID ExtContext, _In_ PEVHD_EXT_SCSI_PACKET
             EXTLOG(LL_VERBOSE, "Write request: %X blocks starting from %X\n", wSectors, dwSectorOffset);
 
             pExtPacket->pMdl = Ext_AllocateInnerMdl(pMdl);
+            if (Context->pStats)
+            {
+                DISK_COUNTERS *pCounters = DiskStats_Counters(Context->pStats);
+                if (pExtPacket->pMdl)
+                    ++pCounters->BounceAllocations;
+                else
+                    ++pCounters->BounceFailures;
+            }
+            if (!pExtPacket->pMdl)
+            {
+                EXTLOG(LL_ERROR, "Could not allocate 0x%X bytes for the encrypted data", pMdl->ByteCount);
+                pExtPacket->pMdl = pMdl;
+                Status = STATUS_INSUFFICIENT_RESOURCES;
+                break;
+            }
 
-            Status = Ext_CryptBlocks(Context, pMdl, pExtPacket->pMdl, pExtPacket->Srb->DataTransferLength, dwSectorOffset, TRUE);
+            Status = Ext_CryptCounted(Context, pExtPacket->pTiming, pMdl, pExtPacket->pMdl,
+                pExtPacket->Srb->DataTransferLength, dwSectorOffset, TRUE);
 
             pMdl = pExtPacket->pMdl;
 
@@ -260,9 +1139,23 @@ NTSTATUS Ext_CompleteScsiRequest(_In_ PVOID ExtContext, _In_ PEVHD_EXT_SCSI_PACK
     PMDL pMdl = pExtPacket->pMdl;
 
     PEXTENSION_CONTEXT Context = ExtContext;
+    ULONG Ahead = 0;
+    // Before anything reads the CDB or the transfer length
+    BOOLEAN ReadAhead = Ext_TrimReadAhead(Context, pExtPacket, &Ahead);
     USHORT wSectors = RtlUshortByteSwap(*(USHORT *)&(pExtPacket->Srb->Cdb[7]));
     ULONG dwSectorOffset = RtlUlongByteSwap(*(ULONG *)&(pExtPacket->Srb->Cdb[2]));
+    ULONG64 StartTsc = Ext_CountComplete(Context, pExtPacket->Srb, Status);
+    BOOLEAN Decrypted = FALSE;
 
+    // Rewritten before the response cache keeps it, answers from the cache are rewritten already
+    if (Context->bAdvertise4K && NT_SUCCESS(Status))
+        Ext_AdvertisePhysicalSectors(pExtPacket->Srb);
+    Ext_CompleteForCache(Context, pExtPacket->Srb, pExtPacket->RequestLength, Status);
+    if (Context->pReadAheadBuffer && NT_SUCCESS(Status))
+        Ext_LearnCapacity(Context, pExtPacket->Srb);
+    // Reads that started while the request was in flight do not fill what it changed
+    if (Context->pCipherEngine)
+        Ext_InvalidateReadCache(Context, pExtPacket->Srb);
     switch (opCode)
     {
     case SCSI_OP_CODE_READ_6:
@@ -273,8 +1166,19 @@ NTSTATUS Ext_CompleteScsiRequest(_In_ PVOID ExtContext, _In_ PEVHD_EXT_SCSI_PACK
         {
             EXTLOG(LL_VERBOSE, "Read request completed: %X blocks starting from %X\n",
                 wSectors, dwSectorOffset);
-            if (NT_SUCCESS(Status)) {
-                Ext_CryptBlocks(Context, pMdl, pMdl, pExtPacket->Srb->DataTransferLength, dwSectorOffset, FALSE);
+            if (ReadAhead)
+                Decrypted = Ext_KeepReadAhead(Context, pExtPacket, Status, Ahead, dwSectorOffset, StartTsc);
+            else
+                Decrypted = NT_SUCCESS(Status) && NT_SUCCESS(Ext_CryptCounted(Context, pExtPacket->pTiming, pMdl, pMdl,
+                    pExtPacket->Srb->DataTransferLength, dwSectorOffset, FALSE));
+            if (Decrypted && ReadCache_Enabled())
+                Ext_FillReadCache(Context, pExtPacket->Srb, pExtPacket->pMdl, StartTsc);
+            // Ciphertext never reaches the guest as the data of a successful read
+            if (NT_SUCCESS(Status) && !Decrypted)
+            {
+                EXTLOG(LL_ERROR, "Read of %X blocks starting from %X could not be decrypted\n", wSectors, dwSectorOffset);
+                Ext_FailRequest(pExtPacket->Srb, EXT_SENSE_MEDIUM_ERROR, EXT_ASC_UNRECOVERED_READ_ERROR);
+                Status = STATUS_DEVICE_DATA_ERROR;
             }
         }
         break;
@@ -287,9 +1191,66 @@ NTSTATUS Ext_CompleteScsiRequest(_In_ PVOID ExtContext, _In_ PEVHD_EXT_SCSI_PACK
             EXTLOG(LL_VERBOSE, "Write request completed: %X blocks starting from %X\n",
                 wSectors, dwSectorOffset);
 
-            pExtPacket->pMdl = Ext_FreeInnerMdl(pExtPacket->pMdl);
+            // The inner MDL is missing if its allocation failed when the request started
+            if (pExtPacket->pMdl->Next)
+                pExtPacket->pMdl = Ext_FreeInnerMdl(pExtPacket->pMdl);
         }
         break;
     }
     return Status;
 }
+
+BOOLEAN Ext_IsPassThrough(_In_ PVOID ExtContext)
+{
+    return !((PEXTENSION_CONTEXT)ExtContext)->pCipherEngine;
+}
+
+NTSTATUS Ext_StartPlainRequest(_In_ PVOID ExtContext, _In_ PSCSI_REQUEST_BLOCK Srb, _In_opt_ SRB_TIMING *pTiming)
+{
+    Ext_CountStart(ExtContext, Srb, pTiming);
+    if (ScsiCache_IsCacheable(Srb->Cdb, Srb->CdbLength) && Ext_AnswerFromCache(ExtContext, Srb))
+    {
+        Ext_CountComplete(ExtContext, Srb, STATUS_SUCCESS);
+        return STATUS_ALREADY_COMPLETE;
+    }
+    return STATUS_SUCCESS;
+}
+
+VOID Ext_CompletePlainRequest(_In_ PVOID ExtContext, _In_ PSCSI_REQUEST_BLOCK Srb, _In_ ULONG RequestLength,
+    _In_ NTSTATUS Status)
+{
+    Ext_CountComplete(ExtContext, Srb, Status);
+    if (((PEXTENSION_CONTEXT)ExtContext)->bAdvertise4K && NT_SUCCESS(Status))
+        Ext_AdvertisePhysicalSectors(Srb);
+    Ext_CompleteForCache(ExtContext, Srb, RequestLength, Status);
+}
+
+VOID Ext_InvalidateResponses(_In_ PVOID ExtContext)
+{
+    PEXTENSION_CONTEXT Context = ExtContext;
+    KIRQL OldIrql;
+
+    KeAcquireSpinLock(&Context->ResponseLock, &OldIrql);
+    ScsiCache_Invalidate(&Context->Responses);
+    KeReleaseSpinLock(&Context->ResponseLock, OldIrql);
+    // Learned again from the next READ CAPACITY, the disk may have been resized
+    InterlockedExchange64(&Context->CapacityBytes, 0);
+}
+
+ULONG Ext_TimingSize()
+{
+    return DiskStats_StageTimingEnabled() ? sizeof(SRB_TIMING) : 0;
+}
+
+VOID Ext_CompleteTiming(_In_ PVOID ExtContext, _In_ SRB_TIMING *pTiming)
+{
+    PEXTENSION_CONTEXT Context = ExtContext;
+    if (Context->pStats && Context->pStats->pStages)
+        SrbTiming_Aggregate(DiskStats_Stages(Context->pStats), pTiming);
+}
+
+VOID Ext_RecordControl(_In_opt_ PVOID ExtContext, _In_ const CTL_TIMING *pTiming, ULONG First, ULONG Last)
+{
+    PEXTENSION_CONTEXT Context = ExtContext;
+    DiskStats_RecordControl(Context ? Context->pStats : NULL, pTiming, First, Last);
+}
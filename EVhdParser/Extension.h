@@ -1,5 +1,6 @@
 #pragma once  
 #include <srb.h>
+#include "ControlTiming.h"
 
 typedef struct _EVHD_EXT_CAPABILITIES {
 	SIZE_T StateSize;
@@ -18,6 +19,17 @@ typedef struct _EVHD_EXT_SCSI_PACKET {
     /** Length of the sense buffer
     */
     SIZE_T SenseBufferLength;
+    /** Stage timestamps of the request, NULL if it is not timed
+    */
+    SRB_TIMING *pTiming;
+    /** Transfer length the guest asked for, set for completions. Srb->DataTransferLength holds the
+     * length transferred by then
+    */
+    ULONG RequestLength;
+    /** Set by the extension for a read it sent with a read-ahead after it, FALSE from the parser. The
+     * extension remembers the read in flight and sets it again on its completion
+    */
+    BOOLEAN bReadAheadSent;
 } EVHD_EXT_SCSI_PACKET, *PEVHD_EXT_SCSI_PACKET;
 
 #define EVHD_MOUNT_FLAG_SHARED_ACCESS
@@ -45,6 +57,18 @@ NTSTATUS Ext_Create(_In_ PCUNICODE_STRING DiskPath,
     _In_ PGUID DiskId,
     _Outptr_opt_result_maybenull_ PVOID *DiskContext);
 
+/**
+
+ Ext_SetParent
+
+ Routine Description:
+	This function is called after Ext_Create for a differencing disk, the blocks it reads from
+	its parent may be shared with the other clones of the parent once it is mounted
+ Arguments:
+	ParentId - Linkage identifier of the parent
+*/
+VOID Ext_SetParent(_In_ PVOID DiskContext, _In_ PGUID ParentId);
+
 /**
 
  Ext_Delete
@@ -102,7 +126,12 @@ NTSTATUS Ext_Restore(_In_ PVOID ExtContext, PVOID RestoreBuffer, SIZE_T RestoreB
  Ext_StartScsiRequest
 
  Routine Description:
-	This function is called to filter all SCSI commands
+	This function is called to filter all SCSI commands. STATUS_ALREADY_COMPLETE means the command was
+	answered from the response cache of the disk, or failed with sense data if it does not cover whole data
+	units of the cipher, the parser completes it without sending it to vhdmp and without calling
+	Ext_CompleteScsiRequest. Otherwise pMdl, the transfer length in the CDB and
+	Srb->DataTransferLength may be changed, a sequential read is extended with a read-ahead, and the parser
+	sends the request as it is returned
 */
 NTSTATUS Ext_StartScsiRequest(_In_ PVOID ExtContext, _In_ PEVHD_EXT_SCSI_PACKET pExtPacket);
 
@@ -110,6 +139,82 @@ NTSTATUS Ext_StartScsiRequest(_In_ PVOID ExtContext, _In_ PEVHD_EXT_SCSI_PACKET
  Ext_CompleteScsiRequest
 
  Routine Description:
-	 	
+	Restores what Ext_StartScsiRequest changed, the parser takes pMdl and Srb->DataTransferLength for
+	the guest from the packet after the call. A read that completed but could not be decrypted is failed
+	with sense data and an error is returned, the parser then takes the status of the guest from Srb too
 */
 NTSTATUS Ext_CompleteScsiRequest(_In_ PVOID ExtContext, _In_ PEVHD_EXT_SCSI_PACKET pExtPacket, _In_ NTSTATUS Status);
+
+/**
+ Ext_IsPassThrough
+
+ Routine Description:
+	Returns TRUE if the mounted disk has no cipher, its data passes unchanged. The parser then hands its
+	requests to Ext_StartPlainRequest and Ext_CompletePlainRequest without building an EVHD_EXT_SCSI_PACKET
+*/
+BOOLEAN Ext_IsPassThrough(_In_ PVOID ExtContext);
+
+/**
+ Ext_StartPlainRequest
+
+ Routine Description:
+	This function is called instead of Ext_StartScsiRequest for the requests of a pass-through disk,
+	it counts the request and answers it from the response cache like Ext_StartScsiRequest
+*/
+NTSTATUS Ext_StartPlainRequest(_In_ PVOID ExtContext, _In_ PSCSI_REQUEST_BLOCK Srb, _In_opt_ SRB_TIMING *pTiming);
+
+/**
+ Ext_CompletePlainRequest
+
+ Routine Description:
+	This function is called instead of Ext_CompleteScsiRequest for the requests of a pass-through disk
+ Arguments:
+	RequestLength - Transfer length the guest asked for
+*/
+VOID Ext_CompletePlainRequest(_In_ PVOID ExtContext, _In_ PSCSI_REQUEST_BLOCK Srb, _In_ ULONG RequestLength,
+	_In_ NTSTATUS Status);
+
+/**
+ Ext_InvalidateResponses
+
+ Routine Description:
+	Drops the responses kept for the idempotent SCSI commands of a disk. The parser calls it when
+	the disk is resized or its medium changes, Ext_Dismount calls it as well
+*/
+VOID Ext_InvalidateResponses(_In_ PVOID ExtContext);
+
+/**
+ Ext_TimingSize
+
+ Routine Description:
+	Returns the bytes the parser reserves in the inner buffer of every request of a disk mounted now
+	for its stage timestamps, 0 if stage timing is disabled
+*/
+ULONG Ext_TimingSize();
+
+/**
+ Ext_CompleteTiming
+
+ Routine Description:
+	This function is called right before a timed request is handed back to storage VSP,
+	it adds the stages of the request to the statistics of the disk
+*/
+VOID Ext_CompleteTiming(_In_ PVOID ExtContext, _In_ SRB_TIMING *pTiming);
+
+/**
+ Ext_RecordControl
+
+ Routine Description:
+	This function is called after an open, mount, dismount or close of a disk to count the
+	time spent in the phases First to Last of the operation
+ Arguments:
+	ExtContext - The extension context of the disk, NULL if the disk has no context (any more)
+*/
+VOID Ext_RecordControl(_In_opt_ PVOID ExtContext, _In_ const CTL_TIMING *pTiming, ULONG First, ULONG Last);
+
+/** Records when a request reached a stage */
+static __inline VOID Ext_StampRequest(_In_opt_ SRB_TIMING *pTiming, ULONG Stamp)
+{
+	if (pTiming)
+		pTiming->Tsc[Stamp] = ReadTimeStampCounter();
+}
@@ -0,0 +1,131 @@
+#pragma once
+/*
+ * Flight recorder: a fixed ring of compact binary events per processor that is
+ * always recording and silently overwrites its oldest events. Recording an
+ * event claims a position with an interlocked increment and fills a 32 byte
+ * slot, nothing is allocated or locked. Plain C, the snapshot returned by
+ * IOCTL_VIRTUAL_DISK_SNAPSHOT_FLIGHT_RECORDER is decoded by evhdtool.
+ *
+ * Snapshot layout: FLIGHT_SNAPSHOT_HEADER, then RingCount times a
+ * FLIGHT_SNAPSHOT_RING followed by EventsPerRing FLIGHT_EVENTs.
+ */
+#include "MessageRing.h"
+
+#define FLIGHT_SNAPSHOT_MAGIC       0x52465645  /* 'EVFR' */
+#define FLIGHT_SNAPSHOT_VERSION     1
+/* Power of two */
+#define FLIGHT_RING_EVENTS          1024
+
+typedef enum _FLIGHT_EVENT_TYPE {
+    FlightEventNone,
+    /* Lba, Length and Status hold the disk id */
+    FlightEventMount,
+    /* Status is the result of the mount or the dismount */
+    FlightEventMountDone,
+    FlightEventDismount,
+    /* Opcode is the first CDB byte, Lba the first block of a read or write and Length the transfer in bytes */
+    FlightEventSrbStart,
+    FlightEventSrbComplete,
+    /* Opcode is the message type */
+    FlightEventKeyRequest,
+    /* Lba is the request id, Length the latency in microseconds and Status STATUS_SUCCESS or STATUS_TIMEOUT */
+    FlightEventKeyResponse,
+    /* Opcode is the log category, Length the log level and Status the source line */
+    FlightEventError,
+    /* Request found stuck by the in-flight scanner, Opcode, Lba and Length as for SrbStart and Status its age in ms */
+    FlightEventSrbStuck,
+    FlightEventTypeMax
+} FLIGHT_EVENT_TYPE;
+
+typedef struct _FLIGHT_EVENT {
+    /* Ring position + 1 once the event is complete, 0 while it is written */
+    volatile ULONG32 Sequence;
+    UCHAR Type;
+    UCHAR Opcode;
+    /* Assigned to a disk when it is mounted, 0 for events not tied to a disk */
+    USHORT DiskTag;
+    ULONG64 Tsc;
+    ULONG64 Lba;
+    ULONG32 Length;
+    ULONG32 Status;
+} FLIGHT_EVENT;
+
+C_ASSERT(sizeof(FLIGHT_EVENT) == 32);
+
+typedef struct _FLIGHT_RING {
+    /* Positions handed out so far, the newest event is at Next - 1 */
+    volatile LONG Next;
+    UCHAR Padding[60];
+    FLIGHT_EVENT Events[FLIGHT_RING_EVENTS];
+} FLIGHT_RING;
+
+/** TSC stamp and the local time, in 100 ns units since 1601, read together */
+typedef struct _FLIGHT_SYNC {
+    ULONG64 Tsc;
+    ULONG64 LocalTime;
+} FLIGHT_SYNC;
+
+typedef struct _FLIGHT_SNAPSHOT_HEADER {
+    ULONG32 Magic;
+    ULONG32 Version;
+    /* Bytes of the whole snapshot, also returned when the buffer is too small for it */
+    ULONG32 TotalSize;
+    ULONG32 RingCount;
+    ULONG32 EventsPerRing;
+    ULONG32 EventSize;
+    /* Taken when the recorder started and when the snapshot was made */
+    FLIGHT_SYNC Sync[2];
+    ULONG64 Reserved;
+} FLIGHT_SNAPSHOT_HEADER;
+
+C_ASSERT(sizeof(FLIGHT_SNAPSHOT_HEADER) == 64);
+
+typedef struct _FLIGHT_SNAPSHOT_RING {
+    ULONG32 Processor;
+    ULONG32 Next;
+} FLIGHT_SNAPSHOT_RING;
+
+C_ASSERT(sizeof(FLIGHT_SNAPSHOT_RING) == 8);
+
+#define FLIGHT_SNAPSHOT_SIZE(RingCount) \
+    (sizeof(FLIGHT_SNAPSHOT_HEADER) + (RingCount) * (sizeof(FLIGHT_SNAPSHOT_RING) + FLIGHT_RING_EVENTS * sizeof(FLIGHT_EVENT)))
+
+/**
+ * Records an event. Stores are not reordered on x86 and x64, so clearing Sequence before the fields and
+ * setting it after them lets a reader detect an event that was overwritten while it copied it.
+ */
+static __inline VOID FlightRing_Record(FLIGHT_RING *pRing, ULONG64 Tsc, UCHAR Type, UCHAR Opcode, USHORT DiskTag,
+    ULONG64 Lba, ULONG32 Length, ULONG32 Status)
+{
+    ULONG32 Pos = (ULONG32)RING_INCREMENT(&pRing->Next) - 1;
+    FLIGHT_EVENT *pEvent = &pRing->Events[Pos & (FLIGHT_RING_EVENTS - 1)];
+
+    pEvent->Sequence = 0;
+    RING_COMPILER_BARRIER();
+    pEvent->Type = Type;
+    pEvent->Opcode = Opcode;
+    pEvent->DiskTag = DiskTag;
+    pEvent->Tsc = Tsc;
+    pEvent->Lba = Lba;
+    pEvent->Length = Length;
+    pEvent->Status = Status;
+    RING_STORE_RELEASE(&pEvent->Sequence, Pos + 1);
+}
+
+/** Copies a ring, events overwritten during the copy are returned with a zero Sequence */
+static __inline ULONG32 FlightRing_Copy(FLIGHT_RING *pRing, FLIGHT_EVENT *pEvents)
+{
+    ULONG32 Next = RING_LOAD_ACQUIRE(&pRing->Next);
+    ULONG32 i = 0;
+
+    for (i = 0; i < FLIGHT_RING_EVENTS; ++i)
+    {
+        ULONG32 Sequence = RING_LOAD_ACQUIRE(&pRing->Events[i].Sequence);
+        memcpy(&pEvents[i], (const VOID *)&pRing->Events[i], sizeof(FLIGHT_EVENT));
+        RING_COMPILER_BARRIER();
+        if (Sequence != RING_LOAD_ACQUIRE(&pRing->Events[i].Sequence))
+            Sequence = 0;
+        pEvents[i].Sequence = Sequence;
+    }
+    return Next;
+}
@@ -0,0 +1,103 @@
+#include "stdafx.h"
+#include "FlightRecorder.h"
+
+static const ULONG FlightAllocationTag = 'RFVE';
+static FLIGHT_RING *FlightRings = NULL;
+static ULONG FlightRingCount = 0;
+static FLIGHT_SYNC FlightStartSync = { 0 };
+static volatile LONG FlightDiskTags = 0;
+
+static VOID Flight_FillSync(_Out_ FLIGHT_SYNC *pSync)
+{
+	LARGE_INTEGER SystemTime, LocalTime;
+
+	pSync->Tsc = ReadTimeStampCounter();
+	KeQuerySystemTime(&SystemTime);
+	ExSystemTimeToLocalTime(&SystemTime, &LocalTime);
+	pSync->LocalTime = LocalTime.QuadPart;
+}
+
+NTSTATUS Flight_Initialize()
+{
+	ULONG Count = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+	FLIGHT_RING *pRings = ExAllocatePoolWithTag(NonPagedPoolNx, Count * sizeof(FLIGHT_RING), FlightAllocationTag);
+
+	if (!pRings)
+		return STATUS_INSUFFICIENT_RESOURCES;
+
+	RtlZeroMemory(pRings, Count * sizeof(FLIGHT_RING));
+	Flight_FillSync(&FlightStartSync);
+	FlightRingCount = Count;
+	FlightRings = pRings;
+	return STATUS_SUCCESS;
+}
+
+VOID Flight_Cleanup()
+{
+	FLIGHT_RING *pRings = FlightRings;
+
+	FlightRings = NULL;
+	FlightRingCount = 0;
+	if (pRings)
+		ExFreePoolWithTag(pRings, FlightAllocationTag);
+}
+
+VOID Flight_Record(UCHAR Type, UCHAR Opcode, USHORT DiskTag, ULONG64 Lba, ULONG32 Length, ULONG32 Status)
+{
+	Flight_RecordAt(ReadTimeStampCounter(), Type, Opcode, DiskTag, Lba, Length, Status);
+}
+
+VOID Flight_RecordAt(ULONG64 Tsc, UCHAR Type, UCHAR Opcode, USHORT DiskTag, ULONG64 Lba, ULONG32 Length, ULONG32 Status)
+{
+	FLIGHT_RING *pRings = FlightRings;
+
+	if (!pRings)
+		return;
+	FlightRing_Record(&pRings[KeGetCurrentProcessorNumberEx(NULL) % FlightRingCount], Tsc,
+		Type, Opcode, DiskTag, Lba, Length, Status);
+}
+
+USHORT Flight_AllocateDiskTag()
+{
+	USHORT Tag = 0;
+	while (!Tag)
+		Tag = (USHORT)InterlockedIncrement(&FlightDiskTags);
+	return Tag;
+}
+
+NTSTATUS Flight_Snapshot(_Out_writes_bytes_(Length) FLIGHT_SNAPSHOT_HEADER *pHeader, ULONG Length, _Out_ ULONG_PTR *pInformation)
+{
+	UCHAR *pOut = (UCHAR *)(pHeader + 1);
+	ULONG Index = 0;
+
+	*pInformation = 0;
+	if (Length < sizeof(FLIGHT_SNAPSHOT_HEADER))
+		return STATUS_BUFFER_TOO_SMALL;
+	if (!FlightRings)
+		return STATUS_DEVICE_NOT_READY;
+
+	RtlZeroMemory(pHeader, sizeof(FLIGHT_SNAPSHOT_HEADER));
+	pHeader->Magic = FLIGHT_SNAPSHOT_MAGIC;
+	pHeader->Version = FLIGHT_SNAPSHOT_VERSION;
+	pHeader->TotalSize = (ULONG32)FLIGHT_SNAPSHOT_SIZE(FlightRingCount);
+	pHeader->RingCount = FlightRingCount;
+	pHeader->EventsPerRing = FLIGHT_RING_EVENTS;
+	pHeader->EventSize = sizeof(FLIGHT_EVENT);
+	pHeader->Sync[0] = FlightStartSync;
+	Flight_FillSync(&pHeader->Sync[1]);
+
+	*pInformation = sizeof(FLIGHT_SNAPSHOT_HEADER);
+	if (Length < pHeader->TotalSize)
+		return STATUS_BUFFER_OVERFLOW;
+
+	for (Index = 0; Index < FlightRingCount; ++Index)
+	{
+		FLIGHT_SNAPSHOT_RING *pRing = (FLIGHT_SNAPSHOT_RING *)pOut;
+		pRing->Processor = Index;
+		pRing->Next = FlightRing_Copy(&FlightRings[Index], (FLIGHT_EVENT *)(pRing + 1));
+		pOut += sizeof(FLIGHT_SNAPSHOT_RING) + FLIGHT_RING_EVENTS * sizeof(FLIGHT_EVENT);
+	}
+
+	*pInformation = pHeader->TotalSize;
+	return STATUS_SUCCESS;
+}
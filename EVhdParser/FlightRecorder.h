@@ -0,0 +1,13 @@
+#pragma once
+#include "Control.h"
+
+NTSTATUS Flight_Initialize();
+/** Nothing may be recording any more */
+VOID Flight_Cleanup();
+/** Records an event in the ring of the current processor, at any IRQL. Does nothing before Flight_Initialize */
+VOID Flight_Record(UCHAR Type, UCHAR Opcode, USHORT DiskTag, ULONG64 Lba, ULONG32 Length, ULONG32 Status);
+/** Records an event stamped with a TSC value the caller already read */
+VOID Flight_RecordAt(ULONG64 Tsc, UCHAR Type, UCHAR Opcode, USHORT DiskTag, ULONG64 Lba, ULONG32 Length, ULONG32 Status);
+/** Tag identifying the events of a disk, never 0 */
+USHORT Flight_AllocateDiskTag();
+NTSTATUS Flight_Snapshot(_Out_writes_bytes_(Length) FLIGHT_SNAPSHOT_HEADER *pHeader, ULONG Length, _Out_ ULONG_PTR *pInformation);
@@ -0,0 +1,239 @@
+#pragma once
+/*
+ * Access heatmap and hot block sketch of a disk. The heatmap counts the reads
+ * and writes starting in every bucket of the disk. Buckets start at 1 MiB and
+ * are merged in pairs whenever a request lands beyond the last one, so a disk
+ * of any size fits in HEAT_BUCKETS counters. The hottest 4 KiB blocks are
+ * found with a count-min sketch: a block whose estimate beats the coldest of
+ * the HEAT_TOP_BLOCKS kept replaces it, listed counts may lag by a few.
+ * Counters are updated with plain stores like the disk counters and may lose
+ * an increment under contention.
+ * Plain C, evhdtool renders and compares the snapshots returned by
+ * IOCTL_VIRTUAL_DISK_SNAPSHOT_HEATMAP.
+ *
+ * Snapshot layout: HEAT_SNAPSHOT_HEADER, BucketCount HEAT_BUCKETs, then
+ * TopCount HEAT_HOT_BLOCKs, hottest first.
+ */
+#include "MessageRing.h"
+
+#define HEAT_SNAPSHOT_MAGIC         0x4D485645  /* 'EVHM' */
+#define HEAT_SNAPSHOT_VERSION       1
+/* Power of two */
+#define HEAT_BUCKETS                16384
+#define HEAT_MIN_BUCKET_SHIFT       20
+#define HEAT_BLOCK_SHIFT            12
+/* Blocks of a request counted in the sketch, the rest of a longer request is not */
+#define HEAT_MAX_REQUEST_BLOCKS     16
+#define HEAT_SKETCH_ROWS            4
+/* Power of two */
+#define HEAT_SKETCH_COLUMNS         4096
+#define HEAT_TOP_BLOCKS             32
+/* Accesses between offers of a block to the full top list, power of two */
+#define HEAT_PROMOTE_STEP           8
+
+typedef struct _HEAT_BUCKET {
+    ULONG32 Reads;
+    ULONG32 Writes;
+} HEAT_BUCKET;
+
+typedef struct _HEAT_HOT_BLOCK {
+    /* Byte offset of the block >> HEAT_BLOCK_SHIFT */
+    ULONG64 Block;
+    /* Accesses estimated by the sketch, never below the real count */
+    ULONG64 Count;
+} HEAT_HOT_BLOCK;
+
+typedef struct _HEAT_MAP {
+    /* Log2 of the bytes per bucket, only grows */
+    volatile LONG BucketShift;
+    ULONG32 TopCount;
+    /* Smallest count of the full top list, 0 while it is not full. Read without the lock */
+    volatile ULONG64 TopFloor;
+    /* Blocks counted in the sketch */
+    ULONG64 Blocks;
+    HEAT_HOT_BLOCK Top[HEAT_TOP_BLOCKS];
+    ULONG32 Sketch[HEAT_SKETCH_ROWS][HEAT_SKETCH_COLUMNS];
+    HEAT_BUCKET Buckets[HEAT_BUCKETS];
+} HEAT_MAP;
+
+typedef struct _HEAT_SNAPSHOT_HEADER {
+    ULONG32 Magic;
+    ULONG32 Version;
+    /* Bytes of the whole snapshot, also returned when the buffer is too small for it */
+    ULONG32 TotalSize;
+    ULONG32 DiskTag;
+    GUID DiskId;
+    GUID ApplicationId;
+    ULONG32 BucketShift;
+    /* Buckets up to the last one accessed */
+    ULONG32 BucketCount;
+    ULONG32 TopCount;
+    ULONG32 Reserved;
+    ULONG64 Blocks;
+    /* Local time the snapshot was taken, in 100 ns units since 1601 */
+    ULONG64 LocalTime;
+} HEAT_SNAPSHOT_HEADER;
+
+C_ASSERT(sizeof(HEAT_SNAPSHOT_HEADER) == 80);
+
+#define HEAT_SNAPSHOT_SIZE(BucketCount, TopCount) \
+    (sizeof(HEAT_SNAPSHOT_HEADER) + (BucketCount) * sizeof(HEAT_BUCKET) + (TopCount) * sizeof(HEAT_HOT_BLOCK))
+
+static __inline VOID HeatMap_Initialize(HEAT_MAP *pMap)
+{
+    memset(pMap, 0, sizeof(HEAT_MAP));
+    pMap->BucketShift = HEAT_MIN_BUCKET_SHIFT;
+}
+
+/** Counts a request in its bucket, returns FALSE if it starts beyond the last bucket and the map has to be folded */
+static __inline BOOLEAN HeatMap_CountBucket(HEAT_MAP *pMap, ULONG64 Offset, BOOLEAN Write)
+{
+    ULONG64 Index = Offset >> pMap->BucketShift;
+
+    if (Index >= HEAT_BUCKETS)
+        return FALSE;
+    if (Write)
+        ++pMap->Buckets[Index].Writes;
+    else
+        ++pMap->Buckets[Index].Reads;
+    return TRUE;
+}
+
+/** Merges buckets in pairs until Offset falls in one. Called under the lock of the map */
+static __inline VOID HeatMap_Fold(HEAT_MAP *pMap, ULONG64 Offset)
+{
+    ULONG32 i = 0;
+
+    while ((Offset >> pMap->BucketShift) >= HEAT_BUCKETS && pMap->BucketShift < 63)
+    {
+        for (i = 0; i < HEAT_BUCKETS / 2; ++i)
+        {
+            pMap->Buckets[i].Reads = pMap->Buckets[2 * i].Reads + pMap->Buckets[2 * i + 1].Reads;
+            pMap->Buckets[i].Writes = pMap->Buckets[2 * i].Writes + pMap->Buckets[2 * i + 1].Writes;
+        }
+        memset(&pMap->Buckets[HEAT_BUCKETS / 2], 0, HEAT_BUCKETS / 2 * sizeof(HEAT_BUCKET));
+        RING_COMPILER_BARRIER();
+        pMap->BucketShift = pMap->BucketShift + 1;
+    }
+}
+
+static __inline ULONG32 HeatSketch_Column(ULONG64 Block, ULONG32 Row)
+{
+    static const ULONG64 Seeds[HEAT_SKETCH_ROWS] = {
+        0x9E3779B97F4A7C15ULL, 0xC2B2AE3D27D4EB4FULL, 0x165667B19E3779F9ULL, 0xD6E8FEB86659FD93ULL };
+    ULONG64 Hash = (Block ^ (Block >> 29)) * Seeds[Row];
+
+    return (ULONG32)(Hash >> 40) & (HEAT_SKETCH_COLUMNS - 1);
+}
+
+/** Counts one access to a block, returns its estimated count */
+static __inline ULONG64 HeatSketch_Count(HEAT_MAP *pMap, ULONG64 Block)
+{
+    ULONG32 Row = 0, Estimate = 0xFFFFFFFF;
+
+    for (Row = 0; Row < HEAT_SKETCH_ROWS; ++Row)
+    {
+        ULONG32 *pCell = &pMap->Sketch[Row][HeatSketch_Column(Block, Row)];
+        ULONG32 Count = ++*pCell;
+        if (Count < Estimate)
+            Estimate = Count;
+    }
+    return Estimate;
+}
+
+/**
+ * Counts the blocks of a request in the sketch. The blocks whose estimate beats the top list floor are returned
+ * in pCandidates, at most HEAT_MAX_REQUEST_BLOCKS of them, to be passed to HeatMap_Promote.
+ */
+static __inline ULONG32 HeatMap_CountBlocks(HEAT_MAP *pMap, ULONG64 Offset, ULONG32 Length,
+    HEAT_HOT_BLOCK *pCandidates)
+{
+    ULONG64 Block = Offset >> HEAT_BLOCK_SHIFT;
+    ULONG64 Last = Length ? (Offset + Length - 1) >> HEAT_BLOCK_SHIFT : Block;
+    ULONG64 Floor = pMap->TopFloor;
+    ULONG32 Counted = 0, Candidates = 0;
+
+    for (; Block <= Last && Counted < HEAT_MAX_REQUEST_BLOCKS; ++Block, ++Counted)
+    {
+        ULONG64 Estimate = HeatSketch_Count(pMap, Block);
+        // Keeps the hot blocks already listed from taking the lock on every access
+        if (Estimate > Floor && (!Floor || !(Estimate & (HEAT_PROMOTE_STEP - 1))))
+        {
+            pCandidates[Candidates].Block = Block;
+            pCandidates[Candidates++].Count = Estimate;
+        }
+    }
+    pMap->Blocks += Counted;
+    return Candidates;
+}
+
+/** Puts a block in the top list if it is not colder than all of it. Called under the lock of the map */
+static __inline VOID HeatMap_Promote(HEAT_MAP *pMap, const HEAT_HOT_BLOCK *pBlock)
+{
+    ULONG32 i = 0, Coldest = 0;
+
+    for (i = 0; i < pMap->TopCount; ++i)
+    {
+        if (pMap->Top[i].Block == pBlock->Block)
+        {
+            if (pMap->Top[i].Count < pBlock->Count)
+                pMap->Top[i].Count = pBlock->Count;
+            break;
+        }
+        if (pMap->Top[i].Count < pMap->Top[Coldest].Count)
+            Coldest = i;
+    }
+    if (i == pMap->TopCount)
+    {
+        if (pMap->TopCount < HEAT_TOP_BLOCKS)
+            pMap->Top[pMap->TopCount++] = *pBlock;
+        else if (pMap->Top[Coldest].Count < pBlock->Count)
+            pMap->Top[Coldest] = *pBlock;
+    }
+
+    if (pMap->TopCount == HEAT_TOP_BLOCKS)
+    {
+        ULONG64 Floor = pMap->Top[0].Count;
+        for (i = 1; i < HEAT_TOP_BLOCKS; ++i)
+        {
+            if (pMap->Top[i].Count < Floor)
+                Floor = pMap->Top[i].Count;
+        }
+        pMap->TopFloor = Floor;
+    }
+}
+
+/**
+ * Fills the part of a snapshot that comes from the map, the caller sets the disk fields. Length must hold the
+ * whole snapshot, its size is returned in TotalSize anyway. Called under the lock of the map.
+ */
+static __inline BOOLEAN HeatMap_Snapshot(HEAT_MAP *pMap, HEAT_SNAPSHOT_HEADER *pHeader, ULONG32 Length)
+{
+    HEAT_BUCKET *pBuckets = (HEAT_BUCKET *)(pHeader + 1);
+    HEAT_HOT_BLOCK *pTop = NULL;
+    ULONG32 Count = HEAT_BUCKETS, i = 0, j = 0;
+
+    while (Count > 0 && !pMap->Buckets[Count - 1].Reads && !pMap->Buckets[Count - 1].Writes)
+        --Count;
+    pHeader->Magic = HEAT_SNAPSHOT_MAGIC;
+    pHeader->Version = HEAT_SNAPSHOT_VERSION;
+    pHeader->TotalSize = (ULONG32)HEAT_SNAPSHOT_SIZE(Count, pMap->TopCount);
+    pHeader->BucketShift = pMap->BucketShift;
+    pHeader->BucketCount = Count;
+    pHeader->TopCount = pMap->TopCount;
+    pHeader->Reserved = 0;
+    pHeader->Blocks = pMap->Blocks;
+    if (Length < pHeader->TotalSize)
+        return FALSE;
+
+    memcpy(pBuckets, pMap->Buckets, Count * sizeof(HEAT_BUCKET));
+    pTop = (HEAT_HOT_BLOCK *)(pBuckets + Count);
+    for (i = 0; i < pMap->TopCount; ++i)
+    {
+        // Insertion sort, hottest first
+        for (j = i; j > 0 && pTop[j - 1].Count < pMap->Top[i].Count; --j)
+            pTop[j] = pTop[j - 1];
+        pTop[j] = pMap->Top[i];
+    }
+    return TRUE;
+}
@@ -0,0 +1,160 @@
+#include "stdafx.h"
+#include "IrpPool.h"
+
+typedef struct _IRP_POOL {
+	KSPIN_LOCK Lock;
+	ULONG Count;
+	PIRP Irps[IRP_POOL_DEPTH];
+} IRP_POOL;
+
+/* Indexed by the stack size */
+static IRP_POOL IrpPools[IRP_POOL_STACK_SIZES + 1];
+static volatile LONG64 IrpPoolCalls = 0;
+static volatile LONG64 IrpPoolAllocated = 0;
+static volatile LONG64 IrpPoolReused = 0;
+static volatile LONG IrpPoolInFlight = 0;
+static volatile LONG IrpPoolMaxInFlight = 0;
+
+VOID IrpPool_Initialize()
+{
+	ULONG i = 0;
+	for (i = 0; i <= IRP_POOL_STACK_SIZES; ++i)
+	{
+		KeInitializeSpinLock(&IrpPools[i].Lock);
+		IrpPools[i].Count = 0;
+	}
+}
+
+VOID IrpPool_Cleanup()
+{
+	ULONG i = 0;
+	for (i = 0; i <= IRP_POOL_STACK_SIZES; ++i)
+	{
+		while (IrpPools[i].Count)
+			IoFreeIrp(IrpPools[i].Irps[--IrpPools[i].Count]);
+	}
+}
+
+PIRP IrpPool_Allocate(_In_ PDEVICE_OBJECT pDeviceObject)
+{
+	CCHAR StackSize = pDeviceObject->StackSize;
+	PIRP pIrp = NULL;
+	KIRQL OldIrql;
+
+	if (StackSize > 0 && StackSize <= IRP_POOL_STACK_SIZES)
+	{
+		IRP_POOL *pPool = &IrpPools[StackSize];
+		KeAcquireSpinLock(&pPool->Lock, &OldIrql);
+		if (pPool->Count)
+			pIrp = pPool->Irps[--pPool->Count];
+		KeReleaseSpinLock(&pPool->Lock, OldIrql);
+	}
+	if (pIrp)
+	{
+		InterlockedIncrement64(&IrpPoolReused);
+		return pIrp;
+	}
+
+	pIrp = IoAllocateIrp(StackSize, FALSE);
+	if (pIrp)
+		InterlockedIncrement64(&IrpPoolAllocated);
+	return pIrp;
+}
+
+VOID IrpPool_Free(_In_ PIRP pIrp)
+{
+	CCHAR StackSize = pIrp->StackCount;
+	KIRQL OldIrql;
+
+	if (StackSize > 0 && StackSize <= IRP_POOL_STACK_SIZES)
+	{
+		IRP_POOL *pPool = &IrpPools[StackSize];
+		IoReuseIrp(pIrp, STATUS_PENDING);
+		KeAcquireSpinLock(&pPool->Lock, &OldIrql);
+		if (pPool->Count < IRP_POOL_DEPTH)
+		{
+			pPool->Irps[pPool->Count++] = pIrp;
+			pIrp = NULL;
+		}
+		KeReleaseSpinLock(&pPool->Lock, OldIrql);
+	}
+	if (pIrp)
+		IoFreeIrp(pIrp);
+}
+
+VOID IrpPool_PrepareIoControl(_In_ PIRP pIrp, _In_ PFILE_OBJECT pFileObject, ULONG ControlCode, _In_opt_ PVOID pSystemBuffer,
+	ULONG InputBufferLength, ULONG OutputBufferLength)
+{
+	PIO_STACK_LOCATION pStackFrame = IoGetNextIrpStackLocation(pIrp);
+
+	pIrp->Flags |= IRP_NOCACHE;
+	pIrp->Tail.Overlay.Thread = PsGetCurrentThread();
+	pIrp->AssociatedIrp.SystemBuffer = pSystemBuffer;				// IO buffer for buffered control code
+	pIrp->RequestorMode = KernelMode;
+	pStackFrame->FileObject = pFileObject;
+	pStackFrame->DeviceObject = IoGetRelatedDeviceObject(pFileObject);
+	pStackFrame->Parameters.DeviceIoControl.IoControlCode = ControlCode;
+	pStackFrame->Parameters.DeviceIoControl.InputBufferLength = InputBufferLength;
+	pStackFrame->Parameters.DeviceIoControl.OutputBufferLength = OutputBufferLength;
+	pStackFrame->MajorFunction = IRP_MJ_DEVICE_CONTROL;
+	pStackFrame->MinorFunction = 0;
+	pStackFrame->Flags = 0;
+}
+
+static NTSTATUS IrpPool_SendCompletionRoutine(PDEVICE_OBJECT DeviceObject, PIRP pIrp, PVOID pContext)
+{
+	UNREFERENCED_PARAMETER(DeviceObject);
+	UNREFERENCED_PARAMETER(pIrp);
+	InterlockedDecrement(&IrpPoolInFlight);
+	KeSetEvent((PKEVENT)pContext, IO_NO_INCREMENT, FALSE);
+	return STATUS_MORE_PROCESSING_REQUIRED;
+}
+
+VOID IrpPool_Send(_In_ PIRP pIrp, _In_ PKEVENT pEvent)
+{
+	PIO_STACK_LOCATION pStackFrame = IoGetNextIrpStackLocation(pIrp);
+	LONG InFlight = InterlockedIncrement(&IrpPoolInFlight), Max = IrpPoolMaxInFlight;
+
+	while (InFlight > Max)
+	{
+		LONG Seen = InterlockedCompareExchange(&IrpPoolMaxInFlight, InFlight, Max);
+		if (Seen == Max)
+			break;
+		Max = Seen;
+	}
+	InterlockedIncrement64(&IrpPoolCalls);
+
+	KeInitializeEvent(pEvent, NotificationEvent, FALSE);
+	pStackFrame->Control = SL_INVOKE_ON_CANCEL | SL_INVOKE_ON_SUCCESS | SL_INVOKE_ON_ERROR;
+	pStackFrame->Context = pEvent;
+	pStackFrame->CompletionRoutine = IrpPool_SendCompletionRoutine;
+	IoCallDriver(pStackFrame->DeviceObject, pIrp);
+}
+
+NTSTATUS IrpPool_Call(_In_ PFILE_OBJECT pFileObject, ULONG ControlCode, _In_opt_ PVOID pSystemBuffer,
+	ULONG InputBufferLength, ULONG OutputBufferLength, _Out_opt_ PULONG_PTR pInformation)
+{
+	NTSTATUS status = STATUS_SUCCESS;
+	KEVENT Event;
+	PIRP pIrp = IrpPool_Allocate(IoGetRelatedDeviceObject(pFileObject));
+
+	if (!pIrp)
+		return STATUS_INSUFFICIENT_RESOURCES;
+	IrpPool_PrepareIoControl(pIrp, pFileObject, ControlCode, pSystemBuffer, InputBufferLength, OutputBufferLength);
+	IrpPool_Send(pIrp, &Event);
+	KeWaitForSingleObject(&Event, Executive, KernelMode, FALSE, NULL);
+	status = pIrp->IoStatus.Status;
+	if (pInformation)
+		*pInformation = pIrp->IoStatus.Information;
+	IrpPool_Free(pIrp);
+	return status;
+}
+
+VOID IrpPool_QueryStats(_Out_ CONTROL_IRP_STATS *pStats)
+{
+	pStats->Calls = IrpPoolCalls;
+	pStats->Allocated = IrpPoolAllocated;
+	pStats->Reused = IrpPoolReused;
+	pStats->InFlight = IrpPoolInFlight;
+	pStats->MaxInFlight = IrpPoolMaxInFlight;
+}
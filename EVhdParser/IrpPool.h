@@ -0,0 +1,34 @@
+#pragma once
+#include <ntifs.h>
+#include "Control.h"
+
+/*
+ * Driver wide pools of free IRPs, one per device stack size. Control requests to vhdmp take an IRP from the
+ * pool of their device and give it back with IoReuseIrp instead of allocating one per request, and any number
+ * of them may be in flight at once.
+ */
+
+/* Stack sizes with a pool, IRPs for deeper device stacks are allocated for every request */
+#define IRP_POOL_STACK_SIZES    16
+/* Free IRPs kept for each stack size */
+#define IRP_POOL_DEPTH          8
+
+VOID IrpPool_Initialize();
+/** Frees the pooled IRPs, every IRP must have been given back */
+VOID IrpPool_Cleanup();
+/** Takes a free IRP for the stack size of the device or allocates one, NULL if that fails */
+PIRP IrpPool_Allocate(_In_ PDEVICE_OBJECT pDeviceObject);
+/** Gives an IRP back to the pool of its stack size, or frees it if that pool is full */
+VOID IrpPool_Free(_In_ PIRP pIrp);
+/**
+ * Fills the next stack location of an IRP for a buffered control request to the file object. pSystemBuffer holds
+ * the input and receives the output, it must be resident while the request is in flight.
+ */
+VOID IrpPool_PrepareIoControl(_In_ PIRP pIrp, _In_ PFILE_OBJECT pFileObject, ULONG ControlCode, _In_opt_ PVOID pSystemBuffer,
+	ULONG InputBufferLength, ULONG OutputBufferLength);
+/** Sends a prepared IRP and counts it in flight, pEvent is set on completion and the IRP stays the caller's */
+VOID IrpPool_Send(_In_ PIRP pIrp, _In_ PKEVENT pEvent);
+/** Sends a buffered control request with a pooled IRP and waits for it */
+NTSTATUS IrpPool_Call(_In_ PFILE_OBJECT pFileObject, ULONG ControlCode, _In_opt_ PVOID pSystemBuffer,
+	ULONG InputBufferLength, ULONG OutputBufferLength, _Out_opt_ PULONG_PTR pInformation);
+VOID IrpPool_QueryStats(_Out_ CONTROL_IRP_STATS *pStats);
@@ -14,19 +14,29 @@ LOG_SETTINGS LogSettings = {
 	.LogLevel = LL_MAX,
 	.LogCategories = LOG_CTG_DEFAULT,
 	.MaxFileSize = MINIMUM_ROTATION_SIZE,
-	.MaxKeptRotatedFiles = 5
+	.MaxKeptRotatedFiles = 5,
+	.Backend = LOG_BACKEND_TEXT
 };
 static PWSTR LogFileName = NULL;
-static volatile LONG LogScheduledPrints = 0;
-static volatile LONG LogRotationInProgress = 0;
 
-#define MAX_LOG_STRING_SIZE 1024
-
-typedef struct _LOG_COUNTED_STRING {
-	_Field_range_(0, (MAX_LOG_STRING_SIZE))
-	USHORT DataLength;	// in bytes
-	CHAR Data[MAX_LOG_STRING_SIZE];
-} LOG_COUNTED_STRING, *PLOG_COUNTED_STRING;
+/* Lines are formatted into per-processor rings and written to the file by a single flusher thread */
+static LOG_RING *LogRings = NULL;
+static ULONG LogRingCount = 0;
+static CHAR *LogBatch = NULL;
+static CHAR *LogTraceBatch = NULL;
+static PEX_RUNDOWN_REF_CACHE_AWARE LogRundown = NULL;
+static PKTHREAD LogFlushThread = NULL;
+static KEVENT LogFlushEvent;
+static volatile LONG LogStopping = 0;
+static LONG64 LogReportedDrops = 0;
+static LONG64 LogLinesWritten = 0;
+static LONG64 LogBatchesWritten = 0;
+static LONG64 LogBytesWritten = 0;
+
+#define LOG_BATCH_SIZE 0x10000
+/* Flusher wakes up on its own this often, errors and rings filled past the threshold wake it right away */
+#define LOG_FLUSH_INTERVAL_MS 200
+#define LOG_WAKE_THRESHOLD (LOG_RING_SLOTS * 3 / 4)
 
 NTSTATUS Log_StartFileLogging(LPCWSTR pszFileName)
 {
@@ -146,38 +156,170 @@ Cleanup:
 	return Status;
 }
 
-NTSTATUS Log_WriteLine(PLOG_COUNTED_STRING Line)
+/** Flusher only. Writes the batch with a single ZwWriteFile, the file is rotated or reopened first if needed */
+static NTSTATUS Log_WriteBatch(ULONG Length)
 {
 	NTSTATUS Status = STATUS_SUCCESS;
 	IO_STATUS_BLOCK StatusBlock;
 	FILE_STANDARD_INFORMATION Info;
 
+	if (!Length)
+		return STATUS_SUCCESS;
+
+	if (!LogFile && LogFileName)
+		Log_StartFileLogging(LogFileName);
 	if (!LogFile)
 		return STATUS_INVALID_HANDLE;
 
-	if (!InterlockedCompareExchange(&LogRotationInProgress, 1, 0))
-	{
-		Status = ZwQueryInformationFile(LogFile, &StatusBlock, &Info, sizeof(Info), FileStandardInformation);
-		if (!NT_SUCCESS(Status)) {
+	Status = ZwQueryInformationFile(LogFile, &StatusBlock, &Info, sizeof(Info), FileStandardInformation);
+	if (!NT_SUCCESS(Status))
+		return Status;
+
+	if (Info.DeletePending && LogFileName) {
+		ZwClose(LogFile);
+		LogFile = NULL;
+		Status = Log_StartFileLogging(LogFileName);
+		if (!NT_SUCCESS(Status))
 			return Status;
-		}
+	}
+	else if (Info.EndOfFile.QuadPart >= LogSettings.MaxFileSize) {
+		Status = Log_Rotate();
+		if (!LogFile)
+			return Status;
+	}
+
+	Status = ZwWriteFile(LogFile, NULL, NULL, NULL, &StatusBlock, LogBatch, Length, NULL, NULL);
+	if (NT_SUCCESS(Status))
+	{
+		++LogBatchesWritten;
+		LogBytesWritten += Length;
+	}
+
+	return Status;
+}
+
+/** Flusher only. Moves every published line to the file */
+static VOID Log_Flush()
+{
+	ULONG Length = 0, Index = 0;
+	LONG64 Dropped = 0;
+	LOG_RING_SLOT *pSlot = NULL;
 
-		if (Info.DeletePending && LogFileName) {
-			ZwClose(LogFile);
-			LogFile = NULL;
-			Status = Log_StartFileLogging(LogFileName);
-			if (!NT_SUCCESS(Status))
-				return Status;
+	ULONG TraceLength = 0;
+
+	for (Index = 0; Index < LogRingCount; ++Index)
+	{
+		while (NULL != (pSlot = LogRing_Peek(&LogRings[Index])))
+		{
+			if (pSlot->Type == LOG_SLOT_TRACE)
+			{
+				// Room is kept for the sync record Trace_WriteBatch appends
+				if (TraceLength + pSlot->Length > LOG_BATCH_SIZE - TRACE_SYNC_SIZE)
+				{
+					Trace_WriteBatch(LogTraceBatch, TraceLength);
+					TraceLength = 0;
+				}
+				RtlCopyMemory(LogTraceBatch + TraceLength, pSlot->Data, pSlot->Length);
+				TraceLength += pSlot->Length;
+			}
+			else
+			{
+				if (Length + pSlot->Length > LOG_BATCH_SIZE)
+				{
+					Log_WriteBatch(Length);
+					Length = 0;
+				}
+				RtlCopyMemory(LogBatch + Length, pSlot->Data, pSlot->Length);
+				Length += pSlot->Length;
+			}
+			++LogLinesWritten;
+			LogRing_Release(&LogRings[Index], pSlot);
 		}
-		else if (Info.EndOfFile.QuadPart >= LogSettings.MaxFileSize) {
-			Status = Log_Rotate();
+		Dropped += LogRings[Index].Dropped;
+	}
+
+	if (Dropped > LogReportedDrops && Length + LOG_RING_SLOT_SIZE <= LOG_BATCH_SIZE)
+	{
+		if (SUCCEEDED(StringCbPrintfA(LogBatch + Length, LOG_RING_SLOT_SIZE,
+			"WARNING: %I64d log lines dropped, the rings were full\r\n", Dropped - LogReportedDrops)))
+		{
+			Length += (ULONG)strlen(LogBatch + Length);
+			LogReportedDrops = Dropped;
 		}
+	}
+
+	Log_WriteBatch(Length);
+	if (TraceLength)
+		Trace_WriteBatch(LogTraceBatch, TraceLength);
+}
+
+static VOID Log_FlushThreadRoutine(PVOID Context)
+{
+	LARGE_INTEGER Timeout;
+	UNREFERENCED_PARAMETER(Context);
+
+	Timeout.QuadPart = -10000LL * LOG_FLUSH_INTERVAL_MS;
+	while (!LogStopping)
+	{
+		KeWaitForSingleObject(&LogFlushEvent, Executive, KernelMode, FALSE, &Timeout);
+		Log_Flush();
+	}
+
+	PsTerminateSystemThread(STATUS_SUCCESS);
+}
 
-		LogRotationInProgress = 0;
+static NTSTATUS Log_StartFlusher()
+{
+	NTSTATUS Status = STATUS_SUCCESS;
+	HANDLE hThread = NULL;
+	ULONG Index = 0;
+
+	LogRingCount = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+	LogRings = ExAllocatePoolWithTag(NonPagedPoolNx, LogRingCount * sizeof(LOG_RING), LogAllocationTag);
+	LogBatch = ExAllocatePoolWithTag(PagedPool, LOG_BATCH_SIZE, LogAllocationTag);
+	LogTraceBatch = ExAllocatePoolWithTag(PagedPool, LOG_BATCH_SIZE, LogAllocationTag);
+	LogRundown = ExAllocateCacheAwareRundownProtection(NonPagedPoolNx, LogAllocationTag);
+	if (!LogRings || !LogBatch || !LogTraceBatch || !LogRundown)
+	{
+		Status = STATUS_INSUFFICIENT_RESOURCES;
+		goto Cleanup;
 	}
 
-	if (NT_SUCCESS(Status) && LogFile)
-		Status = ZwWriteFile(LogFile, NULL, NULL, NULL, &StatusBlock, Line->Data, Line->DataLength, NULL, NULL);
+	for (Index = 0; Index < LogRingCount; ++Index)
+		LogRing_Initialize(&LogRings[Index]);
+	KeInitializeEvent(&LogFlushEvent, SynchronizationEvent, FALSE);
+	LogStopping = 0;
+
+	Status = PsCreateSystemThread(&hThread, THREAD_ALL_ACCESS, NULL, NULL, NULL, Log_FlushThreadRoutine, NULL);
+	if (!NT_SUCCESS(Status))
+		goto Cleanup;
+	Status = ObReferenceObjectByHandle(hThread, SYNCHRONIZE, *PsThreadType, KernelMode, (PVOID *)&LogFlushThread, NULL);
+	if (!NT_SUCCESS(Status))
+	{
+		LogFlushThread = NULL;
+		LogStopping = 1;
+		KeSetEvent(&LogFlushEvent, IO_NO_INCREMENT, FALSE);
+		ZwWaitForSingleObject(hThread, FALSE, NULL);
+	}
+	ZwClose(hThread);
+
+Cleanup:
+	if (!LogFlushThread)
+	{
+		if (LogRundown)
+			ExFreeCacheAwareRundownProtection(LogRundown);
+		if (LogBatch)
+			ExFreePoolWithTag(LogBatch, LogAllocationTag);
+		if (LogTraceBatch)
+			ExFreePoolWithTag(LogTraceBatch, LogAllocationTag);
+		if (LogRings)
+			ExFreePoolWithTag(LogRings, LogAllocationTag);
+		LogRundown = NULL;
+		LogBatch = NULL;
+		LogTraceBatch = NULL;
+		LogRings = NULL;
+		LogRingCount = 0;
+	}
 
 	return Status;
 }
@@ -189,6 +331,8 @@ NTSTATUS Log_Initialize(PDEVICE_OBJECT DeviceObject, PUNICODE_STRING RegistryPat
 	OBJECT_ATTRIBUTES fAttrs;
 	UNICODE_STRING SubkeyName;
 
+	Trace_InitializeCallsites();
+
 	LogDeviceObject = DeviceObject;
 	ObReferenceObject(LogDeviceObject);
 
@@ -206,6 +350,7 @@ NTSTATUS Log_Initialize(PDEVICE_OBJECT DeviceObject, PUNICODE_STRING RegistryPat
 		Reg_GetDwordValue(LogParametersKey, L"LogCategoryMask", &LogSettings.LogCategories);
 		Reg_GetDwordValue(LogParametersKey, L"MaxFileSize", &LogSettings.MaxFileSize);
 		Reg_GetDwordValue(LogParametersKey, L"MaxKeptRotatedFiles", &LogSettings.MaxKeptRotatedFiles);
+		Reg_GetDwordValue(LogParametersKey, L"LogBackend", &LogSettings.Backend);
 		Reg_GetStringValue(LogParametersKey, L"LogFileName", &LogFileName);
 	}
 
@@ -215,6 +360,12 @@ NTSTATUS Log_Initialize(PDEVICE_OBJECT DeviceObject, PUNICODE_STRING RegistryPat
 	if (LogFileName)
 	{
 		Status = Log_StartFileLogging(LogFileName);
+		if (NT_SUCCESS(Status))
+			Status = Trace_Initialize(LogFileName);
+		if (NT_SUCCESS(Status))
+			Status = Log_StartFlusher();
+		if (NT_SUCCESS(Status))
+			Trace_UpdateCallsites(TRUE);
 	}
 
 	ZwClose(hKey);
@@ -224,13 +375,31 @@ NTSTATUS Log_Initialize(PDEVICE_OBJECT DeviceObject, PUNICODE_STRING RegistryPat
 
 VOID Log_Cleanup()
 {
-	// wait for all pending prints to finish
-	LARGE_INTEGER delay;
-	delay.QuadPart = -100000;	// 10 ms
-	while (LogScheduledPrints) {
-		KeDelayExecutionThread(KernelMode, TRUE, &delay);
+	Trace_UpdateCallsites(FALSE);
+
+	if (LogFlushThread)
+	{
+		// Wait for the lines being formatted, then let the flusher drain the rings and exit
+		ExWaitForRundownProtectionReleaseCacheAware(LogRundown);
+		LogStopping = 1;
+		KeSetEvent(&LogFlushEvent, IO_NO_INCREMENT, FALSE);
+		KeWaitForSingleObject(LogFlushThread, Executive, KernelMode, FALSE, NULL);
+		ObDereferenceObject(LogFlushThread);
+		LogFlushThread = NULL;
+
+		ExFreeCacheAwareRundownProtection(LogRundown);
+		ExFreePoolWithTag(LogBatch, LogAllocationTag);
+		ExFreePoolWithTag(LogTraceBatch, LogAllocationTag);
+		ExFreePoolWithTag(LogRings, LogAllocationTag);
+		LogRundown = NULL;
+		LogBatch = NULL;
+		LogTraceBatch = NULL;
+		LogRings = NULL;
+		LogRingCount = 0;
 	}
 
+	Trace_Cleanup();
+
 	if (LogFile) {
 		ZwClose(LogFile);
 		LogFile = NULL;
@@ -248,19 +417,33 @@ VOID Log_Cleanup()
 	}
 }
 
-VOID Log_WriteWorker(_In_ PDEVICE_OBJECT DeviceObject, _In_opt_ PVOID Context, _In_ PIO_WORKITEM IoWorkItem)
+LOG_RING_SLOT *Log_BeginSlot(_Out_ LOG_RING **ppRing)
 {
-	UNREFERENCED_PARAMETER(DeviceObject);
+	LOG_RING_SLOT *pSlot = NULL;
 
-	PLOG_COUNTED_STRING line = Context;
-	ASSERT(KeGetCurrentIrql() == PASSIVE_LEVEL);
+	if (!LogFlushThread || KeGetCurrentIrql() > DISPATCH_LEVEL)
+		return NULL;
 
-	Log_WriteLine(line);
+	if (!ExAcquireRundownProtectionCacheAware(LogRundown))
+		return NULL;
 
-	InterlockedDecrement(&LogScheduledPrints);
+	// Being moved to another processor after this point only costs a cache miss, the ring takes many producers
+	*ppRing = &LogRings[KeGetCurrentProcessorNumberEx(NULL) % LogRingCount];
+	pSlot = LogRing_Reserve(*ppRing);
+	if (!pSlot)
+		ExReleaseRundownProtectionCacheAware(LogRundown);
 
-	IoFreeWorkItem(IoWorkItem);
-	ExFreePoolWithTag(Context, LogAllocationTag);
+	return pSlot;
+}
+
+VOID Log_EndSlot(_In_ LOG_RING *pRing, _In_ LOG_RING_SLOT *pSlot, BOOLEAN Urgent)
+{
+	LogRing_Commit(pSlot);
+
+	if (Urgent || LogRing_Used(pRing) >= LOG_WAKE_THRESHOLD)
+		KeSetEvent(&LogFlushEvent, IO_NO_INCREMENT, FALSE);
+
+	ExReleaseRundownProtectionCacheAware(LogRundown);
 }
 
 NTSTATUS Log_Print(LOG_LEVEL Level, LPCSTR pszFormat, ...)
@@ -268,25 +451,27 @@ NTSTATUS Log_Print(LOG_LEVEL Level, LPCSTR pszFormat, ...)
 	NTSTATUS Status = STATUS_SUCCESS;
 	LARGE_INTEGER SystemTime, LocalTime;
 	TIME_FIELDS TimeFields;
-	PLOG_COUNTED_STRING Line = NULL;
+	LOG_RING *pRing = NULL;
+	LOG_RING_SLOT *pSlot = NULL;
+	size_t Length = 0;
 	va_list args;
 	KIRQL Irql = KeGetCurrentIrql();
 	LPCSTR StrLevel = "       :";
 
-	if (!LogFile)
+	if (!LogFlushThread)
 		return STATUS_INVALID_DEVICE_STATE;
 
 	if (Irql > DISPATCH_LEVEL)
 		return STATUS_INVALID_LEVEL;
 
+	pSlot = Log_BeginSlot(&pRing);
+	if (!pSlot)
+		return STATUS_DEVICE_BUSY;
+
 	KeQuerySystemTime(&SystemTime);
 	ExSystemTimeToLocalTime(&SystemTime, &LocalTime);
 	RtlTimeToTimeFields(&LocalTime, &TimeFields);
 
-	Line = ExAllocatePoolWithTag(NonPagedPool, MAX_LOG_STRING_SIZE + FIELD_OFFSET(LOG_COUNTED_STRING, Data), LogAllocationTag);
-	if (!Line)
-		return STATUS_INSUFFICIENT_RESOURCES;
-
 	switch (Level)
 	{
 	case LL_FATAL:
@@ -312,7 +497,7 @@ NTSTATUS Log_Print(LOG_LEVEL Level, LPCSTR pszFormat, ...)
 		break;
 	}
 
-	Status = StringCbPrintfA(Line->Data, MAX_LOG_STRING_SIZE, "%04u.%02u.%02u %02u:%02u:%02u.%03u PR:0x%04X TH:0x%04X IL:%d %s ",
+	Status = StringCbPrintfA(pSlot->Data, sizeof(pSlot->Data), "%04u.%02u.%02u %02u:%02u:%02u.%03u PR:0x%04X TH:0x%04X IL:%d %s ",
 		TimeFields.Year,
 		TimeFields.Month,
 		TimeFields.Day,
@@ -328,40 +513,36 @@ NTSTATUS Log_Print(LOG_LEVEL Level, LPCSTR pszFormat, ...)
 	if (SUCCEEDED(Status))
 	{
 		va_start(args, pszFormat);
-		Line->DataLength = (USHORT)strlen(Line->Data);
-		Status = StringCbVPrintfA(Line->Data + Line->DataLength, MAX_LOG_STRING_SIZE - Line->DataLength, pszFormat, args);
-		if (SUCCEEDED(Status))
-		{
-			Line->DataLength = (USHORT)strlen(Line->Data);
-			if (Irql != PASSIVE_LEVEL) {
-				PIO_WORKITEM pWorkItem = IoAllocateWorkItem(LogDeviceObject);
-				InterlockedIncrement(&LogScheduledPrints);
-				IoQueueWorkItemEx(pWorkItem, Log_WriteWorker, DelayedWorkQueue, Line);
-				Status = STATUS_PENDING;
-			}
-			else
-			{
-				Status = Log_WriteLine(Line);
-			}
-		}
-
+		Length = strlen(pSlot->Data);
+		Status = StringCbVPrintfA(pSlot->Data + Length, sizeof(pSlot->Data) - Length, pszFormat, args);
 		va_end(args);
 	}
 
-	if (Status != STATUS_PENDING)
-		ExFreePoolWithTag(Line, LogAllocationTag);
+	Length = strlen(pSlot->Data);
+	if (Status == STRSAFE_E_INSUFFICIENT_BUFFER)
+	{
+		// Keep the truncated part, it still has to end the line
+		pSlot->Data[Length - 2] = '\r';
+		pSlot->Data[Length - 1] = '\n';
+		Status = STATUS_SUCCESS;
+	}
+	pSlot->Length = NT_SUCCESS(Status) ? (USHORT)Length : 0;
+	pSlot->Type = LOG_SLOT_TEXT;
+	Log_EndSlot(pRing, pSlot, Level <= LL_WARNING);
 
 	return Status;
 }
 
 NTSTATUS Log_SetSetting(_In_ LOG_SETTINGS *Settings)
 {
-	if (Settings->MaxFileSize < MINIMUM_ROTATION_SIZE)
+	if (Settings->MaxFileSize < MINIMUM_ROTATION_SIZE || Settings->Backend > LOG_BACKEND_BINARY)
 		return STATUS_INVALID_PARAMETER;
 	LogSettings.LogCategories = Settings->LogCategories;
 	LogSettings.LogLevel = Settings->LogLevel;
 	LogSettings.MaxFileSize = Settings->MaxFileSize;
 	LogSettings.MaxKeptRotatedFiles = Settings->MaxKeptRotatedFiles;
+	LogSettings.Backend = Settings->Backend;
+	Trace_UpdateCallsites(NULL != LogFlushThread);
 
 	return STATUS_SUCCESS;
 }
@@ -372,6 +553,30 @@ NTSTATUS Log_QueryLogSettings(_Out_ LOG_SETTINGS *Settings)
 	Settings->LogLevel = LogSettings.LogLevel;
 	Settings->MaxFileSize = LogSettings.MaxFileSize;
 	Settings->MaxKeptRotatedFiles = LogSettings.MaxKeptRotatedFiles;
+	Settings->Backend = LogSettings.Backend;
+
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS Log_QueryStatistics(_Out_ LOG_STATISTICS *Statistics)
+{
+	ULONG Index = 0;
+
+	RtlZeroMemory(Statistics, sizeof(LOG_STATISTICS));
+	Statistics->Rings = LogRingCount;
+	Statistics->SlotsPerRing = LOG_RING_SLOTS;
+	Statistics->LinesWritten = LogLinesWritten;
+	Statistics->BatchesWritten = LogBatchesWritten;
+	Statistics->BytesWritten = LogBytesWritten;
+
+	// Rings are only freed on unload, the counters are read without synchronization
+	for (Index = 0; Index < LogRingCount; ++Index)
+	{
+		Statistics->Dropped += LogRings[Index].Dropped;
+		Statistics->Pending += LogRing_Used(&LogRings[Index]);
+		if ((ULONG32)LogRings[Index].HighWater > Statistics->HighWater)
+			Statistics->HighWater = LogRings[Index].HighWater;
+	}
 
 	return STATUS_SUCCESS;
 }
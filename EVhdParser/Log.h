@@ -1,5 +1,8 @@
 #pragma once
 #include "Control.h"
+#include "LogRing.h"
+#include "Trace.h"
+#include "FlightRecorder.h"
 
 typedef enum _LOG_LEVEL
 {
@@ -34,6 +37,10 @@ VOID Log_Cleanup();
 NTSTATUS Log_Print(LOG_LEVEL Level, LPCSTR pszFormat, ...);
 NTSTATUS Log_SetSetting(_In_ LOG_SETTINGS *Settings);
 NTSTATUS Log_QueryLogSettings(_Out_ LOG_SETTINGS *Settings);
+NTSTATUS Log_QueryStatistics(_Out_ LOG_STATISTICS *Statistics);
+/** Reserves a slot in the ring of the current processor, Log_EndSlot publishes it. Returns NULL if nothing can be logged */
+LOG_RING_SLOT *Log_BeginSlot(_Out_ LOG_RING **ppRing);
+VOID Log_EndSlot(_In_ LOG_RING *pRing, _In_ LOG_RING_SLOT *pSlot, BOOLEAN Urgent);
 
 #define MULTILINE_BEGIN do{
 #define MULTILINE_END                  \
@@ -47,9 +54,24 @@ NTSTATUS Log_QueryLogSettings(_Out_ LOG_SETTINGS *Settings);
 #define CONCATENATE2(a, b) a##b
 #define CONCATENATE(a, b) CONCATENATE2(a, b)
 
+/*
+ * The level and category mask are folded into the guard of each call site when they change. Errors are
+ * also kept by the flight recorder whatever the settings, the level is a constant so other sites skip it.
+ */
 #define LOGPRINT_LVL_CTG(level, category, format, ...) \
-	if (level <= LogSettings.LogLevel && (LogSettings.LogCategories & category) == category) \
-		Log_Print(level, CONCATENATE(format, "\r\n"), __VA_ARGS__); \
+	{ \
+		TRACE_DEFINE_CALLSITE(TraceCallsite, level, category, CONCATENATE(format, "\r\n")); \
+		__pragma(warning(suppress: 4127)) \
+		if (level <= LL_ERROR) \
+			Flight_Record(FlightEventError, (UCHAR)(category), 0, 0, level, __LINE__); \
+		if (TraceCallsite.Enabled && (TraceCallsite.Enabled == TRACE_SITE_ON || Trace_Admit(&TraceCallsite))) \
+		{ \
+			if (LogSettings.Backend == LOG_BACKEND_BINARY) \
+				Trace_Write(&TraceCallsite, __VA_ARGS__); \
+			else \
+				Log_Print(level, CONCATENATE(format, "\r\n"), __VA_ARGS__); \
+		} \
+	} \
 
 #define LOG(level, category, format, ...) \
 	MULTILINE_BEGIN                           \
@@ -0,0 +1,112 @@
+#pragma once
+/*
+ * Bounded multi-producer/single-consumer ring of fixed-size log slots, one per
+ * processor. Producers claim a slot with a compare-exchange on EnqueuePos and
+ * publish it through the slot sequence number, so a producer preempted between
+ * the two only holds back the consumer of its own ring. A full ring drops the
+ * line instead of waiting. Plain C and the barrier macros of MessageRing.h, so
+ * the logger can be measured outside of the kernel.
+ */
+#include "MessageRing.h"
+
+#define LOG_RING_SLOT_SIZE      512
+#define LOG_RING_SLOTS          256
+#define LOG_SLOT_TEXT           0
+#define LOG_SLOT_TRACE          1
+
+typedef struct _LOG_RING_SLOT {
+    /* Position + 1 once the line is published, position + LOG_RING_SLOTS once it is consumed */
+    volatile LONG Sequence;
+    ULONG32 Position;
+    USHORT Length;
+    /* LOG_SLOT_TEXT line or LOG_SLOT_TRACE binary trace record */
+    USHORT Type;
+    ULONG32 Reserved;
+    CHAR Data[LOG_RING_SLOT_SIZE - 16];
+} LOG_RING_SLOT;
+
+C_ASSERT(sizeof(LOG_RING_SLOT) == LOG_RING_SLOT_SIZE);
+
+typedef struct _LOG_RING {
+    volatile LONG EnqueuePos;
+    UCHAR Padding0[60];
+    /* Consumer only */
+    LONG DequeuePos;
+    volatile LONG Dropped;
+    /* Largest number of lines waiting for the flusher, updated without synchronization */
+    LONG HighWater;
+    UCHAR Padding1[52];
+    LOG_RING_SLOT Slots[LOG_RING_SLOTS];
+} LOG_RING;
+
+static __inline VOID LogRing_Initialize(LOG_RING *pRing)
+{
+    LONG i = 0;
+    memset(pRing, 0, FIELD_OFFSET(LOG_RING, Slots));
+    for (i = 0; i < LOG_RING_SLOTS; ++i)
+        pRing->Slots[i].Sequence = i;
+}
+
+/** Claims a slot for a new line, returns NULL and counts a drop if the ring is full */
+static __inline LOG_RING_SLOT *LogRing_Reserve(LOG_RING *pRing)
+{
+    ULONG32 Pos = RING_LOAD_ACQUIRE(&pRing->EnqueuePos);
+
+    for (;;)
+    {
+        LOG_RING_SLOT *pSlot = &pRing->Slots[Pos & (LOG_RING_SLOTS - 1)];
+        LONG Diff = (LONG)(RING_LOAD_ACQUIRE(&pSlot->Sequence) - Pos);
+
+        if (Diff == 0)
+        {
+            ULONG32 Previous = (ULONG32)RING_COMPARE_EXCHANGE(&pRing->EnqueuePos, (LONG)(Pos + 1), (LONG)Pos);
+            if (Previous == Pos)
+            {
+                LONG Used = (LONG)(Pos + 1 - (ULONG32)pRing->DequeuePos);
+                if (Used > pRing->HighWater)
+                    pRing->HighWater = Used;
+                pSlot->Position = Pos;
+                return pSlot;
+            }
+            Pos = Previous;
+        }
+        else if (Diff < 0)
+        {
+            // The slot still holds a line from the previous lap
+            RING_INCREMENT(&pRing->Dropped);
+            return NULL;
+        }
+        else
+        {
+            Pos = RING_LOAD_ACQUIRE(&pRing->EnqueuePos);
+        }
+    }
+}
+
+/** Publishes a reserved slot to the consumer */
+static __inline VOID LogRing_Commit(LOG_RING_SLOT *pSlot)
+{
+    RING_STORE_RELEASE(&pSlot->Sequence, pSlot->Position + 1);
+}
+
+/** Consumer side: returns the oldest published line or NULL */
+static __inline LOG_RING_SLOT *LogRing_Peek(LOG_RING *pRing)
+{
+    LOG_RING_SLOT *pSlot = &pRing->Slots[(ULONG32)pRing->DequeuePos & (LOG_RING_SLOTS - 1)];
+    if (RING_LOAD_ACQUIRE(&pSlot->Sequence) != (ULONG32)pRing->DequeuePos + 1)
+        return NULL;
+    return pSlot;
+}
+
+/** Consumer side: hands the slot returned by LogRing_Peek back to the producers */
+static __inline VOID LogRing_Release(LOG_RING *pRing, LOG_RING_SLOT *pSlot)
+{
+    RING_STORE_RELEASE(&pSlot->Sequence, (ULONG32)pRing->DequeuePos + LOG_RING_SLOTS);
+    ++pRing->DequeuePos;
+}
+
+/** Number of published or reserved lines the consumer has not taken yet */
+static __inline ULONG32 LogRing_Used(LOG_RING *pRing)
+{
+    return RING_LOAD_ACQUIRE(&pRing->EnqueuePos) - (ULONG32)pRing->DequeuePos;
+}
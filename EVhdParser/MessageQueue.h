@@ -0,0 +1,147 @@
+#pragma once
+/*
+ * Bounded read queue of a subscription and its overflow policy. Messages are
+ * queued in order up to the limit of the subscription. When the queue is
+ * full a request is rejected, its sender fails fast instead of timing out.
+ * An event either replaces a queued event of the same type and disk, with
+ * OverflowPolicyCoalesce, or the oldest queued event is dropped for it.
+ * Requests are never dropped or coalesced, their senders are waiting.
+ *
+ * The owner allocates the entries and the messages they point to, and frees
+ * what the queue hands back. The caller serializes all calls and updates the
+ * statistics of the subscription through them. Plain C, evhdtool stresses it
+ * under both policies.
+ */
+#include "Control.h"
+
+typedef struct _MESSAGE_QUEUE_ENTRY {
+    struct _MESSAGE_QUEUE_ENTRY *pNext;
+    struct _MESSAGE_QUEUE_ENTRY *pPrev;
+    /* Message of the owner, it moves to the older entry when an event is coalesced */
+    VOID *pData;
+    /* What coalescing compares, DiskId is zero for messages about no disk */
+    ULONG32 Type;
+    GUID DiskId;
+    BOOLEAN Request;
+} MESSAGE_QUEUE_ENTRY;
+
+typedef struct _MESSAGE_QUEUE {
+    /* Sentinel of the circular list, the oldest message comes first */
+    MESSAGE_QUEUE_ENTRY Head;
+    ULONG32 Count;
+} MESSAGE_QUEUE;
+
+static __inline VOID MessageQueue_Initialize(MESSAGE_QUEUE *pQueue)
+{
+    pQueue->Head.pNext = &pQueue->Head;
+    pQueue->Head.pPrev = &pQueue->Head;
+    pQueue->Count = 0;
+}
+
+/** Returns the oldest message or NULL */
+static __inline MESSAGE_QUEUE_ENTRY *MessageQueue_First(MESSAGE_QUEUE *pQueue)
+{
+    return pQueue->Head.pNext != &pQueue->Head ? pQueue->Head.pNext : NULL;
+}
+
+/** Returns the message after pEntry or NULL */
+static __inline MESSAGE_QUEUE_ENTRY *MessageQueue_Next(MESSAGE_QUEUE *pQueue, MESSAGE_QUEUE_ENTRY *pEntry)
+{
+    return pEntry->pNext != &pQueue->Head ? pEntry->pNext : NULL;
+}
+
+static __inline VOID MessageQueue_Remove(MESSAGE_QUEUE *pQueue, MESSAGE_QUEUE_ENTRY *pEntry)
+{
+    pEntry->pPrev->pNext = pEntry->pNext;
+    pEntry->pNext->pPrev = pEntry->pPrev;
+    --pQueue->Count;
+}
+
+static __inline VOID MessageQueue_InsertTail(MESSAGE_QUEUE *pQueue, MESSAGE_QUEUE_ENTRY *pEntry)
+{
+    pEntry->pNext = &pQueue->Head;
+    pEntry->pPrev = pQueue->Head.pPrev;
+    pQueue->Head.pPrev->pNext = pEntry;
+    pQueue->Head.pPrev = pEntry;
+    ++pQueue->Count;
+}
+
+/** Returns the oldest event or NULL if only requests are queued */
+static __inline MESSAGE_QUEUE_ENTRY *MessageQueue_FindDroppable(MESSAGE_QUEUE *pQueue)
+{
+    MESSAGE_QUEUE_ENTRY *pEntry = NULL;
+    for (pEntry = MessageQueue_First(pQueue); pEntry; pEntry = MessageQueue_Next(pQueue, pEntry))
+    {
+        if (!pEntry->Request)
+            return pEntry;
+    }
+    return NULL;
+}
+
+/** Returns a queued event of the same type and disk as the message or NULL */
+static __inline MESSAGE_QUEUE_ENTRY *MessageQueue_FindCoalescable(MESSAGE_QUEUE *pQueue, MESSAGE_QUEUE_ENTRY *pMessage)
+{
+    MESSAGE_QUEUE_ENTRY *pEntry = NULL;
+    for (pEntry = MessageQueue_First(pQueue); pEntry; pEntry = MessageQueue_Next(pQueue, pEntry))
+    {
+        if (!pEntry->Request && pEntry->Type == pMessage->Type && !memcmp(&pEntry->DiskId, &pMessage->DiskId, sizeof(GUID)))
+            return pEntry;
+    }
+    return NULL;
+}
+
+/**
+ * Queues the message under the limit and the overflow policy. *ppFree is set to the entry the owner frees
+ * afterwards, NULL if none: the dropped event, the message itself if it was not queued, or the entry holding
+ * the replaced message of a coalesced event. Returns FALSE if the message was lost.
+ */
+static __inline BOOLEAN MessageQueue_Push(MESSAGE_QUEUE *pQueue, MESSAGE_QUEUE_ENTRY *pEntry, ULONG32 MaxCount,
+    ULONG32 Policy, SUBSCRIPTION_STATISTICS *pStatistics, MESSAGE_QUEUE_ENTRY **ppFree)
+{
+    MESSAGE_QUEUE_ENTRY *pVictim = NULL;
+    VOID *pReplaced = NULL;
+
+    *ppFree = NULL;
+    if (pQueue->Count < MaxCount)
+    {
+        MessageQueue_InsertTail(pQueue, pEntry);
+        if (pQueue->Count > pStatistics->HighWater)
+            pStatistics->HighWater = pQueue->Count;
+        return TRUE;
+    }
+    *ppFree = pEntry;
+    if (pEntry->Request)
+    {
+        ++pStatistics->Rejected;
+        return FALSE;
+    }
+    if (Policy == OverflowPolicyCoalesce && NULL != (pVictim = MessageQueue_FindCoalescable(pQueue, pEntry)))
+    {
+        // The newer event supersedes the queued one, it keeps the position of the old one
+        pReplaced = pVictim->pData;
+        pVictim->pData = pEntry->pData;
+        pEntry->pData = pReplaced;
+        ++pStatistics->Coalesced;
+        return TRUE;
+    }
+    ++pStatistics->Dropped;
+    // Nothing to drop when the queue is full of requests
+    if (NULL == (pVictim = MessageQueue_FindDroppable(pQueue)))
+        return FALSE;
+    MessageQueue_Remove(pQueue, pVictim);
+    MessageQueue_InsertTail(pQueue, pEntry);
+    *ppFree = pVictim;
+    return TRUE;
+}
+
+/** Returns the next event dropped to bring the queue down to MaxCount after the limit was lowered, NULL when it fits */
+static __inline MESSAGE_QUEUE_ENTRY *MessageQueue_Trim(MESSAGE_QUEUE *pQueue, ULONG32 MaxCount, SUBSCRIPTION_STATISTICS *pStatistics)
+{
+    MESSAGE_QUEUE_ENTRY *pVictim = NULL;
+
+    if (pQueue->Count <= MaxCount || NULL == (pVictim = MessageQueue_FindDroppable(pQueue)))
+        return NULL;
+    MessageQueue_Remove(pQueue, pVictim);
+    ++pStatistics->Dropped;
+    return pVictim;
+}
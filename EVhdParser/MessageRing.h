@@ -0,0 +1,168 @@
+#pragma once
+/*
+ * Single-producer/single-consumer ring of variable-length records placed in
+ * memory shared between the driver and the user-mode service. The same code is
+ * used on both sides of the mapping, so it only relies on plain C and the
+ * barrier macros below.
+ *
+ * Head and Tail are free running byte counters, the data area size is a power
+ * of two. A record that does not fit in the space left before the end of the
+ * data area is preceded by a padding record covering that space.
+ */
+#include "PortableTypes.h"
+
+#define PARSER_RING_MIN_SIZE        0x1000
+#define PARSER_RING_MAX_SIZE        0x400000
+#define PARSER_RING_PADDING_RECORD  0xFFFFFFFF
+#define PARSER_RING_ALIGN(Length)   (((Length) + 7) & ~7)
+
+#if defined(_MSC_VER)
+#define RING_LOAD_ACQUIRE(p)        (*(volatile ULONG32 *)(p))
+#define RING_STORE_RELEASE(p, v)    (*(volatile ULONG32 *)(p) = (v))
+#define RING_EXCHANGE(p, v)         InterlockedExchange((volatile LONG *)(p), (v))
+#define RING_COMPARE_EXCHANGE(p, v, c) InterlockedCompareExchange((volatile LONG *)(p), (v), (c))
+#define RING_INCREMENT(p)           InterlockedIncrement((volatile LONG *)(p))
+#define RING_COMPARE_EXCHANGE64(p, v, c) InterlockedCompareExchange64((volatile LONG64 *)(p), (v), (c))
+#define RING_INCREMENT64(p)         InterlockedIncrement64((volatile LONG64 *)(p))
+#define RING_FULL_BARRIER()         MemoryBarrier()
+#define RING_COMPILER_BARRIER()     _ReadWriteBarrier()
+#else
+#define RING_LOAD_ACQUIRE(p)        __atomic_load_n((volatile ULONG32 *)(p), __ATOMIC_ACQUIRE)
+#define RING_STORE_RELEASE(p, v)    __atomic_store_n((volatile ULONG32 *)(p), (v), __ATOMIC_RELEASE)
+#define RING_EXCHANGE(p, v)         __atomic_exchange_n((volatile LONG *)(p), (v), __ATOMIC_SEQ_CST)
+#define RING_COMPARE_EXCHANGE(p, v, c) __sync_val_compare_and_swap((volatile LONG *)(p), (c), (v))
+#define RING_INCREMENT(p)           __atomic_add_fetch((volatile LONG *)(p), 1, __ATOMIC_SEQ_CST)
+#define RING_COMPARE_EXCHANGE64(p, v, c) __sync_val_compare_and_swap((volatile LONG64 *)(p), (c), (v))
+#define RING_INCREMENT64(p)         __atomic_add_fetch((volatile LONG64 *)(p), 1, __ATOMIC_SEQ_CST)
+#define RING_FULL_BARRIER()         __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define RING_COMPILER_BARRIER()     __atomic_signal_fence(__ATOMIC_SEQ_CST)
+#endif
+
+/** Shared ring control block, the data area follows it */
+typedef struct _PARSER_RING_HEADER {
+    ULONG32 Size;
+    ULONG32 Reserved;
+    /* Set by the consumer right before it blocks on the wake event */
+    volatile LONG ConsumerWaiting;
+    UCHAR Padding0[52];
+    /* Written by the producer only */
+    volatile ULONG32 Head;
+    UCHAR Padding1[60];
+    /* Written by the consumer only */
+    volatile ULONG32 Tail;
+    UCHAR Padding2[60];
+} PARSER_RING_HEADER;
+
+C_ASSERT(sizeof(PARSER_RING_HEADER) == 192);
+
+typedef struct _PARSER_RING_RECORD {
+    /* Payload length or PARSER_RING_PADDING_RECORD */
+    ULONG32 Length;
+    ULONG32 Reserved;
+} PARSER_RING_RECORD;
+
+/** Private view of a ring. Size is kept outside of the shared header so the peer can not change it */
+typedef struct _PARSER_RING {
+    PARSER_RING_HEADER *pHeader;
+    UCHAR *pData;
+    ULONG32 Size;
+} PARSER_RING;
+
+static __inline VOID Ring_Attach(PARSER_RING *pRing, PARSER_RING_HEADER *pHeader, ULONG32 Size)
+{
+    pRing->pHeader = pHeader;
+    pRing->pData = (UCHAR *)(pHeader + 1);
+    pRing->Size = Size;
+}
+
+static __inline VOID Ring_Format(PARSER_RING *pRing, PARSER_RING_HEADER *pHeader, ULONG32 Size)
+{
+    memset(pHeader, 0, sizeof(PARSER_RING_HEADER));
+    pHeader->Size = Size;
+    Ring_Attach(pRing, pHeader, Size);
+}
+
+static __inline BOOLEAN Ring_IsEmpty(PARSER_RING *pRing)
+{
+    return RING_LOAD_ACQUIRE(&pRing->pHeader->Head) == pRing->pHeader->Tail;
+}
+
+/** Appends a record. Returns FALSE if there is not enough free space */
+static __inline BOOLEAN Ring_Write(PARSER_RING *pRing, const VOID *pData, ULONG32 Length)
+{
+    PARSER_RING_HEADER *pHeader = pRing->pHeader;
+    ULONG32 Head = pHeader->Head;
+    ULONG32 Used = Head - RING_LOAD_ACQUIRE(&pHeader->Tail);
+    ULONG32 Needed = PARSER_RING_ALIGN(sizeof(PARSER_RING_RECORD) + Length);
+    ULONG32 Offset = Head & (pRing->Size - 1);
+    ULONG32 Padding = (pRing->Size - Offset < Needed) ? pRing->Size - Offset : 0;
+    PARSER_RING_RECORD *pRecord;
+
+    if (Length > pRing->Size || Used > pRing->Size || Needed + Padding > pRing->Size - Used)
+        return FALSE;
+
+    if (Padding)
+    {
+        ((PARSER_RING_RECORD *)(pRing->pData + Offset))->Length = PARSER_RING_PADDING_RECORD;
+        Head += Padding;
+        Offset = 0;
+    }
+
+    pRecord = (PARSER_RING_RECORD *)(pRing->pData + Offset);
+    pRecord->Length = Length;
+    pRecord->Reserved = 0;
+    memcpy(pRecord + 1, pData, Length);
+
+    RING_STORE_RELEASE(&pHeader->Head, Head + Needed);
+    return TRUE;
+}
+
+/**
+ * Removes the oldest record and copies up to BufferLength bytes of it. The full record length is
+ * returned in pLength. Returns FALSE if the ring is empty or its control block is inconsistent.
+ */
+static __inline BOOLEAN Ring_Read(PARSER_RING *pRing, VOID *pBuffer, ULONG32 BufferLength, ULONG32 *pLength)
+{
+    PARSER_RING_HEADER *pHeader = pRing->pHeader;
+    ULONG32 Tail = pHeader->Tail;
+    ULONG32 Head = RING_LOAD_ACQUIRE(&pHeader->Head);
+    ULONG32 Offset, Length, Needed;
+
+    for (;;)
+    {
+        if (Head == Tail || Head - Tail > pRing->Size)
+            return FALSE;
+
+        Offset = Tail & (pRing->Size - 1);
+        // The record header is read exactly once, the peer may be rewriting it
+        Length = ((volatile PARSER_RING_RECORD *)(pRing->pData + Offset))->Length;
+        if (Length != PARSER_RING_PADDING_RECORD)
+            break;
+        Tail += pRing->Size - Offset;
+    }
+
+    Needed = PARSER_RING_ALIGN(sizeof(PARSER_RING_RECORD) + Length);
+    if (Length > pRing->Size || Needed > pRing->Size - Offset || Needed > Head - Tail)
+        return FALSE;
+
+    memcpy(pBuffer, pRing->pData + Offset + sizeof(PARSER_RING_RECORD), Length < BufferLength ? Length : BufferLength);
+    *pLength = Length;
+
+    RING_STORE_RELEASE(&pHeader->Tail, Tail + Needed);
+    return TRUE;
+}
+
+/** Consumer side: announces the consumer is going to block. The ring must be checked again before blocking */
+static __inline VOID Ring_PrepareWait(PARSER_RING *pRing)
+{
+    RING_EXCHANGE(&pRing->pHeader->ConsumerWaiting, 1);
+}
+
+/** Producer side: called after Ring_Write, returns TRUE if the consumer has to be woken up */
+static __inline BOOLEAN Ring_ConsumerNeedsWake(PARSER_RING *pRing)
+{
+    RING_FULL_BARRIER();
+    if (!pRing->pHeader->ConsumerWaiting)
+        return FALSE;
+    return RING_EXCHANGE(&pRing->pHeader->ConsumerWaiting, 0) != 0;
+}
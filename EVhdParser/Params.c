@@ -0,0 +1,143 @@
+#include "stdafx.h"
+#include "Params.h"
+#include "RegUtils.h"
+#include "Log.h"
+
+#define PARAMS_FAST_PAUSE   0x1
+#define PARAMS_FAST_CLOSE   0x2
+
+/* PARAMS_ flags of the values read last */
+static volatile LONG ParamsFlags = PARAMS_FAST_PAUSE | PARAMS_FAST_CLOSE;
+/* The Parameters subkey, watched with ZwNotifyChangeKey. The driver writes other subkeys of the service key */
+static HANDLE ParamsKey = NULL;
+static IO_STATUS_BLOCK ParamsIoStatus;
+/* Queued by the registry, it only hands the change over to ParamsIoWorkItem */
+static WORK_QUEUE_ITEM ParamsWorkItem;
+/* Keeps the device object, and so the driver image, referenced while Params_ChangeRoutine runs */
+static PIO_WORKITEM ParamsIoWorkItem = NULL;
+/* Serializes the work item and the cleanup over the key handle */
+static FAST_MUTEX ParamsMutex;
+static BOOLEAN ParamsArmed = FALSE;
+static BOOLEAN ParamsStopping = FALSE;
+static KEVENT ParamsStoppedEvent;
+static volatile LONG ParamsReads = 0;
+
+static VOID Params_Read()
+{
+	ULONG32 FastPause = TRUE, FastClose = TRUE;
+
+	Reg_GetDwordValue(ParamsKey, L"FastPause", &FastPause);
+	Reg_GetDwordValue(ParamsKey, L"FastClose", &FastClose);
+	InterlockedExchange(&ParamsFlags, (FastPause ? PARAMS_FAST_PAUSE : 0) | (FastClose ? PARAMS_FAST_CLOSE : 0));
+	InterlockedIncrement(&ParamsReads);
+}
+
+/** Queues the work item for the next change of a value of the Parameters key */
+static VOID Params_Arm()
+{
+	NTSTATUS Status = ZwNotifyChangeKey(ParamsKey, NULL, (PIO_APC_ROUTINE)&ParamsWorkItem, (PVOID)(UINT_PTR)DelayedWorkQueue,
+		&ParamsIoStatus, REG_NOTIFY_CHANGE_LAST_SET, FALSE, NULL, 0, TRUE);
+	ParamsArmed = NT_SUCCESS(Status);
+	if (!ParamsArmed)
+		LOG_FUNCTION(LL_ERROR, LOG_CTG_GENERAL, "ZwNotifyChangeKey failed with error 0x%08X, parameters are no longer updated\n", Status);
+}
+
+static VOID Params_ChangeRoutine(PDEVICE_OBJECT pDeviceObject, PVOID Context)
+{
+	BOOLEAN Stopped = FALSE;
+
+	UNREFERENCED_PARAMETER(pDeviceObject);
+	UNREFERENCED_PARAMETER(Context);
+	ExAcquireFastMutex(&ParamsMutex);
+	if (ParamsStopping)
+	{
+		// Closing the key completed the notification
+		ParamsArmed = FALSE;
+		Stopped = TRUE;
+	}
+	else
+	{
+		Params_Read();
+		Params_Arm();
+		LOG_FUNCTION(LL_INFO, LOG_CTG_GENERAL, "Parameters read again: 0x%X\n", ParamsFlags);
+	}
+	ExReleaseFastMutex(&ParamsMutex);
+	if (Stopped)
+		KeSetEvent(&ParamsStoppedEvent, IO_NO_INCREMENT, FALSE);
+}
+
+/** The registry only queues executive work items, these do not keep the driver loaded */
+static VOID Params_NotifyRoutine(PVOID Context)
+{
+	UNREFERENCED_PARAMETER(Context);
+	IoQueueWorkItem(ParamsIoWorkItem, Params_ChangeRoutine, DelayedWorkQueue, NULL);
+}
+
+NTSTATUS Params_Initialize(_In_ PDEVICE_OBJECT pDeviceObject, _In_ PCUNICODE_STRING pRegistryPath)
+{
+	NTSTATUS Status = STATUS_SUCCESS;
+	HANDLE hKey = NULL;
+	OBJECT_ATTRIBUTES fAttrs;
+	UNICODE_STRING SubkeyName;
+
+	ExInitializeFastMutex(&ParamsMutex);
+	KeInitializeEvent(&ParamsStoppedEvent, NotificationEvent, FALSE);
+	ExInitializeWorkItem(&ParamsWorkItem, Params_NotifyRoutine, NULL);
+	ParamsStopping = FALSE;
+	ParamsIoWorkItem = IoAllocateWorkItem(pDeviceObject);
+	if (!ParamsIoWorkItem)
+		return STATUS_INSUFFICIENT_RESOURCES;
+
+	// The defaults stay if the service key can not be read
+	InitializeObjectAttributes(&fAttrs, (PUNICODE_STRING)pRegistryPath, OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, NULL, NULL);
+	Status = ZwOpenKey(&hKey, KEY_CREATE_SUB_KEY, &fAttrs);
+	if (NT_SUCCESS(Status))
+	{
+		// Created when missing, values set later are still seen
+		RtlInitUnicodeString(&SubkeyName, L"Parameters");
+		InitializeObjectAttributes(&fAttrs, &SubkeyName, OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, hKey, NULL);
+		Status = ZwCreateKey(&ParamsKey, KEY_READ | KEY_NOTIFY, &fAttrs, 0, NULL, REG_OPTION_NON_VOLATILE, NULL);
+		ZwClose(hKey);
+	}
+	if (!NT_SUCCESS(Status))
+	{
+		ParamsKey = NULL;
+		IoFreeWorkItem(ParamsIoWorkItem);
+		ParamsIoWorkItem = NULL;
+		return Status;
+	}
+
+	ExAcquireFastMutex(&ParamsMutex);
+	Params_Read();
+	Params_Arm();
+	ExReleaseFastMutex(&ParamsMutex);
+	return STATUS_SUCCESS;
+}
+
+VOID Params_Cleanup()
+{
+	BOOLEAN Armed = FALSE;
+
+	if (!ParamsKey)
+		return;
+	ExAcquireFastMutex(&ParamsMutex);
+	ParamsStopping = TRUE;
+	Armed = ParamsArmed;
+	ZwClose(ParamsKey);
+	ParamsKey = NULL;
+	ExReleaseFastMutex(&ParamsMutex);
+	// The routine does not touch the work item after setting the event
+	if (Armed)
+		KeWaitForSingleObject(&ParamsStoppedEvent, Executive, KernelMode, FALSE, NULL);
+	IoFreeWorkItem(ParamsIoWorkItem);
+	ParamsIoWorkItem = NULL;
+	LOG_FUNCTION(LL_INFO, LOG_CTG_GENERAL, "Parameters were read %d times\n", ParamsReads);
+}
+
+VOID Params_Query(_Out_ EVHD_PARAMETERS *pParameters)
+{
+	LONG Flags = ParamsFlags;
+
+	pParameters->bFastPause = 0 != (Flags & PARAMS_FAST_PAUSE);
+	pParameters->bFastClose = 0 != (Flags & PARAMS_FAST_CLOSE);
+}
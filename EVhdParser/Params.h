@@ -0,0 +1,19 @@
+#pragma once
+#include <ntifs.h>
+
+/*
+ * Parameters of the service key that disks read when they are opened. They are read once when the driver
+ * starts and read again whenever a value of the Parameters key changes, an open only copies them.
+ */
+
+typedef struct _EVHD_PARAMETERS {
+	BOOLEAN bFastPause;		/* Parameters\FastPause, TRUE if not set */
+	BOOLEAN bFastClose;		/* Parameters\FastClose, TRUE if not set */
+} EVHD_PARAMETERS;
+
+/** Changes are read again in an IO work item of pDeviceObject */
+NTSTATUS Params_Initialize(_In_ PDEVICE_OBJECT pDeviceObject, _In_ PCUNICODE_STRING pRegistryPath);
+/** Stops watching the Parameters key, waits for a pending change notification */
+VOID Params_Cleanup();
+/** Copies the current parameters, callable at any IRQL */
+VOID Params_Query(_Out_ EVHD_PARAMETERS *pParameters);
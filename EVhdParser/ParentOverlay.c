@@ -0,0 +1,121 @@
+#include "stdafx.h"
+#include "ParentOverlay.h"
+#include "VhdLayout.h"
+#include "Log.h"
+
+#define OVERLOG(level, format, ...) LOG_FUNCTION(level, LOG_CTG_EXTENSION, format, __VA_ARGS__)
+
+const ULONG32 ParentOverlayAllocationTag = 'OvrP';
+
+/* Entries of the block allocation table read at once */
+#define PARENT_OVERLAY_READ_SIZE 0x10000
+
+/** Reads Length bytes at Offset, a short read is an error */
+static NTSTATUS ParentOverlay_ReadFile(HANDLE hFile, ULONG64 Offset, PVOID pBuffer, ULONG Length)
+{
+	NTSTATUS Status = STATUS_SUCCESS;
+	IO_STATUS_BLOCK StatusBlock = { 0 };
+	LARGE_INTEGER ByteOffset;
+
+	ByteOffset.QuadPart = (LONGLONG)Offset;
+	Status = ZwReadFile(hFile, NULL, NULL, NULL, &StatusBlock, pBuffer, Length, &ByteOffset, NULL);
+	if (NT_SUCCESS(Status) && StatusBlock.Information != Length)
+		Status = STATUS_END_OF_FILE;
+	return Status;
+}
+
+/** Locates the block allocation table, pBuffer holds PARENT_OVERLAY_READ_SIZE bytes */
+static NTSTATUS ParentOverlay_ReadLayout(HANDLE hFile, BOOLEAN bVhdx, PUCHAR pBuffer, VHD_LAYOUT *pLayout)
+{
+	NTSTATUS Status = STATUS_SUCCESS;
+	PUCHAR pMetadata = NULL;
+	ULONG64 HeaderOffset = 0;
+	ULONG Length = 0;
+
+	if (!bVhdx)
+	{
+		Status = ParentOverlay_ReadFile(hFile, 0, pBuffer, VHD_FOOTER_SIZE);
+		if (!NT_SUCCESS(Status))
+			return Status;
+		if (!VhdLayout_VhdFooter(pBuffer, &HeaderOffset))
+			return STATUS_FILE_CORRUPT_ERROR;
+		Status = ParentOverlay_ReadFile(hFile, HeaderOffset, pBuffer, VHD_DYNAMIC_HEADER_SIZE);
+		if (NT_SUCCESS(Status) && !VhdLayout_VhdHeader(pBuffer, pLayout))
+			Status = STATUS_FILE_CORRUPT_ERROR;
+		return Status;
+	}
+
+	Status = ParentOverlay_ReadFile(hFile, VHDX_REGION_TABLE_OFFSET, pBuffer, VHDX_REGION_TABLE_SIZE);
+	if (!NT_SUCCESS(Status))
+		return Status;
+	if (!VhdLayout_VhdxRegions(pBuffer, VHDX_REGION_TABLE_SIZE, pLayout))
+		return STATUS_FILE_CORRUPT_ERROR;
+
+	Length = min(pLayout->MetadataLength, VHDX_METADATA_READ_SIZE);
+	pMetadata = ExAllocatePoolWithTag(PagedPool, Length, ParentOverlayAllocationTag);
+	if (!pMetadata)
+		return STATUS_INSUFFICIENT_RESOURCES;
+	Status = ParentOverlay_ReadFile(hFile, pLayout->MetadataOffset, pMetadata, Length);
+	if (NT_SUCCESS(Status) && !VhdLayout_VhdxMetadata(pMetadata, Length, pLayout))
+		Status = STATUS_FILE_CORRUPT_ERROR;
+	ExFreePoolWithTag(pMetadata, ParentOverlayAllocationTag);
+	return Status;
+}
+
+NTSTATUS ParentOverlay_Load(PARENT_OVERLAY *pOverlay, PCUNICODE_STRING pDiskPath, BOOLEAN bVhdx)
+{
+	NTSTATUS Status = STATUS_SUCCESS;
+	OBJECT_ATTRIBUTES fAttrs;
+	IO_STATUS_BLOCK StatusBlock = { 0 };
+	HANDLE hFile = NULL;
+	PUCHAR pBuffer = NULL;
+	VHD_LAYOUT Layout;
+	ULONG64 Index = 0, Block = 0, Blocks = 0;
+	ULONG EntrySize = 0, Count = 0, i = 0;
+
+	PAGED_CODE();
+	pBuffer = ExAllocatePoolWithTag(PagedPool, PARENT_OVERLAY_READ_SIZE, ParentOverlayAllocationTag);
+	if (!pBuffer)
+		return STATUS_INSUFFICIENT_RESOURCES;
+
+	// vhdmp holds the file open without sharing it for writes
+	InitializeObjectAttributes(&fAttrs, (PUNICODE_STRING)pDiskPath, OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, NULL, NULL);
+	Status = IoCreateFileEx(&hFile, FILE_READ_DATA | SYNCHRONIZE, &fAttrs, &StatusBlock, NULL, FILE_ATTRIBUTE_NORMAL,
+		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, FILE_OPEN,
+		FILE_NON_DIRECTORY_FILE | FILE_SYNCHRONOUS_IO_NONALERT, NULL, 0, CreateFileTypeNone, NULL,
+		IO_IGNORE_SHARE_ACCESS_CHECK, NULL);
+	if (!NT_SUCCESS(Status))
+	{
+		hFile = NULL;
+		goto Cleanup;
+	}
+
+	Status = ParentOverlay_ReadLayout(hFile, bVhdx, pBuffer, &Layout);
+	if (!NT_SUCCESS(Status))
+		goto Cleanup;
+
+	EntrySize = VhdLayout_EntrySize(&Layout);
+	for (Index = 0; Index < Layout.BatEntries && !pOverlay->Full; Index += Count)
+	{
+		Count = (ULONG)min(Layout.BatEntries - Index, PARENT_OVERLAY_READ_SIZE / EntrySize);
+		Status = ParentOverlay_ReadFile(hFile, Layout.BatOffset + Index * EntrySize, pBuffer, Count * EntrySize);
+		if (!NT_SUCCESS(Status))
+			goto Cleanup;
+		for (i = 0; i < Count; ++i)
+		{
+			if (VhdLayout_OwnBlock(&Layout, Index + i, pBuffer + i * EntrySize, &Block))
+			{
+				ParentOverlay_Add(pOverlay, Block * Layout.BlockSize, Layout.BlockSize);
+				++Blocks;
+			}
+		}
+	}
+	OVERLOG(LL_INFO, "%I64u blocks of %u bytes of %S are not read from the parent%s", Blocks, Layout.BlockSize,
+		pDiskPath->Buffer, pOverlay->Full ? ", the whole disk counts as written" : "");
+
+Cleanup:
+	if (hFile)
+		ZwClose(hFile);
+	ExFreePoolWithTag(pBuffer, ParentOverlayAllocationTag);
+	return Status;
+}
@@ -0,0 +1,123 @@
+#pragma once
+/*
+ * Regions a differencing disk holds itself. A clone created empty over a
+ * shared parent reads the data of the parent wherever it has not written
+ * itself, so its reads outside the overlay may be served from the blocks
+ * decrypted for the other clones of the parent. At mount it is filled with
+ * the blocks the allocation table of the disk maps, written by earlier
+ * mounts, and the writes of the mount are added as they are sent.
+ *
+ * Regions are 1 MiB and kept in an open addressed set updated without a
+ * lock. A write adds its regions before it is sent to vhdmp, so a read that
+ * returns its data is found in the overlay by the time it completes. The set
+ * never shrinks, once it is full or a command changes a range it can not
+ * tell, the whole disk counts as written.
+ * Plain C, evhdtool simulates a boot storm of clones with it.
+ */
+#include "MessageRing.h"
+
+#define PARENT_OVERLAY_REGION_SHIFT 20
+/* Power of two */
+#define PARENT_OVERLAY_SLOTS        4096
+#define PARENT_OVERLAY_PROBES       32
+/* Larger ranges cover the whole disk */
+#define PARENT_OVERLAY_MAX_REGIONS  64
+
+typedef struct _PARENT_OVERLAY {
+    /* Region number + 1, 0 for a free slot */
+    volatile LONG64 Slots[PARENT_OVERLAY_SLOTS];
+    volatile LONG Full;
+    volatile LONG Count;
+} PARENT_OVERLAY;
+
+static __inline VOID ParentOverlay_Initialize(PARENT_OVERLAY *pOverlay)
+{
+    memset((VOID *)pOverlay, 0, sizeof(PARENT_OVERLAY));
+}
+
+/** The whole disk counts as written from now on */
+static __inline VOID ParentOverlay_SetFull(PARENT_OVERLAY *pOverlay)
+{
+    RING_EXCHANGE(&pOverlay->Full, TRUE);
+}
+
+static __inline ULONG32 ParentOverlay_Slot(ULONG64 Region)
+{
+    return (ULONG32)((Region * 0x9E3779B97F4A7C15ULL) >> 40) & (PARENT_OVERLAY_SLOTS - 1);
+}
+
+/** Adds the regions a write of Length bytes at Offset touches, with a full barrier */
+static __inline VOID ParentOverlay_Add(PARENT_OVERLAY *pOverlay, ULONG64 Offset, ULONG64 Length)
+{
+    ULONG64 Region = Offset >> PARENT_OVERLAY_REGION_SHIFT;
+    ULONG64 End = (Offset + (Length ? Length : 1) - 1) >> PARENT_OVERLAY_REGION_SHIFT;
+
+    if (End - Region >= PARENT_OVERLAY_MAX_REGIONS)
+    {
+        ParentOverlay_SetFull(pOverlay);
+        return;
+    }
+    for (; Region <= End && !pOverlay->Full; ++Region)
+    {
+        ULONG32 Slot = ParentOverlay_Slot(Region), Probe = 0;
+        LONG64 Key = (LONG64)(Region + 1), Found = 0;
+
+        for (Probe = 0; Probe < PARENT_OVERLAY_PROBES; ++Probe, Slot = (Slot + 1) & (PARENT_OVERLAY_SLOTS - 1))
+        {
+            Found = pOverlay->Slots[Slot];
+            if (Found == Key)
+                break;
+            if (!Found)
+            {
+                Found = RING_COMPARE_EXCHANGE64(&pOverlay->Slots[Slot], Key, 0);
+                if (!Found)
+                {
+                    // Past three quarters probes get long, the remaining writes are not tracked one by one
+                    if (RING_INCREMENT(&pOverlay->Count) > PARENT_OVERLAY_SLOTS / 4 * 3)
+                        ParentOverlay_SetFull(pOverlay);
+                    break;
+                }
+                // Taken by another write meanwhile, maybe for the same region
+                if (Found == Key)
+                    break;
+            }
+        }
+        if (Probe == PARENT_OVERLAY_PROBES)
+            ParentOverlay_SetFull(pOverlay);
+    }
+    RING_FULL_BARRIER();
+}
+
+/** TRUE if the disk holds any region of the range itself */
+static __inline BOOLEAN ParentOverlay_Covers(const PARENT_OVERLAY *pOverlay, ULONG64 Offset, ULONG64 Length)
+{
+    ULONG64 Region = Offset >> PARENT_OVERLAY_REGION_SHIFT;
+    ULONG64 End = (Offset + (Length ? Length : 1) - 1) >> PARENT_OVERLAY_REGION_SHIFT;
+
+    RING_FULL_BARRIER();
+    if (pOverlay->Full || End - Region >= PARENT_OVERLAY_MAX_REGIONS)
+        return TRUE;
+    for (; Region <= End; ++Region)
+    {
+        ULONG32 Slot = ParentOverlay_Slot(Region), Probe = 0;
+        LONG64 Key = (LONG64)(Region + 1), Found = 0;
+
+        for (Probe = 0; Probe < PARENT_OVERLAY_PROBES; ++Probe, Slot = (Slot + 1) & (PARENT_OVERLAY_SLOTS - 1))
+        {
+            Found = pOverlay->Slots[Slot];
+            if (Found == Key)
+                return TRUE;
+            if (!Found)
+                break;
+        }
+        // Added regions are found within the probes or the overlay is full
+        if (Probe == PARENT_OVERLAY_PROBES)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+#ifdef _WINKRNL
+/** Adds the blocks the allocation table of the VHD or VHDX file at pDiskPath maps, the file is open by vhdmp */
+NTSTATUS ParentOverlay_Load(PARENT_OVERLAY *pOverlay, PCUNICODE_STRING pDiskPath, BOOLEAN bVhdx);
+#endif
@@ -0,0 +1,50 @@
+#pragma once
+/*
+ * Windows type names used by the headers that describe shared formats (rings,
+ * catalogs, snapshots). On Windows they come from the DDK/SDK headers included
+ * before this one, elsewhere they are mapped onto stdint types so the same
+ * headers can be used by offline tools.
+ */
+#if !defined(_WIN32)
+#include <stdint.h>
+#include <string.h>
+
+#ifndef VOID
+#define VOID void
+#endif
+typedef char CHAR;
+typedef uint8_t UCHAR;
+typedef uint8_t UINT8;
+typedef uint8_t BOOLEAN;
+typedef int16_t SHORT;
+typedef uint16_t USHORT;
+typedef int32_t LONG;
+typedef uint32_t ULONG;
+typedef uint32_t ULONG32;
+typedef int64_t LONG64;
+typedef uint64_t ULONG64;
+
+#ifndef GUID_DEFINED
+#define GUID_DEFINED
+typedef struct _GUID {
+    uint32_t Data1;
+    uint16_t Data2;
+    uint16_t Data3;
+    uint8_t Data4[8];
+} GUID;
+#endif
+
+#ifndef TRUE
+#define TRUE 1
+#define FALSE 0
+#endif
+
+#ifndef C_ASSERT
+#define C_ASSERT(e) _Static_assert(e, #e)
+#endif
+
+#ifndef FIELD_OFFSET
+#define FIELD_OFFSET(type, field) ((LONG)offsetof(type, field))
+#include <stddef.h>
+#endif
+#endif
@@ -0,0 +1,215 @@
+#pragma once
+/*
+ * Sequential stream detection and read-ahead of one disk. Reads that follow
+ * each other in offset order make a stream, once READ_AHEAD_TRIGGER of them
+ * came in a row the next read that misses the buffer is sent to vhdmp with
+ * a window of data after it. The owner decrypts the whole transfer when it
+ * completes and keeps the window in its buffer, the following reads of the
+ * stream are copied from there.
+ *
+ * The window starts at READ_AHEAD_MIN_WINDOW and doubles every time the
+ * stream reads the whole buffer, up to the size of the buffer. Up to
+ * READ_AHEAD_STRAYS reads elsewhere pass between two reads of the stream,
+ * one more of them, or a read right after one of them, ends it: the buffer
+ * is dropped and the window starts over. Only one read-ahead is in flight at a time, and writes that overlap
+ * it stamp the state so its data is not kept, like fills of the read cache.
+ * The caller serializes all calls and stores the data, the state only holds
+ * offsets. The data is copied between the calls: a hit copies from the buffer
+ * until ReadAhead_EndRead, a completed read-ahead fills it until
+ * ReadAhead_Publish, and a read-ahead is not kept while a hit still copies.
+ * Plain C, evhdtool simulates streams with it.
+ */
+#include "PortableTypes.h"
+
+#define READ_AHEAD_MIN_WINDOW       0x10000
+/* Reads in a row that make a stream */
+#define READ_AHEAD_TRIGGER          2
+/* Reads elsewhere in a row that leave the stream alone */
+#define READ_AHEAD_STRAYS           2
+/* Read-ahead is a multiple of it */
+#define READ_AHEAD_ALIGNMENT        0x1000
+/* ReadAhead_Start result of a read found in the buffer */
+#define READ_AHEAD_HIT              0xFFFFFFFF
+
+typedef struct _READ_AHEAD {
+    /* Size of the buffer, and bytes read ahead by the next read-ahead */
+    ULONG32 MaxWindow;
+    ULONG32 Window;
+    /* Offset the next read of the stream starts at, and reads of the stream so far */
+    ULONG64 NextOffset;
+    ULONG32 Sequential;
+    /* Reads elsewhere since the last read of the stream, and the offset after the last of them */
+    ULONG32 Strays;
+    ULONG64 StrayOffset;
+    /* Byte 0 of the buffer holds the data at BaseOffset, the valid part is [BufferOffset, BufferOffset + BufferLength) */
+    ULONG64 BaseOffset;
+    ULONG64 BufferOffset;
+    ULONG32 BufferLength;
+    /* Set from ReadAhead_Issue until the read-ahead was dropped or published, the buffer is empty meanwhile */
+    BOOLEAN Pending;
+    ULONG64 PendingOffset;
+    ULONG32 PendingLength;
+    /* Hits copying from the buffer */
+    ULONG32 Readers;
+    /* Last time a write overlapped the read-ahead in flight */
+    ULONG64 WriteStamp;
+    ULONG64 Hits;
+    ULONG64 Issued;
+    ULONG64 AheadBytes;
+    /* Bytes read ahead and never read, and streams that ended with data in the buffer */
+    ULONG64 WastedBytes;
+    ULONG64 Cancels;
+} READ_AHEAD;
+
+static __inline VOID ReadAhead_Initialize(READ_AHEAD *pAhead, ULONG32 MaxWindow)
+{
+    memset(pAhead, 0, sizeof(READ_AHEAD));
+    pAhead->MaxWindow = MaxWindow;
+    pAhead->StrayOffset = (ULONG64)-1;
+    pAhead->Window = MaxWindow < READ_AHEAD_MIN_WINDOW ? MaxWindow : READ_AHEAD_MIN_WINDOW;
+}
+
+static __inline VOID ReadAhead_DropBuffer(READ_AHEAD *pAhead)
+{
+    pAhead->WastedBytes += pAhead->BufferLength;
+    pAhead->BufferLength = 0;
+}
+
+static __inline BOOLEAN ReadAhead_Overlaps(ULONG64 Offset, ULONG64 Length, ULONG64 OtherOffset, ULONG64 OtherLength)
+{
+    return Offset < OtherOffset + OtherLength && OtherOffset < Offset + Length;
+}
+
+/**
+ * Called when a read of Length bytes at Offset starts. Returns READ_AHEAD_HIT if the buffer holds the read, the
+ * caller copies it from BaseOffset and calls ReadAhead_EndRead. Otherwise returns the bytes to read ahead after it, 0 for none, the caller
+ * calls ReadAhead_Issue if it sends them. Limit is the size of the disk.
+ */
+static __inline ULONG32 ReadAhead_Start(READ_AHEAD *pAhead, ULONG64 Offset, ULONG32 Length, ULONG64 Limit)
+{
+    ULONG64 End = Offset + Length, Ahead = 0;
+
+    if (pAhead->BufferLength && Offset >= pAhead->BufferOffset && End <= pAhead->BufferOffset + pAhead->BufferLength)
+    {
+        // Streams do not read back, what is before the read is not kept
+        pAhead->BufferLength -= (ULONG32)(End - pAhead->BufferOffset);
+        pAhead->BufferOffset = End;
+        pAhead->NextOffset = End;
+        ++pAhead->Sequential;
+        pAhead->Strays = 0;
+        ++pAhead->Hits;
+        ++pAhead->Readers;
+        if (!pAhead->BufferLength && pAhead->Window < pAhead->MaxWindow)
+            pAhead->Window = pAhead->Window * 2 < pAhead->MaxWindow ? pAhead->Window * 2 : pAhead->MaxWindow;
+        return READ_AHEAD_HIT;
+    }
+    if (Offset == pAhead->NextOffset)
+        ++pAhead->Sequential;
+    else if (Offset != pAhead->StrayOffset && pAhead->Sequential >= READ_AHEAD_TRIGGER &&
+        pAhead->Strays < READ_AHEAD_STRAYS)
+    {
+        // A lookup of metadata in the middle of a copy, the stream goes on
+        ++pAhead->Strays;
+        pAhead->StrayOffset = End;
+        return 0;
+    }
+    else
+    {
+        // Random reads, or another stream took over
+        if (pAhead->BufferLength)
+            ++pAhead->Cancels;
+        ReadAhead_DropBuffer(pAhead);
+        pAhead->Sequential = Offset == pAhead->StrayOffset ? 2 : 1;
+        pAhead->Window = pAhead->MaxWindow < READ_AHEAD_MIN_WINDOW ? pAhead->MaxWindow : READ_AHEAD_MIN_WINDOW;
+    }
+    pAhead->Strays = 0;
+    pAhead->StrayOffset = (ULONG64)-1;
+    pAhead->NextOffset = End;
+    // Reads of the stream sent while the read-ahead is in flight go to the disk themselves
+    if (pAhead->Sequential < READ_AHEAD_TRIGGER || pAhead->Pending || End >= Limit)
+        return 0;
+    ReadAhead_DropBuffer(pAhead);
+    Ahead = Limit - End < pAhead->Window ? Limit - End : pAhead->Window;
+    return (ULONG32)Ahead & ~(READ_AHEAD_ALIGNMENT - 1);
+}
+
+/** A hit copied its data from the buffer */
+static __inline VOID ReadAhead_EndRead(READ_AHEAD *pAhead)
+{
+    --pAhead->Readers;
+}
+
+/** The read ending at Offset was sent with Length bytes read ahead */
+static __inline VOID ReadAhead_Issue(READ_AHEAD *pAhead, ULONG64 Offset, ULONG32 Length)
+{
+    pAhead->Pending = TRUE;
+    pAhead->PendingOffset = Offset;
+    pAhead->PendingLength = Length;
+    ++pAhead->Issued;
+}
+
+/** FALSE if a write may have changed the read-ahead, or the stream moved elsewhere while it was in flight */
+static __inline BOOLEAN ReadAhead_Fresh(const READ_AHEAD *pAhead, ULONG32 Length, ULONG64 StartStamp)
+{
+    ULONG64 Offset = pAhead->PendingOffset;
+
+    return Length && StartStamp > pAhead->WriteStamp && pAhead->NextOffset >= Offset &&
+        pAhead->NextOffset < Offset + Length;
+}
+
+/**
+ * The read-ahead completed with Length bytes, its read started at StartStamp. Returns TRUE if the caller copies
+ * them into the buffer, the first *pSkip bytes were read by the stream meanwhile and are not needed. The
+ * read-ahead stays pending until the caller calls ReadAhead_Publish, writes and reads meanwhile are accounted
+ * for there.
+ */
+static __inline BOOLEAN ReadAhead_Complete(READ_AHEAD *pAhead, ULONG32 Length, ULONG64 StartStamp, ULONG32 *pSkip)
+{
+    *pSkip = 0;
+    pAhead->AheadBytes += Length;
+    if (!ReadAhead_Fresh(pAhead, Length, StartStamp) || pAhead->Readers)
+    {
+        pAhead->Pending = FALSE;
+        pAhead->WastedBytes += Length;
+        return FALSE;
+    }
+    *pSkip = (ULONG32)(pAhead->NextOffset - pAhead->PendingOffset);
+    return TRUE;
+}
+
+/** The caller copied the read-ahead ReadAhead_Complete returned TRUE for, returns TRUE if the buffer keeps it */
+static __inline BOOLEAN ReadAhead_Publish(READ_AHEAD *pAhead, ULONG32 Length, ULONG64 StartStamp)
+{
+    ULONG64 Offset = pAhead->PendingOffset;
+
+    pAhead->Pending = FALSE;
+    // The stream went on reading from the disk while the data was copied, or a write landed
+    if (!ReadAhead_Fresh(pAhead, Length, StartStamp))
+    {
+        pAhead->WastedBytes += Length;
+        return FALSE;
+    }
+    pAhead->WastedBytes += pAhead->NextOffset - Offset;
+    pAhead->BaseOffset = Offset;
+    pAhead->BufferOffset = pAhead->NextOffset;
+    pAhead->BufferLength = (ULONG32)(Offset + Length - pAhead->NextOffset);
+    return TRUE;
+}
+
+/** A write of Length bytes at Offset starts or completes, Stamp is now */
+static __inline VOID ReadAhead_Invalidate(READ_AHEAD *pAhead, ULONG64 Offset, ULONG64 Length, ULONG64 Stamp)
+{
+    if (pAhead->BufferLength && ReadAhead_Overlaps(Offset, Length, pAhead->BufferOffset, pAhead->BufferLength))
+    {
+        // The stream still reads what comes before the write
+        if (Offset > pAhead->BufferOffset)
+        {
+            pAhead->WastedBytes += pAhead->BufferOffset + pAhead->BufferLength - Offset;
+            pAhead->BufferLength = (ULONG32)(Offset - pAhead->BufferOffset);
+        }
+        else
+            ReadAhead_DropBuffer(pAhead);
+    }
+    if (pAhead->Pending && ReadAhead_Overlaps(Offset, Length, pAhead->PendingOffset, pAhead->PendingLength))
+        pAhead->WriteStamp = Stamp;
+}
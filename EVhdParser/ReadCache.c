@@ -0,0 +1,374 @@
+#include "stdafx.h"
+#include "ReadCache.h"
+#include "BlockCache.h"
+#include "RegUtils.h"
+#include "Log.h"
+
+#define LOG_READ_CACHE(level, format, ...) LOG_FUNCTION(level, LOG_CTG_GENERAL, format, __VA_ARGS__)
+
+/* Invalidation stamps of every shard, power of two */
+#define READ_CACHE_STAMPS       4096
+/* Period of the low memory check in milliseconds */
+#define READ_CACHE_CHECK_PERIOD 1000
+
+/* Parent shared by its clones */
+typedef struct _READ_CACHE_PARENT {
+	GUID ParentId;
+	ULONG64 KeyHash;
+	/* Key of the blocks, 0 for a free entry */
+	ULONG64 Disk;
+	ULONG32 References;
+} READ_CACHE_PARENT;
+
+typedef struct _READ_CACHE_SHARD {
+	KSPIN_LOCK Lock;
+	BLOCK_CACHE Cache;
+	BLOCK_CACHE_NODE *pNodes;
+	ULONG32 *pBuckets;
+	ULONG64 *pStamps;
+} READ_CACHE_SHARD;
+
+static const ULONG ReadCacheAllocationTag = 'CRVE';
+/* Parameters\ReadCacheMegabytes, read once when the driver starts */
+static ULONG32 ReadCacheMegabytes = 0;
+/* Parameters\ReadAheadKilobytes, read with it */
+static ULONG32 ReadAheadKilobytes = 0;
+static READ_CACHE_SHARD *pReadCacheShards = NULL;
+static volatile LONG64 ReadCacheNextDisk = 0;
+static KSPIN_LOCK ReadCacheParentLock;
+static READ_CACHE_PARENT ReadCacheParents[READ_CACHE_PARENTS];
+/* \KernelObjects\LowMemoryCondition */
+static PKEVENT pReadCacheLowMemory = NULL;
+static HANDLE hReadCacheLowMemory = NULL;
+static KTIMER ReadCacheTimer;
+static KDPC ReadCacheDpc;
+static KDEFERRED_ROUTINE ReadCache_CheckDpc;
+
+static VOID *ReadCache_AllocateBlock(VOID *pContext)
+{
+	UNREFERENCED_PARAMETER(pContext);
+	return ExAllocatePoolWithTag(NonPagedPoolNx, READ_CACHE_BLOCK_SIZE, ReadCacheAllocationTag);
+}
+
+static VOID ReadCache_ReleaseBlock(VOID *pContext, VOID *pData)
+{
+	UNREFERENCED_PARAMETER(pContext);
+	ExFreePoolWithTag(pData, ReadCacheAllocationTag);
+}
+
+static READ_CACHE_SHARD *ReadCache_Shard(ULONG64 Disk, ULONG64 Block)
+{
+	// The upper bits of the hash pick the bucket and the stamp inside the shard
+	return &pReadCacheShards[(BlockCache_Hash(Disk, Block) >> 28) % READ_CACHE_SHARDS];
+}
+
+static VOID ReadCache_FreeShards()
+{
+	ULONG i = 0;
+
+	for (i = 0; i < READ_CACHE_SHARDS; ++i)
+	{
+		READ_CACHE_SHARD *pShard = &pReadCacheShards[i];
+		if (pShard->pNodes && pShard->pBuckets && pShard->pStamps)
+			BlockCache_SetLimit(&pShard->Cache, 0);
+		if (pShard->pNodes)
+			ExFreePoolWithTag(pShard->pNodes, ReadCacheAllocationTag);
+		if (pShard->pBuckets)
+			ExFreePoolWithTag(pShard->pBuckets, ReadCacheAllocationTag);
+		if (pShard->pStamps)
+			ExFreePoolWithTag(pShard->pStamps, ReadCacheAllocationTag);
+	}
+	ExFreePoolWithTag(pReadCacheShards, ReadCacheAllocationTag);
+	pReadCacheShards = NULL;
+}
+
+NTSTATUS ReadCache_Initialize(_In_ PCUNICODE_STRING pRegistryPath)
+{
+	HANDLE hKey = NULL, hParametersKey = NULL;
+	OBJECT_ATTRIBUTES fAttrs;
+	UNICODE_STRING SubkeyName;
+	ULONG32 Capacity = 0, Buckets = 1, i = 0;
+	LARGE_INTEGER DueTime;
+
+	KeInitializeTimer(&ReadCacheTimer);
+	KeInitializeSpinLock(&ReadCacheParentLock);
+	RtlZeroMemory(ReadCacheParents, sizeof(ReadCacheParents));
+	KeInitializeDpc(&ReadCacheDpc, ReadCache_CheckDpc, NULL);
+	InitializeObjectAttributes(&fAttrs, (PUNICODE_STRING)pRegistryPath, OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, NULL, NULL);
+	if (NT_SUCCESS(ZwOpenKey(&hKey, KEY_READ, &fAttrs)))
+	{
+		RtlInitUnicodeString(&SubkeyName, L"Parameters");
+		InitializeObjectAttributes(&fAttrs, &SubkeyName, OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, hKey, NULL);
+		if (NT_SUCCESS(ZwOpenKey(&hParametersKey, KEY_READ, &fAttrs)))
+		{
+			Reg_GetDwordValue(hParametersKey, L"ReadCacheMegabytes", &ReadCacheMegabytes);
+			Reg_GetDwordValue(hParametersKey, L"ReadAheadKilobytes", &ReadAheadKilobytes);
+			ZwClose(hParametersKey);
+		}
+		ZwClose(hKey);
+	}
+	// Whole 4 KiB blocks, every encrypted disk keeps a buffer of this size in nonpaged memory
+	ReadAheadKilobytes = min(ReadAheadKilobytes, 4096) & ~3;
+	if (ReadAheadKilobytes)
+		LOG_READ_CACHE(LL_INFO, "Read-ahead of up to %u KiB\n", ReadAheadKilobytes);
+	if (!ReadCacheMegabytes)
+		return STATUS_SUCCESS;
+
+	Capacity = (ULONG32)(min(ReadCacheMegabytes, 0x100000) * (0x100000 / READ_CACHE_BLOCK_SIZE) / READ_CACHE_SHARDS);
+	while (Buckets < BlockCache_NodeCount(Capacity))
+		Buckets <<= 1;
+	pReadCacheShards = ExAllocatePoolWithTag(NonPagedPoolNx, READ_CACHE_SHARDS * sizeof(READ_CACHE_SHARD),
+		ReadCacheAllocationTag);
+	if (!pReadCacheShards)
+	{
+		ReadCacheMegabytes = 0;
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+	RtlZeroMemory(pReadCacheShards, READ_CACHE_SHARDS * sizeof(READ_CACHE_SHARD));
+	for (i = 0; i < READ_CACHE_SHARDS; ++i)
+	{
+		READ_CACHE_SHARD *pShard = &pReadCacheShards[i];
+		KeInitializeSpinLock(&pShard->Lock);
+		pShard->pNodes = ExAllocatePoolWithTag(NonPagedPoolNx, BlockCache_NodeCount(Capacity) * sizeof(BLOCK_CACHE_NODE),
+			ReadCacheAllocationTag);
+		pShard->pBuckets = ExAllocatePoolWithTag(NonPagedPoolNx, Buckets * sizeof(ULONG32), ReadCacheAllocationTag);
+		pShard->pStamps = ExAllocatePoolWithTag(NonPagedPoolNx, READ_CACHE_STAMPS * sizeof(ULONG64), ReadCacheAllocationTag);
+		if (!pShard->pNodes || !pShard->pBuckets || !pShard->pStamps)
+		{
+			LOG_READ_CACHE(LL_ERROR, "Could not allocate a read cache of %u MiB\n", ReadCacheMegabytes);
+			ReadCache_FreeShards();
+			ReadCacheMegabytes = 0;
+			return STATUS_INSUFFICIENT_RESOURCES;
+		}
+		BlockCache_Initialize(&pShard->Cache, Capacity, pShard->pNodes, pShard->pBuckets, Buckets, pShard->pStamps,
+			READ_CACHE_STAMPS, ReadCache_AllocateBlock, ReadCache_ReleaseBlock, NULL);
+	}
+
+	// The cache does not shrink without the event, it still works
+	RtlInitUnicodeString(&SubkeyName, L"\\KernelObjects\\LowMemoryCondition");
+	pReadCacheLowMemory = IoCreateNotificationEvent(&SubkeyName, &hReadCacheLowMemory);
+	if (pReadCacheLowMemory)
+	{
+		DueTime.QuadPart = -(LONGLONG)READ_CACHE_CHECK_PERIOD * 10000;
+		KeSetTimerEx(&ReadCacheTimer, DueTime, READ_CACHE_CHECK_PERIOD, &ReadCacheDpc);
+	}
+	else
+		LOG_READ_CACHE(LL_WARNING, "Could not open the low memory event, the read cache keeps its size\n");
+	LOG_READ_CACHE(LL_INFO, "Read cache of %u MiB, %u blocks in each of %u shards\n", ReadCacheMegabytes, Capacity,
+		READ_CACHE_SHARDS);
+	return STATUS_SUCCESS;
+}
+
+VOID ReadCache_Cleanup()
+{
+	ULONG64 Hits = 0, Misses = 0, Rejected = 0;
+	ULONG i = 0;
+
+	ReadAheadKilobytes = 0;
+	if (!ReadCacheMegabytes)
+		return;
+	KeCancelTimer(&ReadCacheTimer);
+	KeFlushQueuedDpcs();
+	if (hReadCacheLowMemory)
+		ZwClose(hReadCacheLowMemory);
+	hReadCacheLowMemory = NULL;
+	pReadCacheLowMemory = NULL;
+	for (i = 0; i < READ_CACHE_SHARDS; ++i)
+	{
+		Hits += pReadCacheShards[i].Cache.Hits;
+		Misses += pReadCacheShards[i].Cache.Misses;
+		Rejected += pReadCacheShards[i].Cache.Rejected;
+	}
+	LOG_READ_CACHE(LL_INFO, "Read cache: %llu block hits, %llu misses, %llu fills raced a write\n", Hits, Misses,
+		Rejected);
+	ReadCache_FreeShards();
+	ReadCacheMegabytes = 0;
+}
+
+BOOLEAN ReadCache_Enabled()
+{
+	return NULL != pReadCacheShards;
+}
+
+ULONG ReadCache_ReadAheadWindow()
+{
+	return ReadAheadKilobytes * 1024;
+}
+
+ULONG64 ReadCache_NewDisk()
+{
+	return (ULONG64)InterlockedIncrement64(&ReadCacheNextDisk);
+}
+
+ULONG64 ReadCache_OpenShared(_In_ const GUID *pParentId, ULONG64 KeyHash)
+{
+	READ_CACHE_PARENT *pFree = NULL;
+	ULONG64 Disk = 0;
+	ULONG i = 0;
+	KIRQL OldIrql;
+
+	if (!pReadCacheShards)
+		return 0;
+	KeAcquireSpinLock(&ReadCacheParentLock, &OldIrql);
+	for (i = 0; i < READ_CACHE_PARENTS && !Disk; ++i)
+	{
+		READ_CACHE_PARENT *pParent = &ReadCacheParents[i];
+		if (!pParent->Disk)
+		{
+			if (!pFree)
+				pFree = pParent;
+		}
+		else if (pParent->KeyHash == KeyHash && RtlEqualMemory(&pParent->ParentId, pParentId, sizeof(GUID)))
+		{
+			++pParent->References;
+			Disk = pParent->Disk;
+		}
+	}
+	if (!Disk && pFree)
+	{
+		// A new key, blocks of a parent that was shared before may be stale, the parent could have been replaced
+		pFree->ParentId = *pParentId;
+		pFree->KeyHash = KeyHash;
+		pFree->References = 1;
+		pFree->Disk = ReadCache_NewDisk();
+		Disk = pFree->Disk;
+	}
+	KeReleaseSpinLock(&ReadCacheParentLock, OldIrql);
+	return Disk;
+}
+
+VOID ReadCache_CloseShared(ULONG64 Disk)
+{
+	BOOLEAN Last = FALSE;
+	ULONG i = 0;
+	KIRQL OldIrql;
+
+	KeAcquireSpinLock(&ReadCacheParentLock, &OldIrql);
+	for (i = 0; i < READ_CACHE_PARENTS; ++i)
+	{
+		if (ReadCacheParents[i].Disk == Disk)
+		{
+			Last = 0 == --ReadCacheParents[i].References;
+			if (Last)
+				ReadCacheParents[i].Disk = 0;
+			break;
+		}
+	}
+	KeReleaseSpinLock(&ReadCacheParentLock, OldIrql);
+	// No clone opens the key any more, the next one gets a new key
+	if (Last)
+		ReadCache_DropDisk(Disk);
+}
+
+BOOLEAN ReadCache_Read(ULONG64 Disk, ULONG64 Offset, ULONG Length, _Out_writes_bytes_(Length) PUCHAR pBuffer)
+{
+	ULONG64 Block = Offset / READ_CACHE_BLOCK_SIZE;
+	ULONG Copied = 0;
+	KIRQL OldIrql;
+
+	for (Copied = 0; Copied < Length; Copied += READ_CACHE_BLOCK_SIZE, ++Block)
+	{
+		READ_CACHE_SHARD *pShard = ReadCache_Shard(Disk, Block);
+		const VOID *pData = NULL;
+
+		KeAcquireSpinLock(&pShard->Lock, &OldIrql);
+		pData = BlockCache_Lookup(&pShard->Cache, Disk, Block);
+		if (pData)
+			RtlCopyMemory(pBuffer + Copied, pData, READ_CACHE_BLOCK_SIZE);
+		KeReleaseSpinLock(&pShard->Lock, OldIrql);
+		// The blocks copied so far are overwritten by the read sent to the disk
+		if (!pData)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+ULONG ReadCache_Fill(ULONG64 Disk, ULONG64 Offset, ULONG Length, _In_reads_bytes_(Length) const UCHAR *pBuffer,
+	ULONG64 StartTsc)
+{
+	ULONG64 Block = Offset / READ_CACHE_BLOCK_SIZE;
+	ULONG Filled = 0, Copied = 0;
+	KIRQL OldIrql;
+
+	for (Copied = 0; Copied < Length; Copied += READ_CACHE_BLOCK_SIZE, ++Block)
+	{
+		READ_CACHE_SHARD *pShard = ReadCache_Shard(Disk, Block);
+		VOID *pData = NULL;
+
+		KeAcquireSpinLock(&pShard->Lock, &OldIrql);
+		pData = BlockCache_Fill(&pShard->Cache, Disk, Block, StartTsc);
+		if (pData)
+		{
+			RtlCopyMemory(pData, pBuffer + Copied, READ_CACHE_BLOCK_SIZE);
+			++Filled;
+		}
+		KeReleaseSpinLock(&pShard->Lock, OldIrql);
+	}
+	return Filled;
+}
+
+VOID ReadCache_Invalidate(ULONG64 Disk, ULONG64 Offset, ULONG Length)
+{
+	ULONG64 Block = Offset / READ_CACHE_BLOCK_SIZE;
+	ULONG64 End = (Offset + Length + READ_CACHE_BLOCK_SIZE - 1) / READ_CACHE_BLOCK_SIZE;
+	KIRQL OldIrql;
+
+	if (!pReadCacheShards)
+		return;
+	for (; Block < End; ++Block)
+	{
+		READ_CACHE_SHARD *pShard = ReadCache_Shard(Disk, Block);
+
+		KeAcquireSpinLock(&pShard->Lock, &OldIrql);
+		// Read under the lock, so a read started after the stamp is taken fills after it is stored
+		BlockCache_Invalidate(&pShard->Cache, Disk, Block, ReadTimeStampCounter());
+		KeReleaseSpinLock(&pShard->Lock, OldIrql);
+	}
+}
+
+VOID ReadCache_DropDisk(ULONG64 Disk)
+{
+	ULONG i = 0;
+	KIRQL OldIrql;
+
+	if (!pReadCacheShards)
+		return;
+	for (i = 0; i < READ_CACHE_SHARDS; ++i)
+	{
+		KeAcquireSpinLock(&pReadCacheShards[i].Lock, &OldIrql);
+		BlockCache_DropDisk(&pReadCacheShards[i].Cache, Disk, ReadTimeStampCounter());
+		KeReleaseSpinLock(&pReadCacheShards[i].Lock, OldIrql);
+	}
+}
+
+/** Halves the cache while the system is low on memory, grows it back by an eighth per period once it is not */
+static VOID ReadCache_CheckDpc(PKDPC pDpc, PVOID pDeferredContext, PVOID pSystemArgument1, PVOID pSystemArgument2)
+{
+	UNREFERENCED_PARAMETER(pDpc);
+	UNREFERENCED_PARAMETER(pDeferredContext);
+	UNREFERENCED_PARAMETER(pSystemArgument1);
+	UNREFERENCED_PARAMETER(pSystemArgument2);
+	BOOLEAN LowMemory = 0 != KeReadStateEvent(pReadCacheLowMemory), Shrunk = FALSE;
+	ULONG i = 0;
+
+	for (i = 0; i < READ_CACHE_SHARDS; ++i)
+	{
+		READ_CACHE_SHARD *pShard = &pReadCacheShards[i];
+		ULONG32 Limit = pShard->Cache.Limit;
+
+		if (LowMemory && Limit)
+		{
+			Limit /= 2;
+			Shrunk = TRUE;
+		}
+		else if (!LowMemory && Limit < pShard->Cache.Capacity)
+			Limit += max(pShard->Cache.Capacity / 8, 1);
+		else
+			continue;
+		KeAcquireSpinLockAtDpcLevel(&pShard->Lock);
+		BlockCache_SetLimit(&pShard->Cache, Limit);
+		KeReleaseSpinLockFromDpcLevel(&pShard->Lock);
+	}
+	if (Shrunk)
+		LOG_READ_CACHE(LL_INFO, "Low memory, the read cache keeps %u blocks per shard\n", pReadCacheShards[0].Cache.Limit);
+}
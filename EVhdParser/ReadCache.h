@@ -0,0 +1,45 @@
+#pragma once
+#include <ntifs.h>
+
+/*
+ * Host wide cache of decrypted 4 KiB blocks of encrypted disks, in nonpaged memory. Parameters\ReadCacheMegabytes
+ * sets its size when the driver starts, it is off while the value is 0 or not set. The blocks are spread over
+ * shards by their hash, every shard is a BLOCK_CACHE under its own spin lock. The cache gives back half of its
+ * blocks every second while the system signals low memory and grows back once the condition clears.
+ * Clones of one parent that decrypt with the same key share a key for the blocks they read from the parent.
+ * Parameters\ReadAheadKilobytes sets the largest read-ahead window of the sequential streams of encrypted disks,
+ * read at start as well, read-ahead is off while it is 0 or not set.
+ */
+
+#define READ_CACHE_BLOCK_SIZE   4096
+#define READ_CACHE_SHARDS       16
+/* Parents shared at once */
+#define READ_CACHE_PARENTS      64
+
+NTSTATUS ReadCache_Initialize(_In_ PCUNICODE_STRING pRegistryPath);
+/** Frees every block, the disks are closed */
+VOID ReadCache_Cleanup();
+BOOLEAN ReadCache_Enabled();
+/** Largest read-ahead window in bytes, 0 if read-ahead is off */
+ULONG ReadCache_ReadAheadWindow();
+/** Key of a newly opened disk, disks never share blocks */
+ULONG64 ReadCache_NewDisk();
+/**
+ * Key of the blocks of the parent ParentId shared by its clones that decrypt with the key KeyHash identifies,
+ * 0 if the cache is off or too many parents are shared
+ */
+ULONG64 ReadCache_OpenShared(_In_ const GUID *pParentId, ULONG64 KeyHash);
+/** Releases a key from ReadCache_OpenShared, the blocks are dropped when the last clone releases it */
+VOID ReadCache_CloseShared(ULONG64 Disk);
+/** Copies a read of whole blocks from the cache, TRUE if every block was found and copied */
+BOOLEAN ReadCache_Read(ULONG64 Disk, ULONG64 Offset, ULONG Length, _Out_writes_bytes_(Length) PUCHAR pBuffer);
+/**
+ * Keeps the blocks of a completed read of whole blocks that started at the TSC StartTsc, returns the number of
+ * blocks filled
+ */
+ULONG ReadCache_Fill(ULONG64 Disk, ULONG64 Offset, ULONG Length, _In_reads_bytes_(Length) const UCHAR *pBuffer,
+	ULONG64 StartTsc);
+/** Drops the blocks a write overlaps, called when it starts and again when it completes */
+VOID ReadCache_Invalidate(ULONG64 Disk, ULONG64 Offset, ULONG Length);
+/** Drops every block of a disk, reads in flight do not fill blocks */
+VOID ReadCache_DropDisk(ULONG64 Disk);
@@ -0,0 +1,165 @@
+#pragma once
+/*
+ * Table of the requests waiting for a response of the key service, and the
+ * timer wheel expiring them. The table hashes requests by RequestId into
+ * REQUEST_TABLE_BUCKETS lists, ids are sequential so they spread evenly and
+ * a response finds its request in a short list. Every bucket is locked on
+ * its own by the owner.
+ *
+ * The wheel has REQUEST_TIMER_SLOTS slots of one tick, a request is put into
+ * the slot of its expiration tick and every tick looks at one slot only.
+ * Requests of later revolutions share the slot and stay in it. The owner
+ * serializes the calls on the wheel and signals the expired requests.
+ * Plain C, evhdtool drives it with thousands of outstanding requests and
+ * with a stand-in of the workers of the key service.
+ */
+#include "PortableTypes.h"
+
+#define REQUEST_TABLE_BUCKETS       256
+#define REQUEST_TIMER_SLOTS         64
+
+/** Intrusive circular list, an empty head or an unlinked entry points to itself */
+typedef struct _REQUEST_LINK {
+    struct _REQUEST_LINK *pNext;
+    struct _REQUEST_LINK *pPrev;
+} REQUEST_LINK;
+
+typedef struct _REQUEST_TABLE_ENTRY {
+    /* Link in the bucket of the request */
+    REQUEST_LINK Link;
+    /* Link in the timer wheel slot, unlinked once the request expired */
+    REQUEST_LINK TimerLink;
+    LONG RequestId;
+    ULONG64 ExpirationTick;
+} REQUEST_TABLE_ENTRY;
+
+#define REQUEST_TABLE_ENTRY_OF(pLink, Field) \
+    ((REQUEST_TABLE_ENTRY *)((UCHAR *)(pLink) - FIELD_OFFSET(REQUEST_TABLE_ENTRY, Field)))
+
+typedef struct _REQUEST_TIMER_WHEEL {
+    REQUEST_LINK Slots[REQUEST_TIMER_SLOTS];
+    /* Last tick whose slot was looked at */
+    ULONG64 LastTick;
+    ULONG32 Count;
+} REQUEST_TIMER_WHEEL;
+
+static __inline VOID RequestLink_Initialize(REQUEST_LINK *pLink)
+{
+    pLink->pNext = pLink;
+    pLink->pPrev = pLink;
+}
+
+static __inline BOOLEAN RequestLink_IsEmpty(const REQUEST_LINK *pLink)
+{
+    return pLink->pNext == pLink;
+}
+
+static __inline VOID RequestLink_InsertTail(REQUEST_LINK *pHead, REQUEST_LINK *pLink)
+{
+    pLink->pNext = pHead;
+    pLink->pPrev = pHead->pPrev;
+    pHead->pPrev->pNext = pLink;
+    pHead->pPrev = pLink;
+}
+
+/** Unlinks the entry and leaves it empty, so removing it twice is harmless */
+static __inline VOID RequestLink_Remove(REQUEST_LINK *pLink)
+{
+    pLink->pPrev->pNext = pLink->pNext;
+    pLink->pNext->pPrev = pLink->pPrev;
+    RequestLink_Initialize(pLink);
+}
+
+static __inline ULONG32 RequestTable_Bucket(LONG RequestId)
+{
+    return (ULONG32)RequestId & (REQUEST_TABLE_BUCKETS - 1);
+}
+
+static __inline VOID RequestTable_InitializeEntry(REQUEST_TABLE_ENTRY *pEntry, LONG RequestId)
+{
+    RequestLink_Initialize(&pEntry->Link);
+    RequestLink_Initialize(&pEntry->TimerLink);
+    pEntry->RequestId = RequestId;
+    pEntry->ExpirationTick = 0;
+}
+
+/** Returns the request of the bucket with the id or NULL. Called with the bucket locked */
+static __inline REQUEST_TABLE_ENTRY *RequestTable_Find(REQUEST_LINK *pBucket, LONG RequestId)
+{
+    REQUEST_LINK *pLink = NULL;
+    for (pLink = pBucket->pNext; pLink != pBucket; pLink = pLink->pNext)
+    {
+        REQUEST_TABLE_ENTRY *pEntry = REQUEST_TABLE_ENTRY_OF(pLink, Link);
+        if (pEntry->RequestId == RequestId)
+            return pEntry;
+    }
+    return NULL;
+}
+
+/**
+ * Whether a worker with Outstanding requests, chosen last at LastSelected, takes the next request over the best
+ * one so far. The fewest outstanding requests win, equally loaded workers are used round-robin.
+ */
+static __inline BOOLEAN RequestTable_PreferWorker(LONG Outstanding, ULONG64 LastSelected, LONG BestOutstanding, ULONG64 BestLastSelected)
+{
+    return Outstanding < BestOutstanding || (Outstanding == BestOutstanding && LastSelected < BestLastSelected);
+}
+
+static __inline VOID TimerWheel_Initialize(REQUEST_TIMER_WHEEL *pWheel, ULONG64 CurrentTick)
+{
+    ULONG32 i = 0;
+    for (i = 0; i < REQUEST_TIMER_SLOTS; ++i)
+        RequestLink_Initialize(&pWheel->Slots[i]);
+    pWheel->LastTick = CurrentTick;
+    pWheel->Count = 0;
+}
+
+/**
+ * Arms the timeout of the request, it expires once Ticks whole ticks passed. Returns TRUE if it is the only
+ * request of the wheel, the owner starts its periodic tick then.
+ */
+static __inline BOOLEAN TimerWheel_Insert(REQUEST_TIMER_WHEEL *pWheel, REQUEST_TABLE_ENTRY *pEntry, ULONG64 CurrentTick, ULONG64 Ticks)
+{
+    // +1 so a request never expires before the full timeout elapsed
+    pEntry->ExpirationTick = CurrentTick + Ticks + 1;
+    RequestLink_InsertTail(&pWheel->Slots[pEntry->ExpirationTick & (REQUEST_TIMER_SLOTS - 1)], &pEntry->TimerLink);
+    return ++pWheel->Count == 1;
+}
+
+/** Disarms the timeout of a request that did not expire yet */
+static __inline VOID TimerWheel_Remove(REQUEST_TIMER_WHEEL *pWheel, REQUEST_TABLE_ENTRY *pEntry)
+{
+    if (RequestLink_IsEmpty(&pEntry->TimerLink))
+        return;
+    RequestLink_Remove(&pEntry->TimerLink);
+    --pWheel->Count;
+}
+
+/**
+ * Moves the requests expired by CurrentTick from the slots passed since the last call to the Expired list,
+ * linked through their TimerLink. The owner unlinks and signals them before it releases the wheel.
+ */
+static __inline VOID TimerWheel_Expire(REQUEST_TIMER_WHEEL *pWheel, ULONG64 CurrentTick, REQUEST_LINK *pExpired)
+{
+    // A whole revolution covers every slot, older ticks have nothing left to look at
+    if (CurrentTick - pWheel->LastTick > REQUEST_TIMER_SLOTS)
+        pWheel->LastTick = CurrentTick - REQUEST_TIMER_SLOTS;
+
+    while (pWheel->LastTick < CurrentTick)
+    {
+        REQUEST_LINK *pSlot = &pWheel->Slots[++pWheel->LastTick & (REQUEST_TIMER_SLOTS - 1)];
+        REQUEST_LINK *pLink = pSlot->pNext;
+        while (pLink != pSlot)
+        {
+            REQUEST_TABLE_ENTRY *pEntry = REQUEST_TABLE_ENTRY_OF(pLink, TimerLink);
+            pLink = pLink->pNext;
+            // Entries of later revolutions share the slot
+            if (pEntry->ExpirationTick <= CurrentTick)
+            {
+                RequestLink_Remove(&pEntry->TimerLink);
+                RequestLink_InsertTail(pExpired, &pEntry->TimerLink);
+                --pWheel->Count;
+            }
+        }
+    }
+}
@@ -0,0 +1,149 @@
+#pragma once
+/*
+ * Responses of a disk to the SCSI commands guests send in bursts at boot and
+ * on every rescan: TEST UNIT READY, INQUIRY, READ CAPACITY (10 and 16),
+ * MODE SENSE (6 and 10) and REPORT LUNS. They do not change the disk and get
+ * the same answer until its size, medium or mode pages change. The first
+ * successful completion of a command fills an entry keyed by its CDB and
+ * transfer length, identical commands are then answered from the entry
+ * without going to vhdmp. Entries are replaced round robin.
+ *
+ * The owner invalidates the cache on resize, media change and dismount, the
+ * completion of a command that changes the disk or reports a check condition
+ * invalidates it as well. A command sent before an invalidation may complete
+ * with the old answer, so nothing is kept until the commands in flight at
+ * the time have completed.
+ * The caller serializes all calls. Plain C, evhdtool simulates a boot storm
+ * with it.
+ */
+#include "PortableTypes.h"
+
+#define SCSI_CACHE_ENTRIES          16
+#define SCSI_CACHE_CDB_SIZE         16
+/* Longer responses are not kept */
+#define SCSI_CACHE_DATA_SIZE        256
+
+#define SCSI_CACHE_STATUS_GOOD      0x00
+#define SCSI_CACHE_STATUS_CHECK     0x02
+
+typedef struct _SCSI_CACHE_ENTRY {
+    UCHAR Cdb[SCSI_CACHE_CDB_SIZE];
+    UCHAR CdbLength;
+    UCHAR Valid;
+    /* SrbStatus and sense length the command completed with */
+    UCHAR SrbStatus;
+    UCHAR SenseLength;
+    /* Transfer length asked for and returned */
+    ULONG32 RequestLength;
+    ULONG32 DataLength;
+    UCHAR Data[SCSI_CACHE_DATA_SIZE];
+} SCSI_CACHE_ENTRY;
+
+typedef struct _SCSI_CACHE {
+    /* Cacheable commands sent to the disk and not completed yet */
+    ULONG32 Outstanding;
+    /* Set by an invalidation while commands were outstanding, cleared when the last one completes */
+    BOOLEAN Blocked;
+    ULONG32 Next;
+    ULONG64 Invalidations;
+    SCSI_CACHE_ENTRY Entries[SCSI_CACHE_ENTRIES];
+} SCSI_CACHE;
+
+/** TRUE for the commands whose responses are kept */
+static __inline BOOLEAN ScsiCache_IsCacheable(const UCHAR *Cdb, UCHAR CdbLength)
+{
+    if (!CdbLength || CdbLength > SCSI_CACHE_CDB_SIZE)
+        return FALSE;
+    switch (Cdb[0])
+    {
+    case 0x00:  // TEST UNIT READY
+    case 0x12:  // INQUIRY
+    case 0x1A:  // MODE SENSE 6
+    case 0x25:  // READ CAPACITY 10
+    case 0x5A:  // MODE SENSE 10
+    case 0xA0:  // REPORT LUNS
+        return TRUE;
+    case 0x9E:  // SERVICE ACTION IN 16, only READ CAPACITY 16
+        return 0x10 == (Cdb[1] & 0x1F);
+    }
+    return FALSE;
+}
+
+/** TRUE if the completion of a command makes the kept responses stale */
+static __inline BOOLEAN ScsiCache_Invalidates(const UCHAR *Cdb, UCHAR ScsiStatus)
+{
+    if (SCSI_CACHE_STATUS_CHECK == ScsiStatus)
+        return TRUE;
+    switch (Cdb[0])
+    {
+    case 0x04:  // FORMAT UNIT
+    case 0x15:  // MODE SELECT 6
+    case 0x1B:  // START STOP UNIT
+    case 0x55:  // MODE SELECT 10
+        return TRUE;
+    }
+    return FALSE;
+}
+
+static __inline VOID ScsiCache_Initialize(SCSI_CACHE *pCache)
+{
+    memset(pCache, 0, sizeof(SCSI_CACHE));
+}
+
+/** Entry answering the command, NULL if there is none */
+static __inline const SCSI_CACHE_ENTRY *ScsiCache_Find(const SCSI_CACHE *pCache, const UCHAR *Cdb, UCHAR CdbLength,
+    ULONG32 RequestLength)
+{
+    ULONG32 i = 0;
+
+    for (i = 0; i < SCSI_CACHE_ENTRIES; ++i)
+    {
+        const SCSI_CACHE_ENTRY *pEntry = &pCache->Entries[i];
+        if (pEntry->Valid && pEntry->CdbLength == CdbLength && pEntry->RequestLength == RequestLength &&
+            0 == memcmp(pEntry->Cdb, Cdb, CdbLength))
+            return pEntry;
+    }
+    return NULL;
+}
+
+/** Counts a cacheable command sent to the disk, every one must be followed by ScsiCache_Complete */
+static __inline VOID ScsiCache_Sent(SCSI_CACHE *pCache)
+{
+    ++pCache->Outstanding;
+}
+
+static __inline VOID ScsiCache_Invalidate(SCSI_CACHE *pCache)
+{
+    ULONG32 i = 0;
+
+    for (i = 0; i < SCSI_CACHE_ENTRIES; ++i)
+        pCache->Entries[i].Valid = FALSE;
+    pCache->Blocked = 0 != pCache->Outstanding;
+    ++pCache->Invalidations;
+}
+
+/**
+ * Counts the completion of a cacheable command and keeps its response if it succeeded. SrbStatus is the
+ * status without the flag bits, pData holds DataLength bytes of the response.
+ */
+static __inline VOID ScsiCache_Complete(SCSI_CACHE *pCache, const UCHAR *Cdb, UCHAR CdbLength, ULONG32 RequestLength,
+    UCHAR SrbStatus, UCHAR ScsiStatus, UCHAR SenseLength, const VOID *pData, ULONG32 DataLength, BOOLEAN Succeeded)
+{
+    if (Succeeded && !pCache->Blocked && SCSI_CACHE_STATUS_GOOD == ScsiStatus && DataLength <= RequestLength &&
+        DataLength <= SCSI_CACHE_DATA_SIZE && (pData || !DataLength) &&
+        !ScsiCache_Find(pCache, Cdb, CdbLength, RequestLength))
+    {
+        SCSI_CACHE_ENTRY *pEntry = &pCache->Entries[pCache->Next++ % SCSI_CACHE_ENTRIES];
+        memcpy(pEntry->Cdb, Cdb, CdbLength);
+        pEntry->CdbLength = CdbLength;
+        pEntry->SrbStatus = SrbStatus;
+        pEntry->SenseLength = SenseLength;
+        pEntry->RequestLength = RequestLength;
+        pEntry->DataLength = DataLength;
+        if (DataLength)
+            memcpy(pEntry->Data, pData, DataLength);
+        pEntry->Valid = TRUE;
+    }
+    if (pCache->Outstanding && 0 == --pCache->Outstanding)
+        pCache->Blocked = FALSE;
+}
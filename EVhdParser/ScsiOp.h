@@ -60,6 +60,7 @@ typedef enum _SCSI_OP_CODE {
 	SCSI_OP_CODE_WRITE_LONG_10 = 0x3F,
 	SCSI_OP_CODE_CHANGE_DEFINITION = 0x40,
 	SCSI_OP_CODE_WRITE_SAME_10 = 0x41,
+	SCSI_OP_CODE_UNMAP = 0x42,
 	SCSI_OP_CODE_READ_TOC_PMA_ATIP = 0x43,
 	SCSI_OP_CODE_REPORT_DENSITY_SUPPORT = 0x44,
 	SCSI_OP_CODE_PLAY_AUDIO_10 = 0x45,
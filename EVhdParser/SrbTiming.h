@@ -0,0 +1,147 @@
+#pragma once
+/*
+ * Stage timing of SCSI requests. When it is enabled the parser reserves an
+ * SRB_TIMING in the inner buffer of every request, right after the vhdmp
+ * extension, and the parser and the extension write a TSC stamp into it as
+ * the request passes each stage. Nothing is allocated per request. When the
+ * request is handed back to the VSP the stamps are turned into the time spent
+ * in every stage and counted in per-processor histograms of the disk.
+ * Plain C, evhdtool checks and measures the aggregation outside of the kernel.
+ */
+#include "PortableTypes.h"
+
+/* Points in the life of a request a stamp is taken at */
+#define SRB_STAMP_ENTRY             0   /* EVhd_ExecuteScsiRequestDisk called */
+#define SRB_STAMP_EXT_START         1   /* Ext_StartScsiRequest called */
+#define SRB_STAMP_CRYPT_START       2   /* Encryption of written data started, after the bounce pages were allocated */
+#define SRB_STAMP_CRYPT_END         3
+#define SRB_STAMP_START_IO          4   /* Request passed to vhdmp */
+#define SRB_STAMP_VHDMP_COMPLETE    5   /* Request completed by vhdmp */
+#define SRB_STAMP_DECRYPT_START     6   /* Decryption of read data */
+#define SRB_STAMP_DECRYPT_END       7
+#define SRB_STAMP_VSTOR_COMPLETE    8   /* Request handed back to the VSP */
+#define SRB_STAMP_MAX               9
+
+/*
+ * Stage N is the time from the last stamp taken before stamp N to stamp N, stamps a request does not
+ * pass are skipped. Stage 0 is the whole request, from entry to the VSP completion.
+ */
+#define SRB_STAGE_TOTAL             0
+#define SRB_STAGE_MAX               SRB_STAMP_MAX
+
+/*
+ * HDR-style histogram: four sub-buckets per power of two of 16 ticks, so a bucket is at most 25% wide.
+ * Buckets 0 to 3 count below 64 ticks, the last one also everything longer than its range.
+ */
+#define SRB_STAGE_SHIFT             4
+#define SRB_STAGE_SUB_BITS          2
+#define SRB_STAGE_BUCKETS           128
+
+typedef struct _SRB_TIMING {
+    /* 0 for the stages the request did not pass */
+    ULONG64 Tsc[SRB_STAMP_MAX];
+} SRB_TIMING;
+
+typedef struct _SRB_STAGE_COUNTERS {
+    /* Requests that passed each stage and the ticks they spent in it */
+    ULONG64 Count[SRB_STAGE_MAX];
+    ULONG64 Ticks[SRB_STAGE_MAX];
+    /* Requests whose stamps went backwards, they were completed on a processor with a skewed TSC */
+    ULONG64 Skewed;
+    ULONG64 Reserved[5];
+    ULONG64 Histogram[SRB_STAGE_MAX][SRB_STAGE_BUCKETS];
+} SRB_STAGE_COUNTERS;
+
+C_ASSERT(sizeof(SRB_STAGE_COUNTERS) % 64 == 0);
+
+static __inline ULONG32 SrbTiming_Bucket(ULONG64 Ticks)
+{
+    ULONG64 Units = Ticks >> SRB_STAGE_SHIFT;
+    ULONG32 Msb = 0;
+
+    if (Units < (1 << SRB_STAGE_SUB_BITS))
+        return (ULONG32)Units;
+#if defined(_MSC_VER)
+    {
+        unsigned long Index = 0;
+        _BitScanReverse64(&Index, Units);
+        Msb = Index;
+    }
+#else
+    Msb = 63 - __builtin_clzll(Units);
+#endif
+    if (Msb > SRB_STAGE_BUCKETS >> SRB_STAGE_SUB_BITS)
+        return SRB_STAGE_BUCKETS - 1;
+    // The bits below the leading one select the sub-bucket
+    return ((Msb - SRB_STAGE_SUB_BITS + 1) << SRB_STAGE_SUB_BITS) +
+        (ULONG32)((Units >> (Msb - SRB_STAGE_SUB_BITS)) & ((1 << SRB_STAGE_SUB_BITS) - 1));
+}
+
+/** Smallest number of ticks counted by a bucket */
+static __inline ULONG64 SrbTiming_BucketStart(ULONG32 Bucket)
+{
+    ULONG32 Power = Bucket >> SRB_STAGE_SUB_BITS;
+    ULONG64 Sub = Bucket & ((1 << SRB_STAGE_SUB_BITS) - 1);
+
+    if (Power == 0)
+        return Sub << SRB_STAGE_SHIFT;
+    return (((1ULL << SRB_STAGE_SUB_BITS) | Sub) << (Power - 1)) << SRB_STAGE_SHIFT;
+}
+
+static __inline VOID SrbTiming_Start(SRB_TIMING *pTiming, ULONG64 Tsc)
+{
+    memset(pTiming, 0, sizeof(SRB_TIMING));
+    pTiming->Tsc[SRB_STAMP_ENTRY] = Tsc;
+}
+
+static __inline VOID SrbTiming_Count(SRB_STAGE_COUNTERS *pCounters, ULONG32 Stage, ULONG64 Ticks)
+{
+    ++pCounters->Count[Stage];
+    pCounters->Ticks[Stage] += Ticks;
+    ++pCounters->Histogram[Stage][SrbTiming_Bucket(Ticks)];
+}
+
+/**
+ * Counts the stages of a completed request. Requests missing the entry or the completion stamp are ignored,
+ * requests with a stamp older than the one before it are only counted as skewed.
+ */
+static __inline VOID SrbTiming_Aggregate(SRB_STAGE_COUNTERS *pCounters, const SRB_TIMING *pTiming)
+{
+    ULONG64 Previous = pTiming->Tsc[SRB_STAMP_ENTRY];
+    ULONG32 Stamp = 0;
+
+    if (!Previous || !pTiming->Tsc[SRB_STAMP_VSTOR_COMPLETE])
+        return;
+    for (Stamp = SRB_STAMP_ENTRY + 1; Stamp < SRB_STAMP_MAX; ++Stamp)
+    {
+        if (!pTiming->Tsc[Stamp])
+            continue;
+        if (pTiming->Tsc[Stamp] < Previous)
+        {
+            ++pCounters->Skewed;
+            return;
+        }
+        Previous = pTiming->Tsc[Stamp];
+    }
+
+    Previous = pTiming->Tsc[SRB_STAMP_ENTRY];
+    for (Stamp = SRB_STAMP_ENTRY + 1; Stamp < SRB_STAMP_MAX; ++Stamp)
+    {
+        if (!pTiming->Tsc[Stamp])
+            continue;
+        SrbTiming_Count(pCounters, Stamp, pTiming->Tsc[Stamp] - Previous);
+        Previous = pTiming->Tsc[Stamp];
+    }
+    SrbTiming_Count(pCounters, SRB_STAGE_TOTAL, Previous - pTiming->Tsc[SRB_STAMP_ENTRY]);
+}
+
+/** Adds the counters of one processor to a total */
+static __inline VOID SrbTiming_Add(SRB_STAGE_COUNTERS *pTotal, const SRB_STAGE_COUNTERS *pCounters)
+{
+    ULONG64 *pTo = (ULONG64 *)pTotal;
+    const ULONG64 *pFrom = (const ULONG64 *)pCounters;
+    ULONG32 i = 0;
+
+    for (i = 0; i < sizeof(SRB_STAGE_COUNTERS) / sizeof(ULONG64); ++i)
+        pTo[i] += pFrom[i];
+}
@@ -0,0 +1,364 @@
+#include "stdafx.h"
+#include "Log.h"
+
+#define TRACE_FILE_SUFFIX L".etr"
+#define TRACE_ROTATED_SUFFIX L".001"
+
+__declspec(allocate(".evtr$a")) static TRACE_CALLSITE TraceCallsitesStart = { 0 };
+__declspec(allocate(".evtr$z")) static TRACE_CALLSITE TraceCallsitesEnd = { 0 };
+
+static const ULONG TraceAllocationTag = 'RTVE';
+static PWSTR TraceFileName = NULL;
+/* Serializes changes of the call site modes */
+static FAST_MUTEX TraceCallsitesMutex;
+static BOOLEAN TraceCallsitesActive = FALSE;
+/* Owned by the flusher */
+static HANDLE TraceFile = NULL;
+static LONGLONG TraceFileSize = 0;
+
+static VOID Trace_FillSync(_Out_ TRACE_RECORD *pRecord)
+{
+	LARGE_INTEGER SystemTime, LocalTime;
+
+	RtlZeroMemory(pRecord, TRACE_SYNC_SIZE);
+	pRecord->Size = TRACE_SYNC_SIZE;
+	pRecord->Type = TRACE_RECORD_SYNC;
+	pRecord->Tsc = ReadTimeStampCounter();
+	KeQuerySystemTime(&SystemTime);
+	ExSystemTimeToLocalTime(&SystemTime, &LocalTime);
+	*(ULONG64 *)(pRecord + 1) = LocalTime.QuadPart;
+}
+
+/** Keeps the previous trace under the .001 suffix, the call site table of a new file may differ from it */
+static VOID Trace_RotateFile()
+{
+	NTSTATUS Status = STATUS_SUCCESS;
+	HANDLE hFile = NULL;
+	OBJECT_ATTRIBUTES fAttrs;
+	UNICODE_STRING FileName;
+	IO_STATUS_BLOCK StatusBlock = { 0 };
+	FILE_RENAME_INFORMATION *RenameBuffer = NULL;
+	LPCWSTR BaseFileName = wcsrchr(TraceFileName, L'\\');
+	ULONG FileNameLength = 0;
+
+	BaseFileName = BaseFileName ? BaseFileName + 1 : TraceFileName;
+	FileNameLength = (ULONG)(wcslen(BaseFileName) + wcslen(TRACE_ROTATED_SUFFIX) + 1) * sizeof(WCHAR);
+
+	RtlInitUnicodeString(&FileName, TraceFileName);
+	InitializeObjectAttributes(&fAttrs, &FileName, OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, NULL, NULL);
+	Status = ZwOpenFile(&hFile, DELETE, &fAttrs, &StatusBlock, 0, 0);
+	if (!NT_SUCCESS(Status))
+		return;
+
+	RenameBuffer = ExAllocatePoolWithTag(PagedPool, FileNameLength + FIELD_OFFSET(FILE_RENAME_INFORMATION, FileName),
+		TraceAllocationTag);
+	if (RenameBuffer)
+	{
+		RenameBuffer->ReplaceIfExists = TRUE;
+		RenameBuffer->RootDirectory = NULL;
+		RenameBuffer->FileNameLength = FileNameLength - sizeof(WCHAR);
+		if (SUCCEEDED(StringCbPrintf(RenameBuffer->FileName, FileNameLength, L"%ws%ws", BaseFileName, TRACE_ROTATED_SUFFIX)))
+		{
+			ZwSetInformationFile(hFile, &StatusBlock, RenameBuffer,
+				FileNameLength + FIELD_OFFSET(FILE_RENAME_INFORMATION, FileName), FileRenameInformation);
+		}
+		ExFreePoolWithTag(RenameBuffer, TraceAllocationTag);
+	}
+
+	ZwClose(hFile);
+}
+
+/** Starts a new trace file with the call site table and a first sync record */
+static NTSTATUS Trace_OpenFile()
+{
+	NTSTATUS Status = STATUS_SUCCESS;
+	OBJECT_ATTRIBUTES fAttrs;
+	UNICODE_STRING FileName;
+	IO_STATUS_BLOCK StatusBlock = { 0 };
+	TRACE_CALLSITE *pSite = NULL;
+	TRACE_FILE_HEADER *pHeader = NULL;
+	ULONG32 Size = sizeof(TRACE_FILE_HEADER) + TRACE_SYNC_SIZE, Used = sizeof(TRACE_FILE_HEADER), Length = 0;
+
+	if (TraceFile)
+	{
+		ZwClose(TraceFile);
+		TraceFile = NULL;
+	}
+	Trace_RotateFile();
+
+	// Padding the linker may put between call sites is left zeroed
+	for (pSite = &TraceCallsitesStart + 1; pSite < &TraceCallsitesEnd; ++pSite)
+		if (pSite->Format)
+			Size += TRACE_ALIGN(sizeof(TRACE_CALLSITE_ENTRY) + strlen(pSite->Function) + strlen(pSite->Format) + 2);
+
+	pHeader = ExAllocatePoolWithTag(PagedPool, Size, TraceAllocationTag);
+	if (!pHeader)
+		return STATUS_INSUFFICIENT_RESOURCES;
+
+	RtlZeroMemory(pHeader, sizeof(TRACE_FILE_HEADER));
+	pHeader->Magic = TRACE_FILE_MAGIC;
+	pHeader->Version = TRACE_FILE_VERSION;
+	for (pSite = &TraceCallsitesStart + 1; pSite < &TraceCallsitesEnd; ++pSite)
+	{
+		if (!pSite->Format)
+			continue;
+		Length = Trace_WriteCallsiteEntry((UCHAR *)pHeader + Used, Size - Used - TRACE_SYNC_SIZE,
+			(ULONG32)(pSite - &TraceCallsitesStart), pSite);
+		if (!Length)
+			continue;
+		Used += Length;
+		++pHeader->CallsiteCount;
+	}
+	pHeader->TableSize = Used - sizeof(TRACE_FILE_HEADER);
+	Trace_FillSync((TRACE_RECORD *)((UCHAR *)pHeader + Used));
+	Used += TRACE_SYNC_SIZE;
+
+	RtlInitUnicodeString(&FileName, TraceFileName);
+	InitializeObjectAttributes(&fAttrs, &FileName, OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, NULL, NULL);
+	Status = ZwCreateFile(&TraceFile, GENERIC_WRITE | SYNCHRONIZE, &fAttrs,
+		&StatusBlock, NULL, FILE_ATTRIBUTE_NORMAL, FILE_SHARE_READ | FILE_SHARE_DELETE, FILE_OVERWRITE_IF,
+		FILE_SYNCHRONOUS_IO_NONALERT | FILE_SEQUENTIAL_ONLY, NULL, 0);
+	if (!NT_SUCCESS(Status))
+	{
+		TraceFile = NULL;
+		goto Cleanup;
+	}
+
+	Status = ZwWriteFile(TraceFile, NULL, NULL, NULL, &StatusBlock, pHeader, Used, NULL, NULL);
+	TraceFileSize = Used;
+
+Cleanup:
+	ExFreePoolWithTag(pHeader, TraceAllocationTag);
+
+	return Status;
+}
+
+static VOID Trace_UpdateCallsiteNoLock(_Inout_ TRACE_CALLSITE *pSite)
+{
+	UCHAR Enabled = TRACE_SITE_OFF;
+
+	if (TraceCallsitesActive)
+	{
+		switch (pSite->Mode)
+		{
+		case TracepointDefault:
+			if (pSite->Level <= LogSettings.LogLevel && (LogSettings.LogCategories & pSite->Category) == pSite->Category)
+				Enabled = TRACE_SITE_ON;
+			break;
+		case TracepointOn:
+			Enabled = TRACE_SITE_ON;
+			break;
+		case TracepointSample:
+		case TracepointRateLimit:
+			Enabled = TRACE_SITE_LIMITED;
+			break;
+		}
+	}
+
+	pSite->Enabled = Enabled;
+}
+
+VOID Trace_InitializeCallsites()
+{
+	ExInitializeFastMutex(&TraceCallsitesMutex);
+}
+
+VOID Trace_UpdateCallsites(BOOLEAN Active)
+{
+	TRACE_CALLSITE *pSite = NULL;
+
+	ExAcquireFastMutex(&TraceCallsitesMutex);
+	TraceCallsitesActive = Active;
+	for (pSite = &TraceCallsitesStart + 1; pSite < &TraceCallsitesEnd; ++pSite)
+		if (pSite->Format)
+			Trace_UpdateCallsiteNoLock(pSite);
+	ExReleaseFastMutex(&TraceCallsitesMutex);
+}
+
+NTSTATUS Trace_SetTracepoint(_In_ TRACEPOINT_REQUEST *pRequest)
+{
+	TRACE_CALLSITE *pSite = NULL;
+	ULONG Matched = 0;
+
+	if (pRequest->Mode >= TracepointModeMax || !SUCCEEDED(StringCbLengthA(pRequest->Function, sizeof(pRequest->Function), NULL)))
+		return STATUS_INVALID_PARAMETER;
+	if ((pRequest->Mode == TracepointSample || pRequest->Mode == TracepointRateLimit) && !pRequest->Rate)
+		return STATUS_INVALID_PARAMETER;
+
+	ExAcquireFastMutex(&TraceCallsitesMutex);
+	for (pSite = &TraceCallsitesStart + 1; pSite < &TraceCallsitesEnd; ++pSite)
+	{
+		if (!pSite->Format)
+			continue;
+		if (pRequest->Id != TRACEPOINT_ALL_SITES && pRequest->Id != (ULONG32)(pSite - &TraceCallsitesStart))
+			continue;
+		if (pRequest->CategoryMask && !(pRequest->CategoryMask & pSite->Category))
+			continue;
+		if (pRequest->Function[0] && strcmp(pRequest->Function, pSite->Function))
+			continue;
+
+		// Producers that still see the old guard use the old or the new limits, both are valid
+		pSite->Enabled = TRACE_SITE_OFF;
+		KeMemoryBarrier();
+		pSite->Rate = pRequest->Rate;
+		pSite->Burst = pRequest->Burst;
+		pSite->ArrivalTime = 0;
+		pSite->Mode = pRequest->Mode;
+		KeMemoryBarrier();
+		Trace_UpdateCallsiteNoLock(pSite);
+		++Matched;
+	}
+	ExReleaseFastMutex(&TraceCallsitesMutex);
+
+	return Matched ? STATUS_SUCCESS : STATUS_NOT_FOUND;
+}
+
+NTSTATUS Trace_QueryTracepoints(_Out_writes_bytes_(Length) TRACEPOINT_LIST *pList, ULONG Length, _Out_ ULONG_PTR *pInformation)
+{
+	TRACE_CALLSITE *pSite = NULL;
+	ULONG Capacity = 0, Count = 0;
+
+	*pInformation = 0;
+	if (Length < FIELD_OFFSET(TRACEPOINT_LIST, Sites))
+		return STATUS_BUFFER_TOO_SMALL;
+	Capacity = (Length - FIELD_OFFSET(TRACEPOINT_LIST, Sites)) / sizeof(TRACEPOINT_INFO);
+
+	ExAcquireFastMutex(&TraceCallsitesMutex);
+	for (pSite = &TraceCallsitesStart + 1; pSite < &TraceCallsitesEnd; ++pSite)
+	{
+		TRACEPOINT_INFO *pInfo = NULL;
+		if (!pSite->Format)
+			continue;
+		if (Count++ >= Capacity)
+			continue;
+
+		pInfo = &pList->Sites[Count - 1];
+		RtlZeroMemory(pInfo, sizeof(TRACEPOINT_INFO));
+		pInfo->Id = (ULONG32)(pSite - &TraceCallsitesStart);
+		pInfo->Line = pSite->Line;
+		pInfo->Level = pSite->Level;
+		pInfo->Category = pSite->Category;
+		pInfo->Enabled = pSite->Enabled;
+		pInfo->Mode = pSite->Mode;
+		pInfo->Rate = pSite->Rate;
+		pInfo->Burst = pSite->Burst;
+		pInfo->Evaluated = pSite->Evaluated;
+		pInfo->Suppressed = pSite->Suppressed;
+		if (pSite->Mode == TracepointSample && pSite->Rate)
+			pInfo->Suppressed = pSite->Evaluated - (pSite->Evaluated + pSite->Rate - 1) / pSite->Rate;
+		StringCbCopyA(pInfo->Function, sizeof(pInfo->Function), pSite->Function);
+	}
+	ExReleaseFastMutex(&TraceCallsitesMutex);
+
+	pList->Count = Count;
+	pList->Reserved = 0;
+	*pInformation = FIELD_OFFSET(TRACEPOINT_LIST, Sites) + min(Count, Capacity) * sizeof(TRACEPOINT_INFO);
+
+	return STATUS_SUCCESS;
+}
+
+BOOLEAN Trace_Admit(_Inout_ TRACE_CALLSITE *pSite)
+{
+	if (pSite->Mode == TracepointSample)
+		return Trace_AdmitSample(pSite);
+	return Trace_AdmitRate(pSite, KeQueryInterruptTime());
+}
+
+NTSTATUS Trace_Initialize(_In_ PCWSTR pszLogFileName)
+{
+	SIZE_T Size = (wcslen(pszLogFileName) + wcslen(TRACE_FILE_SUFFIX) + 1) * sizeof(WCHAR);
+
+	// The file is created by the flusher once the binary backend is used
+	TraceFileName = ExAllocatePoolWithTag(PagedPool, Size, TraceAllocationTag);
+	if (!TraceFileName)
+		return STATUS_INSUFFICIENT_RESOURCES;
+
+	return StringCbPrintf(TraceFileName, Size, L"%ws%ws", pszLogFileName, TRACE_FILE_SUFFIX);
+}
+
+VOID Trace_Cleanup()
+{
+	if (TraceFile)
+	{
+		ZwClose(TraceFile);
+		TraceFile = NULL;
+	}
+
+	if (TraceFileName)
+	{
+		ExFreePoolWithTag(TraceFileName, TraceAllocationTag);
+		TraceFileName = NULL;
+	}
+}
+
+NTSTATUS Trace_WriteBatch(_Inout_ CHAR *pBatch, ULONG Length)
+{
+	NTSTATUS Status = STATUS_SUCCESS;
+	IO_STATUS_BLOCK StatusBlock;
+
+	if (!TraceFileName)
+		return STATUS_INVALID_DEVICE_STATE;
+
+	if (!TraceFile || TraceFileSize >= LogSettings.MaxFileSize)
+	{
+		Status = Trace_OpenFile();
+		if (!NT_SUCCESS(Status))
+			return Status;
+	}
+
+	Trace_FillSync((TRACE_RECORD *)(pBatch + Length));
+	Length += TRACE_SYNC_SIZE;
+
+	Status = ZwWriteFile(TraceFile, NULL, NULL, NULL, &StatusBlock, pBatch, Length, NULL, NULL);
+	if (NT_SUCCESS(Status))
+		TraceFileSize += Length;
+
+	return Status;
+}
+
+VOID Trace_Write(_Inout_ TRACE_CALLSITE *pSite, ...)
+{
+	LOG_RING *pRing = NULL;
+	LOG_RING_SLOT *pSlot = NULL;
+	TRACE_RECORD *pRecord = NULL;
+	ULONG32 Encoded = 0, Length = 0;
+	va_list args;
+
+	if (!pSite->Parsed)
+	{
+		// Concurrent first uses parse the same format to the same types
+		pSite->ArgCount = (UCHAR)Trace_ParseFormat(pSite->Format, pSite->ArgTypes, TRACE_MAX_ARGS);
+		KeMemoryBarrier();
+		pSite->Parsed = TRUE;
+	}
+
+#if DBG
+	if (pSite->Level == LL_FATAL)
+		DbgBreakPointWithStatus(DBG_STATUS_FATAL);
+#endif
+
+	pSlot = Log_BeginSlot(&pRing);
+	if (!pSlot)
+		return;
+
+	pRecord = (TRACE_RECORD *)pSlot->Data;
+	pRecord->Type = TRACE_RECORD_EVENT;
+	pRecord->Irql = KeGetCurrentIrql();
+	pRecord->CallsiteId = (ULONG32)(pSite - &TraceCallsitesStart);
+	pRecord->Tsc = ReadTimeStampCounter();
+	pRecord->ProcessId = (USHORT)((ULONG_PTR)PsGetCurrentProcessId() & 0xFFFF);
+	pRecord->ThreadId = (USHORT)((ULONG_PTR)PsGetCurrentThreadId() & 0xFFFF);
+	pRecord->Processor = (USHORT)KeGetCurrentProcessorNumberEx(NULL);
+	pRecord->Reserved = 0;
+
+	va_start(args, pSite);
+	Length = Trace_EncodeArgs((UCHAR *)(pRecord + 1), sizeof(pSlot->Data) - sizeof(TRACE_RECORD),
+		pSite->ArgTypes, pSite->ArgCount, &Encoded, args);
+	va_end(args);
+
+	pRecord->ArgCount = (UCHAR)Encoded;
+	pRecord->Size = (USHORT)(sizeof(TRACE_RECORD) + Length);
+	pSlot->Length = pRecord->Size;
+	pSlot->Type = LOG_SLOT_TRACE;
+	Log_EndSlot(pRing, pSlot, pSite->Level <= LL_WARNING);
+}
@@ -0,0 +1,28 @@
+#pragma once
+#include "Control.h"
+
+/*
+ * Call sites of the log macros are placed between the start and end markers of
+ * the .evtr section, their offset in it is the call site id.
+ */
+#pragma section(".evtr$a", read, write)
+#pragma section(".evtr$m", read, write)
+#pragma section(".evtr$z", read, write)
+
+#define TRACE_DEFINE_CALLSITE(name, level, category, format) \
+	__declspec(allocate(".evtr$m")) static TRACE_CALLSITE name = { format, __FUNCTION__, __LINE__, level, category }
+
+/** Must run before any other Trace_ and Log_ routine, all call sites start disabled */
+VOID Trace_InitializeCallsites();
+/** Recomputes the guard of every call site from its mode and the log settings. Nothing logs while Active is FALSE */
+VOID Trace_UpdateCallsites(BOOLEAN Active);
+NTSTATUS Trace_SetTracepoint(_In_ TRACEPOINT_REQUEST *pRequest);
+NTSTATUS Trace_QueryTracepoints(_Out_writes_bytes_(Length) TRACEPOINT_LIST *pList, ULONG Length, _Out_ ULONG_PTR *pInformation);
+/** Slow path of limited call sites */
+BOOLEAN Trace_Admit(_Inout_ TRACE_CALLSITE *pSite);
+NTSTATUS Trace_Initialize(_In_ PCWSTR pszLogFileName);
+VOID Trace_Cleanup();
+/** Records an event in the ring of the current processor, the arguments must match the format of the call site */
+VOID Trace_Write(_Inout_ TRACE_CALLSITE *pSite, ...);
+/** Flusher only. Appends a sync record at pBatch + Length, there must be room for it, and writes the batch */
+NTSTATUS Trace_WriteBatch(_Inout_ CHAR *pBatch, ULONG Length);
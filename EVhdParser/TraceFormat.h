@@ -0,0 +1,319 @@
+#pragma once
+/*
+ * Binary trace events. Instead of a formatted line an event carries the id of
+ * its call site, a TSC stamp and the raw arguments. The call site table (level,
+ * category, function and format string of every site) is written once at the
+ * start of each trace file and evhdtool trace-decode rebuilds the text lines
+ * from it. Plain C, the decoder is built outside of Windows.
+ *
+ * File layout: TRACE_FILE_HEADER, TableSize bytes of TRACE_CALLSITE_ENTRY, then
+ * TRACE_RECORDs. Sync records pair a TSC stamp with the local time so event
+ * stamps can be converted, the flusher writes one with every batch.
+ *
+ * Every call site also carries its own guard: a disabled site only reads its
+ * Enabled byte, a limited one is sampled or rate limited before logging.
+ */
+#include <stdarg.h>
+#include <stddef.h>
+#include "MessageRing.h"
+
+#define TRACE_FILE_MAGIC            0x52545645  /* 'EVTR' */
+#define TRACE_FILE_VERSION          1
+#define TRACE_MAX_ARGS              16
+/* Bytes of a string argument kept in an event */
+#define TRACE_MAX_STRING            64
+#define TRACE_NULL_STRING           0xFFFFFFFFFFFFFFFFULL
+#define TRACE_ALIGN(Length)         (((Length) + 7) & ~7)
+
+#define TRACE_RECORD_EVENT          1
+#define TRACE_RECORD_SYNC           2
+
+#define TRACE_SITE_OFF              0
+#define TRACE_SITE_ON               1
+#define TRACE_SITE_LIMITED          2
+
+typedef enum _TRACEPOINT_MODE {
+    /* Follows the log level and category mask */
+    TracepointDefault,
+    TracepointOff,
+    TracepointOn,
+    /* One in Rate events is logged */
+    TracepointSample,
+    /* Rate events per second, Burst of them at once */
+    TracepointRateLimit,
+    TracepointModeMax
+} TRACEPOINT_MODE;
+
+typedef enum _TRACE_ARG_TYPE {
+    TraceArgNone,
+    TraceArgInt32,
+    TraceArgInt64,
+    TraceArgPointer,
+    TraceArgString,
+    TraceArgWideString
+} TRACE_ARG_TYPE;
+
+typedef struct _TRACE_FILE_HEADER {
+    ULONG32 Magic;
+    ULONG32 Version;
+    ULONG32 CallsiteCount;
+    /* Bytes of call site entries following the header */
+    ULONG32 TableSize;
+} TRACE_FILE_HEADER;
+
+C_ASSERT(sizeof(TRACE_FILE_HEADER) == 16);
+
+typedef struct _TRACE_CALLSITE_ENTRY {
+    /* Whole entry including the strings, multiple of 8 */
+    ULONG32 Size;
+    ULONG32 Id;
+    ULONG32 Line;
+    UCHAR Level;
+    UCHAR Category;
+    /* Lengths including the terminating zero, the function name comes first */
+    USHORT FunctionLength;
+    USHORT FormatLength;
+    USHORT Reserved[3];
+} TRACE_CALLSITE_ENTRY;
+
+C_ASSERT(sizeof(TRACE_CALLSITE_ENTRY) == 24);
+
+/**
+ * Event and sync record header. An event is followed by ArgCount arguments of 8 bytes, a string
+ * argument holds its length in bytes (TRACE_NULL_STRING for NULL) and the characters follow it padded
+ * to 8 bytes. A sync record is followed by the local time, in 100 ns units since 1601, read with Tsc.
+ */
+typedef struct _TRACE_RECORD {
+    USHORT Size;
+    UCHAR Type;
+    UCHAR Irql;
+    ULONG32 CallsiteId;
+    ULONG64 Tsc;
+    USHORT ProcessId;
+    USHORT ThreadId;
+    USHORT Processor;
+    UCHAR ArgCount;
+    UCHAR Reserved;
+} TRACE_RECORD;
+
+C_ASSERT(sizeof(TRACE_RECORD) == 24);
+
+#define TRACE_SYNC_SIZE (sizeof(TRACE_RECORD) + sizeof(ULONG64))
+
+/** Static description of a call site, the argument types are filled on its first use */
+typedef struct _TRACE_CALLSITE {
+    const CHAR *Format;
+    const CHAR *Function;
+    ULONG32 Line;
+    UCHAR Level;
+    UCHAR Category;
+    volatile UCHAR Parsed;
+    UCHAR ArgCount;
+    UCHAR ArgTypes[TRACE_MAX_ARGS];
+    /* TRACE_SITE_*, the only field a disabled call site reads */
+    volatile UCHAR Enabled;
+    UCHAR Reserved[3];
+    ULONG32 Mode;
+    ULONG32 Rate;
+    ULONG32 Burst;
+    /* Events seen and dropped by a limited call site */
+    volatile LONG64 Evaluated;
+    volatile LONG64 Suppressed;
+    /* Theoretical arrival time of the next event allowed by the rate limit, in 100 ns units */
+    volatile LONG64 ArrivalTime;
+} TRACE_CALLSITE;
+
+/**
+ * Parses the conversion following a '%'. Returns the character after it, pType receives the type of the
+ * argument it consumes (TraceArgNone for "%%") and pStars the number of '*' width or precision arguments
+ * consumed before it. Only the conversions of the Windows kernel printf used by the driver are known.
+ */
+static __inline const CHAR *Trace_ParseSpec(const CHAR *p, UCHAR *pType, ULONG32 *pStars)
+{
+    BOOLEAN Wide = FALSE, Long64 = FALSE;
+
+    *pStars = 0;
+    *pType = TraceArgNone;
+    if (*p == '%')
+        return p + 1;
+
+    while (*p == '-' || *p == '+' || *p == ' ' || *p == '#' || *p == '0')
+        ++p;
+    for (; *p == '*' || *p == '.' || (*p >= '0' && *p <= '9'); ++p)
+        if (*p == '*')
+            ++*pStars;
+
+    for (;; ++p)
+    {
+        if (*p == 'h' || *p == 'w')
+            Wide = *p == 'w';
+        else if (*p == 'l')
+        {
+            if (p[1] == 'l')
+            {
+                Long64 = TRUE;
+                ++p;
+            }
+            else
+                Wide = TRUE;
+        }
+        else if (*p == 'I')
+        {
+            if (p[1] == '6' && p[2] == '4')
+                Long64 = TRUE, p += 2;
+            else if (p[1] == '3' && p[2] == '2')
+                p += 2;
+            else
+                Long64 = TRUE;
+        }
+        else if (*p == 'z' || *p == 'j' || *p == 't')
+            Long64 = TRUE;
+        else
+            break;
+    }
+
+    switch (*p)
+    {
+    case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c': case 'C':
+        *pType = Long64 ? TraceArgInt64 : TraceArgInt32;
+        break;
+    case 's':
+        *pType = Wide ? TraceArgWideString : TraceArgString;
+        break;
+    case 'S':
+        *pType = TraceArgWideString;
+        break;
+    case '\0':
+        return p;
+    default:
+        // %p and conversions the decoder can not render, the argument is kept as a pointer
+        *pType = TraceArgPointer;
+        break;
+    }
+    return p + 1;
+}
+
+/** Fills pTypes with the arguments consumed by a format string, returns their number */
+static __inline ULONG32 Trace_ParseFormat(const CHAR *pszFormat, UCHAR *pTypes, ULONG32 MaxCount)
+{
+    ULONG32 Count = 0, Stars = 0;
+    UCHAR Type = TraceArgNone;
+
+    while (*pszFormat)
+    {
+        if (*pszFormat++ != '%')
+            continue;
+        pszFormat = Trace_ParseSpec(pszFormat, &Type, &Stars);
+        for (; Stars && Count < MaxCount; --Stars)
+            pTypes[Count++] = TraceArgInt32;
+        if (Type != TraceArgNone && Count < MaxCount)
+            pTypes[Count++] = Type;
+    }
+    return Count;
+}
+
+/** Stores the arguments after an event header. Returns the bytes used, pEncoded receives the arguments that fit */
+static __inline ULONG32 Trace_EncodeArgs(UCHAR *pBuffer, ULONG32 Size, const UCHAR *pTypes, ULONG32 Count,
+    ULONG32 *pEncoded, va_list args)
+{
+    ULONG32 Used = 0, i = 0;
+
+    for (i = 0; i < Count; ++i)
+    {
+        ULONG64 Value = 0;
+        const UCHAR *pString = NULL;
+        ULONG32 Length = 0;
+
+        switch (pTypes[i])
+        {
+        case TraceArgInt32:
+            Value = va_arg(args, ULONG32);
+            break;
+        case TraceArgInt64:
+            Value = va_arg(args, ULONG64);
+            break;
+        case TraceArgPointer:
+            Value = (ULONG64)(size_t)va_arg(args, VOID *);
+            break;
+        case TraceArgString:
+            pString = va_arg(args, const UCHAR *);
+            while (pString && Length < TRACE_MAX_STRING && pString[Length])
+                ++Length;
+            Value = pString ? Length : TRACE_NULL_STRING;
+            break;
+        case TraceArgWideString:
+            pString = va_arg(args, const UCHAR *);
+            while (pString && Length < TRACE_MAX_STRING && ((const USHORT *)pString)[Length / 2])
+                Length += 2;
+            Value = pString ? Length : TRACE_NULL_STRING;
+            break;
+        }
+
+        if (Used + sizeof(ULONG64) + TRACE_ALIGN(Length) > Size)
+            break;
+        memcpy(pBuffer + Used, &Value, sizeof(ULONG64));
+        if (Length)
+            memcpy(pBuffer + Used + sizeof(ULONG64), pString, Length);
+        Used += sizeof(ULONG64) + TRACE_ALIGN(Length);
+    }
+
+    *pEncoded = i;
+    return Used;
+}
+
+/** Serializes a call site for the file table. Returns the bytes used or 0 if it does not fit */
+static __inline ULONG32 Trace_WriteCallsiteEntry(UCHAR *pBuffer, ULONG32 Size, ULONG32 Id, const TRACE_CALLSITE *pSite)
+{
+    TRACE_CALLSITE_ENTRY *pEntry = (TRACE_CALLSITE_ENTRY *)pBuffer;
+    ULONG32 FunctionLength = (ULONG32)strlen(pSite->Function) + 1;
+    ULONG32 FormatLength = (ULONG32)strlen(pSite->Format) + 1;
+    ULONG32 Needed = TRACE_ALIGN(sizeof(TRACE_CALLSITE_ENTRY) + FunctionLength + FormatLength);
+
+    if (Needed > Size || FunctionLength > 0xFFFF || FormatLength > 0xFFFF)
+        return 0;
+
+    memset(pBuffer, 0, Needed);
+    pEntry->Size = Needed;
+    pEntry->Id = Id;
+    pEntry->Line = pSite->Line;
+    pEntry->Level = pSite->Level;
+    pEntry->Category = pSite->Category;
+    pEntry->FunctionLength = (USHORT)FunctionLength;
+    pEntry->FormatLength = (USHORT)FormatLength;
+    memcpy(pEntry + 1, pSite->Function, FunctionLength);
+    memcpy((UCHAR *)(pEntry + 1) + FunctionLength, pSite->Format, FormatLength);
+    return Needed;
+}
+
+/** Sampled call site: keeps the first of every Rate events. Drops are not counted, they follow from Evaluated */
+static __inline BOOLEAN Trace_AdmitSample(TRACE_CALLSITE *pSite)
+{
+    LONG64 Evaluated = RING_INCREMENT64(&pSite->Evaluated);
+    return pSite->Rate <= 1 || (ULONG32)(Evaluated - 1) % pSite->Rate == 0;
+}
+
+/**
+ * Rate limited call site at time Now (100 ns units). The token bucket is kept as a single theoretical
+ * arrival time (GCRA) so producers only need a compare-exchange.
+ */
+static __inline BOOLEAN Trace_AdmitRate(TRACE_CALLSITE *pSite, ULONG64 Now)
+{
+    LONG64 Interval = pSite->Rate ? 10000000 / pSite->Rate : 10000000;
+    LONG64 Tolerance = 0, Arrival = 0, Start = 0;
+
+    RING_INCREMENT64(&pSite->Evaluated);
+    Interval = Interval ? Interval : 1;
+    Tolerance = Interval * (pSite->Burst ? pSite->Burst - 1 : 0);
+    for (;;)
+    {
+        Arrival = pSite->ArrivalTime;
+        Start = Arrival > (LONG64)Now ? Arrival : (LONG64)Now;
+        if (Start - (LONG64)Now > Tolerance)
+        {
+            RING_INCREMENT64(&pSite->Suppressed);
+            return FALSE;
+        }
+        if (RING_COMPARE_EXCHANGE64(&pSite->ArrivalTime, Start + Interval, Arrival) == Arrival)
+            return TRUE;
+    }
+}
@@ -6,8 +6,68 @@
 #include "utils.h"
 #include <stddef.h>
 #include "Log.h"
+#include "DiskStats.h"
+
+/* Shim device name read last, kept until an interface of the virtual drive enumerator arrives or goes */
+static FIND_SHIM_RESPONSE ShimCache;
+static BOOLEAN ShimCacheValid = FALSE;
+/* Bumped by every interface change, a lookup that started before one does not fill the cache */
+static ULONG ShimCacheGeneration = 0;
+static KSPIN_LOCK ShimCacheLock;
+static PVOID ShimNotificationEntry = NULL;
+static volatile LONG64 ShimCacheHits = 0;
+static volatile LONG64 ShimCacheMisses = 0;
+
+static NTSTATUS Vdrvroot_InterfaceChange(PVOID NotificationStructure, PVOID Context)
+{
+	UNREFERENCED_PARAMETER(NotificationStructure);
+	UNREFERENCED_PARAMETER(Context);
+	Vdrvroot_InvalidateShim();
+	return STATUS_SUCCESS;
+}
 
-NTSTATUS FindShimDevice(PUNICODE_STRING pShimName, PCUNICODE_STRING pDiskPath)
+NTSTATUS Vdrvroot_Initialize(PDRIVER_OBJECT pDriverObject)
+{
+	NTSTATUS status = STATUS_SUCCESS;
+
+	KeInitializeSpinLock(&ShimCacheLock);
+	ShimCacheValid = FALSE;
+	status = IoRegisterPlugPlayNotification(EventCategoryDeviceInterfaceChange, 0,
+		(PVOID)&GUID_DEVINTERFACE_SURFACE_VIRTUAL_DRIVE, pDriverObject, Vdrvroot_InterfaceChange, NULL,
+		&ShimNotificationEntry);
+	if (!NT_SUCCESS(status))
+	{
+		// Without the notification every lookup goes to the enumerator
+		LOG_FUNCTION(LL_ERROR, LOG_CTG_GENERAL, "IoRegisterPlugPlayNotification failed with error 0x%0x\n", status);
+		ShimNotificationEntry = NULL;
+	}
+	return status;
+}
+
+VOID Vdrvroot_Cleanup()
+{
+	if (ShimNotificationEntry)
+	{
+		IoUnregisterPlugPlayNotificationEx(ShimNotificationEntry);
+		ShimNotificationEntry = NULL;
+	}
+	Vdrvroot_InvalidateShim();
+	LOG_FUNCTION(LL_INFO, LOG_CTG_GENERAL, "Shim lookups: %I64d from the cache, %I64d from the enumerator\n",
+		ShimCacheHits, ShimCacheMisses);
+}
+
+VOID Vdrvroot_InvalidateShim()
+{
+	KIRQL OldIrql;
+
+	KeAcquireSpinLock(&ShimCacheLock, &OldIrql);
+	ShimCacheValid = FALSE;
+	++ShimCacheGeneration;
+	KeReleaseSpinLock(&ShimCacheLock, OldIrql);
+}
+
+/** Asks the virtual drive enumerator for the shim device name, the name is returned as the enumerator gives it */
+static NTSTATUS Vdrvroot_QueryShim(FIND_SHIM_RESPONSE *pResponse)
 {
 	NTSTATUS status = STATUS_SUCCESS;
 	OBJECT_ATTRIBUTES ObjectAttributes = { 0 };
@@ -16,22 +76,12 @@ NTSTATUS FindShimDevice(PUNICODE_STRING pShimName, PCUNICODE_STRING pDiskPath)
 	PDEVICE_OBJECT pDeviceObject = NULL;
 	PZZWSTR SymbolicLinkList = NULL;
 	FIND_SHIM_REQUEST inputBuffer = { 0 };
-	FIND_SHIM_RESPONSE outputBuffer = { 0 };
-	SIZE_T ShimNameLength = 0;
-
-	if (!pShimName)
-	{
-		status = STATUS_INVALID_PARAMETER;
-		goto cleanup_failure;
-	}
-	else
-		pShimName->Buffer = NULL;
 
 	status = IoGetDeviceInterfaces(&GUID_DEVINTERFACE_SURFACE_VIRTUAL_DRIVE, NULL, 0, &SymbolicLinkList);
 	if (!NT_SUCCESS(status))
 	{
         LOG_FUNCTION(LL_FATAL, LOG_CTG_GENERAL, "Failed to find installed Hyper-V Virtual Drive Enumerator\n");
-		goto cleanup_failure;
+		goto cleanup;
 	}
 
 	RtlInitUnicodeString(&DriveEnumeratorSymbolicLink, SymbolicLinkList);
@@ -44,7 +94,7 @@ NTSTATUS FindShimDevice(PUNICODE_STRING pShimName, PCUNICODE_STRING pDiskPath)
 	if (!NT_SUCCESS(status))
 	{
         LOG_FUNCTION(LL_FATAL, LOG_CTG_GENERAL, "IoGetDeviceObjectPointer %S failed with error = 0x%0x\n", DriveEnumeratorSymbolicLink.Buffer, status);
-		goto cleanup_failure;
+		goto cleanup;
 	}
 
 
@@ -55,12 +105,63 @@ NTSTATUS FindShimDevice(PUNICODE_STRING pShimName, PCUNICODE_STRING pDiskPath)
 	inputBuffer.Reserved2 = 0;
 
 	status = SynchronouseCall(pFileObject, IOCTL_STORAGE_VHD_FIND_SHIM,
-        &inputBuffer, sizeof(FIND_SHIM_REQUEST), &outputBuffer, sizeof(FIND_SHIM_RESPONSE));
+        &inputBuffer, sizeof(FIND_SHIM_REQUEST), pResponse, sizeof(FIND_SHIM_RESPONSE));
 	if (!NT_SUCCESS(status))
 	{
         LOG_FUNCTION(LL_FATAL, LOG_CTG_GENERAL, "SynchronouseCall failed with error 0x%0x\n", status);
+		goto cleanup;
+	}
+	if (pResponse->NameSizeInBytes < sizeof(WCHAR) || pResponse->NameSizeInBytes > sizeof(pResponse->szShimName))
+		status = STATUS_INVALID_DEVICE_REQUEST;
+
+cleanup:
+	if (SymbolicLinkList) ExFreePool(SymbolicLinkList);
+	if (pFileObject) ObDereferenceObject(pFileObject);
+
+	return status;
+}
+
+NTSTATUS FindShimDevice(PUNICODE_STRING pShimName, PCUNICODE_STRING pDiskPath)
+{
+	NTSTATUS status = STATUS_SUCCESS;
+	FIND_SHIM_RESPONSE outputBuffer = { 0 };
+	SIZE_T ShimNameLength = 0;
+	BOOLEAN Cached = FALSE;
+	ULONG Generation = 0;
+	KIRQL OldIrql;
+
+	if (!pShimName)
+	{
+		status = STATUS_INVALID_PARAMETER;
 		goto cleanup_failure;
 	}
+	else
+		pShimName->Buffer = NULL;
+
+	KeAcquireSpinLock(&ShimCacheLock, &OldIrql);
+	Cached = ShimCacheValid;
+	if (Cached)
+		memmove(&outputBuffer, &ShimCache, sizeof(FIND_SHIM_RESPONSE));
+	Generation = ShimCacheGeneration;
+	KeReleaseSpinLock(&ShimCacheLock, OldIrql);
+
+	if (Cached)
+		InterlockedIncrement64(&ShimCacheHits);
+	else
+	{
+		InterlockedIncrement64(&ShimCacheMisses);
+		status = Vdrvroot_QueryShim(&outputBuffer);
+		if (!NT_SUCCESS(status))
+			goto cleanup_failure;
+		// Only cached when no interface changed while the enumerator was asked
+		KeAcquireSpinLock(&ShimCacheLock, &OldIrql);
+		if (Generation == ShimCacheGeneration && ShimNotificationEntry)
+		{
+			memmove(&ShimCache, &outputBuffer, sizeof(FIND_SHIM_RESPONSE));
+			ShimCacheValid = TRUE;
+		}
+		KeReleaseSpinLock(&ShimCacheLock, OldIrql);
+	}
 
 	/* Convert UNC path from '\\.\' to '\??\' */
 	if (outputBuffer.NameSizeInBytes > 8 &&
@@ -104,11 +205,11 @@ NTSTATUS FindShimDevice(PUNICODE_STRING pShimName, PCUNICODE_STRING pDiskPath)
 
 cleanup_failure:
 	if (pShimName && pShimName->Buffer)
+	{
 		ExFreePool(pShimName->Buffer);
+		pShimName->Buffer = NULL;
+	}
 cleanup:
-	if (SymbolicLinkList) ExFreePool(SymbolicLinkList);
-	if (pFileObject) ObDereferenceObject(pFileObject);
-
 	return status;
 }
 
@@ -141,7 +242,7 @@ cleanup:
 }
 
 NTSTATUS OpenVhdmpDevice(HANDLE *pFileHandle, ULONG32 OpenFlags, PFILE_OBJECT *ppFileObject, PCUNICODE_STRING diskPath,
-	const RESILIENCY_INFO_EA *pResiliency)
+	const RESILIENCY_INFO_EA *pResiliency, CTL_TIMING *pTiming)
 {
 	NTSTATUS status = STATUS_SUCCESS;
 	HANDLE FileHandle = NULL;
@@ -151,8 +252,10 @@ NTSTATUS OpenVhdmpDevice(HANDLE *pFileHandle, ULONG32 OpenFlags, PFILE_OBJECT *p
 	PFILE_OBJECT pFileObject = NULL;
 	OPEN_DISK_EA ea = { 0 };
 	BOOLEAN getInfoOnly = OpenFlags & 1;
+	LONG64 PhaseStart = DiskStats_PhaseStart();
 
 	status = FindShimDevice(&VhdmpPath, diskPath);
+	DiskStats_PhaseEnd(pTiming, CTL_PHASE_OPEN_FIND_SHIM, PhaseStart);
 	if (!NT_SUCCESS(status))
 	{
         LOG_FUNCTION(LL_FATAL, LOG_CTG_GENERAL, "FindShimDevice failed\n");
@@ -250,9 +353,11 @@ NTSTATUS OpenVhdmpDevice(HANDLE *pFileHandle, ULONG32 OpenFlags, PFILE_OBJECT *p
 	ObjectAttributes.ObjectName = &VhdmpPath;
 	ObjectAttributes.Attributes = OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE;
 
+	PhaseStart = DiskStats_PhaseStart();
 	status = IoCreateFile(&FileHandle, GENERIC_READ | SYNCHRONIZE, &ObjectAttributes, &StatusBlock, 0,
 		FILE_READ_ATTRIBUTES, FILE_SHARE_READ, FILE_OPEN, FILE_NON_DIRECTORY_FILE, &ea, sizeof(ea),
 		CreateFileTypeNone, NULL, IO_FORCE_ACCESS_CHECK | IO_NO_PARAMETER_CHECKING);
+	DiskStats_PhaseEnd(pTiming, CTL_PHASE_OPEN_CREATE, PhaseStart);
 	if (!NT_SUCCESS(status))
 	{
         LOG_FUNCTION(LL_FATAL, LOG_CTG_GENERAL, "IoCreateFile %S failed with error 0x%0x\n", VhdmpPath.Buffer, status);
@@ -265,7 +370,9 @@ NTSTATUS OpenVhdmpDevice(HANDLE *pFileHandle, ULONG32 OpenFlags, PFILE_OBJECT *p
 		for (;;)
 		{
 			BOOLEAN IsDifferencing = FALSE;
+			PhaseStart = DiskStats_PhaseStart();
 			status = GetIsDifferencing(FileHandle, &IsDifferencing);
+			DiskStats_PhaseEnd(pTiming, CTL_PHASE_OPEN_DIFFERENCING, PhaseStart);
 			if (!NT_SUCCESS(status))
 			{
                 LOG_FUNCTION(LL_FATAL, LOG_CTG_GENERAL, "GetIsDifferencing failed with error 0x%0x\n", status);
@@ -280,9 +387,11 @@ NTSTATUS OpenVhdmpDevice(HANDLE *pFileHandle, ULONG32 OpenFlags, PFILE_OBJECT *p
 				goto cleanup_failure;
 			}
 
+			PhaseStart = DiskStats_PhaseStart();
 			status = IoCreateFile(&FileHandle, GENERIC_READ | SYNCHRONIZE, &ObjectAttributes, &StatusBlock, 0,
 				FILE_READ_ATTRIBUTES, FILE_SHARE_READ, FILE_OPEN, FILE_NON_DIRECTORY_FILE, &ea, sizeof(ea),
 				CreateFileTypeNone, NULL, IO_FORCE_ACCESS_CHECK | IO_NO_PARAMETER_CHECKING);
+			DiskStats_PhaseEnd(pTiming, CTL_PHASE_OPEN_DIFFERENCING, PhaseStart);
 			if (!NT_SUCCESS(status))
 			{
                 LOG_FUNCTION(LL_FATAL, LOG_CTG_GENERAL, "IoCreateFile %S failed with error 0x%0x\n", VhdmpPath.Buffer, status);
@@ -1,5 +1,6 @@
 #pragma once
 #include <ntifs.h>
+#include "ControlTiming.h"
 
 #define OPEN_FILE_RESILIENCY_INFO_EA_NAME "ClusteredApplicationInstance"
 #define OPEN_FILE_VIRT_DISK_INFO_EA_NAME "VIRTDSK"
@@ -71,7 +72,15 @@ typedef struct {
 	RESILIENCY_INFO_EA	VmInfo;
 } OPEN_DISK_EA;
 
+/** Watches the interfaces of the virtual drive enumerator, the shim device name is cached until one changes */
+NTSTATUS Vdrvroot_Initialize(PDRIVER_OBJECT pDriverObject);
+VOID Vdrvroot_Cleanup();
+/** Makes the next lookup ask the enumerator for the shim device again */
+VOID Vdrvroot_InvalidateShim();
+/** Shim device name followed by the disk path if given, the cached name is used when there is one */
 NTSTATUS FindShimDevice(PUNICODE_STRING pShimName, PCUNICODE_STRING pDiskPath);
-NTSTATUS OpenVhdmpDevice(HANDLE *pFileHandle, ULONG32 OpenFlags, PFILE_OBJECT *ppFileObject, PCUNICODE_STRING diskPath, const RESILIENCY_INFO_EA *pResiliency);
+/** Opens a disk through the vhdmp shim, the time spent in each step is added to the open phases of pTiming if given */
+NTSTATUS OpenVhdmpDevice(HANDLE *pFileHandle, ULONG32 OpenFlags, PFILE_OBJECT *ppFileObject, PCUNICODE_STRING diskPath,
+	const RESILIENCY_INFO_EA *pResiliency, CTL_TIMING *pTiming);
 
 #pragma pack(pop)
@@ -0,0 +1,216 @@
+#pragma once
+/*
+ * Block allocation table of dynamic and differencing VHD and VHDX files, as
+ * far as needed to tell the blocks a differencing disk holds itself from the
+ * ones it reads from its parent. vhdmp validated the file and replayed its
+ * log when it opened it, so the structures are only checked for what would
+ * make the walk go astray.
+ *
+ * A VHD has a footer copy at offset 0 pointing to its dynamic header, which
+ * holds the table of 32 bit big endian sector offsets, all ones for a block
+ * of the parent. A VHDX has its region table at 192 KiB, the metadata region
+ * holds the block size and the table interleaves one sector bitmap entry
+ * after every chunk of payload entries.
+ * Plain C, evhdtool builds tables to check it.
+ */
+#include "PortableTypes.h"
+
+#define VHD_LAYOUT_VHD                  1
+#define VHD_LAYOUT_VHDX                 2
+
+#define VHD_FOOTER_SIZE                 512
+#define VHD_FOOTER_COOKIE               "conectix"
+#define VHD_DYNAMIC_HEADER_SIZE         1024
+#define VHD_DYNAMIC_COOKIE              "cxsparse"
+#define VHD_DISK_TYPE_DIFFERENCING      4
+#define VHD_BAT_UNUSED                  0xFFFFFFFF
+
+#define VHDX_REGION_TABLE_OFFSET        0x30000
+#define VHDX_REGION_TABLE_SIZE          0x10000
+#define VHDX_REGION_SIGNATURE           0x69676572  // 'regi'
+#define VHDX_REGION_MAX_ENTRIES         2047
+#define VHDX_METADATA_SIGNATURE         "metadata"
+#define VHDX_METADATA_MAX_ENTRIES       2047
+/* Read of the metadata region, its table and the items follow one another at its start */
+#define VHDX_METADATA_READ_SIZE         0x20000
+#define VHDX_BAT_STATE_MASK             7
+#define VHDX_BAT_NOT_PRESENT            0
+#define VHDX_MIN_BLOCK_SIZE             0x100000
+#define VHDX_MAX_BLOCK_SIZE             0x10000000
+/* Sectors described by one sector bitmap block */
+#define VHDX_CHUNK_SECTORS              0x800000ULL
+
+typedef struct _VHDX_REGION_ENTRY {
+    GUID Guid;
+    ULONG64 FileOffset;
+    ULONG32 Length;
+    ULONG32 Required;
+} VHDX_REGION_ENTRY;
+
+typedef struct _VHDX_METADATA_ENTRY {
+    GUID ItemId;
+    ULONG32 Offset;
+    ULONG32 Length;
+    ULONG32 Flags;
+    ULONG32 Reserved;
+} VHDX_METADATA_ENTRY;
+
+typedef struct _VHD_LAYOUT {
+    ULONG32 Format;
+    ULONG32 BlockSize;
+    /* Payload entries between two sector bitmap entries of a VHDX table */
+    ULONG32 ChunkRatio;
+    ULONG64 BatOffset;
+    ULONG64 BatEntries;
+    /* Metadata region of a VHDX, read by VhdLayout_VhdxMetadata */
+    ULONG64 MetadataOffset;
+    ULONG32 MetadataLength;
+} VHD_LAYOUT;
+
+static const GUID VhdxBatRegion =
+    { 0x2DC27766, 0xF623, 0x4200, { 0x9D, 0x64, 0x11, 0x5E, 0x9B, 0xFD, 0x4A, 0x08 } };
+static const GUID VhdxMetadataRegion =
+    { 0x8B7CA206, 0x4790, 0x4B9A, { 0xB8, 0xFE, 0x57, 0x5F, 0x05, 0x0F, 0x88, 0x6E } };
+static const GUID VhdxFileParameters =
+    { 0xCAA16737, 0xFA36, 0x4D43, { 0xB3, 0xB6, 0x33, 0xF0, 0xAA, 0x44, 0xE7, 0x6B } };
+static const GUID VhdxVirtualDiskSize =
+    { 0x2FA54224, 0xCD1B, 0x4876, { 0xB2, 0x11, 0x5D, 0xBE, 0xD8, 0x3B, 0xF4, 0xB8 } };
+static const GUID VhdxLogicalSectorSize =
+    { 0x8141BF1D, 0xA96F, 0x4709, { 0xBA, 0x47, 0xF2, 0x33, 0xA8, 0xFA, 0xAB, 0x5F } };
+
+static __inline ULONG64 VhdLayout_BigEndian(const UCHAR *p, ULONG32 Bytes)
+{
+    ULONG64 Value = 0;
+    while (Bytes--)
+        Value = Value << 8 | *p++;
+    return Value;
+}
+
+static __inline BOOLEAN VhdLayout_PowerOfTwo(ULONG64 Value)
+{
+    return Value && !(Value & (Value - 1));
+}
+
+/** Offset of the dynamic header from the footer copy at the start of a VHD, FALSE if it is not a differencing disk */
+static __inline BOOLEAN VhdLayout_VhdFooter(const UCHAR *pFooter, ULONG64 *pHeaderOffset)
+{
+    if (memcmp(pFooter, VHD_FOOTER_COOKIE, 8) || VhdLayout_BigEndian(pFooter + 60, 4) != VHD_DISK_TYPE_DIFFERENCING)
+        return FALSE;
+    *pHeaderOffset = VhdLayout_BigEndian(pFooter + 16, 8);
+    return TRUE;
+}
+
+/** Table and block size from the dynamic header of a VHD */
+static __inline BOOLEAN VhdLayout_VhdHeader(const UCHAR *pHeader, VHD_LAYOUT *pLayout)
+{
+    memset(pLayout, 0, sizeof(VHD_LAYOUT));
+    if (memcmp(pHeader, VHD_DYNAMIC_COOKIE, 8))
+        return FALSE;
+    pLayout->Format = VHD_LAYOUT_VHD;
+    pLayout->BatOffset = VhdLayout_BigEndian(pHeader + 16, 8);
+    pLayout->BatEntries = VhdLayout_BigEndian(pHeader + 28, 4);
+    pLayout->BlockSize = (ULONG32)VhdLayout_BigEndian(pHeader + 32, 4);
+    return VhdLayout_PowerOfTwo(pLayout->BlockSize) && pLayout->BlockSize >= 512;
+}
+
+/** Table and metadata region from the region table of a VHDX */
+static __inline BOOLEAN VhdLayout_VhdxRegions(const UCHAR *pTable, ULONG32 Length, VHD_LAYOUT *pLayout)
+{
+    ULONG32 Signature = 0, Count = 0, i = 0;
+    BOOLEAN bBat = FALSE;
+
+    memset(pLayout, 0, sizeof(VHD_LAYOUT));
+    memcpy(&Signature, pTable, sizeof(Signature));
+    memcpy(&Count, pTable + 8, sizeof(Count));
+    if (Signature != VHDX_REGION_SIGNATURE || Count > VHDX_REGION_MAX_ENTRIES ||
+        16 + (ULONG64)Count * sizeof(VHDX_REGION_ENTRY) > Length)
+        return FALSE;
+    pLayout->Format = VHD_LAYOUT_VHDX;
+    for (i = 0; i < Count; ++i)
+    {
+        VHDX_REGION_ENTRY Entry;
+
+        memcpy(&Entry, pTable + 16 + i * sizeof(VHDX_REGION_ENTRY), sizeof(Entry));
+        if (!memcmp(&Entry.Guid, &VhdxBatRegion, sizeof(GUID)))
+        {
+            pLayout->BatOffset = Entry.FileOffset;
+            bBat = TRUE;
+        }
+        else if (!memcmp(&Entry.Guid, &VhdxMetadataRegion, sizeof(GUID)))
+        {
+            pLayout->MetadataOffset = Entry.FileOffset;
+            pLayout->MetadataLength = Entry.Length;
+        }
+    }
+    return bBat && pLayout->MetadataLength;
+}
+
+/** Copies a metadata item of a VHDX that lies within the Length bytes read of the metadata region */
+static __inline BOOLEAN VhdLayout_VhdxItem(const UCHAR *pMetadata, ULONG32 Length, const GUID *pItemId, VOID *pValue,
+    ULONG32 ValueLength)
+{
+    USHORT Count = 0, i = 0;
+
+    memcpy(&Count, pMetadata + 10, sizeof(Count));
+    if (Count > VHDX_METADATA_MAX_ENTRIES || 32 + (ULONG64)Count * sizeof(VHDX_METADATA_ENTRY) > Length)
+        return FALSE;
+    for (i = 0; i < Count; ++i)
+    {
+        VHDX_METADATA_ENTRY Entry;
+
+        memcpy(&Entry, pMetadata + 32 + i * sizeof(VHDX_METADATA_ENTRY), sizeof(Entry));
+        if (memcmp(&Entry.ItemId, pItemId, sizeof(GUID)))
+            continue;
+        if (Entry.Length < ValueLength || (ULONG64)Entry.Offset + ValueLength > Length)
+            return FALSE;
+        memcpy(pValue, pMetadata + Entry.Offset, ValueLength);
+        return TRUE;
+    }
+    return FALSE;
+}
+
+/** Block size and entries of the table from the start of the metadata region of a VHDX */
+static __inline BOOLEAN VhdLayout_VhdxMetadata(const UCHAR *pMetadata, ULONG32 Length, VHD_LAYOUT *pLayout)
+{
+    ULONG32 BlockSize = 0, SectorSize = 0;
+    ULONG64 DiskSize = 0, Blocks = 0;
+
+    if (Length < 32 || memcmp(pMetadata, VHDX_METADATA_SIGNATURE, 8) ||
+        !VhdLayout_VhdxItem(pMetadata, Length, &VhdxFileParameters, &BlockSize, sizeof(BlockSize)) ||
+        !VhdLayout_VhdxItem(pMetadata, Length, &VhdxVirtualDiskSize, &DiskSize, sizeof(DiskSize)) ||
+        !VhdLayout_VhdxItem(pMetadata, Length, &VhdxLogicalSectorSize, &SectorSize, sizeof(SectorSize)))
+        return FALSE;
+    if (!VhdLayout_PowerOfTwo(BlockSize) || BlockSize < VHDX_MIN_BLOCK_SIZE || BlockSize > VHDX_MAX_BLOCK_SIZE ||
+        (SectorSize != 512 && SectorSize != 4096) || !DiskSize)
+        return FALSE;
+    pLayout->BlockSize = BlockSize;
+    pLayout->ChunkRatio = (ULONG32)(VHDX_CHUNK_SECTORS * SectorSize / BlockSize);
+    Blocks = (DiskSize + BlockSize - 1) / BlockSize;
+    // The last payload entry is followed by the sector bitmap entry of its chunk
+    pLayout->BatEntries = Blocks + (Blocks + pLayout->ChunkRatio - 1) / pLayout->ChunkRatio;
+    return TRUE;
+}
+
+static __inline ULONG32 VhdLayout_EntrySize(const VHD_LAYOUT *pLayout)
+{
+    return pLayout->Format == VHD_LAYOUT_VHDX ? 8 : 4;
+}
+
+/** TRUE if the entry Index of the table maps a block the disk holds itself, pBlock receives the number of the block */
+static __inline BOOLEAN VhdLayout_OwnBlock(const VHD_LAYOUT *pLayout, ULONG64 Index, const UCHAR *pEntry,
+    ULONG64 *pBlock)
+{
+    ULONG64 Entry = 0;
+
+    if (pLayout->Format == VHD_LAYOUT_VHD)
+    {
+        *pBlock = Index;
+        return VhdLayout_BigEndian(pEntry, 4) != VHD_BAT_UNUSED;
+    }
+    if ((Index + 1) % ((ULONG64)pLayout->ChunkRatio + 1) == 0)
+        return FALSE;
+    memcpy(&Entry, pEntry, sizeof(Entry));
+    *pBlock = Index - Index / ((ULONG64)pLayout->ChunkRatio + 1);
+    // Zero, unmapped and undefined blocks are not read from the parent either
+    return (Entry & VHDX_BAT_STATE_MASK) != VHDX_BAT_NOT_PRESENT;
+}
@@ -22,24 +22,37 @@ typedef struct _CipherOptsEntry
 	} Opts;
 } CipherOptsEntry;
 
-CipherOptsEntry *g_pCipherOptsHead = NULL;
+/* Disk options are hashed by DiskId, disk identifiers are random so their first dword spreads evenly */
+#define CIPHER_OPTS_BUCKETS 1024
+
+CipherOptsEntry *g_pCipherOptsTable[CIPHER_OPTS_BUCKETS] = { 0 };
 FAST_MUTEX g_pCipherOptsMutex;
 
-NTSTATUS CipherEngineGet(PGUID pDiskId, CipherEngine **pOutCipherEngine, PVOID *pOutCipherContext)
+static CipherOptsEntry **CipherOptsBucket(PGUID pDiskId)
 {
-	NTSTATUS status = STATUS_SUCCESS;
-	CipherOptsEntry *pOptsNode = NULL, *pFoundNode = NULL;
-	ExAcquireFastMutex(&g_pCipherOptsMutex);
+	return &g_pCipherOptsTable[(pDiskId->Data1 ^ pDiskId->Data4[7]) & (CIPHER_OPTS_BUCKETS - 1)];
+}
 
-	for (pOptsNode = g_pCipherOptsHead; pOptsNode; pOptsNode = pOptsNode->Next)
+/** Must be called with g_pCipherOptsMutex held */
+static CipherOptsEntry *CipherOptsFind(PGUID pDiskId)
+{
+	CipherOptsEntry *pOptsNode = NULL;
+
+	for (pOptsNode = *CipherOptsBucket(pDiskId); pOptsNode; pOptsNode = pOptsNode->Next)
 	{
 		if (0 == memcmp(&pOptsNode->DiskId, pDiskId, sizeof(GUID)))
-		{
-			pFoundNode = pOptsNode;
-			break;
-		}
+			return pOptsNode;
 	}
+	return NULL;
+}
 
+NTSTATUS CipherEngineGet(PGUID pDiskId, CipherEngine **pOutCipherEngine, PVOID *pOutCipherContext)
+{
+	NTSTATUS status = STATUS_SUCCESS;
+	CipherOptsEntry *pFoundNode = NULL;
+	ExAcquireFastMutex(&g_pCipherOptsMutex);
+
+	pFoundNode = CipherOptsFind(pDiskId);
 	if (pFoundNode)
 	{
         CipherCreate(pFoundNode->Algorithm, &pFoundNode->Opts, pOutCipherEngine, pOutCipherContext);
@@ -89,63 +102,122 @@ NTSTATUS CipherInit()
 
 NTSTATUS CipherCleanup()
 {
-	ExReleaseFastMutex(&g_pCipherOptsMutex);
+	ULONG i = 0;
+
+	for (i = 0; i < CIPHER_OPTS_BUCKETS; ++i)
+	{
+		while (g_pCipherOptsTable[i])
+		{
+			CipherOptsEntry *pOptsNode = g_pCipherOptsTable[i];
+			g_pCipherOptsTable[i] = pOptsNode->Next;
+			RtlSecureZeroMemory(pOptsNode, sizeof(CipherOptsEntry));
+			ExFreePoolWithTag(pOptsNode, CipherPoolTag);
+		}
+	}
 	return STATUS_SUCCESS;
 }
 
-NTSTATUS SetCipherOpts(PGUID pDiskId, ECipherAlgo Algorithm, PVOID pCipherOpts)
+static BOOLEAN CipherOptsValidAlgorithm(ECipherAlgo Algorithm)
 {
-	NTSTATUS status = STATUS_SUCCESS;
-	CipherOptsEntry *pOptsNode = NULL, *pThisNode = NULL;
-	ExAcquireFastMutex(&g_pCipherOptsMutex);
-
 	switch (Algorithm)
 	{
 	case ECipherAlgo_Disabled:
-    case ECipherAlgo_AesXts:
-    case ECipherAlgo_TwofishXts:
-    case ECipherAlgo_SerpentXts:
-		// Try find existing opts in a list
-		for (pOptsNode = g_pCipherOptsHead; pOptsNode; pOptsNode = pOptsNode->Next)
-		{
-			if (0 == memcmp(&pOptsNode->DiskId, pDiskId, sizeof(GUID)))
-			{
-				pThisNode = pOptsNode;
-				break;
-			}
-		}
+	case ECipherAlgo_AesXts:
+	case ECipherAlgo_TwofishXts:
+	case ECipherAlgo_SerpentXts:
+		return TRUE;
+	default:
+		return FALSE;
+	}
+}
 
-		if (!pThisNode)
-		{
-			pThisNode = ExAllocatePoolWithTag(NonPagedPoolNx, sizeof(CipherOptsEntry), CipherPoolTag);
-			if (pThisNode)
-			{
-				pThisNode->Next = g_pCipherOptsHead;
-				g_pCipherOptsHead = pThisNode;
-			}
-			else
-				status = STATUS_NO_MEMORY;
-		}
+/** Stores the options into the node, which is either found in the table or the spare one. Must be called with g_pCipherOptsMutex held */
+static VOID CipherOptsStore(PGUID pDiskId, ECipherAlgo Algorithm, PVOID pCipherOpts, CipherOptsEntry **ppSpareNode)
+{
+	CipherOptsEntry *pThisNode = CipherOptsFind(pDiskId);
 
-		if (pThisNode)
+	if (!pThisNode)
+	{
+		CipherOptsEntry **ppBucket = CipherOptsBucket(pDiskId);
+		pThisNode = *ppSpareNode;
+		*ppSpareNode = NULL;
+		pThisNode->Next = *ppBucket;
+		*ppBucket = pThisNode;
+	}
+
+	memcpy(&pThisNode->DiskId, pDiskId, sizeof(GUID));
+	pThisNode->Algorithm = Algorithm;
+	switch (Algorithm)
+	{
+	case ECipherAlgo_AesXts:
+	case ECipherAlgo_TwofishXts:
+	case ECipherAlgo_SerpentXts:
+		memcpy(&pThisNode->Opts.Xts256, pCipherOpts, sizeof(Xts256CipherOptions));
+		break;
+	}
+}
+
+NTSTATUS SetCipherOpts(PGUID pDiskId, ECipherAlgo Algorithm, PVOID pCipherOpts)
+{
+	CipherOptsEntry *pSpareNode = NULL;
+
+	if (!CipherOptsValidAlgorithm(Algorithm))
+		return STATUS_INVALID_PARAMETER;
+
+	// Allocated up front so the mutex is not held across the allocation, freed if the disk is already known
+	pSpareNode = ExAllocatePoolWithTag(NonPagedPoolNx, sizeof(CipherOptsEntry), CipherPoolTag);
+	if (!pSpareNode)
+		return STATUS_NO_MEMORY;
+
+	ExAcquireFastMutex(&g_pCipherOptsMutex);
+	CipherOptsStore(pDiskId, Algorithm, pCipherOpts, &pSpareNode);
+	ExReleaseFastMutex(&g_pCipherOptsMutex);
+
+	if (pSpareNode)
+		ExFreePoolWithTag(pSpareNode, CipherPoolTag);
+
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS SetCipherOptsBatch(EVHD_SET_CIPHER_CONFIG_REQUEST *pRequests, ULONG Count)
+{
+	NTSTATUS status = STATUS_SUCCESS;
+	CipherOptsEntry **ppSpareNodes = NULL;
+	ULONG i = 0;
+
+	for (i = 0; i < Count; ++i)
+	{
+		if (!CipherOptsValidAlgorithm(pRequests[i].Algorithm))
+			return STATUS_INVALID_PARAMETER;
+	}
+
+	// The batch is applied entirely or not at all, so every node that may be needed is allocated first
+	ppSpareNodes = ExAllocatePoolWithTag(PagedPool, Count * sizeof(CipherOptsEntry *), CipherPoolTag);
+	if (!ppSpareNodes)
+		return STATUS_NO_MEMORY;
+	RtlZeroMemory(ppSpareNodes, Count * sizeof(CipherOptsEntry *));
+	for (i = 0; i < Count; ++i)
+	{
+		ppSpareNodes[i] = ExAllocatePoolWithTag(NonPagedPoolNx, sizeof(CipherOptsEntry), CipherPoolTag);
+		if (!ppSpareNodes[i])
 		{
-			memcpy(&pThisNode->DiskId, pDiskId, sizeof(GUID));
-			pThisNode->Algorithm = Algorithm;
-			switch (Algorithm)
-			{
-            case ECipherAlgo_AesXts:
-            case ECipherAlgo_TwofishXts:
-            case ECipherAlgo_SerpentXts:
-				memcpy(&pThisNode->Opts.Xts256, pCipherOpts, sizeof(Xts256CipherOptions));
-				break;
-			}
+			status = STATUS_NO_MEMORY;
+			goto Cleanup;
 		}
-		break;
-	default:
-        
-		status = STATUS_INVALID_PARAMETER;
 	}
 
+	ExAcquireFastMutex(&g_pCipherOptsMutex);
+	for (i = 0; i < Count; ++i)
+		CipherOptsStore(&pRequests[i].DiskId, pRequests[i].Algorithm, &pRequests[i].Opts, &ppSpareNodes[i]);
 	ExReleaseFastMutex(&g_pCipherOptsMutex);
+
+Cleanup:
+	for (i = 0; i < Count; ++i)
+	{
+		if (ppSpareNodes[i])
+			ExFreePoolWithTag(ppSpareNodes[i], CipherPoolTag);
+	}
+	ExFreePoolWithTag(ppSpareNodes, CipherPoolTag);
+
 	return status;
 }
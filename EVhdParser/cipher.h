@@ -1,6 +1,6 @@
 #pragma once
 #include <ntifs.h>
-#include "CipherOpts.h"
+#include "Control.h"
 
 /** Creates cipher instance */
 typedef NTSTATUS(*CipherCreate_t)(PVOID cipherConfig, PVOID *pOutContext);
@@ -30,3 +30,5 @@ NTSTATUS CipherInit();
 NTSTATUS CipherCleanup();
 
 NTSTATUS SetCipherOpts(PGUID pDiskId, ECipherAlgo Algorithm, PVOID pCipherOpts);
+/** Validates all the configurations first, then applies them under a single acquisition of the options lock */
+NTSTATUS SetCipherOptsBatch(EVHD_SET_CIPHER_CONFIG_REQUEST *pRequests, ULONG Count);
@@ -1,7 +1,12 @@
 #include "stdafx.h"
 #include "utils.h"	
+#include "IrpPool.h"
 
-NTSTATUS SynchronouseCall(PFILE_OBJECT pFileObject, ULONG ulControlCode, PVOID InputBuffer,
+static const ULONG UtilsPoolTag = 'VVut';
+/* Buffered requests whose input and output are apart are copied through a buffer this large on the stack */
+#define SYNC_CALL_STACK_BUFFER 128
+
+static NTSTATUS SynchronouseCallBuilt(PFILE_OBJECT pFileObject, ULONG ulControlCode, PVOID InputBuffer,
 	ULONG InputBufferLength, PVOID OutputBuffer, ULONG OutputBufferLength)
 {
 	NTSTATUS status = STATUS_SUCCESS;
@@ -20,6 +25,75 @@ NTSTATUS SynchronouseCall(PFILE_OBJECT pFileObject, ULONG ulControlCode, PVOID I
 	return status;
 }
 
+NTSTATUS SynchronouseCall(PFILE_OBJECT pFileObject, ULONG ulControlCode, PVOID InputBuffer,
+	ULONG InputBufferLength, PVOID OutputBuffer, ULONG OutputBufferLength)
+{
+	NTSTATUS status = STATUS_SUCCESS;
+	UCHAR StackBuffer[SYNC_CALL_STACK_BUFFER];
+	PVOID pSystemBuffer = OutputBufferLength ? OutputBuffer : InputBuffer;
+	ULONG BufferLength = max(InputBufferLength, OutputBufferLength);
+	ULONG_PTR Information = 0;
+
+	if (METHOD_BUFFERED != METHOD_FROM_CTL_CODE(ulControlCode))
+		return SynchronouseCallBuilt(pFileObject, ulControlCode, InputBuffer, InputBufferLength, OutputBuffer,
+			OutputBufferLength);
+
+	// vhdmp reads the input from and writes the output to the same buffer
+	if (InputBufferLength && OutputBufferLength && InputBuffer != OutputBuffer)
+	{
+		pSystemBuffer = BufferLength <= sizeof(StackBuffer) ? StackBuffer
+			: ExAllocatePoolWithTag(NonPagedPoolNx, BufferLength, UtilsPoolTag);
+		if (!pSystemBuffer)
+			return STATUS_INSUFFICIENT_RESOURCES;
+		RtlCopyMemory(pSystemBuffer, InputBuffer, InputBufferLength);
+	}
+
+	status = IrpPool_Call(pFileObject, ulControlCode, pSystemBuffer, InputBufferLength, OutputBufferLength, &Information);
+
+	if (pSystemBuffer != OutputBuffer && pSystemBuffer != InputBuffer)
+	{
+		if (!NT_ERROR(status))
+			RtlCopyMemory(OutputBuffer, pSystemBuffer, min(Information, OutputBufferLength));
+		if (pSystemBuffer != StackBuffer)
+			ExFreePoolWithTag(pSystemBuffer, UtilsPoolTag);
+	}
+	return status;
+}
+
+NTSTATUS ConcurrentCalls(PFILE_OBJECT pFileObject, CONCURRENT_CALL *pCalls, ULONG Count)
+{
+	NTSTATUS status = STATUS_SUCCESS;
+	PDEVICE_OBJECT pDeviceObject = IoGetRelatedDeviceObject(pFileObject);
+	ULONG i = 0, Sent = 0;
+
+	for (Sent = 0; Sent < Count; ++Sent)
+	{
+		CONCURRENT_CALL *pCall = &pCalls[Sent];
+		pCall->pIrp = IrpPool_Allocate(pDeviceObject);
+		if (!pCall->pIrp)
+		{
+			status = STATUS_INSUFFICIENT_RESOURCES;
+			break;
+		}
+		IrpPool_PrepareIoControl(pCall->pIrp, pFileObject, pCall->ControlCode, pCall->SystemBuffer,
+			pCall->InputBufferLength, pCall->OutputBufferLength);
+		IrpPool_Send(pCall->pIrp, &pCall->Event);
+	}
+	for (i = Sent; i < Count; ++i)
+		pCalls[i].Status = status;
+
+	for (i = 0; i < Sent; ++i)
+	{
+		KeWaitForSingleObject(&pCalls[i].Event, Executive, KernelMode, FALSE, NULL);
+		pCalls[i].Status = pCalls[i].pIrp->IoStatus.Status;
+		IrpPool_Free(pCalls[i].pIrp);
+		pCalls[i].pIrp = NULL;
+		if (NT_SUCCESS(status) && !NT_SUCCESS(pCalls[i].Status))
+			status = pCalls[i].Status;
+	}
+	return status;
+}
+
 NTSTATUS DuplicateUnicodeString(PCUNICODE_STRING Source, PUNICODE_STRING Destination)
 {
 	Destination->Length = Source->Length;
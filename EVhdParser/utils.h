@@ -4,6 +4,21 @@
 NTSTATUS SynchronouseCall(PFILE_OBJECT pFileObject, ULONG ulControlCode, PVOID InputBuffer,
 	ULONG InputBufferLength, PVOID OutputBuffer, ULONG OutputBufferLength);
 
+/** Buffered request of ConcurrentCalls, Status holds its result once they return */
+typedef struct _CONCURRENT_CALL {
+	ULONG ControlCode;
+	/* Holds the input and receives the output, resident until ConcurrentCalls returns */
+	PVOID SystemBuffer;
+	ULONG InputBufferLength;
+	ULONG OutputBufferLength;
+	NTSTATUS Status;
+	PIRP pIrp;
+	KEVENT Event;
+} CONCURRENT_CALL;
+
+/** Sends all the requests with pooled IRPs before waiting for any of them, returns the first failure */
+NTSTATUS ConcurrentCalls(PFILE_OBJECT pFileObject, CONCURRENT_CALL *pCalls, ULONG Count);
+
 /** Crates UNICODE_STRING copy */
 NTSTATUS DuplicateUnicodeString(PCUNICODE_STRING Source, PUNICODE_STRING Destination);
 /** Replaces forward slashes with backward */
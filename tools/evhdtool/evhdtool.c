@@ -0,0 +1,6213 @@
+/*
+ * Offline tool for the files shared with the driver. Only uses the C runtime
+ * and, for log-bench, pthreads. Build it next to the sources with
+ *
+ *     cc -O2 -pthread -o evhdtool evhdtool.c ../../EVhdConfig/manifest.c
+ *
+ * Catalog source files hold one disk per line:
+ *
+ *     <DiskId> <algorithm> <data unit size> <policy flags> <key reference|-> [<crypto key hex> <tweak key hex>]
+ *
+ * keys are given only with the inline key policy flag (0x1). The flag 0x4 makes
+ * the disk report 4 KiB physical sectors to its guest, 0x8 shares the blocks a
+ * clone reads from its parent with the other clones.
+ */
+#if !defined(_WIN32)
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <errno.h>
+#if defined(_WIN32)
+#include <windows.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#endif
+#include "../../EVhdConfig/manifest.h"
+#include "../../EVhdParser/Catalog.h"
+#include "../../EVhdParser/LogRing.h"
+#include "../../EVhdParser/TraceFormat.h"
+#include "../../EVhdParser/FlightFormat.h"
+#include "../../EVhdParser/DiskCounters.h"
+#include "../../EVhdParser/SrbTiming.h"
+#include "../../EVhdParser/HeatFormat.h"
+#include "../../EVhdParser/ScsiCache.h"
+#include "../../EVhdParser/BlockCache.h"
+#include "../../EVhdParser/ParentOverlay.h"
+#include "../../EVhdParser/VhdLayout.h"
+#include "../../EVhdParser/ReadAhead.h"
+#include "../../EVhdParser/RequestTable.h"
+#include "../../EVhdParser/MessageQueue.h"
+#include "../../EVhdParser/Control.h"
+
+static const char *AlgorithmNames[] = { "disabled", "aes-xts", "twofish-xts", "serpent-xts" };
+
+static double Now()
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void PrintGuid(const GUID *pGuid)
+{
+    printf("%08X-%04X-%04X-%02X%02X-%02X%02X%02X%02X%02X%02X", pGuid->Data1, pGuid->Data2, pGuid->Data3,
+        pGuid->Data4[0], pGuid->Data4[1], pGuid->Data4[2], pGuid->Data4[3],
+        pGuid->Data4[4], pGuid->Data4[5], pGuid->Data4[6], pGuid->Data4[7]);
+}
+
+/** Reads a whole file, returns NULL on failure */
+static void *LoadFile(const char *pszPath, ULONG32 *pSize)
+{
+    FILE *pFile = fopen(pszPath, "rb");
+    void *pData = NULL;
+    long Size = 0;
+
+    if (!pFile)
+        return NULL;
+    if (0 == fseek(pFile, 0, SEEK_END) && (Size = ftell(pFile)) > 0 && Size <= CATALOG_MAX_SIZE &&
+        0 == fseek(pFile, 0, SEEK_SET) && NULL != (pData = malloc(Size)))
+    {
+        if (fread(pData, 1, Size, pFile) != (size_t)Size)
+        {
+            free(pData);
+            pData = NULL;
+        }
+    }
+    fclose(pFile);
+    *pSize = (ULONG32)Size;
+    return pData;
+}
+
+/** Writes the file under a temporary name and renames it over the target, readers see either version */
+static int WriteFileAtomic(const char *pszPath, const void *pData, ULONG32 Size)
+{
+    char szTemp[1024];
+    FILE *pFile = NULL;
+    int Ok = 0;
+
+    if (snprintf(szTemp, sizeof(szTemp), "%s.tmp", pszPath) >= (int)sizeof(szTemp))
+        return -1;
+    if (!(pFile = fopen(szTemp, "wb")))
+        return -1;
+    Ok = fwrite(pData, 1, Size, pFile) == Size && 0 == fflush(pFile);
+#if defined(_WIN32)
+    Ok = Ok && 0 == _commit(_fileno(pFile));
+#else
+    Ok = Ok && 0 == fsync(fileno(pFile));
+#endif
+    Ok = 0 == fclose(pFile) && Ok;
+#if defined(_WIN32)
+    Ok = Ok && MoveFileExA(szTemp, pszPath, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+#else
+    Ok = Ok && 0 == rename(szTemp, pszPath);
+#endif
+    if (!Ok)
+        remove(szTemp);
+    return Ok ? 0 : -1;
+}
+
+typedef struct {
+    CATALOG_ENTRY *pEntries;
+    ULONG32 Count;
+    ULONG32 Capacity;
+} ENTRY_LIST;
+
+static int AppendEntry(ENTRY_LIST *pList, const CATALOG_ENTRY *pEntry)
+{
+    if (pList->Count == pList->Capacity)
+    {
+        ULONG32 Capacity = pList->Capacity ? pList->Capacity * 2 : 1024;
+        CATALOG_ENTRY *pEntries = realloc(pList->pEntries, Capacity * sizeof(CATALOG_ENTRY));
+        if (!pEntries)
+            return -1;
+        pList->pEntries = pEntries;
+        pList->Capacity = Capacity;
+    }
+    pList->pEntries[pList->Count++] = *pEntry;
+    return 0;
+}
+
+/**
+ * Lays the entries out with their hash index. A disk listed twice keeps its last definition.
+ * Returns the image allocated with malloc or NULL.
+ */
+static CATALOG_HEADER *BuildCatalog(const CATALOG_ENTRY *pSource, ULONG32 Count, ULONG64 Generation, ULONG32 *pSize)
+{
+    CATALOG_HEADER *pHeader = NULL;
+    ULONG32 *pBuckets = NULL;
+    CATALOG_ENTRY *pEntries = NULL;
+    ULONG32 BucketCount = 16, EntryCount = 0, i = 0;
+    size_t Size = 0;
+
+    // Load factor of at most one keeps the chains short
+    while (BucketCount < Count)
+        BucketCount <<= 1;
+
+    Size = PARSER_RING_ALIGN(sizeof(CATALOG_HEADER) + (size_t)BucketCount * sizeof(ULONG32)) + (size_t)Count * sizeof(CATALOG_ENTRY);
+    if (Size > CATALOG_MAX_SIZE || !(pHeader = calloc(1, Size)))
+        return NULL;
+
+    pHeader->Magic = CATALOG_MAGIC;
+    pHeader->Version = CATALOG_VERSION;
+    pHeader->HeaderSize = sizeof(CATALOG_HEADER);
+    pHeader->Generation = Generation;
+    pHeader->BucketCount = BucketCount;
+    pHeader->BucketsOffset = sizeof(CATALOG_HEADER);
+    pHeader->EntriesOffset = PARSER_RING_ALIGN(sizeof(CATALOG_HEADER) + BucketCount * sizeof(ULONG32));
+    pBuckets = Catalog_Buckets(pHeader);
+    pEntries = Catalog_Entries(pHeader);
+    memset(pBuckets, 0xFF, BucketCount * sizeof(ULONG32));
+
+    for (i = 0; i < Count; ++i)
+    {
+        ULONG32 Bucket = Catalog_Hash(&pSource[i].DiskId) & (BucketCount - 1);
+        ULONG32 Index = pBuckets[Bucket];
+
+        while (Index != CATALOG_END && memcmp(&pEntries[Index].DiskId, &pSource[i].DiskId, sizeof(GUID)))
+            Index = pEntries[Index].Next;
+        if (Index != CATALOG_END)
+        {
+            ULONG32 Next = pEntries[Index].Next;
+            pEntries[Index] = pSource[i];
+            pEntries[Index].Next = Next;
+            continue;
+        }
+
+        pEntries[EntryCount] = pSource[i];
+        pEntries[EntryCount].Next = pBuckets[Bucket];
+        pBuckets[Bucket] = EntryCount++;
+    }
+
+    pHeader->EntryCount = EntryCount;
+    pHeader->FileSize = (ULONG32)(pHeader->EntriesOffset + EntryCount * sizeof(CATALOG_ENTRY));
+    pHeader->Checksum = Catalog_Checksum(pHeader, pHeader->FileSize);
+    *pSize = pHeader->FileSize;
+    return pHeader;
+}
+
+static int ParseCatalogLine(const char *pLine, CATALOG_ENTRY *pEntry)
+{
+    char Algorithm[16];
+    char KeyReference[40];
+    unsigned long DataUnitSize = 0;
+    long Flags = 0;
+    int Consumed = 0;
+    size_t i = 0;
+    const char *p = pLine;
+
+    while (isspace((unsigned char)*p))
+        ++p;
+    if (!*p || *p == '#')
+        return 0;
+
+    memset(pEntry, 0, sizeof(*pEntry));
+    if (!(p = Manifest_ParseGuid(p, &pEntry->DiskId)))
+        return -1;
+    if (4 != sscanf(p, " %15s %lu %li %39s%n", Algorithm, &DataUnitSize, &Flags, KeyReference, &Consumed))
+        return -1;
+    p += Consumed;
+
+    for (i = 0; i < sizeof(AlgorithmNames) / sizeof(AlgorithmNames[0]); ++i)
+    {
+        if (!strcmp(Algorithm, AlgorithmNames[i]))
+            break;
+    }
+    if (i == sizeof(AlgorithmNames) / sizeof(AlgorithmNames[0]) || (DataUnitSize != 512 && DataUnitSize != 4096))
+        return -1;
+    pEntry->Algorithm = (ULONG32)i;
+    pEntry->DataUnitSize = (ULONG32)DataUnitSize;
+    pEntry->PolicyFlags = (ULONG32)Flags;
+    if (strcmp(KeyReference, "-") && (!Manifest_ParseGuid(KeyReference, &pEntry->KeyReference)))
+        return -1;
+
+    if (Flags & CATALOG_FLAG_INLINE_KEY)
+    {
+        while (isspace((unsigned char)*p))
+            ++p;
+        if (!(p = Manifest_ParseHex(p, pEntry->Key.CryptoKey, sizeof(pEntry->Key.CryptoKey))) || !isspace((unsigned char)*p))
+            return -1;
+        while (isspace((unsigned char)*p))
+            ++p;
+        if (!(p = Manifest_ParseHex(p, pEntry->Key.TweakKey, sizeof(pEntry->Key.TweakKey))))
+            return -1;
+    }
+
+    while (isspace((unsigned char)*p))
+        ++p;
+    return (!*p || *p == '#') ? 1 : -1;
+}
+
+static int WriteCatalog(const char *pszPath, ENTRY_LIST *pList)
+{
+    CATALOG_HEADER *pOld = NULL, *pImage = NULL;
+    ULONG32 OldSize = 0, Size = 0;
+    ULONG64 Generation = 1;
+    int Result = 0;
+
+    // Generations only grow so the driver can tell a stale file from the loaded one
+    pOld = LoadFile(pszPath, &OldSize);
+    if (pOld && Catalog_Validate(pOld, OldSize))
+        Generation = pOld->Generation + 1;
+    free(pOld);
+
+    if (!(pImage = BuildCatalog(pList->pEntries, pList->Count, Generation, &Size)))
+    {
+        fprintf(stderr, "Catalog is too large\n");
+        return 1;
+    }
+    if (0 != WriteFileAtomic(pszPath, pImage, Size))
+    {
+        perror(pszPath);
+        Result = 1;
+    }
+    else
+        printf("Wrote generation %llu with %u entries, %u bytes\n", (unsigned long long)Generation, pImage->EntryCount, Size);
+
+    memset(pImage, 0, Size);
+    free(pImage);
+    return Result;
+}
+
+static int CatalogBuild(const char *pszSource, const char *pszCatalog)
+{
+    ENTRY_LIST List = { 0 };
+    CATALOG_ENTRY Entry;
+    char Line[512];
+    unsigned long LineNumber = 0;
+    int Result = 0;
+    FILE *pFile = fopen(pszSource, "r");
+
+    if (!pFile)
+    {
+        perror(pszSource);
+        return 1;
+    }
+
+    while (fgets(Line, sizeof(Line), pFile))
+    {
+        ++LineNumber;
+        Result = ParseCatalogLine(Line, &Entry);
+        if (Result < 0)
+        {
+            fprintf(stderr, "%s:%lu: syntax error\n", pszSource, LineNumber);
+            break;
+        }
+        if (Result > 0 && 0 != AppendEntry(&List, &Entry))
+        {
+            fprintf(stderr, "Out of memory\n");
+            Result = -1;
+            break;
+        }
+    }
+    fclose(pFile);
+
+    Result = Result < 0 ? 1 : WriteCatalog(pszCatalog, &List);
+
+    if (List.pEntries)
+        memset(List.pEntries, 0, List.Capacity * sizeof(CATALOG_ENTRY));
+    free(List.pEntries);
+    return Result;
+}
+
+static int CatalogDump(const char *pszCatalog)
+{
+    ULONG32 Size = 0, i = 0, Longest = 0;
+    CATALOG_HEADER *pHeader = LoadFile(pszCatalog, &Size);
+    CATALOG_ENTRY *pEntries = NULL;
+    ULONG32 *pBuckets = NULL;
+
+    if (!pHeader || !Catalog_Validate(pHeader, Size))
+    {
+        fprintf(stderr, "%s is not a valid catalog\n", pszCatalog);
+        free(pHeader);
+        return 1;
+    }
+
+    pBuckets = Catalog_Buckets(pHeader);
+    pEntries = Catalog_Entries(pHeader);
+    for (i = 0; i < pHeader->BucketCount; ++i)
+    {
+        ULONG32 Length = 0, Index = 0;
+        for (Index = pBuckets[i]; Index != CATALOG_END && Length < pHeader->EntryCount; Index = pEntries[Index].Next)
+            ++Length;
+        if (Length > Longest)
+            Longest = Length;
+    }
+
+    printf("Generation %llu, %u entries, %u buckets, longest chain %u, checksum %08X\n",
+        (unsigned long long)pHeader->Generation, pHeader->EntryCount, pHeader->BucketCount, Longest, pHeader->Checksum);
+    for (i = 0; i < pHeader->EntryCount; ++i)
+    {
+        CATALOG_ENTRY *pEntry = &pEntries[i];
+        PrintGuid(&pEntry->DiskId);
+        printf(" %s %u 0x%x ", pEntry->Algorithm < 4 ? AlgorithmNames[pEntry->Algorithm] : "?",
+            pEntry->DataUnitSize, pEntry->PolicyFlags);
+        PrintGuid(&pEntry->KeyReference);
+        // Keys are never printed
+        printf("%s%s%s\n", (pEntry->PolicyFlags & CATALOG_FLAG_INLINE_KEY) ? " <inline key>" : "",
+            (pEntry->PolicyFlags & CATALOG_FLAG_ADVERTISE_4K) ? " <4K sectors>" : "",
+            (pEntry->PolicyFlags & CATALOG_FLAG_SHARE_PARENT) ? " <shared parent>" : "");
+    }
+
+    memset(pHeader, 0, Size);
+    free(pHeader);
+    return 0;
+}
+
+/** Measures what the driver does at start: read, validate and look disks up */
+static int CatalogBench(const char *pszCatalog, ULONG32 Count)
+{
+    ENTRY_LIST List = { 0 };
+    CATALOG_ENTRY Entry;
+    CATALOG_HEADER *pHeader = NULL;
+    ULONG32 Size = 0, i = 0, Found = 0;
+    double Start = 0, Read = 0, Validated = 0, Looked = 0;
+
+    memset(&Entry, 0, sizeof(Entry));
+    Entry.Algorithm = ECipherAlgo_AesXts;
+    Entry.DataUnitSize = 512;
+    srand(1);
+    for (i = 0; i < Count; ++i)
+    {
+        size_t j = 0;
+        for (j = 0; j < sizeof(GUID); ++j)
+            ((UCHAR *)&Entry.DiskId)[j] = (UCHAR)rand();
+        if (0 != AppendEntry(&List, &Entry))
+            return 1;
+    }
+    if (0 != WriteCatalog(pszCatalog, &List))
+        return 1;
+
+    Start = Now();
+    pHeader = LoadFile(pszCatalog, &Size);
+    Read = Now();
+    if (!pHeader || !Catalog_Validate(pHeader, Size))
+    {
+        fprintf(stderr, "Catalog did not validate\n");
+        return 1;
+    }
+    Validated = Now();
+    for (i = 0; i < List.Count; ++i)
+        Found += NULL != Catalog_Find(pHeader, &List.pEntries[i].DiskId);
+    Looked = Now();
+
+    printf("read %.2f ms, validate %.2f ms, %u/%u lookups %.1f ns each\n", (Read - Start) * 1e3,
+        (Validated - Read) * 1e3, Found, List.Count, (Looked - Validated) * 1e9 / List.Count);
+
+    free(pHeader);
+    free(List.pEntries);
+    return Found == List.Count ? 0 : 1;
+}
+
+#if !defined(_WIN32)
+/*
+ * Port of the driver logger: the same rings, formatting into the slot of the current processor and a
+ * single flusher writing batches. The previous scheme, one write per line under a lock, is measured for
+ * comparison.
+ */
+#define LOG_BENCH_BATCH 0x10000
+
+typedef struct _LOG_BENCH {
+    int File;
+    int Rings;
+    LONG Lines;
+    volatile LONG Stopping;
+    LOG_RING *pRings;
+    pthread_mutex_t Lock;
+    pthread_cond_t Wake;
+    long long Written;
+    long long Batches;
+} LOG_BENCH;
+
+typedef struct _LOG_BENCH_PRODUCER {
+    LOG_BENCH *pBench;
+    int Producer;
+    long long Written;
+} LOG_BENCH_PRODUCER;
+
+static void LogBenchFormat(char *pBuffer, size_t Size, int Producer, LONG Line)
+{
+    struct timespec ts;
+    struct tm Fields;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    localtime_r(&ts.tv_sec, &Fields);
+    snprintf(pBuffer, Size, "%04d.%02d.%02d %02d:%02d:%02d.%03ld PR:0x%04X TH:0x%04X IL:%d INFO   : "
+        "[LogBench] producer %d line %d disk %08X\r\n",
+        Fields.tm_year + 1900, Fields.tm_mon + 1, Fields.tm_mday, Fields.tm_hour, Fields.tm_min, Fields.tm_sec,
+        ts.tv_nsec / 1000000, (unsigned)getpid() & 0xFFFF, Producer & 0xFFFF, 0, Producer, Line, (unsigned)Line * 2654435761u);
+}
+
+static void *LogBenchLockedProducer(void *Context)
+{
+    LOG_BENCH_PRODUCER *pProducer = Context;
+    LOG_BENCH *pBench = pProducer->pBench;
+    int Producer = pProducer->Producer;
+    char Line[LOG_RING_SLOT_SIZE];
+    LONG i = 0;
+
+    for (i = 0; i < pBench->Lines; ++i)
+    {
+        LogBenchFormat(Line, sizeof(Line), Producer, i);
+        pthread_mutex_lock(&pBench->Lock);
+        if (write(pBench->File, Line, strlen(Line)) > 0)
+            ++pProducer->Written;
+        pthread_mutex_unlock(&pBench->Lock);
+    }
+    return NULL;
+}
+
+static void *LogBenchRingProducer(void *Context)
+{
+    LOG_BENCH_PRODUCER *pProducer = Context;
+    LOG_BENCH *pBench = pProducer->pBench;
+    int Producer = pProducer->Producer;
+    LONG i = 0;
+
+    for (i = 0; i < pBench->Lines; ++i)
+    {
+        int Cpu = sched_getcpu();
+        LOG_RING *pRing = &pBench->pRings[(Cpu < 0 ? Producer : Cpu) % pBench->Rings];
+        LOG_RING_SLOT *pSlot = LogRing_Reserve(pRing);
+        if (!pSlot)
+            continue;
+        LogBenchFormat(pSlot->Data, sizeof(pSlot->Data), Producer, i);
+        pSlot->Length = (USHORT)strlen(pSlot->Data);
+        LogRing_Commit(pSlot);
+        if (LogRing_Used(pRing) >= LOG_RING_SLOTS * 3 / 4)
+            pthread_cond_signal(&pBench->Wake);
+    }
+    return NULL;
+}
+
+static void LogBenchFlush(LOG_BENCH *pBench, char *pBatch)
+{
+    size_t Length = 0;
+    int i = 0;
+    LOG_RING_SLOT *pSlot = NULL;
+
+    for (i = 0; i < pBench->Rings; ++i)
+    {
+        while (NULL != (pSlot = LogRing_Peek(&pBench->pRings[i])))
+        {
+            if (Length + pSlot->Length > LOG_BENCH_BATCH)
+            {
+                pBench->Batches += write(pBench->File, pBatch, Length) > 0;
+                Length = 0;
+            }
+            memcpy(pBatch + Length, pSlot->Data, pSlot->Length);
+            Length += pSlot->Length;
+            ++pBench->Written;
+            LogRing_Release(&pBench->pRings[i], pSlot);
+        }
+    }
+    if (Length)
+        pBench->Batches += write(pBench->File, pBatch, Length) > 0;
+}
+
+static void *LogBenchFlusher(void *Context)
+{
+    LOG_BENCH *pBench = Context;
+    char *pBatch = malloc(LOG_BENCH_BATCH);
+
+    while (pBatch && !pBench->Stopping)
+    {
+        struct timespec Deadline;
+        clock_gettime(CLOCK_REALTIME, &Deadline);
+        Deadline.tv_nsec += 200 * 1000000;
+        if (Deadline.tv_nsec >= 1000000000)
+        {
+            Deadline.tv_sec++;
+            Deadline.tv_nsec -= 1000000000;
+        }
+        pthread_mutex_lock(&pBench->Lock);
+        pthread_cond_timedwait(&pBench->Wake, &pBench->Lock, &Deadline);
+        pthread_mutex_unlock(&pBench->Lock);
+        LogBenchFlush(pBench, pBatch);
+    }
+    if (pBatch)
+        LogBenchFlush(pBench, pBatch);
+    free(pBatch);
+    return NULL;
+}
+
+static int LogBenchRun(const char *pszFile, int Producers, LONG Lines, int UseRings)
+{
+    LOG_BENCH Bench;
+    pthread_t *pThreads = calloc(Producers, sizeof(pthread_t));
+    LOG_BENCH_PRODUCER *pArgs = calloc(Producers, sizeof(LOG_BENCH_PRODUCER));
+    pthread_t Flusher;
+    long long Dropped = 0;
+    LONG HighWater = 0;
+    double Start = 0, Produced = 0, Flushed = 0;
+    int i = 0;
+
+    memset(&Bench, 0, sizeof(Bench));
+    Bench.File = open(pszFile, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    Bench.Rings = (int)sysconf(_SC_NPROCESSORS_CONF);
+    Bench.Lines = Lines;
+    Bench.pRings = UseRings ? aligned_alloc(64, Bench.Rings * sizeof(LOG_RING)) : NULL;
+    pthread_mutex_init(&Bench.Lock, NULL);
+    pthread_cond_init(&Bench.Wake, NULL);
+    if (Bench.File < 0 || !pThreads || !pArgs || (UseRings && !Bench.pRings))
+    {
+        fprintf(stderr, "Can not set up the benchmark on %s\n", pszFile);
+        return 1;
+    }
+    for (i = 0; UseRings && i < Bench.Rings; ++i)
+        LogRing_Initialize(&Bench.pRings[i]);
+
+    if (UseRings)
+        pthread_create(&Flusher, NULL, LogBenchFlusher, &Bench);
+    Start = Now();
+    for (i = 0; i < Producers; ++i)
+    {
+        pArgs[i].pBench = &Bench;
+        pArgs[i].Producer = i;
+        pthread_create(&pThreads[i], NULL, UseRings ? LogBenchRingProducer : LogBenchLockedProducer, &pArgs[i]);
+    }
+    for (i = 0; i < Producers; ++i)
+        pthread_join(pThreads[i], NULL);
+    Produced = Now();
+    if (UseRings)
+    {
+        __atomic_store_n(&Bench.Stopping, 1, __ATOMIC_SEQ_CST);
+        pthread_cond_signal(&Bench.Wake);
+        pthread_join(Flusher, NULL);
+    }
+    Flushed = Now();
+
+    for (i = 0; !UseRings && i < Producers; ++i)
+        Bench.Written += pArgs[i].Written;
+    for (i = 0; UseRings && i < Bench.Rings; ++i)
+    {
+        Dropped += Bench.pRings[i].Dropped;
+        if (Bench.pRings[i].HighWater > HighWater)
+            HighWater = Bench.pRings[i].HighWater;
+    }
+
+    // Dropped lines skip the formatting, only lines that reached the file are counted as throughput
+    printf("%-6s %d producers: %.0f lines/s, %.0f ns per line, %lld written, %lld dropped, %lld writes, "
+        "ring high-water %d, %.1f ms to drain\n",
+        UseRings ? "rings" : "locked", Producers, Bench.Written / (Flushed - Start),
+        Bench.Written ? (Flushed - Start) * 1e9 / Bench.Written : 0.0, Bench.Written, Dropped,
+        UseRings ? Bench.Batches : Bench.Written, HighWater, (Flushed - Produced) * 1e3);
+
+    close(Bench.File);
+    free(Bench.pRings);
+    free(pThreads);
+    free(pArgs);
+    return 0;
+}
+
+/** Measures the driver logger against the per-line writes it replaced */
+static int LogBench(const char *pszFile, int Producers, LONG Lines)
+{
+    if (Producers <= 0 || Lines <= 0)
+        return 1;
+    return LogBenchRun(pszFile, Producers, Lines, 0) | LogBenchRun(pszFile, Producers, Lines, 1);
+}
+#endif
+
+static const char *LevelNames[] = { "       :", "FATAL  :", "ERROR  :", "WARNING:", "INFO   :", "VERBOSE:", "DEBUG  :" };
+
+typedef struct _TRACE_SYNC {
+    ULONG64 Tsc;
+    ULONG64 Time;
+} TRACE_SYNC;
+
+static int CompareSync(const void *a, const void *b)
+{
+    const TRACE_SYNC *pA = a, *pB = b;
+    return pA->Tsc < pB->Tsc ? -1 : pA->Tsc > pB->Tsc;
+}
+
+/** Events are sorted by TSC, records of different processors are interleaved in the file */
+static int CompareEvent(const void *a, const void *b)
+{
+    const TRACE_RECORD *pA = *(const TRACE_RECORD * const *)a, *pB = *(const TRACE_RECORD * const *)b;
+    if (pA->Tsc != pB->Tsc)
+        return pA->Tsc < pB->Tsc ? -1 : 1;
+    return pA < pB ? -1 : pA > pB;
+}
+
+/** Converts a TSC stamp to local time through the two sync records around it, or the closest two */
+static ULONG64 TraceTime(const TRACE_SYNC *pSyncs, ULONG32 Count, ULONG64 Tsc)
+{
+    ULONG32 Low = 0, High = Count - 1;
+
+    while (High - Low > 1)
+    {
+        ULONG32 Middle = (Low + High) / 2;
+        if (pSyncs[Middle].Tsc <= Tsc)
+            Low = Middle;
+        else
+            High = Middle;
+    }
+    if (Low == High || pSyncs[High].Tsc == pSyncs[Low].Tsc)
+        return pSyncs[Low].Time;
+    return pSyncs[Low].Time + (ULONG64)(((double)Tsc - (double)pSyncs[Low].Tsc) *
+        ((double)pSyncs[High].Time - (double)pSyncs[Low].Time) / ((double)pSyncs[High].Tsc - (double)pSyncs[Low].Tsc));
+}
+
+/** Prints a local time in 100 ns units since 1601 up to the seconds */
+static void PrintLocalTime(FILE *pOut, ULONG64 Time)
+{
+    // 100 ns units since 1601 to a civil date, the days are counted from 0000-03-01
+    long long Days = (long long)(Time / 864000000000ULL) + 584694;
+    ULONG64 Rest = Time % 864000000000ULL;
+    long long Era = Days / 146097, DayOfEra = Days - Era * 146097;
+    long long YearOfEra = (DayOfEra - DayOfEra / 1460 + DayOfEra / 36524 - DayOfEra / 146096) / 365;
+    long long DayOfYear = DayOfEra - (365 * YearOfEra + YearOfEra / 4 - YearOfEra / 100);
+    long long MonthIndex = (5 * DayOfYear + 2) / 153;
+    unsigned Day = (unsigned)(DayOfYear - (153 * MonthIndex + 2) / 5 + 1);
+    unsigned Month = (unsigned)(MonthIndex < 10 ? MonthIndex + 3 : MonthIndex - 9);
+    unsigned Year = (unsigned)(YearOfEra + Era * 400 + (Month <= 2));
+
+    fprintf(pOut, "%04u.%02u.%02u %02u:%02u:%02u", Year, Month, Day,
+        (unsigned)(Rest / 36000000000ULL), (unsigned)(Rest / 600000000 % 60), (unsigned)(Rest / 10000000 % 60));
+}
+
+/** Prints the header Log_Print puts in front of every line */
+static void TracePrintHeader(FILE *pOut, ULONG64 Time, const TRACE_RECORD *pRecord, UCHAR Level)
+{
+    PrintLocalTime(pOut, Time);
+    fprintf(pOut, ".%03u PR:0x%04X TH:0x%04X IL:%d %s ", (unsigned)(Time % 10000000 / 10000),
+        pRecord->ProcessId, pRecord->ThreadId, pRecord->Irql,
+        Level < sizeof(LevelNames) / sizeof(LevelNames[0]) ? LevelNames[Level] : LevelNames[0]);
+}
+
+/** Reads the next argument of an event, returns 0 if the event has no more */
+static int TraceNextArg(const UCHAR **ppArg, const UCHAR *pEnd, ULONG32 *pLeft, ULONG64 *pValue)
+{
+    if (!*pLeft || *ppArg + sizeof(ULONG64) > pEnd)
+        return 0;
+    memcpy(pValue, *ppArg, sizeof(ULONG64));
+    *ppArg += sizeof(ULONG64);
+    --*pLeft;
+    return 1;
+}
+
+/** Rebuilds the message of an event, every conversion is handed to the C runtime printf with its arguments */
+static void TracePrintMessage(FILE *pOut, const char *pszFormat, const TRACE_RECORD *pRecord)
+{
+    const UCHAR *pArg = (const UCHAR *)(pRecord + 1), *pEnd = (const UCHAR *)pRecord + pRecord->Size;
+    ULONG32 Left = pRecord->ArgCount, Stars = 0;
+    const char *p = pszFormat;
+
+    while (*p)
+    {
+        char Spec[64], Text[TRACE_MAX_STRING + 1];
+        size_t Used = 1;
+        const char *pStart = p, *pConversion = NULL;
+        UCHAR Type = TraceArgNone;
+        ULONG64 Value = 0;
+
+        if (*p != '%')
+        {
+            fputc(*p++, pOut);
+            continue;
+        }
+        p = Trace_ParseSpec(p + 1, &Type, &Stars);
+        if (Type == TraceArgNone && !Stars)
+        {
+            fputc('%', pOut);
+            continue;
+        }
+
+        // Flags, width and precision are kept, '*' is replaced by its argument
+        Spec[0] = '%';
+        for (pStart = pStart + 1; strchr("-+ #0123456789.*", *pStart) && *pStart && Used < 32; ++pStart)
+        {
+            if (*pStart != '*')
+                Spec[Used++] = *pStart;
+            else if (TraceNextArg(&pArg, pEnd, &Left, &Value))
+                Used += snprintf(Spec + Used, sizeof(Spec) - Used, "%d", (int)(LONG)Value);
+        }
+        pConversion = p - 1;
+        if (!TraceNextArg(&pArg, pEnd, &Left, &Value))
+        {
+            fputs("?", pOut);
+            continue;
+        }
+
+        switch (Type)
+        {
+        case TraceArgInt32:
+            if (pConversion - pStart >= 1 && pConversion[-1] == 'h')
+                Spec[Used++] = 'h';
+            if (pConversion - pStart >= 2 && pConversion[-1] == 'h' && pConversion[-2] == 'h')
+                Spec[Used++] = 'h';
+            Spec[Used++] = *pConversion == 'C' ? 'c' : *pConversion;
+            Spec[Used] = 0;
+            fprintf(pOut, Spec, (ULONG32)Value);
+            break;
+        case TraceArgInt64:
+            snprintf(Spec + Used, sizeof(Spec) - Used, "ll%c", *pConversion);
+            fprintf(pOut, Spec, (unsigned long long)Value);
+            break;
+        case TraceArgString:
+        case TraceArgWideString:
+            if (Value == TRACE_NULL_STRING)
+                strcpy(Text, "(null)");
+            else
+            {
+                ULONG32 Length = (ULONG32)Value, i = 0, Step = Type == TraceArgWideString ? 2 : 1;
+                if (Length > TRACE_MAX_STRING || pArg + Length > pEnd)
+                    Length = 0;
+                // Wide strings are narrowed, the driver only logs paths and names
+                for (i = 0; i < Length / Step; ++i)
+                    Text[i] = (char)pArg[i * Step];
+                Text[i] = 0;
+                pArg += TRACE_ALIGN(Length);
+            }
+            Spec[Used++] = 's';
+            Spec[Used] = 0;
+            fprintf(pOut, Spec, Text);
+            break;
+        default:
+            fprintf(pOut, *pConversion == 'p' ? "%016llX" : "0x%llX", (unsigned long long)Value);
+            break;
+        }
+    }
+}
+
+/** Rebuilds the text lines of a binary trace file */
+static int TraceDecode(const char *pszTrace)
+{
+    ULONG32 Size = 0, Offset = 0, i = 0, MaxId = 0, SyncCount = 0, EventCount = 0, Unknown = 0;
+    UCHAR *pFile = LoadFile(pszTrace, &Size);
+    TRACE_FILE_HEADER *pHeader = (TRACE_FILE_HEADER *)pFile;
+    const TRACE_CALLSITE_ENTRY **ppSites = NULL;
+    const TRACE_RECORD **ppEvents = NULL;
+    TRACE_SYNC *pSyncs = NULL;
+    int Result = 1;
+
+    if (!pFile || Size < sizeof(TRACE_FILE_HEADER) || pHeader->Magic != TRACE_FILE_MAGIC ||
+        pHeader->Version != TRACE_FILE_VERSION || pHeader->TableSize > Size - sizeof(TRACE_FILE_HEADER))
+    {
+        fprintf(stderr, "%s is not a trace file\n", pszTrace);
+        goto Cleanup;
+    }
+
+    for (Offset = sizeof(TRACE_FILE_HEADER); Offset < sizeof(TRACE_FILE_HEADER) + pHeader->TableSize; )
+    {
+        const TRACE_CALLSITE_ENTRY *pEntry = (const TRACE_CALLSITE_ENTRY *)(pFile + Offset);
+        if (pEntry->Size < sizeof(TRACE_CALLSITE_ENTRY) || pEntry->Size > sizeof(TRACE_FILE_HEADER) + pHeader->TableSize - Offset)
+            break;
+        if (pEntry->Id > MaxId)
+            MaxId = pEntry->Id;
+        Offset += pEntry->Size;
+    }
+    ppSites = calloc(MaxId + 1, sizeof(*ppSites));
+    ppEvents = calloc(Size / sizeof(TRACE_RECORD), sizeof(*ppEvents));
+    pSyncs = calloc(Size / TRACE_SYNC_SIZE, sizeof(*pSyncs));
+    if (!ppSites || !ppEvents || !pSyncs)
+        goto Cleanup;
+
+    for (Offset = sizeof(TRACE_FILE_HEADER); Offset < sizeof(TRACE_FILE_HEADER) + pHeader->TableSize; )
+    {
+        const TRACE_CALLSITE_ENTRY *pEntry = (const TRACE_CALLSITE_ENTRY *)(pFile + Offset);
+        if (pEntry->Size < sizeof(TRACE_CALLSITE_ENTRY) || pEntry->Size > sizeof(TRACE_FILE_HEADER) + pHeader->TableSize - Offset)
+            break;
+        if ((ULONG32)sizeof(TRACE_CALLSITE_ENTRY) + pEntry->FunctionLength + pEntry->FormatLength <= pEntry->Size &&
+            pEntry->FormatLength && !((const char *)(pEntry + 1))[pEntry->FunctionLength + pEntry->FormatLength - 1])
+            ppSites[pEntry->Id] = pEntry;
+        Offset += pEntry->Size;
+    }
+
+    // A partially written record ends the trace
+    for (Offset = sizeof(TRACE_FILE_HEADER) + pHeader->TableSize; Offset + sizeof(TRACE_RECORD) <= Size; )
+    {
+        const TRACE_RECORD *pRecord = (const TRACE_RECORD *)(pFile + Offset);
+        if (pRecord->Size < sizeof(TRACE_RECORD) || pRecord->Size & 7 || pRecord->Size > Size - Offset)
+            break;
+        if (pRecord->Type == TRACE_RECORD_SYNC && pRecord->Size >= TRACE_SYNC_SIZE)
+        {
+            pSyncs[SyncCount].Tsc = pRecord->Tsc;
+            memcpy(&pSyncs[SyncCount++].Time, pRecord + 1, sizeof(ULONG64));
+        }
+        else if (pRecord->Type == TRACE_RECORD_EVENT)
+            ppEvents[EventCount++] = pRecord;
+        Offset += pRecord->Size;
+    }
+    if (!SyncCount)
+    {
+        fprintf(stderr, "%s has no sync record\n", pszTrace);
+        goto Cleanup;
+    }
+
+    qsort(pSyncs, SyncCount, sizeof(*pSyncs), CompareSync);
+    qsort(ppEvents, EventCount, sizeof(*ppEvents), CompareEvent);
+    for (i = 0; i < EventCount; ++i)
+    {
+        const TRACE_CALLSITE_ENTRY *pEntry = ppEvents[i]->CallsiteId <= MaxId ? ppSites[ppEvents[i]->CallsiteId] : NULL;
+        TracePrintHeader(stdout, TraceTime(pSyncs, SyncCount, ppEvents[i]->Tsc), ppEvents[i], pEntry ? pEntry->Level : 0);
+        if (!pEntry)
+        {
+            printf("<unknown call site %u>\r\n", ppEvents[i]->CallsiteId);
+            ++Unknown;
+            continue;
+        }
+        TracePrintMessage(stdout, (const char *)(pEntry + 1) + pEntry->FunctionLength, ppEvents[i]);
+    }
+
+    fprintf(stderr, "%u events, %u call sites, %u sync records, %u unknown call sites%s\n", EventCount,
+        pHeader->CallsiteCount, SyncCount, Unknown, Offset < Size ? ", trailing data ignored" : "");
+    Result = 0;
+
+Cleanup:
+    free(pSyncs);
+    free(ppEvents);
+    free(ppSites);
+    free(pFile);
+    return Result;
+}
+
+static const char *FlightTypeNames[] = {
+    "?", "MOUNT", "MOUNT-DONE", "DISMOUNT", "SRB-START", "SRB-DONE", "KEY-REQUEST", "KEY-RESPONSE", "ERROR", "SRB-STUCK"
+};
+
+typedef struct _FLIGHT_ENTRY {
+    const FLIGHT_EVENT *pEvent;
+    ULONG32 Processor;
+} FLIGHT_ENTRY;
+
+static int CompareFlightEntry(const void *a, const void *b)
+{
+    const FLIGHT_ENTRY *pA = a, *pB = b;
+    if (pA->pEvent->Tsc != pB->pEvent->Tsc)
+        return pA->pEvent->Tsc < pB->pEvent->Tsc ? -1 : 1;
+    if (pA->Processor != pB->Processor)
+        return pA->Processor < pB->Processor ? -1 : 1;
+    return pA->pEvent->Sequence < pB->pEvent->Sequence ? -1 : pA->pEvent->Sequence > pB->pEvent->Sequence;
+}
+
+static const char *FlightOpcodeName(UCHAR Opcode)
+{
+    switch (Opcode)
+    {
+    case 0x08: return "READ(6)";
+    case 0x0A: return "WRITE(6)";
+    case 0x28: return "READ(10)";
+    case 0x2A: return "WRITE(10)";
+    case 0xA8: return "READ(12)";
+    case 0xAA: return "WRITE(12)";
+    case 0x88: return "READ(16)";
+    case 0x8A: return "WRITE(16)";
+    case 0x35: return "SYNC-CACHE(10)";
+    case 0x42: return "UNMAP";
+    case 0x12: return "INQUIRY";
+    case 0x25: return "READ-CAPACITY(10)";
+    case 0x9E: return "READ-CAPACITY(16)";
+    }
+    return NULL;
+}
+
+static void FlightPrintEvent(const FLIGHT_ENTRY *pEntry, const TRACE_SYNC *pSyncs)
+{
+    const FLIGHT_EVENT *pEvent = pEntry->pEvent;
+    ULONG64 Time = TraceTime(pSyncs, 2, pEvent->Tsc);
+    const char *pszOpcode = FlightOpcodeName(pEvent->Opcode);
+    GUID DiskId;
+
+    PrintLocalTime(stdout, Time);
+    printf(".%06u CPU:%-3u DISK:%-5u %-12s ", (unsigned)(Time % 10000000 / 10), pEntry->Processor, pEvent->DiskTag,
+        pEvent->Type < sizeof(FlightTypeNames) / sizeof(FlightTypeNames[0]) ? FlightTypeNames[pEvent->Type] : FlightTypeNames[0]);
+    switch (pEvent->Type)
+    {
+    case FlightEventMount:
+        memcpy(&DiskId, &pEvent->Lba, sizeof(ULONG64));
+        memcpy(DiskId.Data4, &pEvent->Length, sizeof(ULONG32));
+        memcpy(DiskId.Data4 + 4, &pEvent->Status, sizeof(ULONG32));
+        PrintGuid(&DiskId);
+        break;
+    case FlightEventMountDone:
+    case FlightEventDismount:
+        printf("status 0x%08X", pEvent->Status);
+        break;
+    case FlightEventSrbStart:
+    case FlightEventSrbComplete:
+    case FlightEventSrbStuck:
+        if (pszOpcode)
+            printf("%-17s", pszOpcode);
+        else
+            printf("op 0x%02X%10s", pEvent->Opcode, "");
+        printf(" lba 0x%llX, %u bytes", (unsigned long long)pEvent->Lba, pEvent->Length);
+        if (pEvent->Type == FlightEventSrbComplete)
+            printf(", status 0x%08X", pEvent->Status);
+        else if (pEvent->Type == FlightEventSrbStuck)
+            printf(", in flight for %u ms", pEvent->Status);
+        break;
+    case FlightEventKeyRequest:
+        printf("message type %u", pEvent->Opcode);
+        break;
+    case FlightEventKeyResponse:
+        printf("message type %u, request %llu, %u us, status 0x%08X", pEvent->Opcode,
+            (unsigned long long)pEvent->Lba, pEvent->Length, pEvent->Status);
+        break;
+    case FlightEventError:
+        printf("%s category 0x%02X, line %u", pEvent->Length < sizeof(LevelNames) / sizeof(LevelNames[0]) ?
+            LevelNames[pEvent->Length] : LevelNames[0], pEvent->Opcode, pEvent->Status);
+        break;
+    }
+    printf("\n");
+}
+
+/** Prints the events of a flight recorder snapshot in TSC order, the rings of all processors merged */
+static int FlightDecode(const char *pszSnapshot)
+{
+    ULONG32 Size = 0, Ring = 0, i = 0, Count = 0, Recorded = 0, Torn = 0;
+    UCHAR *pFile = LoadFile(pszSnapshot, &Size);
+    FLIGHT_SNAPSHOT_HEADER *pHeader = (FLIGHT_SNAPSHOT_HEADER *)pFile;
+    FLIGHT_ENTRY *pEntries = NULL;
+    TRACE_SYNC Syncs[2];
+    int Result = 1;
+
+    if (!pFile || Size < sizeof(FLIGHT_SNAPSHOT_HEADER) || pHeader->Magic != FLIGHT_SNAPSHOT_MAGIC ||
+        pHeader->Version != FLIGHT_SNAPSHOT_VERSION || pHeader->EventSize != sizeof(FLIGHT_EVENT) ||
+        !pHeader->EventsPerRing || (pHeader->EventsPerRing & (pHeader->EventsPerRing - 1)) ||
+        pHeader->RingCount > (Size - sizeof(FLIGHT_SNAPSHOT_HEADER)) /
+            (sizeof(FLIGHT_SNAPSHOT_RING) + (ULONG64)pHeader->EventsPerRing * sizeof(FLIGHT_EVENT)))
+    {
+        fprintf(stderr, "%s is not a flight recorder snapshot\n", pszSnapshot);
+        goto Cleanup;
+    }
+
+    pEntries = calloc((size_t)pHeader->RingCount * pHeader->EventsPerRing + 1, sizeof(*pEntries));
+    if (!pEntries)
+        goto Cleanup;
+
+    for (Ring = 0; Ring < pHeader->RingCount; ++Ring)
+    {
+        const FLIGHT_SNAPSHOT_RING *pRing = (const FLIGHT_SNAPSHOT_RING *)(pFile + sizeof(FLIGHT_SNAPSHOT_HEADER) +
+            Ring * (sizeof(FLIGHT_SNAPSHOT_RING) + (size_t)pHeader->EventsPerRing * sizeof(FLIGHT_EVENT)));
+        const FLIGHT_EVENT *pEvents = (const FLIGHT_EVENT *)(pRing + 1);
+
+        Recorded += pRing->Next;
+        for (i = 0; i < pHeader->EventsPerRing; ++i)
+        {
+            ULONG32 Position = pEvents[i].Sequence - 1;
+            // An event is kept only in the slot of its position, within the last EventsPerRing positions
+            if (!pEvents[i].Sequence || (Position & (pHeader->EventsPerRing - 1)) != i ||
+                pRing->Next - Position - 1 >= pHeader->EventsPerRing)
+            {
+                if (i < pRing->Next)
+                    ++Torn;
+                continue;
+            }
+            pEntries[Count].pEvent = &pEvents[i];
+            pEntries[Count++].Processor = pRing->Processor;
+        }
+    }
+
+    Syncs[0].Tsc = pHeader->Sync[0].Tsc;
+    Syncs[0].Time = pHeader->Sync[0].LocalTime;
+    Syncs[1].Tsc = pHeader->Sync[1].Tsc;
+    Syncs[1].Time = pHeader->Sync[1].LocalTime;
+    qsort(pEntries, Count, sizeof(*pEntries), CompareFlightEntry);
+    for (i = 0; i < Count; ++i)
+        FlightPrintEvent(&pEntries[i], Syncs);
+
+    fprintf(stderr, "%u events of %u processors, %u recorded in total, %u being written during the snapshot\n",
+        Count, pHeader->RingCount, Recorded, Torn);
+    Result = 0;
+
+Cleanup:
+    free(pEntries);
+    free(pFile);
+    return Result;
+}
+
+/** Loads a heatmap snapshot, returns NULL if the file is not one */
+static HEAT_SNAPSHOT_HEADER *HeatLoad(const char *pszSnapshot)
+{
+    ULONG32 Size = 0;
+    HEAT_SNAPSHOT_HEADER *pHeader = LoadFile(pszSnapshot, &Size);
+
+    if (!pHeader || Size < sizeof(HEAT_SNAPSHOT_HEADER) || pHeader->Magic != HEAT_SNAPSHOT_MAGIC ||
+        pHeader->Version != HEAT_SNAPSHOT_VERSION || pHeader->BucketCount > HEAT_BUCKETS ||
+        pHeader->TopCount > HEAT_TOP_BLOCKS || pHeader->BucketShift < HEAT_MIN_BUCKET_SHIFT || pHeader->BucketShift > 63 ||
+        Size < HEAT_SNAPSHOT_SIZE(pHeader->BucketCount, pHeader->TopCount))
+    {
+        fprintf(stderr, "%s is not a heatmap snapshot\n", pszSnapshot);
+        free(pHeader);
+        return NULL;
+    }
+    return pHeader;
+}
+
+static const HEAT_BUCKET *HeatBuckets(const HEAT_SNAPSHOT_HEADER *pHeader)
+{
+    return (const HEAT_BUCKET *)(pHeader + 1);
+}
+
+static const HEAT_HOT_BLOCK *HeatTop(const HEAT_SNAPSHOT_HEADER *pHeader)
+{
+    return (const HEAT_HOT_BLOCK *)(HeatBuckets(pHeader) + pHeader->BucketCount);
+}
+
+/** Adds (Sign 1) or subtracts (-1) the buckets of a snapshot to rows of RowBuckets buckets of 1 << Shift bytes */
+static void HeatAddRows(const HEAT_SNAPSHOT_HEADER *pHeader, ULONG32 Shift, ULONG64 RowBuckets, ULONG64 *pReads,
+    ULONG64 *pWrites, ULONG32 Rows, LONG64 Sign)
+{
+    const HEAT_BUCKET *pBuckets = HeatBuckets(pHeader);
+    ULONG32 i = 0;
+
+    for (i = 0; i < pHeader->BucketCount; ++i)
+    {
+        ULONG64 Row = (((ULONG64)i << pHeader->BucketShift) >> Shift) / RowBuckets;
+        if (Row >= Rows)
+            Row = Rows - 1;
+        pReads[Row] += Sign * pBuckets[i].Reads;
+        pWrites[Row] += Sign * pBuckets[i].Writes;
+    }
+}
+
+static void HeatPrintSize(ULONG64 Bytes)
+{
+    if (Bytes >= (1ULL << 30) && !(Bytes & ((1ULL << 30) - 1)))
+        printf("%6llu GiB", (unsigned long long)(Bytes >> 30));
+    else
+        printf("%6llu MiB", (unsigned long long)(Bytes >> 20));
+}
+
+static void HeatPrintHeader(const char *pszName, const HEAT_SNAPSHOT_HEADER *pHeader)
+{
+    printf("%s: disk ", pszName);
+    PrintGuid(&pHeader->DiskId);
+    printf(" (tag %u) taken ", pHeader->DiskTag);
+    PrintLocalTime(stdout, pHeader->LocalTime);
+    printf(", %u buckets of %llu KiB, %llu blocks sketched\n", pHeader->BucketCount,
+        (unsigned long long)((1ULL << pHeader->BucketShift) >> 10), (unsigned long long)pHeader->Blocks);
+}
+
+/** Prints the rows of a heatmap with a bar as long as the share of their accesses of the busiest row */
+static void HeatPrintRows(ULONG32 Shift, ULONG64 RowBuckets, const ULONG64 *pReads, const ULONG64 *pWrites, ULONG32 Rows)
+{
+    ULONG64 Max = 1;
+    ULONG32 Row = 0, i = 0;
+
+    for (Row = 0; Row < Rows; ++Row)
+    {
+        if ((LONG64)(pReads[Row] + pWrites[Row]) > (LONG64)Max)
+            Max = pReads[Row] + pWrites[Row];
+    }
+    for (Row = 0; Row < Rows; ++Row)
+    {
+        LONG64 Total = (LONG64)(pReads[Row] + pWrites[Row]);
+        ULONG32 Width = Total > 0 ? (ULONG32)((Total * 50 + Max - 1) / Max) : 0;
+        HeatPrintSize((Row * RowBuckets) << Shift);
+        printf(" - ");
+        HeatPrintSize(((Row + 1) * RowBuckets) << Shift);
+        printf(" %12lld reads %12lld writes |", (long long)pReads[Row], (long long)pWrites[Row]);
+        for (i = 0; i < Width; ++i)
+            putchar('#');
+        printf("\n");
+    }
+}
+
+/** Splits the accessed part of the disk in at most Rows rows of whole buckets at Shift */
+static ULONG32 HeatLayout(ULONG64 Buckets, ULONG32 Rows, ULONG64 *pRowBuckets)
+{
+    if (!Buckets)
+        Buckets = 1;
+    *pRowBuckets = (Buckets + Rows - 1) / Rows;
+    return (ULONG32)((Buckets + *pRowBuckets - 1) / *pRowBuckets);
+}
+
+static int HeatRender(const char *pszSnapshot, ULONG32 Rows)
+{
+    HEAT_SNAPSHOT_HEADER *pHeader = HeatLoad(pszSnapshot);
+    const HEAT_HOT_BLOCK *pTop = NULL;
+    ULONG64 *pReads = NULL, *pWrites = NULL, RowBuckets = 0;
+    ULONG32 i = 0;
+    int Result = 1;
+
+    if (!pHeader || !Rows)
+        goto Cleanup;
+    Rows = HeatLayout(pHeader->BucketCount, Rows, &RowBuckets);
+    pReads = calloc(Rows, sizeof(ULONG64));
+    pWrites = calloc(Rows, sizeof(ULONG64));
+    if (!pReads || !pWrites)
+        goto Cleanup;
+
+    HeatPrintHeader(pszSnapshot, pHeader);
+    HeatAddRows(pHeader, pHeader->BucketShift, RowBuckets, pReads, pWrites, Rows, 1);
+    HeatPrintRows(pHeader->BucketShift, RowBuckets, pReads, pWrites, Rows);
+
+    pTop = HeatTop(pHeader);
+    printf("hottest 4 KiB blocks, counts are upper bounds\n");
+    for (i = 0; i < pHeader->TopCount; ++i)
+    {
+        printf("  offset 0x%012llX %10llu accesses %6.2f%%\n", (unsigned long long)(pTop[i].Block << HEAT_BLOCK_SHIFT),
+            (unsigned long long)pTop[i].Count, pHeader->Blocks ? pTop[i].Count * 100.0 / pHeader->Blocks : 0);
+    }
+    Result = 0;
+
+Cleanup:
+    free(pWrites);
+    free(pReads);
+    free(pHeader);
+    return Result;
+}
+
+static const HEAT_HOT_BLOCK *HeatFindBlock(const HEAT_SNAPSHOT_HEADER *pHeader, ULONG64 Block)
+{
+    const HEAT_HOT_BLOCK *pTop = HeatTop(pHeader);
+    ULONG32 i = 0;
+
+    for (i = 0; i < pHeader->TopCount; ++i)
+    {
+        if (pTop[i].Block == Block)
+            return &pTop[i];
+    }
+    return NULL;
+}
+
+/**
+ * Prints where the accesses went between two snapshots of a disk. Both are brought to the coarser bucket size,
+ * a later snapshot with fewer accesses was taken after a reset and is compared as it is.
+ */
+static int HeatCompare(const char *pszOld, const char *pszNew, ULONG32 Rows)
+{
+    HEAT_SNAPSHOT_HEADER *pOld = HeatLoad(pszOld), *pNew = HeatLoad(pszNew);
+    const HEAT_HOT_BLOCK *pTop = NULL, *pFound = NULL;
+    ULONG64 *pReads = NULL, *pWrites = NULL, RowBuckets = 0, Buckets = 0;
+    ULONG32 Shift = 0, i = 0;
+    int Result = 1;
+
+    if (!pOld || !pNew || !Rows)
+        goto Cleanup;
+    HeatPrintHeader(pszOld, pOld);
+    HeatPrintHeader(pszNew, pNew);
+    if (memcmp(&pOld->DiskId, &pNew->DiskId, sizeof(GUID)))
+        printf("the snapshots are of different disks\n");
+
+    Shift = pOld->BucketShift > pNew->BucketShift ? pOld->BucketShift : pNew->BucketShift;
+    Buckets = ((ULONG64)pOld->BucketCount << pOld->BucketShift) >> Shift;
+    if ((((ULONG64)pNew->BucketCount << pNew->BucketShift) >> Shift) > Buckets)
+        Buckets = ((ULONG64)pNew->BucketCount << pNew->BucketShift) >> Shift;
+    Rows = HeatLayout(Buckets + 1, Rows, &RowBuckets);
+    pReads = calloc(Rows, sizeof(ULONG64));
+    pWrites = calloc(Rows, sizeof(ULONG64));
+    if (!pReads || !pWrites)
+        goto Cleanup;
+
+    HeatAddRows(pNew, Shift, RowBuckets, pReads, pWrites, Rows, 1);
+    if (pNew->Blocks >= pOld->Blocks)
+        HeatAddRows(pOld, Shift, RowBuckets, pReads, pWrites, Rows, -1);
+    else
+        printf("the heatmap was reset in between, the later snapshot is shown as it is\n");
+    HeatPrintRows(Shift, RowBuckets, pReads, pWrites, Rows);
+
+    pTop = HeatTop(pNew);
+    printf("hottest 4 KiB blocks of %s\n", pszNew);
+    for (i = 0; i < pNew->TopCount; ++i)
+    {
+        pFound = HeatFindBlock(pOld, pTop[i].Block);
+        printf("  offset 0x%012llX %10llu accesses", (unsigned long long)(pTop[i].Block << HEAT_BLOCK_SHIFT),
+            (unsigned long long)pTop[i].Count);
+        if (pFound)
+            printf(", %+lld\n", (long long)(pTop[i].Count - pFound->Count));
+        else
+            printf(", new\n");
+    }
+    pTop = HeatTop(pOld);
+    for (i = 0; i < pOld->TopCount; ++i)
+    {
+        if (!HeatFindBlock(pNew, pTop[i].Block))
+            printf("  offset 0x%012llX cooled down, was %llu accesses\n",
+                (unsigned long long)(pTop[i].Block << HEAT_BLOCK_SHIFT), (unsigned long long)pTop[i].Count);
+    }
+    Result = 0;
+
+Cleanup:
+    free(pWrites);
+    free(pReads);
+    free(pNew);
+    free(pOld);
+    return Result;
+}
+
+#if !defined(_WIN32)
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BenchTsc() __rdtsc()
+#else
+#define BenchTsc() ((ULONG64)(Now() * 1e9))
+#endif
+
+#define BENCH_GUID_FORMAT "%08lX-%04hX-%04hX-%02hhX%02hhX-%02hhX%02hhX%02hhX%02hhX%02hhX%02hhX"
+#define BENCH_GUID_PARAMETERS(guid) (guid).Data1, (guid).Data2, (guid).Data3, \
+    (guid).Data4[0], (guid).Data4[1], (guid).Data4[2], (guid).Data4[3], \
+    (guid).Data4[4], (guid).Data4[5], (guid).Data4[6], (guid).Data4[7]
+
+/* Named fields, the parsed arguments and the limits the driver fills at run time start zeroed */
+#define BENCH_SITE(format, function, line, level, category) \
+    { .Format = format, .Function = function, .Line = line, .Level = level, .Category = category }
+
+/* Stand-ins for call sites of the driver, ids start at 1 like offsets from the section start marker */
+static TRACE_CALLSITE BenchSites[] = {
+    BENCH_SITE("[Ext_Mount] Disk opened %S, " BENCH_GUID_FORMAT "\r\n", "Ext_Mount", 122, 4, 16),
+    BENCH_SITE("[Ext_CryptBlocks] VHD: %s 0x%X bytes\r\n", "Ext_CryptBlocks", 75, 5, 16),
+    BENCH_SITE("[DPT_SendRequest] Request %d queued for worker %u, %I64d outstanding\r\n", "DPT_SendRequest", 840, 6, 8),
+    BENCH_SITE("[Ext_StartIo] Write request: %X blocks starting from %X\n\r\n", "Ext_StartIo", 278, 5, 16),
+    BENCH_SITE("[Ext_CompleteIo] Write request completed: %X blocks starting from %X\n\r\n", "Ext_CompleteIo", 333, 5, 16),
+};
+
+/* The same messages with the specifiers of the C runtime, used by the text backend */
+static const char *BenchTextFormats[] = {
+    "[Ext_Mount] Disk opened %s, %08X-%04hX-%04hX-%02hhX%02hhX-%02hhX%02hhX%02hhX%02hhX%02hhX%02hhX\r\n",
+    "[Ext_CryptBlocks] VHD: %s 0x%X bytes\r\n",
+    "[DPT_SendRequest] Request %d queued for worker %u, %lld outstanding\r\n",
+};
+
+/** Local time in 100 ns units since 1601, as KeQuerySystemTime + ExSystemTimeToLocalTime */
+static ULONG64 BenchLocalTime()
+{
+    struct timespec ts;
+    struct tm Fields;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    localtime_r(&ts.tv_sec, &Fields);
+    return ((ULONG64)ts.tv_sec + Fields.tm_gmtoff) * 10000000ULL + ts.tv_nsec / 100 + 116444736000000000ULL;
+}
+
+/** Log_Print: timestamp conversion, header and message formatted into the slot */
+static void BenchText(LOG_RING *pRing, UCHAR Level, const char *pszFormat, ...)
+{
+    LOG_RING_SLOT *pSlot = LogRing_Reserve(pRing);
+    struct timespec ts;
+    struct tm Fields;
+    va_list args;
+    size_t Length = 0;
+
+    if (!pSlot)
+        return;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    localtime_r(&ts.tv_sec, &Fields);
+    snprintf(pSlot->Data, sizeof(pSlot->Data), "%04d.%02d.%02d %02d:%02d:%02d.%03ld PR:0x%04X TH:0x%04X IL:%d %s ",
+        Fields.tm_year + 1900, Fields.tm_mon + 1, Fields.tm_mday, Fields.tm_hour, Fields.tm_min, Fields.tm_sec,
+        ts.tv_nsec / 1000000, 4, 0x1234, 0, LevelNames[Level]);
+    Length = strlen(pSlot->Data);
+    va_start(args, pszFormat);
+    vsnprintf(pSlot->Data + Length, sizeof(pSlot->Data) - Length, pszFormat, args);
+    va_end(args);
+    pSlot->Length = (USHORT)strlen(pSlot->Data);
+    pSlot->Type = LOG_SLOT_TEXT;
+    LogRing_Commit(pSlot);
+}
+
+/** Trace_Write: call site id, TSC stamp and raw arguments */
+static void BenchTrace(LOG_RING *pRing, TRACE_CALLSITE *pSite, ...)
+{
+    LOG_RING_SLOT *pSlot = NULL;
+    TRACE_RECORD *pRecord = NULL;
+    ULONG32 Encoded = 0, Length = 0;
+    va_list args;
+
+    if (!pSite->Parsed)
+    {
+        pSite->ArgCount = (UCHAR)Trace_ParseFormat(pSite->Format, pSite->ArgTypes, TRACE_MAX_ARGS);
+        pSite->Parsed = TRUE;
+    }
+    pSlot = LogRing_Reserve(pRing);
+    if (!pSlot)
+        return;
+    pRecord = (TRACE_RECORD *)pSlot->Data;
+    pRecord->Type = TRACE_RECORD_EVENT;
+    pRecord->Irql = 0;
+    pRecord->CallsiteId = (ULONG32)(pSite - BenchSites) + 1;
+    pRecord->Tsc = BenchTsc();
+    pRecord->ProcessId = 4;
+    pRecord->ThreadId = 0x1234;
+    pRecord->Processor = 0;
+    pRecord->Reserved = 0;
+    va_start(args, pSite);
+    Length = Trace_EncodeArgs((UCHAR *)(pRecord + 1), sizeof(pSlot->Data) - sizeof(TRACE_RECORD),
+        pSite->ArgTypes, pSite->ArgCount, &Encoded, args);
+    va_end(args);
+    pRecord->ArgCount = (UCHAR)Encoded;
+    pRecord->Size = (USHORT)(sizeof(TRACE_RECORD) + Length);
+    pSlot->Length = pRecord->Size;
+    pSlot->Type = LOG_SLOT_TRACE;
+    LogRing_Commit(pSlot);
+}
+
+static void BenchSync(FILE *pFile)
+{
+    UCHAR Sync[TRACE_SYNC_SIZE];
+    TRACE_RECORD *pRecord = (TRACE_RECORD *)Sync;
+    ULONG64 Time = BenchLocalTime();
+
+    memset(Sync, 0, sizeof(Sync));
+    pRecord->Size = TRACE_SYNC_SIZE;
+    pRecord->Type = TRACE_RECORD_SYNC;
+    pRecord->Tsc = BenchTsc();
+    memcpy(pRecord + 1, &Time, sizeof(Time));
+    fwrite(Sync, 1, sizeof(Sync), pFile);
+}
+
+/** Drains the ring like the flusher, into a trace file or a text log */
+static void BenchDrain(LOG_RING *pRing, FILE *pFile, int Binary)
+{
+    LOG_RING_SLOT *pSlot = NULL;
+    while (NULL != (pSlot = LogRing_Peek(pRing)))
+    {
+        fwrite(pSlot->Data, 1, pSlot->Length, pFile);
+        LogRing_Release(pRing, pSlot);
+    }
+    if (Binary)
+        BenchSync(pFile);
+}
+
+static double BenchRun(LOG_RING *pRing, FILE *pFile, int Binary, LONG Events)
+{
+    static const USHORT Path[] = { 'C', ':', '\\', 'v', 'm', '\\', 'd', 'i', 's', 'k', '.', 'v', 'h', 'd', 'x', 0 };
+    GUID DiskId = { 0x6F1C2B3A, 0x1D2E, 0x4F50, { 0x81, 0x92, 0xA3, 0xB4, 0xC5, 0xD6, 0xE7, 0xF8 } };
+    double Start = Now(), Formatting = 0;
+    LONG i = 0;
+
+    for (i = 0; i < Events; ++i)
+    {
+        switch (i % 3)
+        {
+        case 0:
+            if (Binary)
+                BenchTrace(pRing, &BenchSites[0], Path, BENCH_GUID_PARAMETERS(DiskId));
+            else
+                BenchText(pRing, BenchSites[0].Level, BenchTextFormats[0], "C:\\vm\\disk.vhdx", BENCH_GUID_PARAMETERS(DiskId));
+            break;
+        case 1:
+            if (Binary)
+                BenchTrace(pRing, &BenchSites[1], "Decrypting", 0x10000 + i);
+            else
+                BenchText(pRing, BenchSites[1].Level, BenchTextFormats[1], "Decrypting", 0x10000 + i);
+            break;
+        default:
+            if (Binary)
+                BenchTrace(pRing, &BenchSites[2], i, i % 7, (long long)i * 3);
+            else
+                BenchText(pRing, BenchSites[2].Level, BenchTextFormats[2], i, i % 7, (long long)i * 3);
+            break;
+        }
+        // Only the producers are timed, the ring is drained every quarter of it like the flusher would
+        if (LogRing_Used(pRing) >= LOG_RING_SLOTS / 4)
+        {
+            Formatting += Now() - Start;
+            BenchDrain(pRing, pFile, Binary);
+            Start = Now();
+        }
+    }
+    Formatting += Now() - Start;
+    BenchDrain(pRing, pFile, Binary);
+    return Formatting * 1e9 / Events;
+}
+
+/** Per-event cost of the text and binary backends. Writes <file>.log and <file>.etr, the latter for trace-decode */
+static int TraceBench(const char *pszFile, LONG Events)
+{
+    char Path[1024];
+    FILE *pText = NULL, *pTrace = NULL;
+    LOG_RING *pRing = aligned_alloc(64, sizeof(LOG_RING));
+    UCHAR Table[4096];
+    TRACE_FILE_HEADER *pHeader = (TRACE_FILE_HEADER *)Table;
+    ULONG32 Used = sizeof(TRACE_FILE_HEADER), i = 0;
+    double Text = 0, Binary = 0;
+
+    snprintf(Path, sizeof(Path), "%s.log", pszFile);
+    pText = fopen(Path, "wb");
+    snprintf(Path, sizeof(Path), "%s.etr", pszFile);
+    pTrace = fopen(Path, "wb");
+    if (!pRing || !pText || !pTrace || Events <= 0)
+    {
+        fprintf(stderr, "Can not set up the benchmark on %s\n", pszFile);
+        return 1;
+    }
+
+    memset(pHeader, 0, sizeof(TRACE_FILE_HEADER));
+    pHeader->Magic = TRACE_FILE_MAGIC;
+    pHeader->Version = TRACE_FILE_VERSION;
+    for (i = 0; i < sizeof(BenchSites) / sizeof(BenchSites[0]); ++i, ++pHeader->CallsiteCount)
+        Used += Trace_WriteCallsiteEntry(Table + Used, sizeof(Table) - Used, i + 1, &BenchSites[i]);
+    pHeader->TableSize = Used - sizeof(TRACE_FILE_HEADER);
+    fwrite(Table, 1, Used, pTrace);
+    BenchSync(pTrace);
+
+    LogRing_Initialize(pRing);
+    Text = BenchRun(pRing, pText, 0, Events);
+    Binary = BenchRun(pRing, pTrace, 1, Events);
+    printf("%d events: text %.0f ns per event, binary %.0f ns per event (%.1fx), %ld vs %ld bytes written\n",
+        (int)Events, Text, Binary, Text / Binary, ftell(pText), ftell(pTrace));
+
+    fclose(pText);
+    fclose(pTrace);
+    free(pRing);
+    return 0;
+}
+
+static ULONG64 BenchInterruptTime()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ULONG64)ts.tv_sec * 10000000ULL + ts.tv_nsec / 100;
+}
+
+/** Trace_Admit */
+static BOOLEAN BenchAdmit(TRACE_CALLSITE *pSite)
+{
+    if (pSite->Mode == TracepointSample)
+        return Trace_AdmitSample(pSite);
+    return Trace_AdmitRate(pSite, BenchInterruptTime());
+}
+
+/* The guard LOGPRINT_LVL_CTG puts around every call site */
+#define BENCH_LOG(pRing, Binary, Site, ...) \
+    if ((Site).Enabled && ((Site).Enabled == TRACE_SITE_ON || BenchAdmit(&(Site)))) \
+    { \
+        if (Binary) \
+            BenchTrace(pRing, &(Site), __VA_ARGS__); \
+        else \
+            BenchText(pRing, (Site).Level, (Site).Format, __VA_ARGS__); \
+    }
+
+/** Stand-in for the request path of the extension: a 4 KB copy between two log call sites */
+static double BenchIoRun(LOG_RING *pRing, FILE *pFile, int Traced, int Binary, LONG Ios)
+{
+    static UCHAR Source[4096], Target[4096];
+    double Start = Now(), Elapsed = 0;
+    LONG i = 0;
+
+    for (i = 0; i < Ios; ++i)
+    {
+        ULONG32 Sectors = 8, Offset = (ULONG32)i * 8;
+        if (Traced)
+            BENCH_LOG(pRing, Binary, BenchSites[3], Sectors, Offset);
+        Source[i & 4095] = (UCHAR)i;
+        memcpy(Target, Source, sizeof(Target));
+        if (Traced)
+            BENCH_LOG(pRing, Binary, BenchSites[4], Sectors, Offset);
+
+        // The flusher's work is not part of the request path
+        if (LogRing_Used(pRing) >= LOG_RING_SLOTS / 4)
+        {
+            Elapsed += Now() - Start;
+            BenchDrain(pRing, pFile, Binary);
+            Start = Now();
+        }
+    }
+    Elapsed += Now() - Start;
+    BenchDrain(pRing, pFile, Binary);
+    return Target[i & 4095] + Elapsed * 1e9 / Ios;
+}
+
+static void BenchSetSites(UCHAR Enabled, ULONG32 Mode, ULONG32 Rate, ULONG32 Burst)
+{
+    int i = 0;
+    for (i = 3; i <= 4; ++i)
+    {
+        BenchSites[i].Enabled = Enabled;
+        BenchSites[i].Mode = Mode;
+        BenchSites[i].Rate = Rate;
+        BenchSites[i].Burst = Burst;
+        BenchSites[i].Evaluated = 0;
+        BenchSites[i].Suppressed = 0;
+        BenchSites[i].ArrivalTime = 0;
+    }
+}
+
+/** Request path cost with its call sites compiled out, disabled, sampled, rate limited and fully enabled */
+static int TracepointBench(const char *pszFile, LONG Ios)
+{
+    LOG_RING *pRing = aligned_alloc(64, sizeof(LOG_RING));
+    FILE *pFile = fopen(pszFile, "wb");
+    double Baseline = 0, Cost = 0;
+    int Run = 0;
+    static const struct {
+        const char *Name;
+        UCHAR Enabled;
+        ULONG32 Mode, Rate, Burst;
+        int Binary;
+    } Runs[] = {
+        { "off", TRACE_SITE_OFF, TracepointOff, 0, 0, 1 },
+        { "sampled 1/1000", TRACE_SITE_LIMITED, TracepointSample, 1000, 0, 1 },
+        { "limited 1000/s", TRACE_SITE_LIMITED, TracepointRateLimit, 1000, 16, 1 },
+        { "on, binary", TRACE_SITE_ON, TracepointOn, 0, 0, 1 },
+        { "on, text", TRACE_SITE_ON, TracepointOn, 0, 0, 0 },
+    };
+
+    if (!pRing || !pFile || Ios <= 0)
+    {
+        fprintf(stderr, "Can not set up the benchmark on %s\n", pszFile);
+        return 1;
+    }
+    LogRing_Initialize(pRing);
+
+    // Formats are parsed on the first use, keep it out of the measurements
+    BenchSetSites(TRACE_SITE_ON, TracepointOn, 0, 0);
+    BenchIoRun(pRing, pFile, 1, 1, 1);
+
+    Baseline = BenchIoRun(pRing, pFile, 0, 1, Ios);
+    printf("%-16s %7.1f ns per request\n", "no call sites", Baseline);
+    for (Run = 0; Run < (int)(sizeof(Runs) / sizeof(Runs[0])); ++Run)
+    {
+        BenchSetSites(Runs[Run].Enabled, Runs[Run].Mode, Runs[Run].Rate, Runs[Run].Burst);
+        Cost = BenchIoRun(pRing, pFile, 1, Runs[Run].Binary, Ios);
+        printf("%-16s %7.1f ns per request, %+6.1f ns for 2 call sites, %lld of %lld events suppressed\n",
+            Runs[Run].Name, Cost, Cost - Baseline, Runs[Run].Mode == TracepointSample ?
+            (long long)(BenchSites[3].Evaluated + BenchSites[4].Evaluated) * (Runs[Run].Rate - 1) / Runs[Run].Rate :
+            (long long)(BenchSites[3].Suppressed + BenchSites[4].Suppressed),
+            (long long)(BenchSites[3].Evaluated + BenchSites[4].Evaluated));
+    }
+
+    fclose(pFile);
+    free(pRing);
+    return 0;
+}
+
+/*
+ * Record cost of the flight recorder: every thread records into its own ring like the driver does per
+ * processor, into a single shared ring (several threads on one processor), or into a ring behind a lock
+ * as a conventional recorder would.
+ */
+typedef struct _FLIGHT_BENCH {
+    FLIGHT_RING *pRings;
+    int Shared;
+    int Locked;
+    LONG Events;
+    pthread_mutex_t Lock;
+} FLIGHT_BENCH;
+
+typedef struct _FLIGHT_BENCH_THREAD {
+    FLIGHT_BENCH *pBench;
+    int Thread;
+    pthread_t Handle;
+} FLIGHT_BENCH_THREAD;
+
+static void *FlightBenchThread(void *Context)
+{
+    FLIGHT_BENCH_THREAD *pThread = Context;
+    FLIGHT_BENCH *pBench = pThread->pBench;
+    FLIGHT_RING *pRing = &pBench->pRings[pBench->Shared ? 0 : pThread->Thread];
+    LONG i = 0;
+
+    for (i = 0; i < pBench->Events; ++i)
+    {
+        UCHAR Type = (i & 1) ? FlightEventSrbComplete : FlightEventSrbStart;
+        if (pBench->Locked)
+            pthread_mutex_lock(&pBench->Lock);
+        FlightRing_Record(pRing, BenchTsc(), Type, 0x2A, (USHORT)(pThread->Thread + 1), (ULONG64)(i / 2) * 8, 4096, 0);
+        if (pBench->Locked)
+            pthread_mutex_unlock(&pBench->Lock);
+    }
+    return NULL;
+}
+
+static double FlightBenchRun(FLIGHT_BENCH *pBench, int Threads)
+{
+    FLIGHT_BENCH_THREAD *pThreads = calloc(Threads, sizeof(*pThreads));
+    double Start = 0;
+    int i = 0;
+
+    memset(pBench->pRings, 0, Threads * sizeof(FLIGHT_RING));
+    Start = Now();
+    for (i = 0; i < Threads; ++i)
+    {
+        pThreads[i].pBench = pBench;
+        pThreads[i].Thread = i;
+        pthread_create(&pThreads[i].Handle, NULL, FlightBenchThread, &pThreads[i]);
+    }
+    for (i = 0; i < Threads; ++i)
+        pthread_join(pThreads[i].Handle, NULL);
+    free(pThreads);
+    return (Now() - Start) * 1e9 / ((double)pBench->Events * Threads);
+}
+
+/** Writes the per-thread rings of the last run as a snapshot, the input of flight-decode */
+static int FlightBenchSave(const char *pszFile, FLIGHT_RING *pRings, int Threads, const FLIGHT_SYNC *pStart)
+{
+    ULONG32 Size = (ULONG32)FLIGHT_SNAPSHOT_SIZE(Threads);
+    UCHAR *pSnapshot = calloc(1, Size), *pOut = NULL;
+    FLIGHT_SNAPSHOT_HEADER *pHeader = (FLIGHT_SNAPSHOT_HEADER *)pSnapshot;
+    int i = 0, Result = 1;
+
+    if (!pSnapshot)
+        return 1;
+    pHeader->Magic = FLIGHT_SNAPSHOT_MAGIC;
+    pHeader->Version = FLIGHT_SNAPSHOT_VERSION;
+    pHeader->TotalSize = Size;
+    pHeader->RingCount = Threads;
+    pHeader->EventsPerRing = FLIGHT_RING_EVENTS;
+    pHeader->EventSize = sizeof(FLIGHT_EVENT);
+    pHeader->Sync[0] = *pStart;
+    pHeader->Sync[1].Tsc = BenchTsc();
+    pHeader->Sync[1].LocalTime = BenchLocalTime();
+
+    for (i = 0, pOut = (UCHAR *)(pHeader + 1); i < Threads; ++i)
+    {
+        FLIGHT_SNAPSHOT_RING *pRing = (FLIGHT_SNAPSHOT_RING *)pOut;
+        pRing->Processor = i;
+        pRing->Next = FlightRing_Copy(&pRings[i], (FLIGHT_EVENT *)(pRing + 1));
+        pOut += sizeof(FLIGHT_SNAPSHOT_RING) + FLIGHT_RING_EVENTS * sizeof(FLIGHT_EVENT);
+    }
+
+    Result = WriteFileAtomic(pszFile, pSnapshot, Size);
+    free(pSnapshot);
+    return Result;
+}
+
+static int FlightBench(const char *pszFile, LONG Events, int Threads)
+{
+    FLIGHT_BENCH Bench = { 0 };
+    FLIGHT_SYNC Start = { BenchTsc(), BenchLocalTime() };
+    static const struct {
+        const char *Name;
+        int Shared, Locked;
+    } Runs[] = {
+        { "locked ring", 1, 1 },
+        { "shared ring", 1, 0 },
+        { "per-thread rings", 0, 0 },
+    };
+    int Run = 0;
+
+    Bench.pRings = aligned_alloc(64, Threads * sizeof(FLIGHT_RING));
+    Bench.Events = Events;
+    if (!Bench.pRings || Events <= 0 || Threads <= 0)
+    {
+        fprintf(stderr, "Can not set up the benchmark\n");
+        return 1;
+    }
+    pthread_mutex_init(&Bench.Lock, NULL);
+
+    // Touch the rings once so page faults are not measured
+    FlightBenchRun(&Bench, Threads);
+    printf("%d threads, %d events each, %d online processors\n", Threads, (int)Events, (int)sysconf(_SC_NPROCESSORS_ONLN));
+    for (Run = 0; Run < (int)(sizeof(Runs) / sizeof(Runs[0])); ++Run)
+    {
+        Bench.Shared = Runs[Run].Shared;
+        Bench.Locked = Runs[Run].Locked;
+        printf("%-17s %6.1f ns per event\n", Runs[Run].Name, FlightBenchRun(&Bench, Threads));
+    }
+
+    if (FlightBenchSave(pszFile, Bench.pRings, Threads, &Start))
+        fprintf(stderr, "Could not write %s\n", pszFile);
+    pthread_mutex_destroy(&Bench.Lock);
+    free(Bench.pRings);
+    return 0;
+}
+
+/*
+ * Cost of counting a request: the per-processor blocks of the driver, the same with the latency measured
+ * through the in-flight table, and one block shared by all threads updated with interlocked operations.
+ */
+#define STATS_BENCH_COUNTERS    0
+#define STATS_BENCH_LATENCY     1
+#define STATS_BENCH_SHARED      2
+
+typedef struct _STATS_BENCH {
+    DISK_COUNTERS *pCounters;
+    DISK_INFLIGHT_TABLE *pInflight;
+    int Mode;
+    LONG Ios;
+} STATS_BENCH;
+
+typedef struct _STATS_BENCH_THREAD {
+    STATS_BENCH *pBench;
+    int Thread;
+    pthread_t Handle;
+} STATS_BENCH_THREAD;
+
+static void *StatsBenchThread(void *Context)
+{
+    STATS_BENCH_THREAD *pThread = Context;
+    STATS_BENCH *pBench = pThread->pBench;
+    DISK_COUNTERS *pCounters = &pBench->pCounters[pBench->Mode == STATS_BENCH_SHARED ? 0 : pThread->Thread];
+    // Distinct request blocks per thread, like the SRBs of the requests in flight
+    static UCHAR Srbs[64][256];
+    ULONG64 Srb = (ULONG64)(size_t)&Srbs[pThread->Thread & 63][0];
+    LONG i = 0;
+
+    for (i = 0; i < pBench->Ios; ++i)
+    {
+        UCHAR Opcode = (i & 3) ? 0x28 : 0x2A;
+        ULONG32 Class = DiskCounters_Class(Opcode);
+        ULONG64 StartTsc = 0, Ticks = 1000 + (i & 1023);
+
+        switch (pBench->Mode)
+        {
+        case STATS_BENCH_COUNTERS:
+            DiskCounters_Start(pCounters, Class);
+            DiskCounters_Complete(pCounters, Class, 4096, Ticks, FALSE);
+            break;
+        case STATS_BENCH_LATENCY:
+            DiskCounters_Start(pCounters, Class);
+            DiskInflight_Insert(pBench->pInflight, Srb + (i & 3), BenchTsc(), Opcode, (ULONG64)i * 8, 4096);
+            Ticks = DiskInflight_Remove(pBench->pInflight, Srb + (i & 3), &StartTsc) ? BenchTsc() - StartTsc + 1 : 0;
+            DiskCounters_Complete(pCounters, Class, 4096, Ticks, FALSE);
+            break;
+        case STATS_BENCH_SHARED:
+            __atomic_add_fetch(&pCounters->Requests[Class], 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&pCounters->Completed[Class], 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&pCounters->Bytes[Class], 4096, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&pCounters->LatencyTicks[Class], Ticks, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&pCounters->Latency[Class][DiskCounters_Bucket(Ticks)], 1, __ATOMIC_RELAXED);
+            break;
+        }
+        __asm__ __volatile__("" ::: "memory");
+    }
+    return NULL;
+}
+
+static double StatsBenchRun(STATS_BENCH *pBench, int Threads, int Mode)
+{
+    STATS_BENCH_THREAD *pThreads = calloc(Threads, sizeof(*pThreads));
+    double Start = 0;
+    int i = 0;
+
+    pBench->Mode = Mode;
+    memset(pBench->pCounters, 0, Threads * sizeof(DISK_COUNTERS));
+    Start = Now();
+    for (i = 0; i < Threads; ++i)
+    {
+        pThreads[i].pBench = pBench;
+        pThreads[i].Thread = i;
+        pthread_create(&pThreads[i].Handle, NULL, StatsBenchThread, &pThreads[i]);
+    }
+    for (i = 0; i < Threads; ++i)
+        pthread_join(pThreads[i].Handle, NULL);
+    free(pThreads);
+    return (Now() - Start) * 1e9 / ((double)pBench->Ios * Threads);
+}
+
+static int StatsBench(LONG Ios, int Threads)
+{
+    STATS_BENCH Bench = { 0 };
+    DISK_COUNTERS Total = { 0 };
+    ULONG64 Seen = 0, Count = 0;
+    ULONG32 Bucket = 0;
+    int i = 0;
+
+    Bench.pCounters = aligned_alloc(64, Threads * sizeof(DISK_COUNTERS));
+    Bench.pInflight = calloc(1, sizeof(DISK_INFLIGHT_TABLE));
+    Bench.Ios = Ios;
+    if (!Bench.pCounters || !Bench.pInflight || Ios <= 0 || Threads <= 0)
+    {
+        fprintf(stderr, "Can not set up the benchmark\n");
+        return 1;
+    }
+
+    printf("%d threads, %d requests each, %d online processors\n", Threads, (int)Ios, (int)sysconf(_SC_NPROCESSORS_ONLN));
+    StatsBenchRun(&Bench, Threads, STATS_BENCH_COUNTERS);
+    printf("%-30s %5.1f ns per request\n", "per-processor counters", StatsBenchRun(&Bench, Threads, STATS_BENCH_COUNTERS));
+    printf("%-30s %5.1f ns per request\n", "shared interlocked counters", StatsBenchRun(&Bench, Threads, STATS_BENCH_SHARED));
+    printf("%-30s %5.1f ns per request\n", "per-processor with latency", StatsBenchRun(&Bench, Threads, STATS_BENCH_LATENCY));
+
+    // The last run measured the latency of the in-flight table itself
+    for (i = 0; i < Threads; ++i)
+        DiskCounters_Add(&Total, &Bench.pCounters[i]);
+    for (Bucket = 0; Bucket < DISK_LATENCY_BUCKETS; ++Bucket)
+        Count += Total.Latency[DISK_CLASS_READ][Bucket];
+    for (Bucket = 0; Bucket < DISK_LATENCY_BUCKETS - 1 && (Seen += Total.Latency[DISK_CLASS_READ][Bucket]) < Count / 2; ++Bucket)
+        ;
+    printf("%llu reads, %llu untracked, median below %llu ticks\n", (unsigned long long)Total.Completed[DISK_CLASS_READ],
+        (unsigned long long)Total.Untracked, (unsigned long long)DiskCounters_BucketStart(Bucket + 1));
+
+    free(Bench.pInflight);
+    free(Bench.pCounters);
+    return 0;
+}
+
+/** A tick count falls in a bucket that starts at or below it, ends above it and is at most 25% wide */
+static int StageCheckBucket(ULONG64 Ticks, ULONG32 *pLast)
+{
+    ULONG32 Bucket = SrbTiming_Bucket(Ticks);
+    ULONG64 Start = SrbTiming_BucketStart(Bucket);
+
+    if (Bucket < *pLast || Start > Ticks ||
+        (Bucket < SRB_STAGE_BUCKETS - 1 && SrbTiming_BucketStart(Bucket + 1) <= Ticks) ||
+        (Bucket >= 4 && Bucket < SRB_STAGE_BUCKETS - 1 && SrbTiming_BucketStart(Bucket + 1) - Start > Start / 4))
+    {
+        printf("bucket check failed at %llu ticks: bucket %u starts at %llu\n", (unsigned long long)Ticks, Bucket,
+            (unsigned long long)Start);
+        return 1;
+    }
+    *pLast = Bucket;
+    return 0;
+}
+
+/** Every tick count below 2^20, then the values around each sub-bucket boundary from there on */
+static int StageCheckBuckets()
+{
+    ULONG64 Ticks = 0;
+    ULONG32 Last = 0, Power = 0, Sub = 0;
+
+    for (Ticks = 0; Ticks < (1 << 20) - 1; ++Ticks)
+        if (StageCheckBucket(Ticks, &Last))
+            return 1;
+    for (Power = 20; Power < 64; ++Power)
+    {
+        for (Sub = 0; Sub < 4; ++Sub)
+        {
+            Ticks = (1ULL << Power) + ((ULONG64)Sub << (Power - 2));
+            if (StageCheckBucket(Ticks - 1, &Last) || StageCheckBucket(Ticks, &Last) || StageCheckBucket(Ticks + 1, &Last))
+                return 1;
+        }
+    }
+    if (SrbTiming_Bucket(~0ULL) != SRB_STAGE_BUCKETS - 1)
+    {
+        printf("bucket check failed for the largest tick count\n");
+        return 1;
+    }
+    return 0;
+}
+
+static int StageCheckCounts(const SRB_STAGE_COUNTERS *pCounters, const ULONG64 *pExpected, ULONG64 Skewed, const char *pszCase)
+{
+    ULONG64 Sum = 0;
+    ULONG32 Stage = 0;
+
+    for (Stage = 0; Stage < SRB_STAGE_MAX; ++Stage)
+    {
+        ULONG64 Count = pExpected[Stage] != 0;
+        if (pCounters->Count[Stage] != Count || pCounters->Ticks[Stage] != pExpected[Stage] ||
+            (Count && pCounters->Histogram[Stage][SrbTiming_Bucket(pExpected[Stage])] != 1))
+        {
+            printf("aggregation check '%s' failed for stage %u: %llu requests, %llu ticks\n", pszCase, Stage,
+                (unsigned long long)pCounters->Count[Stage], (unsigned long long)pCounters->Ticks[Stage]);
+            return 1;
+        }
+        if (Stage != SRB_STAGE_TOTAL)
+            Sum += pCounters->Ticks[Stage];
+    }
+    if (Sum != pCounters->Ticks[SRB_STAGE_TOTAL] || pCounters->Skewed != Skewed)
+    {
+        printf("aggregation check '%s' failed: stages sum to %llu of %llu ticks, %llu skewed\n", pszCase,
+            (unsigned long long)Sum, (unsigned long long)pCounters->Ticks[SRB_STAGE_TOTAL], (unsigned long long)pCounters->Skewed);
+        return 1;
+    }
+    return 0;
+}
+
+/** Requests through the write, read and failure paths, and requests that must not be counted */
+static int StageCheckAggregate()
+{
+    static const ULONG64 Write[SRB_STAMP_MAX] = { 1000, 1100, 1500, 9500, 9600, 60000, 0, 0, 60200 };
+    static const ULONG64 WriteStages[SRB_STAGE_MAX] = { 59200, 100, 400, 8000, 100, 50400, 0, 0, 200 };
+    static const ULONG64 Read[SRB_STAMP_MAX] = { 5000, 5040, 0, 0, 5100, 90000, 90300, 97000, 97050 };
+    static const ULONG64 ReadStages[SRB_STAGE_MAX] = { 92050, 40, 0, 0, 60, 84900, 300, 6700, 50 };
+    // Failed before it reached vhdmp
+    static const ULONG64 Failed[SRB_STAMP_MAX] = { 100, 300, 0, 0, 0, 0, 0, 0, 700 };
+    static const ULONG64 FailedStages[SRB_STAGE_MAX] = { 600, 200, 0, 0, 0, 0, 0, 0, 400 };
+    static const ULONG64 Skewed[SRB_STAMP_MAX] = { 5000, 5040, 0, 0, 5100, 4000, 0, 0, 6000 };
+    static const ULONG64 Unfinished[SRB_STAMP_MAX] = { 5000, 5040, 0, 0, 5100, 0, 0, 0, 0 };
+    static const ULONG64 None[SRB_STAGE_MAX] = { 0 };
+    SRB_STAGE_COUNTERS Counters, Total;
+    SRB_TIMING Timing;
+
+    memset(&Counters, 0, sizeof(Counters));
+    memcpy(Timing.Tsc, Write, sizeof(Write));
+    SrbTiming_Aggregate(&Counters, &Timing);
+    if (StageCheckCounts(&Counters, WriteStages, 0, "write"))
+        return 1;
+
+    memset(&Counters, 0, sizeof(Counters));
+    memcpy(Timing.Tsc, Read, sizeof(Read));
+    SrbTiming_Aggregate(&Counters, &Timing);
+    if (StageCheckCounts(&Counters, ReadStages, 0, "read"))
+        return 1;
+
+    memset(&Counters, 0, sizeof(Counters));
+    memcpy(Timing.Tsc, Failed, sizeof(Failed));
+    SrbTiming_Aggregate(&Counters, &Timing);
+    if (StageCheckCounts(&Counters, FailedStages, 0, "failed"))
+        return 1;
+
+    memset(&Counters, 0, sizeof(Counters));
+    memcpy(Timing.Tsc, Skewed, sizeof(Skewed));
+    SrbTiming_Aggregate(&Counters, &Timing);
+    memcpy(Timing.Tsc, Unfinished, sizeof(Unfinished));
+    SrbTiming_Aggregate(&Counters, &Timing);
+    SrbTiming_Start(&Timing, 0);
+    SrbTiming_Aggregate(&Counters, &Timing);
+    if (StageCheckCounts(&Counters, None, 1, "not counted"))
+        return 1;
+
+    // Sums of per-processor blocks
+    memset(&Counters, 0, sizeof(Counters));
+    memset(&Total, 0, sizeof(Total));
+    memcpy(Timing.Tsc, Read, sizeof(Read));
+    SrbTiming_Aggregate(&Counters, &Timing);
+    SrbTiming_Add(&Total, &Counters);
+    SrbTiming_Add(&Total, &Counters);
+    if (Total.Count[SRB_STAGE_TOTAL] != 2 || Total.Ticks[SRB_STAMP_VHDMP_COMPLETE] != 2 * ReadStages[SRB_STAMP_VHDMP_COMPLETE] ||
+        Total.Histogram[SRB_STAGE_TOTAL][SrbTiming_Bucket(ReadStages[SRB_STAGE_TOTAL])] != 2)
+    {
+        printf("aggregation check 'sum' failed\n");
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Cost of stage timing a request: the stamps the parser and the extension take along the write path,
+ * then the same with the stages counted in a per-processor block.
+ */
+typedef struct _STAGE_BENCH_THREAD {
+    SRB_STAGE_COUNTERS *pCounters;
+    LONG Ios;
+    int Aggregate;
+    pthread_t Handle;
+} STAGE_BENCH_THREAD;
+
+static void *StageBenchThread(void *Context)
+{
+    STAGE_BENCH_THREAD *pThread = Context;
+    SRB_TIMING Timing;
+    LONG i = 0;
+    ULONG32 Stamp = 0;
+
+    for (i = 0; i < pThread->Ios; ++i)
+    {
+        SrbTiming_Start(&Timing, BenchTsc());
+        for (Stamp = SRB_STAMP_EXT_START; Stamp < SRB_STAMP_DECRYPT_START; ++Stamp)
+            Timing.Tsc[Stamp] = BenchTsc();
+        Timing.Tsc[SRB_STAMP_VSTOR_COMPLETE] = BenchTsc();
+        if (pThread->Aggregate)
+            SrbTiming_Aggregate(pThread->pCounters, &Timing);
+        __asm__ __volatile__("" ::: "memory");
+    }
+    return NULL;
+}
+
+static double StageBenchRun(SRB_STAGE_COUNTERS *pCounters, int Threads, LONG Ios, int Aggregate)
+{
+    STAGE_BENCH_THREAD *pThreads = calloc(Threads, sizeof(*pThreads));
+    double Start = 0;
+    int i = 0;
+
+    memset(pCounters, 0, Threads * sizeof(SRB_STAGE_COUNTERS));
+    Start = Now();
+    for (i = 0; i < Threads; ++i)
+    {
+        pThreads[i].pCounters = &pCounters[i];
+        pThreads[i].Ios = Ios;
+        pThreads[i].Aggregate = Aggregate;
+        pthread_create(&pThreads[i].Handle, NULL, StageBenchThread, &pThreads[i]);
+    }
+    for (i = 0; i < Threads; ++i)
+        pthread_join(pThreads[i].Handle, NULL);
+    free(pThreads);
+    return (Now() - Start) * 1e9 / ((double)Ios * Threads);
+}
+
+static int StageBench(LONG Ios, int Threads)
+{
+    SRB_STAGE_COUNTERS *pCounters = NULL, Total;
+    ULONG64 Seen = 0;
+    ULONG32 Bucket = 0;
+    int i = 0;
+
+    if (StageCheckBuckets() || StageCheckAggregate())
+        return 1;
+    printf("histogram and aggregation checks passed\n");
+
+    pCounters = aligned_alloc(64, Threads * sizeof(SRB_STAGE_COUNTERS));
+    if (!pCounters || Ios <= 0 || Threads <= 0)
+    {
+        fprintf(stderr, "Can not set up the benchmark\n");
+        return 1;
+    }
+
+    printf("%d threads, %d requests each, %d online processors\n", Threads, (int)Ios, (int)sysconf(_SC_NPROCESSORS_ONLN));
+    StageBenchRun(pCounters, Threads, Ios, 1);
+    printf("%-30s %5.1f ns per request\n", "stamps only", StageBenchRun(pCounters, Threads, Ios, 0));
+    printf("%-30s %5.1f ns per request\n", "stamps and aggregation", StageBenchRun(pCounters, Threads, Ios, 1));
+
+    // The last run measured the stamps themselves
+    memset(&Total, 0, sizeof(Total));
+    for (i = 0; i < Threads; ++i)
+        SrbTiming_Add(&Total, &pCounters[i]);
+    for (Bucket = 0; Bucket < SRB_STAGE_BUCKETS - 1 &&
+        (Seen += Total.Histogram[SRB_STAGE_TOTAL][Bucket]) < Total.Count[SRB_STAGE_TOTAL] / 2; ++Bucket)
+        ;
+    printf("%llu requests, %llu skewed, median request below %llu ticks\n", (unsigned long long)Total.Count[SRB_STAGE_TOTAL],
+        (unsigned long long)Total.Skewed, (unsigned long long)SrbTiming_BucketStart(Bucket + 1));
+
+    free(pCounters);
+    return 0;
+}
+
+/*
+ * Cost of tracking requests in the in-flight table of a disk shared by all threads, with and without the stuck IO
+ * scanner reading the table at the same time, against the same table behind one lock.
+ */
+#define INFLIGHT_BENCH_DEPTH    16
+
+typedef struct _INFLIGHT_BENCH {
+    DISK_INFLIGHT_TABLE *pTable;
+    pthread_spinlock_t Lock;
+    BOOLEAN Locked;
+    LONG Ios;
+    volatile LONG Running;
+    /* Written by the scanner thread */
+    ULONG64 Scans;
+    double ScanTime;
+    ULONG64 Seen;
+    ULONG64 Torn;
+} INFLIGHT_BENCH;
+
+typedef struct _INFLIGHT_BENCH_THREAD {
+    INFLIGHT_BENCH *pBench;
+    int Thread;
+    ULONG64 Untracked;
+    pthread_t Handle;
+} INFLIGHT_BENCH_THREAD;
+
+/** The first block and the length of a request are derived from its key, so the scanner can tell a torn copy */
+static ULONG64 InflightBenchLba(ULONG64 Key)
+{
+    return Key * 7 + 1;
+}
+
+static void *InflightBenchThread(void *Context)
+{
+    INFLIGHT_BENCH_THREAD *pThread = Context;
+    INFLIGHT_BENCH *pBench = pThread->pBench;
+    // Distinct request blocks per thread, every thread keeps INFLIGHT_BENCH_DEPTH of them in flight
+    ULONG64 Base = ((ULONG64)pThread->Thread + 1) << 20;
+    BOOLEAN Inserted[INFLIGHT_BENCH_DEPTH] = { 0 };
+    ULONG64 StartTsc = 0;
+    LONG i = 0;
+
+    for (i = 0; i < pBench->Ios; ++i)
+    {
+        ULONG32 Index = i % INFLIGHT_BENCH_DEPTH;
+        ULONG64 Key = Base + Index * 256;
+
+        if (pBench->Locked)
+            pthread_spin_lock(&pBench->Lock);
+        if (Inserted[Index])
+            DiskInflight_Remove(pBench->pTable, Key, &StartTsc);
+        Inserted[Index] = DiskInflight_Insert(pBench->pTable, Key, BenchTsc(), 0x28, InflightBenchLba(Key), (ULONG32)Key);
+        if (pBench->Locked)
+            pthread_spin_unlock(&pBench->Lock);
+        pThread->Untracked += !Inserted[Index];
+    }
+    for (i = 0; i < INFLIGHT_BENCH_DEPTH; ++i)
+    {
+        if (Inserted[i])
+            DiskInflight_Remove(pBench->pTable, Base + i * 256, &StartTsc);
+    }
+    return NULL;
+}
+
+static void *InflightBenchScanner(void *Context)
+{
+    INFLIGHT_BENCH *pBench = Context;
+    DISK_INFLIGHT_SCAN Scan;
+    ULONG32 i = 0;
+
+    while (__atomic_load_n(&pBench->Running, __ATOMIC_ACQUIRE))
+    {
+        double Start = Now();
+        // Every request is stuck, so every slot is also written by the scan
+        DiskInflight_Scan(pBench->pTable, BenchTsc(), 0, TRUE, &Scan);
+        pBench->ScanTime += Now() - Start;
+        ++pBench->Scans;
+        pBench->Seen += Scan.Outstanding;
+        for (i = 0; i < Scan.OldestCount; ++i)
+            pBench->Torn += Scan.Oldest[i].Lba != InflightBenchLba(Scan.Oldest[i].Length);
+    }
+    return NULL;
+}
+
+static double InflightBenchRun(INFLIGHT_BENCH *pBench, int Threads, BOOLEAN Locked, BOOLEAN Scanner, ULONG64 *pUntracked)
+{
+    INFLIGHT_BENCH_THREAD *pThreads = calloc(Threads, sizeof(*pThreads));
+    pthread_t ScannerHandle;
+    double Start = 0, Elapsed = 0;
+    int i = 0;
+
+    pBench->Locked = Locked;
+    pBench->Running = 1;
+    pBench->Scans = pBench->Seen = pBench->Torn = 0;
+    pBench->ScanTime = 0;
+    if (Scanner)
+        pthread_create(&ScannerHandle, NULL, InflightBenchScanner, pBench);
+    Start = Now();
+    for (i = 0; i < Threads; ++i)
+    {
+        pThreads[i].pBench = pBench;
+        pThreads[i].Thread = i;
+        pthread_create(&pThreads[i].Handle, NULL, InflightBenchThread, &pThreads[i]);
+    }
+    *pUntracked = 0;
+    for (i = 0; i < Threads; ++i)
+    {
+        pthread_join(pThreads[i].Handle, NULL);
+        *pUntracked += pThreads[i].Untracked;
+    }
+    Elapsed = Now() - Start;
+    __atomic_store_n(&pBench->Running, 0, __ATOMIC_RELEASE);
+    if (Scanner)
+        pthread_join(ScannerHandle, NULL);
+    free(pThreads);
+    return Elapsed * 1e9 / ((double)pBench->Ios * Threads);
+}
+
+/** The slowest list keeps the longest requests sorted, whatever order they come in */
+static int InflightCheckKeepLongest()
+{
+    DISK_INFLIGHT_REQUEST List[DISK_INFLIGHT_REPORT], Request = { 0 };
+    ULONG64 Top[DISK_INFLIGHT_REPORT] = { 0 };
+    ULONG32 Count = 0, Round = 0, i = 0, j = 0;
+
+    srand(1);
+    for (Round = 0; Round < 1000; ++Round)
+    {
+        Count = 0;
+        memset(Top, 0, sizeof(Top));
+        for (i = 0; i < Round % 40; ++i)
+        {
+            Request.Ticks = (ULONG64)(rand() % 100) + 1;
+            DiskInflight_KeepLongest(List, &Count, &Request);
+            // Reference: insertion into a zero filled array of the largest values
+            for (j = DISK_INFLIGHT_REPORT; j > 0 && Top[j - 1] < Request.Ticks; --j)
+                if (j < DISK_INFLIGHT_REPORT)
+                    Top[j] = Top[j - 1];
+            if (j < DISK_INFLIGHT_REPORT)
+                Top[j] = Request.Ticks;
+        }
+        if (Count != (Round % 40 < DISK_INFLIGHT_REPORT ? Round % 40 : DISK_INFLIGHT_REPORT))
+        {
+            fprintf(stderr, "round %u: %u requests kept\n", Round, Count);
+            return 1;
+        }
+        for (i = 0; i < Count; ++i)
+        {
+            if (List[i].Ticks != Top[i])
+            {
+                fprintf(stderr, "round %u: entry %u is %llu, expected %llu\n", Round, i,
+                    (unsigned long long)List[i].Ticks, (unsigned long long)Top[i]);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static int InflightBench(LONG Ios, int Threads)
+{
+    INFLIGHT_BENCH Bench = { 0 };
+    ULONG64 Untracked = 0;
+    double Cost = 0;
+
+    if (InflightCheckKeepLongest())
+        return 1;
+    printf("slowest list checks passed\n");
+
+    Bench.pTable = calloc(1, sizeof(DISK_INFLIGHT_TABLE));
+    Bench.Ios = Ios;
+    if (!Bench.pTable || Ios <= 0 || Threads <= 0 || pthread_spin_init(&Bench.Lock, PTHREAD_PROCESS_PRIVATE))
+    {
+        fprintf(stderr, "Can not set up the benchmark\n");
+        return 1;
+    }
+
+    printf("%d threads, %d requests each, %d in flight per thread, %d online processors\n", Threads, (int)Ios,
+        INFLIGHT_BENCH_DEPTH, (int)sysconf(_SC_NPROCESSORS_ONLN));
+    InflightBenchRun(&Bench, Threads, FALSE, FALSE, &Untracked);
+    Cost = InflightBenchRun(&Bench, Threads, FALSE, FALSE, &Untracked);
+    printf("%-30s %6.1f ns per request, %llu untracked\n", "lock-free", Cost, (unsigned long long)Untracked);
+    Cost = InflightBenchRun(&Bench, Threads, FALSE, TRUE, &Untracked);
+    printf("%-30s %6.1f ns per request, %llu untracked\n", "lock-free, scanner running", Cost, (unsigned long long)Untracked);
+    printf("%llu scans, %.2f us and %.1f requests in flight per scan, %llu torn copies\n",
+        (unsigned long long)Bench.Scans, Bench.Scans ? Bench.ScanTime * 1e6 / Bench.Scans : 0,
+        Bench.Scans ? Bench.Seen / (double)Bench.Scans : 0, (unsigned long long)Bench.Torn);
+    Cost = InflightBenchRun(&Bench, Threads, TRUE, FALSE, &Untracked);
+    printf("%-30s %6.1f ns per request, %llu untracked\n", "one spin lock", Cost, (unsigned long long)Untracked);
+
+    pthread_spin_destroy(&Bench.Lock);
+    free(Bench.pTable);
+    return Bench.Torn != 0;
+}
+
+/*
+ * Cost of counting a request in the heatmap of a disk: 80% of the requests go to a skewed hot set of 4 KiB
+ * blocks in the first GiB, the rest anywhere on a 2 TiB disk so the map is folded while it is updated.
+ */
+#define HEAT_BENCH_HOT_BLOCKS   1000
+#define HEAT_BENCH_DISK_SHIFT   41
+
+typedef struct _HEAT_BENCH {
+    HEAT_MAP *pMap;
+    pthread_mutex_t Lock;
+    LONG Ios;
+} HEAT_BENCH;
+
+typedef struct _HEAT_BENCH_THREAD {
+    HEAT_BENCH *pBench;
+    int Thread;
+    ULONG64 Locked;
+    pthread_t Handle;
+} HEAT_BENCH_THREAD;
+
+static ULONG64 HeatBenchNext(ULONG64 *pState)
+{
+    *pState ^= *pState << 13;
+    *pState ^= *pState >> 7;
+    *pState ^= *pState << 17;
+    return *pState;
+}
+
+/** Offset of the next request, hot block i is chosen with a probability falling with i */
+static ULONG64 HeatBenchOffset(ULONG64 *pState)
+{
+    ULONG64 Random = HeatBenchNext(pState);
+
+    if (Random % 10 < 8)
+    {
+        ULONG64 Hot = (HeatBenchNext(pState) % HEAT_BENCH_HOT_BLOCKS) * (HeatBenchNext(pState) % HEAT_BENCH_HOT_BLOCKS) /
+            HEAT_BENCH_HOT_BLOCKS;
+        return (Hot * 97 + 5) << HEAT_BLOCK_SHIFT;
+    }
+    return (HeatBenchNext(pState) & ((1ULL << HEAT_BENCH_DISK_SHIFT) - 1)) & ~4095ULL;
+}
+
+static void *HeatBenchThread(void *Context)
+{
+    HEAT_BENCH_THREAD *pThread = Context;
+    HEAT_BENCH *pBench = pThread->pBench;
+    HEAT_HOT_BLOCK Candidates[HEAT_MAX_REQUEST_BLOCKS];
+    ULONG64 State = 0x2545F4914F6CDD1DULL * (pThread->Thread + 1);
+    ULONG32 Count = 0, j = 0;
+    LONG i = 0;
+
+    for (i = 0; i < pBench->Ios; ++i)
+    {
+        ULONG64 Offset = HeatBenchOffset(&State);
+        BOOLEAN Write = (i & 3) == 0;
+        // Same fast and slow paths as DiskStats_Access
+        BOOLEAN Fold = !HeatMap_CountBucket(pBench->pMap, Offset, Write);
+        Count = HeatMap_CountBlocks(pBench->pMap, Offset, 4096, Candidates);
+        if (Fold || Count)
+        {
+            pthread_mutex_lock(&pBench->Lock);
+            if (Fold)
+            {
+                HeatMap_Fold(pBench->pMap, Offset);
+                HeatMap_CountBucket(pBench->pMap, Offset, Write);
+            }
+            for (j = 0; j < Count; ++j)
+                HeatMap_Promote(pBench->pMap, &Candidates[j]);
+            pthread_mutex_unlock(&pBench->Lock);
+            ++pThread->Locked;
+        }
+    }
+    return NULL;
+}
+
+static double HeatBenchRun(HEAT_BENCH *pBench, int Threads, ULONG64 *pLocked)
+{
+    HEAT_BENCH_THREAD *pThreads = calloc(Threads, sizeof(*pThreads));
+    double Start = 0;
+    int i = 0;
+
+    HeatMap_Initialize(pBench->pMap);
+    Start = Now();
+    for (i = 0; i < Threads; ++i)
+    {
+        pThreads[i].pBench = pBench;
+        pThreads[i].Thread = i;
+        pthread_create(&pThreads[i].Handle, NULL, HeatBenchThread, &pThreads[i]);
+    }
+    *pLocked = 0;
+    for (i = 0; i < Threads; ++i)
+    {
+        pthread_join(pThreads[i].Handle, NULL);
+        *pLocked += pThreads[i].Locked;
+    }
+    free(pThreads);
+    return (Now() - Start) * 1e9 / ((double)pBench->Ios * Threads);
+}
+
+/** A single thread loses no access to folding, and the top list is made of hot blocks */
+static int HeatCheck(HEAT_BENCH *pBench)
+{
+    const HEAT_HOT_BLOCK *pTop = NULL;
+    HEAT_SNAPSHOT_HEADER *pHeader = NULL;
+    ULONG64 Locked = 0, Counted = 0;
+    ULONG32 i = 0, Hot = 0;
+    LONG Ios = pBench->Ios;
+    int Result = 1;
+
+    pBench->Ios = 200000;
+    HeatBenchRun(pBench, 1, &Locked);
+    pBench->Ios = Ios;
+    pHeader = malloc(HEAT_SNAPSHOT_SIZE(HEAT_BUCKETS, HEAT_TOP_BLOCKS));
+    if (!pHeader || !HeatMap_Snapshot(pBench->pMap, pHeader, (ULONG32)HEAT_SNAPSHOT_SIZE(HEAT_BUCKETS, HEAT_TOP_BLOCKS)))
+        goto Cleanup;
+    for (i = 0; i < pHeader->BucketCount; ++i)
+        Counted += HeatBuckets(pHeader)[i].Reads + HeatBuckets(pHeader)[i].Writes;
+    pTop = HeatTop(pHeader);
+    for (i = 0; i < pHeader->TopCount; ++i)
+        Hot += pTop[i].Block < HEAT_BENCH_HOT_BLOCKS * 97 + 5 && pTop[i].Block % 97 == 5;
+    if (Counted != 200000 || pHeader->Blocks != 200000 || pHeader->TopCount != HEAT_TOP_BLOCKS ||
+        Hot < HEAT_TOP_BLOCKS * 9 / 10 || pHeader->BucketShift != HEAT_BENCH_DISK_SHIFT - 14)
+    {
+        fprintf(stderr, "%llu requests in the buckets, %llu blocks, %u of %u hot blocks, buckets of 2^%u bytes\n",
+            (unsigned long long)Counted, (unsigned long long)pHeader->Blocks, Hot, pHeader->TopCount,
+            pHeader->BucketShift);
+        goto Cleanup;
+    }
+    for (i = 1; i < pHeader->TopCount; ++i)
+    {
+        if (pTop[i].Count > pTop[i - 1].Count)
+        {
+            fprintf(stderr, "hot block %u is hotter than the one before it\n", i);
+            goto Cleanup;
+        }
+    }
+    Result = 0;
+
+Cleanup:
+    free(pHeader);
+    return Result;
+}
+
+static int HeatBench(const char *pszFile, LONG Ios, int Threads)
+{
+    HEAT_BENCH Bench = { 0 };
+    HEAT_SNAPSHOT_HEADER *pHeader = NULL;
+    ULONG64 Locked = 0;
+    double Cost = 0;
+    FILE *pFile = NULL;
+    int Result = 1;
+
+    Bench.pMap = malloc(sizeof(HEAT_MAP));
+    pHeader = malloc(HEAT_SNAPSHOT_SIZE(HEAT_BUCKETS, HEAT_TOP_BLOCKS));
+    Bench.Ios = Ios;
+    if (!Bench.pMap || !pHeader || Ios <= 0 || Threads <= 0)
+    {
+        fprintf(stderr, "Can not set up the benchmark\n");
+        goto Cleanup;
+    }
+    pthread_mutex_init(&Bench.Lock, NULL);
+
+    if (HeatCheck(&Bench))
+        goto Cleanup;
+    printf("folding and hot block checks passed\n");
+
+    printf("%d threads, %d requests each, %d online processors\n", Threads, (int)Ios, (int)sysconf(_SC_NPROCESSORS_ONLN));
+    Cost = HeatBenchRun(&Bench, Threads, &Locked);
+    printf("%-30s %5.1f ns per request, %.3f%% took the lock\n", "heatmap and sketch", Cost,
+        Locked * 100.0 / ((double)Ios * Threads));
+
+    memset(pHeader, 0, sizeof(HEAT_SNAPSHOT_HEADER));
+    pHeader->DiskTag = 1;
+    pHeader->LocalTime = BenchLocalTime();
+    HeatMap_Snapshot(Bench.pMap, pHeader, (ULONG32)HEAT_SNAPSHOT_SIZE(HEAT_BUCKETS, HEAT_TOP_BLOCKS));
+    if (!(pFile = fopen(pszFile, "wb")) || fwrite(pHeader, 1, pHeader->TotalSize, pFile) != pHeader->TotalSize)
+        fprintf(stderr, "Could not write %s\n", pszFile);
+    Result = 0;
+
+Cleanup:
+    if (pFile)
+        fclose(pFile);
+    if (Bench.pMap)
+        pthread_mutex_destroy(&Bench.Lock);
+    free(pHeader);
+    free(Bench.pMap);
+    return Result;
+}
+
+/*
+ * execute-bench: EVhdExecuteScsiRequestDisk and EvhdCompleteScsiRequest of the 2016 parser in user mode. The
+ * SRB is built from the VSC request as the parser does, vhdmp completes every request at once. Calls into the
+ * extension and vhdmp are not inlined, they cross modules in the driver.
+ */
+#define EXEC_MODE_PARSER        0   /* Disk opened without an extension */
+#define EXEC_MODE_PLAIN         1   /* Pass-through disk, requests only counted */
+#define EXEC_MODE_PACKET        2   /* Disk without a cipher still given an extension packet */
+
+typedef struct _EXEC_BENCH_SRB {
+    USHORT Length;
+    UCHAR Function;
+    UCHAR SrbStatus;
+    UCHAR ScsiStatus;
+    UCHAR PathId;
+    UCHAR TargetId;
+    UCHAR Lun;
+    UCHAR QueueTag;
+    UCHAR QueueAction;
+    UCHAR CdbLength;
+    UCHAR SenseInfoBufferLength;
+    ULONG32 SrbFlags;
+    ULONG32 DataTransferLength;
+    ULONG32 TimeOutValue;
+    void *DataBuffer;
+    void *SenseInfoBuffer;
+    void *NextSrb;
+    void *OriginalRequest;
+    void *SrbExtension;
+    ULONG32 QueueSortKey;
+    UCHAR Cdb[16];
+} EXEC_BENCH_SRB;
+
+typedef struct _EXEC_BENCH_VSC {
+    UCHAR SrbStatus;
+    UCHAR ScsiStatus;
+    UCHAR CdbLength;
+    UCHAR SenseInfoBufferLength;
+    UCHAR bDataIn;
+    UCHAR bReserved;
+    ULONG32 DataTransferLength;
+    UCHAR Cdb[20];
+    ULONG32 SrbFlags;
+} EXEC_BENCH_VSC;
+
+typedef struct _EXEC_BENCH_PACKET {
+    EXEC_BENCH_SRB *Srb;
+    void *pMdl;
+    void *pSenseBuffer;
+    size_t SenseBufferLength;
+    SRB_TIMING *pTiming;
+} EXEC_BENCH_PACKET;
+
+typedef struct _EXEC_BENCH_EXTENSION {
+    void *pCipherEngine;
+    USHORT DiskTag;
+    DISK_COUNTERS *pCounters;
+    DISK_INFLIGHT_TABLE *pInflight;
+    FLIGHT_RING *pRing;
+} EXEC_BENCH_EXTENSION;
+
+typedef struct _EXEC_BENCH_PARSER {
+    EXEC_BENCH_EXTENSION *pExtension;
+    BOOLEAN bPassThrough;
+    UCHAR ScsiPathId;
+    UCHAR ScsiTargetId;
+    UCHAR ScsiLun;
+} EXEC_BENCH_PARSER;
+
+typedef struct _EXEC_BENCH {
+    DISK_COUNTERS *pCounters;
+    DISK_INFLIGHT_TABLE *pInflight;
+    FLIGHT_RING *pRings;
+    int Mode;
+    LONG Ios;
+} EXEC_BENCH;
+
+typedef struct _EXEC_BENCH_THREAD {
+    EXEC_BENCH *pBench;
+    int Thread;
+    ULONG64 Completed;
+    pthread_t Handle;
+} EXEC_BENCH_THREAD;
+
+static ULONG64 ExecBenchLba(const UCHAR *Cdb)
+{
+    return __builtin_bswap32(*(const ULONG32 *)&Cdb[2]);
+}
+
+static void ExecBenchCountStart(EXEC_BENCH_EXTENSION *pExt, EXEC_BENCH_SRB *Srb)
+{
+    ULONG64 Lba = ExecBenchLba(Srb->Cdb), Tsc = BenchTsc();
+
+    FlightRing_Record(pExt->pRing, Tsc, FlightEventSrbStart, Srb->Cdb[0], pExt->DiskTag, Lba, Srb->DataTransferLength, 0);
+    DiskCounters_Start(pExt->pCounters, DiskCounters_Class(Srb->Cdb[0]));
+    DiskInflight_Insert(pExt->pInflight, (ULONG64)(size_t)Srb, Tsc, Srb->Cdb[0], Lba, Srb->DataTransferLength);
+}
+
+static void ExecBenchCountComplete(EXEC_BENCH_EXTENSION *pExt, EXEC_BENCH_SRB *Srb, LONG Status)
+{
+    ULONG64 Lba = ExecBenchLba(Srb->Cdb), Tsc = BenchTsc(), StartTsc = 0, Ticks = 0;
+
+    FlightRing_Record(pExt->pRing, Tsc, FlightEventSrbComplete, Srb->Cdb[0], pExt->DiskTag, Lba,
+        Srb->DataTransferLength, (ULONG32)Status);
+    if (DiskInflight_Remove(pExt->pInflight, (ULONG64)(size_t)Srb, &StartTsc))
+        Ticks = Tsc - StartTsc + 1;
+    DiskCounters_Complete(pExt->pCounters, DiskCounters_Class(Srb->Cdb[0]), Srb->DataTransferLength, Ticks,
+        Status < 0 || Srb->SrbStatus != 1);
+}
+
+static __attribute__((noinline)) void ExecBenchStartPlain(EXEC_BENCH_EXTENSION *pExt, EXEC_BENCH_SRB *Srb)
+{
+    ExecBenchCountStart(pExt, Srb);
+}
+
+static __attribute__((noinline)) void ExecBenchCompletePlain(EXEC_BENCH_EXTENSION *pExt, EXEC_BENCH_SRB *Srb, LONG Status)
+{
+    ExecBenchCountComplete(pExt, Srb, Status);
+}
+
+static __attribute__((noinline)) LONG ExecBenchStartPacket(EXEC_BENCH_EXTENSION *pExt, EXEC_BENCH_PACKET *pPacket)
+{
+    USHORT wSectors = __builtin_bswap16(*(USHORT *)&pPacket->Srb->Cdb[7]);
+    ULONG32 dwSectorOffset = __builtin_bswap32(*(ULONG32 *)&pPacket->Srb->Cdb[2]);
+
+    ExecBenchCountStart(pExt, pPacket->Srb);
+    switch (pPacket->Srb->Cdb[0])
+    {
+    case 0x2A:
+        if (pExt->pCipherEngine)
+            pPacket->pMdl = (void *)(size_t)(wSectors + dwSectorOffset);
+        break;
+    case 0x28:
+        break;
+    }
+    return 0;
+}
+
+static __attribute__((noinline)) LONG ExecBenchCompletePacket(EXEC_BENCH_EXTENSION *pExt, EXEC_BENCH_PACKET *pPacket,
+    LONG Status)
+{
+    USHORT wSectors = __builtin_bswap16(*(USHORT *)&pPacket->Srb->Cdb[7]);
+    ULONG32 dwSectorOffset = __builtin_bswap32(*(ULONG32 *)&pPacket->Srb->Cdb[2]);
+
+    ExecBenchCountComplete(pExt, pPacket->Srb, Status);
+    switch (pPacket->Srb->Cdb[0])
+    {
+    case 0x28:
+        if (pExt->pCipherEngine)
+            pPacket->pMdl = (void *)(size_t)(wSectors + dwSectorOffset);
+        break;
+    case 0x2A:
+        break;
+    }
+    return Status;
+}
+
+/** Stands in for vhdmp, which completes the request on the calling thread */
+static __attribute__((noinline)) LONG ExecBenchStartIo(EXEC_BENCH_SRB *Srb)
+{
+    Srb->SrbStatus = 1;
+    return 0;
+}
+
+static void ExecBenchPostProcess(EXEC_BENCH_PARSER *parser, EXEC_BENCH_SRB *Srb, EXEC_BENCH_VSC *pVsc, void **ppMdl,
+    LONG Status)
+{
+    pVsc->SrbStatus = Srb->SrbStatus;
+    pVsc->ScsiStatus = Srb->ScsiStatus;
+    pVsc->SenseInfoBufferLength = Srb->SenseInfoBufferLength;
+    pVsc->DataTransferLength = Srb->DataTransferLength;
+    if (parser->bPassThrough)
+        ExecBenchCompletePlain(parser->pExtension, Srb, Status);
+    else if (parser->pExtension)
+    {
+        EXEC_BENCH_PACKET ExtPacket;
+        ExtPacket.pMdl = *ppMdl;
+        ExtPacket.pSenseBuffer = pVsc->Cdb;
+        ExtPacket.SenseBufferLength = Srb->SenseInfoBufferLength;
+        ExtPacket.Srb = Srb;
+        ExtPacket.pTiming = NULL;
+        if (ExecBenchCompletePacket(parser->pExtension, &ExtPacket, Status) >= 0)
+            *ppMdl = ExtPacket.pMdl;
+    }
+}
+
+static LONG ExecBenchExecute(EXEC_BENCH_PARSER *parser, EXEC_BENCH_SRB *Srb, EXEC_BENCH_VSC *pVsc, void **ppMdl)
+{
+    LONG Status = 0;
+
+    memset(Srb, 0, sizeof(EXEC_BENCH_SRB));
+    Srb->Length = sizeof(EXEC_BENCH_SRB);
+    Srb->SrbStatus = pVsc->SrbStatus;
+    Srb->ScsiStatus = pVsc->ScsiStatus;
+    Srb->PathId = parser->ScsiPathId;
+    Srb->TargetId = parser->ScsiTargetId;
+    Srb->Lun = parser->ScsiLun;
+    Srb->CdbLength = pVsc->CdbLength;
+    Srb->SenseInfoBufferLength = pVsc->SenseInfoBufferLength;
+    Srb->SrbFlags = pVsc->bDataIn ? 0x40 : 0x80;
+    Srb->DataTransferLength = pVsc->DataTransferLength;
+    Srb->SrbFlags |= pVsc->SrbFlags & 8000;
+    Srb->SrbExtension = Srb + 1;
+    Srb->SenseInfoBuffer = pVsc->Cdb;
+    memmove(Srb->Cdb, pVsc->Cdb, pVsc->CdbLength);
+
+    if (parser->bPassThrough)
+        ExecBenchStartPlain(parser->pExtension, Srb);
+    else if (parser->pExtension)
+    {
+        EXEC_BENCH_PACKET ExtPacket;
+        ExtPacket.pMdl = *ppMdl;
+        ExtPacket.pSenseBuffer = pVsc->Cdb;
+        ExtPacket.SenseBufferLength = Srb->SenseInfoBufferLength;
+        ExtPacket.Srb = Srb;
+        ExtPacket.pTiming = NULL;
+        Status = ExecBenchStartPacket(parser->pExtension, &ExtPacket);
+        *ppMdl = ExtPacket.pMdl;
+    }
+    if (Status >= 0)
+        Status = ExecBenchStartIo(Srb);
+    ExecBenchPostProcess(parser, Srb, pVsc, ppMdl, Status);
+    return Status;
+}
+
+static void *ExecBenchThread(void *Context)
+{
+    EXEC_BENCH_THREAD *pThread = Context;
+    EXEC_BENCH *pBench = pThread->pBench;
+    EXEC_BENCH_EXTENSION Extension = { 0 };
+    EXEC_BENCH_PARSER Parser = { 0 };
+    EXEC_BENCH_VSC Vsc = { 0 };
+    // The SRB is followed by the inner buffer of the request, distinct per thread
+    static UCHAR Requests[64][256];
+    EXEC_BENCH_SRB *Srb = (EXEC_BENCH_SRB *)&Requests[pThread->Thread & 63][0];
+    void *pMdl = &Vsc;
+    LONG i = 0;
+
+    Extension.DiskTag = 1;
+    Extension.pCounters = &pBench->pCounters[pThread->Thread];
+    Extension.pInflight = pBench->pInflight;
+    Extension.pRing = &pBench->pRings[pThread->Thread];
+    Parser.pExtension = pBench->Mode == EXEC_MODE_PARSER ? NULL : &Extension;
+    Parser.bPassThrough = pBench->Mode == EXEC_MODE_PLAIN;
+    Vsc.CdbLength = 10;
+    Vsc.SenseInfoBufferLength = 20;
+
+    for (i = 0; i < pBench->Ios; ++i)
+    {
+        ULONG32 Lba = (ULONG32)i * 8;
+        Vsc.Cdb[0] = (i & 3) ? 0x28 : 0x2A;
+        Vsc.bDataIn = Vsc.Cdb[0] == 0x28;
+        *(ULONG32 *)&Vsc.Cdb[2] = __builtin_bswap32(Lba);
+        *(USHORT *)&Vsc.Cdb[7] = __builtin_bswap16(8);
+        Vsc.DataTransferLength = 4096;
+        pThread->Completed += ExecBenchExecute(&Parser, Srb, &Vsc, &pMdl) == 0;
+        __asm__ __volatile__("" ::: "memory");
+    }
+    return NULL;
+}
+
+static double ExecBenchRun(EXEC_BENCH *pBench, int Threads, int Mode)
+{
+    EXEC_BENCH_THREAD *pThreads = calloc(Threads, sizeof(*pThreads));
+    double Start = 0;
+    int i = 0;
+
+    pBench->Mode = Mode;
+    memset(pBench->pCounters, 0, Threads * sizeof(DISK_COUNTERS));
+    Start = Now();
+    for (i = 0; i < Threads; ++i)
+    {
+        pThreads[i].pBench = pBench;
+        pThreads[i].Thread = i;
+        pthread_create(&pThreads[i].Handle, NULL, ExecBenchThread, &pThreads[i]);
+    }
+    for (i = 0; i < Threads; ++i)
+        pthread_join(pThreads[i].Handle, NULL);
+    free(pThreads);
+    return (Now() - Start) * 1e9 / ((double)pBench->Ios * Threads);
+}
+
+static int ExecuteBench(LONG Ios, int Threads)
+{
+    static const char *ModeNames[] = { "parser without extension", "pass-through extension", "extension packet, no cipher" };
+    EXEC_BENCH Bench = { 0 };
+    DISK_COUNTERS Total = { 0 };
+    double Time[3] = { 0 };
+    int Mode = 0, Round = 0, i = 0;
+
+    Bench.pCounters = aligned_alloc(64, Threads * sizeof(DISK_COUNTERS));
+    Bench.pInflight = calloc(1, sizeof(DISK_INFLIGHT_TABLE));
+    Bench.pRings = aligned_alloc(64, Threads * sizeof(FLIGHT_RING));
+    Bench.Ios = Ios;
+    if (!Bench.pCounters || !Bench.pInflight || !Bench.pRings || Ios <= 0 || Threads <= 0)
+    {
+        fprintf(stderr, "Can not set up the benchmark\n");
+        return 1;
+    }
+    memset(Bench.pRings, 0, Threads * sizeof(FLIGHT_RING));
+
+    printf("%d threads, %d requests each, %d online processors\n", Threads, (int)Ios, (int)sysconf(_SC_NPROCESSORS_ONLN));
+    // Modes alternate so frequency changes hit them alike, the best of three rounds is kept
+    ExecBenchRun(&Bench, Threads, EXEC_MODE_PARSER);
+    for (Round = 0; Round < 3; ++Round)
+    {
+        for (Mode = EXEC_MODE_PARSER; Mode <= EXEC_MODE_PACKET; ++Mode)
+        {
+            double Ns = ExecBenchRun(&Bench, Threads, Mode);
+            if (!Round || Ns < Time[Mode])
+                Time[Mode] = Ns;
+        }
+    }
+    for (Mode = EXEC_MODE_PARSER; Mode <= EXEC_MODE_PACKET; ++Mode)
+        printf("%-30s %5.1f ns per request, +%.1f ns\n", ModeNames[Mode], Time[Mode], Time[Mode] - Time[EXEC_MODE_PARSER]);
+
+    // The last run counted every request it completed
+    for (i = 0; i < Threads; ++i)
+        DiskCounters_Add(&Total, &Bench.pCounters[i]);
+    if (Total.Completed[DISK_CLASS_READ] + Total.Completed[DISK_CLASS_WRITE] != (ULONG64)Ios * Threads || Total.Untracked)
+    {
+        fprintf(stderr, "Counted %llu requests, %llu untracked\n",
+            (unsigned long long)(Total.Completed[DISK_CLASS_READ] + Total.Completed[DISK_CLASS_WRITE]),
+            (unsigned long long)Total.Untracked);
+        return 1;
+    }
+    printf("every request counted\n");
+
+    free(Bench.pRings);
+    free(Bench.pInflight);
+    free(Bench.pCounters);
+    return 0;
+}
+
+/*
+ * diskinfo-bench: the EDiskInfo_Format query against a simulated vhdmp, seven synchronous
+ * IOCTL_STORAGE_VHD_GET_INFORMATION requests in a row as before the disk information cache, then the three
+ * requests left with the cache sent at once as DiskInfo_QueryFormat does. vhdmp either completes a request on
+ * the calling thread or pends it to its worker threads, every request takes the given service time.
+ */
+#define INFO_TYPE_GEOMETRY      0x0
+#define INFO_TYPE_LINKAGE_ID    0x1
+#define INFO_TYPE_PARSER_INFO   0x6
+#define INFO_TYPE_TYPE          0x7
+#define INFO_TYPE_FULLY_ALLOC   0x8
+#define INFO_TYPE_PHYSICAL_DISK 0x9
+#define INFO_TYPE_IN_USE        0xD
+#define INFO_TYPE_PAGE83        0xE
+#define INFO_WORKERS            4
+#define INFO_MAX_CALLS          6
+
+typedef struct _INFO_BENCH_RESPONSE {
+    ULONG32 Type;
+    ULONG32 Reserved;
+    union {
+        GUID Guid;
+        ULONG64 Vals[3];
+    };
+} INFO_BENCH_RESPONSE;
+
+typedef struct _INFO_BENCH_FORMAT {
+    ULONG32 DiskType;
+    ULONG32 DiskFormat;
+    ULONG32 BlockSize;
+    GUID LinkageId;
+    BOOLEAN IsRemote;
+    BOOLEAN InUse;
+    BOOLEAN FullyAllocated;
+    ULONG64 DiskSize;
+    GUID DiskIdentifier;
+} INFO_BENCH_FORMAT;
+
+typedef struct _INFO_BENCH_CALL {
+    ULONG32 Type;
+    INFO_BENCH_RESPONSE *pResponse;
+    volatile int Done;
+    struct _INFO_BENCH_CALL *pNext;
+} INFO_BENCH_CALL;
+
+typedef struct _INFO_BENCH_CACHE {
+    BOOLEAN bValid;
+    ULONG32 DiskType;
+    ULONG32 DiskFormat;
+    ULONG32 BlockSize;
+    BOOLEAN IsRemote;
+    GUID LinkageId;
+    GUID DiskIdentifier;
+} INFO_BENCH_CACHE;
+
+typedef struct _INFO_BENCH_VHDMP {
+    double ServiceTime;
+    int Pended;
+    int Stop;
+    /* Grows with every resize */
+    ULONG64 DiskSize;
+    pthread_mutex_t Lock;
+    pthread_cond_t Queued;
+    pthread_cond_t Completed;
+    INFO_BENCH_CALL *pHead;
+    INFO_BENCH_CALL **ppTail;
+    pthread_t Workers[INFO_WORKERS];
+} INFO_BENCH_VHDMP;
+
+static void InfoBenchServe(INFO_BENCH_VHDMP *pVhdmp, INFO_BENCH_CALL *pCall)
+{
+    static const GUID LinkageId = { 0x1B4E28BA, 0x2FA1, 0x11D2, { 0x88, 0x3F, 0xB9, 0xA7, 0x61, 0xBD, 0xE3, 0xFB } };
+    static const GUID Page83 = { 0x7D44D6B2, 0x5C0E, 0x4E6F, { 0x9A, 0x41, 0x02, 0x6B, 0x3C, 0x8D, 0x11, 0x5E } };
+    INFO_BENCH_RESPONSE *pResponse = pCall->pResponse;
+    double Until = Now() + pVhdmp->ServiceTime;
+
+    while (Now() < Until);
+    memset(pResponse, 0, sizeof(*pResponse));
+    pResponse->Type = pCall->Type;
+    switch (pCall->Type)
+    {
+    case INFO_TYPE_GEOMETRY:
+        pResponse->Vals[1] = pVhdmp->DiskSize;
+        pResponse->Vals[2] = 2 << 20;
+        break;
+    case INFO_TYPE_LINKAGE_ID:
+        pResponse->Guid = LinkageId;
+        break;
+    case INFO_TYPE_PARSER_INFO:
+        pResponse->Vals[0] = 3;
+        break;
+    case INFO_TYPE_TYPE:
+        pResponse->Vals[0] = 3;
+        break;
+    case INFO_TYPE_PAGE83:
+        pResponse->Guid = Page83;
+        break;
+    case INFO_TYPE_IN_USE:
+        pResponse->Vals[0] = 1;
+        break;
+    }
+}
+
+static void *InfoBenchWorker(void *Context)
+{
+    INFO_BENCH_VHDMP *pVhdmp = Context;
+    INFO_BENCH_CALL *pCall = NULL;
+
+    pthread_mutex_lock(&pVhdmp->Lock);
+    while (!pVhdmp->Stop)
+    {
+        if (!pVhdmp->pHead)
+        {
+            pthread_cond_wait(&pVhdmp->Queued, &pVhdmp->Lock);
+            continue;
+        }
+        pCall = pVhdmp->pHead;
+        pVhdmp->pHead = pCall->pNext;
+        if (!pVhdmp->pHead)
+            pVhdmp->ppTail = &pVhdmp->pHead;
+        pthread_mutex_unlock(&pVhdmp->Lock);
+        InfoBenchServe(pVhdmp, pCall);
+        pthread_mutex_lock(&pVhdmp->Lock);
+        pCall->Done = 1;
+        pthread_cond_broadcast(&pVhdmp->Completed);
+    }
+    pthread_mutex_unlock(&pVhdmp->Lock);
+    return NULL;
+}
+
+/** IoCallDriver, vhdmp completes the request inline or queues it to a worker */
+static void InfoBenchSend(INFO_BENCH_VHDMP *pVhdmp, INFO_BENCH_CALL *pCall)
+{
+    pCall->Done = 0;
+    pCall->pNext = NULL;
+    if (!pVhdmp->Pended)
+    {
+        InfoBenchServe(pVhdmp, pCall);
+        pCall->Done = 1;
+        return;
+    }
+    pthread_mutex_lock(&pVhdmp->Lock);
+    *pVhdmp->ppTail = pCall;
+    pVhdmp->ppTail = &pCall->pNext;
+    pthread_cond_signal(&pVhdmp->Queued);
+    pthread_mutex_unlock(&pVhdmp->Lock);
+}
+
+static void InfoBenchWait(INFO_BENCH_VHDMP *pVhdmp, INFO_BENCH_CALL *pCall)
+{
+    if (pCall->Done)
+        return;
+    pthread_mutex_lock(&pVhdmp->Lock);
+    while (!pCall->Done)
+        pthread_cond_wait(&pVhdmp->Completed, &pVhdmp->Lock);
+    pthread_mutex_unlock(&pVhdmp->Lock);
+}
+
+/** ConcurrentCalls */
+static void InfoBenchQuery(INFO_BENCH_VHDMP *pVhdmp, const ULONG32 *pTypes, int Count, INFO_BENCH_RESPONSE *pResponses)
+{
+    INFO_BENCH_CALL Calls[INFO_MAX_CALLS];
+    int i = 0;
+
+    for (i = 0; i < Count; ++i)
+    {
+        Calls[i].Type = pTypes[i];
+        Calls[i].pResponse = &pResponses[i];
+        InfoBenchSend(pVhdmp, &Calls[i]);
+    }
+    for (i = 0; i < Count; ++i)
+        InfoBenchWait(pVhdmp, &Calls[i]);
+}
+
+/** The query before the cache, one SynchronouseCall after the other */
+static void InfoBenchQuerySequential(INFO_BENCH_VHDMP *pVhdmp, INFO_BENCH_FORMAT *pFormat)
+{
+    static const ULONG32 Types[] = { INFO_TYPE_TYPE, INFO_TYPE_PARSER_INFO, INFO_TYPE_GEOMETRY, INFO_TYPE_LINKAGE_ID,
+        INFO_TYPE_IN_USE, INFO_TYPE_FULLY_ALLOC, INFO_TYPE_PHYSICAL_DISK, INFO_TYPE_PAGE83 };
+    INFO_BENCH_RESPONSE Responses[8];
+    int i = 0;
+
+    for (i = 0; i < 8; ++i)
+        InfoBenchQuery(pVhdmp, &Types[i], 1, &Responses[i]);
+    memset(pFormat, 0, sizeof(*pFormat));
+    pFormat->DiskType = (ULONG32)Responses[0].Vals[0];
+    pFormat->DiskFormat = (ULONG32)Responses[1].Vals[0];
+    pFormat->BlockSize = (ULONG32)Responses[2].Vals[2];
+    pFormat->DiskSize = Responses[2].Vals[1];
+    pFormat->LinkageId = Responses[3].Guid;
+    pFormat->InUse = (BOOLEAN)Responses[4].Vals[0];
+    pFormat->FullyAllocated = (BOOLEAN)Responses[5].Vals[0];
+    pFormat->IsRemote = (BOOLEAN)Responses[6].Vals[0];
+    pFormat->DiskIdentifier = Responses[7].Guid;
+}
+
+/** DiskInfo_Fetch */
+static void InfoBenchFetch(INFO_BENCH_VHDMP *pVhdmp, INFO_BENCH_CACHE *pCache)
+{
+    static const ULONG32 Types[] = { INFO_TYPE_TYPE, INFO_TYPE_PARSER_INFO, INFO_TYPE_GEOMETRY, INFO_TYPE_LINKAGE_ID,
+        INFO_TYPE_PHYSICAL_DISK, INFO_TYPE_PAGE83 };
+    INFO_BENCH_RESPONSE Responses[6];
+
+    InfoBenchQuery(pVhdmp, Types, 6, Responses);
+    pCache->DiskType = (ULONG32)Responses[0].Vals[0];
+    pCache->DiskFormat = (ULONG32)Responses[1].Vals[0];
+    pCache->BlockSize = (ULONG32)Responses[2].Vals[2];
+    pCache->LinkageId = Responses[3].Guid;
+    pCache->IsRemote = (BOOLEAN)Responses[4].Vals[0];
+    pCache->DiskIdentifier = Responses[5].Guid;
+    pCache->bValid = TRUE;
+}
+
+/** DiskInfo_QueryFormat */
+static void InfoBenchQueryCached(INFO_BENCH_VHDMP *pVhdmp, INFO_BENCH_CACHE *pCache, INFO_BENCH_FORMAT *pFormat)
+{
+    static const ULONG32 Types[] = { INFO_TYPE_GEOMETRY, INFO_TYPE_IN_USE, INFO_TYPE_FULLY_ALLOC };
+    INFO_BENCH_RESPONSE Responses[3];
+
+    if (!pCache->bValid)
+        InfoBenchFetch(pVhdmp, pCache);
+    InfoBenchQuery(pVhdmp, Types, 3, Responses);
+    memset(pFormat, 0, sizeof(*pFormat));
+    pFormat->DiskType = pCache->DiskType;
+    pFormat->DiskFormat = pCache->DiskFormat;
+    pFormat->BlockSize = pCache->BlockSize;
+    pFormat->LinkageId = pCache->LinkageId;
+    pFormat->IsRemote = pCache->IsRemote;
+    pFormat->DiskIdentifier = pCache->DiskIdentifier;
+    pFormat->DiskSize = Responses[0].Vals[1];
+    pFormat->InUse = (BOOLEAN)Responses[1].Vals[0];
+    pFormat->FullyAllocated = (BOOLEAN)Responses[2].Vals[0];
+}
+
+static int InfoBenchCompare(const void *p1, const void *p2)
+{
+    double d1 = *(const double *)p1, d2 = *(const double *)p2;
+    return d1 < d2 ? -1 : d1 > d2;
+}
+
+static int DiskInfoBench(LONG Queries, LONG ServiceUs)
+{
+    static const char *ModeNames[] = { "completed inline", "pended to workers" };
+    INFO_BENCH_VHDMP Vhdmp = { 0 };
+    INFO_BENCH_CACHE Cache = { 0 };
+    INFO_BENCH_FORMAT Expected = { 0 }, Format = { 0 };
+    double *pTimes = calloc(Queries > 0 ? Queries : 1, sizeof(double));
+    double Mean[2] = { 0 };
+    int Mode = 0, Cached = 0, Result = 0, i = 0;
+    LONG q = 0;
+
+    if (!pTimes || Queries <= 0 || ServiceUs < 0)
+    {
+        fprintf(stderr, "Can not set up the benchmark\n");
+        free(pTimes);
+        return 1;
+    }
+    Vhdmp.ServiceTime = ServiceUs * 1e-6;
+    Vhdmp.DiskSize = 40ULL << 30;
+    Vhdmp.ppTail = &Vhdmp.pHead;
+    pthread_mutex_init(&Vhdmp.Lock, NULL);
+    pthread_cond_init(&Vhdmp.Queued, NULL);
+    pthread_cond_init(&Vhdmp.Completed, NULL);
+    for (i = 0; i < INFO_WORKERS; ++i)
+        pthread_create(&Vhdmp.Workers[i], NULL, InfoBenchWorker, &Vhdmp);
+
+    printf("%d queries, %d us per vhdmp request, %d vhdmp workers\n", (int)Queries, (int)ServiceUs, INFO_WORKERS);
+    for (Mode = 0; Mode < 2 && !Result; ++Mode)
+    {
+        Vhdmp.Pended = Mode;
+        Cache.bValid = FALSE;
+        InfoBenchFetch(&Vhdmp, &Cache);
+        for (Cached = 0; Cached < 2; ++Cached)
+        {
+            for (q = 0; q < Queries; ++q)
+            {
+                double Start = Now();
+                if (Cached)
+                    InfoBenchQueryCached(&Vhdmp, &Cache, &Format);
+                else
+                    InfoBenchQuerySequential(&Vhdmp, &Format);
+                pTimes[q] = (Now() - Start) * 1e6;
+                Mean[Cached] += pTimes[q];
+            }
+            Mean[Cached] /= Queries;
+            qsort(pTimes, Queries, sizeof(double), InfoBenchCompare);
+            printf("%-18s %-28s %7.1f us mean, %7.1f us p99\n", ModeNames[Mode],
+                Cached ? "cached, 3 requests at once" : "uncached, 8 in a row", Mean[Cached],
+                pTimes[(Queries - 1) * 99 / 100]);
+        }
+        printf("%-18s %.1fx faster\n", ModeNames[Mode], Mean[0] / Mean[1]);
+        Mean[0] = Mean[1] = 0;
+
+        // The cache answers like vhdmp, a resize shows at once and an invalidated cache is read again
+        InfoBenchQuerySequential(&Vhdmp, &Expected);
+        InfoBenchQueryCached(&Vhdmp, &Cache, &Format);
+        Result |= memcmp(&Expected, &Format, sizeof(Format)) != 0;
+        Vhdmp.DiskSize += 1 << 30;
+        Cache.bValid = FALSE;
+        InfoBenchQuerySequential(&Vhdmp, &Expected);
+        InfoBenchQueryCached(&Vhdmp, &Cache, &Format);
+        Result |= memcmp(&Expected, &Format, sizeof(Format)) != 0 || Format.DiskSize != Vhdmp.DiskSize;
+    }
+    if (Result)
+        fprintf(stderr, "The cached query differs from vhdmp\n");
+    else
+        printf("cached queries match vhdmp\n");
+
+    pthread_mutex_lock(&Vhdmp.Lock);
+    Vhdmp.Stop = 1;
+    pthread_cond_broadcast(&Vhdmp.Queued);
+    pthread_mutex_unlock(&Vhdmp.Lock);
+    for (i = 0; i < INFO_WORKERS; ++i)
+        pthread_join(Vhdmp.Workers[i], NULL);
+    free(pTimes);
+    return Result;
+}
+
+/*
+ * irp-bench: control requests of several threads to one simulated vhdmp. Before the IRP pool, direct requests
+ * took the single IRP of the parser under its push lock and every other request built a new IRP and a system
+ * buffer with IoBuildDeviceIoControlRequest. With the pool both take a free IRP of the stack size and give it
+ * back, as IrpPool.c does. vhdmp pends every request for the given service time.
+ */
+#define IRP_BENCH_STACK_SIZE    7
+/* sizeof(IRP) + StackSize * sizeof(IO_STACK_LOCATION) on x64 */
+#define IRP_BENCH_IRP_SIZE      (0xD0 + IRP_BENCH_STACK_SIZE * 0x48)
+#define IRP_BENCH_DEPTH         8
+#define IRP_BENCH_DIRECT        0   /* One IRP of the parser under an exclusive lock */
+#define IRP_BENCH_BUILT         1   /* IRP and system buffer allocated for every request */
+#define IRP_BENCH_POOLED        2
+
+typedef struct _IRP_BENCH {
+    int Mode;
+    LONG Requests;
+    double ServiceTime;
+    pthread_mutex_t DirectLock;
+    void *pDirectIrp;
+    pthread_spinlock_t PoolLock;
+    ULONG32 PoolCount;
+    void *Pool[IRP_BENCH_DEPTH];
+    volatile LONG64 Allocated;
+    volatile LONG64 Reused;
+    volatile LONG InFlight;
+    volatile LONG MaxInFlight;
+} IRP_BENCH;
+
+static void *IrpBenchAllocate(IRP_BENCH *pBench)
+{
+    void *pIrp = NULL;
+
+    pthread_spin_lock(&pBench->PoolLock);
+    if (pBench->PoolCount)
+        pIrp = pBench->Pool[--pBench->PoolCount];
+    pthread_spin_unlock(&pBench->PoolLock);
+    if (pIrp)
+    {
+        __atomic_add_fetch(&pBench->Reused, 1, __ATOMIC_RELAXED);
+        return pIrp;
+    }
+    __atomic_add_fetch(&pBench->Allocated, 1, __ATOMIC_RELAXED);
+    return calloc(1, IRP_BENCH_IRP_SIZE);
+}
+
+static void IrpBenchFree(IRP_BENCH *pBench, void *pIrp)
+{
+    // IoReuseIrp
+    memset(pIrp, 0, IRP_BENCH_IRP_SIZE);
+    pthread_spin_lock(&pBench->PoolLock);
+    if (pBench->PoolCount < IRP_BENCH_DEPTH)
+    {
+        pBench->Pool[pBench->PoolCount++] = pIrp;
+        pIrp = NULL;
+    }
+    pthread_spin_unlock(&pBench->PoolLock);
+    free(pIrp);
+}
+
+static void IrpBenchCallDriver(IRP_BENCH *pBench, void *pIrp, void *pSystemBuffer)
+{
+    LONG InFlight = __atomic_add_fetch(&pBench->InFlight, 1, __ATOMIC_RELAXED);
+    LONG Max = pBench->MaxInFlight;
+    struct timespec Service = { 0, (long)(pBench->ServiceTime * 1e9) };
+
+    while (InFlight > Max && !__atomic_compare_exchange_n(&pBench->MaxInFlight, &Max, InFlight, 0,
+        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    ((volatile UCHAR *)pIrp)[0] = 1;
+    ((volatile UCHAR *)pSystemBuffer)[0] = 1;
+    // vhdmp pends the request, the thread waits for its completion
+    if (Service.tv_nsec)
+        nanosleep(&Service, NULL);
+    __atomic_sub_fetch(&pBench->InFlight, 1, __ATOMIC_RELAXED);
+}
+
+static void *IrpBenchThread(void *Context)
+{
+    IRP_BENCH *pBench = Context;
+    UCHAR Buffer[32] = { 0 };
+    LONG i = 0;
+
+    for (i = 0; i < pBench->Requests; ++i)
+    {
+        if (pBench->Mode == IRP_BENCH_DIRECT)
+        {
+            pthread_mutex_lock(&pBench->DirectLock);
+            memset(pBench->pDirectIrp, 0, IRP_BENCH_IRP_SIZE);
+            IrpBenchCallDriver(pBench, pBench->pDirectIrp, Buffer);
+            pthread_mutex_unlock(&pBench->DirectLock);
+        }
+        else if (pBench->Mode == IRP_BENCH_BUILT)
+        {
+            void *pIrp = calloc(1, IRP_BENCH_IRP_SIZE);
+            void *pSystemBuffer = malloc(sizeof(Buffer));
+            __atomic_add_fetch(&pBench->Allocated, 2, __ATOMIC_RELAXED);
+            memcpy(pSystemBuffer, Buffer, sizeof(Buffer));
+            IrpBenchCallDriver(pBench, pIrp, pSystemBuffer);
+            memcpy(Buffer, pSystemBuffer, sizeof(Buffer));
+            free(pSystemBuffer);
+            free(pIrp);
+        }
+        else
+        {
+            void *pIrp = IrpBenchAllocate(pBench);
+            IrpBenchCallDriver(pBench, pIrp, Buffer);
+            IrpBenchFree(pBench, pIrp);
+        }
+    }
+    return NULL;
+}
+
+static double IrpBenchRun(IRP_BENCH *pBench, int Threads, int Mode)
+{
+    pthread_t *pThreads = calloc(Threads, sizeof(pthread_t));
+    double Start = 0;
+    int i = 0;
+
+    pBench->Mode = Mode;
+    pBench->Allocated = pBench->Reused = 0;
+    pBench->MaxInFlight = 0;
+    Start = Now();
+    for (i = 0; i < Threads; ++i)
+        pthread_create(&pThreads[i], NULL, IrpBenchThread, pBench);
+    for (i = 0; i < Threads; ++i)
+        pthread_join(pThreads[i], NULL);
+    free(pThreads);
+    return (Now() - Start) * 1e9 / ((double)pBench->Requests * Threads);
+}
+
+static int IrpBench(LONG Requests, int Threads, LONG ServiceUs)
+{
+    static const char *ModeNames[] = { "one IRP under the lock", "IoBuildDeviceIoControlRequest", "IRP pool" };
+    IRP_BENCH Bench = { 0 };
+    int Mode = 0;
+
+    if (Requests <= 0 || Threads <= 0 || ServiceUs < 0)
+    {
+        fprintf(stderr, "Can not set up the benchmark\n");
+        return 1;
+    }
+    Bench.Requests = Requests;
+    Bench.ServiceTime = ServiceUs * 1e-6;
+    Bench.pDirectIrp = calloc(1, IRP_BENCH_IRP_SIZE);
+    pthread_mutex_init(&Bench.DirectLock, NULL);
+    pthread_spin_init(&Bench.PoolLock, PTHREAD_PROCESS_PRIVATE);
+
+    printf("%d threads, %d control requests each, %d us per vhdmp request\n", Threads, (int)Requests, (int)ServiceUs);
+    for (Mode = IRP_BENCH_DIRECT; Mode <= IRP_BENCH_POOLED; ++Mode)
+    {
+        double Ns = IrpBenchRun(&Bench, Threads, Mode);
+        printf("%-30s %8.0f ns per request, %2d in flight at most, %8lld allocations, %8lld reused\n",
+            ModeNames[Mode], Ns, (int)Bench.MaxInFlight, (long long)Bench.Allocated, (long long)Bench.Reused);
+    }
+
+    // Every request but the first few on each stack size found a free IRP
+    while (Bench.PoolCount)
+        free(Bench.Pool[--Bench.PoolCount]);
+    free(Bench.pDirectIrp);
+    if (Bench.Allocated > Threads)
+    {
+        fprintf(stderr, "The pool allocated %lld IRPs for %d threads\n", (long long)Bench.Allocated, Threads);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * scsi-cache-bench: guests booting and rescanning one disk, as the response cache of Extension.c sees them. Each
+ * boot or rescan is the usual burst of TEST UNIT READY, INQUIRY (standard, pages 00, 80, 83, B0 and B1), READ
+ * CAPACITY 10 and 16, MODE SENSE 6 and 10 and REPORT LUNS, with reads in between. Up to the queue depth
+ * requests are in flight and vhdmp answers each one when it is sent, so the resizes in the middle of the first
+ * burst and of a later one leave old answers in flight. Every answer from the cache is checked against what vhdmp would answer at that time.
+ */
+#define SCSI_BENCH_DEPTH        8
+#define SCSI_BENCH_BLOCK_SIZE   512
+/* Commands and reads of a burst sent before a resize, READ CAPACITY 10 and 16 are still in flight */
+#define SCSI_BENCH_RESIZE_AT    18
+
+typedef struct _SCSI_BENCH_COMMAND {
+    UCHAR Cdb[SCSI_CACHE_CDB_SIZE];
+    UCHAR CdbLength;
+    ULONG32 RequestLength;
+} SCSI_BENCH_COMMAND;
+
+typedef struct _SCSI_BENCH_REQUEST {
+    SCSI_BENCH_COMMAND Command;
+    ULONG32 DataLength;
+    UCHAR Data[SCSI_CACHE_DATA_SIZE];
+} SCSI_BENCH_REQUEST;
+
+static const SCSI_BENCH_COMMAND ScsiBenchBurst[] = {
+    { { 0x00 }, 6, 0 },
+    { { 0x12, 0, 0, 0, 36 }, 6, 36 },
+    { { 0x12, 1, 0x00, 0, 255 }, 6, 255 },
+    { { 0x12, 1, 0x80, 0, 255 }, 6, 255 },
+    { { 0x12, 1, 0x83, 0, 255 }, 6, 255 },
+    { { 0x12, 1, 0xB0, 0, 64 }, 6, 64 },
+    { { 0x12, 1, 0xB1, 0, 64 }, 6, 64 },
+    { { 0x25 }, 10, 8 },
+    { { 0x9E, 0x10, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 32 }, 16, 32 },
+    { { 0x1A, 0, 0x3F, 0, 192 }, 6, 192 },
+    { { 0x5A, 0, 0x3F, 0, 0, 0, 0, 0, 192 }, 10, 192 },
+    { { 0xA0, 0, 0, 0, 0, 0, 0, 0, 0, 16 }, 12, 16 },
+    { { 0x00 }, 6, 0 },
+    { { 0x25 }, 10, 8 },
+};
+#define SCSI_BENCH_BURST        (ULONG32)(sizeof(ScsiBenchBurst) / sizeof(ScsiBenchBurst[0]))
+
+/** Response of the simulated disk, depends on the command and the capacity */
+static ULONG32 ScsiBenchRespond(const SCSI_BENCH_COMMAND *pCommand, ULONG64 Blocks, UCHAR *pData)
+{
+    ULONG32 Length = pCommand->RequestLength, i = 0;
+
+    memset(pData, 0, Length);
+    switch (pCommand->Cdb[0])
+    {
+    case 0x00:
+        return 0;
+    case 0x12:
+        for (i = 0; i < Length; ++i)
+            pData[i] = (UCHAR)(pCommand->Cdb[2] * 7 + i);
+        return Length;
+    case 0x25:
+        for (i = 0; i < 4; ++i)
+            pData[i] = (UCHAR)((Blocks - 1 > 0xFFFFFFFF ? 0xFFFFFFFF : Blocks - 1) >> (24 - 8 * i));
+        pData[6] = SCSI_BENCH_BLOCK_SIZE >> 8;
+        return 8;
+    case 0x9E:
+        for (i = 0; i < 8; ++i)
+            pData[i] = (UCHAR)((Blocks - 1) >> (56 - 8 * i));
+        pData[10] = SCSI_BENCH_BLOCK_SIZE >> 8;
+        return Length;
+    case 0x1A:
+    case 0x5A:
+        // Block descriptor with the number of blocks, then the pages
+        for (i = 0; i < 4; ++i)
+            pData[4 + i] = (UCHAR)(Blocks >> (24 - 8 * i));
+        for (i = 12; i < 64; ++i)
+            pData[i] = (UCHAR)i;
+        return 64;
+    case 0xA0:
+        pData[3] = 8;
+        return Length;
+    }
+    return 0;
+}
+
+static int ScsiBenchRun(LONG Boots, LONG ServiceUs, int UseCache, ULONG64 *pSent, double *pSeconds)
+{
+    SCSI_CACHE *pCache = calloc(1, sizeof(SCSI_CACHE));
+    SCSI_BENCH_REQUEST *pQueue = calloc(SCSI_BENCH_DEPTH, sizeof(SCSI_BENCH_REQUEST));
+    SCSI_BENCH_COMMAND Read = { { 0x28, 0, 0, 0, 0, 0, 0, 0, 8 }, 10, 8 * SCSI_BENCH_BLOCK_SIZE };
+    UCHAR Expected[SCSI_CACHE_DATA_SIZE];
+    struct timespec Service = { 0, ServiceUs * 1000 };
+    ULONG64 Blocks = 1ULL << 21;
+    ULONG32 Head = 0, Count = 0;
+    LONG Boot = 0;
+    int Mismatches = 0;
+    double Start = Now();
+
+    ScsiCache_Initialize(pCache);
+    *pSent = 0;
+    for (Boot = 0; Boot <= Boots; ++Boot)
+    {
+        ULONG32 i = 0;
+
+        for (i = 0; i < SCSI_BENCH_BURST * 2; ++i)
+        {
+            const SCSI_BENCH_COMMAND *pCommand = i & 1 ? &Read : &ScsiBenchBurst[i / 2];
+            BOOLEAN Cacheable = UseCache && ScsiCache_IsCacheable(pCommand->Cdb, pCommand->CdbLength);
+            SCSI_BENCH_REQUEST *pRequest = NULL;
+
+            if (Boot == Boots)
+                break;
+            if ((0 == Boot || Boots / 2 == Boot) && SCSI_BENCH_RESIZE_AT == i)
+            {
+                // The disk grows in the middle of a burst, answers sent before are still in flight
+                Blocks += 1ULL << 20;
+                if (UseCache)
+                    ScsiCache_Invalidate(pCache);
+            }
+            if (Cacheable)
+            {
+                const SCSI_CACHE_ENTRY *pEntry = ScsiCache_Find(pCache, pCommand->Cdb, pCommand->CdbLength,
+                    pCommand->RequestLength);
+                if (pEntry)
+                {
+                    ULONG32 Length = ScsiBenchRespond(pCommand, Blocks, Expected);
+                    if (pEntry->DataLength != Length || memcmp(pEntry->Data, Expected, Length))
+                        ++Mismatches;
+                    continue;
+                }
+                ScsiCache_Sent(pCache);
+            }
+
+            // Complete the oldest request when the queue is full
+            if (SCSI_BENCH_DEPTH == Count)
+            {
+                SCSI_BENCH_REQUEST *pDone = &pQueue[Head];
+                if (UseCache && ScsiCache_IsCacheable(pDone->Command.Cdb, pDone->Command.CdbLength))
+                    ScsiCache_Complete(pCache, pDone->Command.Cdb, pDone->Command.CdbLength, pDone->Command.RequestLength,
+                        0x01, SCSI_CACHE_STATUS_GOOD, 0, pDone->Data, pDone->DataLength, TRUE);
+                Head = (Head + 1) % SCSI_BENCH_DEPTH;
+                --Count;
+            }
+            pRequest = &pQueue[(Head + Count++) % SCSI_BENCH_DEPTH];
+            pRequest->Command = *pCommand;
+            pRequest->DataLength = pCommand->Cdb[0] == 0x28 ? 0 : ScsiBenchRespond(pCommand, Blocks, pRequest->Data);
+            ++*pSent;
+            if (ServiceUs)
+                nanosleep(&Service, NULL);
+        }
+        // A rescan waits for its answers before the next one starts
+        while (Count && Boot + 1 < Boots && (Boot + 1) % 4 == 0)
+        {
+            SCSI_BENCH_REQUEST *pDone = &pQueue[Head];
+            if (UseCache && ScsiCache_IsCacheable(pDone->Command.Cdb, pDone->Command.CdbLength))
+                ScsiCache_Complete(pCache, pDone->Command.Cdb, pDone->Command.CdbLength, pDone->Command.RequestLength,
+                    0x01, SCSI_CACHE_STATUS_GOOD, 0, pDone->Data, pDone->DataLength, TRUE);
+            Head = (Head + 1) % SCSI_BENCH_DEPTH;
+            --Count;
+        }
+    }
+    *pSeconds = Now() - Start;
+    free(pQueue);
+    free(pCache);
+    return Mismatches;
+}
+
+static int ScsiCacheBench(LONG Boots, LONG ServiceUs)
+{
+    ULONG64 Commands = 0, Sent = 0, Reads = 0;
+    double Direct = 0, Cached = 0;
+    int Mismatches = 0;
+
+    if (Boots < 2 || ServiceUs < 0)
+    {
+        fprintf(stderr, "Can not set up the benchmark\n");
+        return 1;
+    }
+    Reads = (ULONG64)Boots * SCSI_BENCH_BURST;
+    ScsiBenchRun(Boots, ServiceUs, FALSE, &Commands, &Direct);
+    Mismatches = ScsiBenchRun(Boots, ServiceUs, TRUE, &Sent, &Cached);
+
+    printf("%d boots and rescans, %d control commands and %d reads each, %d us per vhdmp request\n",
+        (int)Boots, (int)SCSI_BENCH_BURST, (int)SCSI_BENCH_BURST, (int)ServiceUs);
+    printf("without the cache %8llu requests to vhdmp in %.3f s\n", (unsigned long long)Commands, Direct);
+    printf("with the cache    %8llu requests to vhdmp in %.3f s, %.1f%% of the control commands answered\n",
+        (unsigned long long)Sent, Cached, 100.0 * (Commands - Sent) / (Commands - Reads));
+    if (Mismatches)
+    {
+        fprintf(stderr, "%d answers from the cache differ from the disk\n", Mismatches);
+        return 1;
+    }
+    return 0;
+}
+
+
+/*
+ * read-cache-bench: a trace of 4 KiB reads and writes replayed through the 2Q cache of BlockCache.h and through
+ * a plain LRU cache of the same size. Requests are kept in flight up to the queue depth and complete in random
+ * order, a read returns the data of the disk when it is sent and a write changes the disk when it completes,
+ * invalidating the cache when it starts and again when it completes as Extension.c does. Every hit on a block
+ * without a write in flight must return the current data of the disk. The trace is read from a file of lines
+ * "R|W <byte offset> <byte length>", or made up: hot blocks read with a backup scan going through the disk, or
+ * reads with a power law skew, both with some writes.
+ */
+#define READ_BENCH_DEPTH        16
+#define READ_BENCH_WRITE_PERCENT 5
+
+typedef struct _READ_BENCH_REQUEST {
+    ULONG64 Block;
+    ULONG64 Start;
+    /* Version of the block a read returned */
+    ULONG64 Version;
+    int Write;
+} READ_BENCH_REQUEST;
+
+typedef struct _LRU_BENCH {
+    ULONG32 Capacity;
+    ULONG32 Count;
+    ULONG32 Head;
+    ULONG32 Tail;
+    ULONG32 BucketMask;
+    ULONG32 *pBuckets;
+    ULONG64 *pBlocks;
+    ULONG32 *pPrev;
+    ULONG32 *pNext;
+    ULONG32 *pHashNext;
+    ULONG64 Hits;
+} LRU_BENCH;
+
+typedef struct _READ_BENCH {
+    BLOCK_CACHE Cache;
+    LRU_BENCH Lru;
+    ULONG64 DiskBlocks;
+    /* Current version of every block, and writes in flight on it */
+    ULONG64 *pVersions;
+    UCHAR *pWriting;
+    READ_BENCH_REQUEST Queue[READ_BENCH_DEPTH];
+    ULONG32 Queued;
+    ULONG64 Clock;
+    ULONG64 Reads;
+    ULONG64 Writes;
+    ULONG64 Stale;
+    ULONG64 Allocated;
+    ULONG64 Random;
+} READ_BENCH;
+
+static ULONG64 ReadBenchRandom(READ_BENCH *pBench)
+{
+    pBench->Random ^= pBench->Random << 13;
+    pBench->Random ^= pBench->Random >> 7;
+    pBench->Random ^= pBench->Random << 17;
+    return pBench->Random;
+}
+
+static VOID *ReadBenchAllocate(VOID *pContext)
+{
+    ++((READ_BENCH *)pContext)->Allocated;
+    return malloc(sizeof(ULONG64));
+}
+
+static VOID ReadBenchRelease(VOID *pContext, VOID *pData)
+{
+    --((READ_BENCH *)pContext)->Allocated;
+    free(pData);
+}
+
+static ULONG32 LruBenchFind(LRU_BENCH *pLru, ULONG64 Block)
+{
+    ULONG32 Index = pLru->pBuckets[BlockCache_Hash(0, Block) & pLru->BucketMask];
+    while (Index != BLOCK_CACHE_NIL && pLru->pBlocks[Index] != Block)
+        Index = pLru->pHashNext[Index];
+    return Index;
+}
+
+static void LruBenchUnlink(LRU_BENCH *pLru, ULONG32 Index)
+{
+    if (pLru->pPrev[Index] != BLOCK_CACHE_NIL)
+        pLru->pNext[pLru->pPrev[Index]] = pLru->pNext[Index];
+    else
+        pLru->Head = pLru->pNext[Index];
+    if (pLru->pNext[Index] != BLOCK_CACHE_NIL)
+        pLru->pPrev[pLru->pNext[Index]] = pLru->pPrev[Index];
+    else
+        pLru->Tail = pLru->pPrev[Index];
+}
+
+static void LruBenchPush(LRU_BENCH *pLru, ULONG32 Index)
+{
+    pLru->pPrev[Index] = BLOCK_CACHE_NIL;
+    pLru->pNext[Index] = pLru->Head;
+    if (pLru->Head != BLOCK_CACHE_NIL)
+        pLru->pPrev[pLru->Head] = Index;
+    else
+        pLru->Tail = Index;
+    pLru->Head = Index;
+}
+
+static void LruBenchUnhash(LRU_BENCH *pLru, ULONG32 Index)
+{
+    ULONG32 *pLink = &pLru->pBuckets[BlockCache_Hash(0, pLru->pBlocks[Index]) & pLru->BucketMask];
+    while (*pLink != Index)
+        pLink = &pLru->pHashNext[*pLink];
+    *pLink = pLru->pHashNext[Index];
+}
+
+/** Counts a read of the LRU cache and keeps the block, only the hit rate is compared */
+static void LruBenchRead(LRU_BENCH *pLru, ULONG64 Block)
+{
+    ULONG32 Index = LruBenchFind(pLru, Block);
+    ULONG32 *pBucket = NULL;
+
+    if (Index != BLOCK_CACHE_NIL)
+    {
+        ++pLru->Hits;
+        LruBenchUnlink(pLru, Index);
+        LruBenchPush(pLru, Index);
+        return;
+    }
+    if (pLru->Count < pLru->Capacity)
+        Index = pLru->Count++;
+    else
+    {
+        Index = pLru->Tail;
+        LruBenchUnlink(pLru, Index);
+        if (pLru->pBlocks[Index] != ~0ULL)
+            LruBenchUnhash(pLru, Index);
+    }
+    pLru->pBlocks[Index] = Block;
+    pBucket = &pLru->pBuckets[BlockCache_Hash(0, Block) & pLru->BucketMask];
+    pLru->pHashNext[Index] = *pBucket;
+    *pBucket = Index;
+    LruBenchPush(pLru, Index);
+}
+
+static void LruBenchInvalidate(LRU_BENCH *pLru, ULONG64 Block)
+{
+    ULONG32 Index = LruBenchFind(pLru, Block);
+
+    if (Index == BLOCK_CACHE_NIL)
+        return;
+    // The slot leaves the hash and moves to the tail, it is reused first
+    LruBenchUnlink(pLru, Index);
+    LruBenchUnhash(pLru, Index);
+    pLru->pBlocks[Index] = ~0ULL;
+    pLru->pPrev[Index] = pLru->Tail;
+    pLru->pNext[Index] = BLOCK_CACHE_NIL;
+    if (pLru->Tail != BLOCK_CACHE_NIL)
+        pLru->pNext[pLru->Tail] = Index;
+    else
+        pLru->Head = Index;
+    pLru->Tail = Index;
+}
+
+static void ReadBenchComplete(READ_BENCH *pBench, ULONG32 Slot)
+{
+    READ_BENCH_REQUEST Request = pBench->Queue[Slot];
+
+    pBench->Queue[Slot] = pBench->Queue[--pBench->Queued];
+    ++pBench->Clock;
+    if (Request.Write)
+    {
+        ++pBench->pVersions[Request.Block];
+        --pBench->pWriting[Request.Block];
+        BlockCache_Invalidate(&pBench->Cache, 1, Request.Block, pBench->Clock);
+        LruBenchInvalidate(&pBench->Lru, Request.Block);
+    }
+    else
+    {
+        ULONG64 *pData = BlockCache_Fill(&pBench->Cache, 1, Request.Block, Request.Start);
+        if (pData)
+            *pData = Request.Version;
+    }
+}
+
+static void ReadBenchRequest(READ_BENCH *pBench, int Write, ULONG64 Block)
+{
+    READ_BENCH_REQUEST *pRequest = NULL;
+
+    Block %= pBench->DiskBlocks;
+    if (pBench->Queued == READ_BENCH_DEPTH)
+        ReadBenchComplete(pBench, (ULONG32)(ReadBenchRandom(pBench) % pBench->Queued));
+    ++pBench->Clock;
+    if (Write)
+    {
+        ++pBench->Writes;
+        ++pBench->pWriting[Block];
+        BlockCache_Invalidate(&pBench->Cache, 1, Block, pBench->Clock);
+        LruBenchInvalidate(&pBench->Lru, Block);
+    }
+    else
+    {
+        const ULONG64 *pData = BlockCache_Lookup(&pBench->Cache, 1, Block);
+        ++pBench->Reads;
+        LruBenchRead(&pBench->Lru, Block);
+        if (pData)
+        {
+            if (!pBench->pWriting[Block] && *pData != pBench->pVersions[Block])
+                ++pBench->Stale;
+            return;
+        }
+    }
+    pRequest = &pBench->Queue[pBench->Queued++];
+    pRequest->Block = Block;
+    pRequest->Start = pBench->Clock;
+    pRequest->Version = pBench->pVersions[Block];
+    pRequest->Write = Write;
+}
+
+static int ReadBenchRun(const char *pszName, const char *pszTrace, int Pattern, ULONG32 Capacity, LONG Requests)
+{
+    ULONG32 Buckets = 1, i = 0;
+    READ_BENCH *pBench = calloc(1, sizeof(READ_BENCH));
+    BLOCK_CACHE_NODE *pNodes = NULL;
+    ULONG32 *pCacheBuckets = NULL;
+    ULONG64 *pStamps = NULL;
+    ULONG64 ScanBlock = 0;
+    FILE *pTrace = NULL;
+    double Start = 0, Seconds = 0;
+    int Result = 0;
+
+    while (Buckets < BlockCache_NodeCount(Capacity))
+        Buckets <<= 1;
+    pBench->DiskBlocks = (ULONG64)Capacity * 64;
+    pBench->pVersions = calloc(pBench->DiskBlocks, sizeof(ULONG64));
+    pBench->pWriting = calloc(pBench->DiskBlocks, 1);
+    pBench->Random = 0x9E3779B97F4A7C15ULL;
+    pNodes = calloc(BlockCache_NodeCount(Capacity), sizeof(BLOCK_CACHE_NODE));
+    pCacheBuckets = calloc(Buckets, sizeof(ULONG32));
+    pStamps = calloc(4096, sizeof(ULONG64));
+    pBench->Lru.Capacity = Capacity;
+    pBench->Lru.Head = pBench->Lru.Tail = BLOCK_CACHE_NIL;
+    pBench->Lru.BucketMask = Buckets - 1;
+    pBench->Lru.pBuckets = malloc(Buckets * sizeof(ULONG32));
+    pBench->Lru.pBlocks = calloc(Capacity, sizeof(ULONG64));
+    pBench->Lru.pPrev = calloc(Capacity, sizeof(ULONG32));
+    pBench->Lru.pNext = calloc(Capacity, sizeof(ULONG32));
+    pBench->Lru.pHashNext = calloc(Capacity, sizeof(ULONG32));
+    if (!pBench->pVersions || !pBench->pWriting || !pNodes || !pCacheBuckets || !pStamps || !pBench->Lru.pBuckets ||
+        !pBench->Lru.pBlocks || !pBench->Lru.pPrev || !pBench->Lru.pNext || !pBench->Lru.pHashNext)
+    {
+        fprintf(stderr, "Can not set up the benchmark\n");
+        return 1;
+    }
+    for (i = 0; i < Buckets; ++i)
+        pBench->Lru.pBuckets[i] = BLOCK_CACHE_NIL;
+    BlockCache_Initialize(&pBench->Cache, Capacity, pNodes, pCacheBuckets, Buckets, pStamps, 4096, ReadBenchAllocate,
+        ReadBenchRelease, pBench);
+    if (pszTrace && !(pTrace = fopen(pszTrace, "r")))
+    {
+        fprintf(stderr, "Can not open %s\n", pszTrace);
+        return 1;
+    }
+
+    Start = Now();
+    if (pTrace)
+    {
+        char Line[128], Type = 0;
+        unsigned long long Offset = 0, Length = 0, Block = 0;
+
+        // Offsets are bytes, the disk of the simulation wraps around
+        while (fgets(Line, sizeof(Line), pTrace))
+        {
+            if (3 != sscanf(Line, " %c %llu %llu", &Type, &Offset, &Length))
+                continue;
+            for (Block = Offset / 4096; Block < (Offset + Length + 4095) / 4096; ++Block)
+                ReadBenchRequest(pBench, 'W' == Type || 'w' == Type, Block);
+        }
+        fclose(pTrace);
+    }
+    else
+    {
+        LONG n = 0;
+        for (n = 0; n < Requests; ++n)
+        {
+            ULONG64 Random = ReadBenchRandom(pBench);
+            int Write = Random % 100 < READ_BENCH_WRITE_PERCENT;
+            double Uniform = (double)(ReadBenchRandom(pBench) >> 11) / (double)(1ULL << 53);
+
+            if (0 == Pattern)
+            {
+                // Hot blocks filling 3/4 of the cache read 70% of the time, a scan through the rest of the disk otherwise
+                if (Write || Random % 10 < 7)
+                    ReadBenchRequest(pBench, Write, (ULONG64)(Uniform * (Capacity / 4 * 3)));
+                else
+                    ReadBenchRequest(pBench, 0, Capacity / 4 * 3 + ScanBlock++ % (pBench->DiskBlocks - Capacity / 4 * 3));
+            }
+            else
+                // Power law over four times the cache
+                ReadBenchRequest(pBench, Write, (ULONG64)(Uniform * Uniform * Uniform * Capacity * 4));
+        }
+    }
+    while (pBench->Queued)
+        ReadBenchComplete(pBench, 0);
+    Seconds = Now() - Start;
+
+    printf("%-12s %9llu reads %8llu writes  LRU %5.1f%%  2Q %5.1f%% hits, %llu fills raced a write, %.0f ns per request\n",
+        pszName, (unsigned long long)pBench->Reads, (unsigned long long)pBench->Writes,
+        pBench->Reads ? 100.0 * pBench->Lru.Hits / pBench->Reads : 0,
+        pBench->Reads ? 100.0 * pBench->Cache.Hits / pBench->Reads : 0, (unsigned long long)pBench->Cache.Rejected,
+        1e9 * Seconds / (pBench->Reads + pBench->Writes + 1));
+    if (pBench->Stale)
+    {
+        fprintf(stderr, "%llu hits returned stale data\n", (unsigned long long)pBench->Stale);
+        Result = 1;
+    }
+    BlockCache_SetLimit(&pBench->Cache, Capacity / 4);
+    if (BlockCache_Resident(&pBench->Cache) > Capacity / 4 || pBench->Allocated != BlockCache_Resident(&pBench->Cache))
+    {
+        fprintf(stderr, "The cache holds %llu buffers for %u blocks after shrinking\n",
+            (unsigned long long)pBench->Allocated, BlockCache_Resident(&pBench->Cache));
+        Result = 1;
+    }
+    BlockCache_DropDisk(&pBench->Cache, 1, pBench->Clock);
+    if (pBench->Allocated)
+    {
+        fprintf(stderr, "%llu buffers left after dropping the disk\n", (unsigned long long)pBench->Allocated);
+        Result = 1;
+    }
+
+    free(pBench->Lru.pBuckets);
+    free(pBench->Lru.pBlocks);
+    free(pBench->Lru.pPrev);
+    free(pBench->Lru.pNext);
+    free(pBench->Lru.pHashNext);
+    free(pBench->pVersions);
+    free(pBench->pWriting);
+    free(pNodes);
+    free(pCacheBuckets);
+    free(pStamps);
+    free(pBench);
+    return Result;
+}
+
+static int ReadCacheBench(const char *pszTrace, LONG CacheMegabytes, LONG Requests)
+{
+    ULONG32 Capacity = (ULONG32)(CacheMegabytes * 256);
+
+    if (CacheMegabytes <= 0 || Requests <= 0)
+    {
+        fprintf(stderr, "Can not set up the benchmark\n");
+        return 1;
+    }
+    printf("%u blocks of 4 KiB, %d requests in flight\n", Capacity, READ_BENCH_DEPTH);
+    if (pszTrace)
+        return ReadBenchRun(pszTrace, pszTrace, 0, Capacity, 0);
+    return ReadBenchRun("hot + scan", NULL, 0, Capacity, Requests) | ReadBenchRun("power law", NULL, 1, Capacity, Requests);
+}
+
+#define PARENT_BENCH_DEPTH      64
+/* Blocks of the parent the clones boot from, and the start of the area they write */
+#define PARENT_BENCH_BLOCKS     65536
+#define PARENT_BENCH_WRITE_AREA (PARENT_BENCH_BLOCKS / 4 * 3)
+/* Reads per boot, drawn from the boot order all clones share except for a few */
+#define PARENT_BENCH_READS      6000
+#define PARENT_BENCH_OWN_PERCENT 10
+#define PARENT_BENCH_WRITE_PERCENT 10
+/* Files of the clones of the remount run, the table entries of a VHD are sector offsets */
+#define PARENT_BENCH_VHD_BLOCK      0x200000
+#define PARENT_BENCH_VHD_BAT        0x600
+#define PARENT_BENCH_VHDX_BLOCK     0x100000
+#define PARENT_BENCH_VHDX_METADATA  0x40000
+#define PARENT_BENCH_VHDX_ITEMS     0x10000
+#define PARENT_BENCH_VHDX_BAT       0x140000
+#define PARENT_BENCH_FILE_SIZE      (PARENT_BENCH_VHDX_BAT + 0x1000)
+
+typedef struct _PARENT_BENCH_REQUEST {
+    ULONG32 Clone;
+    ULONG32 Block;
+    ULONG64 Start;
+    int Write;
+} PARENT_BENCH_REQUEST;
+
+typedef struct _PARENT_BENCH {
+    BLOCK_CACHE Cache;
+    ULONG32 Clones;
+    int Share;
+    PARENT_OVERLAY *pOverlays;
+    /* Blocks every clone wrote, by clone, 0 while the clone reads the block of the parent */
+    ULONG32 *pVersions;
+    ULONG32 *pBootOrder;
+    ULONG32 *pDone;
+    PARENT_BENCH_REQUEST Queue[PARENT_BENCH_DEPTH];
+    ULONG32 Queued;
+    ULONG64 Clock;
+    ULONG64 Reads;
+    ULONG64 Writes;
+    ULONG64 Sent;
+    ULONG64 Wrong;
+    ULONG64 Random;
+} PARENT_BENCH;
+
+static ULONG64 ParentBenchRandom(PARENT_BENCH *pBench)
+{
+    pBench->Random ^= pBench->Random << 13;
+    pBench->Random ^= pBench->Random >> 7;
+    pBench->Random ^= pBench->Random << 17;
+    return pBench->Random;
+}
+
+static VOID *ParentBenchAllocate(VOID *pContext)
+{
+    (void)pContext;
+    return malloc(sizeof(ULONG64));
+}
+
+static VOID ParentBenchRelease(VOID *pContext, VOID *pData)
+{
+    (void)pContext;
+    free(pData);
+}
+
+/** Data a clone reads from a block, its own once it wrote the block */
+static ULONG64 ParentBenchData(PARENT_BENCH *pBench, ULONG32 Clone, ULONG32 Block)
+{
+    ULONG32 Version = pBench->pVersions[(ULONG64)Clone * PARENT_BENCH_BLOCKS + Block];
+    return Version ? ((ULONG64)(Clone + 1) << 32) | Version : (1ULL << 63) | Block;
+}
+
+/** Key of a block of a clone in the cache, 1 is the key of the parent */
+static ULONG64 ParentBenchDisk(PARENT_BENCH *pBench, ULONG32 Clone, ULONG32 Block)
+{
+    if (pBench->Share && !ParentOverlay_Covers(&pBench->pOverlays[Clone], (ULONG64)Block * 4096, 4096))
+        return 1;
+    return 2 + Clone;
+}
+
+static void ParentBenchComplete(PARENT_BENCH *pBench, ULONG32 Slot)
+{
+    PARENT_BENCH_REQUEST Request = pBench->Queue[Slot];
+    ULONG64 *pData = NULL;
+
+    pBench->Queue[Slot] = pBench->Queue[--pBench->Queued];
+    ++pBench->Clock;
+    if (Request.Write)
+        BlockCache_Invalidate(&pBench->Cache, 2 + Request.Clone, Request.Block, pBench->Clock);
+    else if ((pData = BlockCache_Fill(&pBench->Cache, ParentBenchDisk(pBench, Request.Clone, Request.Block),
+        Request.Block, Request.Start)))
+        // A read sent before a write of the block may return the data of the write, it does here
+        *pData = ParentBenchData(pBench, Request.Clone, Request.Block);
+}
+
+static void ParentBenchRequest(PARENT_BENCH *pBench, ULONG32 Clone, int Write, ULONG32 Block)
+{
+    PARENT_BENCH_REQUEST *pRequest = NULL;
+
+    if (pBench->Queued == PARENT_BENCH_DEPTH)
+        ParentBenchComplete(pBench, (ULONG32)(ParentBenchRandom(pBench) % pBench->Queued));
+    ++pBench->Clock;
+    if (Write)
+    {
+        ++pBench->Writes;
+        // Added before the write is sent, the data is visible to reads sent from now on
+        ParentOverlay_Add(&pBench->pOverlays[Clone], (ULONG64)Block * 4096, 4096);
+        BlockCache_Invalidate(&pBench->Cache, 2 + Clone, Block, pBench->Clock);
+        ++pBench->pVersions[(ULONG64)Clone * PARENT_BENCH_BLOCKS + Block];
+    }
+    else
+    {
+        const ULONG64 *pData = BlockCache_Lookup(&pBench->Cache, ParentBenchDisk(pBench, Clone, Block), Block);
+        ++pBench->Reads;
+        if (pData)
+        {
+            if (*pData != ParentBenchData(pBench, Clone, Block))
+                ++pBench->Wrong;
+            return;
+        }
+        ++pBench->Sent;
+    }
+    pRequest = &pBench->Queue[pBench->Queued++];
+    pRequest->Clone = Clone;
+    pRequest->Block = Block;
+    pRequest->Start = pBench->Clock;
+    pRequest->Write = Write;
+}
+
+static void ParentBenchPutBigEndian(UCHAR *p, ULONG64 Value, ULONG32 Bytes)
+{
+    while (Bytes--)
+    {
+        p[Bytes] = (UCHAR)Value;
+        Value >>= 8;
+    }
+}
+
+/** Differencing VHD with the blocks the clone wrote allocated */
+static void ParentBenchBuildVhd(PARENT_BENCH *pBench, ULONG32 Clone, UCHAR *pFile)
+{
+    const ULONG32 *pVersions = &pBench->pVersions[(ULONG64)Clone * PARENT_BENCH_BLOCKS];
+    ULONG32 Blocks = (ULONG32)((ULONG64)PARENT_BENCH_BLOCKS * 4096 / PARENT_BENCH_VHD_BLOCK), i = 0;
+
+    memset(pFile, 0, PARENT_BENCH_FILE_SIZE);
+    memcpy(pFile, VHD_FOOTER_COOKIE, 8);
+    ParentBenchPutBigEndian(pFile + 16, VHD_FOOTER_SIZE, 8);
+    ParentBenchPutBigEndian(pFile + 60, VHD_DISK_TYPE_DIFFERENCING, 4);
+    memcpy(pFile + VHD_FOOTER_SIZE, VHD_DYNAMIC_COOKIE, 8);
+    ParentBenchPutBigEndian(pFile + VHD_FOOTER_SIZE + 16, PARENT_BENCH_VHD_BAT, 8);
+    ParentBenchPutBigEndian(pFile + VHD_FOOTER_SIZE + 28, Blocks, 4);
+    ParentBenchPutBigEndian(pFile + VHD_FOOTER_SIZE + 32, PARENT_BENCH_VHD_BLOCK, 4);
+    memset(pFile + PARENT_BENCH_VHD_BAT, 0xFF, (size_t)Blocks * 4);
+    for (i = 0; i < PARENT_BENCH_BLOCKS; ++i)
+    {
+        ULONG32 Block = (ULONG32)((ULONG64)i * 4096 / PARENT_BENCH_VHD_BLOCK);
+        if (pVersions[i])
+            ParentBenchPutBigEndian(pFile + PARENT_BENCH_VHD_BAT + Block * 4, 0x1000 + Block * (PARENT_BENCH_VHD_BLOCK / 512), 4);
+    }
+}
+
+/** Differencing VHDX with the blocks the clone wrote partially present */
+static void ParentBenchBuildVhdx(PARENT_BENCH *pBench, ULONG32 Clone, UCHAR *pFile)
+{
+    const ULONG32 *pVersions = &pBench->pVersions[(ULONG64)Clone * PARENT_BENCH_BLOCKS];
+    ULONG32 Signature = VHDX_REGION_SIGNATURE, Count = 2, Value = 0, i = 0;
+    ULONG32 ChunkRatio = (ULONG32)(VHDX_CHUNK_SECTORS * 512 / PARENT_BENCH_VHDX_BLOCK);
+    ULONG64 DiskSize = (ULONG64)PARENT_BENCH_BLOCKS * 4096;
+    USHORT Items = 3;
+    VHDX_REGION_ENTRY Region;
+    VHDX_METADATA_ENTRY Item;
+
+    memset(pFile, 0, PARENT_BENCH_FILE_SIZE);
+    memcpy(pFile + VHDX_REGION_TABLE_OFFSET, &Signature, sizeof(Signature));
+    memcpy(pFile + VHDX_REGION_TABLE_OFFSET + 8, &Count, sizeof(Count));
+    memset(&Region, 0, sizeof(Region));
+    Region.Guid = VhdxMetadataRegion;
+    Region.FileOffset = PARENT_BENCH_VHDX_METADATA;
+    Region.Length = PARENT_BENCH_VHDX_BAT - PARENT_BENCH_VHDX_METADATA;
+    Region.Required = 1;
+    memcpy(pFile + VHDX_REGION_TABLE_OFFSET + 16, &Region, sizeof(Region));
+    Region.Guid = VhdxBatRegion;
+    Region.FileOffset = PARENT_BENCH_VHDX_BAT;
+    Region.Length = 0x1000;
+    memcpy(pFile + VHDX_REGION_TABLE_OFFSET + 16 + sizeof(Region), &Region, sizeof(Region));
+
+    // The items follow the table, file parameters, virtual disk size and logical sector size
+    memcpy(pFile + PARENT_BENCH_VHDX_METADATA, VHDX_METADATA_SIGNATURE, 8);
+    memcpy(pFile + PARENT_BENCH_VHDX_METADATA + 10, &Items, sizeof(Items));
+    memset(&Item, 0, sizeof(Item));
+    Item.ItemId = VhdxFileParameters;
+    Item.Offset = PARENT_BENCH_VHDX_ITEMS;
+    Item.Length = 8;
+    memcpy(pFile + PARENT_BENCH_VHDX_METADATA + 32, &Item, sizeof(Item));
+    Item.ItemId = VhdxVirtualDiskSize;
+    Item.Offset = PARENT_BENCH_VHDX_ITEMS + 8;
+    memcpy(pFile + PARENT_BENCH_VHDX_METADATA + 64, &Item, sizeof(Item));
+    Item.ItemId = VhdxLogicalSectorSize;
+    Item.Offset = PARENT_BENCH_VHDX_ITEMS + 16;
+    Item.Length = 4;
+    memcpy(pFile + PARENT_BENCH_VHDX_METADATA + 96, &Item, sizeof(Item));
+    Value = PARENT_BENCH_VHDX_BLOCK;
+    memcpy(pFile + PARENT_BENCH_VHDX_METADATA + PARENT_BENCH_VHDX_ITEMS, &Value, sizeof(Value));
+    // Has a parent
+    Value = 2;
+    memcpy(pFile + PARENT_BENCH_VHDX_METADATA + PARENT_BENCH_VHDX_ITEMS + 4, &Value, sizeof(Value));
+    memcpy(pFile + PARENT_BENCH_VHDX_METADATA + PARENT_BENCH_VHDX_ITEMS + 8, &DiskSize, sizeof(DiskSize));
+    Value = 512;
+    memcpy(pFile + PARENT_BENCH_VHDX_METADATA + PARENT_BENCH_VHDX_ITEMS + 16, &Value, sizeof(Value));
+
+    for (i = 0; i < PARENT_BENCH_BLOCKS; ++i)
+    {
+        ULONG64 Block = (ULONG64)i * 4096 / PARENT_BENCH_VHDX_BLOCK;
+        // Partially present, a sector bitmap entry follows every chunk of payload entries
+        ULONG64 Entry = (4 + Block) << 20 | 7;
+        if (pVersions[i])
+            memcpy(pFile + PARENT_BENCH_VHDX_BAT + (Block + Block / ChunkRatio) * 8, &Entry, sizeof(Entry));
+    }
+}
+
+/** Fills the overlay of a clone from its file like ParentOverlay_Load, FALSE if the file can not be walked */
+static int ParentBenchLoad(PARENT_OVERLAY *pOverlay, const UCHAR *pFile, int Vhdx, ULONG64 *pBlocks)
+{
+    VHD_LAYOUT Layout;
+    ULONG64 HeaderOffset = 0, Index = 0, Block = 0;
+
+    if (Vhdx)
+    {
+        if (!VhdLayout_VhdxRegions(pFile + VHDX_REGION_TABLE_OFFSET, VHDX_REGION_TABLE_SIZE, &Layout) ||
+            Layout.MetadataOffset + VHDX_METADATA_READ_SIZE > PARENT_BENCH_FILE_SIZE ||
+            !VhdLayout_VhdxMetadata(pFile + Layout.MetadataOffset, VHDX_METADATA_READ_SIZE, &Layout))
+            return 0;
+    }
+    else if (!VhdLayout_VhdFooter(pFile, &HeaderOffset) || HeaderOffset + VHD_DYNAMIC_HEADER_SIZE > PARENT_BENCH_FILE_SIZE ||
+        !VhdLayout_VhdHeader(pFile + HeaderOffset, &Layout))
+        return 0;
+    if (Layout.BatOffset + Layout.BatEntries * VhdLayout_EntrySize(&Layout) > PARENT_BENCH_FILE_SIZE)
+        return 0;
+    for (Index = 0; Index < Layout.BatEntries; ++Index)
+    {
+        if (VhdLayout_OwnBlock(&Layout, Index, pFile + Layout.BatOffset + Index * VhdLayout_EntrySize(&Layout), &Block))
+        {
+            ParentOverlay_Add(pOverlay, Block * Layout.BlockSize, Layout.BlockSize);
+            ++*pBlocks;
+        }
+    }
+    return 1;
+}
+
+/** Every clone boots once, reading mostly the boot order of the parent */
+static void ParentBenchBoot(PARENT_BENCH *pBench, ULONG32 *pActive)
+{
+    ULONG32 i = 0, Active = pBench->Clones;
+
+    for (i = 0; i < pBench->Clones; ++i)
+    {
+        pBench->pDone[i] = 0;
+        pActive[i] = i;
+    }
+    while (Active)
+    {
+        ULONG32 Index = (ULONG32)(ParentBenchRandom(pBench) % Active), Clone = pActive[Index];
+        ULONG64 Random = ParentBenchRandom(pBench);
+        ULONG32 Step = pBench->pDone[Clone]++;
+
+        if (Random % 100 < PARENT_BENCH_WRITE_PERCENT)
+            // Registry, logs and the page file of the clone
+            ParentBenchRequest(pBench, Clone, 1,
+                PARENT_BENCH_WRITE_AREA + (ULONG32)(Random >> 8) % (PARENT_BENCH_BLOCKS - PARENT_BENCH_WRITE_AREA));
+        else if (Random % 100 < PARENT_BENCH_WRITE_PERCENT + PARENT_BENCH_OWN_PERCENT)
+            // Reads off the common order, some of them of what the clone wrote
+            ParentBenchRequest(pBench, Clone, 0, (ULONG32)(Random >> 8) % PARENT_BENCH_BLOCKS);
+        else
+            ParentBenchRequest(pBench, Clone, 0, pBench->pBootOrder[Step % PARENT_BENCH_READS]);
+        if (pBench->pDone[Clone] == PARENT_BENCH_READS)
+            pActive[Index] = pActive[--Active];
+    }
+    while (pBench->Queued)
+        ParentBenchComplete(pBench, 0);
+}
+
+/** Remounts every clone, its overlay only knows the blocks its file holds */
+static int ParentBenchRemount(PARENT_BENCH *pBench, ULONG64 *pBlocks)
+{
+    UCHAR *pFile = malloc(PARENT_BENCH_FILE_SIZE);
+    ULONG32 i = 0;
+
+    if (!pFile)
+        return 0;
+    for (i = 0; i < pBench->Clones; ++i)
+    {
+        // Half of the clones are VHD files
+        if (i & 1)
+            ParentBenchBuildVhd(pBench, i, pFile);
+        else
+            ParentBenchBuildVhdx(pBench, i, pFile);
+        ParentOverlay_Initialize(&pBench->pOverlays[i]);
+        if (!ParentBenchLoad(&pBench->pOverlays[i], pFile, !(i & 1), pBlocks))
+        {
+            free(pFile);
+            return 0;
+        }
+    }
+    free(pFile);
+    return 1;
+}
+
+static int ParentBenchRun(ULONG32 Clones, ULONG32 Capacity, int Share, int Remount, ULONG64 *pSent, double *pSeconds)
+{
+    ULONG32 Buckets = 1, i = 0;
+    ULONG64 Loaded = 0;
+    PARENT_BENCH *pBench = calloc(1, sizeof(PARENT_BENCH));
+    BLOCK_CACHE_NODE *pNodes = NULL;
+    ULONG32 *pCacheBuckets = NULL, *pActive = NULL;
+    ULONG64 *pStamps = NULL;
+    double Start = 0;
+    int Result = 0;
+
+    while (Buckets < BlockCache_NodeCount(Capacity))
+        Buckets <<= 1;
+    pNodes = calloc(BlockCache_NodeCount(Capacity), sizeof(BLOCK_CACHE_NODE));
+    pCacheBuckets = calloc(Buckets, sizeof(ULONG32));
+    pStamps = calloc(4096, sizeof(ULONG64));
+    pActive = calloc(Clones, sizeof(ULONG32));
+    if (pBench)
+    {
+        pBench->Clones = Clones;
+        pBench->Share = Share;
+        pBench->Random = 0x9E3779B97F4A7C15ULL;
+        pBench->pOverlays = calloc(Clones, sizeof(PARENT_OVERLAY));
+        pBench->pVersions = calloc((size_t)Clones * PARENT_BENCH_BLOCKS, sizeof(ULONG32));
+        pBench->pBootOrder = calloc(PARENT_BENCH_READS, sizeof(ULONG32));
+        pBench->pDone = calloc(Clones, sizeof(ULONG32));
+    }
+    if (!pBench || !pNodes || !pCacheBuckets || !pStamps || !pActive || !pBench->pOverlays || !pBench->pVersions ||
+        !pBench->pBootOrder || !pBench->pDone)
+    {
+        fprintf(stderr, "Can not set up the benchmark\n");
+        return 1;
+    }
+    BlockCache_Initialize(&pBench->Cache, Capacity, pNodes, pCacheBuckets, Buckets, pStamps, 4096, ParentBenchAllocate,
+        ParentBenchRelease, pBench);
+    // Every boot reads the same files of the parent in about the same order, hot ones more than once
+    for (i = 0; i < PARENT_BENCH_READS; ++i)
+    {
+        double Uniform = (double)(ParentBenchRandom(pBench) >> 11) / (double)(1ULL << 53);
+        pBench->pBootOrder[i] = (ULONG32)(Uniform * Uniform * PARENT_BENCH_WRITE_AREA);
+    }
+    for (i = 0; i < Clones; ++i)
+        ParentOverlay_Initialize(&pBench->pOverlays[i]);
+
+    Start = Now();
+    ParentBenchBoot(pBench, pActive);
+    // The blocks written by the first boot are read back from the shared key unless the files tell them
+    if (Remount && !ParentBenchRemount(pBench, &Loaded))
+    {
+        fprintf(stderr, "Can not read the allocation tables of the clones\n");
+        Result = 1;
+    }
+    else if (Remount)
+        ParentBenchBoot(pBench, pActive);
+    *pSeconds = Now() - Start;
+    *pSent = pBench->Sent;
+
+    printf("%-8s %9llu reads %8llu writes, %9llu reads sent to vhdmp (%5.1f%%), %7.0f MiB decrypted\n",
+        Remount ? "remount" : Share ? "shared" : "private", (unsigned long long)pBench->Reads, (unsigned long long)pBench->Writes,
+        (unsigned long long)pBench->Sent, pBench->Reads ? 100.0 * pBench->Sent / pBench->Reads : 0,
+        pBench->Sent * 4096.0 / 1048576);
+    if (Remount)
+        printf("         %9llu blocks of the clones found in their allocation tables\n", (unsigned long long)Loaded);
+    if (pBench->Wrong)
+    {
+        fprintf(stderr, "%llu hits returned data the clone does not read\n", (unsigned long long)pBench->Wrong);
+        Result = 1;
+    }
+
+    BlockCache_SetLimit(&pBench->Cache, 0);
+    free(pBench->pOverlays);
+    free(pBench->pVersions);
+    free(pBench->pBootOrder);
+    free(pBench->pDone);
+    free(pNodes);
+    free(pCacheBuckets);
+    free(pStamps);
+    free(pActive);
+    free(pBench);
+    return Result;
+}
+
+static int ParentCacheBench(LONG Clones, LONG CacheMegabytes)
+{
+    ULONG64 Private = 0, Shared = 0, Remounted = 0;
+    double PrivateSeconds = 0, SharedSeconds = 0, RemountSeconds = 0;
+    int Result = 0;
+
+    if (Clones <= 0 || CacheMegabytes <= 0)
+    {
+        fprintf(stderr, "Can not set up the benchmark\n");
+        return 1;
+    }
+    printf("%d clones booting at once, %ld MiB of cache, %d requests in flight\n", (int)Clones, (long)CacheMegabytes,
+        PARENT_BENCH_DEPTH);
+    Result |= ParentBenchRun((ULONG32)Clones, (ULONG32)(CacheMegabytes * 256), 0, 0, &Private, &PrivateSeconds);
+    Result |= ParentBenchRun((ULONG32)Clones, (ULONG32)(CacheMegabytes * 256), 1, 0, &Shared, &SharedSeconds);
+    if (Shared)
+        printf("sharing the parent sends and decrypts %.1fx fewer reads, %.0f ns per request shared, %.0f private\n",
+            (double)Private / Shared, 1e9 * SharedSeconds / ((double)Clones * PARENT_BENCH_READS),
+            1e9 * PrivateSeconds / ((double)Clones * PARENT_BENCH_READS));
+    // Booted twice, the second time with the overlays read from the files of the clones
+    Result |= ParentBenchRun((ULONG32)Clones, (ULONG32)(CacheMegabytes * 256), 1, 1, &Remounted, &RemountSeconds);
+    return Result;
+}
+
+/* Disk the guest reads, in 4 KiB blocks, and the reads of the copy it makes */
+#define AHEAD_BENCH_DISK            0x40000000ULL
+#define AHEAD_BENCH_BLOCKS          (ULONG32)(AHEAD_BENCH_DISK / 4096)
+#define AHEAD_BENCH_READ            0x10000
+/* Modeled cost of a transfer from vhdmp and of its decryption, nanoseconds per KiB */
+#define AHEAD_BENCH_TRANSFER_NS     250
+#define AHEAD_BENCH_DECRYPT_NS      500
+/* Stray reads and writes of the mixed run, in percent of the reads of the copy */
+#define AHEAD_BENCH_STRAY_PERCENT   12
+#define AHEAD_BENCH_WRITE_PERCENT   6
+
+typedef struct _AHEAD_BENCH {
+    READ_AHEAD Ahead;
+    UCHAR *pBuffer;
+    UCHAR *pGuest;
+    /* Stands in for the inner MDL of a read sent with a read-ahead */
+    UCHAR *pTransfer;
+    /* Writes of every block so far, the first bytes of a block read hold its number and version */
+    ULONG32 *pVersions;
+    ULONG64 Clock;
+    ULONG64 BaseNs;
+    double ModeledNs;
+    ULONG64 Reads;
+    ULONG64 Sent;
+    ULONG64 SentBytes;
+    ULONG64 Wrong;
+    ULONG64 Random;
+} AHEAD_BENCH;
+
+static ULONG64 AheadBenchRandom(AHEAD_BENCH *pBench)
+{
+    pBench->Random ^= pBench->Random << 13;
+    pBench->Random ^= pBench->Random >> 7;
+    pBench->Random ^= pBench->Random << 17;
+    return pBench->Random;
+}
+
+static ULONG64 AheadBenchTag(AHEAD_BENCH *pBench, ULONG32 Block)
+{
+    return (ULONG64)Block << 32 | pBench->pVersions[Block];
+}
+
+/** A write of one block lands, from another thread of the guest */
+static void AheadBenchWrite(AHEAD_BENCH *pBench, ULONG32 Block)
+{
+    ++pBench->pVersions[Block];
+    ReadAhead_Invalidate(&pBench->Ahead, (ULONG64)Block * 4096, 4096, ++pBench->Clock);
+}
+
+/**
+ * Reads like Ext_StartScsiRequest and Ext_CompleteScsiRequest, WriteBlock lands while the read is in flight, or while
+ * its read-ahead is copied into the buffer for an odd block
+ */
+static void AheadBenchRead(AHEAD_BENCH *pBench, ULONG64 Offset, ULONG32 Length, LONG64 WriteBlock)
+{
+    ULONG32 Ahead = 0, Skip = 0, i = 0;
+    ULONG64 Start = 0;
+    double CopyStart = 0;
+
+    ++pBench->Reads;
+    if (pBench->Ahead.MaxWindow)
+        Ahead = ReadAhead_Start(&pBench->Ahead, Offset, Length, AHEAD_BENCH_DISK);
+    if (READ_AHEAD_HIT == Ahead)
+    {
+        CopyStart = Now();
+        memcpy(pBench->pGuest, pBench->pBuffer + (Offset - pBench->Ahead.BaseOffset), Length);
+        pBench->ModeledNs += 1e9 * (Now() - CopyStart);
+        for (i = 0; i < Length / 4096; ++i)
+            if (*(ULONG64 *)(pBench->pGuest + i * 4096) != AheadBenchTag(pBench, (ULONG32)(Offset / 4096) + i))
+                ++pBench->Wrong;
+        ReadAhead_EndRead(&pBench->Ahead);
+        return;
+    }
+    if (Ahead)
+        ReadAhead_Issue(&pBench->Ahead, Offset + Length, Ahead);
+    Start = ++pBench->Clock;
+    // vhdmp reads the blocks before the write lands, the read-ahead must not be kept
+    for (i = 0; i < (Length + Ahead) / 4096; ++i)
+        *(ULONG64 *)(pBench->pTransfer + i * 4096) = AheadBenchTag(pBench, (ULONG32)(Offset / 4096) + i);
+    if (WriteBlock >= 0 && !(WriteBlock & 1))
+        AheadBenchWrite(pBench, (ULONG32)WriteBlock);
+    ++pBench->Sent;
+    pBench->SentBytes += Length + Ahead;
+    pBench->ModeledNs += pBench->BaseNs + (Length + Ahead) / 1024.0 * (AHEAD_BENCH_TRANSFER_NS + AHEAD_BENCH_DECRYPT_NS);
+    memcpy(pBench->pGuest, pBench->pTransfer, Length);
+    if (Ahead && ReadAhead_Complete(&pBench->Ahead, Ahead, Start, &Skip))
+    {
+        memcpy(pBench->pBuffer + Skip, pBench->pTransfer + Length + Skip, Ahead - Skip);
+        if (WriteBlock >= 0 && (WriteBlock & 1))
+            AheadBenchWrite(pBench, (ULONG32)WriteBlock);
+        ReadAhead_Publish(&pBench->Ahead, Ahead, Start);
+    }
+    else if (WriteBlock >= 0 && (WriteBlock & 1))
+        AheadBenchWrite(pBench, (ULONG32)WriteBlock);
+}
+
+/**
+ * One guest at queue depth 1: Pattern 0 copies the disk with 64 KiB reads, 1 reads 4 KiB blocks at random, 2 copies
+ * with stray reads between the reads of the copy and writes landing ahead of it
+ */
+static int AheadBenchRun(const char *pszName, int Pattern, ULONG32 Window, LONG BaseUs, double *pMiBps)
+{
+    AHEAD_BENCH *pBench = calloc(1, sizeof(AHEAD_BENCH));
+    ULONG64 Offset = 0, Bytes = 0;
+    double Start = 0, Seconds = 0;
+    int Result = 0;
+
+    if (pBench)
+    {
+        pBench->pBuffer = malloc(Window ? Window : 1);
+        pBench->pGuest = malloc(AHEAD_BENCH_READ);
+        pBench->pTransfer = malloc(AHEAD_BENCH_READ + (size_t)Window);
+        pBench->pVersions = calloc(AHEAD_BENCH_BLOCKS, sizeof(ULONG32));
+    }
+    if (!pBench || !pBench->pBuffer || !pBench->pGuest || !pBench->pTransfer || !pBench->pVersions)
+    {
+        fprintf(stderr, "Can not set up the benchmark\n");
+        return 1;
+    }
+    ReadAhead_Initialize(&pBench->Ahead, Window);
+    pBench->BaseNs = (ULONG64)BaseUs * 1000;
+    pBench->Random = 0x9E3779B97F4A7C15ULL;
+
+    Start = Now();
+    if (1 == Pattern)
+    {
+        for (; Bytes < AHEAD_BENCH_DISK / 4; Bytes += 4096)
+            AheadBenchRead(pBench, AheadBenchRandom(pBench) % AHEAD_BENCH_BLOCKS * 4096, 4096, -1);
+    }
+    else
+    {
+        while (Offset < AHEAD_BENCH_DISK)
+        {
+            ULONG64 Random = AheadBenchRandom(pBench);
+            LONG64 WriteBlock = -1;
+
+            if (2 == Pattern && Random % 100 < AHEAD_BENCH_STRAY_PERCENT)
+            {
+                // Metadata and the page file, away from the copy
+                AheadBenchRead(pBench, (Random >> 8) % AHEAD_BENCH_BLOCKS * 4096, 4096, -1);
+                Bytes += 4096;
+                continue;
+            }
+            // Writes to the blocks the copy reads next, in flight with the read or between two reads
+            if (2 == Pattern && (Random >> 7) % 100 < AHEAD_BENCH_WRITE_PERCENT)
+                WriteBlock = (LONG64)((Offset + AHEAD_BENCH_READ) / 4096 + (Random >> 16) % 256) % AHEAD_BENCH_BLOCKS;
+            if (WriteBlock >= 0 && (Random & 1))
+            {
+                AheadBenchWrite(pBench, (ULONG32)WriteBlock);
+                WriteBlock = -1;
+            }
+            AheadBenchRead(pBench, Offset, AHEAD_BENCH_READ, WriteBlock);
+            Offset += AHEAD_BENCH_READ;
+            Bytes += AHEAD_BENCH_READ;
+        }
+    }
+    Seconds = Now() - Start;
+    *pMiBps = Bytes / 1048576.0 / (pBench->ModeledNs / 1e9);
+
+    printf("%-24s %8llu reads %8llu sent to vhdmp %6llu MiB sent %8.0f MiB/s %5.0f ns CPU per read, %llu KiB never read,"
+        " %llu streams cancelled\n", pszName, (unsigned long long)pBench->Reads, (unsigned long long)pBench->Sent,
+        (unsigned long long)(pBench->SentBytes / 1048576), *pMiBps, 1e9 * Seconds / pBench->Reads,
+        (unsigned long long)(pBench->Ahead.WastedBytes / 1024), (unsigned long long)pBench->Ahead.Cancels);
+    if (pBench->Wrong)
+    {
+        fprintf(stderr, "%llu blocks copied from the read-ahead were stale\n", (unsigned long long)pBench->Wrong);
+        Result = 1;
+    }
+
+    free(pBench->pBuffer);
+    free(pBench->pGuest);
+    free(pBench->pTransfer);
+    free(pBench->pVersions);
+    free(pBench);
+    return Result;
+}
+
+static int ReadAheadBench(LONG WindowKilobytes, LONG BaseUs)
+{
+    double Plain = 0, Ahead = 0, Unused = 0;
+    int Result = 0;
+
+    if (WindowKilobytes < 4 || WindowKilobytes > 4096 || BaseUs < 0)
+    {
+        fprintf(stderr, "Can not set up the benchmark\n");
+        return 1;
+    }
+    printf("%ld KiB read-ahead window, %ld us per request to vhdmp, %d ns per KiB transferred, %d ns per KiB decrypted\n",
+        (long)WindowKilobytes, (long)BaseUs, AHEAD_BENCH_TRANSFER_NS, AHEAD_BENCH_DECRYPT_NS);
+    Result |= AheadBenchRun("copy", 0, 0, BaseUs, &Plain);
+    Result |= AheadBenchRun("copy, read-ahead", 0, (ULONG32)(WindowKilobytes * 1024) & ~4095, BaseUs, &Ahead);
+    if (Plain)
+        printf("read-ahead copies %.2fx faster\n", Ahead / Plain);
+    Result |= AheadBenchRun("random", 1, 0, BaseUs, &Plain);
+    Result |= AheadBenchRun("random, read-ahead", 1, (ULONG32)(WindowKilobytes * 1024) & ~4095, BaseUs, &Ahead);
+    Result |= AheadBenchRun("mixed", 2, 0, BaseUs, &Plain);
+    Result |= AheadBenchRun("mixed, read-ahead", 2, (ULONG32)(WindowKilobytes * 1024) & ~4095, BaseUs, &Unused);
+    if (Plain)
+        printf("read-ahead runs the mixed load %.2fx faster\n", Unused / Plain);
+    return Result;
+}
+
+/* ring-bench: the messages to the key service through the locked queue of pended reads and through the rings */
+#define RING_BENCH_QUEUE        0
+#define RING_BENCH_RING         1
+
+/** Auto-reset event like the synchronization events the driver and the service share */
+typedef struct _BENCH_EVENT {
+    pthread_mutex_t Lock;
+    pthread_cond_t Cond;
+    int Signaled;
+    ULONG64 Sets;
+} BENCH_EVENT;
+
+static void BenchEventInitialize(BENCH_EVENT *pEvent)
+{
+    pthread_mutex_init(&pEvent->Lock, NULL);
+    pthread_cond_init(&pEvent->Cond, NULL);
+    pEvent->Signaled = 0;
+    pEvent->Sets = 0;
+}
+
+static void BenchEventDestroy(BENCH_EVENT *pEvent)
+{
+    pthread_mutex_destroy(&pEvent->Lock);
+    pthread_cond_destroy(&pEvent->Cond);
+}
+
+static void BenchEventSet(BENCH_EVENT *pEvent)
+{
+    pthread_mutex_lock(&pEvent->Lock);
+    pEvent->Signaled = 1;
+    ++pEvent->Sets;
+    pthread_cond_signal(&pEvent->Cond);
+    pthread_mutex_unlock(&pEvent->Lock);
+}
+
+static void BenchEventWait(BENCH_EVENT *pEvent)
+{
+    pthread_mutex_lock(&pEvent->Lock);
+    while (!pEvent->Signaled)
+        pthread_cond_wait(&pEvent->Cond, &pEvent->Lock);
+    pEvent->Signaled = 0;
+    pthread_mutex_unlock(&pEvent->Lock);
+}
+
+/** PARSER_MESSAGE_ENTRY, allocated and filled for every message the old path queues */
+typedef struct _QUEUE_BENCH_ENTRY {
+    struct _QUEUE_BENCH_ENTRY *pNext;
+    PARSER_MESSAGE Message;
+} QUEUE_BENCH_ENTRY;
+
+typedef struct _RING_BENCH {
+    int Mode;
+    int RoundTrip;
+    LONG Messages;
+    /* DptLock, and the lock of the subscription context the producers of a ring share */
+    pthread_mutex_t GlobalLock;
+    pthread_mutex_t ContextLock;
+    pthread_cond_t Queued;
+    pthread_cond_t Answered;
+    QUEUE_BENCH_ENTRY *pHead;
+    QUEUE_BENCH_ENTRY **ppTail;
+    PARSER_RESPONSE_MESSAGE Response;
+    int HasResponse;
+    PARSER_RING Requests;
+    PARSER_RING Responses;
+    BENCH_EVENT RequestEvent;
+    BENCH_EVENT ResponseEvent;
+    /* Times the service or the requester blocked, and the producer found the request ring full */
+    ULONG64 Sleeps;
+    ULONG64 Full;
+    ULONG64 Wrong;
+} RING_BENCH;
+
+static void RingBenchMessage(PARSER_MESSAGE *pMessage, LONG RequestId)
+{
+    pMessage->Type = RequestId < 0 ? MessageTypeNone : MessageTypeQueryCipherConfig;
+    pMessage->RequestId = RequestId;
+    memset(&pMessage->Message.QueryCipherConfig, 0, sizeof(pMessage->Message.QueryCipherConfig));
+    pMessage->Message.QueryCipherConfig.DiskId.Data1 = (ULONG32)RequestId;
+}
+
+/** DPT_QueueMessage of the old path, or DPT_PostRingMessage */
+static void RingBenchPost(RING_BENCH *pBench, LONG RequestId)
+{
+    PARSER_MESSAGE Message;
+
+    RingBenchMessage(&Message, RequestId);
+    if (RING_BENCH_QUEUE == pBench->Mode)
+    {
+        QUEUE_BENCH_ENTRY *pEntry = malloc(sizeof(QUEUE_BENCH_ENTRY));
+        if (!pEntry)
+            abort();
+        pEntry->pNext = NULL;
+        pthread_mutex_lock(&pBench->GlobalLock);
+        pthread_mutex_lock(&pBench->ContextLock);
+        memcpy(&pEntry->Message, &Message, sizeof(PARSER_MESSAGE));
+        *pBench->ppTail = pEntry;
+        pBench->ppTail = &pEntry->pNext;
+        pthread_cond_signal(&pBench->Queued);
+        pthread_mutex_unlock(&pBench->ContextLock);
+        pthread_mutex_unlock(&pBench->GlobalLock);
+        return;
+    }
+    for (;;)
+    {
+        BOOLEAN Written = FALSE, Wake = FALSE;
+        pthread_mutex_lock(&pBench->ContextLock);
+        Written = Ring_Write(&pBench->Requests, &Message, FIELD_OFFSET(PARSER_MESSAGE, Message) +
+            sizeof(Message.Message.QueryCipherConfig));
+        Wake = Written && Ring_ConsumerNeedsWake(&pBench->Requests);
+        pthread_mutex_unlock(&pBench->ContextLock);
+        if (Wake)
+            BenchEventSet(&pBench->RequestEvent);
+        if (Written)
+            return;
+        // The driver drops the message, the bench waits for the service to make room
+        ++pBench->Full;
+        sched_yield();
+    }
+}
+
+/** The service waits for the next message, one read IRP of the old path per message */
+static void RingBenchReceive(RING_BENCH *pBench, PARSER_MESSAGE *pMessage)
+{
+    ULONG32 Length = 0;
+
+    if (RING_BENCH_QUEUE == pBench->Mode)
+    {
+        QUEUE_BENCH_ENTRY *pEntry = NULL;
+        pthread_mutex_lock(&pBench->ContextLock);
+        while (!pBench->pHead)
+        {
+            ++pBench->Sleeps;
+            pthread_cond_wait(&pBench->Queued, &pBench->ContextLock);
+        }
+        pEntry = pBench->pHead;
+        if (!(pBench->pHead = pEntry->pNext))
+            pBench->ppTail = &pBench->pHead;
+        pthread_mutex_unlock(&pBench->ContextLock);
+        memcpy(pMessage, &pEntry->Message, sizeof(PARSER_MESSAGE));
+        free(pEntry);
+        return;
+    }
+    for (;;)
+    {
+        if (Ring_Read(&pBench->Requests, pMessage, sizeof(PARSER_MESSAGE), &Length))
+            return;
+        // Checked again after the announcement, a message written in between is not slept through
+        Ring_PrepareWait(&pBench->Requests);
+        if (Ring_IsEmpty(&pBench->Requests))
+        {
+            ++pBench->Sleeps;
+            BenchEventWait(&pBench->RequestEvent);
+        }
+    }
+}
+
+/** IOCTL_VIRTUAL_DISK_FINISH_REQUEST of the old path, or a response written to the response ring */
+static void RingBenchAnswer(RING_BENCH *pBench, LONG RequestId)
+{
+    PARSER_RESPONSE_MESSAGE Response;
+
+    memset(&Response, 0, sizeof(Response));
+    Response.RequestId = RequestId;
+    Response.Type = MessageTypeResponseCipherConfig;
+    if (RING_BENCH_QUEUE == pBench->Mode)
+    {
+        pthread_mutex_lock(&pBench->GlobalLock);
+        pBench->Response = Response;
+        pBench->HasResponse = 1;
+        pthread_cond_signal(&pBench->Answered);
+        pthread_mutex_unlock(&pBench->GlobalLock);
+        return;
+    }
+    while (!Ring_Write(&pBench->Responses, &Response, sizeof(Response)))
+        sched_yield();
+    if (Ring_ConsumerNeedsWake(&pBench->Responses))
+        BenchEventSet(&pBench->ResponseEvent);
+}
+
+/** The requesting thread of the driver waits for the response to its request */
+static void RingBenchAwait(RING_BENCH *pBench, LONG RequestId)
+{
+    PARSER_RESPONSE_MESSAGE Response;
+    ULONG32 Length = 0;
+
+    if (RING_BENCH_QUEUE == pBench->Mode)
+    {
+        pthread_mutex_lock(&pBench->GlobalLock);
+        while (!pBench->HasResponse)
+        {
+            ++pBench->Sleeps;
+            pthread_cond_wait(&pBench->Answered, &pBench->GlobalLock);
+        }
+        pBench->HasResponse = 0;
+        Response = pBench->Response;
+        pthread_mutex_unlock(&pBench->GlobalLock);
+    }
+    else
+    {
+        for (;;)
+        {
+            if (Ring_Read(&pBench->Responses, &Response, sizeof(Response), &Length))
+                break;
+            Ring_PrepareWait(&pBench->Responses);
+            if (Ring_IsEmpty(&pBench->Responses))
+            {
+                ++pBench->Sleeps;
+                BenchEventWait(&pBench->ResponseEvent);
+            }
+        }
+    }
+    if (Response.RequestId != RequestId)
+        ++pBench->Wrong;
+}
+
+static void *RingBenchService(void *Context)
+{
+    RING_BENCH *pBench = Context;
+    PARSER_MESSAGE Message;
+    LONG Expected = 0;
+
+    for (;;)
+    {
+        RingBenchReceive(pBench, &Message);
+        if (MessageTypeNone == Message.Type)
+            break;
+        // One producer, every message arrives once and in order
+        if (Message.RequestId != Expected++ || Message.Message.QueryCipherConfig.DiskId.Data1 != (ULONG32)Message.RequestId)
+            ++pBench->Wrong;
+        if (pBench->RoundTrip)
+            RingBenchAnswer(pBench, Message.RequestId);
+    }
+    return NULL;
+}
+
+static int CompareDouble(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static int RingBenchRun(int Mode, int RoundTrip, LONG Messages, ULONG32 RingSize, double *pRate)
+{
+    RING_BENCH Bench;
+    PARSER_RING_HEADER *pRequestHeader = NULL, *pResponseHeader = NULL;
+    double *pLatencies = NULL, Start = 0, Seconds = 0;
+    pthread_t Service;
+    LONG i = 0;
+    int Result = 0;
+
+    memset(&Bench, 0, sizeof(Bench));
+    Bench.Mode = Mode;
+    Bench.RoundTrip = RoundTrip;
+    Bench.Messages = Messages;
+    Bench.ppTail = &Bench.pHead;
+    pthread_mutex_init(&Bench.GlobalLock, NULL);
+    pthread_mutex_init(&Bench.ContextLock, NULL);
+    pthread_cond_init(&Bench.Queued, NULL);
+    pthread_cond_init(&Bench.Answered, NULL);
+    BenchEventInitialize(&Bench.RequestEvent);
+    BenchEventInitialize(&Bench.ResponseEvent);
+    pRequestHeader = aligned_alloc(64, sizeof(PARSER_RING_HEADER) + RingSize);
+    pResponseHeader = aligned_alloc(64, sizeof(PARSER_RING_HEADER) + RingSize);
+    if (RoundTrip)
+        pLatencies = malloc(Messages * sizeof(double));
+    if (!pRequestHeader || !pResponseHeader || (RoundTrip && !pLatencies))
+    {
+        fprintf(stderr, "Can not set up the benchmark\n");
+        return 1;
+    }
+    Ring_Format(&Bench.Requests, pRequestHeader, RingSize);
+    Ring_Format(&Bench.Responses, pResponseHeader, RingSize);
+    pthread_create(&Service, NULL, RingBenchService, &Bench);
+
+    Start = Now();
+    for (i = 0; i < Messages; ++i)
+    {
+        double Sent = RoundTrip ? Now() : 0;
+        RingBenchPost(&Bench, i);
+        if (!RoundTrip)
+            continue;
+        RingBenchAwait(&Bench, i);
+        pLatencies[i] = Now() - Sent;
+    }
+    RingBenchPost(&Bench, -1);
+    pthread_join(Service, NULL);
+    Seconds = Now() - Start;
+    *pRate = Messages / Seconds;
+
+    printf("%-5s %-11s %9.0f messages/s, %5.3f sleeps per message", Mode == RING_BENCH_RING ? "ring" : "queue",
+        RoundTrip ? "round trip" : "one way", *pRate, (double)Bench.Sleeps / (Messages + 1));
+    if (Mode == RING_BENCH_RING)
+        printf(", %5.3f events set", (double)(Bench.RequestEvent.Sets + Bench.ResponseEvent.Sets) / (Messages + 1));
+    if (RoundTrip)
+    {
+        qsort(pLatencies, Messages, sizeof(double), CompareDouble);
+        printf(", round trip p50 %.1f us p99 %.1f us max %.1f us", 1e6 * pLatencies[Messages / 2],
+            1e6 * pLatencies[Messages / 100 * 99], 1e6 * pLatencies[Messages - 1]);
+    }
+    else if (Mode == RING_BENCH_RING)
+        printf(", ring full %llu times", (unsigned long long)Bench.Full);
+    printf("\n");
+    if (Bench.Wrong)
+    {
+        fprintf(stderr, "%llu messages were lost, repeated or answered out of order\n", (unsigned long long)Bench.Wrong);
+        Result = 1;
+    }
+
+    while (Bench.pHead)
+    {
+        QUEUE_BENCH_ENTRY *pEntry = Bench.pHead;
+        Bench.pHead = pEntry->pNext;
+        free(pEntry);
+    }
+    BenchEventDestroy(&Bench.RequestEvent);
+    BenchEventDestroy(&Bench.ResponseEvent);
+    pthread_mutex_destroy(&Bench.GlobalLock);
+    pthread_mutex_destroy(&Bench.ContextLock);
+    pthread_cond_destroy(&Bench.Queued);
+    pthread_cond_destroy(&Bench.Answered);
+    free(pRequestHeader);
+    free(pResponseHeader);
+    free(pLatencies);
+    return Result;
+}
+
+static int RingBench(LONG Messages, LONG RingKilobytes)
+{
+    ULONG32 RingSize = (ULONG32)RingKilobytes * 1024;
+    double Queue = 0, Ring = 0;
+    int Result = 0;
+
+    if (Messages < 100 || RingSize < PARSER_RING_MIN_SIZE || RingSize > PARSER_RING_MAX_SIZE || (RingSize & (RingSize - 1)))
+    {
+        fprintf(stderr, "Can not set up the benchmark\n");
+        return 1;
+    }
+    printf("%ld messages, %ld KiB rings, one producer and one service thread\n", (long)Messages, (long)RingKilobytes);
+    // A user-mode model can not show the cost of the read IRP the old path completes for every message
+    printf("the queue allocates and copies 1024 bytes per message, without the read IRP it costs in the driver\n");
+    Result |= RingBenchRun(RING_BENCH_QUEUE, 0, Messages, RingSize, &Queue);
+    Result |= RingBenchRun(RING_BENCH_RING, 0, Messages, RingSize, &Ring);
+    printf("the ring delivers %.1fx the messages per second\n", Ring / Queue);
+    Result |= RingBenchRun(RING_BENCH_QUEUE, 1, Messages / 10, RingSize, &Queue);
+    Result |= RingBenchRun(RING_BENCH_RING, 1, Messages / 10, RingSize, &Ring);
+    printf("the ring answers %.1fx the requests per second\n", Ring / Queue);
+    return Result;
+}
+
+/* drain-bench: the messages a servicing subscription reads with fixed framing and with packed framing */
+#define DRAIN_BENCH_FIXED       0
+/* Packed reads, a message that completes a pended read fills it alone and passes the queue like DPT_SendMessage used to */
+#define DRAIN_BENCH_SINGLE      1
+#define DRAIN_BENCH_PACKED      2
+#define DRAIN_BENCH_MAX_QUEUED  4096
+
+typedef struct _DRAIN_BENCH_ENTRY {
+    struct _DRAIN_BENCH_ENTRY *pNext;
+    ULONG32 Length;
+    PARSER_MESSAGE Message;
+} DRAIN_BENCH_ENTRY;
+
+typedef struct _DRAIN_BENCH {
+    int Mode;
+    double ReadTime;
+    ULONG32 BufferLength;
+    /* Lock of the subscription context, its queue and its one pended read */
+    pthread_mutex_t Lock;
+    pthread_cond_t Completed;
+    DRAIN_BENCH_ENTRY *pHead;
+    DRAIN_BENCH_ENTRY **ppTail;
+    ULONG32 Queued;
+    UCHAR *pPendedBuffer;
+    ULONG32 PendedBytes;
+    int Pended;
+    /* Messages the service got, and the highest request id among them */
+    UCHAR *pSeen;
+    LONG Highest;
+    ULONG64 Reads;
+    ULONG64 PendedReads;
+    ULONG64 Full;
+    ULONG64 Reordered;
+    ULONG64 Wrong;
+} DRAIN_BENCH;
+
+/** DPT_FrameMessage */
+static ULONG32 DrainBenchFrame(int Mode, const PARSER_MESSAGE *pMessage, ULONG32 MessageLength, UCHAR *pBuffer, ULONG32 BufferLength)
+{
+    PARSER_MESSAGE_FRAME *pFrame = (PARSER_MESSAGE_FRAME *)pBuffer;
+
+    if (DRAIN_BENCH_FIXED == Mode)
+    {
+        memcpy(pBuffer, pMessage, MessageLength);
+        memset(pBuffer + MessageLength, 0, sizeof(PARSER_MESSAGE) - MessageLength);
+        return sizeof(PARSER_MESSAGE);
+    }
+    if (PARSER_MESSAGE_FRAME_SIZE(MessageLength) > BufferLength)
+        return 0;
+    pFrame->Length = MessageLength;
+    pFrame->Reserved = 0;
+    memcpy(pFrame + 1, pMessage, MessageLength);
+    memset((UCHAR *)(pFrame + 1) + MessageLength, 0, PARSER_MESSAGE_FRAME_SIZE(MessageLength) - sizeof(PARSER_MESSAGE_FRAME) - MessageLength);
+    return PARSER_MESSAGE_FRAME_SIZE(MessageLength);
+}
+
+/** Frames the queued messages into the buffer, all that fit with packed framing. Called with the lock held */
+static ULONG32 DrainBenchDrain(DRAIN_BENCH *pBench, UCHAR *pBuffer, ULONG32 Copied)
+{
+    while (pBench->pHead)
+    {
+        DRAIN_BENCH_ENTRY *pEntry = pBench->pHead;
+        ULONG32 Bytes = DrainBenchFrame(pBench->Mode, &pEntry->Message, pEntry->Length, pBuffer + Copied,
+            pBench->BufferLength - Copied);
+        if (!Bytes)
+            break;
+        Copied += Bytes;
+        if (!(pBench->pHead = pEntry->pNext))
+            pBench->ppTail = &pBench->pHead;
+        --pBench->Queued;
+        free(pEntry);
+        if (DRAIN_BENCH_FIXED == pBench->Mode)
+            break;
+    }
+    return Copied;
+}
+
+/** DPT_DeliverMessage to a servicing context without a ring */
+static void DrainBenchPost(DRAIN_BENCH *pBench, LONG RequestId)
+{
+    PARSER_MESSAGE Message;
+    ULONG32 Length = FIELD_OFFSET(PARSER_MESSAGE, Message) + sizeof(Message.Message.QueryCipherConfig);
+    DRAIN_BENCH_ENTRY *pEntry = NULL;
+
+    RingBenchMessage(&Message, RequestId);
+    pthread_mutex_lock(&pBench->Lock);
+    while (!pBench->Pended && pBench->Queued >= DRAIN_BENCH_MAX_QUEUED)
+    {
+        // The driver rejects the request, the bench waits for the service to make room
+        ++pBench->Full;
+        pthread_mutex_unlock(&pBench->Lock);
+        sched_yield();
+        pthread_mutex_lock(&pBench->Lock);
+    }
+    if (pBench->Pended)
+    {
+        // DPT_SendMessage, the older queued messages go first
+        if (DRAIN_BENCH_PACKED == pBench->Mode)
+            pBench->PendedBytes = DrainBenchDrain(pBench, pBench->pPendedBuffer, 0);
+        if (!pBench->pHead || DRAIN_BENCH_PACKED != pBench->Mode)
+            pBench->PendedBytes += DrainBenchFrame(pBench->Mode, &Message, Length, pBench->pPendedBuffer + pBench->PendedBytes,
+                pBench->BufferLength - pBench->PendedBytes);
+        pBench->Pended = 0;
+        pthread_cond_signal(&pBench->Completed);
+        if (pBench->PendedBytes && (!pBench->pHead || DRAIN_BENCH_PACKED != pBench->Mode))
+        {
+            pthread_mutex_unlock(&pBench->Lock);
+            return;
+        }
+    }
+    pthread_mutex_unlock(&pBench->Lock);
+
+    // DPT_EnqueueMessage, it only copies the meaningful bytes of the message
+    pEntry = malloc(sizeof(DRAIN_BENCH_ENTRY));
+    if (!pEntry)
+        abort();
+    pEntry->pNext = NULL;
+    pEntry->Length = Length;
+    memcpy(&pEntry->Message, &Message, Length);
+    pthread_mutex_lock(&pBench->Lock);
+    *pBench->ppTail = pEntry;
+    pBench->ppTail = &pEntry->pNext;
+    ++pBench->Queued;
+    pthread_mutex_unlock(&pBench->Lock);
+}
+
+/** DPT_Read, the time of the read IRP spent before the context lock is taken */
+static ULONG32 DrainBenchRead(DRAIN_BENCH *pBench, UCHAR *pBuffer)
+{
+    double Until = Now() + pBench->ReadTime;
+    ULONG32 Bytes = 0;
+
+    while (Now() < Until);
+    pthread_mutex_lock(&pBench->Lock);
+    ++pBench->Reads;
+    if (pBench->pHead)
+        Bytes = DrainBenchDrain(pBench, pBuffer, 0);
+    else
+    {
+        ++pBench->PendedReads;
+        pBench->pPendedBuffer = pBuffer;
+        pBench->PendedBytes = 0;
+        pBench->Pended = 1;
+        while (pBench->Pended)
+            pthread_cond_wait(&pBench->Completed, &pBench->Lock);
+        Bytes = pBench->PendedBytes;
+    }
+    pthread_mutex_unlock(&pBench->Lock);
+    return Bytes;
+}
+
+/** The service parses the read, every message arrives once. Returns FALSE after the last one */
+static BOOLEAN DrainBenchParse(DRAIN_BENCH *pBench, const UCHAR *pBuffer, ULONG32 Bytes)
+{
+    ULONG32 Offset = 0;
+
+    while (Offset < Bytes)
+    {
+        const PARSER_MESSAGE *pMessage = (const PARSER_MESSAGE *)(pBuffer + Offset);
+        if (DRAIN_BENCH_FIXED == pBench->Mode)
+            Offset += sizeof(PARSER_MESSAGE);
+        else
+        {
+            const PARSER_MESSAGE_FRAME *pFrame = (const PARSER_MESSAGE_FRAME *)(pBuffer + Offset);
+            pMessage = (const PARSER_MESSAGE *)(pFrame + 1);
+            Offset += PARSER_MESSAGE_FRAME_SIZE(pFrame->Length);
+        }
+        if (MessageTypeNone == pMessage->Type)
+            return FALSE;
+        if (pMessage->Message.QueryCipherConfig.DiskId.Data1 != (ULONG32)pMessage->RequestId ||
+            pBench->pSeen[pMessage->RequestId]++)
+            ++pBench->Wrong;
+        if (pMessage->RequestId < pBench->Highest)
+            ++pBench->Reordered;
+        else
+            pBench->Highest = pMessage->RequestId;
+    }
+    return TRUE;
+}
+
+static void *DrainBenchService(void *Context)
+{
+    DRAIN_BENCH *pBench = Context;
+    UCHAR *pBuffer = malloc(pBench->BufferLength);
+
+    if (!pBuffer)
+        abort();
+    while (DrainBenchParse(pBench, pBuffer, DrainBenchRead(pBench, pBuffer)));
+    free(pBuffer);
+    return NULL;
+}
+
+static int DrainBenchRun(int Mode, LONG Messages, LONG ReadUs, ULONG32 BufferLength, double *pRate)
+{
+    static const char *ModeNames[] = { "fixed", "packed, one message per pended read", "packed" };
+    DRAIN_BENCH Bench;
+    pthread_t Service;
+    double Start = 0;
+    LONG i = 0;
+    int Result = 0;
+
+    memset(&Bench, 0, sizeof(Bench));
+    Bench.Mode = Mode;
+    Bench.ReadTime = ReadUs * 1e-6;
+    Bench.BufferLength = Mode == DRAIN_BENCH_FIXED ? sizeof(PARSER_MESSAGE) : BufferLength;
+    Bench.ppTail = &Bench.pHead;
+    if (!(Bench.pSeen = calloc(Messages, 1)))
+    {
+        fprintf(stderr, "Can not set up the benchmark\n");
+        return 1;
+    }
+    pthread_mutex_init(&Bench.Lock, NULL);
+    pthread_cond_init(&Bench.Completed, NULL);
+    pthread_create(&Service, NULL, DrainBenchService, &Bench);
+
+    Start = Now();
+    for (i = 0; i < Messages; ++i)
+        DrainBenchPost(&Bench, i);
+    DrainBenchPost(&Bench, -1);
+    pthread_join(Service, NULL);
+    *pRate = Messages / (Now() - Start);
+
+    for (i = 0; i < Messages; ++i)
+        Bench.Wrong += !Bench.pSeen[i];
+    printf("%-37s %9.0f messages/s, %6.2f messages per read, %4.1f%% of the reads pended, %llu out of order\n",
+        ModeNames[Mode], *pRate, (double)(Messages + 1) / Bench.Reads, 100.0 * Bench.PendedReads / Bench.Reads,
+        (unsigned long long)Bench.Reordered);
+    if (Bench.Wrong)
+    {
+        fprintf(stderr, "%llu messages were lost or repeated\n", (unsigned long long)Bench.Wrong);
+        Result = 1;
+    }
+    // The old completion of pended reads passed the queue, the drain keeps the order
+    if (Bench.Reordered && DRAIN_BENCH_SINGLE != Mode)
+    {
+        fprintf(stderr, "%llu messages were read out of order\n", (unsigned long long)Bench.Reordered);
+        Result = 1;
+    }
+
+    while (Bench.pHead)
+    {
+        DRAIN_BENCH_ENTRY *pEntry = Bench.pHead;
+        Bench.pHead = pEntry->pNext;
+        free(pEntry);
+    }
+    pthread_mutex_destroy(&Bench.Lock);
+    pthread_cond_destroy(&Bench.Completed);
+    free(Bench.pSeen);
+    return Result;
+}
+
+static int DrainBench(LONG Messages, LONG ReadUs, LONG BufferKilobytes)
+{
+    ULONG32 BufferLength = (ULONG32)BufferKilobytes * 1024;
+    double Fixed = 0, Single = 0, Packed = 0;
+    int Result = 0;
+
+    if (Messages < 100 || ReadUs < 0 || BufferLength < PARSER_MESSAGE_FRAME_SIZE(sizeof(PARSER_MESSAGE)) || BufferKilobytes > 16384)
+    {
+        fprintf(stderr, "Can not set up the benchmark\n");
+        return 1;
+    }
+    printf("%ld messages, %ld us per read IRP, %ld KiB read buffer, one producer and one service thread\n",
+        (long)Messages, (long)ReadUs, (long)BufferKilobytes);
+    Result |= DrainBenchRun(DRAIN_BENCH_FIXED, Messages, ReadUs, BufferLength, &Fixed);
+    Result |= DrainBenchRun(DRAIN_BENCH_SINGLE, Messages, ReadUs, BufferLength, &Single);
+    Result |= DrainBenchRun(DRAIN_BENCH_PACKED, Messages, ReadUs, BufferLength, &Packed);
+    printf("packed reads deliver %.1fx the messages per second of fixed reads, %.1fx of one message per pended read\n",
+        Packed / Fixed, Packed / Single);
+    return Result;
+}
+
+/* request-bench: lookup of the responses to thousands of outstanding requests, one locked list against the table */
+#define REQUEST_BENCH_LIST      0
+#define REQUEST_BENCH_TABLE     1
+/* The ticker runs a hundred times faster than the driver, the timeouts never end during the run */
+#define REQUEST_BENCH_TICKS     0xFFFFFFFF
+
+typedef struct _REQUEST_BENCH {
+    int Mode;
+    volatile LONG Counter;
+    /* DptLock and the single list of the old table, or the bucket locks */
+    pthread_mutex_t GlobalLock;
+    REQUEST_LINK List;
+    pthread_mutex_t BucketLocks[REQUEST_TABLE_BUCKETS];
+    REQUEST_LINK Buckets[REQUEST_TABLE_BUCKETS];
+    pthread_mutex_t TimerLock;
+    REQUEST_TIMER_WHEEL Wheel;
+    volatile LONG Stop;
+    ULONG64 Tick;
+    ULONG64 Expired;
+    ULONG64 Wrong;
+} REQUEST_BENCH;
+
+typedef struct _REQUEST_BENCH_THREAD {
+    REQUEST_BENCH *pBench;
+    pthread_t Thread;
+    REQUEST_TABLE_ENTRY *pEntries;
+    LONG Outstanding;
+    LONG Responses;
+    ULONG64 Random;
+    ULONG64 Wrong;
+} REQUEST_BENCH_THREAD;
+
+/** DPT_InsertRequest */
+static void RequestBenchInsert(REQUEST_BENCH *pBench, REQUEST_TABLE_ENTRY *pEntry)
+{
+    RequestTable_InitializeEntry(pEntry, __atomic_add_fetch(&pBench->Counter, 1, __ATOMIC_RELAXED));
+    if (REQUEST_BENCH_LIST == pBench->Mode)
+    {
+        pthread_mutex_lock(&pBench->GlobalLock);
+        RequestLink_InsertTail(&pBench->List, &pEntry->Link);
+        pthread_mutex_unlock(&pBench->GlobalLock);
+        return;
+    }
+    pthread_mutex_lock(&pBench->TimerLock);
+    TimerWheel_Insert(&pBench->Wheel, pEntry, pBench->Tick, REQUEST_BENCH_TICKS);
+    pthread_mutex_unlock(&pBench->TimerLock);
+    pthread_mutex_lock(&pBench->BucketLocks[RequestTable_Bucket(pEntry->RequestId)]);
+    RequestLink_InsertTail(&pBench->Buckets[RequestTable_Bucket(pEntry->RequestId)], &pEntry->Link);
+    pthread_mutex_unlock(&pBench->BucketLocks[RequestTable_Bucket(pEntry->RequestId)]);
+}
+
+/** DPT_CompleteRequest finds the request of the response, DPT_RemoveRequest takes it out once its waiter woke up */
+static BOOLEAN RequestBenchRespond(REQUEST_BENCH *pBench, REQUEST_TABLE_ENTRY *pEntry)
+{
+    REQUEST_TABLE_ENTRY *pFound = NULL;
+
+    if (REQUEST_BENCH_LIST == pBench->Mode)
+    {
+        pthread_mutex_lock(&pBench->GlobalLock);
+        if ((pFound = RequestTable_Find(&pBench->List, pEntry->RequestId)))
+            RequestLink_Remove(&pFound->Link);
+        pthread_mutex_unlock(&pBench->GlobalLock);
+        return pFound == pEntry;
+    }
+    pthread_mutex_lock(&pBench->BucketLocks[RequestTable_Bucket(pEntry->RequestId)]);
+    pFound = RequestTable_Find(&pBench->Buckets[RequestTable_Bucket(pEntry->RequestId)], pEntry->RequestId);
+    pthread_mutex_unlock(&pBench->BucketLocks[RequestTable_Bucket(pEntry->RequestId)]);
+    pthread_mutex_lock(&pBench->TimerLock);
+    TimerWheel_Remove(&pBench->Wheel, pEntry);
+    pthread_mutex_unlock(&pBench->TimerLock);
+    pthread_mutex_lock(&pBench->BucketLocks[RequestTable_Bucket(pEntry->RequestId)]);
+    RequestLink_Remove(&pEntry->Link);
+    pthread_mutex_unlock(&pBench->BucketLocks[RequestTable_Bucket(pEntry->RequestId)]);
+    return pFound == pEntry;
+}
+
+/** A service worker answers the outstanding requests of the thread in random order, each answered one is issued again */
+static void *RequestBenchThread(void *Context)
+{
+    REQUEST_BENCH_THREAD *pThread = Context;
+    LONG i = 0;
+
+    for (i = 0; i < pThread->Responses; ++i)
+    {
+        REQUEST_TABLE_ENTRY *pEntry = &pThread->pEntries[HeatBenchNext(&pThread->Random) % pThread->Outstanding];
+        if (!RequestBenchRespond(pThread->pBench, pEntry))
+            ++pThread->Wrong;
+        RequestBenchInsert(pThread->pBench, pEntry);
+    }
+    return NULL;
+}
+
+/** DPT_TimerDpc, every millisecond instead of every tick so the wheel is looked at more often than in the driver */
+static void *RequestBenchTicker(void *Context)
+{
+    REQUEST_BENCH *pBench = Context;
+    struct timespec Interval = { 0, 1000000 };
+    REQUEST_LINK Expired;
+
+    while (!__atomic_load_n(&pBench->Stop, __ATOMIC_ACQUIRE))
+    {
+        RequestLink_Initialize(&Expired);
+        pthread_mutex_lock(&pBench->TimerLock);
+        TimerWheel_Expire(&pBench->Wheel, ++pBench->Tick, &Expired);
+        while (!RequestLink_IsEmpty(&Expired))
+        {
+            RequestLink_Remove(Expired.pNext);
+            ++pBench->Expired;
+        }
+        pthread_mutex_unlock(&pBench->TimerLock);
+        nanosleep(&Interval, NULL);
+    }
+    return NULL;
+}
+
+static double RequestBenchRun(int Mode, LONG Outstanding, LONG Responses, int Threads)
+{
+    REQUEST_BENCH *pBench = calloc(1, sizeof(REQUEST_BENCH));
+    REQUEST_BENCH_THREAD *pThreads = calloc(Threads, sizeof(REQUEST_BENCH_THREAD));
+    REQUEST_TABLE_ENTRY *pEntries = malloc(Outstanding * sizeof(REQUEST_TABLE_ENTRY));
+    pthread_t Ticker;
+    double Start = 0, Seconds = 0;
+    ULONG64 Wrong = 0;
+    LONG i = 0;
+    int t = 0;
+
+    if (!pBench || !pThreads || !pEntries)
+    {
+        fprintf(stderr, "Can not set up the benchmark\n");
+        exit(1);
+    }
+    pBench->Mode = Mode;
+    pthread_mutex_init(&pBench->GlobalLock, NULL);
+    pthread_mutex_init(&pBench->TimerLock, NULL);
+    RequestLink_Initialize(&pBench->List);
+    for (i = 0; i < REQUEST_TABLE_BUCKETS; ++i)
+    {
+        pthread_mutex_init(&pBench->BucketLocks[i], NULL);
+        RequestLink_Initialize(&pBench->Buckets[i]);
+    }
+    TimerWheel_Initialize(&pBench->Wheel, 0);
+    for (i = 0; i < Outstanding; ++i)
+        RequestBenchInsert(pBench, &pEntries[i]);
+    if (REQUEST_BENCH_TABLE == Mode)
+        pthread_create(&Ticker, NULL, RequestBenchTicker, pBench);
+
+    Start = Now();
+    for (t = 0; t < Threads; ++t)
+    {
+        pThreads[t].pBench = pBench;
+        pThreads[t].pEntries = pEntries + Outstanding / Threads * t;
+        pThreads[t].Outstanding = Outstanding / Threads;
+        pThreads[t].Responses = Responses / Threads;
+        pThreads[t].Random = 0x9E3779B97F4A7C15ULL * (t + 1);
+        pthread_create(&pThreads[t].Thread, NULL, RequestBenchThread, &pThreads[t]);
+    }
+    for (t = 0; t < Threads; ++t)
+    {
+        pthread_join(pThreads[t].Thread, NULL);
+        Wrong += pThreads[t].Wrong;
+    }
+    Seconds = Now() - Start;
+    if (REQUEST_BENCH_TABLE == Mode)
+    {
+        __atomic_store_n(&pBench->Stop, 1, __ATOMIC_RELEASE);
+        pthread_join(Ticker, NULL);
+    }
+
+    printf("%-5s %9.0f responses/s", Mode == REQUEST_BENCH_TABLE ? "table" : "list", Responses / Seconds);
+    if (REQUEST_BENCH_TABLE == Mode)
+        printf(", %u requests in the wheel after %llu ticks, %llu expired", pBench->Wheel.Count,
+            (unsigned long long)pBench->Tick, (unsigned long long)pBench->Expired);
+    printf("\n");
+    if (Wrong || pBench->Expired)
+    {
+        fprintf(stderr, "%llu responses did not find their request\n", (unsigned long long)(Wrong + pBench->Expired));
+        Seconds = 0;
+    }
+
+    for (i = 0; i < REQUEST_TABLE_BUCKETS; ++i)
+        pthread_mutex_destroy(&pBench->BucketLocks[i]);
+    pthread_mutex_destroy(&pBench->GlobalLock);
+    pthread_mutex_destroy(&pBench->TimerLock);
+    free(pEntries);
+    free(pThreads);
+    free(pBench);
+    return Seconds ? Responses / Seconds : 0;
+}
+
+/** Requests expire on the tick their timeout ends, not earlier and not later, also across revolutions and gaps */
+static int RequestCheckWheel()
+{
+    REQUEST_TIMER_WHEEL Wheel;
+    REQUEST_TABLE_ENTRY Entries[1000];
+    REQUEST_LINK Expired;
+    ULONG64 Random = 0x2545F4914F6CDD1DULL, Tick = 0;
+    ULONG32 Wrong = 0, Left = 1000, i = 0;
+
+    TimerWheel_Initialize(&Wheel, 0);
+    for (i = 0; i < 1000; ++i)
+    {
+        RequestTable_InitializeEntry(&Entries[i], (LONG)i);
+        TimerWheel_Insert(&Wheel, &Entries[i], 0, HeatBenchNext(&Random) % (REQUEST_TIMER_SLOTS * 3));
+        // A few answered before they expire
+        if (i % 10 == 0)
+        {
+            TimerWheel_Remove(&Wheel, &Entries[i]);
+            --Left;
+        }
+    }
+    while (Left && Tick < REQUEST_TIMER_SLOTS * 4)
+    {
+        // A gap longer than a revolution now and then, the DPC was late
+        Tick += Tick % 50 == 7 ? REQUEST_TIMER_SLOTS + 5 : 1;
+        RequestLink_Initialize(&Expired);
+        TimerWheel_Expire(&Wheel, Tick, &Expired);
+        while (!RequestLink_IsEmpty(&Expired))
+        {
+            REQUEST_TABLE_ENTRY *pEntry = REQUEST_TABLE_ENTRY_OF(Expired.pNext, TimerLink);
+            RequestLink_Remove(&pEntry->TimerLink);
+            // Late only by the gap the wheel skipped
+            if (pEntry->ExpirationTick > Tick || Tick - pEntry->ExpirationTick > REQUEST_TIMER_SLOTS + 5 || pEntry->RequestId % 10 == 0)
+                ++Wrong;
+            --Left;
+        }
+    }
+    if (Wrong || Left || Wheel.Count)
+    {
+        fprintf(stderr, "Timer wheel: %u requests expired wrong, %u never expired\n", Wrong, Left);
+        return 1;
+    }
+    printf("timer wheel expired 900 requests on time over %llu ticks with gaps\n", (unsigned long long)Tick);
+    return 0;
+}
+
+static int RequestBench(LONG Outstanding, LONG Responses, int Threads)
+{
+    double List = 0, Table = 0;
+
+    if (Outstanding < Threads || Threads <= 0 || Threads > 64 || Responses < Threads)
+    {
+        fprintf(stderr, "Can not set up the benchmark\n");
+        return 1;
+    }
+    if (RequestCheckWheel())
+        return 1;
+    printf("%ld outstanding requests, %ld responses, %d service threads\n", (long)Outstanding, (long)Responses, Threads);
+    // The old table is linear, it answers a tenth of the responses
+    List = RequestBenchRun(REQUEST_BENCH_LIST, Outstanding, Responses / 10 < Threads ? Threads : Responses / 10, Threads);
+    Table = RequestBenchRun(REQUEST_BENCH_TABLE, Outstanding, Responses, Threads);
+    if (!List || !Table)
+        return 1;
+    printf("the table answers %.1fx the responses per second\n", Table / List);
+    return 0;
+}
+
+/* worker-bench: key requests served by a stand-in of several service workers, one of them closes halfway */
+#define WORKER_BENCH_FIRST      0   /* Every request goes to the first servicing worker */
+#define WORKER_BENCH_BALANCED   1
+#define WORKER_BENCH_MAX        64
+#define WORKER_BENCH_REQUESTERS 16
+#define WORKER_BENCH_TIMEOUT_MS 5000
+
+typedef struct _WORKER_BENCH_REQUEST {
+    /* REQUEST_ENTRY, linked in the bucket of its id */
+    REQUEST_TABLE_ENTRY Table;
+    struct _WORKER_BENCH_REQUEST *pNext;
+    struct _WORKER_BENCH_WORKER *pWorker;
+    BOOLEAN Completed;
+    BENCH_EVENT *pEvent;
+} WORKER_BENCH_REQUEST;
+
+typedef struct _WORKER_BENCH_WORKER {
+    struct _WORKER_BENCH *pBench;
+    pthread_t Thread;
+    /* Read queue of the subscription */
+    pthread_mutex_t Lock;
+    pthread_cond_t Queued;
+    WORKER_BENCH_REQUEST *pHead;
+    WORKER_BENCH_REQUEST **ppTail;
+    volatile LONG Closed;
+    volatile LONG Outstanding;
+    ULONG64 LastSelected;
+    ULONG64 Completed;
+    ULONG64 FailedOver;
+} WORKER_BENCH_WORKER;
+
+typedef struct _WORKER_BENCH {
+    int Mode;
+    LONG ServiceUs;
+    int Workers;
+    /* DptLock, the servicing subscriptions */
+    pthread_mutex_t GlobalLock;
+    WORKER_BENCH_WORKER Worker[WORKER_BENCH_MAX];
+    ULONG64 Selections;
+    volatile LONG Counter;
+    pthread_mutex_t BucketLocks[REQUEST_TABLE_BUCKETS];
+    REQUEST_LINK Buckets[REQUEST_TABLE_BUCKETS];
+    LONG Requests;
+    volatile LONG Issued;
+    double *pLatencies;
+    volatile LONG TimedOut;
+    volatile LONG Wrong;
+} WORKER_BENCH;
+
+/** DPT_SelectWorker, the closed workers left the subscription list */
+static WORKER_BENCH_WORKER *WorkerBenchSelect(WORKER_BENCH *pBench)
+{
+    WORKER_BENCH_WORKER *pBest = NULL;
+    int i = 0;
+
+    pthread_mutex_lock(&pBench->GlobalLock);
+    for (i = 0; i < pBench->Workers; ++i)
+    {
+        WORKER_BENCH_WORKER *pWorker = &pBench->Worker[i];
+        if (pWorker->Closed)
+            continue;
+        if (!pBest || (WORKER_BENCH_BALANCED == pBench->Mode && RequestTable_PreferWorker(pWorker->Outstanding,
+            pWorker->LastSelected, pBest->Outstanding, pBest->LastSelected)))
+            pBest = pWorker;
+    }
+    if (pBest)
+        pBest->LastSelected = ++pBench->Selections;
+    pthread_mutex_unlock(&pBench->GlobalLock);
+    return pBest;
+}
+
+/** DPT_AssignRequestNoLock, called with the bucket lock held */
+static void WorkerBenchAssign(WORKER_BENCH_REQUEST *pRequest, WORKER_BENCH_WORKER *pWorker)
+{
+    pRequest->pWorker = pWorker;
+    __atomic_add_fetch(&pWorker->Outstanding, 1, __ATOMIC_RELAXED);
+    pRequest->pNext = NULL;
+    pthread_mutex_lock(&pWorker->Lock);
+    *pWorker->ppTail = pRequest;
+    pWorker->ppTail = &pRequest->pNext;
+    pthread_cond_signal(&pWorker->Queued);
+    pthread_mutex_unlock(&pWorker->Lock);
+}
+
+/** DPT_CompleteRequest */
+static void WorkerBenchComplete(WORKER_BENCH *pBench, WORKER_BENCH_WORKER *pWorker, LONG RequestId)
+{
+    ULONG32 Bucket = RequestTable_Bucket(RequestId);
+    REQUEST_TABLE_ENTRY *pEntry = NULL;
+
+    pthread_mutex_lock(&pBench->BucketLocks[Bucket]);
+    pEntry = RequestTable_Find(&pBench->Buckets[Bucket], RequestId);
+    if (pEntry && !((WORKER_BENCH_REQUEST *)pEntry)->Completed)
+    {
+        WORKER_BENCH_REQUEST *pRequest = (WORKER_BENCH_REQUEST *)pEntry;
+        pRequest->Completed = TRUE;
+        ++pWorker->Completed;
+        BenchEventSet(pRequest->pEvent);
+    }
+    else
+        __atomic_add_fetch(&pBench->Wrong, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&pBench->BucketLocks[Bucket]);
+}
+
+/** A worker of the key service reads the requests and answers them, it abandons the ones it holds when it closes */
+static void *WorkerBenchWorker(void *Context)
+{
+    WORKER_BENCH_WORKER *pWorker = Context;
+    struct timespec Service = { 0, pWorker->pBench->ServiceUs * 1000L };
+
+    for (;;)
+    {
+        WORKER_BENCH_REQUEST *pRequest = NULL;
+        LONG RequestId = 0;
+
+        pthread_mutex_lock(&pWorker->Lock);
+        while (!pWorker->pHead && !pWorker->Closed)
+            pthread_cond_wait(&pWorker->Queued, &pWorker->Lock);
+        if (pWorker->Closed)
+        {
+            pthread_mutex_unlock(&pWorker->Lock);
+            return NULL;
+        }
+        pRequest = pWorker->pHead;
+        if (!(pWorker->pHead = pRequest->pNext))
+            pWorker->ppTail = &pWorker->pHead;
+        RequestId = pRequest->Table.RequestId;
+        pthread_mutex_unlock(&pWorker->Lock);
+
+        if (Service.tv_nsec)
+            nanosleep(&Service, NULL);
+        if (__atomic_load_n(&pWorker->Closed, __ATOMIC_ACQUIRE))
+            return NULL;
+        WorkerBenchComplete(pWorker->pBench, pWorker, RequestId);
+    }
+}
+
+/** DPT_FailOverRequests */
+static void WorkerBenchFailOver(WORKER_BENCH *pBench, WORKER_BENCH_WORKER *pClosed)
+{
+    ULONG32 i = 0;
+
+    for (i = 0; i < REQUEST_TABLE_BUCKETS; ++i)
+    {
+        REQUEST_LINK *pLink = NULL;
+        pthread_mutex_lock(&pBench->BucketLocks[i]);
+        for (pLink = pBench->Buckets[i].pNext; pLink != &pBench->Buckets[i]; pLink = pLink->pNext)
+        {
+            WORKER_BENCH_REQUEST *pRequest = (WORKER_BENCH_REQUEST *)REQUEST_TABLE_ENTRY_OF(pLink, Link);
+            WORKER_BENCH_WORKER *pWorker = NULL;
+            if (pRequest->pWorker != pClosed || pRequest->Completed)
+                continue;
+            __atomic_sub_fetch(&pClosed->Outstanding, 1, __ATOMIC_RELAXED);
+            pRequest->pWorker = NULL;
+            if ((pWorker = WorkerBenchSelect(pBench)))
+            {
+                WorkerBenchAssign(pRequest, pWorker);
+                ++pClosed->FailedOver;
+            }
+            else
+                BenchEventSet(pRequest->pEvent);
+        }
+        pthread_mutex_unlock(&pBench->BucketLocks[i]);
+    }
+}
+
+/** DPT_SynchronouseRequest, a thread of the parser mounting disks one request after the other */
+static void *WorkerBenchRequester(void *Context)
+{
+    WORKER_BENCH *pBench = Context;
+    WORKER_BENCH_REQUEST Request;
+    BENCH_EVENT Event;
+    LONG Index = 0;
+
+    BenchEventInitialize(&Event);
+    while ((Index = __atomic_fetch_add(&pBench->Issued, 1, __ATOMIC_RELAXED)) < pBench->Requests)
+    {
+        WORKER_BENCH_WORKER *pWorker = WorkerBenchSelect(pBench);
+        double Start = Now();
+        struct timespec Deadline;
+        ULONG32 Bucket = 0;
+        int Answered = 0;
+
+        if (!pWorker)
+            abort();
+        memset(&Request, 0, sizeof(Request));
+        RequestTable_InitializeEntry(&Request.Table, __atomic_add_fetch(&pBench->Counter, 1, __ATOMIC_RELAXED));
+        Request.pEvent = &Event;
+        Bucket = RequestTable_Bucket(Request.Table.RequestId);
+        pthread_mutex_lock(&pBench->BucketLocks[Bucket]);
+        RequestLink_InsertTail(&pBench->Buckets[Bucket], &Request.Table.Link);
+        WorkerBenchAssign(&Request, pWorker);
+        pthread_mutex_unlock(&pBench->BucketLocks[Bucket]);
+
+        // The timeout of the request, signalled by the timer wheel in the driver
+        clock_gettime(CLOCK_REALTIME, &Deadline);
+        Deadline.tv_sec += WORKER_BENCH_TIMEOUT_MS / 1000;
+        pthread_mutex_lock(&Event.Lock);
+        while (!Event.Signaled && !pthread_cond_timedwait(&Event.Cond, &Event.Lock, &Deadline));
+        Event.Signaled = 0;
+        pthread_mutex_unlock(&Event.Lock);
+
+        // DPT_RemoveRequest
+        pthread_mutex_lock(&pBench->BucketLocks[Bucket]);
+        RequestLink_Remove(&Request.Table.Link);
+        Answered = Request.Completed;
+        if (Request.pWorker)
+            __atomic_sub_fetch(&Request.pWorker->Outstanding, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&pBench->BucketLocks[Bucket]);
+        if (!Answered)
+            __atomic_add_fetch(&pBench->TimedOut, 1, __ATOMIC_RELAXED);
+        pBench->pLatencies[Index] = Now() - Start;
+    }
+    BenchEventDestroy(&Event);
+    return NULL;
+}
+
+static int WorkerBenchRun(int Mode, LONG Requests, int Workers, LONG ServiceUs, double *pRate)
+{
+    WORKER_BENCH *pBench = calloc(1, sizeof(WORKER_BENCH));
+    pthread_t Requesters[WORKER_BENCH_REQUESTERS];
+    double Start = 0, Seconds = 0;
+    int i = 0, Result = 0;
+
+    if (!pBench || !(pBench->pLatencies = malloc(Requests * sizeof(double))))
+    {
+        fprintf(stderr, "Can not set up the benchmark\n");
+        exit(1);
+    }
+    pBench->Mode = Mode;
+    pBench->ServiceUs = ServiceUs;
+    pBench->Workers = Workers;
+    pBench->Requests = Requests;
+    pthread_mutex_init(&pBench->GlobalLock, NULL);
+    for (i = 0; i < REQUEST_TABLE_BUCKETS; ++i)
+    {
+        pthread_mutex_init(&pBench->BucketLocks[i], NULL);
+        RequestLink_Initialize(&pBench->Buckets[i]);
+    }
+    for (i = 0; i < Workers; ++i)
+    {
+        WORKER_BENCH_WORKER *pWorker = &pBench->Worker[i];
+        pWorker->pBench = pBench;
+        pWorker->ppTail = &pWorker->pHead;
+        pthread_mutex_init(&pWorker->Lock, NULL);
+        pthread_cond_init(&pWorker->Queued, NULL);
+        pthread_create(&pWorker->Thread, NULL, WorkerBenchWorker, pWorker);
+    }
+
+    Start = Now();
+    for (i = 0; i < WORKER_BENCH_REQUESTERS; ++i)
+        pthread_create(&Requesters[i], NULL, WorkerBenchRequester, pBench);
+    // The first worker closes with requests pending once half of them were issued
+    while (__atomic_load_n(&pBench->Issued, __ATOMIC_RELAXED) < Requests / 2)
+        sched_yield();
+    pthread_mutex_lock(&pBench->GlobalLock);
+    pthread_mutex_lock(&pBench->Worker[0].Lock);
+    __atomic_store_n(&pBench->Worker[0].Closed, 1, __ATOMIC_RELEASE);
+    pthread_cond_signal(&pBench->Worker[0].Queued);
+    pthread_mutex_unlock(&pBench->Worker[0].Lock);
+    pthread_mutex_unlock(&pBench->GlobalLock);
+    pthread_join(pBench->Worker[0].Thread, NULL);
+    WorkerBenchFailOver(pBench, &pBench->Worker[0]);
+    for (i = 0; i < WORKER_BENCH_REQUESTERS; ++i)
+        pthread_join(Requesters[i], NULL);
+    Seconds = Now() - Start;
+    *pRate = Requests / Seconds;
+
+    qsort(pBench->pLatencies, Requests, sizeof(double), CompareDouble);
+    printf("%-8s %8.0f requests/s, p50 %6.0f us p99 %6.0f us, %llu failed over, answered by",
+        Mode == WORKER_BENCH_BALANCED ? "balanced" : "first", *pRate, 1e6 * pBench->pLatencies[Requests / 2],
+        1e6 * pBench->pLatencies[Requests / 100 * 99], (unsigned long long)pBench->Worker[0].FailedOver);
+    for (i = 0; i < Workers; ++i)
+        printf(" %llu", (unsigned long long)pBench->Worker[i].Completed);
+    printf("\n");
+    if (pBench->TimedOut || pBench->Wrong)
+    {
+        fprintf(stderr, "%ld requests were not answered, %ld responses found no request\n", (long)pBench->TimedOut, (long)pBench->Wrong);
+        Result = 1;
+    }
+
+    for (i = 1; i < Workers; ++i)
+    {
+        WORKER_BENCH_WORKER *pWorker = &pBench->Worker[i];
+        pthread_mutex_lock(&pWorker->Lock);
+        pWorker->Closed = 1;
+        pthread_cond_signal(&pWorker->Queued);
+        pthread_mutex_unlock(&pWorker->Lock);
+        pthread_join(pWorker->Thread, NULL);
+    }
+    for (i = 0; i < Workers; ++i)
+    {
+        pthread_mutex_destroy(&pBench->Worker[i].Lock);
+        pthread_cond_destroy(&pBench->Worker[i].Queued);
+    }
+    for (i = 0; i < REQUEST_TABLE_BUCKETS; ++i)
+        pthread_mutex_destroy(&pBench->BucketLocks[i]);
+    pthread_mutex_destroy(&pBench->GlobalLock);
+    free(pBench->pLatencies);
+    free(pBench);
+    return Result;
+}
+
+static int WorkerBench(LONG Requests, int Workers, LONG ServiceUs)
+{
+    double First = 0, Balanced = 0;
+    int Result = 0;
+
+    if (Requests < 100 || Workers < 2 || Workers > WORKER_BENCH_MAX || ServiceUs < 0 || ServiceUs >= 1000000)
+    {
+        fprintf(stderr, "Can not set up the benchmark\n");
+        return 1;
+    }
+    printf("%ld requests from %d threads, %d workers, %ld us per request, the first worker closes halfway\n",
+        (long)Requests, WORKER_BENCH_REQUESTERS, Workers, (long)ServiceUs);
+    Result |= WorkerBenchRun(WORKER_BENCH_FIRST, Requests, Workers, ServiceUs, &First);
+    Result |= WorkerBenchRun(WORKER_BENCH_BALANCED, Requests, Workers, ServiceUs, &Balanced);
+    printf("balancing answers %.1fx the requests per second\n", Balanced / First);
+    return Result;
+}
+
+/* queue-stress: producers overflow a subscription queue, every message must be delivered or discarded exactly once */
+#define QUEUE_STRESS_PRODUCERS  4
+#define QUEUE_STRESS_DISKS      8
+#define QUEUE_STRESS_REQUEST    1
+#define QUEUE_STRESS_EVENT      2   /* Two event types */
+#define QUEUE_STRESS_DELIVERED  1
+#define QUEUE_STRESS_DISCARDED  2
+
+typedef struct _QUEUE_STRESS_MESSAGE {
+    LONG Id;
+    int Producer;
+    LONG Sequence;
+} QUEUE_STRESS_MESSAGE;
+
+typedef struct _QUEUE_STRESS {
+    ULONG32 Policy;
+    LONG Messages;
+    /* The lock of the subscription context */
+    pthread_mutex_t Lock;
+    MESSAGE_QUEUE Queue;
+    volatile ULONG32 MaxCount;
+    SUBSCRIPTION_STATISTICS Statistics;
+    /* Fates of the messages by id, written under the lock */
+    UCHAR *pDelivered;
+    UCHAR *pDiscarded;
+    volatile LONG Producing;
+    ULONG64 Trimmed;
+    ULONG64 RequestsDiscarded;
+    ULONG64 Reordered;
+} QUEUE_STRESS;
+
+typedef struct _QUEUE_STRESS_PRODUCER {
+    QUEUE_STRESS *pStress;
+    pthread_t Thread;
+    int Index;
+    ULONG64 Random;
+} QUEUE_STRESS_PRODUCER;
+
+/** Called with the lock held for an entry the queue handed back */
+static void QueueStressDiscard(QUEUE_STRESS *pStress, MESSAGE_QUEUE_ENTRY *pEntry, BOOLEAN Rejected)
+{
+    QUEUE_STRESS_MESSAGE *pMessage = pEntry->pData;
+
+    // Requests only come back rejected, they are never dropped or coalesced
+    if (pEntry->Request && !Rejected)
+        ++pStress->RequestsDiscarded;
+    ++pStress->pDiscarded[pMessage->Id];
+}
+
+static void *QueueStressProducer(void *Context)
+{
+    QUEUE_STRESS_PRODUCER *pProducer = Context;
+    QUEUE_STRESS *pStress = pProducer->pStress;
+    LONG Count = pStress->Messages / QUEUE_STRESS_PRODUCERS, i = 0;
+
+    for (i = 0; i < Count; ++i)
+    {
+        MESSAGE_QUEUE_ENTRY *pEntry = calloc(1, sizeof(MESSAGE_QUEUE_ENTRY));
+        QUEUE_STRESS_MESSAGE *pMessage = malloc(sizeof(QUEUE_STRESS_MESSAGE));
+        MESSAGE_QUEUE_ENTRY *pFree = NULL;
+        ULONG64 Random = HeatBenchNext(&pProducer->Random);
+        BOOLEAN Queued = FALSE;
+
+        if (!pEntry || !pMessage)
+            abort();
+        pMessage->Id = pProducer->Index * Count + i;
+        pMessage->Producer = pProducer->Index;
+        pMessage->Sequence = i;
+        pEntry->pData = pMessage;
+        pEntry->Request = Random % 10 == 0;
+        pEntry->Type = pEntry->Request ? QUEUE_STRESS_REQUEST : QUEUE_STRESS_EVENT + (ULONG32)(Random >> 8) % 2;
+        pEntry->DiskId.Data1 = (ULONG32)(Random >> 16) % QUEUE_STRESS_DISKS;
+
+        pthread_mutex_lock(&pStress->Lock);
+        Queued = MessageQueue_Push(&pStress->Queue, pEntry, pStress->MaxCount, pStress->Policy, &pStress->Statistics, &pFree);
+        if (pFree)
+            QueueStressDiscard(pStress, pFree, !Queued && pFree == pEntry);
+        pthread_mutex_unlock(&pStress->Lock);
+
+        if (pFree)
+        {
+            free(pFree->pData);
+            free(pFree);
+        }
+        // Leave the reader a chance, a producer does more than queueing between two messages
+        if (i % 16 == 15)
+            sched_yield();
+    }
+    __atomic_sub_fetch(&pStress->Producing, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/** DPT_SetSubscriptionOptions lowers and raises the limit while the producers run */
+static void *QueueStressResizer(void *Context)
+{
+    QUEUE_STRESS *pStress = Context;
+    struct timespec Interval = { 0, 200000 };
+    ULONG32 Limits[] = { 64, 8, 256, 1, 32 };
+    int Round = 0;
+
+    while (__atomic_load_n(&pStress->Producing, __ATOMIC_ACQUIRE))
+    {
+        MESSAGE_QUEUE_ENTRY *pEntry = NULL;
+        pthread_mutex_lock(&pStress->Lock);
+        pStress->MaxCount = Limits[Round++ % 5];
+        while (NULL != (pEntry = MessageQueue_Trim(&pStress->Queue, pStress->MaxCount, &pStress->Statistics)))
+        {
+            QueueStressDiscard(pStress, pEntry, FALSE);
+            ++pStress->Trimmed;
+            free(pEntry->pData);
+            free(pEntry);
+        }
+        pthread_mutex_unlock(&pStress->Lock);
+        nanosleep(&Interval, NULL);
+    }
+    return NULL;
+}
+
+static int QueueStressRun(ULONG32 Policy, LONG Messages)
+{
+    QUEUE_STRESS Stress;
+    QUEUE_STRESS_PRODUCER Producers[QUEUE_STRESS_PRODUCERS];
+    LONG LastSequence[QUEUE_STRESS_PRODUCERS];
+    pthread_t Resizer;
+    ULONG64 Delivered = 0, Discarded = 0, Lost = 0, Repeated = 0, Accounted = 0;
+    double Start = 0;
+    LONG i = 0;
+    int Result = 0;
+
+    memset(&Stress, 0, sizeof(Stress));
+    Stress.Policy = Policy;
+    Stress.Messages = Messages / QUEUE_STRESS_PRODUCERS * QUEUE_STRESS_PRODUCERS;
+    Stress.MaxCount = 64;
+    Stress.Producing = QUEUE_STRESS_PRODUCERS;
+    Stress.pDelivered = calloc(Stress.Messages, 1);
+    Stress.pDiscarded = calloc(Stress.Messages, 1);
+    if (!Stress.pDelivered || !Stress.pDiscarded)
+    {
+        fprintf(stderr, "Can not set up the benchmark\n");
+        return 1;
+    }
+    pthread_mutex_init(&Stress.Lock, NULL);
+    MessageQueue_Initialize(&Stress.Queue);
+    for (i = 0; i < QUEUE_STRESS_PRODUCERS; ++i)
+        LastSequence[i] = -1;
+
+    Start = Now();
+    pthread_create(&Resizer, NULL, QueueStressResizer, &Stress);
+    for (i = 0; i < QUEUE_STRESS_PRODUCERS; ++i)
+    {
+        Producers[i].pStress = &Stress;
+        Producers[i].Index = (int)i;
+        Producers[i].Random = 0x9E3779B97F4A7C15ULL * (i + 1) + Policy;
+        pthread_create(&Producers[i].Thread, NULL, QueueStressProducer, &Producers[i]);
+    }
+    // The reader of the subscription, it also empties the queue once the producers are done
+    for (;;)
+    {
+        MESSAGE_QUEUE_ENTRY *pEntry = NULL;
+        QUEUE_STRESS_MESSAGE *pMessage = NULL;
+        BOOLEAN Done = !__atomic_load_n(&Stress.Producing, __ATOMIC_ACQUIRE);
+
+        pthread_mutex_lock(&Stress.Lock);
+        if (NULL != (pEntry = MessageQueue_First(&Stress.Queue)))
+        {
+            MessageQueue_Remove(&Stress.Queue, pEntry);
+            ++Stress.Statistics.Delivered;
+            pMessage = pEntry->pData;
+            ++Stress.pDelivered[pMessage->Id];
+        }
+        pthread_mutex_unlock(&Stress.Lock);
+        if (!pEntry)
+        {
+            if (Done)
+                break;
+            sched_yield();
+            continue;
+        }
+        // Coalescing moves newer events to older positions, dropping only removes messages
+        if (Policy == OverflowPolicyDropOldest && pMessage->Sequence <= LastSequence[pMessage->Producer])
+            ++Stress.Reordered;
+        LastSequence[pMessage->Producer] = pMessage->Sequence;
+        free(pMessage);
+        free(pEntry);
+    }
+    for (i = 0; i < QUEUE_STRESS_PRODUCERS; ++i)
+        pthread_join(Producers[i].Thread, NULL);
+    pthread_join(Resizer, NULL);
+
+    for (i = 0; i < Stress.Messages; ++i)
+    {
+        Delivered += Stress.pDelivered[i];
+        Discarded += Stress.pDiscarded[i];
+        Lost += Stress.pDelivered[i] + Stress.pDiscarded[i] == 0;
+        Repeated += Stress.pDelivered[i] + Stress.pDiscarded[i] > 1;
+    }
+    Accounted = Stress.Statistics.Dropped + Stress.Statistics.Coalesced + Stress.Statistics.Rejected;
+    printf("%-11s %8.0f messages/s, %llu delivered, %llu dropped (%llu by a lower limit), %llu coalesced, "
+        "%llu requests rejected, high water %u\n", Policy == OverflowPolicyCoalesce ? "coalesce" : "drop oldest",
+        Stress.Messages / (Now() - Start), (unsigned long long)Delivered, (unsigned long long)Stress.Statistics.Dropped,
+        (unsigned long long)Stress.Trimmed, (unsigned long long)Stress.Statistics.Coalesced,
+        (unsigned long long)Stress.Statistics.Rejected, Stress.Statistics.HighWater);
+    if (Lost || Repeated || Stress.RequestsDiscarded || Stress.Reordered || Discarded != Accounted ||
+        Delivered != (ULONG64)Stress.Statistics.Delivered || Stress.Queue.Count)
+    {
+        fprintf(stderr, "%llu messages lost, %llu repeated, %llu requests dropped, %llu out of order, "
+            "%llu discarded against %llu counted\n", (unsigned long long)Lost, (unsigned long long)Repeated,
+            (unsigned long long)Stress.RequestsDiscarded, (unsigned long long)Stress.Reordered,
+            (unsigned long long)Discarded, (unsigned long long)Accounted);
+        Result = 1;
+    }
+
+    pthread_mutex_destroy(&Stress.Lock);
+    free(Stress.pDelivered);
+    free(Stress.pDiscarded);
+    return Result;
+}
+
+static int QueueStress(LONG Messages)
+{
+    int Result = 0;
+
+    if (Messages < QUEUE_STRESS_PRODUCERS * 100)
+    {
+        fprintf(stderr, "Can not set up the benchmark\n");
+        return 1;
+    }
+    printf("%ld messages from %d producers, a tenth of them requests, the queue limit changes every 200 us\n",
+        (long)Messages, QUEUE_STRESS_PRODUCERS);
+    Result |= QueueStressRun(OverflowPolicyDropOldest, Messages);
+    Result |= QueueStressRun(OverflowPolicyCoalesce, Messages);
+    if (!Result)
+        printf("every message was delivered or discarded exactly once\n");
+    return Result;
+}
+
+/*
+ * batch-bench: imports a manifest of Disks disks into a stand-in of the cipher options table of cipher.c, once
+ * with an IOCTL per disk like SetCipherOpts, once in batches of MANIFEST_DEFAULT_BATCH like SetCipherOptsBatch.
+ * Every IOCTL costs IoctlUs of busy time, a mount thread looks disks up meanwhile like CipherEngineGet.
+ */
+#define BATCH_BENCH_BUCKETS 1024
+
+typedef struct _BATCH_BENCH_NODE {
+    struct _BATCH_BENCH_NODE *pNext;
+    EVHD_SET_CIPHER_CONFIG_REQUEST Config;
+} BATCH_BENCH_NODE;
+
+typedef struct _BATCH_BENCH {
+    pthread_mutex_t Lock;
+    BATCH_BENCH_NODE *pTable[BATCH_BENCH_BUCKETS];
+    LONG IoctlUs;
+    BOOLEAN Batched;
+    ULONG64 Ioctls;
+    ULONG64 Acquisitions;
+    /* Disks of the manifest, the mount thread looks them up until the import is done */
+    const GUID *pDiskIds;
+    LONG Disks;
+    volatile LONG Importing;
+    ULONG64 Lookups;
+} BATCH_BENCH;
+
+static BATCH_BENCH_NODE **BatchBenchBucket(BATCH_BENCH *pBench, const GUID *pDiskId)
+{
+    return &pBench->pTable[(pDiskId->Data1 ^ pDiskId->Data4[7]) & (BATCH_BENCH_BUCKETS - 1)];
+}
+
+/** Called with the lock held */
+static BATCH_BENCH_NODE *BatchBenchFind(BATCH_BENCH *pBench, const GUID *pDiskId)
+{
+    BATCH_BENCH_NODE *pNode = NULL;
+    for (pNode = *BatchBenchBucket(pBench, pDiskId); pNode; pNode = pNode->pNext)
+    {
+        if (!memcmp(&pNode->Config.DiskId, pDiskId, sizeof(GUID)))
+            return pNode;
+    }
+    return NULL;
+}
+
+/** CipherOptsStore, called with the lock held */
+static void BatchBenchStore(BATCH_BENCH *pBench, const EVHD_SET_CIPHER_CONFIG_REQUEST *pConfig, BATCH_BENCH_NODE **ppSpareNode)
+{
+    BATCH_BENCH_NODE *pNode = BatchBenchFind(pBench, &pConfig->DiskId);
+    if (!pNode)
+    {
+        BATCH_BENCH_NODE **ppBucket = BatchBenchBucket(pBench, &pConfig->DiskId);
+        pNode = *ppSpareNode;
+        *ppSpareNode = NULL;
+        pNode->pNext = *ppBucket;
+        *ppBucket = pNode;
+    }
+    memcpy(&pNode->Config, pConfig, sizeof(EVHD_SET_CIPHER_CONFIG_REQUEST));
+}
+
+static void BatchBenchIoctl(BATCH_BENCH *pBench)
+{
+    double End = Now() + pBench->IoctlUs / 1e6;
+    ++pBench->Ioctls;
+    while (Now() < End)
+        ;
+}
+
+/** ManifestSubmit_t of the import, the per-disk run submits batches of one */
+static int BatchBenchSubmit(void *pContext, EVHD_SET_CIPHER_BATCH_REQUEST *pBatch, unsigned long Size)
+{
+    BATCH_BENCH *pBench = pContext;
+    BATCH_BENCH_NODE **ppSpareNodes = NULL;
+    ULONG32 i = 0;
+
+    if (Size != EVHD_SET_CIPHER_BATCH_SIZE(pBatch->Count))
+        return EINVAL;
+    if (!pBench->Batched)
+    {
+        // SetCipherOpts, an IOCTL, an allocation and a lock acquisition per disk
+        BATCH_BENCH_NODE *pSpareNode = NULL;
+        BatchBenchIoctl(pBench);
+        if (!(pSpareNode = malloc(sizeof(BATCH_BENCH_NODE))))
+            return ENOMEM;
+        pthread_mutex_lock(&pBench->Lock);
+        ++pBench->Acquisitions;
+        BatchBenchStore(pBench, &pBatch->Configs[0], &pSpareNode);
+        pthread_mutex_unlock(&pBench->Lock);
+        free(pSpareNode);
+        return 0;
+    }
+
+    // SetCipherOptsBatch, every node is allocated before the single lock acquisition
+    BatchBenchIoctl(pBench);
+    if (!(ppSpareNodes = calloc(pBatch->Count, sizeof(BATCH_BENCH_NODE *))))
+        return ENOMEM;
+    for (i = 0; i < pBatch->Count; ++i)
+    {
+        if (!(ppSpareNodes[i] = malloc(sizeof(BATCH_BENCH_NODE))))
+            break;
+    }
+    if (i == pBatch->Count)
+    {
+        pthread_mutex_lock(&pBench->Lock);
+        ++pBench->Acquisitions;
+        for (i = 0; i < pBatch->Count; ++i)
+            BatchBenchStore(pBench, &pBatch->Configs[i], &ppSpareNodes[i]);
+        pthread_mutex_unlock(&pBench->Lock);
+        i = pBatch->Count;
+    }
+    for (; i > 0; --i)
+        free(ppSpareNodes[i - 1]);
+    free(ppSpareNodes);
+    return 0;
+}
+
+static void *BatchBenchMount(void *Context)
+{
+    BATCH_BENCH *pBench = Context;
+    ULONG64 Random = 0x2545F4914F6CDD1DULL;
+
+    while (__atomic_load_n(&pBench->Importing, __ATOMIC_ACQUIRE))
+    {
+        pthread_mutex_lock(&pBench->Lock);
+        BatchBenchFind(pBench, &pBench->pDiskIds[HeatBenchNext(&Random) % pBench->Disks]);
+        ++pBench->Lookups;
+        pthread_mutex_unlock(&pBench->Lock);
+    }
+    return NULL;
+}
+
+static void BatchBenchDisk(ULONG64 Seed, LONG Index, EVHD_SET_CIPHER_CONFIG_REQUEST *pConfig)
+{
+    ULONG64 Random = Seed ^ (0x9E3779B97F4A7C15ULL * (Index + 1));
+    size_t i = 0;
+
+    memset(pConfig, 0, sizeof(EVHD_SET_CIPHER_CONFIG_REQUEST));
+    for (i = 0; i < sizeof(GUID); ++i)
+        ((UCHAR *)&pConfig->DiskId)[i] = (UCHAR)HeatBenchNext(&Random);
+    pConfig->Algorithm = (ECipherAlgo)(Index % 4);
+    if (pConfig->Algorithm == ECipherAlgo_Disabled)
+        return;
+    for (i = 0; i < sizeof(pConfig->Opts.Xts256); ++i)
+        ((UCHAR *)&pConfig->Opts.Xts256)[i] = (UCHAR)HeatBenchNext(&Random);
+}
+
+static void BatchBenchPrintHex(FILE *pFile, const UCHAR *pBytes, size_t Count)
+{
+    size_t i = 0;
+    for (i = 0; i < Count; ++i)
+        fprintf(pFile, "%02x", pBytes[i]);
+}
+
+static int BatchBenchRun(BOOLEAN Batched, FILE *pManifest, const GUID *pDiskIds, LONG Disks, LONG IoctlUs, ULONG64 Seed, double *pRate)
+{
+    BATCH_BENCH *pBench = calloc(1, sizeof(BATCH_BENCH));
+    pthread_t Mount;
+    ULONG32 Count = 0;
+    LONG i = 0, Wrong = 0;
+    double Start = 0, Elapsed = 0;
+    int Result = 0;
+
+    if (!pBench)
+    {
+        fprintf(stderr, "Can not set up the benchmark\n");
+        return 1;
+    }
+    pthread_mutex_init(&pBench->Lock, NULL);
+    pBench->IoctlUs = IoctlUs;
+    pBench->Batched = Batched;
+    pBench->pDiskIds = pDiskIds;
+    pBench->Disks = Disks;
+    pBench->Importing = 1;
+
+    rewind(pManifest);
+    pthread_create(&Mount, NULL, BatchBenchMount, pBench);
+    Start = Now();
+    Result = Manifest_Import(pManifest, Batched ? MANIFEST_DEFAULT_BATCH : 1, BatchBenchSubmit, pBench, &Count);
+    Elapsed = Now() - Start;
+    __atomic_store_n(&pBench->Importing, 0, __ATOMIC_RELEASE);
+    pthread_join(Mount, NULL);
+
+    // Every disk of the manifest is in the table with its own options
+    for (i = 0; i < Disks && !Result; ++i)
+    {
+        EVHD_SET_CIPHER_CONFIG_REQUEST Expected;
+        BATCH_BENCH_NODE *pNode = NULL;
+
+        BatchBenchDisk(Seed, i, &Expected);
+        pNode = BatchBenchFind(pBench, &Expected.DiskId);
+        if (!pNode || pNode->Config.Algorithm != Expected.Algorithm ||
+            memcmp(&pNode->Config.Opts, &Expected.Opts, sizeof(Expected.Opts)))
+            ++Wrong;
+    }
+
+    *pRate = Count / Elapsed;
+    printf("%-8s %6lu disks %8.0f disks/s %6llu IOCTLs %6llu lock acquisitions %9llu lookups meanwhile\n",
+        Batched ? "batched" : "per-disk", (unsigned long)Count, *pRate, (unsigned long long)pBench->Ioctls,
+        (unsigned long long)pBench->Acquisitions, (unsigned long long)pBench->Lookups);
+    if (Result)
+        fprintf(stderr, "%s: the import failed with %d\n", Batched ? "batched" : "per-disk", Result);
+    else if (Count != (ULONG32)Disks || Wrong)
+    {
+        fprintf(stderr, "%s: %lu of %ld disks imported, %ld of them missing or wrong\n",
+            Batched ? "batched" : "per-disk", (unsigned long)Count, (long)Disks, (long)Wrong);
+        Result = 1;
+    }
+
+    for (i = 0; i < BATCH_BENCH_BUCKETS; ++i)
+    {
+        while (pBench->pTable[i])
+        {
+            BATCH_BENCH_NODE *pNode = pBench->pTable[i];
+            pBench->pTable[i] = pNode->pNext;
+            free(pNode);
+        }
+    }
+    pthread_mutex_destroy(&pBench->Lock);
+    free(pBench);
+    return Result;
+}
+
+static int BatchBench(LONG Disks, LONG IoctlUs)
+{
+    static const char *Algorithms[] = { "disabled", "aes-xts", "twofish-xts", "serpent-xts" };
+    const ULONG64 Seed = 0x5DEECE66DULL;
+    FILE *pManifest = tmpfile();
+    GUID *pDiskIds = calloc(Disks > 0 ? Disks : 1, sizeof(GUID));
+    double PerDisk = 0, Batched = 0;
+    LONG i = 0;
+    int Result = 0;
+
+    if (!pManifest || !pDiskIds || Disks <= 0)
+    {
+        fprintf(stderr, "Can not set up the benchmark\n");
+        if (pManifest)
+            fclose(pManifest);
+        free(pDiskIds);
+        return 1;
+    }
+    fprintf(pManifest, "# %ld disks, a quarter of them disabled\n", (long)Disks);
+    for (i = 0; i < Disks; ++i)
+    {
+        EVHD_SET_CIPHER_CONFIG_REQUEST Config;
+        const GUID *pId = &Config.DiskId;
+
+        BatchBenchDisk(Seed, i, &Config);
+        pDiskIds[i] = Config.DiskId;
+        fprintf(pManifest, "{%08X-%04X-%04X-%02X%02X-%02X%02X%02X%02X%02X%02X} %s", pId->Data1, pId->Data2, pId->Data3,
+            pId->Data4[0], pId->Data4[1], pId->Data4[2], pId->Data4[3], pId->Data4[4], pId->Data4[5], pId->Data4[6],
+            pId->Data4[7], Algorithms[Config.Algorithm]);
+        if (Config.Algorithm != ECipherAlgo_Disabled)
+        {
+            fputc(' ', pManifest);
+            BatchBenchPrintHex(pManifest, Config.Opts.Xts256.CryptoKey, sizeof(Config.Opts.Xts256.CryptoKey));
+            fputc(' ', pManifest);
+            BatchBenchPrintHex(pManifest, Config.Opts.Xts256.TweakKey, sizeof(Config.Opts.Xts256.TweakKey));
+        }
+        fputc('\n', pManifest);
+    }
+
+    printf("%ld disks, %ld us per IOCTL, batches of %d\n", (long)Disks, (long)IoctlUs, MANIFEST_DEFAULT_BATCH);
+    Result |= BatchBenchRun(FALSE, pManifest, pDiskIds, Disks, IoctlUs, Seed, &PerDisk);
+    Result |= BatchBenchRun(TRUE, pManifest, pDiskIds, Disks, IoctlUs, Seed, &Batched);
+    if (!Result)
+        printf("batched import is %.1fx faster, every disk was stored with its options\n", Batched / PerDisk);
+    fclose(pManifest);
+    free(pDiskIds);
+    return Result;
+}
+
+#endif
+
+static void PrintUsage()
+{
+    printf("Usage: evhdtool catalog-build <source> <catalog>\n");
+    printf("       evhdtool catalog-dump <catalog>\n");
+    printf("       evhdtool catalog-bench <catalog> [entries]\n");
+    printf("       evhdtool trace-decode <trace>\n");
+    printf("       evhdtool flight-decode <snapshot>\n");
+    printf("       evhdtool heat-render <snapshot> [rows]\n");
+    printf("       evhdtool heat-compare <older snapshot> <newer snapshot> [rows]\n");
+#if !defined(_WIN32)
+    printf("       evhdtool log-bench <file> [producers] [lines per producer]\n");
+    printf("       evhdtool trace-bench <file> [events]\n");
+    printf("       evhdtool tracepoint-bench <file> [requests]\n");
+    printf("       evhdtool flight-bench <snapshot> [events per thread] [threads]\n");
+    printf("       evhdtool stats-bench [requests per thread] [threads]\n");
+    printf("       evhdtool stage-bench [requests per thread] [threads]\n");
+    printf("       evhdtool inflight-bench [requests per thread] [threads]\n");
+    printf("       evhdtool heat-bench <snapshot> [requests per thread] [threads]\n");
+    printf("       evhdtool execute-bench [requests per thread] [threads]\n");
+    printf("       evhdtool diskinfo-bench [queries] [us per vhdmp request]\n");
+    printf("       evhdtool irp-bench [requests per thread] [threads] [us per vhdmp request]\n");
+    printf("       evhdtool scsi-cache-bench [boots] [us per vhdmp request]\n");
+    printf("       evhdtool read-cache-bench [cache MiB] [requests] [trace]\n");
+    printf("       evhdtool parent-cache-bench [clones] [cache MiB]\n");
+    printf("       evhdtool read-ahead-bench [window KiB] [us per request]\n");
+    printf("       evhdtool ring-bench [messages] [ring KiB]\n");
+    printf("       evhdtool drain-bench [messages] [us per read] [buffer KiB]\n");
+    printf("       evhdtool request-bench [outstanding requests] [responses] [threads]\n");
+    printf("       evhdtool worker-bench [requests] [workers] [us per request]\n");
+    printf("       evhdtool queue-stress [messages]\n");
+    printf("       evhdtool batch-bench [disks] [us per IOCTL]\n");
+#endif
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc == 4 && !strcmp(argv[1], "catalog-build"))
+        return CatalogBuild(argv[2], argv[3]);
+    if (argc == 3 && !strcmp(argv[1], "catalog-dump"))
+        return CatalogDump(argv[2]);
+    if ((argc == 3 || argc == 4) && !strcmp(argv[1], "catalog-bench"))
+        return CatalogBench(argv[2], argc == 4 ? (ULONG32)strtoul(argv[3], NULL, 10) : 100000);
+    if (argc == 3 && !strcmp(argv[1], "trace-decode"))
+        return TraceDecode(argv[2]);
+    if (argc == 3 && !strcmp(argv[1], "flight-decode"))
+        return FlightDecode(argv[2]);
+    if ((argc == 3 || argc == 4) && !strcmp(argv[1], "heat-render"))
+        return HeatRender(argv[2], argc == 4 ? (ULONG32)strtoul(argv[3], NULL, 10) : 32);
+    if ((argc == 4 || argc == 5) && !strcmp(argv[1], "heat-compare"))
+        return HeatCompare(argv[2], argv[3], argc == 5 ? (ULONG32)strtoul(argv[4], NULL, 10) : 32);
+
+#if !defined(_WIN32)
+    if (argc >= 3 && argc <= 5 && !strcmp(argv[1], "log-bench"))
+        return LogBench(argv[2], argc >= 4 ? atoi(argv[3]) : 32, argc == 5 ? atol(argv[4]) : 100000);
+    if ((argc == 3 || argc == 4) && !strcmp(argv[1], "trace-bench"))
+        return TraceBench(argv[2], argc == 4 ? atol(argv[3]) : 1000000);
+    if ((argc == 3 || argc == 4) && !strcmp(argv[1], "tracepoint-bench"))
+        return TracepointBench(argv[2], argc == 4 ? atol(argv[3]) : 2000000);
+    if (argc >= 3 && argc <= 5 && !strcmp(argv[1], "flight-bench"))
+        return FlightBench(argv[2], argc >= 4 ? atol(argv[3]) : 10000000, argc == 5 ? atoi(argv[4]) : 4);
+    if (argc <= 4 && argc >= 2 && !strcmp(argv[1], "stats-bench"))
+        return StatsBench(argc >= 3 ? atol(argv[2]) : 20000000, argc == 4 ? atoi(argv[3]) : 4);
+    if (argc <= 4 && argc >= 2 && !strcmp(argv[1], "stage-bench"))
+        return StageBench(argc >= 3 ? atol(argv[2]) : 10000000, argc == 4 ? atoi(argv[3]) : 4);
+    if (argc <= 4 && argc >= 2 && !strcmp(argv[1], "inflight-bench"))
+        return InflightBench(argc >= 3 ? atol(argv[2]) : 10000000, argc == 4 ? atoi(argv[3]) : 4);
+    if (argc >= 3 && argc <= 5 && !strcmp(argv[1], "heat-bench"))
+        return HeatBench(argv[2], argc >= 4 ? atol(argv[3]) : 5000000, argc == 5 ? atoi(argv[4]) : 4);
+    if (argc <= 4 && argc >= 2 && !strcmp(argv[1], "execute-bench"))
+        return ExecuteBench(argc >= 3 ? atol(argv[2]) : 10000000, argc == 4 ? atoi(argv[3]) : 4);
+    if (argc <= 4 && argc >= 2 && !strcmp(argv[1], "diskinfo-bench"))
+        return DiskInfoBench(argc >= 3 ? atol(argv[2]) : 2000, argc == 4 ? atol(argv[3]) : 10);
+    if (argc <= 5 && argc >= 2 && !strcmp(argv[1], "irp-bench"))
+        return IrpBench(argc >= 3 ? atol(argv[2]) : 20000, argc >= 4 ? atoi(argv[3]) : 4, argc == 5 ? atol(argv[4]) : 10);
+    if (argc <= 4 && argc >= 2 && !strcmp(argv[1], "scsi-cache-bench"))
+        return ScsiCacheBench(argc >= 3 ? atol(argv[2]) : 2000, argc == 4 ? atol(argv[3]) : 20);
+    if (argc <= 5 && argc >= 2 && !strcmp(argv[1], "read-cache-bench"))
+        return ReadCacheBench(argc == 5 ? argv[4] : NULL, argc >= 3 ? atol(argv[2]) : 64, argc >= 4 ? atol(argv[3]) : 4000000);
+    if (argc <= 4 && argc >= 2 && !strcmp(argv[1], "parent-cache-bench"))
+        return ParentCacheBench(argc >= 3 ? atol(argv[2]) : 200, argc == 4 ? atol(argv[3]) : 256);
+    if (argc <= 4 && argc >= 2 && !strcmp(argv[1], "read-ahead-bench"))
+        return ReadAheadBench(argc >= 3 ? atol(argv[2]) : 1024, argc == 4 ? atol(argv[3]) : 200);
+    if (argc <= 4 && argc >= 2 && !strcmp(argv[1], "ring-bench"))
+        return RingBench(argc >= 3 ? atol(argv[2]) : 1000000, argc == 4 ? atol(argv[3]) : 64);
+    if (argc <= 5 && argc >= 2 && !strcmp(argv[1], "drain-bench"))
+        return DrainBench(argc >= 3 ? atol(argv[2]) : 1000000, argc >= 4 ? atol(argv[3]) : 5, argc == 5 ? atol(argv[4]) : 64);
+    if (argc <= 5 && argc >= 2 && !strcmp(argv[1], "request-bench"))
+        return RequestBench(argc >= 3 ? atol(argv[2]) : 10000, argc >= 4 ? atol(argv[3]) : 2000000, argc == 5 ? atoi(argv[4]) : 4);
+    if (argc <= 5 && argc >= 2 && !strcmp(argv[1], "worker-bench"))
+        return WorkerBench(argc >= 3 ? atol(argv[2]) : 40000, argc >= 4 ? atoi(argv[3]) : 4, argc == 5 ? atol(argv[4]) : 50);
+    if ((argc == 2 || argc == 3) && !strcmp(argv[1], "queue-stress"))
+        return QueueStress(argc == 3 ? atol(argv[2]) : 4000000);
+    if (argc >= 2 && argc <= 4 && !strcmp(argv[1], "batch-bench"))
+        return BatchBench(argc >= 3 ? atol(argv[2]) : 4000, argc == 4 ? atol(argv[3]) : 20);
+#endif
+
+    PrintUsage();
+    return 1;
+}